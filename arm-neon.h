@@ -117,6 +117,33 @@ void aligned_block_fill_stm8_armv4(int64_t * __restrict dst,
                                    int64_t * __restrict src,
                                    int                  size);
 
+/* Prefetching 'prefetch' bytes ahead, 1, 2 or 4 cache lines per iteration */
+void aligned_block_read_pfn1_neon(int64_t * __restrict dst,
+                                  int64_t * __restrict src,
+                                  int                  size,
+                                  int                  prefetch);
+void aligned_block_read_pfn2_neon(int64_t * __restrict dst,
+                                  int64_t * __restrict src,
+                                  int                  size,
+                                  int                  prefetch);
+void aligned_block_read_pfn4_neon(int64_t * __restrict dst,
+                                  int64_t * __restrict src,
+                                  int                  size,
+                                  int                  prefetch);
+
+void aligned_block_copy_pfn1_neon(int64_t * __restrict dst,
+                                  int64_t * __restrict src,
+                                  int                  size,
+                                  int                  prefetch);
+void aligned_block_copy_pfn2_neon(int64_t * __restrict dst,
+                                  int64_t * __restrict src,
+                                  int                  size,
+                                  int                  prefetch);
+void aligned_block_copy_pfn4_neon(int64_t * __restrict dst,
+                                  int64_t * __restrict src,
+                                  int                  size,
+                                  int                  prefetch);
+
 #ifdef __cplusplus
 }
 #endif
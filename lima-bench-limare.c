@@ -0,0 +1,450 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Microbenchmarks of the cpu side of limare: frame setup, plb stream
+ * generation, texture swizzling and mipmapping, draw recording, symbol
+ * lookup and uniform upload. Everything runs on a null state, see
+ * limare_init_null, so no gpu gets involved and this runs anywhere.
+ *
+ *   lima-bench-limare [-t seconds] [filter]
+ *
+ * Each benchmark runs for at least -t seconds, 0.25 by default, and only
+ * those with filter in their name run when it is given.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <GLES2/gl2.h>
+
+#include "limare.h"
+#include "formats.h"
+#include "plb.h"
+#include "cube_mesh.h"
+
+#include "shader_v.h"
+#include "shader_f.h"
+
+/* what limare_frame_new starts a frame out with */
+#define BENCH_FRAME_SIZE 0x200000
+#define BENCH_TEXTURE_SIZE 256
+/* draws recorded per frame in the draw benchmarks */
+#define BENCH_DRAWS 256
+
+struct bench {
+	const char *name;
+	/* runs count iterations, returns the bytes processed or -1 */
+	long long (*run)(struct limare_state *state, int count);
+};
+
+static double bench_seconds = 0.25;
+
+static int bench_program;
+static int bench_mvp;
+static int bench_vertices;
+static int bench_coords;
+static int bench_indices;
+
+static double
+bench_time(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec / 1000000000.0;
+}
+
+static long long
+bench_frame_create(struct limare_state *state, int count)
+{
+	int i;
+
+	/* the first frame slot is still free, no frame_new ran before */
+	for (i = 0; i < count; i++) {
+		struct limare_frame *frame =
+			limare_frame_create(state, 0, BENCH_FRAME_SIZE);
+
+		if (!frame)
+			return -1;
+		limare_frame_destroy(frame);
+	}
+
+	return 0;
+}
+
+static long long
+bench_frame_new(struct limare_state *state, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (limare_frame_new(state) || limare_frame_flush(state))
+			return -1;
+
+	return 0;
+}
+
+static long long
+bench_plb(struct limare_state *state, int count)
+{
+	int i;
+
+	/* with the state holding none, each create generates it afresh */
+	plb_info_destroy(state->plb);
+
+	for (i = 0; i < count; i++) {
+		struct plb_info *plb = plb_info_create(state);
+
+		if (!plb)
+			return -1;
+		plb_info_destroy(plb);
+	}
+
+	state->plb = plb_info_create(state);
+	if (!state->plb)
+		return -1;
+
+	return (long long) count * (state->plb->plbu_size +
+				    16 * state->plb->pp_size[0]);
+}
+
+static long long
+bench_texture(struct limare_state *state, int count, int format, int bpp,
+	      int mipmap)
+{
+	int size = BENCH_TEXTURE_SIZE * BENCH_TEXTURE_SIZE * bpp / 8;
+	unsigned char *pixels = malloc(size);
+	int i;
+
+	if (!pixels)
+		return -1;
+
+	for (i = 0; i < size; i++)
+		pixels[i] = i * 7;
+
+	for (i = 0; i < count; i++) {
+		int texture = limare_texture_upload(state, pixels,
+						    BENCH_TEXTURE_SIZE,
+						    BENCH_TEXTURE_SIZE,
+						    format, mipmap);
+
+		if (texture < 0) {
+			free(pixels);
+			return -1;
+		}
+		limare_texture_free(state, texture);
+	}
+
+	free(pixels);
+
+	return (long long) count * size;
+}
+
+static long long
+bench_texture_rgba(struct limare_state *state, int count)
+{
+	return bench_texture(state, count, LIMA_TEXEL_FORMAT_RGBA_8888, 32, 0);
+}
+
+static long long
+bench_texture_rgb(struct limare_state *state, int count)
+{
+	return bench_texture(state, count, LIMA_TEXEL_FORMAT_RGB_888, 24, 0);
+}
+
+static long long
+bench_texture_565(struct limare_state *state, int count)
+{
+	return bench_texture(state, count, LIMA_TEXEL_FORMAT_BGR_565, 16, 0);
+}
+
+static long long
+bench_texture_etc1(struct limare_state *state, int count)
+{
+	return bench_texture(state, count, LIMA_TEXEL_FORMAT_ETC1_RGB8, 4, 0);
+}
+
+static long long
+bench_mipmap_rgba(struct limare_state *state, int count)
+{
+	return bench_texture(state, count, LIMA_TEXEL_FORMAT_RGBA_8888, 32, 1);
+}
+
+static long long
+bench_mipmap_rgb(struct limare_state *state, int count)
+{
+	return bench_texture(state, count, LIMA_TEXEL_FORMAT_RGB_888, 24, 1);
+}
+
+static long long
+bench_mipmap_565(struct limare_state *state, int count)
+{
+	return bench_texture(state, count, LIMA_TEXEL_FORMAT_BGR_565, 16, 1);
+}
+
+/* count draws, BENCH_DRAWS to a frame, the frame setup included */
+static long long
+bench_draw(struct limare_state *state, int count, int buffers)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		int ret;
+
+		if (!(i % BENCH_DRAWS) && limare_frame_new(state))
+			return -1;
+
+		if (buffers)
+			ret = limare_draw_elements_buffer(state,
+							  bench_indices);
+		else
+			ret = limare_draw_elements(state, GL_TRIANGLES,
+						   CUBE_INDEX_COUNT,
+						   &cube_indices,
+						   GL_UNSIGNED_BYTE);
+		if (ret)
+			return -1;
+
+		if ((((i + 1) % BENCH_DRAWS) == 0) || ((i + 1) == count))
+			if (limare_frame_flush(state))
+				return -1;
+	}
+
+	return 0;
+}
+
+static long long
+bench_draw_buffers(struct limare_state *state, int count)
+{
+	limare_attribute_buffer_attach(state, "in_position", bench_vertices);
+	limare_attribute_buffer_attach(state, "in_coord", bench_coords);
+
+	return bench_draw(state, count, 1);
+}
+
+static long long
+bench_draw_pointers(struct limare_state *state, int count)
+{
+	limare_attribute_pointer(state, "in_position", LIMARE_ATTRIB_FLOAT,
+				 3, 0, CUBE_VERTEX_COUNT, cube_vertices);
+	limare_attribute_pointer(state, "in_coord", LIMARE_ATTRIB_FLOAT,
+				 2, 0, CUBE_VERTEX_COUNT,
+				 cube_texture_coordinates);
+
+	return bench_draw(state, count, 0);
+}
+
+static long long
+bench_symbol_lookup(struct limare_state *state, int count)
+{
+	static const char *names[] = {
+		"modelviewprojectionMatrix", "in_texture", "in_position",
+		"in_coord", "no_such_symbol",
+	};
+	int i;
+
+	/* the last one misses, which has to go through all of the symbols */
+	for (i = 0; i < count; i++)
+		limare_uniform_location(state, names[i % 5]);
+
+	return 0;
+}
+
+static long long
+bench_uniform(struct limare_state *state, int count)
+{
+	float matrix[16];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		matrix[i] = i * 0.25;
+
+	for (i = 0; i < count; i++) {
+		matrix[0] = i;
+		if (limare_uniform_attach_location(state, bench_mvp, 16,
+						   matrix))
+			return -1;
+	}
+
+	return (long long) count * sizeof(matrix);
+}
+
+static struct bench benches[] = {
+	{ "frame create/destroy", bench_frame_create },
+	{ "frame new/flush", bench_frame_new },
+	{ "plb streams", bench_plb },
+	{ "texture rgba8888", bench_texture_rgba },
+	{ "texture rgb888", bench_texture_rgb },
+	{ "texture bgr565", bench_texture_565 },
+	{ "texture etc1", bench_texture_etc1 },
+	{ "mipmap rgba8888", bench_mipmap_rgba },
+	{ "mipmap rgb888", bench_mipmap_rgb },
+	{ "mipmap bgr565", bench_mipmap_565 },
+	{ "draw buffers", bench_draw_buffers },
+	{ "draw pointers", bench_draw_pointers },
+	{ "symbol lookup", bench_symbol_lookup },
+	{ "uniform upload", bench_uniform },
+	{ NULL },
+};
+
+static int
+bench_setup(struct limare_state *state)
+{
+	static const float identity[16] = {
+		1.0, 0.0, 0.0, 0.0,
+		0.0, 1.0, 0.0, 0.0,
+		0.0, 0.0, 1.0, 0.0,
+		0.0, 0.0, 0.0, 1.0,
+	};
+	uint32_t pixels[16 * 16];
+	int texture;
+
+	if (limare_state_setup(state, 0, 0, 0xFF505050))
+		return -1;
+
+	bench_program = limare_program_new(state);
+	if (bench_program < 0)
+		return -1;
+
+	vertex_shader_attach_mbs_stream(state, bench_program,
+					vertex_shader_binary,
+					sizeof(vertex_shader_binary));
+	fragment_shader_attach_mbs_stream(state, bench_program,
+					  fragment_shader_binary,
+					  sizeof(fragment_shader_binary));
+	if (limare_link(state))
+		return -1;
+
+	bench_mvp = limare_uniform_location(state,
+					    "modelviewprojectionMatrix");
+	if (bench_mvp < 0)
+		return -1;
+	limare_uniform_attach_location(state, bench_mvp, 16,
+				       (float *) identity);
+
+	memset(pixels, 0x80, sizeof(pixels));
+	texture = limare_texture_upload(state, pixels, 16, 16,
+					LIMA_TEXEL_FORMAT_RGBA_8888, 0);
+	if (texture < 0)
+		return -1;
+	limare_texture_attach(state, "in_texture", texture);
+
+	bench_vertices =
+		limare_attribute_buffer_upload(state, LIMARE_ATTRIB_FLOAT, 3,
+					       0, CUBE_VERTEX_COUNT,
+					       cube_vertices);
+	bench_coords =
+		limare_attribute_buffer_upload(state, LIMARE_ATTRIB_FLOAT, 2,
+					       0, CUBE_VERTEX_COUNT,
+					       cube_texture_coordinates);
+	bench_indices =
+		limare_elements_buffer_upload(state, GL_TRIANGLES,
+					      GL_UNSIGNED_BYTE,
+					      CUBE_INDEX_COUNT, cube_indices);
+	if ((bench_vertices < 0) || (bench_coords < 0) || (bench_indices < 0))
+		return -1;
+
+	return 0;
+}
+
+/* double the count until a run takes long enough to be timed */
+static int
+bench_run(struct limare_state *state, struct bench *bench)
+{
+	double start, time;
+	long long bytes;
+	int count = 1;
+
+	for (;;) {
+		start = bench_time();
+		bytes = bench->run(state, count);
+		time = bench_time() - start;
+
+		if (bytes < 0) {
+			printf("%-24s failed\n", bench->name);
+			return -1;
+		}
+
+		if ((time >= bench_seconds) || (count >= (1 << 28)))
+			break;
+		count *= 2;
+	}
+
+	if (bytes)
+		printf("%-24s %12.1f ns/op %10.1f MB/s\n", bench->name,
+		       time * 1e9 / count, bytes / time / 1e6);
+	else
+		printf("%-24s %12.1f ns/op\n", bench->name,
+		       time * 1e9 / count);
+
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct limare_state *state;
+	const char *filter = NULL;
+	struct bench *bench;
+	int c, ret = 0;
+
+	while ((c = getopt(argc, argv, "t:")) != -1) {
+		switch (c) {
+		case 't':
+			bench_seconds = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-t seconds] [filter]\n",
+				argv[0]);
+			return -1;
+		}
+	}
+	if (optind < argc)
+		filter = argv[optind];
+
+	/* a Mali-400 with 2 pp cores, as on the A10 and A20 */
+	state = limare_init_null(400, 2);
+	if (!state)
+		return -1;
+
+	if (bench_setup(state))
+		return -1;
+
+	for (bench = benches; bench->name; bench++) {
+		if (filter && !strstr(bench->name, filter))
+			continue;
+
+		if (bench_run(state, bench))
+			ret = -1;
+	}
+
+	limare_finish(state);
+
+	return ret;
+}
@@ -21,6 +21,9 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+/* for the cpu affinity of the --scaling threads */
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -30,128 +33,2312 @@
 #include <assert.h>
 #include <math.h>
 #include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+#ifdef __GLIBC__
+#include <gnu/libc-version.h>
+#endif
+
+#include "limare.h"
+#include "formats.h"
+
+#include "lima-memspeed.h"
+#include "memspeed_gpu.h"
+#include "memspeed_fb.h"
+#include "memspeed_dram.h"
+#include "memspeed_baseline.h"
+#include "memspeed_stats.h"
+#include "memspeed_telemetry.h"
+#include "memspeed_workloads.h"
+#include "memspeed_dvfs.h"
+#include "metrics_http.h"
+#include "status_shm.h"
+
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(a)  (sizeof((a)) / sizeof((a)[0]))
+#endif
+
+/******************************************************************************/
+
+/* The working set range and the time spent per size in the sweep mode */
+#define SWEEP_MIN_SIZE (4 * 1024)
+#define SWEEP_MAX_SIZE (256 * 1024 * 1024)
+#define SWEEP_TIME     0.25
+
+/* The time spent per workload in the --all-cpu mode */
+#define ALL_CPU_TIME   2.0
+
+/*
+ * The standard matrix of --baseline and --compare: those of the workloads
+ * which the cpu has, on a working set in the L2 cache and on one of
+ * --buffer-size in the dram, BASELINE_SAMPLES times each.
+ */
+static const char *baseline_workloads[] = {
+	"neon_read_pf64", "neon_copy_pf64", "neon_write", "vfp_copy",
+	"armv5te_copy_incr", "armv4_write_stm4",
+};
+#define BASELINE_L2_SIZE     (128 * 1024)
+#define BASELINE_SAMPLES     8
+#define BASELINE_SAMPLE_TIME 0.5
+
+/* The working set sizes and the time per workload and size of --libc */
+#define LIBC_L1_SIZE (16 * 1024)
+#define LIBC_TIME    0.5
+
+/*
+ * The prefetch distances and the unrolls which --autotune goes through,
+ * on a --buffer-size working set, for this long each
+ */
+static const int autotune_prefetch[] = {
+	0, 64, 128, 192, 256, 320, 384, 448, 512, 640, 768, 1024, 1536, 2048,
+};
+static const int autotune_unroll[] = { 1, 2, 4 };
+#define AUTOTUNE_TIME 0.5
+
+/* The time per pair of cpus and coherency workload of --coherency */
+#define COHERENCY_TIME 0.5
+
+/*
+ * The time per copy kernel and per autotune setting of --probe, and the
+ * buffer size of its profile: the smallest power of two from the minimum
+ * up which is this many times the largest cache
+ */
+#define PROBE_TIME            0.2
+#define PROBE_MIN_BUFFER_SIZE (4 * 1024 * 1024)
+#define PROBE_CACHE_FACTOR    8
+
+/* The settle time and the measurement time of every --scaling step */
+#define SCALING_SETTLE 0.5
+#define SCALING_TIME   2.0
+
+/*
+ * The settle time and the measurement time of every --energy row, and
+ * how often the power gets sampled meanwhile
+ */
+#define ENERGY_SETTLE          1.0
+#define ENERGY_TIME            5.0
+#define ENERGY_SAMPLE_INTERVAL 0.1
+
+/* The settle time and the measurement time of every --dvfs-sweep step */
+#define DVFS_SWEEP_SETTLE 0.5
+#define DVFS_SWEEP_TIME   2.0
+
+/* The settle time and the measurement time of every --rate-sweep step */
+#define RATE_SWEEP_SETTLE 1
+#define RATE_SWEEP_TIME   4
+
+/* How long the workloads get to start up before the sampling goes ahead */
+#define WARMUP_TIMEOUT 10
+
+/*
+ * With --json, one JSON object per line goes to stdout for every
+ * measurement, and the usual text output goes to stderr.
+ */
+static FILE *json;
+
+/* The workloads of the combined mode and their MB/s in the last sample */
+static workload_t *metrics_workloads;
+static int metrics_count;
+static double *metrics_mb_per_s;
+static int metrics_samples;
+
+static void memspeed_metrics(FILE *f, void *data)
+{
+	int i;
+
+	fprintf(f, "# HELP memspeed_bytes_total Bytes moved by the "
+		"workloads\n# TYPE memspeed_bytes_total counter\n");
+	for (i = 0; i < metrics_count; i++)
+		fprintf(f, "memspeed_bytes_total{workload=\"%s\"} %llu\n",
+			metrics_workloads[i].name, (unsigned long long)
+			workload_get_bytes(&metrics_workloads[i]));
+	fprintf(f, "# HELP memspeed_mb_per_s Bandwidth of the workloads "
+		"in the last sample\n# TYPE memspeed_mb_per_s gauge\n");
+	for (i = 0; i < metrics_count; i++)
+		fprintf(f, "memspeed_mb_per_s{workload=\"%s\"} %.1f\n",
+			metrics_workloads[i].name, metrics_mb_per_s[i]);
+}
+
+/* The samples and the bytes of all the workloads, for the status segment */
+static void memspeed_status(status_t *status, void *data)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < metrics_count; i++)
+		status->bytes += workload_get_bytes(&metrics_workloads[i]);
+	for (i = 0; i < metrics_count && len < sizeof(status->state); i++)
+		len += snprintf(status->state + len, sizeof(status->state) - len,
+				"%s%s", i ? "," : "", metrics_workloads[i].name);
+	status->progress = metrics_samples;
+}
+
+static double
+json_time(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_REALTIME, &t);
+	return t.tv_sec + 0.000000001 * t.tv_nsec;
+}
+
+static void
+json_start(const char *mode, workload_t *workloads, int number_of_workloads)
+{
+	int i;
+
+	if (!json)
+		return;
+	fprintf(json, "{\"type\": \"start\", \"time\": %.3f, "
+		"\"mode\": \"%s\", \"buffer_size\": %zu, \"workloads\": [",
+		json_time(), mode, workload_buffer_size);
+	for (i = 0; i < number_of_workloads; i++)
+		fprintf(json, "%s\"%s\"", i ? ", " : "", workloads[i].name);
+	fprintf(json, "]}\n");
+	fflush(json);
+}
+
+static void
+json_bandwidth(const char *type, const char *name, size_t size, double bw)
+{
+	if (!json)
+		return;
+	fprintf(json, "{\"type\": \"%s\", \"time\": %.3f, "
+		"\"workload\": \"%s\", \"size\": %zu, \"mb_per_s\": %.1f}\n",
+		type, json_time(), name, size, bw);
+	fflush(json);
+}
+
+/* The latency of the given fraction of the batches, from the histogram */
+static double latency_percentile(const latency_stats_t *stats,
+				 uint64_t batches, double fraction)
+{
+	uint64_t count = 0;
+	int i;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		count += stats->buckets[i];
+		if (count >= batches * fraction)
+			break;
+	}
+	return (i + 1) * LATENCY_BUCKET;
+}
+
+/* How busy the gpu really was, next to the bandwidth it got. */
+static void print_gpu_job_stats(workload_t *w)
+{
+	struct limare_state *state = __atomic_load_n(&w->extra_data,
+						     __ATOMIC_ACQUIRE);
+	struct limare_job_stats stats;
+	unsigned long long heap = 0;
+	unsigned int heap_jobs = 0, heap_max = 0;
+	int i;
+
+	if (!state || limare_job_stats_get(state, &stats, 0))
+		return;
+	limare_job_stats_print(w->name, &stats);
+	if (!limare_job_heap_bytes(state, &heap, &heap_jobs, &heap_max))
+		printf("    tile heap: %.1f KB per frame, %.1f KB at most\n",
+		       heap / (heap_jobs * 1024.0), heap_max / 1024.0);
+	if (json) {
+		static const char *names[LIMARE_JOB_STAT_COUNT] = {
+			"gp", "pp", "queue", "flip", "pp_idle",
+			"frame_wait", "frame_new", "draws", "flush",
+		};
+
+		fprintf(json, "{\"type\": \"gpu_jobs\", \"time\": %.3f, "
+			"\"workload\": \"%s\", \"seconds\": %.3f",
+			json_time(), w->name, stats.time);
+		for (i = 0; i < LIMARE_JOB_STAT_COUNT; i++) {
+			struct limare_job_histogram *h = &stats.histograms[i];
+
+			fprintf(json, ", \"%s\": {\"count\": %u, "
+				"\"average_ms\": %.3f, \"p99_ms\": %.3f, "
+				"\"max_ms\": %.3f}", names[i], h->count,
+				h->count ? h->total / (h->count * 1000.0) : 0.0,
+				limare_job_histogram_percentile(h, 0.99) /
+				1000.0, h->max / 1000.0);
+		}
+		if (heap_jobs)
+			fprintf(json, ", \"heap_bytes_per_frame\": %.0f, "
+				"\"heap_bytes_max\": %u",
+				(double) heap / heap_jobs, heap_max);
+		fprintf(json, "}\n");
+		fflush(json);
+	}
+}
+
+/*
+ * Each blended layer reads and writes every pixel of the tile buffer once,
+ * 4 bytes each way.
+ */
+static void print_gpu_blend_stats(workload_t *w)
+{
+	struct limare_state *state = __atomic_load_n(&w->extra_data,
+						     __ATOMIC_ACQUIRE);
+	struct limare_job_stats stats;
+	double pixels, fill;
+	int width, height;
+
+	if (!state || limare_job_stats_get(state, &stats, 0) || !stats.time)
+		return;
+	limare_buffer_size(state, &width, &height);
+	pixels = (double) width * height * gpu_blend_layers;
+	fill = pixels * stats.histograms[LIMARE_JOB_STAT_PP].count / stats.time;
+	printf("%s: %d layers of %dx%d, %.1f Mpixel/s fill rate, "
+	       "%.1f MB/s tile buffer traffic\n", w->name, gpu_blend_layers,
+	       width, height, fill / 1000000, fill * 8 / 1000000);
+	if (json) {
+		fprintf(json, "{\"type\": \"gpu_blend\", \"time\": %.3f, "
+			"\"layers\": %d, \"width\": %d, \"height\": %d, "
+			"\"mpixel_per_s\": %.1f, \"tile_mb_per_s\": %.1f}\n",
+			json_time(), gpu_blend_layers, width, height,
+			fill / 1000000, fill * 8 / 1000000);
+		fflush(json);
+	}
+}
+
+/*
+ * Every pixel samples one texel, the dram reads are what the cells of
+ * each frame would have to fetch without any help from the cache.
+ */
+static void print_gpu_scatter_stats(workload_t *w)
+{
+	struct limare_state *state = __atomic_load_n(&w->extra_data,
+						     __ATOMIC_ACQUIRE);
+	struct limare_job_stats stats;
+	double frames, texels;
+	int width, height;
+
+	if (!state || limare_job_stats_get(state, &stats, 0) || !stats.time)
+		return;
+	limare_buffer_size(state, &width, &height);
+	frames = stats.histograms[LIMARE_JOB_STAT_PP].count / stats.time;
+	texels = (double) width * height * frames;
+	printf("%s: %.1f Mtexel/s, %.1f MB/s of texture reads estimated, "
+	       "%.2f bytes per texel\n", w->name, texels / 1000000,
+	       gpu_scatter_frame_bytes * frames / 1000000,
+	       (double) gpu_scatter_frame_bytes / (width * height));
+	if (json) {
+		fprintf(json, "{\"type\": \"gpu_scatter\", \"time\": %.3f, "
+			"\"mtexel_per_s\": %.1f, \"texture_mb_per_s\": %.1f}\n",
+			json_time(), texels / 1000000,
+			gpu_scatter_frame_bytes * frames / 1000000);
+		fflush(json);
+	}
+}
+
+/* Every gp job shades the whole grid once. */
+static void print_gpu_vertex_stats(workload_t *w)
+{
+	struct limare_state *state = __atomic_load_n(&w->extra_data,
+						     __ATOMIC_ACQUIRE);
+	struct limare_job_stats stats;
+	unsigned long long heap = 0;
+	unsigned int heap_jobs = 0;
+	double vertices;
+
+	if (!state || limare_job_stats_get(state, &stats, 0) || !stats.time)
+		return;
+	vertices = (double) GPU_VERTEX_COUNT *
+		stats.histograms[LIMARE_JOB_STAT_GP].count / stats.time;
+	limare_job_heap_bytes(state, &heap, &heap_jobs, NULL);
+	printf("%s: %.2f Mvertices/s, %.1f KB of polygon lists in the tile "
+	       "heap per frame\n", w->name, vertices / 1000000,
+	       heap_jobs ? heap / (heap_jobs * 1024.0) : 0.0);
+	if (json) {
+		fprintf(json, "{\"type\": \"gpu_vertex\", \"time\": %.3f, "
+			"\"mvertices_per_s\": %.2f, \"heap_bytes_per_frame\": "
+			"%.0f}\n", json_time(), vertices / 1000000,
+			heap_jobs ? (double) heap / heap_jobs : 0.0);
+		fflush(json);
+	}
+}
+
+static void print_latency_stats(workload_t *w)
+{
+	latency_stats_t *stats = w->extra_data;
+	uint64_t batches;
+
+	if (!stats || !(batches = stats->batches))
+		return;
+	printf("%s: %.1f ns average load latency, %.1f/%.1f/%.1f/%.1f ns at "
+	       "the 50/90/99/99.9th percentile%s\n", w->name,
+	       stats->sum_ns / batches, latency_percentile(stats, batches, 0.5),
+	       latency_percentile(stats, batches, 0.9),
+	       latency_percentile(stats, batches, 0.99),
+	       latency_percentile(stats, batches, 0.999),
+	       stats->huge_pages ? "" : " (without huge pages)");
+	if (json) {
+		fprintf(json, "{\"type\": \"latency\", \"time\": %.3f, "
+			"\"workload\": \"%s\", \"average_ns\": %.1f, "
+			"\"p50_ns\": %.1f, \"p90_ns\": %.1f, \"p99_ns\": %.1f, "
+			"\"p999_ns\": %.1f, \"huge_pages\": %s}\n",
+			json_time(), w->name, stats->sum_ns / batches,
+			latency_percentile(stats, batches, 0.5),
+			latency_percentile(stats, batches, 0.9),
+			latency_percentile(stats, batches, 0.99),
+			latency_percentile(stats, batches, 0.999),
+			stats->huge_pages ? "true" : "false");
+		fflush(json);
+	}
+}
+
+static void print_coherency_stats(workload_t *w)
+{
+	coherency_stats_t *stats = w->extra_data;
+
+	if (!__atomic_load_n(&w->ready, __ATOMIC_ACQUIRE) || !stats->seconds ||
+	    !stats->transfers)
+		return;
+	if (stats->cpu[0] >= 0)
+		printf("%s: cpu %d and %d, ", w->name, stats->cpu[0],
+		       stats->cpu[1]);
+	else
+		printf("%s: not pinned, ", w->name);
+	printf("%.1f ns per line transfer, %.2f M transfers/s\n",
+	       stats->seconds * 1e9 / stats->transfers,
+	       stats->transfers / stats->seconds / 1e6);
+	if (json) {
+		fprintf(json, "{\"type\": \"coherency\", \"time\": %.3f, "
+			"\"workload\": \"%s\", \"cpus\": [%d, %d], "
+			"\"ns\": %.1f, \"mtransfers_per_s\": %.2f}\n",
+			json_time(), w->name, stats->cpu[0], stats->cpu[1],
+			stats->seconds * 1e9 / stats->transfers,
+			stats->transfers / stats->seconds / 1e6);
+		fflush(json);
+	}
+}
+
+/*
+ * Run the kernel of a CPU workload over a 'size' bytes working set for
+ * 'duration' seconds and return the achieved bandwidth in MB/s.
+ */
+static double measure_cpu_bandwidth(workload_t *w, int64_t *buffer,
+				    size_t size, double duration)
+{
+	void (*f)(int64_t *, int64_t *, int) = w->extra_data;
+	int size_multiplier = w->size_multiplier;
+	int i, repeat = 1;
+	uint64_t bytes = 0;
+	double t1, t2;
+
+	if (!size_multiplier)
+		size_multiplier = 1;
+	/* Avoid calling gettime() for every pass over the small buffers */
+	if (size < 1024 * 1024)
+		repeat = 1024 * 1024 / size;
+
+	/* Warm-up */
+	f(buffer, buffer, size);
+
+	t1 = gettime();
+	do {
+		for (i = 0; i < repeat; i++)
+			f(buffer, buffer, size);
+		bytes += (uint64_t)size * size_multiplier * repeat;
+		t2 = gettime();
+	} while (t2 - t1 < duration);
+
+	return bytes / (t2 - t1) / 1000000.;
+}
+
+/*
+ * Print a table of the bandwidth for the selected CPU workloads (or all
+ * of them if none is selected) over the range of working set sizes.
+ */
+static void run_sweep(workload_t *workloads, int number_of_workloads)
+{
+	workload_t *cpu_workloads[workloads_count];
+	int i, number_of_cpu_workloads = 0;
+	size_t size, max_size = SWEEP_MAX_SIZE;
+	int64_t *buffer;
+
+	for (i = 0; i < number_of_workloads; i++) {
+		if (workloads[i].thread_func == cpu_thread &&
+		    number_of_cpu_workloads < ARRAY_SIZE(cpu_workloads))
+			cpu_workloads[number_of_cpu_workloads++] = &workloads[i];
+	}
+	if (number_of_workloads == 0) {
+		for (i = 0; i < workloads_count; i++) {
+			if (workloads_list[i].thread_func == cpu_thread &&
+			    workload_is_supported(&workloads_list[i]))
+				cpu_workloads[number_of_cpu_workloads++] =
+							&workloads_list[i];
+		}
+	}
+	if (number_of_cpu_workloads == 0) {
+		printf("No CPU workloads to sweep\n");
+		exit(1);
+	}
+
+	/* Use a smaller maximum size if there is not enough memory */
+	while (posix_memalign((void **)&buffer, 4096, max_size) != 0) {
+		max_size /= 2;
+		assert(max_size >= SWEEP_MIN_SIZE);
+	}
+	memset(buffer, 0xCC, max_size);
+
+	printf("%10s", "size");
+	for (i = 0; i < number_of_cpu_workloads; i++)
+		printf(" %22s", cpu_workloads[i]->name);
+	printf("\n");
+
+	for (size = SWEEP_MIN_SIZE; size <= max_size; size *= 2) {
+		if (size >= 1024 * 1024)
+			printf("%8zu M", size / (1024 * 1024));
+		else
+			printf("%8zu K", size / 1024);
+		fflush(stdout);
+		for (i = 0; i < number_of_cpu_workloads; i++) {
+			double bw = measure_cpu_bandwidth(cpu_workloads[i],
+						buffer, size, SWEEP_TIME);
+			printf(" %17.1f MB/s", bw);
+			fflush(stdout);
+			json_bandwidth("sweep", cpu_workloads[i]->name, size, bw);
+		}
+		printf("\n");
+	}
+
+	free(buffer);
+}
+
+typedef struct cpu_result_t
+{
+	workload_t *w;
+	double bandwidth;
+} cpu_result_t;
+
+static int compare_cpu_results(const void *a, const void *b)
+{
+	const cpu_result_t *ra = a, *rb = b;
+	if (ra->bandwidth > rb->bandwidth)
+		return -1;
+	return ra->bandwidth < rb->bandwidth;
+}
+
+/*
+ * Benchmark all the CPU workloads one after another and print them
+ * ranked by bandwidth, the fastest first.
+ */
+static void run_all_cpu(void)
+{
+	cpu_result_t results[workloads_count];
+	int i, n = 0;
+	int64_t *buffer;
+
+	if (posix_memalign((void **)&buffer, 4096, workload_buffer_size) != 0) {
+		assert(0);
+	}
+	memset(buffer, 0xCC, workload_buffer_size);
+
+	for (i = 0; i < workloads_count; i++) {
+		if (workloads_list[i].thread_func != cpu_thread ||
+		    !workload_is_supported(&workloads_list[i]))
+			continue;
+		printf("Running '%s'\n", workloads_list[i].name);
+		results[n].w = &workloads_list[i];
+		results[n].bandwidth = measure_cpu_bandwidth(&workloads_list[i],
+						buffer, workload_buffer_size, ALL_CPU_TIME);
+		json_bandwidth("workload", workloads_list[i].name,
+			       workload_buffer_size, results[n].bandwidth);
+		n++;
+	}
+	free(buffer);
+
+	if (n == 0) {
+		printf("No CPU workloads available\n");
+		exit(1);
+	}
+
+	qsort(results, n, sizeof(results[0]), compare_cpu_results);
+
+	printf("\n%4s %-30s %14s\n", "rank", "workload", "bandwidth");
+	for (i = 0; i < n; i++)
+		printf("%4d %-30s %9.1f MB/s\n", i + 1, results[i].w->name,
+		       results[i].bandwidth);
+}
+
+/*
+ * The fastest of the hand written kernels with 'kind' in their name, the
+ * copy ones for memcpy and memmove and the fill ones for memset, or NULL
+ * if the cpu has none of them
+ */
+static workload_t *libc_best_kernel(const char *kind, int64_t *buffer,
+				    size_t size, double *best)
+{
+	workload_t *w, *best_w = NULL;
+	int i;
+
+	*best = 0;
+	for (i = 0; i < workloads_count; i++) {
+		double bw;
+
+		w = &workloads_list[i];
+		if (w->thread_func != cpu_thread || !workload_is_supported(w) ||
+		    strncmp(w->name, "libc_", 5) == 0 || !strstr(w->name, kind))
+			continue;
+		bw = measure_cpu_bandwidth(w, buffer, size, LIBC_TIME);
+		if (bw > *best) {
+			*best = bw;
+			best_w = w;
+		}
+	}
+	return best_w;
+}
+
+/*
+ * The libc memcpy, memmove and memset workloads on an L1, an L2 and a
+ * --buffer-size working set, each one next to the best of the kernels of
+ * lima-memspeed, to tell if the libc of the system leaves much behind.
+ */
+static void run_libc(void)
+{
+	size_t sizes[3] = { LIBC_L1_SIZE, BASELINE_L2_SIZE, workload_buffer_size };
+	workload_t *copy_w[3], *fill_w[3];
+	double copy_bw[3], fill_bw[3];
+	int i, j;
+	int64_t *buffer;
+
+	if (posix_memalign((void **)&buffer, 4096, workload_buffer_size) != 0) {
+		assert(0);
+	}
+	memset(buffer, 0xCC, workload_buffer_size);
+
+	for (j = 0; j < 3; j++) {
+		copy_w[j] = libc_best_kernel("_copy", buffer, sizes[j],
+					     &copy_bw[j]);
+		fill_w[j] = libc_best_kernel("_write", buffer, sizes[j],
+					     &fill_bw[j]);
+	}
+
+#ifdef __GLIBC__
+	printf("libc: glibc %s\n\n", gnu_get_libc_version());
+#else
+	printf("libc: not glibc (musl or another one)\n\n");
+#endif
+	printf("%-24s %6s %10s   %-24s %10s %7s\n", "workload", "size",
+	       "MB/s", "best kernel", "MB/s", "libc");
+	for (i = 0; i < workloads_count; i++) {
+		workload_t *w = &workloads_list[i], *kernel;
+		double bw, kernel_bw;
+
+		if (w->thread_func != cpu_thread || strncmp(w->name, "libc_", 5))
+			continue;
+		for (j = 0; j < 3; j++) {
+			int fill = strstr(w->name, "memset") != NULL;
+
+			kernel = fill ? fill_w[j] : copy_w[j];
+			kernel_bw = fill ? fill_bw[j] : copy_bw[j];
+			bw = measure_cpu_bandwidth(w, buffer, sizes[j], LIBC_TIME);
+			if (sizes[j] >= 1024 * 1024)
+				printf("%-24s %5zuM %10.1f", w->name,
+				       sizes[j] / (1024 * 1024), bw);
+			else
+				printf("%-24s %5zuK %10.1f", w->name,
+				       sizes[j] / 1024, bw);
+			if (kernel)
+				printf("   %-24s %10.1f %6.0f%%\n",
+				       kernel->name, kernel_bw,
+				       100 * bw / kernel_bw);
+			else
+				printf("   %-24s\n", "-");
+			fflush(stdout);
+			if (json) {
+				fprintf(json, "{\"type\": \"libc\", "
+					"\"time\": %.3f, \"workload\": \"%s\", "
+					"\"size\": %zu, \"mb_per_s\": %.1f, "
+					"\"kernel\": \"%s\", "
+					"\"kernel_mb_per_s\": %.1f}\n",
+					json_time(), w->name, sizes[j], bw,
+					kernel ? kernel->name : "",
+					kernel ? kernel_bw : 0);
+				fflush(json);
+			}
+		}
+	}
+	free(buffer);
+}
+
+/*
+ * Run the standard matrix, and either append it to the results store or
+ * compare it with the baseline from there. Returns 2 if anything got
+ * significantly slower, for the scripts which check a fleet of boards.
+ */
+static int run_baseline(int compare, const char *path)
+{
+	baseline_result_t results[ARRAY_SIZE(baseline_workloads) * 2], then;
+	size_t sizes[2] = { BASELINE_L2_SIZE, workload_buffer_size };
+	double samples[BASELINE_SAMPLES];
+	int i, j, k, n = 0, verdict, regressions = 0;
+	baseline_key_t key;
+	int64_t *buffer;
+	workload_t *w;
+
+	baseline_key_get(&key);
+	if (!path)
+		path = baseline_default_path(&key);
+	printf("Board %s, SoC %s, dram %d MHz, kernel %s\n", key.board, key.soc,
+	       key.dram_mhz, key.kernel);
+	printf("%s '%s'\n\n", compare ? "Comparing with" : "Saving to", path);
+
+	if (posix_memalign((void **)&buffer, 4096, workload_buffer_size) != 0) {
+		assert(0);
+	}
+	memset(buffer, 0xCC, workload_buffer_size);
+
+	printf("%-24s %8s %10s %8s", "workload", "size", "MB/s", "stddev");
+	if (compare)
+		printf(" %10s %8s", "baseline", "change");
+	printf("\n");
+	for (i = 0; i < ARRAY_SIZE(baseline_workloads); i++) {
+		w = workload_find(baseline_workloads[i],
+				  strlen(baseline_workloads[i]));
+		if (!w)
+			continue;
+		for (j = 0; j < ARRAY_SIZE(sizes); j++) {
+			baseline_result_t *r = &results[n++];
+
+			for (k = 0; k < BASELINE_SAMPLES; k++)
+				samples[k] = measure_cpu_bandwidth(w, buffer,
+						sizes[j], BASELINE_SAMPLE_TIME);
+			snprintf(r->workload, sizeof(r->workload), "%s",
+				 w->name);
+			r->size = sizes[j];
+			r->samples = BASELINE_SAMPLES;
+			stats_mean_stddev(samples, BASELINE_SAMPLES, &r->mean,
+					  &r->stddev);
+
+			printf("%-24s %7zuK %10.1f %8.1f", w->name,
+			       r->size / 1024, r->mean, r->stddev);
+			if (!compare) {
+				printf("\n");
+				json_bandwidth("baseline", w->name, r->size,
+					       r->mean);
+				continue;
+			}
+			if (baseline_find(path, &key, w->name, r->size,
+					  &then)) {
+				printf(" %10s\n", "none");
+				json_bandwidth("compare", w->name, r->size,
+					       r->mean);
+				continue;
+			}
+			verdict = baseline_compare(r, &then);
+			regressions += verdict < 0;
+			printf(" %10.1f %+7.1f%%%s%s%s\n", then.mean,
+			       100 * (r->mean - then.mean) / then.mean,
+			       verdict < 0 ? " REGRESSION" :
+			       verdict > 0 ? " improvement" : "",
+			       strcmp(then.kernel, key.kernel) ? ", was on " : "",
+			       strcmp(then.kernel, key.kernel) ? then.kernel : "");
+			fflush(stdout);
+			if (json) {
+				fprintf(json, "{\"type\": \"compare\", "
+					"\"time\": %.3f, \"workload\": \"%s\", "
+					"\"size\": %zu, \"mb_per_s\": %.1f, "
+					"\"stddev\": %.1f, \"baseline\": %.1f, "
+					"\"baseline_kernel\": \"%s\", "
+					"\"verdict\": \"%s\"}\n", json_time(),
+					w->name, r->size, r->mean, r->stddev,
+					then.mean, then.kernel,
+					verdict < 0 ? "regression" :
+					verdict > 0 ? "improvement" : "same");
+				fflush(json);
+			}
+		}
+	}
+	free(buffer);
+
+	if (n == 0) {
+		printf("None of the baseline workloads is available\n");
+		return 1;
+	}
+	if (!compare)
+		return baseline_save(path, &key, results, n) ? 1 : 0;
+	if (regressions)
+		printf("\n%d significant regressions\n", regressions);
+	return regressions ? 2 : 0;
+}
+
+/*
+ * Print the grid of a tunable kernel over the prefetch distances and the
+ * unrolls, each for duration seconds, and return the best MB/s and its
+ * setting. The setting is left at the best one.
+ */
+static double autotune_grid(workload_t *w, int64_t *buffer, double duration,
+			    int *best_prefetch, int *best_unroll)
+{
+	double best = 0;
+	int j, k;
+
+	printf("\n%-16s", w->name);
+	for (k = 0; k < ARRAY_SIZE(autotune_unroll); k++)
+		printf("     unroll %d", autotune_unroll[k]);
+	printf("\n");
+	for (j = 0; j < ARRAY_SIZE(autotune_prefetch); j++) {
+		printf("%10d bytes", autotune_prefetch[j]);
+		for (k = 0; k < ARRAY_SIZE(autotune_unroll); k++) {
+			double bw;
+
+			workload_prefetch = autotune_prefetch[j];
+			workload_unroll = autotune_unroll[k];
+			bw = measure_cpu_bandwidth(w, buffer,
+					workload_buffer_size, duration);
+			printf(" %7.1f MB/s", bw);
+			fflush(stdout);
+			if (json) {
+				fprintf(json, "{\"type\": \"autotune\", "
+					"\"time\": %.3f, \"workload\": \"%s\", "
+					"\"prefetch\": %d, \"unroll\": %d, "
+					"\"mb_per_s\": %.1f}\n", json_time(),
+					w->name, workload_prefetch,
+					workload_unroll, bw);
+				fflush(json);
+			}
+			if (bw > best) {
+				best = bw;
+				*best_prefetch = workload_prefetch;
+				*best_unroll = workload_unroll;
+			}
+		}
+		printf("\n");
+	}
+	printf("best: --prefetch=%d --unroll=%d, %.1f MB/s\n",
+	       *best_prefetch, *best_unroll, best);
+	workload_prefetch = *best_prefetch;
+	workload_unroll = *best_unroll;
+	return best;
+}
+
+/*
+ * Sweep the prefetch distance and the unroll of the tunable kernels, print
+ * the grid of each and save the best one per board to the results store.
+ */
+static int run_autotune(const char *path)
+{
+	static const char *tuned[] = { "neon_read_tuned", "neon_copy_tuned" };
+	baseline_key_t key;
+	int i, n = 0, ret = 0;
+	int64_t *buffer;
+
+	baseline_key_get(&key);
+	if (!path)
+		path = baseline_default_path(&key);
+	printf("Tuning for %s, %s at %d MHz dram, kernel %s\n", key.board,
+	       key.soc, key.dram_mhz, key.kernel);
+
+	if (posix_memalign((void **)&buffer, 4096, workload_buffer_size) != 0) {
+		assert(0);
+	}
+	memset(buffer, 0xCC, workload_buffer_size);
+
+	for (i = 0; i < ARRAY_SIZE(tuned); i++) {
+		workload_t *w = workload_find(tuned[i], strlen(tuned[i]));
+		int best_prefetch = 0, best_unroll = 0;
+		double best;
+
+		if (!w)
+			continue;
+		n++;
+		best = autotune_grid(w, buffer, AUTOTUNE_TIME, &best_prefetch,
+				     &best_unroll);
+		if (baseline_save_tuning(path, &key, w->name, best_prefetch,
+					 best_unroll, best))
+			ret = 1;
+	}
+	free(buffer);
+
+	if (n == 0) {
+		printf("None of the tunable workloads is available\n");
+		return 1;
+	}
+	return ret;
+}
+
+/*
+ * Every coherency workload on every ordered pair of cpus, one at a time,
+ * as a table of the ns per line transfer and the millions per second
+ */
+static int run_coherency(void)
+{
+	int cpus[CPU_SETSIZE], number_of_cpus = 0, i, a, b;
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		for (i = 0; i < CPU_SETSIZE; i++)
+			if (CPU_ISSET(i, &set))
+				cpus[number_of_cpus++] = i;
+	if (number_of_cpus < 2) {
+		printf("The coherency workloads need at least two cpus\n");
+		return 1;
+	}
+
+	for (i = 0; i < workloads_count; i++) {
+		workload_t *w = &workloads_list[i];
+		int variant = (intptr_t)w->extra_data;
+
+		if (w->thread_func != coherency_thread)
+			continue;
+		printf("\n%s, ns per line transfer (M transfers/s)\n%6s",
+		       w->name, "");
+		for (b = 0; b < number_of_cpus; b++)
+			printf(" %12s%-3d", "cpu ", cpus[b]);
+		printf("\n");
+		for (a = 0; a < number_of_cpus; a++) {
+			printf("cpu %-2d", cpus[a]);
+			for (b = 0; b < number_of_cpus; b++) {
+				uint64_t transfers = 0;
+				coherency_t *c;
+				double t1, t2;
+
+				if (a == b) {
+					printf(" %15s", "-");
+					continue;
+				}
+				c = coherency_start(variant, cpus[a], cpus[b]);
+				coherency_run(c, COHERENCY_BATCH);
+				t1 = gettime();
+				do {
+					transfers += coherency_run(c,
+							COHERENCY_BATCH);
+					t2 = gettime();
+				} while (t2 - t1 < COHERENCY_TIME);
+				coherency_stop(c);
+
+				printf(" %7.1f (%5.2f)",
+				       (t2 - t1) * 1e9 / transfers,
+				       transfers / (t2 - t1) / 1e6);
+				fflush(stdout);
+				if (json) {
+					fprintf(json, "{\"type\": "
+						"\"coherency\", \"time\": %.3f, "
+						"\"workload\": \"%s\", "
+						"\"cpus\": [%d, %d], "
+						"\"ns\": %.1f, "
+						"\"mtransfers_per_s\": %.2f}\n",
+						json_time(), w->name, cpus[a],
+						cpus[b],
+						(t2 - t1) * 1e9 / transfers,
+						transfers / (t2 - t1) / 1e6);
+					fflush(json);
+				}
+			}
+			printf("\n");
+		}
+	}
+	return 0;
+}
+
+static void sleep_seconds(double seconds)
+{
+	struct timespec t;
+
+	t.tv_sec = (time_t)seconds;
+	t.tv_nsec = (long)((seconds - t.tv_sec) * 1000000000.);
+	nanosleep(&t, NULL);
+}
+
+/*
+ * The copies of the --scaling workload, each pinned to a cpu of its own
+ * and with its own buffer, first touched from that cpu.
+ */
+static workload_t *scaling_copies;
+static int scaling_cpus[CPU_SETSIZE];
+static volatile int scaling_stop;
+
+static void *scaling_thread(void *data)
+{
+	workload_t *w = data;
+	void (*f)(int64_t *, int64_t *, int) = w->extra_data;
+	int size_multiplier = w->size_multiplier ? w->size_multiplier : 1;
+	int cpu = scaling_cpus[w - scaling_copies];
+	cpu_set_t cpus;
+	int64_t *buffer;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+		printf("Can't pin '%s' to cpu %d\n", w->name, cpu);
+
+	if (posix_memalign((void **)&buffer, 4096, workload_buffer_size) != 0) {
+		assert(0);
+	}
+	memset(buffer, 0xCC, workload_buffer_size);
+
+	while (!scaling_stop) {
+		f(buffer, buffer, workload_buffer_size);
+		workload_add_bytes(w,
+			(uint64_t)workload_buffer_size * size_multiplier);
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+/*
+ * Run 1, 2, ... N pinned copies of a CPU workload, one per cpu that we
+ * may run on, and print the total and the per thread bandwidth at each
+ * step, next to the speedup over a single thread. The fewest threads
+ * which get within 95% of the best total are what saturates the memory,
+ * the number of them is returned.
+ */
+static int run_scaling(workload_t *w)
+{
+	uint64_t bytes1[CPU_SETSIZE];
+	int i, k, cpus = 0, saturated = 0;
+	double t1, t2, single = 0, peak = 0, totals[CPU_SETSIZE];
+	cpu_set_t allowed;
+
+	if (w->thread_func != cpu_thread) {
+		printf("--scaling needs a CPU workload, such as neon_read_pf64\n");
+		exit(1);
+	}
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		printf("Can't get the cpus to run on: %s\n", strerror(errno));
+		exit(1);
+	}
+	for (i = 0; i < CPU_SETSIZE; i++)
+		if (CPU_ISSET(i, &allowed))
+			scaling_cpus[cpus++] = i;
+
+	if (posix_memalign((void **)&scaling_copies, CACHE_LINE_SIZE,
+			   cpus * sizeof(workload_t)) != 0) {
+		assert(0);
+	}
+
+	printf("%7s %10s %7s", "threads", "total MB/s", "speedup");
+	for (i = 0; i < cpus; i++)
+		printf("   cpu%-4d", scaling_cpus[i]);
+	printf("\n");
+
+	for (k = 1; k <= cpus; k++) {
+		double bw, total = 0;
+
+		scaling_stop = 0;
+		for (i = 0; i < k; i++) {
+			scaling_copies[i] = *w;
+			pthread_create(&scaling_copies[i].thread_id, NULL,
+				       scaling_thread, &scaling_copies[i]);
+		}
+		workloads_wait_ready(scaling_copies, k, WARMUP_TIMEOUT);
+		sleep_seconds(SCALING_SETTLE);
+
+		t1 = gettime();
+		for (i = 0; i < k; i++)
+			bytes1[i] = workload_get_bytes(&scaling_copies[i]);
+		sleep_seconds(SCALING_TIME);
+		t2 = gettime();
+		for (i = 0; i < k; i++)
+			total += (workload_get_bytes(&scaling_copies[i]) -
+				  bytes1[i]) / (t2 - t1) / 1000000.;
+		if (k == 1)
+			single = total;
+
+		printf("%7d %10.1f %7.2f", k, total, total / single);
+		if (json)
+			fprintf(json, "{\"type\": \"scaling\", "
+				"\"time\": %.3f, \"workload\": \"%s\", "
+				"\"threads\": %d, \"workloads\": [",
+				json_time(), w->name, k);
+		for (i = 0; i < k; i++) {
+			bw = (workload_get_bytes(&scaling_copies[i]) -
+			      bytes1[i]) / (t2 - t1) / 1000000.;
+			printf(" %9.1f", bw);
+			if (json)
+				fprintf(json, "%s%.1f", i ? ", " : "", bw);
+		}
+		printf("\n");
+		fflush(stdout);
+		if (json) {
+			fprintf(json, "], \"mb_per_s\": %.1f}\n", total);
+			fflush(json);
+		}
+
+		scaling_stop = 1;
+		for (i = 0; i < k; i++)
+			pthread_join(scaling_copies[i].thread_id, NULL);
+		totals[k - 1] = total;
+		if (total > peak)
+			peak = total;
+	}
+
+	for (k = 1; k <= cpus && !saturated; k++)
+		if (totals[k - 1] >= 0.95 * peak)
+			saturated = k;
+	printf("\n%d of %d threads get within 95%% of the best total, "
+	       "%.1f MB/s\n", saturated, cpus, peak);
+	free(scaling_copies);
+	return saturated;
+}
+
+/*
+ * --probe: what the cpu and its caches are, which copy kernel is the
+ * fastest on a working set well out of the caches, the best prefetch and
+ * unroll of the tunable kernels and how many threads of the copy kernel
+ * saturate the memory. It replaces the PATH.conf profile of the board,
+ * which lima-memspeed and lima-memtester start with.
+ */
+static int run_probe(const char *path)
+{
+	static const char *tuned[] = { "neon_copy_tuned", "neon_read_tuned" };
+	baseline_profile_t profile;
+	baseline_key_t key;
+	baseline_cpu_t cpu;
+	char conf_path[512];
+	workload_t *copy = NULL, *w;
+	double bw, best = 0;
+	int64_t *buffer;
+	size_t largest = 0;
+	int i;
+
+	baseline_key_get(&key);
+	baseline_cpu_get(&cpu);
+	if (!path)
+		path = baseline_default_path(&key);
+	snprintf(conf_path, sizeof(conf_path), "%s.conf", path);
+	/* a stress profile added by hand stays */
+	baseline_load_profile(conf_path, &key, &profile);
+	profile.copy_kernel[0] = 0;
+
+	printf("Probing %s, %s at %d MHz dram, kernel %s\n", key.board,
+	       key.soc, key.dram_mhz, key.kernel);
+	printf("%s, %d cpus", cpu.model, cpu.cpus);
+	for (i = 0; i < ARRAY_SIZE(cpu.cache); i++) {
+		if (!cpu.cache[i])
+			continue;
+		printf(", L%d %zuK", i + 1, cpu.cache[i] >> 10);
+		if (cpu.cache[i] > largest)
+			largest = cpu.cache[i];
+	}
+	printf("\n");
+
+	/* large enough to leave the caches out, small enough to spare */
+	profile.buffer_size = PROBE_MIN_BUFFER_SIZE;
+	while (profile.buffer_size < PROBE_CACHE_FACTOR * largest &&
+	       profile.buffer_size < workload_buffer_size)
+		profile.buffer_size *= 2;
+	workload_buffer_size = profile.buffer_size;
+	printf("buffer size %zuM\n\n", profile.buffer_size >> 20);
+
+	if (posix_memalign((void **)&buffer, 4096, workload_buffer_size) != 0) {
+		assert(0);
+	}
+	memset(buffer, 0xCC, workload_buffer_size);
+
+	for (i = 0; i < workloads_count; i++) {
+		w = &workloads_list[i];
+		if (w->thread_func != cpu_thread || !workload_is_supported(w) ||
+		    !strstr(w->name, "copy"))
+			continue;
+		bw = measure_cpu_bandwidth(w, buffer, workload_buffer_size,
+					   PROBE_TIME);
+		printf("%-30s %9.1f MB/s\n", w->name, bw);
+		fflush(stdout);
+		json_bandwidth("probe", w->name, workload_buffer_size, bw);
+		if (bw > best) {
+			best = bw;
+			copy = w;
+		}
+	}
+	if (!copy) {
+		printf("No CPU copy workloads available\n");
+		free(buffer);
+		return 1;
+	}
+	snprintf(profile.copy_kernel, sizeof(profile.copy_kernel), "%s",
+		 copy->name);
+	printf("fastest: %s\n", copy->name);
+
+	/* the copy one is what the tuned kernels get used for */
+	profile.prefetch = profile.unroll = 0;
+	for (i = 0; i < ARRAY_SIZE(tuned) && !profile.prefetch; i++) {
+		w = workload_find(tuned[i], strlen(tuned[i]));
+		if (w)
+			autotune_grid(w, buffer, PROBE_TIME, &profile.prefetch,
+				      &profile.unroll);
+	}
+	free(buffer);
+
+	printf("\n");
+	profile.threads = run_scaling(copy);
+	printf("\n");
+
+	return baseline_save_profile(path, &key, &cpu, &profile) ? 1 : 0;
+}
+
+/* The fastest copy kernel of the --probe profile, if there is one */
+static workload_t *profile_copy_kernel(const char *path,
+				       baseline_profile_t *profile)
+{
+	if (!path || !profile->copy_kernel[0])
+		return NULL;
+	return workload_find(profile->copy_kernel,
+			     strlen(profile->copy_kernel));
+}
+
+/* Parse a size with an optional K, M or G suffix */
+static size_t parse_size(const char *str)
+{
+	char *end;
+	unsigned long long size = strtoull(str, &end, 0);
+
+	switch (*end) {
+	case 'k':
+	case 'K':
+		size <<= 10;
+		end++;
+		break;
+	case 'm':
+	case 'M':
+		size <<= 20;
+		end++;
+		break;
+	case 'g':
+	case 'G':
+		size <<= 30;
+		end++;
+		break;
+	}
+	if (*end || end == str || size == 0 || size & 4095)
+		return 0;
+	return size;
+}
+
+/* The samples array of the time-series grows by this many at a time */
+#define SAMPLES_CHUNK 64
+
+static volatile sig_atomic_t stop_requested;
+
+static void stop_sampling(int sig)
+{
+	stop_requested = 1;
+}
+
+/* The width of a per-workload column, which fits its name */
+static int column_width(workload_t *w)
+{
+	int width = strlen(w->name);
+	return width < 10 ? 10 : width;
+}
+
+/*
+ * The sampling of the combined mode takes a sample every --interval
+ * seconds. The samples up to the first STEADY_WINDOW in a row whose
+ * mean total is within STEADY_SPREAD of the median of all the samples
+ * from there on are the warm-up, and don't count. Neither do the
+ * outliers, such as a sample which lost time to preemption: those more
+ * than OUTLIER_MADS standard deviations (as estimated from the median
+ * absolute deviation) and OUTLIER_FLOOR away from the median total.
+ * Sampling stops once the 95% confidence interval of the mean total is
+ * within SAMPLE_PRECISION of it, but not before --min-time and no later
+ * than --max-time.
+ */
+#define SAMPLE_INTERVAL  2.0
+#define SAMPLE_MIN_TIME  6.0
+#define SAMPLE_MAX_TIME  30.0
+#define SAMPLE_MIN_KEPT  3
+#define SAMPLE_PRECISION 0.004
+#define STEADY_WINDOW    3
+#define STEADY_SPREAD    0.02
+#define OUTLIER_MADS     3.5
+#define OUTLIER_FLOOR    0.01
+
+typedef struct sample_selection_t
+{
+	int first;	/* the first sample after the warm-up */
+	int steady;	/* or the warm-up never ended, and all of them count */
+	int kept;
+	int outliers;
+	double mean;
+	double ci;	/* the half width of the 95% confidence interval */
+} sample_selection_t;
+
+/* The mean of the values which are kept, and its confidence interval */
+static void kept_mean_ci(const double *values, const char *keep, int n,
+			 double *mean, double *ci)
+{
+	double kept[n], stddev;
+	int i, k = 0;
+
+	for (i = 0; i < n; i++)
+		if (keep[i])
+			kept[k++] = values[i];
+	stats_mean_stddev(kept, k, mean, &stddev);
+	*ci = k > 1 ? stats_t_quantile(STATS_Z_95, k - 1) * stddev / sqrt(k) :
+		      0;
+}
+
+static void select_samples(const double *total, int n, char *keep,
+			   sample_selection_t *s)
+{
+	double median, limit, sum;
+	int i, j;
+
+	s->steady = 0;
+	for (s->first = 0; s->first + STEADY_WINDOW <= n; s->first++) {
+		median = stats_median(total + s->first, n - s->first);
+		for (j = 0, sum = 0; j < STEADY_WINDOW; j++)
+			sum += total[s->first + j];
+		if (fabs(sum / STEADY_WINDOW - median) <= median * STEADY_SPREAD) {
+			s->steady = 1;
+			break;
+		}
+	}
+	if (!s->steady)
+		s->first = 0;
+
+	median = stats_median(total + s->first, n - s->first);
+	limit = fmax(OUTLIER_MADS * 1.4826 *
+		     stats_mad(total + s->first, n - s->first, median),
+		     OUTLIER_FLOOR * median);
+	s->kept = s->outliers = 0;
+	for (i = 0; i < n; i++) {
+		keep[i] = i >= s->first && fabs(total[i] - median) <= limit;
+		s->kept += keep[i];
+		s->outliers += i >= s->first && !keep[i];
+	}
+	kept_mean_ci(total, keep, n, &s->mean, &s->ci);
+}
+
+/* Print the min/median/max/mean line of the kept samples of one series */
+static void print_sample_stats(const char *name, const double *samples,
+			       const char *keep, int n)
+{
+	double kept[n], min = 0, max = 0, median, mean, ci;
+	int i, k = 0;
+
+	for (i = 0; i < n; i++) {
+		if (!keep[i])
+			continue;
+		if (!k || samples[i] < min)
+			min = samples[i];
+		if (!k || samples[i] > max)
+			max = samples[i];
+		kept[k++] = samples[i];
+	}
+	median = stats_median(kept, k);
+	kept_mean_ci(samples, keep, n, &mean, &ci);
+	printf("%-30s %10.1f %10.1f %10.1f %10.1f %8.1f\n", name, min, median,
+	       max, mean, ci);
+	if (json) {
+		fprintf(json, "{\"type\": \"summary\", \"time\": %.3f, "
+			"\"workload\": \"%s\", \"samples\": %d, "
+			"\"min\": %.1f, \"median\": %.1f, \"max\": %.1f, "
+			"\"mb_per_s\": %.1f, \"ci95\": %.1f}\n", json_time(),
+			name, k, min, median, max, mean, ci);
+		fflush(json);
+	}
+}
+
+/* What an access pattern workload got to use out of the cache lines */
+static void print_pattern_stats(workload_t *w, const double *samples,
+				const char *keep, int n)
+{
+	double fraction = workload_useful_fraction(w), mean, ci;
+	int stride;
+
+	if (!fraction)
+		return;
+	kept_mean_ci(samples, keep, n, &mean, &ci);
+	stride = strcmp(w->name, "stride_read") == 0 ? workload_stride : 0;
+	printf("%s: %.1f MB/s useful out of %.1f MB/s of cache lines",
+	       w->name, mean * fraction, mean);
+	if (stride)
+		printf(", %d byte stride", stride);
+	printf("\n");
+	if (json) {
+		fprintf(json, "{\"type\": \"pattern\", \"time\": %.3f, "
+			"\"workload\": \"%s\", \"stride\": %d, "
+			"\"useful_mb_per_s\": %.1f, \"line_mb_per_s\": %.1f}\n",
+			json_time(), w->name, stride, mean * fraction, mean);
+		fflush(json);
+	}
+}
+
+/* Parse a rate such as 500MB/s, with K, M or G meaning 10^3, 10^6, 10^9 */
+static uint64_t parse_rate(const char *str)
+{
+	char *end;
+	double rate = strtod(str, &end);
+
+	if (end == str)
+		return 0;
+	switch (*end) {
+	case 'k':
+	case 'K':
+		rate *= 1000.;
+		end++;
+		break;
+	case 'm':
+	case 'M':
+		rate *= 1000000.;
+		end++;
+		break;
+	case 'g':
+	case 'G':
+		rate *= 1000000000.;
+		end++;
+		break;
+	}
+	if (*end == 'B')
+		end++;
+	if (strcmp(end, "/s") == 0)
+		end += 2;
+	if (*end || rate < 1)
+		return 0;
+	return (uint64_t)rate;
+}
+
+/*
+ * Step the rate of the first rate limited workload up from 1/steps of its
+ * target rate to all of it, and print what every workload achieves at
+ * each step, next to the total
+ */
+static void run_rate_sweep(workload_t *workloads, int number_of_workloads,
+			   int steps)
+{
+	workload_t *swept = NULL;
+	uint64_t target, bytes1[number_of_workloads];
+	double t1, t2;
+	int i, step;
+
+	for (i = 0; i < number_of_workloads && !swept; i++) {
+		if (workload_get_rate(&workloads[i]))
+			swept = &workloads[i];
+	}
+	if (!swept) {
+		printf("--rate-sweep needs a workload with a rate, such as "
+		       "neon_copy_pf64@500MB/s\n");
+		exit(1);
+	}
+	target = workload_get_rate(swept);
+
+	printf("%10s", "target");
+	for (i = 0; i < number_of_workloads; i++)
+		printf(" %*s", column_width(&workloads[i]), workloads[i].name);
+	printf(" %10s\n", "total MB/s");
+
+	for (step = 1; step <= steps; step++) {
+		double bw, total = 0;
+		uint64_t rate = target * step / steps;
+
+		workload_set_rate(swept, rate ? rate : 1);
+		sleep(RATE_SWEEP_SETTLE);
+
+		t1 = gettime();
+		for (i = 0; i < number_of_workloads; i++)
+			bytes1[i] = workload_get_bytes(&workloads[i]);
+		sleep(RATE_SWEEP_TIME);
+		t2 = gettime();
+
+		printf("%10.1f", rate / 1000000.);
+		if (json)
+			fprintf(json, "{\"type\": \"rate_sweep\", "
+				"\"time\": %.3f, \"workload\": \"%s\", "
+				"\"target_mb_per_s\": %.1f, \"workloads\": [",
+				json_time(), swept->name, rate / 1000000.);
+		for (i = 0; i < number_of_workloads; i++) {
+			bw = (workload_get_bytes(&workloads[i]) - bytes1[i]) /
+			     (t2 - t1) / 1000000.;
+			total += bw;
+			printf(" %*.1f", column_width(&workloads[i]), bw);
+			if (json)
+				fprintf(json, "%s%.1f", i ? ", " : "", bw);
+		}
+		printf(" %10.1f\n", total);
+		fflush(stdout);
+		if (json) {
+			fprintf(json, "], \"mb_per_s\": %.1f}\n", total);
+			fflush(json);
+		}
+	}
+}
+
+/*
+ * Pin every cpufreq and devfreq domain in turn to each of its operating
+ * points, from the lowest up, and print what every workload achieves at
+ * each one, next to the total. The other domains are left to their
+ * governors, and every domain gets them back when it is done.
+ */
+static void run_dvfs_sweep(workload_t *workloads, int number_of_workloads)
+{
+	uint64_t bytes1[number_of_workloads];
+	int i, domain, point, domains = dvfs_init();
+	double t1, t2;
+
+	if (!domains) {
+		printf("--dvfs-sweep needs cpufreq or devfreq operating points "
+		       "that may be changed, as root\n");
+		exit(1);
+	}
+
+	for (domain = 0; domain < domains; domain++) {
+		dvfs_domain_t *d = dvfs_domain(domain);
+
+		printf("\n%6s MHz", d->name);
+		for (i = 0; i < number_of_workloads; i++)
+			printf(" %*s", column_width(&workloads[i]),
+			       workloads[i].name);
+		printf(" %10s\n", "total MB/s");
+
+		for (point = 0; point < d->points; point++) {
+			double bw, total = 0;
+
+			if (dvfs_set(domain, point)) {
+				printf("%10.0f can't be set\n", d->mhz[point]);
+				continue;
+			}
+			sleep_seconds(DVFS_SWEEP_SETTLE);
+
+			t1 = gettime();
+			for (i = 0; i < number_of_workloads; i++)
+				bytes1[i] = workload_get_bytes(&workloads[i]);
+			sleep_seconds(DVFS_SWEEP_TIME);
+			t2 = gettime();
+
+			printf("%10.0f", d->mhz[point]);
+			if (json)
+				fprintf(json, "{\"type\": \"dvfs_sweep\", "
+					"\"time\": %.3f, \"domain\": \"%s\", "
+					"\"mhz\": %.0f, \"workloads\": [",
+					json_time(), d->name, d->mhz[point]);
+			for (i = 0; i < number_of_workloads; i++) {
+				bw = (workload_get_bytes(&workloads[i]) -
+				      bytes1[i]) / (t2 - t1) / 1000000.;
+				total += bw;
+				printf(" %*.1f", column_width(&workloads[i]),
+				       bw);
+				if (json)
+					fprintf(json, "%s%.1f", i ? ", " : "",
+						bw);
+			}
+			printf(" %10.1f\n", total);
+			fflush(stdout);
+			if (json) {
+				fprintf(json, "], \"mb_per_s\": %.1f}\n", total);
+				fflush(json);
+			}
+		}
+		dvfs_restore_domain(domain);
+	}
+}
+
+/* The power drawn by the board, averaged since the last call */
+static double energy_watts(void)
+{
+	telemetry_value_t values[TELEMETRY_SOURCES_MAX];
+	int count = telemetry_take(values);
+
+	return telemetry_input_watts(values, count);
+}
+
+/*
+ * Run nothing, then every workload alone and then all of them together,
+ * the others paused, and print the MB/s, the watts from the power
+ * readings, the watts over idle and the MB per joule of those over idle,
+ * which is what moving the data costs.
+ */
+static void run_energy(workload_t *workloads, int number_of_workloads)
+{
+	telemetry_value_t values[TELEMETRY_SOURCES_MAX];
+	uint64_t bytes1[number_of_workloads];
+	int i, row, rows, count, power = 0;
+	double t1, t2, idle = 0;
+
+	count = telemetry_start(ENERGY_SAMPLE_INTERVAL);
+	telemetry_take(values);
+	for (i = 0; i < count; i++)
+		if (values[i].input)
+			power++;
+	if (!power) {
+		printf("--energy needs the power or the current of a supply "
+		       "or a hwmon sensor in sysfs\n");
+		exit(1);
+	}
+	printf("Power from");
+	for (i = 0, power = 0; i < count; i++)
+		if (values[i].input)
+			printf("%s %s", power++ ? "," : "", values[i].name);
+	printf("\n\n");
+
+	printf("%-30s %10s %9s %11s %9s\n", "", "MB/s", "W", "W over idle",
+	       "MB/J");
+	/* nothing, every workload alone and the mix of all of them */
+	rows = number_of_workloads > 1 ? number_of_workloads + 2 :
+					 number_of_workloads + 1;
+	for (row = 0; row < rows; row++) {
+		const char *name = row == 0 ? "idle" : row <= number_of_workloads ?
+				   workloads[row - 1].name : "mix";
+		double bw = 0, watts, over;
+
+		for (i = 0; i < number_of_workloads; i++)
+			__atomic_store_n(&workloads[i].paused,
+					 row != i + 1 && row != number_of_workloads + 1,
+					 __ATOMIC_RELAXED);
+		sleep_seconds(ENERGY_SETTLE);
+
+		energy_watts();
+		t1 = gettime();
+		for (i = 0; i < number_of_workloads; i++)
+			bytes1[i] = workload_get_bytes(&workloads[i]);
+		sleep_seconds(ENERGY_TIME);
+		t2 = gettime();
+		watts = energy_watts();
+
+		/* the scanout keeps counting while paused, only the running */
+		for (i = 0; i < number_of_workloads; i++)
+			if (row == i + 1 || row == number_of_workloads + 1)
+				bw += (workload_get_bytes(&workloads[i]) -
+				       bytes1[i]) / (t2 - t1) / 1000000.;
+		if (row == 0)
+			idle = watts;
+		over = watts - idle;
+
+		printf("%-30s %10.1f %9.3f", name, bw, watts);
+		if (row)
+			printf(" %+11.3f", over);
+		if (row && over > 0)
+			printf(" %9.1f", bw / over);
+		printf("\n");
+		fflush(stdout);
+		if (json) {
+			fprintf(json, "{\"type\": \"energy\", \"time\": %.3f, "
+				"\"workload\": \"%s\", \"mb_per_s\": %.1f, "
+				"\"watts\": %.3f, \"idle_watts\": %.3f",
+				json_time(), name, bw, watts, idle);
+			if (row && over > 0)
+				fprintf(json, ", \"mb_per_joule\": %.1f",
+					bw / over);
+			fprintf(json, "}\n");
+			fflush(json);
+		}
+	}
+}
 
-#include "limare.h"
-#include "formats.h"
+/*
+ * A scenario file replays the bandwidth profile of a use case in phases,
+ * such as
+ *
+ *	# the display alone, then a video on it, then the cpu on top
+ *	phase idle 30
+ *	fb_scanout
+ *	phase video 30
+ *	gpu_copy@250MB/s
+ *	phase busy 30
+ *	neon_copy count=2 cpu=1 buffer=8M
+ *	neon_read start=70 stop=80
+ *
+ * "phase NAME SECONDS" begins the next phase. The workloads listed under
+ * it start with it and run until the end, unless start= and stop= give
+ * other times, in seconds from the beginning of the scenario. rate= is
+ * the same as @RATE, cpu= pins the thread to a cpu, buffer= is the
+ * --buffer-size of a CPU or latency workload and count= runs that many
+ * copies of it.
+ */
+#define SCENARIO_PHASES_MAX    32
+#define SCENARIO_WORKLOADS_MAX 64
 
-#include "lima-memspeed.h"
-#include "arm-neon.h"
-#include "memspeed_gpu.h"
-#include "memspeed_fb.h"
+/* How much of the start of a phase is left out of its averages, at most */
+#define SCENARIO_SETTLE        1.0
+#define SCENARIO_TICK          0.1
 
-#ifndef ARRAY_SIZE
-#define ARRAY_SIZE(a)  (sizeof((a)) / sizeof((a)[0]))
-#endif
+typedef struct scenario_phase_t
+{
+	char name[32];
+	double start;
+	double end;
 
-double gettime(void)
+	/* The bytes of every workload after the settle time, and when */
+	uint64_t bytes[SCENARIO_WORKLOADS_MAX];
+	double measure_start;
+	int measuring;
+
+	/* The MB/s of every workload over the phase and the total at the end */
+	double bw[SCENARIO_WORKLOADS_MAX + 1];
+	double seconds;
+} scenario_phase_t;
+
+enum { SCENARIO_WAITING, SCENARIO_RUNNING, SCENARIO_STOPPED };
+
+typedef struct scenario_t
 {
-	struct timespec t;
-	int clock_gettime_result = clock_gettime(CLOCK_MONOTONIC, &t);
-	assert(clock_gettime_result == 0);
-	return t.tv_sec + 0.000000001 * t.tv_nsec;
+	scenario_phase_t phases[SCENARIO_PHASES_MAX];
+	int number_of_phases;
+
+	workload_t *workloads;
+	double start[SCENARIO_WORKLOADS_MAX];
+	double stop[SCENARIO_WORKLOADS_MAX];	/* 0 runs until the end */
+	int cpu[SCENARIO_WORKLOADS_MAX];	/* -1 for any cpu */
+	int state[SCENARIO_WORKLOADS_MAX];
+	int number_of_workloads;
+} scenario_t;
+
+static scenario_t scenario;
+
+/* One KEY=VALUE of a workload line, NULL or what is wrong with it */
+static const char *scenario_option(char *tok, uint64_t *rate,
+				   size_t *buffer_size, double *start,
+				   double *stop, int *cpu, int *count)
+{
+	char *value = strchr(tok, '=');
+
+	if (!value)
+		return "expected KEY=VALUE";
+	*value++ = 0;
+	if (strcmp(tok, "rate") == 0) {
+		if (!(*rate = parse_rate(value)))
+			return "bad rate";
+	} else if (strcmp(tok, "buffer") == 0) {
+		if (!(*buffer_size = parse_size(value)))
+			return "bad buffer size";
+	} else if (strcmp(tok, "cpu") == 0) {
+		*cpu = atoi(value);
+		if (*cpu < 0 || *cpu >= CPU_SETSIZE)
+			return "bad cpu";
+	} else if (strcmp(tok, "count") == 0) {
+		*count = atoi(value);
+		if (*count < 1)
+			return "bad count";
+	} else if (strcmp(tok, "start") == 0) {
+		*start = atof(value);
+	} else if (strcmp(tok, "stop") == 0) {
+		*stop = atof(value);
+	} else {
+		return "unknown KEY";
+	}
+	return NULL;
 }
 
-pthread_mutex_t bandwidth_counters_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* The copies of the workload of a line, NULL or what is wrong with it */
+static const char *scenario_workload(scenario_t *s, char *tok, char **save)
+{
+	scenario_phase_t *phase = &s->phases[s->number_of_phases - 1];
+	double start = phase->start, stop = 0;
+	int cpu = -1, count = 1, k;
+	size_t buffer_size = 0;
+	uint64_t rate = 0;
+	const char *error;
+	workload_t *w;
+	char *at = strchr(tok, '@');
 
-/******************************************************************************/
+	w = workload_find(tok, at ? at - tok : strlen(tok));
+	if (!w)
+		return "unknown or unsupported workload";
+	if (at && !(rate = parse_rate(at + 1)))
+		return "bad rate";
+	while ((tok = strtok_r(NULL, " \t\r\n", save))) {
+		error = scenario_option(tok, &rate, &buffer_size, &start,
+					&stop, &cpu, &count);
+		if (error)
+			return error;
+	}
+
+	if (s->number_of_workloads + count > SCENARIO_WORKLOADS_MAX)
+		return "too many workloads";
+	if (start < 0 || (stop && stop <= start))
+		return "it has to start before it stops";
+	/* The display keeps scanning out, whatever the thread does */
+	if ((rate || stop) && (w->thread_func == fb_scanout_thread ||
+			       w->thread_func == fb_blank_thread))
+		return "the display can't be rate limited or stopped";
+	if (buffer_size && w->thread_func != cpu_thread &&
+	    w->thread_func != latency_thread)
+		return "only CPU and latency workloads have a buffer";
 
-#define BUFFER_SIZE (32 * 1024 * 1024)
+	for (k = 0; k < count; k++) {
+		int i = s->number_of_workloads++;
 
-static void *cpu_thread(void *data)
+		s->workloads[i] = *w;
+		s->workloads[i].rate = rate;
+		s->workloads[i].buffer_size = buffer_size;
+		s->start[i] = start;
+		s->stop[i] = stop;
+		s->cpu[i] = cpu;
+		s->state[i] = SCENARIO_WAITING;
+	}
+	return NULL;
+}
+
+static int scenario_load(const char *path, scenario_t *s)
 {
-	workload_t *w = (workload_t *)data;
-	void (*f)(int64_t *, int64_t *, int) = w->extra_data;
-	int64_t *buffer;
-	int size_multiplier = w->size_multiplier;
-	if (!size_multiplier)
-		size_multiplier = 1;
+	const char *error = NULL;
+	char buf[512], *tok, *save;
+	double end;
+	int line = 0, i;
+	FILE *f;
 
-	if (posix_memalign((void **)&buffer, 4096, BUFFER_SIZE) != 0) {
+	f = fopen(path, "r");
+	if (!f) {
+		printf("Can't open '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (posix_memalign((void **)&s->workloads, CACHE_LINE_SIZE,
+			   SCENARIO_WORKLOADS_MAX * sizeof(workload_t)) != 0) {
 		assert(0);
 	}
-	memset(buffer, 0xCC, BUFFER_SIZE);
+	memset(s->workloads, 0, SCENARIO_WORKLOADS_MAX * sizeof(workload_t));
 
-	while (1) {
-		f(buffer, buffer, BUFFER_SIZE);
+	while (!error && fgets(buf, sizeof(buf), f)) {
+		line++;
+		if ((tok = strchr(buf, '#')))
+			*tok = 0;
+		tok = strtok_r(buf, " \t\r\n", &save);
+		if (!tok)
+			continue;
 
-		pthread_mutex_lock(&bandwidth_counters_mutex);
-		w->bytes_counter += BUFFER_SIZE * size_multiplier;
-		pthread_mutex_unlock(&bandwidth_counters_mutex);
+		if (strcmp(tok, "phase") == 0) {
+			scenario_phase_t *phase;
+			char *name = strtok_r(NULL, " \t\r\n", &save);
+			char *seconds = strtok_r(NULL, " \t\r\n", &save);
+
+			if (!name || !seconds || atof(seconds) <= 0 ||
+			    strtok_r(NULL, " \t\r\n", &save))
+				error = "expected phase NAME SECONDS";
+			else if (s->number_of_phases == SCENARIO_PHASES_MAX)
+				error = "too many phases";
+			if (error)
+				break;
+			phase = &s->phases[s->number_of_phases++];
+			snprintf(phase->name, sizeof(phase->name), "%s", name);
+			phase->start = s->number_of_phases > 1 ? phase[-1].end : 0;
+			phase->end = phase->start + atof(seconds);
+			continue;
+		}
+		if (!s->number_of_phases)
+			error = "a workload before the first phase";
+		else
+			error = scenario_workload(s, tok, &save);
+	}
+	fclose(f);
+	if (error) {
+		printf("%s:%d: %s\n", path, line, error);
+		return -1;
 	}
 
-	free(buffer);
+	if (!s->number_of_phases || !s->number_of_workloads) {
+		printf("%s: no phases or no workloads\n", path);
+		return -1;
+	}
+	end = s->phases[s->number_of_phases - 1].end;
+	for (i = 0; i < s->number_of_workloads; i++) {
+		if (s->start[i] >= end) {
+			printf("%s: '%s' starts after the end, at %.1f s\n",
+			       path, s->workloads[i].name, end);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void *scenario_thread(void *data)
+{
+	workload_t *w = data;
+	int cpu = scenario.cpu[w - scenario.workloads];
+	cpu_set_t cpus;
+
+	if (cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpus),
+					   &cpus) != 0)
+			printf("Can't pin '%s' to cpu %d\n", w->name, cpu);
+	}
+	return w->thread_func(w);
+}
+
+/* If the workload is meant to run at any time during the phase */
+static int scenario_active(scenario_t *s, int i, scenario_phase_t *phase)
+{
+	return s->start[i] < phase->end &&
+	       (!s->stop[i] || s->stop[i] > phase->start);
+}
+
+static void scenario_measure(scenario_t *s, scenario_phase_t *phase)
+{
+	int i;
+
+	for (i = 0; i < s->number_of_workloads; i++)
+		phase->bytes[i] = workload_get_bytes(&s->workloads[i]);
+	phase->measure_start = gettime();
+	phase->measuring = 1;
+}
+
+static void scenario_phase_done(scenario_t *s, scenario_phase_t *phase)
+{
+	double now = gettime();
+	int i, n = s->number_of_workloads;
+
+	if (!phase->measuring || now <= phase->measure_start)
+		return;
+	phase->seconds = now - phase->measure_start;
+	phase->bw[n] = 0;
+	for (i = 0; i < n; i++) {
+		phase->bw[i] = (workload_get_bytes(&s->workloads[i]) -
+				phase->bytes[i]) / phase->seconds / 1000000.;
+		phase->bw[n] += phase->bw[i];
+	}
+	phase->measuring = 0;
+}
+
+/*
+ * Run the scenario from the file, starting and stopping the workloads on
+ * time, with a sample every 'interval' and the averages of every phase at
+ * the end. Returns 1 if the file is no good.
+ */
+static int run_scenario(const char *path, double interval)
+{
+	scenario_t *s = &scenario;
+	scenario_phase_t *phase = NULL;
+	double start, now, next_sample, end, t1;
+	uint64_t bytes1[SCENARIO_WORKLOADS_MAX];
+	int i, p = -1, n;
+
+	if (scenario_load(path, s))
+		return 1;
+	n = s->number_of_workloads;
+	end = s->phases[s->number_of_phases - 1].end;
+	json_start("scenario", s->workloads, n);
+
+	for (p = 0; p < s->number_of_phases; p++)
+		printf("phase %-12s %6.1f s to %6.1f s\n", s->phases[p].name,
+		       s->phases[p].start, s->phases[p].end);
+	p = -1;
+
+	signal(SIGINT, stop_sampling);
+	signal(SIGTERM, stop_sampling);
+
+	printf("\n%8s %-12s", "time", "phase");
+	for (i = 0; i < n; i++)
+		printf(" %*s", column_width(&s->workloads[i]),
+		       s->workloads[i].name);
+	printf(" %10s\n", "total MB/s");
+
+	memset(bytes1, 0, sizeof(bytes1));
+	start = t1 = gettime();
+	next_sample = interval;
+	while (!stop_requested) {
+		now = gettime() - start;
+
+		for (i = 0; i < n; i++) {
+			workload_t *w = &s->workloads[i];
 
+			if (s->state[i] == SCENARIO_WAITING &&
+			    now >= s->start[i]) {
+				pthread_create(&w->thread_id, NULL,
+					       scenario_thread, w);
+				s->state[i] = SCENARIO_RUNNING;
+			}
+			if (s->state[i] == SCENARIO_RUNNING && s->stop[i] &&
+			    now >= s->stop[i]) {
+				__atomic_store_n(&w->paused, 1,
+						 __ATOMIC_RELAXED);
+				s->state[i] = SCENARIO_STOPPED;
+			}
+		}
+
+		while (p + 1 < s->number_of_phases &&
+		       now >= s->phases[p + 1].start) {
+			if (phase)
+				scenario_phase_done(s, phase);
+			phase = &s->phases[++p];
+		}
+		if (now >= end)
+			break;
+		if (!phase->measuring &&
+		    now >= phase->start + fmin(SCENARIO_SETTLE,
+					       (phase->end - phase->start) / 4))
+			scenario_measure(s, phase);
+
+		if (now >= next_sample) {
+			double t2 = gettime(), total = 0;
+
+			printf("%6.1f s %-12s", now, phase->name);
+			if (json)
+				fprintf(json, "{\"type\": \"sample\", "
+					"\"time\": %.3f, \"phase\": \"%s\", "
+					"\"seconds\": %.3f, \"workloads\": [",
+					json_time(), phase->name, t2 - t1);
+			for (i = 0; i < n; i++) {
+				uint64_t bytes = workload_get_bytes(&s->workloads[i]);
+				double bw = (bytes - bytes1[i]) / (t2 - t1) /
+					    1000000.;
+
+				printf(" %*.1f", column_width(&s->workloads[i]),
+				       bw);
+				if (json)
+					fprintf(json, "%s%.1f", i ? ", " : "", bw);
+				total += bw;
+				bytes1[i] = bytes;
+			}
+			printf(" %10.1f\n", total);
+			fflush(stdout);
+			if (json) {
+				fprintf(json, "], \"mb_per_s\": %.1f}\n", total);
+				fflush(json);
+			}
+			t1 = t2;
+			next_sample += interval;
+		}
+		sleep_seconds(SCENARIO_TICK);
+	}
+	if (phase)
+		scenario_phase_done(s, phase);
+
+	printf("\n%-12s %8s", "phase", "seconds");
+	for (i = 0; i < n; i++)
+		printf(" %*s", column_width(&s->workloads[i]),
+		       s->workloads[i].name);
+	printf(" %10s\n", "total MB/s");
+	for (p = 0; p < s->number_of_phases; p++) {
+		phase = &s->phases[p];
+		if (!phase->seconds)
+			continue;
+		printf("%-12s %8.1f", phase->name, phase->seconds);
+		for (i = 0; i < n; i++) {
+			if (scenario_active(s, i, phase))
+				printf(" %*.1f", column_width(&s->workloads[i]),
+				       phase->bw[i]);
+			else
+				printf(" %*s", column_width(&s->workloads[i]),
+				       "-");
+		}
+		printf(" %10.1f\n", phase->bw[n]);
+		if (json) {
+			fprintf(json, "{\"type\": \"phase\", \"time\": %.3f, "
+				"\"phase\": \"%s\", \"seconds\": %.3f, "
+				"\"mb_per_s\": %.1f, \"workloads\": [",
+				json_time(), phase->name, phase->seconds,
+				phase->bw[n]);
+			for (i = 0; i < n; i++) {
+				if (scenario_active(s, i, phase))
+					fprintf(json, "%s%.1f", i ? ", " : "",
+						phase->bw[i]);
+				else
+					fprintf(json, "%snull", i ? ", " : "");
+			}
+			fprintf(json, "]}\n");
+			fflush(json);
+		}
+	}
 	return 0;
 }
 
-static workload_t workloads_list[] = {
-	{
-		.name = "fb_blank",
-		.description = "blank the screen in order not to drain memory bandwidth",
-		.thread_func = fb_blank_thread,
-	},
-	{
-		.name = "fb_scanout",
-		.description = "take the framebuffer scanout bandwidth into account",
-		.thread_func = fb_scanout_thread,
-	},
-	{
-		.name = "gpu_write",
-		.description = "use the lima driver to solid fill the screen",
-		.thread_func = gpu_write_thread,
-	},
-	{
-		.name = "gpu_copy",
-		.description = "use the lima driver to copy a texture to the screen",
-		.thread_func = gpu_copy_thread,
-	},
-#ifdef __ARM__
-	{
-		.name = "neon_write",
-		.description = "use ARM NEON to fill a memory buffer",
-		.thread_func = cpu_thread,
-		.extra_data = aligned_block_fill_neon,
-	},
-	{
-		.name = "neon_write_backwards",
-		.description = "use ARM NEON to fill a memory buffer",
-		.thread_func = cpu_thread,
-		.extra_data = aligned_block_fill_backwards_neon,
-	},
-	{
-		.name = "neon_read_pf32",
-		.description = "use ARM NEON to read from a memory buffer",
-		.thread_func = cpu_thread,
-		.extra_data = aligned_block_read_pf32_neon,
-	},
-	{
-		.name = "neon_read_pf64",
-		.description = "use ARM NEON to read from a memory buffer",
-		.thread_func = cpu_thread,
-		.extra_data = aligned_block_read_pf64_neon,
-	},
-	{
-		.name = "neon_copy_pf64",
-		.description = "use ARM NEON to copy a memory buffer",
-		.thread_func = cpu_thread,
-		.extra_data = aligned_block_copy_pf64_neon,
-		.size_multiplier = 2,
-	},
-#endif
+/*
+ * --find-max builds up the mix with the highest total bandwidth one
+ * workload at a time: every step tries one more copy of each candidate
+ * on top of the best mix so far, and keeps the best of those as long as
+ * it adds at least FIND_MAX_GAIN. A CPU workload can have up to a copy per
+ * cpu, the others one. The threads are only started the first time they
+ * are needed and paused while they are not in the mix, so that a mix can
+ * be set up again in a moment. With --dram-counters it goes by the dram
+ * controller total, otherwise by the sum of the workloads.
+ */
+static const char *find_max_default[] = {
+	"neon_copy_pf64", "neon_read_pf64", "neon_write", "armv5te_copy_incr",
+	"armv4_write_stm4", "gpu_write", "gpu_copy", "gpu_pingpong",
+	"gpu_blend", "fb_scanout",
 };
+#define FIND_MAX_CANDIDATES 32
+#define FIND_MAX_SETTLE     1.0
+#define FIND_MAX_TIME       2.0
+#define FIND_MAX_GAIN       0.02
+
+typedef struct find_max_t
+{
+	workload_t *candidates[FIND_MAX_CANDIDATES];
+	int max_copies[FIND_MAX_CANDIDATES];
+	/* The first instance of every candidate in 'instances' */
+	int first[FIND_MAX_CANDIDATES];
+	int number_of_candidates;
+
+	workload_t *instances;
+	char *started;
+	int number_of_instances;
+} find_max_t;
+
+/* The mix as a --load list, each workload once for every copy */
+static void find_max_format(find_max_t *m, const int *copies, char *buf,
+			    size_t size)
+{
+	int c, k, len = 0;
+
+	buf[0] = 0;
+	for (c = 0; c < m->number_of_candidates; c++)
+		for (k = 0; k < copies[c] && len < size; k++)
+			len += snprintf(buf + len, size - len, "%s%s",
+					len ? "," : "", m->candidates[c]->name);
+}
+
+/* Run the given copies of each candidate, and return the total MB/s */
+static double find_max_measure(find_max_t *m, const int *copies)
+{
+	uint64_t bytes1[m->number_of_instances], dram1[DRAM_COUNTERS_MAX];
+	uint64_t dram2[DRAM_COUNTERS_MAX];
+	int c, k, i, dram_count = dram_counters_count();
+	double t1, t2, total = 0;
+
+	for (c = 0; c < m->number_of_candidates; c++) {
+		for (k = 0; k < m->max_copies[c]; k++) {
+			workload_t *w = &m->instances[m->first[c] + k];
+			int run = k < copies[c];
+
+			__atomic_store_n(&w->paused, !run, __ATOMIC_RELAXED);
+			if (run && !m->started[m->first[c] + k]) {
+				pthread_create(&w->thread_id, NULL,
+					       w->thread_func, w);
+				m->started[m->first[c] + k] = 1;
+				workloads_wait_ready(w, 1, WARMUP_TIMEOUT);
+			}
+		}
+	}
+	sleep_seconds(FIND_MAX_SETTLE);
+
+	for (i = 0; i < m->number_of_instances; i++)
+		bytes1[i] = workload_get_bytes(&m->instances[i]);
+	dram_counters_read(dram1);
+	t1 = gettime();
+	sleep_seconds(FIND_MAX_TIME);
+	t2 = gettime();
+	dram_counters_read(dram2);
+
+	if (dram_count) {
+		for (i = 0; i < dram_count; i++)
+			total += dram2[i] - dram1[i];
+		return total / (t2 - t1) / 1000000.;
+	}
+	/* The scanout keeps counting while paused, only those in the mix */
+	for (c = 0; c < m->number_of_candidates; c++) {
+		for (k = 0; k < copies[c]; k++) {
+			i = m->first[c] + k;
+			total += workload_get_bytes(&m->instances[i]) -
+				 bytes1[i];
+		}
+	}
+	return total / (t2 - t1) / 1000000.;
+}
+
+/*
+ * Search the peak mix of the given workloads, or of find_max_default, and
+ * save it for lima-memtester --load=@FILE. Returns 1 if none got going.
+ */
+static int run_find_max(workload_t *workloads, int number_of_workloads,
+			const char *path)
+{
+	static find_max_t mix;
+	find_max_t *m = &mix;
+	int copies[FIND_MAX_CANDIDATES] = { 0 };
+	int c, i, cpus = sysconf(_SC_NPROCESSORS_ONLN), steps = 0;
+	double best = 0;
+	char list[1024];
+	baseline_key_t key;
+
+	if (cpus < 1)
+		cpus = 1;
+	for (i = 0; i < (number_of_workloads ? number_of_workloads :
+			 (int)ARRAY_SIZE(find_max_default)); i++) {
+		workload_t *w = number_of_workloads ? &workloads[i] :
+				workload_find(find_max_default[i],
+					      strlen(find_max_default[i]));
+
+		if (!w || w->thread_func == fb_blank_thread ||
+		    m->number_of_candidates == FIND_MAX_CANDIDATES)
+			continue;
+		c = m->number_of_candidates++;
+		m->candidates[c] = w;
+		m->max_copies[c] = w->thread_func == cpu_thread ? cpus : 1;
+		m->first[c] = m->number_of_instances;
+		m->number_of_instances += m->max_copies[c];
+	}
+	if (!m->number_of_candidates) {
+		printf("No workloads to mix\n");
+		return 1;
+	}
+
+	if (posix_memalign((void **)&m->instances, CACHE_LINE_SIZE,
+			   m->number_of_instances * sizeof(workload_t)) != 0) {
+		assert(0);
+	}
+	memset(m->instances, 0, m->number_of_instances * sizeof(workload_t));
+	m->started = calloc(m->number_of_instances, 1);
+	assert(m->started);
+	for (c = 0; c < m->number_of_candidates; c++)
+		for (i = 0; i < m->max_copies[c]; i++)
+			m->instances[m->first[c] + i] = *m->candidates[c];
+
+	printf("Looking for the peak mix of %d workloads, up to %d copies of "
+	       "the cpu ones, by the %s\n", m->number_of_candidates, cpus,
+	       dram_counters_count() ? "dram counters" : "workload bandwidth");
+
+	while (!stop_requested) {
+		int step_best = -1;
+		double step_bw = 0;
+
+		for (c = 0; c < m->number_of_candidates && !stop_requested; c++) {
+			double bw;
+
+			if (copies[c] == m->max_copies[c])
+				continue;
+			copies[c]++;
+			bw = find_max_measure(m, copies);
+			find_max_format(m, copies, list, sizeof(list));
+			printf("%10.1f MB/s  %s\n", bw, list);
+			fflush(stdout);
+			if (json) {
+				fprintf(json, "{\"type\": \"mix\", "
+					"\"time\": %.3f, \"mix\": \"%s\", "
+					"\"mb_per_s\": %.1f}\n", json_time(),
+					list, bw);
+				fflush(json);
+			}
+			copies[c]--;
+			if (bw > step_bw) {
+				step_bw = bw;
+				step_best = c;
+			}
+		}
+		if (step_best < 0 || step_bw < best * (1 + FIND_MAX_GAIN))
+			break;
+		copies[step_best]++;
+		best = step_bw;
+		steps++;
+	}
+
+	if (!steps) {
+		printf("None of the workloads got going\n");
+		return 1;
+	}
+	find_max_format(m, copies, list, sizeof(list));
+	printf("\nPeak mix, %.1f MB/s:\n\t%s\n", best, list);
+	if (json) {
+		fprintf(json, "{\"type\": \"peak\", \"time\": %.3f, "
+			"\"mix\": \"%s\", \"mb_per_s\": %.1f}\n", json_time(),
+			list, best);
+		fflush(json);
+	}
+
+	if (!path) {
+		baseline_key_get(&key);
+		path = baseline_default_path(&key);
+	}
+	return baseline_save_mix(path, list) ? 1 : 0;
+}
 
 static void show_help_and_exit(void)
 {
 	int j;
-	printf("Usage: lima-memspeed [workload1] [workload2] ... [workloadN]\n\n");
+	printf("Usage: lima-memspeed [options] [workload1] [workload2] ... "
+	       "[workloadN]\n\n");
 
 	printf("Where the 'workload' arguments are the identifiers of different\n");
 	printf("memory bandwidth consuming workloads. Each workload is run in its\n");
-	printf("own thread.\n\n");
-	
+	printf("own thread. A workload followed by @RATE, such as\n");
+	printf("neon_copy_pf64@500MB/s or gpu_write@250MB/s, is limited to that\n");
+	printf("rate instead of running flat out. Without any workloads, the\n");
+	printf("copy kernel and threads of the board's --probe profile are run.\n\n");
+
+	printf("Options:\n");
+	printf("\t%-30s (%s)\n", "--buffer-size=SIZE",
+	       "buffer size of the CPU workloads, 32M by default");
+	printf("\t%-30s (%s)\n", "--stride=BYTES",
+	       "stride of stride_read, 8, 16, 32 or 64 to 4096 in lines, "
+	       "256 by default");
+	printf("\t%-30s (%s)\n", "--sweep",
+	       "measure the CPU workloads one by one from 4K to 256M");
+	printf("\t%-30s (%s)\n", "--scaling=WORKLOAD",
+	       "run 1 to N pinned copies of a CPU workload, one per cpu");
+	printf("\t%-30s (%s)\n", "--scaling",
+	       "the same with the copy kernel of the board's profile");
+	printf("\t%-30s (%s)\n", "--all-cpu",
+	       "benchmark all the CPU workloads and rank them");
+	printf("\t%-30s (%s)\n", "--libc",
+	       "libc memcpy, memmove and memset next to the best kernels");
+	printf("\t%-30s (%s)\n", "--autotune",
+	       "sweep the prefetch and unroll of the _tuned kernels, save the best");
+	printf("\t%-30s (%s)\n", "--probe",
+	       "find the best settings of the board, save them as its profile");
+	printf("\t%-30s (%s)\n", "--prefetch=BYTES",
+	       "prefetch distance of the _tuned kernels, 256 by default");
+	printf("\t%-30s (%s)\n", "--unroll=N",
+	       "cache lines per loop of the _tuned kernels, 1, 2 or 4, 2 by default");
+	printf("\t%-30s (%s)\n", "--baseline",
+	       "run the standard matrix and add it to the results store");
+	printf("\t%-30s (%s)\n", "--compare",
+	       "run the standard matrix and compare it with the stored baseline");
+	printf("\t%-30s (%s)\n", "--results=FILE",
+	       "the results store, /var/lib/lima-memspeed/BOARD by default");
+	printf("\t%-30s (%s)\n", "--coherency",
+	       "the cache line transfer latency between every pair of cpus");
+	printf("\t%-30s (%s)\n", "--find-max",
+	       "search the mix of the given (or the usual) workloads with "
+	       "the most bandwidth");
+	printf("\t%-30s (%s)\n", "--scenario=FILE",
+	       "run the phases of a scenario file and report each of them");
+	printf("\t%-30s (%s)\n", "--json",
+	       "JSON lines on stdout, the text output on stderr");
+	printf("\t%-30s (%s)\n", "--continuous",
+	       "keep sampling until interrupted, instead of until it converges");
+	printf("\t%-30s (%s)\n", "--interval=SECONDS",
+	       "time between the samples, 2 by default");
+	printf("\t%-30s (%s)\n", "--min-time=SECONDS",
+	       "sample for at least this long, 6 by default");
+	printf("\t%-30s (%s)\n", "--max-time=SECONDS",
+	       "stop sampling after this long, 30 by default");
+	printf("\t%-30s (%s)\n", "--pmu",
+	       "count the cpu events of every workload thread with perf");
+	printf("\t%-30s (%s)\n", "--telemetry",
+	       "tag every sample with the SoC temperatures, clocks and voltages");
+	printf("\t%-30s (%s)\n", "--metrics=[ADDRESS:]PORT",
+	       "serve the samples to Prometheus on http://ADDRESS:PORT/metrics");
+	printf("\t%-30s (%s)\n", "--time-series=FILE",
+	       "write the per-workload MB/s of every sample to a CSV file");
+	printf("\t%-30s (%s)\n", "--rate-sweep=STEPS",
+	       "step the first @RATE workload up to its rate in STEPS steps");
+	printf("\t%-30s (%s)\n", "--energy",
+	       "MB/s, watts and MB per joule of every workload and of the mix");
+	printf("\t%-30s (%s)\n", "--dvfs-sweep",
+	       "run the workloads at every cpu, gpu and dram operating point");
+	printf("\t%-30s (%s)\n", "--dram-counters=SPEC",
+	       "also sample the dram controller counters, see below");
+	printf("\t%-30s (%s)\n", "--blend-layers=N",
+	       "quads blended per gpu_blend frame, 8 by default");
+	printf("\t%-30s (%s)\n", "--samplers=N",
+	       "textures per gpu_sampler pixel, 1 to 4, 4 by default");
+	printf("\t%-30s (%s)\n", "--texture-format=FORMAT",
+	       "rgba8888, rgb888, rgb565 or etc1 textures for gpu_copy and "
+	       "gpu_pingpong");
+	printf("\t%-30s (%s)\n", "--vertex-format=FORMAT",
+	       "float, fixed, i16n or i8n attributes for gpu_vertex");
+	printf("\n");
+
+	printf("The dram controller counters are given as\n");
+	printf("BASE:NAME=OFFSET[*SCALE],... such as "
+	       "0x01c62000:cpu=0x100,gpu=0x104,\n");
+	printf("free running 32 bit registers at OFFSET from the physical address\n");
+	printf("BASE, counting SCALE bytes per step. This needs an Allwinner SoC,\n");
+	printf("root and counters which are enabled already.\n\n");
+
+	printf("The gpu workloads render to the framebuffer, at the resolution\n");
+	printf("of the display. LIMA_OFFSCREEN=WIDTHxHEIGHT[@BPP] in the\n");
+	printf("environment, such as LIMA_OFFSCREEN=1920x1080@32, renders to\n");
+	printf("gpu memory instead, which is also done when there is no\n");
+	printf("framebuffer at all. LIMA_FB_FORMAT=rgb565 or argb8888 picks the\n");
+	printf("format of the frames, switching the framebuffer over if needed.\n");
+	printf("Together with --texture-format, this keeps the fill rate the\n");
+	printf("same while the bytes per pixel double, to tell the memory limits\n");
+	printf("from the PP limits.\n\n");
+
+	printf("gpu_blend reports its fill rate at the end. Raising\n");
+	printf("--blend-layers moves the load from memory to the tile buffer:\n");
+	printf("as long as the fill rate still goes up with N, writing out the\n");
+	printf("frames to memory is the limit, once it stays flat the PP is\n");
+	printf("bound by its tile buffer.\n\n");
+
 	printf("The list of available workload identifiers:\n");
 
-	for (j = 0; j < ARRAY_SIZE(workloads_list); j++) {
+	for (j = 0; j < workloads_count; j++) {
+		if (!workload_is_supported(&workloads_list[j]))
+			continue;
 		if (workloads_list[j].description)
 			printf("\t%-30s (%s)\n", workloads_list[j].name,
 						 workloads_list[j].description);
@@ -163,86 +2350,605 @@ static void show_help_and_exit(void)
 
 int main(int argc, char *argv[])
 {
-	int i, j, number_of_workloads = 0;
+	int i, number_of_workloads = 0;
 	workload_t *workloads;
-	double t1, t2, bytes1, bytes2;
-	double s1, s2;
-	int n;
+	double t1, t2, start;
+	double **series;
+	double interval = SAMPLE_INTERVAL, min_time = SAMPLE_MIN_TIME;
+	double max_time = SAMPLE_MAX_TIME;
+	sample_selection_t selection;
+	char *keep = NULL;
+	uint64_t dram_start[DRAM_COUNTERS_MAX], dram1[DRAM_COUNTERS_MAX];
+	uint64_t dram2[DRAM_COUNTERS_MAX];
+	double dram_bw[DRAM_COUNTERS_MAX];
+	int dram_count;
+	uint64_t *bytes1, *bytes2;
+	int n, sweep = 0, all_cpu = 0, continuous = 0, rate_sweep = 0, pmu = 0;
+	int baseline = 0, compare = 0, libc = 0, autotune = 0, find_max = 0;
+	int coherency = 0, probe = 0, dvfs_sweep = 0, energy = 0;
+	baseline_profile_t profile;
+	const char *profile_path = NULL;
+	workload_t *scaling = NULL;
+	const char *results_path = NULL, *scenario_path = NULL;
+	const char *metrics = NULL;
+	int telemetry = 0, telemetry_count = 0;
+	telemetry_value_t telemetry_values[TELEMETRY_SOURCES_MAX];
+	uint64_t (*pmu_start)[PMU_EVENTS] = NULL, pmu_end[PMU_EVENTS];
+	FILE *time_series = NULL;
 	
 	if (argc < 2)
 		show_help_and_exit();
 
-	workloads = calloc(argc - 1, sizeof(workload_t));
-	assert(workloads);
+	/* before the workload threads, which would take the signals instead */
+	metrics_snapshot_start(getenv("LIMA_SNAPSHOT"));
+
+	/* the board's own defaults, which the options still override */
+	for (i = 1; i < argc && strcmp(argv[i], "--probe") != 0; i++)
+		;
+	if (i == argc)
+		profile_path = baseline_profile_find(&profile);
+	if (profile_path) {
+		if (profile.prefetch)
+			workload_prefetch = profile.prefetch;
+		if (profile.unroll)
+			workload_unroll = profile.unroll;
+		if (profile.buffer_size)
+			workload_buffer_size = profile.buffer_size;
+	}
+
+	/* room for the copies of the profile's copy kernel too */
+	n = argc - 1;
+	if (profile_path && profile.threads > n)
+		n = profile.threads;
+	if (posix_memalign((void **)&workloads, CACHE_LINE_SIZE,
+			   n * sizeof(workload_t)) != 0) {
+		assert(0);
+	}
+	memset(workloads, 0, n * sizeof(workload_t));
 
 	/* Prepare the workloads array */
 	for (i = 1; i < argc; i++) {
-		int workload_found = 0;
-		for (j = 0; j < ARRAY_SIZE(workloads_list); j++) {
-			if (strcmp(argv[i], workloads_list[j].name) == 0) {
-				workloads[number_of_workloads++] = workloads_list[j];
-				workload_found = 1;
+		workload_t *w;
+		const char *at;
+		size_t len;
+		if (strcmp(argv[i], "--sweep") == 0) {
+			sweep = 1;
+			continue;
+		}
+		if (strcmp(argv[i], "--all-cpu") == 0) {
+			all_cpu = 1;
+			continue;
+		}
+		if (strcmp(argv[i], "--libc") == 0) {
+			libc = 1;
+			continue;
+		}
+		if (strcmp(argv[i], "--coherency") == 0) {
+			coherency = 1;
+			continue;
+		}
+		if (strcmp(argv[i], "--find-max") == 0) {
+			find_max = 1;
+			continue;
+		}
+		if (strcmp(argv[i], "--autotune") == 0) {
+			autotune = 1;
+			continue;
+		}
+		if (strcmp(argv[i], "--probe") == 0) {
+			probe = 1;
+			continue;
+		}
+		if (strcmp(argv[i], "--dvfs-sweep") == 0) {
+			dvfs_sweep = 1;
+			continue;
+		}
+		if (strcmp(argv[i], "--energy") == 0) {
+			energy = 1;
+			continue;
+		}
+		if (strncmp(argv[i], "--prefetch=", 11) == 0) {
+			workload_prefetch = atoi(argv[i] + 11);
+			if (workload_prefetch < 0 ||
+			    workload_prefetch > PREFETCH_MAX)
+				show_help_and_exit();
+			continue;
+		}
+		if (strncmp(argv[i], "--unroll=", 9) == 0) {
+			workload_unroll = atoi(argv[i] + 9);
+			if (workload_unroll != 1 && workload_unroll != 2 &&
+			    workload_unroll != 4)
+				show_help_and_exit();
+			continue;
+		}
+		if (strncmp(argv[i], "--scaling=", 10) == 0) {
+			scaling = workload_find(argv[i] + 10,
+						strlen(argv[i] + 10));
+			if (!scaling)
+				show_help_and_exit();
+			continue;
+		}
+		if (strcmp(argv[i], "--scaling") == 0) {
+			scaling = profile_copy_kernel(profile_path, &profile);
+			if (!scaling)
+				show_help_and_exit();
+			continue;
+		}
+		if (strcmp(argv[i], "--baseline") == 0) {
+			baseline = 1;
+			continue;
+		}
+		if (strcmp(argv[i], "--compare") == 0) {
+			compare = 1;
+			continue;
+		}
+		if (strncmp(argv[i], "--results=", 10) == 0) {
+			results_path = argv[i] + 10;
+			continue;
+		}
+		if (strcmp(argv[i], "--json") == 0) {
+			if (!json) {
+				fflush(stdout);
+				json = fdopen(dup(STDOUT_FILENO), "w");
+				dup2(STDERR_FILENO, STDOUT_FILENO);
+			}
+			continue;
+		}
+		if (strcmp(argv[i], "--continuous") == 0) {
+			continuous = 1;
+			continue;
+		}
+		if (strcmp(argv[i], "--pmu") == 0) {
+			pmu = 1;
+			continue;
+		}
+		if (strcmp(argv[i], "--telemetry") == 0) {
+			telemetry = 1;
+			continue;
+		}
+		if (strncmp(argv[i], "--metrics=", 10) == 0) {
+			metrics = argv[i] + 10;
+			continue;
+		}
+		if (strncmp(argv[i], "--time-series=", 14) == 0) {
+			time_series = fopen(argv[i] + 14, "w");
+			if (!time_series) {
+				printf("Can't open '%s': %s\n", argv[i] + 14,
+				       strerror(errno));
+				exit(1);
 			}
+			continue;
+		}
+		if (strncmp(argv[i], "--rate-sweep=", 13) == 0) {
+			rate_sweep = atoi(argv[i] + 13);
+			if (rate_sweep <= 0)
+				show_help_and_exit();
+			continue;
+		}
+		if (strncmp(argv[i], "--dram-counters=", 16) == 0) {
+			if (dram_counters_init(argv[i] + 16))
+				exit(1);
+			continue;
+		}
+		if (strncmp(argv[i], "--blend-layers=", 15) == 0) {
+			gpu_blend_layers = atoi(argv[i] + 15);
+			if (gpu_blend_layers < 1 ||
+			    gpu_blend_layers > GPU_BLEND_LAYERS_MAX)
+				show_help_and_exit();
+			continue;
+		}
+		if (strncmp(argv[i], "--interval=", 11) == 0) {
+			interval = atof(argv[i] + 11);
+			if (interval < 0.1)
+				show_help_and_exit();
+			continue;
+		}
+		if (strncmp(argv[i], "--min-time=", 11) == 0) {
+			min_time = atof(argv[i] + 11);
+			if (min_time < 0)
+				show_help_and_exit();
+			continue;
+		}
+		if (strncmp(argv[i], "--max-time=", 11) == 0) {
+			max_time = atof(argv[i] + 11);
+			if (max_time <= 0)
+				show_help_and_exit();
+			continue;
+		}
+		if (strncmp(argv[i], "--samplers=", 11) == 0) {
+			gpu_samplers = atoi(argv[i] + 11);
+			if (gpu_samplers < 1 ||
+			    gpu_samplers > GPU_SAMPLERS_MAX)
+				show_help_and_exit();
+			continue;
+		}
+		if (strncmp(argv[i], "--texture-format=", 17) == 0) {
+			if (gpu_texture_format_set(argv[i] + 17))
+				show_help_and_exit();
+			continue;
+		}
+		if (strncmp(argv[i], "--vertex-format=", 16) == 0) {
+			if (gpu_vertex_format_set(argv[i] + 16))
+				show_help_and_exit();
+			continue;
+		}
+		if (strncmp(argv[i], "--scenario=", 11) == 0) {
+			scenario_path = argv[i] + 11;
+			continue;
+		}
+		if (strncmp(argv[i], "--stride=", 9) == 0) {
+			workload_stride = atoi(argv[i] + 9);
+			if (!workload_stride_valid(workload_stride))
+				show_help_and_exit();
+			continue;
 		}
-		if (!workload_found)
+		if (strncmp(argv[i], "--buffer-size=", 14) == 0) {
+			workload_buffer_size = parse_size(argv[i] + 14);
+			if (!workload_buffer_size)
+				show_help_and_exit();
+			continue;
+		}
+		at = strchr(argv[i], '@');
+		len = at ? at - argv[i] : strlen(argv[i]);
+		w = workload_find(argv[i], len);
+		if (!w)
 			show_help_and_exit();
+		workloads[number_of_workloads] = *w;
+		if (at) {
+			/* The scanout runs at the refresh rate */
+			uint64_t rate = parse_rate(at + 1);
+			if (!rate || w->thread_func == fb_scanout_thread ||
+			    w->thread_func == fb_blank_thread)
+				show_help_and_exit();
+			workloads[number_of_workloads].rate = rate;
+		}
+		number_of_workloads++;
+	}
+
+	if (profile_path)
+		printf("Using the profile %s\n", profile_path);
+	if (probe) {
+		json_start("probe", workloads, 0);
+		return run_probe(results_path);
+	}
+	if (sweep) {
+		json_start("sweep", workloads, number_of_workloads);
+		run_sweep(workloads, number_of_workloads);
+		return 0;
+	}
+	if (all_cpu) {
+		json_start("all-cpu", workloads, 0);
+		run_all_cpu();
+		return 0;
+	}
+	if (libc) {
+		json_start("libc", workloads, 0);
+		run_libc();
+		return 0;
+	}
+	if (scaling) {
+		json_start("scaling", scaling, 1);
+		run_scaling(scaling);
+		return 0;
 	}
+	if (autotune) {
+		json_start("autotune", workloads, 0);
+		return run_autotune(results_path);
+	}
+	if (baseline || compare) {
+		json_start(compare ? "compare" : "baseline", workloads, 0);
+		return run_baseline(compare, results_path);
+	}
+	if (coherency) {
+		json_start("coherency", workloads, 0);
+		return run_coherency();
+	}
+	if (scenario_path)
+		return run_scenario(scenario_path, interval);
+	if (find_max) {
+		json_start("find-max", workloads, number_of_workloads);
+		signal(SIGINT, stop_sampling);
+		signal(SIGTERM, stop_sampling);
+		return run_find_max(workloads, number_of_workloads,
+				    results_path);
+	}
+	/* without any workloads, the copy threads which saturate the dram */
+	if (number_of_workloads == 0 &&
+	    profile_copy_kernel(profile_path, &profile)) {
+		for (i = 0; i < (profile.threads > 1 ? profile.threads : 1); i++)
+			workloads[number_of_workloads++] =
+				*profile_copy_kernel(profile_path, &profile);
+		printf("Running %d %s threads of the profile\n",
+		       number_of_workloads, workloads[0].name);
+	}
+	if (number_of_workloads == 0 || min_time > max_time)
+		show_help_and_exit();
+
+	json_start("combined", workloads, number_of_workloads);
+	dram_count = dram_counters_count();
+
+	bytes1 = calloc(number_of_workloads, sizeof(uint64_t));
+	bytes2 = calloc(number_of_workloads, sizeof(uint64_t));
+	assert(bytes1 && bytes2);
 
 	/* Start the workloads threads */
 	for (i = 0; i < number_of_workloads; i++) {
 		printf("Starting '%s' thread\n", workloads[i].name);
-		pthread_create(&workloads[i].thread_id, NULL, workloads[i].thread_func, &workloads[i]);
+		pthread_create(&workloads[i].thread_id, NULL, pmu ?
+			       workload_pmu_thread : workloads[i].thread_func,
+			       &workloads[i]);
 	}
 
-	/* Warm-up */
-	sleep(1);
+	/* Warm-up, until every workload has got going */
+	workloads_wait_ready(workloads, number_of_workloads, WARMUP_TIMEOUT);
+
+	if (rate_sweep) {
+		run_rate_sweep(workloads, number_of_workloads, rate_sweep);
+		return 0;
+	}
+	if (dvfs_sweep) {
+		run_dvfs_sweep(workloads, number_of_workloads);
+		return 0;
+	}
+	if (energy) {
+		run_energy(workloads, number_of_workloads);
+		return 0;
+	}
+
+	signal(SIGINT, stop_sampling);
+	signal(SIGTERM, stop_sampling);
+
+	if (telemetry) {
+		telemetry_count = telemetry_start(1);
+		if (!telemetry_count)
+			printf("No temperatures, clocks or voltages in sysfs\n");
+		telemetry_take(telemetry_values);
+	}
 
-	s1 = s2 = 0;
+	/* for the snapshots of SIGUSR1 and SIGUSR2 and for --metrics */
+	metrics_workloads = workloads;
+	metrics_count = number_of_workloads;
+	metrics_mb_per_s = calloc(number_of_workloads, sizeof(double));
+	assert(metrics_mb_per_s);
+	metrics_add(memspeed_metrics, NULL);
+	if (telemetry_count)
+		metrics_add(telemetry_metrics, NULL);
+	if (metrics) {
+		if (metrics_http_start(metrics)) {
+			printf("Can't serve --metrics on '%s'\n", metrics);
+			exit(1);
+		}
+	}
+	if (getenv("LIMA_STATUS")) {
+		status_add("workloads", memspeed_status, NULL);
+		if (status_start(getenv("LIMA_STATUS"), "lima-memspeed"))
+			printf("Can't publish the status in %s\n",
+			       getenv("LIMA_STATUS"));
+	}
+
+	if (time_series) {
+		fprintf(time_series, "time");
+		for (i = 0; i < number_of_workloads; i++)
+			fprintf(time_series, ",%s", workloads[i].name);
+		fprintf(time_series, ",total");
+		for (i = 0; i < telemetry_count; i++)
+			fprintf(time_series, ",%s %s", telemetry_values[i].name,
+				telemetry_values[i].unit);
+		fprintf(time_series, "\n");
+	}
+
+	printf("%8s", "time");
+	for (i = 0; i < number_of_workloads; i++)
+		printf(" %*s", column_width(&workloads[i]), workloads[i].name);
+	printf(" %10s\n", "total MB/s");
+
+	series = calloc(number_of_workloads + 1, sizeof(*series));
+	assert(series);
 	n = 0;
+	start = gettime();
+
+	for (i = 0; i < number_of_workloads; i++)
+		bytes1[i] = workload_get_bytes(&workloads[i]);
+	if (pmu) {
+		pmu_start = calloc(number_of_workloads, sizeof(*pmu_start));
+		assert(pmu_start);
+		for (i = 0; i < number_of_workloads; i++)
+			pmu_read(workloads[i].pmu_fd, pmu_start[i]);
+	}
+	dram_counters_read(dram_start);
+	memcpy(dram1, dram_start, sizeof(dram1));
+	t1 = start;
 
-	/* Do the bandwidth measurements (infinite loop) */
+	/*
+	 * Sample every workload every interval, until the total converges
+	 * or, with --continuous, until interrupted
+	 */
 	while (1) {
-		/* Save time and the bandwidth counters */
-		pthread_mutex_lock(&bandwidth_counters_mutex);
-		t1 = gettime();
-		bytes1 = 0;
-		for (i = 0; i < number_of_workloads; i++) {
-			bytes1 += workloads[i].bytes_counter;
-		}
-		pthread_mutex_unlock(&bandwidth_counters_mutex);
+		double bw[number_of_workloads + 1];
 
-		printf(".");
-		fflush(stdout);
-		sleep(2);
+		sleep_seconds(interval);
 
-		pthread_mutex_lock(&bandwidth_counters_mutex);
 		t2 = gettime();
-		bytes2 = 0;
+		bw[number_of_workloads] = 0;
 		for (i = 0; i < number_of_workloads; i++) {
-			bytes2 += workloads[i].bytes_counter;
+			bytes2[i] = workload_get_bytes(&workloads[i]);
+			bw[i] = (bytes2[i] - bytes1[i]) / (t2 - t1) / 1000000.;
+			bw[number_of_workloads] += bw[i];
+			bytes1[i] = bytes2[i];
+			metrics_mb_per_s[i] = bw[i];
 		}
-		pthread_mutex_unlock(&bandwidth_counters_mutex);
 
-		double bw = (bytes2 - bytes1) / (t2 - t1) / 1000000.;
+		if (n % SAMPLES_CHUNK == 0) {
+			for (i = 0; i <= number_of_workloads; i++) {
+				series[i] = realloc(series[i], (n + SAMPLES_CHUNK) *
+						    sizeof(double));
+				assert(series[i]);
+			}
+			keep = realloc(keep, n + SAMPLES_CHUNK);
+			assert(keep);
+		}
+		for (i = 0; i <= number_of_workloads; i++)
+			series[i][n] = bw[i];
 
 		n++;
-		s1 += bw;
-		s2 += bw * bw;
-		
-		if (n >= 3) {
-			double stddev = sqrt((n * s2 - s1 * s1) / (n * (n - 1)));
-			double sem = stddev / sqrt(n);
-
-			if (sem < (s1 / n) * 0.002)
-				break;
+		metrics_samples = n;
+		select_samples(series[number_of_workloads], n, keep,
+			       &selection);
+
+		printf("%6.1f s", t2 - start);
+		for (i = 0; i < number_of_workloads; i++)
+			printf(" %*.1f", column_width(&workloads[i]), bw[i]);
+		printf(" %10.1f\n", bw[number_of_workloads]);
+		fflush(stdout);
+
+		if (dram_count) {
+			double dram_total = 0;
+
+			dram_counters_read(dram2);
+			printf("%8s", "dram");
+			for (i = 0; i < dram_count; i++) {
+				dram_bw[i] = (dram2[i] - dram1[i]) / (t2 - t1) /
+					     1000000.;
+				dram_total += dram_bw[i];
+				printf(" %s %.1f", dram_counter_name(i),
+				       dram_bw[i]);
+				dram1[i] = dram2[i];
+			}
+			printf(", %.1f MB/s\n", dram_total);
+			fflush(stdout);
+		}
+
+		if (telemetry_count) {
+			double watts;
+
+			telemetry_take(telemetry_values);
+			telemetry_print(stdout, "     soc", telemetry_values,
+					telemetry_count);
+			/* the mean power of the sample, next to its MB/s */
+			watts = telemetry_input_watts(telemetry_values,
+						      telemetry_count);
+			if (watts > 0)
+				printf("%8s %.3f W, %.1f MB/J\n", "energy", watts,
+				       bw[number_of_workloads] / watts);
+			fflush(stdout);
 		}
 
-		if (n >= 15)
+		if (time_series) {
+			fprintf(time_series, "%.3f", t2 - start);
+			for (i = 0; i <= number_of_workloads; i++)
+				fprintf(time_series, ",%.1f", bw[i]);
+			for (i = 0; i < telemetry_count; i++)
+				fprintf(time_series, ",%.3f",
+					telemetry_values[i].last);
+			fprintf(time_series, "\n");
+			fflush(time_series);
+		}
+		if (json) {
+			fprintf(json, "{\"type\": \"sample\", \"time\": %.3f, "
+				"\"sample\": %d, \"seconds\": %.3f, "
+				"\"mb_per_s\": %.1f, \"workloads\": [",
+				json_time(), n, t2 - t1, bw[number_of_workloads]);
+			for (i = 0; i < number_of_workloads; i++)
+				fprintf(json, "%s%.1f", i ? ", " : "", bw[i]);
+			fprintf(json, "]");
+			if (dram_count) {
+				fprintf(json, ", \"dram\": {");
+				for (i = 0; i < dram_count; i++)
+					fprintf(json, "%s\"%s\": %.1f",
+						i ? ", " : "",
+						dram_counter_name(i),
+						dram_bw[i]);
+				fprintf(json, "}");
+			}
+			if (telemetry_count)
+				telemetry_print_json(json, telemetry_values,
+						     telemetry_count);
+			fprintf(json, "}\n");
+			fflush(json);
+		}
+		t1 = t2;
+
+		if (stop_requested)
+			break;
+		if (continuous)
+			continue;
+
+		if (t2 - start >= max_time)
+			break;
+		if (t2 - start >= min_time && selection.steady &&
+		    selection.kept >= SAMPLE_MIN_KEPT &&
+		    selection.ci < selection.mean * SAMPLE_PRECISION)
 			break;
 	}
 
+	printf("\n%d samples, %d of them warm-up%s, %d outliers left out\n",
+	       n, selection.first, selection.steady ? "" :
+	       " (no steady state, all of them count)", selection.outliers);
+	printf("%-30s %10s %10s %10s %10s %8s\n", "workload", "min", "median",
+	       "max", "mean MB/s", "95% CI");
+	for (i = 0; i <= number_of_workloads; i++)
+		print_sample_stats(i < number_of_workloads ?
+				   workloads[i].name : "total", series[i],
+				   keep, n);
+
 	printf("\n");
-	printf("Total combined memory bandwidth: %.1f MB/s\n", (s1 / n));
+	for (i = 0; i < number_of_workloads; i++) {
+		if (workloads[i].thread_func == latency_thread)
+			print_latency_stats(&workloads[i]);
+		print_pattern_stats(&workloads[i], series[i], keep, n);
+		if (workloads[i].thread_func == coherency_thread)
+			print_coherency_stats(&workloads[i]);
+		if (workloads[i].thread_func == gpu_write_thread ||
+		    workloads[i].thread_func == gpu_copy_thread ||
+		    workloads[i].thread_func == gpu_pingpong_thread ||
+		    workloads[i].thread_func == gpu_blend_thread ||
+		    workloads[i].thread_func == gpu_sampler_thread ||
+		    workloads[i].thread_func == gpu_scatter_thread ||
+		    workloads[i].thread_func == gpu_vertex_thread)
+			print_gpu_job_stats(&workloads[i]);
+		if (workloads[i].thread_func == gpu_blend_thread)
+			print_gpu_blend_stats(&workloads[i]);
+		if (workloads[i].thread_func == gpu_scatter_thread)
+			print_gpu_scatter_stats(&workloads[i]);
+		if (workloads[i].thread_func == gpu_vertex_thread)
+			print_gpu_vertex_stats(&workloads[i]);
+	}
+	if (pmu) {
+		printf("\n");
+		pmu_print_header();
+		for (i = 0; i < number_of_workloads; i++) {
+			int j;
+
+			pmu_read(workloads[i].pmu_fd, pmu_end);
+			for (j = 0; j < PMU_EVENTS; j++)
+				pmu_end[j] -= pmu_start[i][j];
+			pmu_print(workloads[i].name, workloads[i].pmu_fd,
+				  pmu_end);
+		}
+		printf("\n");
+	}
+	printf("Total combined memory bandwidth: %.1f MB/s +- %.1f (95%%)\n",
+	       selection.mean, selection.ci);
+	if (dram_count) {
+		dram_counters_read(dram2);
+		printf("Dram controller counters:");
+		for (i = 0; i < dram_count; i++)
+			printf(" %s %.1f", dram_counter_name(i),
+			       (dram2[i] - dram_start[i]) / (t1 - start) /
+			       1000000.);
+		printf(" MB/s\n");
+	}
+	if (json) {
+		fprintf(json, "{\"type\": \"result\", \"time\": %.3f, "
+			"\"samples\": %d, \"warmup\": %d, \"outliers\": %d, "
+			"\"steady\": %s, \"mb_per_s\": %.1f, \"ci95\": %.1f}\n",
+			json_time(), n, selection.first, selection.outliers,
+			selection.steady ? "true" : "false", selection.mean,
+			selection.ci);
+		fflush(json);
+	}
+	if (time_series)
+		fclose(time_series);
 
 	return 0;
 }
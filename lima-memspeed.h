@@ -24,24 +24,96 @@
 #ifndef LIMA_MEMSPEED_H
 #define LIMA_MEMSPEED_H
 
+#include <stdint.h>
 #include <pthread.h>
+#include "memspeed_pmu.h"
 
-extern pthread_mutex_t bandwidth_counters_mutex;
+#define CACHE_LINE_SIZE 64
 
 double gettime(void);
 
+struct workload_t;
+void workload_pace(struct workload_t *w, uint64_t bytes);
+void workload_wait_resumed(struct workload_t *w);
+
 typedef struct workload_t
 {
 	const char *name;
 	const char *description;
 
-	double bytes_counter;
+	/*
+	 * Only updated by the workload thread and read by the sampling loop
+	 * without any locking. Keep it in its own cache line, so that
+	 * the threads don't disturb each other.
+	 */
+	uint64_t bytes_counter __attribute__((aligned(CACHE_LINE_SIZE)));
+	/* Set with the first bytes, see workloads_wait_ready() */
+	int ready;
 
 	void *(*thread_func)(void *);
 	pthread_t thread_id;
 
 	void *extra_data;
 	int size_multiplier;
-} workload_t;
+
+	/* The buffer of a CPU or latency workload, workload_buffer_size if 0 */
+	size_t buffer_size;
+
+	/* The AT_HWCAP bits which the CPU needs to have for this workload */
+	unsigned long hwcap;
+
+	/*
+	 * The target rate in bytes per second (0 runs flat out), set by the
+	 * main thread, and the token bucket of the workload thread which
+	 * keeps it to that rate.
+	 */
+	uint64_t rate;
+	uint64_t paced_rate;
+	double tokens;
+	double last_time;
+
+	/* Set by the main thread to hold the workload at its next bytes */
+	int paused;
+
+	/* The perf events of the thread, with --pmu */
+	int pmu_fd[PMU_EVENTS];
+} __attribute__((aligned(CACHE_LINE_SIZE))) workload_t;
+
+static inline void workload_set_ready(workload_t *w)
+{
+	if (!__atomic_load_n(&w->ready, __ATOMIC_RELAXED))
+		__atomic_store_n(&w->ready, 1, __ATOMIC_RELEASE);
+}
+
+static inline void workload_add_bytes(workload_t *w, uint64_t bytes)
+{
+	__atomic_fetch_add(&w->bytes_counter, bytes, __ATOMIC_RELAXED);
+	workload_set_ready(w);
+	if (__atomic_load_n(&w->rate, __ATOMIC_RELAXED))
+		workload_pace(w, bytes);
+	if (__atomic_load_n(&w->paused, __ATOMIC_RELAXED))
+		workload_wait_resumed(w);
+}
+
+static inline void workload_set_rate(workload_t *w, uint64_t rate)
+{
+	__atomic_store_n(&w->rate, rate, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t workload_get_rate(workload_t *w)
+{
+	return __atomic_load_n(&w->rate, __ATOMIC_RELAXED);
+}
+
+static inline void workload_set_bytes(workload_t *w, uint64_t bytes)
+{
+	__atomic_store_n(&w->bytes_counter, bytes, __ATOMIC_RELAXED);
+	workload_set_ready(w);
+}
+
+static inline uint64_t workload_get_bytes(workload_t *w)
+{
+	return __atomic_load_n(&w->bytes_counter, __ATOMIC_RELAXED);
+}
 
 #endif
@@ -30,9 +30,35 @@
 #include <fcntl.h>
 #include <linux/fb.h>
 #include "load_mali_kernel_module.h"
+#include "memtester_gpu.h"
+#include "lima-memspeed.h"
+#include "memspeed_fb.h"
+#include "memspeed_workloads.h"
+#include "memspeed_telemetry.h"
+#include "memspeed_baseline.h"
+#include "memspeed_dvfs.h"
+#include "metrics_http.h"
+#include "status_shm.h"
+#include "trace.h"
+#include "memtester-4.3.0/types.h"
+#include "memtester-4.3.0/memtester.h"
 
-int textured_cube_main(void);
+/* How often the bandwidth of the --load workloads gets printed */
+#define LOAD_REPORT_INTERVAL 10
+
+/* How long the gpu and the --load workloads get to start up */
+#define READY_TIMEOUT 10
+
+/* How often the temperatures get sampled for --metrics alone */
+#define METRICS_TELEMETRY_INTERVAL 5
+
+int textured_cube_main(const char *profile_name);
+int textured_cube_wait_ready(double timeout);
+void textured_cube_metrics(FILE *f, void *data);
+void textured_cube_status(status_t *status, void *data);
+int textured_cube_stalls(void);
 int memtester_main(int argc, char *argv[]);
+unsigned long long error_histogram_words(void);
 
 void *fb_unblank_thread(void *data)
 {
@@ -51,9 +77,36 @@ void *fb_unblank_thread(void *data)
 	return 0;
 }
 
+/*
+ * Create a thread placed as the given environment variable says, in the
+ * MEMTESTER_SCHED format, or with the default attributes if it is not
+ * set or the kernel doesn't allow it.
+ */
+static void start_thread(pthread_t *thread, const char *env,
+			 void *(*func)(void *), void *arg)
+{
+	const char *spec = getenv(env);
+	pthread_attr_t attr;
+	int ret;
+
+	if (spec) {
+		if (memtester_thread_attr(spec, &attr)) {
+			printf("bad %s %s, should be "
+			       "cpus[:other|fifo|rr[:priority]]\n", env, spec);
+			exit(1);
+		}
+		ret = pthread_create(thread, &attr, func, arg);
+		pthread_attr_destroy(&attr);
+		if (ret == 0)
+			return;
+		printf("failed to apply %s: %s\n", env, strerror(ret));
+	}
+	pthread_create(thread, NULL, func, arg);
+}
+
 static void *lima_thread(void *threadid)
 {
-	textured_cube_main();
+	textured_cube_main(NULL);
 	/* If we reach here, something bad has happened */
 	abort();
 	return NULL;
@@ -64,25 +117,402 @@ static void start_lima_thread(void)
 	pthread_t th1, th2;
 
 	load_mali_kernel_module();
-	pthread_create(&th1, NULL, lima_thread, NULL);
-	pthread_create(&th2, NULL, fb_unblank_thread, NULL);
+	/* The render threads of limare inherit the placement of lima_thread */
+	start_thread(&th1, "LIMA_SCHED_GPU", lima_thread, NULL);
+	start_thread(&th2, "LIMA_SCHED_FB", fb_unblank_thread, NULL);
 
-	/* Wait a bit and let lima stop spamming to the console */
-	usleep(300000);
+	/* Wait for the first frame, lima has stopped spamming the console then */
+	if (!textured_cube_wait_ready(READY_TIMEOUT))
+		printf("lima: no frame after %d seconds, going on\n",
+		       READY_TIMEOUT);
 
 	printf("\n");
 }
 
+static void memtester_trace_test(const char *name, int begin)
+{
+	limare_trace(name, begin ? LIMARE_TRACE_BEGIN : LIMARE_TRACE_END, 0);
+}
+
+static int telemetry_count;
+static int dvfs_count;
+
+static void memtester_telemetry(FILE *json)
+{
+	telemetry_value_t values[TELEMETRY_SOURCES_MAX];
+
+	if (telemetry_count) {
+		telemetry_take(values);
+		telemetry_print(stdout, "  Telemetry:", values,
+				telemetry_count);
+		if (json)
+			telemetry_print_json(json, values, telemetry_count);
+	}
+	if (dvfs_count) {
+		dvfs_print(stdout, "  DVFS");
+		if (json)
+			dvfs_print_json(json);
+	}
+}
+
+/*
+ * With LIMA_TELEMETRY=SECONDS, sample the SoC temperatures, clocks and
+ * voltages at that interval, and report them with every memtester loop.
+ */
+static void start_telemetry(void)
+{
+	const char *env = getenv("LIMA_TELEMETRY");
+	double interval = env ? atof(env) : 0;
+
+	if (interval <= 0)
+		return;
+	telemetry_count = telemetry_start(interval);
+	if (telemetry_count)
+		memtester_loop_telemetry = memtester_telemetry;
+	else
+		printf("LIMA_TELEMETRY: no temperatures, clocks or voltages "
+		       "in sysfs\n");
+}
+
+static workload_t *load_workloads;
+static int load_count;
+/* of the last report, for the metrics */
+static double *load_mb_per_s;
+
+/*
+ * Parse the comma separated list of lima-memspeed workloads, given with
+ * --load, into load_workloads. Exits with the list of the supported ones
+ * on an unknown name. --load=@FILE takes the list from the first line of
+ * FILE, such as the peak mix which lima-memspeed --find-max saves.
+ */
+static void parse_load(const char *spec)
+{
+	static char list[1024];
+	int i, n = 1;
+	const char *p;
+
+	if (spec[0] == '@') {
+		FILE *f = fopen(spec + 1, "r");
+
+		if (!f || !fgets(list, sizeof(list), f)) {
+			printf("Can't read the --load list from '%s'\n",
+			       spec + 1);
+			exit(1);
+		}
+		fclose(f);
+		list[strcspn(list, " \t\r\n")] = 0;
+		spec = list;
+	}
+
+	for (p = spec; *p; p++)
+		if (*p == ',')
+			n++;
+	if (posix_memalign((void **)&load_workloads, CACHE_LINE_SIZE,
+			   n * sizeof(workload_t)) != 0) {
+		assert(0);
+	}
+	memset(load_workloads, 0, n * sizeof(workload_t));
+	load_mb_per_s = calloc(n, sizeof(double));
+	assert(load_mb_per_s);
+
+	for (p = spec; *p; ) {
+		size_t len = strcspn(p, ",");
+		workload_t *w = workload_find(p, len);
+
+		/* The unblank thread would fight with fb_blank */
+		if (!w || w->thread_func == fb_blank_thread) {
+			printf("Unknown --load workload '%.*s', available are:\n",
+			       (int)len, p);
+			for (i = 0; i < workloads_count; i++)
+				if (workload_is_supported(&workloads_list[i]) &&
+				    workloads_list[i].thread_func != fb_blank_thread)
+					printf("\t%s\n", workloads_list[i].name);
+			exit(1);
+		}
+		load_workloads[load_count++] = *w;
+		p += len;
+		if (*p == ',')
+			p++;
+	}
+}
+
+static void *load_report_thread(void *data)
+{
+	uint64_t bytes1[load_count], bytes2;
+	double t1, t2;
+	int i;
+
+	for (i = 0; i < load_count; i++)
+		bytes1[i] = workload_get_bytes(&load_workloads[i]);
+	t1 = gettime();
+
+	while (1) {
+		sleep(LOAD_REPORT_INTERVAL);
+		t2 = gettime();
+		printf("load:");
+		for (i = 0; i < load_count; i++) {
+			bytes2 = workload_get_bytes(&load_workloads[i]);
+			load_mb_per_s[i] = (bytes2 - bytes1[i]) / (t2 - t1) /
+					   1000000.;
+			printf("%s %s %.1f MB/s", i ? "," : "",
+			       load_workloads[i].name, load_mb_per_s[i]);
+			bytes1[i] = bytes2;
+		}
+		printf("\n");
+		fflush(stdout);
+		t1 = t2;
+	}
+
+	return NULL;
+}
+
+static void start_load_threads(void)
+{
+	pthread_t th;
+	int i;
+
+	for (i = 0; i < load_count; i++) {
+		printf("Starting '%s' load thread\n", load_workloads[i].name);
+		start_thread(&load_workloads[i].thread_id, "LIMA_SCHED_LOAD",
+			     load_workloads[i].thread_func, &load_workloads[i]);
+	}
+	workloads_wait_ready(load_workloads, load_count, READY_TIMEOUT);
+	start_thread(&th, "LIMA_SCHED_LOAD", load_report_thread, NULL);
+}
+
+static double dvfs_load_bytes(void)
+{
+	double bytes = 0;
+	int i;
+
+	for (i = 0; i < load_count; i++)
+		bytes += workload_get_bytes(&load_workloads[i]);
+	return bytes;
+}
+
+static double dvfs_failures(void)
+{
+	return error_histogram_words() + textured_cube_stalls();
+}
+
+/*
+ * With LIMA_DVFS=SECONDS[:random], step the cpu, gpu and dram operating
+ * points, one domain every SECONDS, up and down or at random, while the
+ * tests and the gpu run. After every memtester loop the transitions of
+ * every domain get reported, with how many of them failing words or gpu
+ * stalls followed, and the time, the --load MB/s and the failures at
+ * each operating point.
+ */
+static void start_dvfs(void)
+{
+	const char *env = getenv("LIMA_DVFS");
+	double interval = env ? atof(env) : 0;
+
+	if (interval <= 0)
+		return;
+	dvfs_count = dvfs_start(interval, strstr(env, ":random") != NULL,
+				load_count ? dvfs_load_bytes : NULL,
+				dvfs_failures);
+	if (dvfs_count)
+		memtester_loop_telemetry = memtester_telemetry;
+	else
+		printf("LIMA_DVFS: no cpufreq or devfreq operating points that "
+		       "may be changed\n");
+}
+
+static void load_metrics(FILE *f, void *data)
+{
+	int i;
+
+	fprintf(f, "# HELP lima_load_bytes_total Bytes moved by the --load "
+		"workloads\n# TYPE lima_load_bytes_total counter\n");
+	for (i = 0; i < load_count; i++)
+		fprintf(f, "lima_load_bytes_total{workload=\"%s\"} %llu\n",
+			load_workloads[i].name, (unsigned long long)
+			workload_get_bytes(&load_workloads[i]));
+	fprintf(f, "# HELP lima_load_mb_per_s Bandwidth of the --load "
+		"workloads in the last report\n"
+		"# TYPE lima_load_mb_per_s gauge\n");
+	for (i = 0; i < load_count; i++)
+		fprintf(f, "lima_load_mb_per_s{workload=\"%s\"} %.1f\n",
+			load_workloads[i].name, load_mb_per_s[i]);
+}
+
+/*
+ * The state of the memtester, the frame statistics, the bandwidth of the
+ * --load workloads and the telemetry go to the snapshots of SIGUSR1 and
+ * SIGUSR2, and with --metrics=[ADDRESS:]PORT also to Prometheus, from
+ * http://ADDRESS:PORT/metrics.
+ */
+static void start_metrics(const char *spec, int gpu)
+{
+	metrics_add(memtester_metrics, NULL);
+	if (gpu)
+		metrics_add(textured_cube_metrics, NULL);
+	if (load_count)
+		metrics_add(load_metrics, NULL);
+	if (telemetry_count ||
+	    (spec && telemetry_start(METRICS_TELEMETRY_INTERVAL)))
+		metrics_add(telemetry_metrics, NULL);
+	if (!spec)
+		return;
+	if (metrics_http_start(spec)) {
+		printf("Can't serve --metrics on '%s'\n", spec);
+		exit(1);
+	}
+	printf("Serving metrics on port %s\n", strrchr(spec, ':') ?
+	       strrchr(spec, ':') + 1 : spec);
+}
+
+static void memtester_status(status_t *status, void *data)
+{
+	unsigned long loop, failures;
+	unsigned long long bytes;
+	const char *test;
+
+	memtester_progress(&loop, &test, &bytes, &failures);
+	snprintf(status->state, sizeof(status->state), "loop %lu: %s", loop,
+		 test ? test : "starting");
+	status->progress = loop;
+	status->bytes = bytes;
+	status->errors = failures;
+}
+
+static void load_status(status_t *status, void *data)
+{
+	int i;
+
+	snprintf(status->state, sizeof(status->state), "%d workloads",
+		 load_count);
+	for (i = 0; i < load_count; i++)
+		status->bytes += workload_get_bytes(&load_workloads[i]);
+}
+
+/*
+ * With LIMA_STATUS=NAME, publish the memtester, the gpu and the --load
+ * workloads in the shared status segment /dev/shm/NAME, for
+ * lima-supervisor to follow.
+ */
+static void start_status(int gpu)
+{
+	const char *spec = getenv("LIMA_STATUS");
+
+	if (!spec)
+		return;
+	status_add("memtester", memtester_status, NULL);
+	if (gpu)
+		status_add("gpu", textured_cube_status, NULL);
+	if (load_count)
+		status_add("load", load_status, NULL);
+	if (status_start(spec, "lima-memtester"))
+		printf("Can't publish the status in %s\n", spec);
+}
+
+/*
+ * The "lima-memspeed --probe" profile of the board, which has the gpu
+ * stress profile unless LIMA_STRESS_PROFILE says otherwise, the --load
+ * workloads tuned and memtester running as many threads as saturate
+ * the memory, unless there is a -t already.
+ */
+static char **use_profile(int *argc, char **argv, int bench)
+{
+	baseline_profile_t profile;
+	const char *path = baseline_profile_find(&profile);
+	static char threads[16];
+	char **args;
+	int i;
+
+	if (!path)
+		return argv;
+	printf("Using the profile %s\n", path);
+	if (profile.prefetch)
+		workload_prefetch = profile.prefetch;
+	if (profile.unroll)
+		workload_unroll = profile.unroll;
+	if (profile.buffer_size)
+		workload_buffer_size = profile.buffer_size;
+	if (profile.stress_profile[0])
+		setenv("LIMA_STRESS_PROFILE", profile.stress_profile, 0);
+
+	if (bench || profile.threads <= 1)
+		return argv;
+	for (i = 1; i < *argc; i++)
+		if (strncmp(argv[i], "-t", 2) == 0)
+			return argv;
+	args = malloc((*argc + 3) * sizeof(char *));
+	assert(args);
+	snprintf(threads, sizeof(threads), "%d", profile.threads);
+	args[0] = argv[0];
+	args[1] = "-t";
+	args[2] = threads;
+	memcpy(args + 3, argv + 1, *argc * sizeof(char *));
+	*argc += 2;
+	return args;
+}
+
 int main (int argc, char *argv[])
 {
+	const char *metrics = NULL;
+	int i, j, bench = 0;
+
 	printf("This is a simple textured cube demo from the lima driver and\n");
 	printf("a memtester. Both combined in a single program. The mali400\n");
 	printf("hardware is only used to stress RAM in the background. But\n");
 	printf("this happens to significantly increase chances of exposing\n");
 	printf("memory stability related problems.\n\n");
 
+	/* before any other thread, which would take the signals instead */
+	metrics_snapshot_start(getenv("LIMA_SNAPSHOT"));
+
+	limare_trace_init();
+	if (limare_trace_enabled)
+		memtester_trace = memtester_trace_test;
+
+	/* Take --load out of the arguments before memtester sees them */
+	for (i = j = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--load") == 0 && i + 1 < argc)
+			parse_load(argv[++i]);
+		else if (strncmp(argv[i], "--load=", 7) == 0)
+			parse_load(argv[i] + 7);
+		else if (strcmp(argv[i], "--mali-memory") == 0)
+			memtester_gpu_memory = memtester_gpu_memory_map;
+		else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc)
+			metrics = argv[++i];
+		else if (strncmp(argv[i], "--metrics=", 10) == 0)
+			metrics = argv[i] + 10;
+		else {
+			/*
+			 * a scrubber in service leaves the gpu alone too, and
+			 * decoding a journal tests nothing at all
+			 */
+			if (strcmp(argv[i], "--bench") == 0 ||
+			    strncmp(argv[i], "--scrub", 7) == 0 ||
+			    strncmp(argv[i], "--decode-journal", 16) == 0)
+				bench = 1;
+			argv[j++] = argv[i];
+		}
+	}
+	argc = j;
+	argv[argc] = NULL;
 	if (argc > 1)
+		argv = use_profile(&argc, argv, bench);
+
+	/*
+	 * --bench times the cpu kernels, and --scrub runs on a machine in
+	 * service, both with nothing in the background, and
+	 * --decode-journal only prints a journal and exits
+	 */
+	if (argc > 1 && !bench) {
 		start_lima_thread();
+		start_load_threads();
+		start_telemetry();
+		start_dvfs();
+	}
+	start_metrics(metrics, argc > 1 && !bench);
+	start_status(argc > 1 && !bench);
+
+	/* only used when MEMTESTER_GPU_SHARE is set */
+	memtester_gpu_share = memtester_gpu_share_start;
 
 	memtester_main(argc, argv);
 
@@ -0,0 +1,540 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Runs lima-memtester, lima-memspeed and lima-textured-cube, or anything
+ * else, as processes of their own, each on its own cpus and with its own
+ * restart policy, and follows all of them in one timeline, through the
+ * status segment that they publish in (see status_shm.c). A process which
+ * crashes or hangs only takes its own workload with it, and the workloads
+ * don't share the locks and cache lines of a single process.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "status_shm.h"
+
+#define SUPERVISOR_INTERVAL	5.0	/* seconds between two timeline rows */
+#define SUPERVISOR_POLL		0.1
+#define RESTART_DELAY		1.0	/* doubling while a job keeps failing */
+#define RESTART_DELAY_MAX	60.0
+#define RESTART_QUICK		10.0	/* a job that ran less failed quickly */
+#define STALE_TIME		5.0	/* without an update, a slot is stale */
+#define STALE_PROGRESS		60.0	/* or without any progress */
+#define STOP_TIMEOUT		5.0	/* before SIGTERM turns into SIGKILL */
+#define JOBS_MAX		16
+
+enum { RESTART_NEVER, RESTART_FAILURE, RESTART_ALWAYS };
+
+static const char *restart_names[] = { "never", "failure", "always" };
+
+typedef struct {
+	char **argv;
+	cpu_set_t cpus;
+	int pinned;
+	int restart;
+	const char *log;
+
+	pid_t pid;		/* 0 when it isn't running */
+	double started;
+	double restart_at;	/* 0 unless a restart is due */
+	double delay;
+	int restarts;
+	int failed;		/* the last run did */
+} job_t;
+
+static job_t jobs[JOBS_MAX];
+static int jobs_count;
+
+static status_segment_t *segment;
+static double start_time;
+static FILE *json;
+static volatile sig_atomic_t stopping;
+static double stale_progress = STALE_PROGRESS;
+
+/*
+ * What the last row saw of every slot, for the rate of its progress, and
+ * when anything of it last moved: the writers publish from a thread of
+ * their own, which keeps updating while the rest of the process hangs.
+ */
+static int last_pid[STATUS_SLOTS];
+static unsigned long long last_progress[STATUS_SLOTS];
+static unsigned long long last_bytes[STATUS_SLOTS];
+static unsigned long long last_errors[STATUS_SLOTS];
+static char last_state[STATUS_SLOTS][32];
+static double last_time[STATUS_SLOTS];
+static double last_moved[STATUS_SLOTS];
+
+static double gettime(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + 0.000000001 * t.tv_nsec;
+}
+
+static void stop(int sig)
+{
+	stopping = 1;
+}
+
+/* "0-1,3" style, as in /sys/devices/system/cpu/online */
+static int parse_cpus(const char *spec, cpu_set_t *cpus)
+{
+	unsigned long lo, hi;
+	char *end;
+
+	CPU_ZERO(cpus);
+	while (*spec) {
+		lo = hi = strtoul(spec, &end, 10);
+		if (end == spec)
+			return -1;
+		if (*end == '-') {
+			spec = end + 1;
+			hi = strtoul(spec, &end, 10);
+			if (end == spec || hi < lo)
+				return -1;
+		}
+		if (hi >= CPU_SETSIZE)
+			return -1;
+		for (; lo <= hi; lo++)
+			CPU_SET(lo, cpus);
+		spec = end;
+		if (*spec == ',')
+			spec++;
+		else if (*spec)
+			return -1;
+	}
+	return CPU_COUNT(cpus) ? 0 : -1;
+}
+
+/* A json string, quoted, of a command line or of what a slot says */
+static void json_string(const char *s)
+{
+	fputc('"', json);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(json, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(json, "\\u%04x", *s);
+		else
+			fputc(*s, json);
+	}
+	fputc('"', json);
+}
+
+static void event(job_t *job, const char *what)
+{
+	double t = gettime() - start_time;
+
+	printf("%8.1f s %s[%d] %s\n", t, job->argv[0], (int)job->pid, what);
+	fflush(stdout);
+	if (json) {
+		fprintf(json, "{\"type\": \"event\", \"time\": %.3f, "
+			"\"job\": %d, \"command\": ", t, (int)(job - jobs));
+		json_string(job->argv[0]);
+		fprintf(json, ", \"pid\": %d, \"event\": \"%s\"}\n",
+			(int)job->pid, what);
+		fflush(json);
+	}
+}
+
+static void start_job(job_t *job)
+{
+	int fd;
+
+	job->restart_at = 0;
+	job->started = gettime();
+	job->pid = fork();
+	if (job->pid < 0) {
+		job->pid = 0;
+		printf("Can't fork for %s: %s\n", job->argv[0],
+		       strerror(errno));
+		job->failed = 1;
+		return;
+	}
+	if (job->pid == 0) {
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		if (job->pinned &&
+		    sched_setaffinity(0, sizeof(job->cpus), &job->cpus) != 0)
+			fprintf(stderr, "Can't pin %s: %s\n", job->argv[0],
+				strerror(errno));
+		if (job->log) {
+			fd = open(job->log, O_WRONLY | O_CREAT | O_APPEND,
+				  0644);
+			if (fd >= 0) {
+				dup2(fd, STDOUT_FILENO);
+				dup2(fd, STDERR_FILENO);
+				close(fd);
+			}
+		}
+		execvp(job->argv[0], job->argv);
+		fprintf(stderr, "Can't run %s: %s\n", job->argv[0],
+			strerror(errno));
+		_exit(127);
+	}
+	event(job, job->restarts ? "restarted" : "started");
+}
+
+/* The job is gone, see whether and when it comes back */
+static void job_exited(job_t *job, int status)
+{
+	double now = gettime();
+	char what[64];
+
+	if (WIFSIGNALED(status))
+		snprintf(what, sizeof(what), "killed by signal %d",
+			 WTERMSIG(status));
+	else
+		snprintf(what, sizeof(what), "exited with %d",
+			 WEXITSTATUS(status));
+	/* being stopped by us is not a failure */
+	if (!stopping)
+		job->failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+	event(job, what);
+	status_release(segment, job->pid);
+	job->pid = 0;
+
+	if (stopping || job->restart == RESTART_NEVER ||
+	    (job->restart == RESTART_FAILURE && !job->failed))
+		return;
+
+	if (now - job->started < RESTART_QUICK) {
+		job->delay = job->delay ? job->delay * 2 : RESTART_DELAY;
+		if (job->delay > RESTART_DELAY_MAX)
+			job->delay = RESTART_DELAY_MAX;
+	} else {
+		job->delay = RESTART_DELAY;
+	}
+	job->restart_at = now + job->delay;
+	job->restarts++;
+}
+
+static void reap(void)
+{
+	int status, i;
+	pid_t pid;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (i = 0; i < jobs_count; i++)
+			if (jobs[i].pid == pid)
+				job_exited(&jobs[i], status);
+	}
+}
+
+/*
+ * One row of the timeline: every slot in the segment, with the rate of
+ * its progress and of its bytes since the last row, and the totals.
+ */
+static unsigned long long timeline(void)
+{
+	double now = gettime(), t = now - start_time, rate;
+	double total_mb_per_s = 0;
+	unsigned long long total_errors = 0;
+	status_slot_t slot;
+	char stale[48];
+	int i;
+
+	for (i = 0; i < STATUS_SLOTS; i++) {
+		if (status_read(segment, i, &slot)) {
+			last_pid[i] = 0;
+			continue;
+		}
+		slot.status.state[sizeof(slot.status.state) - 1] = 0;
+		rate = 0;
+		if (last_pid[i] == slot.pid && now > last_time[i] &&
+		    slot.status.progress >= last_progress[i])
+			rate = (slot.status.progress - last_progress[i]) /
+				(now - last_time[i]);
+		if (last_pid[i] != slot.pid ||
+		    slot.status.progress != last_progress[i] ||
+		    slot.status.bytes != last_bytes[i] ||
+		    slot.status.errors != last_errors[i] ||
+		    strcmp(slot.status.state, last_state[i]) != 0)
+			last_moved[i] = now;
+		last_pid[i] = slot.pid;
+		last_progress[i] = slot.status.progress;
+		last_bytes[i] = slot.status.bytes;
+		last_errors[i] = slot.status.errors;
+		strcpy(last_state[i], slot.status.state);
+		last_time[i] = now;
+
+		stale[0] = 0;
+		if (now - slot.updated > STALE_TIME)
+			snprintf(stale, sizeof(stale), ", stale for %.0f s",
+				 now - slot.updated);
+		else if (now - last_moved[i] >= stale_progress)
+			snprintf(stale, sizeof(stale),
+				 ", stale, no progress for %.0f s",
+				 now - last_moved[i]);
+		total_mb_per_s += slot.mb_per_s;
+		total_errors += slot.status.errors;
+
+		printf("%8.1f s %s[%d] %-10s %-32s %8.1f/s %10.1f MB/s "
+		       "%6llu errors%s\n", t, slot.tool, slot.pid, slot.name,
+		       slot.status.state, rate, slot.mb_per_s,
+		       slot.status.errors, stale);
+		if (!json)
+			continue;
+		slot.tool[sizeof(slot.tool) - 1] = 0;
+		slot.name[sizeof(slot.name) - 1] = 0;
+		fprintf(json, "{\"type\": \"status\", \"time\": %.3f, "
+			"\"tool\": ", t);
+		json_string(slot.tool);
+		fprintf(json, ", \"pid\": %d, \"name\": ", slot.pid);
+		json_string(slot.name);
+		fprintf(json, ", \"state\": ");
+		json_string(slot.status.state);
+		fprintf(json, ", \"progress\": %llu, \"rate\": %.2f, "
+			"\"bytes\": %llu, \"mb_per_s\": %.1f, "
+			"\"errors\": %llu, \"updated\": %.1f, "
+			"\"moved\": %.1f, \"stale\": %s}\n",
+			slot.status.progress, rate, slot.status.bytes,
+			slot.mb_per_s, slot.status.errors,
+			slot.updated - start_time, last_moved[i] - start_time,
+			stale[0] ? "true" : "false");
+	}
+	printf("%8.1f s total %.1f MB/s, %llu errors\n", t, total_mb_per_s,
+	       total_errors);
+	fflush(stdout);
+	if (json) {
+		fprintf(json, "{\"type\": \"total\", \"time\": %.3f, "
+			"\"mb_per_s\": %.1f, \"errors\": %llu}\n", t,
+			total_mb_per_s, total_errors);
+		fflush(json);
+	}
+	return total_errors;
+}
+
+static void shutdown_jobs(void)
+{
+	double deadline = gettime() + STOP_TIMEOUT;
+	int i, running;
+
+	stopping = 1;
+	for (i = 0; i < jobs_count; i++)
+		if (jobs[i].pid)
+			kill(jobs[i].pid, SIGTERM);
+	while (1) {
+		reap();
+		for (i = running = 0; i < jobs_count; i++)
+			running += jobs[i].pid != 0;
+		if (!running)
+			return;
+		if (gettime() > deadline) {
+			for (i = 0; i < jobs_count; i++)
+				if (jobs[i].pid)
+					kill(jobs[i].pid, SIGKILL);
+			deadline = gettime() + STOP_TIMEOUT;
+		}
+		usleep(SUPERVISOR_POLL * 1000000);
+	}
+}
+
+static void usage(void)
+{
+	printf("Usage: lima-supervisor [options] -- [job options] COMMAND "
+	       "[ARGS] [-- ...]\n\n");
+	printf("Runs every COMMAND as a process of its own, and prints what all\n");
+	printf("of them publish in the LIMA_STATUS segment as one timeline.\n\n");
+	printf("Options:\n");
+	printf("\t%-30s (%s)\n", "--status=NAME",
+	       "the segment, /dev/shm/NAME, lima-status-PID by default");
+	printf("\t%-30s (%s)\n", "--interval=SECONDS",
+	       "between two rows of the timeline, 5 by default");
+	printf("\t%-30s (%s)\n", "--json=FILE",
+	       "also write the timeline and the events to FILE");
+	printf("\t%-30s (%s)\n", "--stale=SECONDS",
+	       "flag a job without progress for that long, 60 by default");
+	printf("\nJob options:\n");
+	printf("\t%-30s (%s)\n", "--cpus=LIST",
+	       "pin the job to the cpus, as in 0-1,3");
+	printf("\t%-30s (%s)\n", "--restart=never|failure|always",
+	       "when to run it again, never by default");
+	printf("\t%-30s (%s)\n", "--log=FILE",
+	       "append its output to FILE instead of the terminal");
+	exit(1);
+}
+
+/* The job options, then the command up to the next "--" */
+static int parse_job(int argc, char **argv, int i)
+{
+	job_t *job = &jobs[jobs_count];
+	int j;
+
+	if (jobs_count == JOBS_MAX) {
+		printf("At most %d jobs\n", JOBS_MAX);
+		exit(1);
+	}
+	for (; i < argc && strncmp(argv[i], "--", 2) == 0 && argv[i][2]; i++) {
+		if (strncmp(argv[i], "--cpus=", 7) == 0) {
+			if (parse_cpus(argv[i] + 7, &job->cpus)) {
+				printf("Bad cpu list '%s'\n", argv[i] + 7);
+				exit(1);
+			}
+			job->pinned = 1;
+			continue;
+		}
+		if (strncmp(argv[i], "--restart=", 10) == 0) {
+			for (j = 0; j < 3; j++)
+				if (strcmp(argv[i] + 10, restart_names[j]) == 0)
+					job->restart = j;
+			if (strcmp(argv[i] + 10, restart_names[job->restart])) {
+				printf("Bad restart policy '%s'\n",
+				       argv[i] + 10);
+				exit(1);
+			}
+			continue;
+		}
+		if (strncmp(argv[i], "--log=", 6) == 0) {
+			job->log = argv[i] + 6;
+			continue;
+		}
+		printf("Unknown job option '%s'\n", argv[i]);
+		usage();
+	}
+	if (i == argc || strcmp(argv[i], "--") == 0) {
+		printf("A job without a command\n");
+		usage();
+	}
+	job->argv = argv + i;
+	for (; i < argc && strcmp(argv[i], "--") != 0; i++)
+		;
+	jobs_count++;
+	return i;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *name = NULL;
+	double interval = SUPERVISOR_INTERVAL, next, now;
+	unsigned long long errors = 0;
+	char default_name[32];
+	int i, running, failed = 0;
+
+	for (i = 1; i < argc && strcmp(argv[i], "--") != 0; i++) {
+		if (strncmp(argv[i], "--status=", 9) == 0) {
+			name = argv[i] + 9;
+			continue;
+		}
+		if (strncmp(argv[i], "--interval=", 11) == 0) {
+			interval = atof(argv[i] + 11);
+			if (interval <= 0)
+				usage();
+			continue;
+		}
+		if (strncmp(argv[i], "--stale=", 8) == 0) {
+			stale_progress = atof(argv[i] + 8);
+			if (stale_progress <= 0)
+				usage();
+			continue;
+		}
+		if (strncmp(argv[i], "--json=", 7) == 0) {
+			json = fopen(argv[i] + 7, "w");
+			if (!json) {
+				printf("Can't write to %s\n", argv[i] + 7);
+				exit(1);
+			}
+			continue;
+		}
+		printf("Unknown option '%s'\n", argv[i]);
+		usage();
+	}
+	while (i < argc) {
+		/* each job ends where the next "--" starts the one after */
+		argv[i] = NULL;
+		i = parse_job(argc, argv, i + 1);
+	}
+	if (!jobs_count)
+		usage();
+
+	if (!name) {
+		snprintf(default_name, sizeof(default_name), "lima-status-%d",
+			 (int)getpid());
+		name = default_name;
+	}
+	segment = status_open(name, 1);
+	if (!segment) {
+		printf("Can't map the status segment %s: %s\n", name,
+		       strerror(errno));
+		exit(1);
+	}
+	setenv("LIMA_STATUS", name, 1);
+	printf("Supervising %d jobs, the status is in /dev/shm/%s\n",
+	       jobs_count, name[0] == '/' ? name + 1 : name);
+	for (i = 0; i < jobs_count; i++)
+		printf("    job %d: %s, restart %s\n", i, jobs[i].argv[0],
+		       restart_names[jobs[i].restart]);
+
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+
+	start_time = gettime();
+	for (i = 0; i < jobs_count; i++)
+		start_job(&jobs[i]);
+	next = start_time + interval;
+
+	while (!stopping) {
+		reap();
+		now = gettime();
+		for (i = running = 0; i < jobs_count; i++) {
+			if (!jobs[i].pid && jobs[i].restart_at &&
+			    jobs[i].restart_at <= now)
+				start_job(&jobs[i]);
+			running += jobs[i].pid != 0 || jobs[i].restart_at;
+		}
+		if (!running)
+			break;
+		if (now >= next) {
+			errors = timeline();
+			next += interval;
+			if (next < now)
+				next = now + interval;
+		}
+		usleep(SUPERVISOR_POLL * 1000000);
+	}
+
+	if (stopping)
+		printf("Stopping the jobs\n");
+	/* what they got to, before they are gone */
+	errors = timeline();
+	shutdown_jobs();
+
+	if (name == default_name)
+		shm_unlink(name);
+	for (i = 0; i < jobs_count; i++)
+		failed |= jobs[i].failed;
+	return failed || errors ? 1 : 0;
+}
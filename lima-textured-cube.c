@@ -26,12 +26,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include "load_mali_kernel_module.h"
+#include "status_shm.h"
 
-int textured_cube_main(void);
+int textured_cube_main(const char *profile_name);
+void textured_cube_status(status_t *status, void *data);
 
 int main(int argc, char *argv[])
 {
+	const char *status = getenv("LIMA_STATUS");
+
 	load_mali_kernel_module();
-	textured_cube_main();
+	if (status) {
+		status_add("gpu", textured_cube_status, NULL);
+		if (status_start(status, "lima-textured-cube"))
+			printf("Can't publish the status in %s\n", status);
+	}
+	textured_cube_main(argc > 1 ? argv[1] : NULL);
 	return 0;
 }
@@ -50,6 +50,7 @@
 #define LIMA_TEXEL_FORMAT_RGB_888		0x15
 #define LIMA_TEXEL_FORMAT_RGBA_8888		0x16
 //#define LIMA_TEXEL_FORMAT_BGRA_8888             0x17 /* check ordering */
+#define LIMA_TEXEL_FORMAT_ETC1_RGB8		0x20
 #define LIMA_TEXEL_FORMAT_RGBA64		0x26
 #define LIMA_TEXEL_FORMAT_DEPTH_STENCIL_32	0x2C
 #define LIMA_TEXEL_FORMAT_INVALID		0x3F
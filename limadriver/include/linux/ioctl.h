@@ -44,6 +44,13 @@
 #define LIMA_GP_START_JOB_R2P1 _IOWR(LIMA_GP_IOC_BASE, LIMA_GP_IOC_START_JOB, struct lima_gp_job_start_r2p1 *)
 #define LIMA_GP_START_JOB_R3P0 _IOWR(LIMA_GP_IOC_BASE, LIMA_GP_IOC_START_JOB, struct lima_gp_job_start_r3p0 *)
 
+/* r3p0 dropped the abort ioctl, which shifted everything after it. */
+#define LIMA_GP_IOC_SUSPEND_RESPONSE_R2P1 0x04
+#define LIMA_GP_IOC_SUSPEND_RESPONSE_R3P0 0x03
+
+#define LIMA_GP_SUSPEND_RESPONSE_R2P1 _IOW(LIMA_GP_IOC_BASE, LIMA_GP_IOC_SUSPEND_RESPONSE_R2P1, struct lima_gp_suspend_response *)
+#define LIMA_GP_SUSPEND_RESPONSE_R3P0 _IOW(LIMA_GP_IOC_BASE, LIMA_GP_IOC_SUSPEND_RESPONSE_R3P0, struct lima_gp_suspend_response *)
+
 
 /*
  *
@@ -94,6 +101,22 @@ struct lima_gp_job_start_r3p0 {
 	unsigned int flush_id;
 };
 
+/*
+ * GP Suspend response, for when the plbu ran out of tile heap.
+ */
+
+enum lima_gp_suspend_response_code {
+	LIMA_GP_JOB_ABORT,
+	LIMA_GP_JOB_RESUME_WITH_NEW_HEAP,
+};
+
+struct lima_gp_suspend_response {
+	unsigned int fd;
+	unsigned int cookie;
+	enum lima_gp_suspend_response_code code;
+	unsigned int arguments[2]; /* new heap start and end */
+};
+
 /*
  * PP Start ioctl.
  * One for m200, one for m400.
@@ -224,4 +247,25 @@ struct lima_m400_pp_job_start_r3p2_01rel2 {
 	unsigned int *memory_cookies;
 };
 
+/*
+ * Job finished notifications, as of r3p0. Before that, these were the
+ * _mali_uk_*_job_finished_s structures from mali_ioctl.h.
+ */
+struct lima_gp_job_finished_r3p0 {
+	unsigned int user_job_ptr;
+	unsigned int status;
+	unsigned int heap_current_addr;
+	unsigned int perf_counter0;
+	unsigned int perf_counter1;
+};
+
+#define LIMA_PP_MAX_SUB_JOBS 8
+
+struct lima_pp_job_finished_r3p0 {
+	unsigned int user_job_ptr;
+	unsigned int status;
+	unsigned int perf_counter0[LIMA_PP_MAX_SUB_JOBS];
+	unsigned int perf_counter1[LIMA_PP_MAX_SUB_JOBS];
+};
+
 #endif /* LIMA_IOCTL_H */
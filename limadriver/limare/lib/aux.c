@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Allocator for the AUX memory area.
+ *
+ * The free space is kept as a list of ranges, sorted by offset. An
+ * allocation takes the smallest range that fits, from its start, and a
+ * freed range gets merged with its neighbours, so that textures and
+ * buffers can come and go in a long running scene without the area
+ * fragmenting into uselessly small pieces.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "limare.h"
+#include "aux.h"
+
+struct limare_aux_range {
+	int offset;
+	int size;
+	/* for a deferred free, the first frame which no longer uses it */
+	int frame_id;
+
+	struct limare_aux_range *next;
+};
+
+int
+limare_aux_init(struct limare_state *state)
+{
+	struct limare_aux_range *range =
+		calloc(1, sizeof(struct limare_aux_range));
+
+	if (!range)
+		return -1;
+
+	range->offset = 0;
+	range->size = state->aux_mem_size;
+
+	state->aux_free = range;
+	state->aux_mem_used = 0;
+	state->aux_mem_peak = 0;
+
+	return 0;
+}
+
+void
+limare_aux_fini(struct limare_state *state)
+{
+	struct limare_aux_range *range, *next;
+
+	for (range = state->aux_free; range; range = next) {
+		next = range->next;
+		free(range);
+	}
+
+	for (range = state->aux_deferred; range; range = next) {
+		next = range->next;
+		free(range);
+	}
+
+	state->aux_free = NULL;
+	state->aux_deferred = NULL;
+}
+
+/*
+ * Returns the offset of size bytes in AUX memory, or -1 when there is no
+ * free range large enough.
+ */
+int
+limare_aux_alloc(struct limare_state *state, int size)
+{
+	struct limare_aux_range *range, **best = NULL, **link;
+	int offset;
+
+	if (size <= 0)
+		return -1;
+	size = ALIGN(size, AUX_MEMORY_ALIGN);
+
+	for (link = &state->aux_free; *link; link = &(*link)->next) {
+		range = *link;
+
+		if ((range->size >= size) &&
+		    (!best || (range->size < (*best)->size)))
+			best = link;
+	}
+
+	if (!best)
+		return -1;
+
+	range = *best;
+	offset = range->offset;
+
+	if (range->size == size) {
+		*best = range->next;
+		free(range);
+	} else {
+		range->offset += size;
+		range->size -= size;
+	}
+
+	state->aux_mem_used += size;
+	if (state->aux_mem_used > state->aux_mem_peak)
+		state->aux_mem_peak = state->aux_mem_used;
+
+	return offset;
+}
+
+void
+limare_aux_free(struct limare_state *state, int offset, int size)
+{
+	struct limare_aux_range *prev = NULL, *next, *range;
+
+	if (size <= 0)
+		return;
+	size = ALIGN(size, AUX_MEMORY_ALIGN);
+
+	for (next = state->aux_free; next && (next->offset < offset);
+	     next = next->next)
+		prev = next;
+
+	if ((prev && ((prev->offset + prev->size) > offset)) ||
+	    (next && ((offset + size) > next->offset))) {
+		printf("%s: 0x%X (0x%X) overlaps free space!\n", __func__,
+		       offset, size);
+		return;
+	}
+
+	state->aux_mem_used -= size;
+
+	/* merge with the neighbours where possible */
+	if (prev && ((prev->offset + prev->size) == offset)) {
+		prev->size += size;
+		if (next && ((prev->offset + prev->size) == next->offset)) {
+			prev->size += next->size;
+			prev->next = next->next;
+			free(next);
+		}
+		return;
+	}
+
+	if (next && ((offset + size) == next->offset)) {
+		next->offset = offset;
+		next->size += size;
+		return;
+	}
+
+	range = calloc(1, sizeof(struct limare_aux_range));
+	if (!range) {
+		printf("%s: Error: failed to allocate range, leaking 0x%X "
+		       "bytes.\n", __func__, size);
+		state->aux_mem_used += size;
+		return;
+	}
+
+	range->offset = offset;
+	range->size = size;
+	range->next = next;
+	if (prev)
+		prev->next = range;
+	else
+		state->aux_free = range;
+}
+
+/*
+ * Free a range which the frames started so far might still read, like the
+ * old shaders of a program which got linked again. It only goes back to
+ * the free list once those frames are done, see limare_aux_retire().
+ */
+void
+limare_aux_free_deferred(struct limare_state *state, int offset, int size)
+{
+	struct limare_aux_range *range =
+		calloc(1, sizeof(struct limare_aux_range));
+
+	if (!range) {
+		printf("%s: Error: failed to allocate range, leaking 0x%X "
+		       "bytes.\n", __func__, size);
+		return;
+	}
+
+	range->offset = offset;
+	range->size = size;
+	range->frame_id = state->frame_count;
+	range->next = state->aux_deferred;
+	state->aux_deferred = range;
+}
+
+/*
+ * Frames finish in the order they were started, so once frame_id is done,
+ * the ranges which were freed deferred before any later frame started can
+ * be freed for real.
+ */
+void
+limare_aux_retire(struct limare_state *state, int frame_id)
+{
+	struct limare_aux_range **link = &state->aux_deferred, *range;
+
+	while (*link) {
+		range = *link;
+
+		if (range->frame_id <= (frame_id + 1)) {
+			*link = range->next;
+			limare_aux_free(state, range->offset, range->size);
+			free(range);
+		} else
+			link = &range->next;
+	}
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Allocator for the AUX memory area, which holds the textures, the
+ * attribute and indices buffers, and the shaders.
+ */
+
+#ifndef LIMARE_AUX_H
+#define LIMARE_AUX_H 1
+
+/* Every allocation starts at, and is a multiple of, this many bytes */
+#define AUX_MEMORY_ALIGN 0x40
+
+int limare_aux_init(struct limare_state *state);
+void limare_aux_fini(struct limare_state *state);
+
+int limare_aux_alloc(struct limare_state *state, int size);
+void limare_aux_free(struct limare_state *state, int offset, int size);
+void limare_aux_free_deferred(struct limare_state *state, int offset,
+			      int size);
+void limare_aux_retire(struct limare_state *state, int frame_id);
+
+#endif /* LIMARE_AUX_H */
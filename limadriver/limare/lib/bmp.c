@@ -29,8 +29,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "limare.h"
 #include "bmp.h"
@@ -141,3 +143,151 @@ bmp_dump(unsigned char *buffer, struct limare_state *state,
 	}
 }
 
+
+/*
+ * Screenshots without holding up the render thread: the 32bpp pixels get
+ * copied into one of BMP_ASYNC_SLOTS buffers, and a background thread
+ * writes them out, with the rows bottom up as bmp wants them. The caller
+ * only pays for the copy. When all slots are still busy, the capture is
+ * dropped rather than stalling the frame, and -1 is returned. Captures
+ * are to come from one thread only, like the render thread.
+ */
+#define BMP_ASYNC_SLOTS 2
+
+struct bmp_async_slot {
+	unsigned char *pixels;
+	int size;
+	int width;
+	int height;
+	char filename[FILENAME_SIZE];
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int started;
+
+	struct bmp_async_slot slots[BMP_ASYNC_SLOTS];
+	/* the slot that gets written next, slots are taken in order. */
+	int head;
+	int count;
+} bmp_async = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void
+bmp_async_write(struct bmp_async_slot *slot)
+{
+	int fd, y, row = slot->width * 4;
+
+	fd = open(slot->filename, O_WRONLY| O_TRUNC | O_CREAT, 0644);
+	if (fd == -1) {
+		printf("Failed to open %s: %s\n", slot->filename,
+		       strerror(errno));
+		return;
+	}
+
+	if (!bmp_header_write(fd, slot->width, slot->height, 1))
+		for (y = slot->height - 1; y >= 0; y--)
+			if (write(fd, slot->pixels + y * row, row) != row) {
+				fprintf(stderr, "%s: failed to write bmp data:"
+					" %s\n", __func__, strerror(errno));
+				break;
+			}
+
+	close(fd);
+}
+
+static void *
+bmp_async_thread(void *arg)
+{
+	struct bmp_async_slot *slot;
+
+	pthread_mutex_lock(&bmp_async.mutex);
+	while (1) {
+		while (!bmp_async.count)
+			pthread_cond_wait(&bmp_async.cond, &bmp_async.mutex);
+
+		slot = &bmp_async.slots[bmp_async.head];
+		pthread_mutex_unlock(&bmp_async.mutex);
+
+		bmp_async_write(slot);
+
+		pthread_mutex_lock(&bmp_async.mutex);
+		bmp_async.head = (bmp_async.head + 1) % BMP_ASYNC_SLOTS;
+		bmp_async.count--;
+		pthread_cond_broadcast(&bmp_async.cond);
+	}
+
+	return NULL;
+}
+
+int
+bmp_dump_async(const void *pixels, int width, int height, int pitch,
+	       const char *filename)
+{
+	struct bmp_async_slot *slot;
+	int y, size = width * height * 4;
+
+	pthread_mutex_lock(&bmp_async.mutex);
+
+	if (!bmp_async.started) {
+		if (pthread_create(&bmp_async.thread, NULL, bmp_async_thread,
+				   NULL)) {
+			pthread_mutex_unlock(&bmp_async.mutex);
+			return -1;
+		}
+		bmp_async.started = 1;
+		/* memtester exits without a limare_finish(). */
+		atexit(bmp_dump_async_flush);
+	}
+
+	if (bmp_async.count == BMP_ASYNC_SLOTS) {
+		pthread_mutex_unlock(&bmp_async.mutex);
+		return -1;
+	}
+
+	slot = &bmp_async.slots[(bmp_async.head + bmp_async.count) %
+				BMP_ASYNC_SLOTS];
+	pthread_mutex_unlock(&bmp_async.mutex);
+
+	/* only we hand out slots, so this one is ours until queued. */
+	if (slot->size < size) {
+		free(slot->pixels);
+		slot->pixels = malloc(size);
+		if (!slot->pixels) {
+			slot->size = 0;
+			return -1;
+		}
+		slot->size = size;
+	}
+
+	for (y = 0; y < height; y++)
+		memcpy(slot->pixels + y * width * 4,
+		       (const unsigned char *) pixels + y * pitch, width * 4);
+
+	slot->width = width;
+	slot->height = height;
+	snprintf(slot->filename, FILENAME_SIZE, "%s", filename);
+
+	pthread_mutex_lock(&bmp_async.mutex);
+	bmp_async.count++;
+	pthread_cond_broadcast(&bmp_async.cond);
+	pthread_mutex_unlock(&bmp_async.mutex);
+
+	return 0;
+}
+
+/*
+ * Waits for the queued screenshots to hit the disk.
+ */
+void
+bmp_dump_async_flush(void)
+{
+	pthread_mutex_lock(&bmp_async.mutex);
+	while (bmp_async.count)
+		pthread_cond_wait(&bmp_async.cond, &bmp_async.mutex);
+	pthread_mutex_unlock(&bmp_async.mutex);
+}
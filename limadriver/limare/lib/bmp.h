@@ -28,4 +28,8 @@ void
 bmp_dump(unsigned char *buffer, struct limare_state *state,
 	 int width, int height, int cpp, char *filename);
 
+int bmp_dump_async(const void *pixels, int width, int height, int pitch,
+		   const char *filename);
+void bmp_dump_async_flush(void);
+
 #endif /* BMP_DUMP_H */
@@ -72,3 +72,77 @@ dumped_mem_load(int fd, struct lima_dumped_mem *dump)
 
 	return 0;
 }
+
+/*
+ * Lowest address of the dumped memory.
+ */
+unsigned int
+dumped_mem_base(struct lima_dumped_mem *dump)
+{
+	unsigned int base = 0xFFFFFFFF;
+	int i;
+
+	for (i = 0; i < dump->count; i++)
+		if (dump->blocks[i]->physical < base)
+			base = dump->blocks[i]->physical;
+
+	return base;
+}
+
+static int
+dumped_mem_contains(struct lima_dumped_mem *dump, unsigned int address)
+{
+	int i;
+
+	for (i = 0; i < dump->count; i++) {
+		struct lima_dumped_mem_block *block = dump->blocks[i];
+
+		if ((address >= block->physical) &&
+		    (address < (block->physical + block->size)))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * The dumped memory only works at the addresses it was captured at. To move
+ * it elsewhere, all blocks get shifted by the same amount, and with them all
+ * words which point into any of the blocks. There is no telling pointers from
+ * other data here, so a vertex or a colour which happens to look like one of
+ * the captured addresses gets shifted as well.
+ *
+ * This works on the captured addresses, so anything outside of the dumped
+ * memory, like the job registers, needs to be relocated before the memory.
+ */
+void
+dumped_mem_relocate_words(struct lima_dumped_mem *dump,
+			  unsigned int *words, int count, int delta)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (dumped_mem_contains(dump, words[i]))
+			words[i] += delta;
+}
+
+void
+dumped_mem_relocate(struct lima_dumped_mem *dump, int delta)
+{
+	int i, j;
+
+	for (i = 0; i < dump->count; i++) {
+		struct lima_dumped_mem_block *block = dump->blocks[i];
+
+		for (j = 0; j < block->count; j++) {
+			struct lima_dumped_mem_content *content =
+				block->contents[j];
+
+			dumped_mem_relocate_words(dump, content->memory,
+						  content->size / 4, delta);
+		}
+	}
+
+	for (i = 0; i < dump->count; i++)
+		dump->blocks[i]->physical += delta;
+}
@@ -48,4 +48,9 @@ struct lima_dumped_mem {
 
 int dumped_mem_load(int fd, struct lima_dumped_mem *dump);
 
+unsigned int dumped_mem_base(struct lima_dumped_mem *dump);
+void dumped_mem_relocate_words(struct lima_dumped_mem *dump,
+			       unsigned int *words, int count, int delta);
+void dumped_mem_relocate(struct lima_dumped_mem *dump, int delta);
+
 #endif /* LIMARE_DUMP_H */
@@ -35,21 +35,104 @@
 
 #include <linux/fb.h>
 
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #define u32 uint32_t
 #include "linux/mali_ioctl.h"
 
 #include "limare.h"
 #include "version.h"
 #include "fb.h"
+#include "kms.h"
+#include "pp.h"
 
 static char *fbdev_dev;
 
+/*
+ * The depth that LIMA_FB_FORMAT asks the render targets to be in, or 0
+ * when it leaves that to the display.
+ */
+int
+fb_format_bpp(void)
+{
+	const char *env = getenv("LIMA_FB_FORMAT");
+
+	if (!env || !env[0])
+		return 0;
+
+	if (!strcmp(env, "rgb565"))
+		return 16;
+	if (!strcmp(env, "argb8888"))
+		return 32;
+
+	printf("Unknown LIMA_FB_FORMAT=%s, use rgb565 or argb8888.\n", env);
+	return 0;
+}
+
+/*
+ * Switch the fbdev to RGB565 or ARGB8888, our only two render target
+ * formats. The var and fix get read back, whatever the driver made of it.
+ */
+static int
+fb_format_set(int fd, struct fb_var_screeninfo *var,
+	      struct fb_fix_screeninfo *fix, int bpp)
+{
+	struct fb_var_screeninfo new = *var;
+
+	new.bits_per_pixel = bpp;
+	if (bpp == 16) {
+		new.red.offset = 11;
+		new.red.length = 5;
+		new.green.offset = 5;
+		new.green.length = 6;
+		new.blue.offset = 0;
+		new.blue.length = 5;
+		new.transp.offset = 0;
+		new.transp.length = 0;
+	} else {
+		new.red.offset = 16;
+		new.red.length = 8;
+		new.green.offset = 8;
+		new.green.length = 8;
+		new.blue.offset = 0;
+		new.blue.length = 8;
+		new.transp.offset = 24;
+		new.transp.length = 8;
+	}
+	new.activate = FB_ACTIVATE_NOW;
+
+	if (ioctl(fd, FBIOPUT_VSCREENINFO, &new))
+		printf("Error: failed to set %dbpp on %s: %s\n", bpp,
+		       fbdev_dev, strerror(errno));
+
+	if (ioctl(fd, FBIOGET_VSCREENINFO, var) ||
+	    ioctl(fd, FBIOGET_FSCREENINFO, fix)) {
+		printf("Error: failed to run ioctl on %s: %s\n",
+			fbdev_dev, strerror(errno));
+		return -1;
+	}
+
+	return ((int) var->bits_per_pixel == bpp) ? 0 : -1;
+}
+
 void
 fb_destroy(struct limare_state *state)
 {
 	struct limare_fb *fb = state->fb;
 	int ret;
 
+	if (fb->offscreen) {
+		if (fb->map)
+			munmap(fb->map, fb->map_size);
+		if (fb->kms)
+			kms_put(fb->kms, 1);
+		free(fb);
+		state->fb = NULL;
+		return;
+	}
+
 	if (fb->ump_id != -1) {
 		_mali_uk_release_ump_mem_s release = { 0 };
 
@@ -83,6 +166,13 @@ fb_destroy(struct limare_state *state)
 
 	munmap(fb->map, fb->map_size);
 
+	if (fb->bpp_restore) {
+		struct fb_fix_screeninfo fix;
+
+		fb->fb_var->yoffset = 0;
+		fb_format_set(fb->fd, fb->fb_var, &fix, fb->bpp_restore);
+	}
+
 	close(fb->fd);
 
 	free(fb->fb_var);
@@ -97,6 +187,7 @@ fb_open(struct limare_state *state)
 	struct fb_var_screeninfo *fb_var =
 		calloc(1, sizeof(struct fb_var_screeninfo));
 	struct fb_fix_screeninfo fix;
+	int bpp;
 
 	if (!fb) {
 		printf("Error: failed to alloc limare_fb: %s\n",
@@ -141,6 +232,17 @@ fb_open(struct limare_state *state)
 		return errno;
 	}
 
+	bpp = fb_format_bpp();
+	if (bpp && (bpp != (int) fb_var->bits_per_pixel)) {
+		int old = fb_var->bits_per_pixel;
+
+		if (!fb_format_set(fb->fd, fb_var, &fix, bpp))
+			fb->bpp_restore = old;
+		else
+			printf("%s: staying at %dbpp.\n", fbdev_dev,
+			       fb_var->bits_per_pixel);
+	}
+
 	printf("FB: %dx%d@%dbpp at 0x%08lX (0x%08X)\n",
 	       fb_var->xres, fb_var->yres, fb_var->bits_per_pixel,
 	       fix.smem_start, fix.smem_len);
@@ -173,6 +275,12 @@ fb_open(struct limare_state *state)
 	else
 		fb->dual_buffer = 0;
 
+	if ((fb->map_size >= (3 * fb->size)) &&
+	    (fb_var->yres_virtual >= (3 * fb_var->yres)))
+		fb->buffer_count = 3;
+	else
+		fb->buffer_count = fb->dual_buffer ? 2 : 1;
+
 	if (fb->dual_buffer) {
 		fb_var->yoffset = 0;
 
@@ -187,6 +295,82 @@ fb_open(struct limare_state *state)
 	return 0;
 }
 
+/*
+ * Render targets in plain mali memory, for when there is no display, or
+ * when the gpu load should not depend on the mode the display is in.
+ * Double buffered like the fb, so that the frame_done callback still sees
+ * a stable frame. Replaces an fbdev which was opened already.
+ */
+int
+fb_offscreen_open(struct limare_state *state, int width, int height, int bpp)
+{
+	struct limare_fb *fb;
+
+	if (!width || !height) {
+		width = LIMARE_OFFSCREEN_WIDTH;
+		height = LIMARE_OFFSCREEN_HEIGHT;
+	}
+
+	if ((width < 16) || (height < 16) ||
+	    (width > 4096) || (height > 4096)) {
+		printf("%s: Error: unsupported size %dx%d\n",
+		       __func__, width, height);
+		return -1;
+	}
+
+	if ((bpp != 16) && (bpp != 32)) {
+		printf("%s: Error: unsupported depth %dbpp\n", __func__, bpp);
+		return -1;
+	}
+
+	fb = calloc(1, sizeof(struct limare_fb));
+	if (!fb) {
+		printf("Error: failed to alloc limare_fb: %s\n",
+		       strerror(errno));
+		return errno;
+	}
+
+	if (state->fb) {
+		munmap(state->fb->map, state->fb->map_size);
+		close(state->fb->fd);
+		free(state->fb->fb_var);
+		free(state->fb);
+	}
+
+	fb->fd = -1;
+	fb->ump_id = -1;
+	fb->offscreen = 1;
+
+	fb->width = width;
+	fb->height = height;
+	fb->bpp = bpp;
+	fb->size = width * height * (bpp / 8);
+	fb->dual_buffer = 1;
+	fb->buffer_count = LIMARE_FB_BUFFERS;
+	fb->map_size = (fb->buffer_count * fb->size + 0xFFF) & ~0xFFF;
+
+	state->fb = fb;
+
+	return 0;
+}
+
+static int
+fb_offscreen_map(struct limare_state *state)
+{
+	struct limare_fb *fb = state->fb;
+
+	fb->map = mmap(NULL, fb->map_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED, state->fd, fb->mali_physical[0]);
+	if (fb->map == MAP_FAILED) {
+		printf("Error: failed to mmap offset 0x%x (0x%x): %s\n",
+		       fb->mali_physical[0], fb->map_size, strerror(errno));
+		fb->map = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
 static int
 mali_map_external(struct limare_state *state)
 {
@@ -246,11 +430,20 @@ mali_map_ump(struct limare_state *state)
 	return 0;
 }
 
+static void
+fb_damage_reset(struct limare_fb_damage *damage, int width, int height)
+{
+	damage->rect.x0 = 0;
+	damage->rect.y0 = 0;
+	damage->rect.x1 = width;
+	damage->rect.y1 = height;
+}
+
 int
 fb_init(struct limare_state *state, int width, int height, int offset)
 {
 	struct limare_fb *fb = state->fb;
-	int ret;
+	int ret, i;
 
 	if (!width || !height) {
 		width = fb->width;
@@ -272,9 +465,27 @@ fb_init(struct limare_state *state, int width, int height, int offset)
 		height = fb->height;
 	}
 
-	fb->mali_physical[0] = state->mem_base + offset;
-	if (fb->dual_buffer)
-		fb->mali_physical[1] = fb->mali_physical[0] + fb->size;
+	for (i = 0; i < fb->buffer_count; i++)
+		fb->mali_physical[i] = state->mem_base + offset + i * fb->size;
+
+	/* nothing is known about what the buffers hold yet. */
+	for (i = 0; i < LIMARE_FB_BUFFERS; i++)
+		fb_damage_reset(&fb->damage[i], width, height);
+	for (i = 0; i < 2; i++)
+		fb_damage_reset(&fb->kms_damage[i], width, height);
+
+	if (fb->offscreen) {
+		if (fb_offscreen_map(state))
+			return -1;
+
+		printf("Using triple buffered offscreen rendering at "
+		       "%dx%d@%dbpp.\n", fb->width, fb->height, fb->bpp);
+
+		state->width = width;
+		state->height = height;
+
+		return 0;
+	}
 
 	ret = mali_map_external(state);
 	if (ret == -1)
@@ -286,7 +497,9 @@ fb_init(struct limare_state *state, int width, int height, int offset)
 		return ret;
 	}
 
-	if (fb->dual_buffer)
+	if (fb->buffer_count == 3)
+		printf("Using triple buffered direct rendering to FB.\n");
+	else if (fb->dual_buffer)
 		printf("Using dual buffered direct rendering to FB.\n");
 	else
 		printf("Using direct rendering to FB.\n");
@@ -297,40 +510,170 @@ fb_init(struct limare_state *state, int width, int height, int offset)
 	return 0;
 }
 
+/*
+ * The area of a buffer which has to be rendered or copied again: where the
+ * frame it holds or the new frame can differ from their clear color, or
+ * all of it when that color changed. Outside of that, both frames show
+ * nothing but the same clear color. Afterwards, the buffer holds the new
+ * frame.
+ */
+void
+fb_damage_update(struct limare_state *state, struct limare_fb_damage *last,
+		 struct limare_frame *frame, struct limare_rect *area)
+{
+	*area = frame->damage;
+
+	if (last->clear_color != frame->pp->clear_color) {
+		area->x0 = 0;
+		area->y0 = 0;
+		area->x1 = state->width;
+		area->y1 = state->height;
+	} else if ((area->x1 <= area->x0) || (area->y1 <= area->y0)) {
+		*area = last->rect;
+	} else if ((last->rect.x1 > last->rect.x0) &&
+		   (last->rect.y1 > last->rect.y0)) {
+		if (last->rect.x0 < area->x0)
+			area->x0 = last->rect.x0;
+		if (last->rect.y0 < area->y0)
+			area->y0 = last->rect.y0;
+		if (last->rect.x1 > area->x1)
+			area->x1 = last->rect.x1;
+		if (last->rect.y1 > area->y1)
+			area->y1 = last->rect.y1;
+	}
+
+	last->rect = frame->damage;
+	last->clear_color = frame->pp->clear_color;
+}
+
 void
 fb_clear(struct limare_state *state)
 {
 	struct limare_fb *fb = state->fb;
 
-	if (fb->fd == -1)
+	uint8_t *p = fb->map;
+	int i = 0;
+
+	if (!fb->map)
 		return;
 
-	memset(fb->map, 0xFF, fb->map_size);
+	/*
+	 * The fb is mapped write-combined, so only plain wide writes in
+	 * order get the most out of it. 64 bytes at a time with neon fill
+	 * whole write buffer entries without the cache getting involved.
+	 */
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+	{
+		uint8x16_t value = vdupq_n_u8(0xFF);
+
+		for (; (i + 64) <= fb->map_size; i += 64) {
+			vst1q_u8(p + i, value);
+			vst1q_u8(p + i + 16, value);
+			vst1q_u8(p + i + 32, value);
+			vst1q_u8(p + i + 48, value);
+		}
+	}
+#endif
+
+	memset(p + i, 0xFF, fb->map_size - i);
+
+	for (i = 0; i < LIMARE_FB_BUFFERS; i++)
+		fb_damage_reset(&fb->damage[i], state->width, state->height);
+}
+
+/*
+ * Copy the finished frame out of mali memory, unless the display is still
+ * busy with the previous one.
+ */
+static void
+limare_fb_flip_kms(struct limare_state *state, struct limare_frame *frame)
+{
+	struct limare_fb *fb = state->fb;
+	struct limare_kms *kms = fb->kms;
+	unsigned char *src = fb_frame_address(state, frame);
+	unsigned char *dst = kms_back_buffer(kms);
+	int y, stride = fb->width * (fb->bpp / 8);
+	int bytes = fb->bpp / 8;
+	struct limare_rect area;
+
+	if (!src || !dst)
+		return;
+
+	fb_damage_update(state, &fb->kms_damage[!kms->front], frame, &area);
+
+	if (area.x0 || area.y0 || (area.x1 < state->width) ||
+	    (area.y1 < state->height)) {
+		/* only what differs from the frame in this buffer. */
+		for (y = area.y0; y < area.y1; y++)
+			memcpy(dst + y * kms->pitch + area.x0 * bytes,
+			       src + y * stride + area.x0 * bytes,
+			       (area.x1 - area.x0) * bytes);
+	} else if (kms->pitch == stride)
+		memcpy(dst, src, fb->size);
+	else
+		for (y = 0; y < fb->height; y++)
+			memcpy(dst + y * kms->pitch, src + y * stride, stride);
+
+	kms_flip(kms);
 }
 
 void
 limare_fb_flip(struct limare_state *state, struct limare_frame *frame)
 {
 	struct limare_fb *fb = state->fb;
-	//int sync_arg = 0;
 
-	if (!fb->dual_buffer)
+	if (fb->kms) {
+		limare_fb_flip_kms(state, frame);
 		return;
+	}
 
-	if (frame->index)
-		fb->fb_var->yoffset = fb->height;
-	else
-		fb->fb_var->yoffset = 0;
+	if (!fb->dual_buffer || fb->offscreen)
+		return;
+
+	fb->fb_var->yoffset = frame->index * fb->height;
 
-#if 0
-	if (ioctl(fb->fd, FBIO_WAITFORVSYNC, &sync_arg))
+	if (ioctl(fb->fd, FBIOPAN_DISPLAY, fb->fb_var))
 		printf("Error: failed to run ioctl on %s: %s\n",
 			fbdev_dev, strerror(errno));
-#endif
+}
 
-	if (ioctl(fb->fd, FBIOPAN_DISPLAY, fb->fb_var))
+/*
+ * Block until the last flip has made it to the screen. Returns -1 when
+ * there is no display to wait for, or when the fbdev cannot wait.
+ */
+int
+limare_fb_vsync_wait(struct limare_state *state)
+{
+	struct limare_fb *fb = state->fb;
+	int sync_arg = 0;
+
+	if (fb->kms)
+		return kms_flip_wait(fb->kms);
+
+	if (fb->offscreen)
+		return -1;
+
+	if (ioctl(fb->fd, FBIO_WAITFORVSYNC, &sync_arg)) {
 		printf("Error: failed to run ioctl on %s: %s\n",
 			fbdev_dev, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Where the pp has written the given frame.
+ */
+void *
+fb_frame_address(struct limare_state *state, struct limare_frame *frame)
+{
+	struct limare_fb *fb = state->fb;
+
+	if (!fb->map)
+		return NULL;
+
+	return fb->map + frame->index * fb->size;
 }
 
 void
@@ -340,7 +683,7 @@ fb_dump_direct(struct limare_state *state, unsigned char *buffer,
 	struct limare_fb *fb = state->fb;
 	int i;
 
-	if (fb->fd == -1)
+	if (!fb->map)
 		return;
 
 	if ((fb->width == width) && (fb->height == height)) {
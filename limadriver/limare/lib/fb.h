@@ -25,9 +25,27 @@
 #ifndef LIMARE_FB_H
 #define LIMARE_FB_H 1
 
+/* when neither the user nor an fbdev tell us what size to render at */
+#define LIMARE_OFFSCREEN_WIDTH 1280
+#define LIMARE_OFFSCREEN_HEIGHT 720
+
+/* so that the gpu can render while one frame shows and the next waits */
+#define LIMARE_FB_BUFFERS 3
+
+struct limare_kms;
+
+/* what a buffer holds, see fb_damage_update */
+struct limare_fb_damage {
+	struct limare_rect rect;
+	unsigned int clear_color;
+};
+
 struct limare_fb {
 	int fd;
 
+	/* rendering to mali memory only, no fbdev behind it */
+	int offscreen;
+
 	/* one single fb */
 	int width;
 	int height;
@@ -35,6 +53,8 @@ struct limare_fb {
 	int size;
 
 	int dual_buffer;
+	/* 1 to LIMARE_FB_BUFFERS, frames go round robin over these */
+	int buffer_count;
 
 	/* mapped fb */
 	void *map;
@@ -45,20 +65,39 @@ struct limare_fb {
 	int buffer_size;
 
 	int fb_physical;
-	int mali_physical[2];
+	int mali_physical[LIMARE_FB_BUFFERS];
 
 	unsigned int ump_id;
 
 	int mali_handle;
 
 	struct fb_var_screeninfo *fb_var;
+	/* the depth the fbdev was in, before LIMA_FB_FORMAT changed it */
+	int bpp_restore;
+
+	/* offscreen frames get copied to and flipped on this display */
+	struct limare_kms *kms;
+
+	/*
+	 * The frames last rendered to each buffer, and copied to each of the
+	 * two kms buffers, the latter only touched by the flip thread.
+	 */
+	struct limare_fb_damage damage[LIMARE_FB_BUFFERS];
+	struct limare_fb_damage kms_damage[2];
 };
 
+int fb_format_bpp(void);
 int fb_open(struct limare_state *state);
+int fb_offscreen_open(struct limare_state *state, int width, int height,
+		      int bpp);
 int fb_init(struct limare_state *state, int width, int height, int offset);
 void fb_clear(struct limare_state *state);
 void fb_dump_direct(struct limare_state *state, unsigned char *buffer,
 		    int width, int height);
 void limare_fb_flip(struct limare_state *state, struct limare_frame *frame);
+int limare_fb_vsync_wait(struct limare_state *state);
+void *fb_frame_address(struct limare_state *state, struct limare_frame *frame);
+void fb_damage_update(struct limare_state *state, struct limare_fb_damage *last,
+		      struct limare_frame *frame, struct limare_rect *area);
 
 #endif /* LIMARE_FB_H */
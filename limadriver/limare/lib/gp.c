@@ -49,34 +49,78 @@
 #include "from_float.h"
 #include "texture.h"
 #include "program.h"
+#include "handle.h"
 
-int
-vs_command_queue_create(struct limare_frame *frame, int size)
+/*
+ * The command queues are built up in normal memory, and only get copied
+ * into frame memory when the frame is flushed, so they can grow to
+ * whatever the number of draws requires. The buffers are kept when the
+ * frame is reused.
+ */
+static int
+command_queue_reserve(struct lima_cmd **commands, int *size, int count,
+		      int needed)
 {
-	size = ALIGN(size, 0x40);
+	struct lima_cmd *cmds;
+	int new_size = *size;
+
+	if ((count + needed) <= new_size)
+		return 0;
+
+	if (!new_size)
+		new_size = 0x100;
+	while (new_size < (count + needed))
+		new_size *= 2;
 
-	if ((frame->mem_size - frame->mem_used) < size) {
-		printf("%s: no space for vs queue\n", __func__);
+	cmds = realloc(*commands, new_size * sizeof(struct lima_cmd));
+	if (!cmds) {
+		printf("%s: Error: failed to grow command queue: %s\n",
+		       __func__, strerror(errno));
 		return -1;
 	}
 
-	frame->vs_commands = frame->mem_address + frame->mem_used;
-	frame->vs_commands_physical = frame->mem_physical + frame->mem_used;
-	frame->vs_commands_count = 0;
-	frame->vs_commands_size = size / 8;
-
-	frame->mem_used += size;
+	*commands = cmds;
+	*size = new_size;
 
 	return 0;
 }
 
-void
+static int
+vs_commands_reserve(struct limare_frame *frame, int needed)
+{
+	return command_queue_reserve(&frame->vs_commands,
+				     &frame->vs_commands_size,
+				     frame->vs_commands_count, needed);
+}
+
+static int
+plbu_commands_reserve(struct limare_frame *frame, int needed)
+{
+	return command_queue_reserve(&frame->plbu_commands,
+				     &frame->plbu_commands_size,
+				     frame->plbu_commands_count, needed);
+}
+
+int
+vs_command_queue_create(struct limare_frame *frame, int size)
+{
+	frame->vs_commands_count = 0;
+	frame->vs_commands_physical = 0;
+
+	return vs_commands_reserve(frame, size / 8);
+}
+
+int
 plbu_viewport_set(struct limare_frame *frame,
 		  float x, float y, float w, float h)
 {
-	struct lima_cmd *cmds = frame->plbu_commands;
+	struct lima_cmd *cmds;
 	int i = frame->plbu_commands_count;
 
+	if (plbu_commands_reserve(frame, 4))
+		return -1;
+	cmds = frame->plbu_commands;
+
 	cmds[i].val = from_float(x);
 	cmds[i].cmd = LIMA_PLBU_CMD_VIEWPORT_X;
 	i++;
@@ -94,15 +138,21 @@ plbu_viewport_set(struct limare_frame *frame,
 	i++;
 
 	frame->plbu_commands_count = i;
+
+	return 0;
 }
 
-void
+static int
 plbu_scissor(struct limare_state *state, struct limare_frame *frame)
 {
-	struct lima_cmd *cmds = frame->plbu_commands;
+	struct lima_cmd *cmds;
 	int i = frame->plbu_commands_count;
 	int x, y, w, h;
 
+	if (plbu_commands_reserve(frame, 1))
+		return -1;
+	cmds = frame->plbu_commands;
+
 	if (state->scissor) {
 		x = state->scissor_x;
 		y = state->scissor_y;
@@ -120,6 +170,8 @@ plbu_scissor(struct limare_state *state, struct limare_frame *frame)
 		(x + w  -1) << 13 | (x >> 2);
 
 	frame->plbu_commands_count++;
+
+	return 0;
 }
 
 int
@@ -130,11 +182,10 @@ plbu_command_queue_create(struct limare_state *state,
 	struct lima_cmd *cmds;
 	int i = 0;
 
-	size = ALIGN(size, 0x40);
 	heap_size = ALIGN(heap_size, 0x40);
 
-	if ((frame->mem_size - frame->mem_used) < (size + heap_size)) {
-		printf("%s: no space for plbu queue and tile heap\n", __func__);
+	if (limare_frame_mem_reserve(frame, heap_size)) {
+		printf("%s: no space for tile heap\n", __func__);
 		return -1;
 	}
 
@@ -142,11 +193,11 @@ plbu_command_queue_create(struct limare_state *state,
 	frame->tile_heap_size = heap_size;
 	frame->mem_used += heap_size;
 
-	frame->plbu_commands = frame->mem_address + frame->mem_used;
-	frame->plbu_commands_physical = frame->mem_physical + frame->mem_used;
 	frame->plbu_commands_count = 0;
-	frame->plbu_commands_size = size / 8;
-	frame->mem_used += size;
+	frame->plbu_commands_physical = 0;
+
+	if (plbu_commands_reserve(frame, size / 8))
+		return -1;
 
 	cmds = frame->plbu_commands;
 
@@ -179,8 +230,11 @@ plbu_command_queue_create(struct limare_state *state,
 
 	frame->plbu_commands_count = i;
 
-	plbu_viewport_set(frame, 0.0, 0.0, state->width, state->height);
+	if (plbu_viewport_set(frame, 0.0, 0.0, state->width, state->height) ||
+	    plbu_commands_reserve(frame, 2))
+		return -1;
 
+	cmds = frame->plbu_commands;
 	i = frame->plbu_commands_count;
 
 	cmds[i].val = frame->mem_physical + frame->tile_heap_offset;
@@ -206,8 +260,7 @@ vs_info_setup(struct limare_state *state, struct limare_frame *frame,
 	int i;
 
 	if (state->type == LIMARE_TYPE_M200) {
-		if ((frame->mem_size - frame->mem_used) <
-		    sizeof(struct gp_common)) {
+		if (limare_frame_mem_reserve(frame, sizeof(struct gp_common))) {
 			printf("%s: no space for vs common\n", __func__);
 			return -1;
 		}
@@ -228,8 +281,8 @@ vs_info_setup(struct limare_state *state, struct limare_frame *frame,
 			info->common->varyings[i].size = 0x3F;
 		}
 	} else if (state->type == LIMARE_TYPE_M400) {
-		if ((frame->mem_size - frame->mem_used) <
-		    (0x20 * sizeof(struct gp_common_entry))) {
+		if (limare_frame_mem_reserve(frame, 0x20 *
+					     sizeof(struct gp_common_entry))) {
 			printf("%s: no space for vs attribute/varying area\n",
 			       __func__);
 			return -1;
@@ -254,11 +307,8 @@ vs_info_attach_uniforms(struct limare_frame *frame, struct draw_info *draw,
 			struct symbol **uniforms, int count, int size)
 {
 	struct vs_info *info = draw->vs;
-	void *address;
-	int i;
 
-	if ((frame->mem_size - frame->mem_used) <
-	    ALIGN(4 * size, 0x40)) {
+	if (limare_frame_mem_reserve(frame, ALIGN(4 * size, 0x40))) {
 		printf("%s: no space for uniforms\n", __func__);
 		return -1;
 	}
@@ -267,7 +317,18 @@ vs_info_attach_uniforms(struct limare_frame *frame, struct draw_info *draw,
 	info->uniform_size = size;
 	frame->mem_used += ALIGN(4 * size, 0x40);
 
-	address = frame->mem_address + info->uniform_offset;
+	vs_info_uniforms_rewrite(frame, draw, uniforms, count);
+
+	return 0;
+}
+
+/* (Re)write the current uniform values into the block of this draw. */
+void
+vs_info_uniforms_rewrite(struct limare_frame *frame, struct draw_info *draw,
+			 struct symbol **uniforms, int count)
+{
+	void *address = frame->mem_address + draw->vs->uniform_offset;
+	int i;
 
 	for (i = 0; i < count; i++) {
 		struct symbol *symbol = uniforms[i];
@@ -286,8 +347,6 @@ vs_info_attach_uniforms(struct limare_frame *frame, struct draw_info *draw,
 				       symbol->src_stride);
 		}
 	}
-
-	return 0;
 }
 
 int
@@ -315,7 +374,7 @@ vs_info_attach_varyings(struct limare_program *program,
 
 	info->varying_size = ALIGN(program->varying_map_size *
 				   draw->attributes_vertex_count, 0x40);
-	if (info->varying_size > (frame->mem_size - frame->mem_used)) {
+	if (limare_frame_mem_reserve(frame, info->varying_size)) {
 		printf("%s: No more space\n", __func__);
 		return -2;
 	}
@@ -325,7 +384,7 @@ vs_info_attach_varyings(struct limare_program *program,
 
 	info->gl_Position_size =
 		ALIGN(16 * draw->attributes_vertex_count, 0x40);
-	if (info->gl_Position_size > (frame->mem_size - frame->mem_used)) {
+	if (limare_frame_mem_reserve(frame, info->gl_Position_size)) {
 		printf("%s: No more space\n", __func__);
 		return -2;
 	}
@@ -336,15 +395,19 @@ vs_info_attach_varyings(struct limare_program *program,
 	return 0;
 }
 
-void
+int
 vs_commands_draw_add(struct limare_state *state, struct limare_frame *frame,
 		     struct limare_program *program, struct draw_info *draw)
 {
 	struct vs_info *vs = draw->vs;
 	struct plbu_info *plbu = draw->plbu;
-	struct lima_cmd *cmds = frame->vs_commands;
+	struct lima_cmd *cmds;
 	int i = frame->vs_commands_count;
 
+	if (vs_commands_reserve(frame, 12))
+		return -1;
+	cmds = frame->vs_commands;
+
 	if (!plbu->indices_mem_physical) {
 		cmds[i].val = LIMA_VS_CMD_ARRAYS_SEMAPHORE_BEGIN_1;
 		cmds[i].cmd = LIMA_VS_CMD_ARRAYS_SEMAPHORE;
@@ -416,6 +479,8 @@ vs_commands_draw_add(struct limare_state *state, struct limare_frame *frame,
 
 	/* update our size so we can set the gp job properly */
 	frame->vs_commands_count = i;
+
+	return 0;
 }
 
 void
@@ -491,15 +556,20 @@ vs_info_finalize(struct limare_state *state, struct limare_frame *frame,
 	}
 }
 
-void
+int
 plbu_commands_draw_add(struct limare_state *state, struct limare_frame *frame,
 		       struct draw_info *draw)
 {
 	struct plbu_info *plbu = draw->plbu;
 	struct vs_info *vs = draw->vs;
-	struct lima_cmd *cmds = frame->plbu_commands;
+	struct lima_cmd *cmds;
 	int i = frame->plbu_commands_count;
 
+	/* covers the viewport and scissor commands too. */
+	if (plbu_commands_reserve(frame, 16))
+		return -1;
+	cmds = frame->plbu_commands;
+
 	/*
 	 *
 	 */
@@ -555,6 +625,7 @@ plbu_commands_draw_add(struct limare_state *state, struct limare_frame *frame,
 		state->scissor_dirty = 0;
 	}
 
+	cmds = frame->plbu_commands;
 	i = frame->plbu_commands_count;
 	if (state->depth_dirty) {
 		cmds[i].val = 0x00000000;
@@ -601,18 +672,24 @@ plbu_commands_draw_add(struct limare_state *state, struct limare_frame *frame,
 
 	/* update our size so we can set the gp job properly */
 	frame->plbu_commands_count = i;
+
+	return 0;
 }
 
-void
+int
 plbu_commands_depth_buffer_clear_draw_add(struct limare_state *state,
 					  struct limare_frame *frame,
 					  struct draw_info *draw, unsigned int
 					  varying_vertices_physical)
 {
 	struct plbu_info *plbu = draw->plbu;
-	struct lima_cmd *cmds = frame->plbu_commands;
+	struct lima_cmd *cmds;
 	int i;
 
+	/* covers the viewport and scissor commands too. */
+	if (plbu_commands_reserve(frame, 13))
+		return -1;
+
 	plbu_viewport_set(frame, 0.0, 0.0, 4096.0, 4096.0);
 	state->viewport_dirty = 1;
 
@@ -621,6 +698,7 @@ plbu_commands_depth_buffer_clear_draw_add(struct limare_state *state,
 		state->scissor_dirty = 0;
 	}
 
+	cmds = frame->plbu_commands;
 	i = frame->plbu_commands_count;
 	cmds[i].val = frame->mem_physical + plbu->render_state_offset;
 	cmds[i].cmd = LIMA_PLBU_CMD_RSW_VERTEX_ARRAY;
@@ -660,15 +738,21 @@ plbu_commands_depth_buffer_clear_draw_add(struct limare_state *state,
 
 	/* update our size so we can set the gp job properly */
 	frame->plbu_commands_count = i;
+
+	return 0;
 }
 
 
-void
+int
 plbu_commands_finish(struct limare_frame *frame)
 {
-	struct lima_cmd *cmds = frame->plbu_commands;
+	struct lima_cmd *cmds;
 	int i = frame->plbu_commands_count;
 
+	if (plbu_commands_reserve(frame, 3))
+		return -1;
+	cmds = frame->plbu_commands;
+
 #if 0
 	cmds[i].val = 0x00000000;
 	cmds[i].cmd = 0xd0000000;
@@ -685,6 +769,38 @@ plbu_commands_finish(struct limare_frame *frame)
 
 	/* update our size so we can set the gp job properly */
 	frame->plbu_commands_count = i;
+
+	return 0;
+}
+
+/*
+ * Copy the finished command queues into frame memory, where the gp can
+ * get at them.
+ */
+int
+command_queues_upload(struct limare_frame *frame)
+{
+	int vs_size = ALIGN(8 * frame->vs_commands_count, 0x40);
+	int plbu_size = ALIGN(8 * frame->plbu_commands_count, 0x40);
+
+	if (limare_frame_mem_reserve(frame, vs_size + plbu_size)) {
+		printf("%s: no space for %d vs and %d plbu commands\n",
+		       __func__, frame->vs_commands_count,
+		       frame->plbu_commands_count);
+		return -1;
+	}
+
+	memcpy(frame->mem_address + frame->mem_used, frame->vs_commands,
+	       8 * frame->vs_commands_count);
+	frame->vs_commands_physical = frame->mem_physical + frame->mem_used;
+	frame->mem_used += vs_size;
+
+	memcpy(frame->mem_address + frame->mem_used, frame->plbu_commands,
+	       8 * frame->plbu_commands_count);
+	frame->plbu_commands_physical = frame->mem_physical + frame->mem_used;
+	frame->mem_used += plbu_size;
+
+	return 0;
 }
 
 int
@@ -692,7 +808,6 @@ plbu_info_attach_uniforms(struct limare_frame *frame, struct draw_info *draw,
 			  struct symbol **uniforms, int count, int size)
 {
 	struct plbu_info *info = draw->plbu;
-	void *address;
 	unsigned int *array;
 	int i;
 
@@ -710,7 +825,7 @@ plbu_info_attach_uniforms(struct limare_frame *frame, struct draw_info *draw,
 	if (i == count)
 		return 0;
 
-	if ((frame->mem_size - frame->mem_used) < (0x40 + ALIGN(size, 0x40))) {
+	if (limare_frame_mem_reserve(frame, 0x40 + ALIGN(size, 0x40))) {
 		printf("%s: no space for plbu uniforms\n", __func__);
 		return -1;
 	}
@@ -725,9 +840,24 @@ plbu_info_attach_uniforms(struct limare_frame *frame, struct draw_info *draw,
 	info->uniform_size = size;
 	frame->mem_used += ALIGN(4 * size, 0x40);
 
-	address = frame->mem_address + info->uniform_offset;
 	array[0] = frame->mem_physical + info->uniform_offset;
 
+	plbu_info_uniforms_rewrite(frame, draw, uniforms, count);
+
+	return 0;
+}
+
+/* (Re)write the current uniform values into the block of this draw. */
+void
+plbu_info_uniforms_rewrite(struct limare_frame *frame, struct draw_info *draw,
+			   struct symbol **uniforms, int count)
+{
+	void *address = frame->mem_address + draw->plbu->uniform_offset;
+	int i;
+
+	if (!draw->plbu->uniform_size)
+		return;
+
 	for (i = 0; i < count; i++) {
 		struct symbol *symbol = uniforms[i];
 
@@ -743,8 +873,6 @@ plbu_info_attach_uniforms(struct limare_frame *frame, struct draw_info *draw,
 		       symbol->component_size * symbol->offset,
 		       symbol->data, symbol->size);
 	}
-
-	return 0;
 }
 
 void
@@ -786,7 +914,7 @@ plbu_info_attach_textures(struct limare_state *state,
 	for (i = 0; i < program->fragment_uniform_count; i++) {
 		struct symbol *symbol = program->fragment_uniforms[i];
 		struct limare_texture *texture;
-		int handle, j;
+		int handle;
 
 		if (symbol->value_type != SYMBOL_SAMPLER)
 			continue;
@@ -800,18 +928,8 @@ plbu_info_attach_textures(struct limare_state *state,
 			return -1;
 		}
 
-		/* find the matching texture */
-		for (j = 0; j < LIMARE_TEXTURE_COUNT; j++) {
-			if (!state->textures[j])
-				continue;
-
-			texture = state->textures[j];
-
-			if (handle == texture->handle)
-				break;
-		}
-
-		if (j == LIMARE_TEXTURE_COUNT) {
+		texture = limare_handle_lookup(&state->textures, handle);
+		if (!texture) {
 			printf("%s: Error: symbol %s texture handle not "
 			       "found\n", __func__, symbol->name);
 			return -1;
@@ -66,16 +66,19 @@ struct vs_info {
 
 int vs_info_attach_uniforms(struct limare_frame *frame, struct draw_info *draw,
 			    struct symbol **uniforms, int count, int size);
+void vs_info_uniforms_rewrite(struct limare_frame *frame,
+			      struct draw_info *draw,
+			      struct symbol **uniforms, int count);
 
 int vs_info_attach_attribute(struct limare_frame *frame,
 			     struct draw_info *draw, struct symbol *attribute);
 int vs_info_attach_varyings(struct limare_program *program,
 			    struct limare_frame *frame, struct draw_info *draw);
 
-void vs_commands_draw_add(struct limare_state *state,
-			  struct limare_frame *frame,
-			  struct limare_program *program,
-			  struct draw_info *draw);
+int vs_commands_draw_add(struct limare_state *state,
+			 struct limare_frame *frame,
+			 struct limare_program *program,
+			 struct draw_info *draw);
 void vs_info_finalize(struct limare_state *state, struct limare_frame *frame,
 		      struct limare_program *program,
 		      struct draw_info *draw, struct vs_info *info);
@@ -100,20 +103,24 @@ int plbu_command_queue_create(struct limare_state *state,
 			      struct limare_frame *frame,
 			      int size, int heap_size);
 
-void plbu_viewport_set(struct limare_frame *frame,
-		       float x, float y, float w, float h);
+int plbu_viewport_set(struct limare_frame *frame,
+		      float x, float y, float w, float h);
 
-void plbu_commands_draw_add(struct limare_state *state,
-			    struct limare_frame *frame, struct draw_info *draw);
-void plbu_commands_depth_buffer_clear_draw_add(struct limare_state *state,
-					       struct limare_frame *frame,
-					       struct draw_info *draw, unsigned
-					       int varying_vertices_physical);
-void plbu_commands_finish(struct limare_frame *frame);
+int plbu_commands_draw_add(struct limare_state *state,
+			   struct limare_frame *frame, struct draw_info *draw);
+int plbu_commands_depth_buffer_clear_draw_add(struct limare_state *state,
+					      struct limare_frame *frame,
+					      struct draw_info *draw, unsigned
+					      int varying_vertices_physical);
+int plbu_commands_finish(struct limare_frame *frame);
+int command_queues_upload(struct limare_frame *frame);
 
 int plbu_info_attach_uniforms(struct limare_frame *frame,
 			      struct draw_info *draw, struct symbol **uniforms,
 			      int count, int size);
+void plbu_info_uniforms_rewrite(struct limare_frame *frame,
+				struct draw_info *draw,
+				struct symbol **uniforms, int count);
 void plbu_info_attach_indices(struct draw_info *draw, int indices_type,
 			      unsigned int mem_physical);
 int plbu_info_attach_textures(struct limare_state *state,
@@ -130,6 +137,11 @@ struct draw_info {
 	/* will be different from attribute when doing indexed draws */
 	int vertex_count;
 
+	/* to match replayed draws with the recorded ones */
+	struct limare_program *program;
+	/* uses the uniform block of an earlier draw of the same program */
+	int uniforms_shared;
+
 	struct vs_info vs[1];
 
 	struct plbu_info plbu[1];
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Tables which hand out the handles of the textures, programs and buffers.
+ *
+ * The low bits of a handle are the slot its object sits in, so a lookup is
+ * a single index into the table. Above that sits the generation of the
+ * slot, which gets bumped when its object is freed, so that a stale handle
+ * does not find whatever took over the slot later on. The two bits below
+ * the sign bit tell what kind of object it is, so that handles stay
+ * positive. Freed slots get reused first, and the
+ * table doubles once all of its slots are taken.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "limare.h"
+#include "handle.h"
+
+void
+limare_handle_table_init(struct limare_handle_table *table, unsigned int type)
+{
+	memset(table, 0, sizeof(struct limare_handle_table));
+	table->type = type & LIMARE_HANDLE_TYPE_MASK;
+}
+
+void
+limare_handle_table_fini(struct limare_handle_table *table)
+{
+	free(table->objects);
+	free(table->generations);
+	free(table->free_slots);
+
+	limare_handle_table_init(table, table->type);
+}
+
+static int
+limare_handle_table_grow(struct limare_handle_table *table)
+{
+	int size = table->size ? 2 * table->size : LIMARE_HANDLE_TABLE_SIZE;
+	void **objects;
+	unsigned short *generations;
+	int *free_slots;
+
+	/* the last slot stays unused, so that no handle is ever -1 */
+	if (size > (LIMARE_HANDLE_SLOT_MAX - 1))
+		size = LIMARE_HANDLE_SLOT_MAX - 1;
+	if (size <= table->size) {
+		printf("%s: Error: all 0x%X slots have been taken!\n",
+		       __func__, table->size);
+		return -1;
+	}
+
+	objects = realloc(table->objects, size * sizeof(void *));
+	if (objects)
+		table->objects = objects;
+	generations = realloc(table->generations,
+			      size * sizeof(unsigned short));
+	if (generations)
+		table->generations = generations;
+	free_slots = realloc(table->free_slots, size * sizeof(int));
+	if (free_slots)
+		table->free_slots = free_slots;
+
+	if (!objects || !generations || !free_slots) {
+		printf("%s: Error: failed to grow to 0x%X slots: %s\n",
+		       __func__, size, strerror(errno));
+		return -1;
+	}
+
+	memset(table->objects + table->size, 0,
+	       (size - table->size) * sizeof(void *));
+	memset(table->generations + table->size, 0,
+	       (size - table->size) * sizeof(unsigned short));
+	table->size = size;
+
+	return 0;
+}
+
+/* Returns the handle for the object, or -1 when the table is full. */
+int
+limare_handle_new(struct limare_handle_table *table, void *object)
+{
+	int slot;
+
+	if (table->free_count)
+		slot = table->free_slots[--table->free_count];
+	else {
+		if ((table->used == table->size) &&
+		    limare_handle_table_grow(table))
+			return -1;
+		slot = table->used++;
+	}
+
+	table->objects[slot] = object;
+	table->count++;
+
+	return table->type |
+		(table->generations[slot] << LIMARE_HANDLE_SLOT_BITS) | slot;
+}
+
+void *
+limare_handle_lookup(struct limare_handle_table *table, int handle)
+{
+	int slot = handle & (LIMARE_HANDLE_SLOT_MAX - 1);
+	unsigned int generation = (handle >> LIMARE_HANDLE_SLOT_BITS) &
+		LIMARE_HANDLE_GENERATION_MASK;
+
+	if (((handle & LIMARE_HANDLE_TYPE_MASK) != table->type) ||
+	    (slot >= table->used) || (table->generations[slot] != generation))
+		return NULL;
+
+	return table->objects[slot];
+}
+
+/*
+ * Drops the object from the table and returns it, or NULL when the handle
+ * is not, or no longer, valid.
+ */
+void *
+limare_handle_free(struct limare_handle_table *table, int handle)
+{
+	void *object = limare_handle_lookup(table, handle);
+	int slot = handle & (LIMARE_HANDLE_SLOT_MAX - 1);
+
+	if (!object)
+		return NULL;
+
+	table->objects[slot] = NULL;
+	table->generations[slot] = (table->generations[slot] + 1) &
+		LIMARE_HANDLE_GENERATION_MASK;
+	table->free_slots[table->free_count++] = slot;
+	table->count--;
+
+	return object;
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Handle tables for the textures, programs and buffers, see handle.c.
+ */
+
+#ifndef LIMARE_HANDLE_H
+#define LIMARE_HANDLE_H 1
+
+/* what the first table allocation holds */
+#define LIMARE_HANDLE_TABLE_SIZE 16
+
+void limare_handle_table_init(struct limare_handle_table *table,
+			      unsigned int type);
+void limare_handle_table_fini(struct limare_handle_table *table);
+
+int limare_handle_new(struct limare_handle_table *table, void *object);
+void *limare_handle_lookup(struct limare_handle_table *table, int handle);
+void *limare_handle_free(struct limare_handle_table *table, int handle);
+
+#endif /* LIMARE_HANDLE_H */
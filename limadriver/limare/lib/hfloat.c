@@ -36,9 +36,20 @@
  * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
  * DEALINGS IN THE SOFTWARE.
  */
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "from_float.h"
 #include "hfloat.h"
 
+/* the vfp has a half float conversion, on all aarch64 and some armv7 */
+#if defined(__aarch64__) || \
+	((defined(__ARM_NEON__) || defined(__ARM_NEON)) && \
+	 defined(__ARM_FP) && (__ARM_FP & 2) && defined(__ARM_FP16_FORMAT_IEEE))
+#define HFLOAT_NEON_FP16 1
+#endif
+
 
 hfloat
 float_to_hfloat(float fp)
@@ -72,3 +83,60 @@ float_to_hfloat(float fp)
 
 	return (hfloat)result;
 }
+
+/*
+ * float_to_hfloat over a whole array, four at a time with neon. With the
+ * fp16 extension, vcvt.f16.f32 does it, and rounds to nearest instead of
+ * truncating. Otherwise the above gets done with integer vectors, with
+ * exactly the same results.
+ */
+void
+floats_to_hfloats(hfloat *dst, const float *src, int count)
+{
+	int i = 0;
+
+#if defined(HFLOAT_NEON_FP16)
+	for (; (i + 4) <= count; i += 4) {
+		float16x4_t half = vcvt_f16_f32(vld1q_f32(src + i));
+
+		vst1_u16(dst + i, vreinterpret_u16_f16(half));
+	}
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+	for (; (i + 4) <= count; i += 4) {
+		uint32x4_t x = vreinterpretq_u32_f32(vld1q_f32(src + i));
+		uint32x4_t sign = vandq_u32(vshrq_n_u32(x, 16),
+					    vdupq_n_u32(0x8000));
+		uint32x4_t exp = vandq_u32(vshrq_n_u32(x, 23),
+					   vdupq_n_u32(0xFF));
+		uint32x4_t mantissa = vandq_u32(x, vdupq_n_u32(0x007FFFFF));
+		uint32x4_t normal, small, large, nan, result;
+
+		normal = vorrq_u32(vshlq_n_u32(vsubq_u32(exp,
+							 vdupq_n_u32(0x70)),
+					       10),
+				   vshrq_n_u32(mantissa, 13));
+
+		/* shifts right by 14 + 0x70 - exp, which ends up 0 when large */
+		small = vshlq_u32(mantissa,
+				  vsubq_s32(vreinterpretq_s32_u32(exp),
+					    vdupq_n_s32(0x7E)));
+
+		/* the nan mantissa also sets the sign, as it does above */
+		nan = vandq_u32(vceqq_u32(exp, vdupq_n_u32(0xFF)),
+				vtstq_u32(mantissa, mantissa));
+		large = vorrq_u32(vdupq_n_u32(0x7C00),
+				  vandq_u32(nan, vdupq_n_u32(0xFFFF)));
+
+		result = vbslq_u32(vcltq_u32(exp, vdupq_n_u32(0x70)),
+				   small, normal);
+		result = vbslq_u32(vcgtq_u32(exp, vdupq_n_u32(0x8F)),
+				   large, result);
+		result = vorrq_u32(result, sign);
+
+		vst1_u16(dst + i, vmovn_u32(result));
+	}
+#endif
+
+	for (; i < count; i++)
+		dst[i] = float_to_hfloat(src[i]);
+}
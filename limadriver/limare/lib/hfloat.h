@@ -7,5 +7,6 @@
 typedef unsigned short hfloat;
 
 hfloat float_to_hfloat(float fp);
+void floats_to_hfloats(hfloat *dst, const float *src, int count);
 
 #endif /* HFLOAT_H */
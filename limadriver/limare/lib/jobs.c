@@ -46,85 +46,350 @@
 #include "plb.h"
 #include "fb.h"
 #include "pp.h"
+#include "trace.h"
 
-static pthread_mutex_t gp_job_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t gp_job_cond = PTHREAD_COND_INITIALIZER;
-static unsigned int gp_job_done;
+/* the id of a job in the trace, unique over all the states. */
+#define LIMARE_TRACE_JOB(state, id) \
+	(((uint64_t) (state)->fd << 32) | ((id) & 0x3FFFFFFF))
 
-static pthread_mutex_t pp_job_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t pp_job_cond = PTHREAD_COND_INITIALIZER;
-static unsigned int pp_job_done;
+/*
+ * Frames are rendered in a two stage pipeline: the gp thread hands the gp
+ * job of a frame to the kernel, and passes the frame on to the pp thread
+ * straight away. The pp thread waits for the gp job of the frame to
+ * finish, then runs the pp job and hands the frame on to the flip
+ * thread. So the kernel can have the gp jobs of several frames queued up
+ * while the pp is still busy with the current one, and the frames are
+ * still shown in order.
+ *
+ * limare_frame_new() never lets more than FRAME_COUNT frames be in flight,
+ * so a ring of FRAME_COUNT entries is enough for each queue.
+ */
+struct limare_render_queue {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	struct limare_frame *frames[FRAME_COUNT];
+	int head;
+	int count;
+
+	int stop;
+};
+
+/*
+ * Job completion, one slot for each frame that can be in flight. The
+ * notification thread stores the id of the finished job, and wakes up the
+ * only thread that can be waiting on the slot, the pp thread. A slot is
+ * free for reuse only once the frame has been flipped.
+ */
+struct limare_job_slot {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	unsigned int gp_done;
+	unsigned int pp_done;
+
+	struct timespec queued;
+	struct timespec gp_start;
+	struct timespec flip_queued;
+};
+
+/*
+ * Everything needed to get jobs through the kernel for one limare_state.
+ * Each state has its own mali fd, and therefore its own notifications, so
+ * several states can have jobs running at the same time.
+ */
+struct limare_jobs {
+	struct limare_job_slot slots[FRAME_COUNT];
+
+	pthread_t notification_pthread;
+	int notification_stop;
+
+	pthread_mutex_t job_time_mutex;
+	long long gp_job_time;
+	long long pp_job_time;
+
+	/* since the last limare_job_stats_get() with reset set. */
+	struct limare_job_stats stats;
+	struct timespec stats_time;
+
+	/* bus traffic, from the performance counters, in bytes. */
+	int counters;
+	unsigned int counter_jobs;
+	unsigned long long bus_read;
+	unsigned long long bus_write;
+	/* how far the plbu got into the tile heap, summed over the gp jobs */
+	unsigned int heap_jobs;
+	unsigned long long heap_bytes;
+	unsigned int heap_max;
+
+	struct limare_render_queue gp_queue;
+	struct limare_render_queue pp_queue;
+	struct limare_render_queue flip_queue;
+
+	pthread_t render_gp_pthread;
+	pthread_t render_pp_pthread;
+	pthread_t render_flip_pthread;
+
+	/* LIMA_FLIP=vsync: show the newest frame at each vblank */
+	int flip_vsync;
+	unsigned int flips_shown;
+	unsigned int flips_skipped;
+
+	struct timespec time;
+};
+
+static struct limare_job_slot *
+limare_job_slot(struct limare_jobs *jobs, unsigned int id)
+{
+	return &jobs->slots[(id & 0x3FFFFFFF) % FRAME_COUNT];
+}
 
 static void
-limare_gp_job_done(unsigned int id)
+limare_job_done(struct limare_jobs *jobs, unsigned int id)
 {
+	struct limare_job_slot *slot = limare_job_slot(jobs, id);
 	int ret;
 
-	ret = pthread_mutex_lock(&gp_job_mutex);
+	ret = pthread_mutex_lock(&slot->mutex);
 	if (ret)
 		printf("%s: error locking mutex: %s\n", __func__,
 		       strerror(ret));
 
-        gp_job_done = id;
+	if ((id & 0xC0000000) == 0xC0000000)
+		slot->pp_done = id;
+	else
+		slot->gp_done = id;
 
-        pthread_cond_broadcast(&gp_job_cond);
+	pthread_cond_signal(&slot->cond);
 
-        ret = pthread_mutex_unlock(&gp_job_mutex);
+	ret = pthread_mutex_unlock(&slot->mutex);
 	if (ret)
 		printf("%s: error unlocking mutex: %s\n", __func__,
 		       strerror(ret));
 }
 
 static void
-limare_gp_job_wait(struct limare_frame *frame)
+limare_job_wait(struct limare_jobs *jobs, unsigned int id)
 {
-	unsigned int job_id = frame->id | 0x80000000;
+	struct limare_job_slot *slot = limare_job_slot(jobs, id);
+	unsigned int *done;
 	int ret;
 
-	ret = pthread_mutex_lock(&gp_job_mutex);
+	if ((id & 0xC0000000) == 0xC0000000)
+		done = &slot->pp_done;
+	else
+		done = &slot->gp_done;
+
+	ret = pthread_mutex_lock(&slot->mutex);
 	if (ret)
 		printf("%s: error locking mutex: %s\n", __func__,
 		       strerror(ret));
 
-	while (gp_job_done < job_id)
-		pthread_cond_wait(&gp_job_cond, &gp_job_mutex);
+	while (*done != id)
+		pthread_cond_wait(&slot->cond, &slot->mutex);
 
-	ret = pthread_mutex_unlock(&gp_job_mutex);
+	ret = pthread_mutex_unlock(&slot->mutex);
 	if (ret)
 		printf("%s: error unlocking mutex: %s\n", __func__,
 		       strerror(ret));
 }
 
+/*
+ * Performance counters, as listed for the Mali-400 gp and pp. Both count
+ * the traffic on their side of the bus in 64bit words. On MP parts this
+ * is the traffic into the l2 cache, the closest that the per job counters
+ * get to the dram.
+ */
+#define LIMA_GP_PERF_WORDS_READ		0x05
+#define LIMA_GP_PERF_WORDS_WRITTEN	0x06
+#define LIMA_PP_PERF_BUS_READS		0x02
+#define LIMA_PP_PERF_BUS_WRITES		0x03
+
+#define LIMA_PERF_WORD_SIZE		8
+
+static void
+limare_job_counters_setup(struct limare_state *state, int gp,
+			  unsigned int *flag, unsigned int *src0,
+			  unsigned int *src1)
+{
+	if (!state->jobs->counters)
+		return;
+
+	*flag = _MALI_PERFORMANCE_COUNTER_FLAG_SRC0_ENABLE |
+		_MALI_PERFORMANCE_COUNTER_FLAG_SRC1_ENABLE;
+
+	if (gp) {
+		*src0 = LIMA_GP_PERF_WORDS_READ;
+		*src1 = LIMA_GP_PERF_WORDS_WRITTEN;
+	} else {
+		*src0 = LIMA_PP_PERF_BUS_READS;
+		*src1 = LIMA_PP_PERF_BUS_WRITES;
+	}
+}
+
+static void
+limare_job_counters_add(struct limare_jobs *jobs,
+			unsigned long long read, unsigned long long write)
+{
+	pthread_mutex_lock(&jobs->job_time_mutex);
+	jobs->counter_jobs++;
+	jobs->bus_read += read * LIMA_PERF_WORD_SIZE;
+	jobs->bus_write += write * LIMA_PERF_WORD_SIZE;
+	pthread_mutex_unlock(&jobs->job_time_mutex);
+}
+
+static void
+limare_pp_job_counters(struct limare_state *state,
+		       _mali_uk_wait_for_notification_s *wait)
+{
+	unsigned long long read = 0, write = 0;
+
+	if (state->kernel_version < MALI_DRIVER_VERSION_R3P0) {
+		read = wait->data.pp_job_finished.perf_counter0;
+		write = wait->data.pp_job_finished.perf_counter1;
+	} else {
+		struct lima_pp_job_finished_r3p0 *finished =
+			(struct lima_pp_job_finished_r3p0 *) &wait->data;
+		int i;
+
+		/* one entry for each of the cores that the job ran on. */
+		for (i = 0; (i < state->pp_core_count) &&
+			     (i < LIMA_PP_MAX_SUB_JOBS); i++) {
+			read += finished->perf_counter0[i];
+			write += finished->perf_counter1[i];
+		}
+	}
+
+	limare_job_counters_add(state->jobs, read, write);
+}
+
+/*
+ * The polygon lists overflow from the plb blocks into the tile heap, the
+ * gp reports where in the heap it stopped. The frame keeps this, so that
+ * limare_frame_reset can size the heap of the next frames from it.
+ */
 static void
-limare_pp_job_done(unsigned int id)
+limare_job_heap_add(struct limare_state *state, unsigned int id,
+		    unsigned int heap_current)
 {
-	pthread_mutex_lock(&pp_job_mutex);
+	struct limare_jobs *jobs = state->jobs;
+	struct limare_frame *frame =
+		state->frames[(id & 0x3FFFFFFF) % FRAME_COUNT];
+	unsigned int heap_start;
+	int used;
+
+	if (!frame)
+		return;
 
-        pp_job_done = id;
+	heap_start = frame->mem_physical + frame->tile_heap_offset;
+	if ((heap_current >= heap_start) &&
+	    (heap_current <= (heap_start + frame->tile_heap_size)))
+		used = heap_current - heap_start;
+	else if (frame->tile_heap_grown)
+		/* it stopped in one of the blocks handed out on oom. */
+		used = frame->tile_heap_size + frame->tile_heap_grown;
+	else
+		return;
 
-        pthread_cond_broadcast(&pp_job_cond);
+	frame->tile_heap_used = used;
 
-        pthread_mutex_unlock(&pp_job_mutex);
+	pthread_mutex_lock(&jobs->job_time_mutex);
+	jobs->heap_jobs++;
+	jobs->heap_bytes += used;
+	if (jobs->heap_max < (unsigned int) used)
+		jobs->heap_max = used;
+	pthread_mutex_unlock(&jobs->job_time_mutex);
 }
 
 static void
-limare_pp_job_wait(struct limare_frame *frame)
+limare_gp_job_heap(struct limare_state *state,
+		   _mali_uk_wait_for_notification_s *wait)
 {
-	unsigned int job_id = frame->id | 0xC0000000;
+	if (state->kernel_version < MALI_DRIVER_VERSION_R3P0) {
+		limare_job_heap_add(state,
+				    wait->data.gp_job_finished.user_job_ptr,
+				    wait->data.gp_job_finished.heap_current_addr);
+	} else {
+		struct lima_gp_job_finished_r3p0 *finished =
+			(struct lima_gp_job_finished_r3p0 *) &wait->data;
+
+		limare_job_heap_add(state, finished->user_job_ptr,
+				    finished->heap_current_addr);
+	}
+}
 
-	pthread_mutex_lock(&pp_job_mutex);
+static void
+limare_gp_job_counters(struct limare_state *state,
+		       _mali_uk_wait_for_notification_s *wait)
+{
+	if (state->kernel_version < MALI_DRIVER_VERSION_R3P0) {
+		limare_job_counters_add(state->jobs,
+					wait->data.gp_job_finished.perf_counter0,
+					wait->data.gp_job_finished.perf_counter1);
+	} else {
+		struct lima_gp_job_finished_r3p0 *finished =
+			(struct lima_gp_job_finished_r3p0 *) &wait->data;
+
+		limare_job_counters_add(state->jobs, finished->perf_counter0,
+					finished->perf_counter1);
+	}
+}
 
-	while (pp_job_done < job_id)
-		pthread_cond_wait(&pp_job_cond, &pp_job_mutex);
+/*
+ * The plbu ran out of tile heap, and the kernel holds the gp job until we
+ * answer. Map in a fresh block behind what the frame has used so far, as
+ * large as the whole heap up to now, and have the plbu carry on there.
+ * The frame is rendering, so nothing else allocates from it right now.
+ */
+static void
+limare_gp_job_oom(struct limare_state *state,
+		  _mali_uk_gp_job_suspended_s *suspended)
+{
+	struct lima_gp_suspend_response response = { 0 };
+	struct limare_frame *frame =
+		state->frames[(suspended->user_job_ptr & 0x3FFFFFFF) %
+			      FRAME_COUNT];
+	int request, size;
+
+	response.fd = state->fd;
+	response.cookie = suspended->cookie;
+	response.code = LIMA_GP_JOB_ABORT;
+
+	if (frame &&
+	    (suspended->reason == _MALIGP_JOB_SUSPENDED_OUT_OF_MEMORY)) {
+		size = frame->tile_heap_size + frame->tile_heap_grown;
+
+		if (!limare_frame_mem_reserve(frame, size)) {
+			response.code = LIMA_GP_JOB_RESUME_WITH_NEW_HEAP;
+			response.arguments[0] =
+				frame->mem_physical + frame->mem_used;
+			response.arguments[1] = response.arguments[0] + size;
+
+			frame->mem_used += size;
+			frame->tile_heap_grown += size;
+		}
+	}
+
+	if (response.code == LIMA_GP_JOB_ABORT)
+		printf("%s: Error: no tile heap left for gp job 0x%08X\n",
+		       __func__, suspended->user_job_ptr);
+
+	if (state->kernel_version < MALI_DRIVER_VERSION_R3P0)
+		request = LIMA_GP_SUSPEND_RESPONSE_R2P1;
+	else
+		request = LIMA_GP_SUSPEND_RESPONSE_R3P0;
 
-        pthread_mutex_unlock(&pp_job_mutex);
+	if (ioctl(state->fd, request, &response) == -1)
+		printf("%s: Error: failed to resume gp job: %s\n",
+		       __func__, strerror(errno));
 }
 
 static void *
 limare_notification_thread(void *arg)
 {
 	struct limare_state *state = arg;
-	static _mali_uk_wait_for_notification_s wait = { 0 };
+	struct limare_jobs *jobs = state->jobs;
+	_mali_uk_wait_for_notification_s wait = { 0 };
 	int request;
 	int ret;
 
@@ -133,9 +398,19 @@ limare_notification_thread(void *arg)
 	else
 		request = MALI_IOC_WAIT_FOR_NOTIFICATION_R3P1;
 
+	limare_trace_thread("lima notification");
+
 	while (1) {
 		while (1) {
 			do {
+				/* all our jobs are done by now. */
+				if (jobs->notification_stop)
+					return NULL;
+
+				/*
+				 * The kernel returns as soon as a job is done,
+				 * the timeout only lets us notice the stop.
+				 */
 				wait.code.timeout = 500;
 				ret = ioctl(state->fd, request, &wait);
 				if (ret == -1) {
@@ -146,9 +421,18 @@ limare_notification_thread(void *arg)
 			} while (wait.code.type ==
 				 _MALI_NOTIFICATION_CORE_TIMEOUT);
 
+			limare_trace("notification", LIMARE_TRACE_INSTANT,
+				     wait.code.type);
+
 			if ((wait.code.type & 0xFF) == 0x10)
 				break;
 
+			if (wait.code.type == _MALI_NOTIFICATION_GP_STALLED) {
+				limare_gp_job_oom(state,
+						  &wait.data.gp_job_suspended);
+				continue;
+			}
+
 			printf("%s: %x: %x\n", __func__, wait.code.type,
 			       wait.data.gp_job_suspended.reason);
 		}
@@ -161,29 +445,39 @@ limare_notification_thread(void *arg)
 				printf("pp job 0x%08X returned 0x%08X\n",
 				       wait.data.pp_job_finished.user_job_ptr,
 				       status);
-
-			limare_pp_job_done(wait.data.pp_job_finished.user_job_ptr);
+			else if (jobs->counters)
+				limare_pp_job_counters(state, &wait);
+
+			limare_trace("pp job", LIMARE_TRACE_ASYNC_END,
+				     LIMARE_TRACE_JOB(state,
+				     wait.data.pp_job_finished.user_job_ptr));
+			limare_job_done(jobs,
+					wait.data.pp_job_finished.user_job_ptr);
 		} else if (wait.code.type == _MALI_NOTIFICATION_GP_FINISHED) {
 			_mali_uk_job_status status =
 				wait.data.gp_job_finished.status;
 
 			if (status != _MALI_UK_JOB_STATUS_END_SUCCESS)
 				printf("gp job returned 0x%08X\n", status);
-
-			limare_gp_job_done(wait.data.pp_job_finished.user_job_ptr);
+			else {
+				limare_gp_job_heap(state, &wait);
+				if (jobs->counters)
+					limare_gp_job_counters(state, &wait);
+			}
+
+			limare_trace("gp job", LIMARE_TRACE_ASYNC_END,
+				     LIMARE_TRACE_JOB(state,
+				     wait.data.gp_job_finished.user_job_ptr));
+			limare_job_done(jobs,
+					wait.data.gp_job_finished.user_job_ptr);
 		}
 	}
 
 	return NULL;
 }
 
-static pthread_t limare_notification_pthread;
-
-static pthread_mutex_t gp_job_time_mutex = PTHREAD_MUTEX_INITIALIZER;
-static long long gp_job_time;
-
-void
-limare_gp_job_bench_start(struct timespec *start)
+static void
+limare_job_bench_start(struct timespec *start)
 {
 	if (clock_gettime(CLOCK_MONOTONIC, start)) {
 		printf("Error: failed to get time: %s\n", strerror(errno));
@@ -191,8 +485,29 @@ limare_gp_job_bench_start(struct timespec *start)
 	}
 }
 
-void
-limare_gp_job_bench_stop(struct timespec *start)
+static void
+limare_job_histogram_add(struct limare_job_histogram *histogram,
+			 long long usec)
+{
+	int bucket = 0;
+
+	while ((bucket < (LIMARE_JOB_HISTOGRAM_SIZE - 1)) &&
+	       (usec >> (bucket + 1)))
+		bucket++;
+
+	if (!histogram->count || (usec < histogram->min))
+		histogram->min = usec;
+	if (usec > histogram->max)
+		histogram->max = usec;
+
+	histogram->count++;
+	histogram->total += usec;
+	histogram->buckets[bucket]++;
+}
+
+static void
+limare_job_bench_stop(struct limare_jobs *jobs, struct timespec *start,
+		      enum limare_job_stat stat)
 {
 	struct timespec new = { 0 };
 	long long total;
@@ -205,40 +520,35 @@ limare_gp_job_bench_stop(struct timespec *start)
 	total = (new.tv_sec - start->tv_sec) * 1000000;
 	total += (new.tv_nsec - start->tv_nsec) / 1000;
 
-	pthread_mutex_lock(&gp_job_time_mutex);
-	gp_job_time += total;
-	pthread_mutex_unlock(&gp_job_time_mutex);
+	pthread_mutex_lock(&jobs->job_time_mutex);
+	if (stat == LIMARE_JOB_STAT_GP)
+		jobs->gp_job_time += total;
+	else if (stat == LIMARE_JOB_STAT_PP)
+		jobs->pp_job_time += total;
+	limare_job_histogram_add(&jobs->stats.histograms[stat], total);
+	pthread_mutex_unlock(&jobs->job_time_mutex);
 }
 
-static pthread_mutex_t pp_job_time_mutex = PTHREAD_MUTEX_INITIALIZER;
-static long long pp_job_time;
-
+/*
+ * The cpu phases of a frame get timed into the same statistics as the
+ * jobs, so that a slow frame can be pinned on the cpu, gp or pp from one
+ * report. Ending a phase begins the next one, at the same time.
+ */
 void
-limare_pp_job_bench_start(struct timespec *start)
+limare_job_phase_begin(struct timespec *start)
 {
-	if (clock_gettime(CLOCK_MONOTONIC, start)) {
-		printf("Error: failed to get time: %s\n", strerror(errno));
-		return;
-	}
+	limare_job_bench_start(start);
 }
 
 void
-limare_pp_job_bench_stop(struct timespec *start)
+limare_job_phase_end(struct limare_state *state, struct timespec *start,
+		     enum limare_job_stat stat)
 {
-	struct timespec new = { 0 };
-	long long total;
-
-	if (clock_gettime(CLOCK_MONOTONIC, &new)) {
-		printf("Error: failed to get time: %s\n", strerror(errno));
+	if (!state->jobs)
 		return;
-	}
 
-	total = (new.tv_sec - start->tv_sec) * 1000000;
-	total += (new.tv_nsec - start->tv_nsec) / 1000;
-
-	pthread_mutex_lock(&pp_job_time_mutex);
-	pp_job_time += total;
-	pthread_mutex_unlock(&pp_job_time_mutex);
+	limare_job_bench_stop(state->jobs, start, stat);
+	limare_job_bench_start(start);
 }
 
 static int
@@ -255,6 +565,11 @@ limare_gp_job_start_r2p1(struct limare_state *state,
 	job.watchdog_msecs = 0;
 	job.frame = *frame_regs;
 	job.abort_id = 0;
+
+	limare_job_counters_setup(state, 1, &job.perf_counter_flag,
+				  &job.perf_counter_src0,
+				  &job.perf_counter_src1);
+
 	ret = ioctl(state->fd, LIMA_GP_START_JOB_R2P1, &job);
 	if (ret == -1) {
 		printf("%s: Error: failed to start job: %s\n",
@@ -277,6 +592,11 @@ limare_gp_job_start_r3p0(struct limare_state *state,
 	job.user_job_ptr = frame->id | 0x80000000;
 	job.priority = 1;
 	job.frame = *frame_regs;
+
+	limare_job_counters_setup(state, 1, &job.perf_counter_flag,
+				  &job.perf_counter_src0,
+				  &job.perf_counter_src1);
+
 	ret = ioctl(state->fd, LIMA_GP_START_JOB_R3P0, &job);
 	if (ret == -1) {
 		printf("%s: Error: failed to start job: %s\n",
@@ -332,6 +652,10 @@ limare_m200_pp_job_start_direct(struct limare_state *state,
 	job.wb[0] = *wb_regs;
 	job.abort_id = 0;
 
+	limare_job_counters_setup(state, 0, &job.perf_counter_flag,
+				  &job.perf_counter_src0,
+				  &job.perf_counter_src1);
+
 	ret = ioctl(state->fd, LIMA_M200_PP_START_JOB, &job);
 	if (ret == -1) {
 		printf("%s: Error: failed to start job: %s\n",
@@ -359,6 +683,10 @@ limare_m400_pp_job_start_r2p1(struct limare_state *state,
 	job.wb[0] = *wb_regs;
 	job.abort_id = 0;
 
+	limare_job_counters_setup(state, 0, &job.perf_counter_flag,
+				  &job.perf_counter_src0,
+				  &job.perf_counter_src1);
+
 	ret = ioctl(state->fd, LIMA_M400_PP_START_JOB_R2P1, &job);
 	if (ret == -1) {
 		printf("%s: Error: failed to start job: %s\n",
@@ -391,6 +719,10 @@ limare_m400_pp_job_start_r3p0(struct limare_state *state,
 	job.wb0 = *wb_regs;
 	job.num_cores = state->pp_core_count;
 
+	limare_job_counters_setup(state, 0, &job.perf_counter_flag,
+				  &job.perf_counter_src0,
+				  &job.perf_counter_src1);
+
 	ret = ioctl(state->fd, LIMA_M400_PP_START_JOB_R3P0, &job);
 	if (ret == -1) {
 		printf("%s: Error: failed to start job: %s\n",
@@ -423,6 +755,10 @@ limare_m400_pp_job_start_r3p1(struct limare_state *state,
 	job.wb0 = *wb_regs;
 	job.num_cores = state->pp_core_count;
 
+	limare_job_counters_setup(state, 0, &job.perf_counter_flag,
+				  &job.perf_counter_src0,
+				  &job.perf_counter_src1);
+
 	ret = ioctl(state->fd, LIMA_M400_PP_START_JOB_R3P0, &job);
 	if (ret == -1) {
 		printf("%s: Error: failed to start job: %s\n",
@@ -457,6 +793,10 @@ limare_m400_pp_job_start_r3p2(struct limare_state *state,
 	job.fence = -1;
 	job.stream = -1;
 
+	limare_job_counters_setup(state, 0, &job.perf_counter_flag,
+				  &job.perf_counter_src0,
+				  &job.perf_counter_src1);
+
 	ret = ioctl(state->fd, LIMA_M400_PP_START_JOB_R3P0, &job);
 	if (ret == -1) {
 		printf("%s: Error: failed to start job: %s\n",
@@ -493,6 +833,10 @@ limare_m400_pp_job_start_r3p2_01rel2(struct limare_state *state,
 	job.num_memory_cookies = 0;
 	job.memory_cookies = NULL;
 
+	limare_job_counters_setup(state, 0, &job.perf_counter_flag,
+				  &job.perf_counter_src0,
+				  &job.perf_counter_src1);
+
 	ret = ioctl(state->fd, LIMA_M400_PP_START_JOB_R3P0, &job);
 	if (ret == -1) {
 		printf("%s: Error: failed to start job: %s\n",
@@ -504,284 +848,627 @@ limare_m400_pp_job_start_r3p2_01rel2(struct limare_state *state,
 }
 
 static void
-limare_render_sequence(struct limare_state *state, struct limare_frame *frame)
+limare_render_queue_push(struct limare_render_queue *queue,
+			 struct limare_frame *frame)
 {
-	struct timespec start;
-
-	pthread_mutex_lock(&frame->mutex);
-
-	/*
-	 * First, push the job through the gp.
-	 */
-	limare_gp_job_bench_start(&start);
-
-	limare_gp_job_start(state, frame);
-
-	limare_gp_job_wait(frame);
-
-	limare_gp_job_bench_stop(&start);
-
-	/*
-	 * Now we can work on the pp.
-	 */
-	limare_pp_job_bench_start(&start);
+	int ret;
 
-	limare_pp_job_start(state, frame);
+	ret = pthread_mutex_lock(&queue->mutex);
+	if (ret)
+		printf("%s: error locking mutex: %s\n", __func__,
+		       strerror(ret));
 
-	limare_pp_job_wait(frame);
+	while (queue->count == FRAME_COUNT) {
+		ret = pthread_cond_wait(&queue->cond, &queue->mutex);
+		if (ret)
+			printf("%s: cond wait error: %s\n", __func__,
+			       strerror(ret));
+	}
 
-	limare_pp_job_bench_stop(&start);
+	queue->frames[(queue->head + queue->count) % FRAME_COUNT] = frame;
+	queue->count++;
 
-        /* wait for display sync, and flip the current fb. */
-	limare_fb_flip(state, frame);
+	pthread_cond_broadcast(&queue->cond);
 
-	frame->render_status = 2;
-	pthread_mutex_unlock(&frame->mutex);
+	ret = pthread_mutex_unlock(&queue->mutex);
+	if (ret)
+		printf("%s: error unlocking mutex: %s\n", __func__,
+		       strerror(ret));
 }
 
-static pthread_mutex_t render_0_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t render_0_cond = PTHREAD_COND_INITIALIZER;
-static struct limare_frame *render_0_frame;
-static int render_0_stop;
-
-static pthread_mutex_t render_1_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t render_1_cond = PTHREAD_COND_INITIALIZER;
-static struct limare_frame *render_1_frame;
-static int render_1_stop;
-
-static void *
-limare_render_0_thread(void *arg)
+/*
+ * Returns NULL once the queue has been stopped and all the frames
+ * that were queued before have been handed out. Without wait, this
+ * returns NULL straight away when nothing is queued.
+ */
+static struct limare_frame *
+limare_render_queue_get(struct limare_render_queue *queue, int wait)
 {
-	struct limare_state *state = arg;
+	struct limare_frame *frame = NULL;
 	int ret;
 
-	ret = pthread_mutex_lock(&render_0_mutex);
+	ret = pthread_mutex_lock(&queue->mutex);
 	if (ret)
 		printf("%s: error locking mutex: %s\n", __func__,
 		       strerror(ret));
 
-	while (!render_0_stop) {
-		while (!render_0_frame && !render_0_stop) {
-			ret = pthread_cond_wait(&render_0_cond,
-						&render_0_mutex);
-			if (ret)
-				printf("%s: cond wait error: %s\n", __func__,
-				       strerror(ret));
-		}
+	while (wait && !queue->count && !queue->stop) {
+		ret = pthread_cond_wait(&queue->cond, &queue->mutex);
+		if (ret)
+			printf("%s: cond wait error: %s\n", __func__,
+			       strerror(ret));
+	}
 
-		if (render_0_frame) {
-			limare_render_sequence(state, render_0_frame);
+	if (queue->count) {
+		frame = queue->frames[queue->head];
+		queue->head = (queue->head + 1) % FRAME_COUNT;
+		queue->count--;
 
-			render_0_frame = NULL;
-		}
+		pthread_cond_broadcast(&queue->cond);
 	}
 
-	ret = pthread_mutex_unlock(&render_0_mutex);
+	ret = pthread_mutex_unlock(&queue->mutex);
 	if (ret)
-		printf("%s: error locking mutex: %s\n", __func__,
+		printf("%s: error unlocking mutex: %s\n", __func__,
 		       strerror(ret));
 
-	return NULL;
+	return frame;
 }
 
-static pthread_t limare_render_0_pthread;
-
-static void
-limare_render_0_start(struct limare_frame *frame)
+static struct limare_frame *
+limare_render_queue_pop(struct limare_render_queue *queue)
 {
-	int ret, done = 0;
-
-	while (!done) {
-		ret = pthread_mutex_lock(&render_0_mutex);
-		if (ret)
-			printf("%s: error locking mutex: %s\n", __func__,
-			       strerror(ret));
-
-		if (!render_0_frame) {
-			render_0_frame = frame;
-			done = 1;
-		}
-
-		if (render_0_frame)
-			pthread_cond_broadcast(&render_0_cond);
-
-		ret = pthread_mutex_unlock(&render_0_mutex);
-		if (ret)
-			printf("%s: error locking mutex: %s\n", __func__,
-			       strerror(ret));
-	}
+	return limare_render_queue_get(queue, 1);
 }
 
 static void
-limare_render_0_stop(void)
+limare_render_queue_stop(struct limare_render_queue *queue)
 {
-	void *retval;
 	int ret;
 
-	ret = pthread_mutex_lock(&render_0_mutex);
+	ret = pthread_mutex_lock(&queue->mutex);
 	if (ret)
 		printf("%s: error locking mutex: %s\n", __func__,
 		       strerror(ret));
 
-	render_0_stop = 1;
-	pthread_cond_broadcast(&render_0_cond);
+	queue->stop = 1;
+	pthread_cond_broadcast(&queue->cond);
 
-	ret = pthread_mutex_unlock(&render_0_mutex);
+	ret = pthread_mutex_unlock(&queue->mutex);
 	if (ret)
-		printf("%s: error locking mutex: %s\n", __func__,
+		printf("%s: error unlocking mutex: %s\n", __func__,
 		       strerror(ret));
+}
 
-	ret = pthread_join(limare_render_0_pthread, &retval);
-	if (ret)
-		printf("%s: error joining thread: %s\n", __func__,
-		       strerror(ret));
+static void *
+limare_render_gp_thread(void *arg)
+{
+	struct limare_state *state = arg;
+	struct limare_jobs *jobs = state->jobs;
+	struct limare_frame *frame;
+
+	limare_trace_thread("lima gp");
+
+	while ((frame = limare_render_queue_pop(&jobs->gp_queue))) {
+		struct limare_job_slot *slot = limare_job_slot(jobs, frame->id);
+
+		limare_job_bench_stop(jobs, &slot->queued,
+				      LIMARE_JOB_STAT_QUEUE);
+
+		limare_job_bench_start(&slot->gp_start);
+
+		limare_trace("gp job", LIMARE_TRACE_ASYNC_BEGIN,
+			     LIMARE_TRACE_JOB(state, frame->id));
+		limare_gp_job_start(state, frame);
+
+		/* the pp thread waits for the gp job, and takes over. */
+		limare_render_queue_push(&jobs->pp_queue, frame);
+	}
+
+	return NULL;
 }
 
 static void *
-limare_render_1_thread(void *arg)
+limare_render_pp_thread(void *arg)
 {
 	struct limare_state *state = arg;
-	int ret;
+	struct limare_jobs *jobs = state->jobs;
+	struct limare_frame *frame;
+	struct timespec start, idle;
 
-	ret = pthread_mutex_lock(&render_1_mutex);
-	if (ret)
-		printf("%s: error locking mutex: %s\n", __func__,
-		       strerror(ret));
+	limare_trace_thread("lima pp");
+	limare_job_bench_start(&idle);
 
-	while (!render_1_stop) {
-		while (!render_1_frame && !render_1_stop) {
-			ret = pthread_cond_wait(&render_1_cond,
-						&render_1_mutex);
-			if (ret)
-				printf("%s: cond wait error: %s\n", __func__,
-				       strerror(ret));
-		}
+	while ((frame = limare_render_queue_pop(&jobs->pp_queue))) {
+		limare_job_wait(jobs, frame->id | 0x80000000);
+
+		/* this includes the time spent queued up in the kernel. */
+		limare_job_bench_stop(jobs,
+				      &limare_job_slot(jobs, frame->id)->gp_start,
+				      LIMARE_JOB_STAT_GP);
 
-		if (render_1_frame) {
-			limare_render_sequence(state, render_1_frame);
+		/* how long the pp had nothing to do. */
+		limare_job_bench_stop(jobs, &idle, LIMARE_JOB_STAT_PP_IDLE);
 
-			render_1_frame = NULL;
+		limare_job_bench_start(&start);
+
+		limare_trace("pp job", LIMARE_TRACE_ASYNC_BEGIN,
+			     LIMARE_TRACE_JOB(state, frame->id));
+		limare_pp_job_start(state, frame);
+
+		limare_job_wait(jobs, frame->id | 0xC0000000);
+
+		limare_job_bench_stop(jobs, &start, LIMARE_JOB_STAT_PP);
+
+		limare_job_bench_start(&limare_job_slot(jobs, frame->id)->
+				       flip_queued);
+
+		/* frames which went to a texture never touched the fb. */
+		if (state->frame_done && !frame->target) {
+			void *pixels = fb_frame_address(state, frame);
+
+			if (pixels)
+				state->frame_done(state, frame, pixels,
+						  state->frame_done_data);
 		}
-	}
 
-	ret = pthread_mutex_unlock(&render_1_mutex);
-	if (ret)
-		printf("%s: error locking mutex: %s\n", __func__,
-		       strerror(ret));
+		limare_job_bench_start(&idle);
+
+		/* the flip thread gives the buffer back once it is off screen. */
+		pthread_mutex_lock(&frame->mutex);
+		frame->render_status = 2;
+		if (!frame->target)
+			frame->flip_pending = 1;
+		pthread_cond_broadcast(&frame->cond);
+		pthread_mutex_unlock(&frame->mutex);
+
+		if (!frame->target)
+			limare_render_queue_push(&jobs->flip_queue, frame);
+	}
 
 	return NULL;
 }
 
-static pthread_t limare_render_1_pthread;
-
 static void
-limare_render_1_start(struct limare_frame *frame)
+limare_frame_flip_release(struct limare_frame *frame)
 {
-	int ret, done = 0;
-
-	while (!done) {
-		ret = pthread_mutex_lock(&render_1_mutex);
-		if (ret)
-			printf("%s: error locking mutex: %s\n", __func__,
-			       strerror(ret));
+	pthread_mutex_lock(&frame->mutex);
+	frame->flip_pending = 0;
+	pthread_cond_broadcast(&frame->cond);
+	pthread_mutex_unlock(&frame->mutex);
+}
 
-		if (!render_1_frame) {
-			render_1_frame = frame;
-			done = 1;
+/*
+ * Puts the finished frames on the screen, so that the pp thread never
+ * waits for the display. An fb buffer only gets rendered to again once
+ * the frame in it has been replaced on screen, see
+ * limare_frame_buffer_wait().
+ *
+ * By default, every frame gets flipped as soon as it is done, like fbdev
+ * panning always did, which may tear. With LIMA_FLIP=vsync, only the
+ * newest finished frame is flipped, and we wait for the vblank after it.
+ * The frames that got overtaken are never shown, so the gpu keeps running
+ * at full speed into the third buffer while this thread sleeps.
+ */
+static void *
+limare_render_flip_thread(void *arg)
+{
+	struct limare_state *state = arg;
+	struct limare_jobs *jobs = state->jobs;
+	struct limare_frame *frame, *newer, *shown = NULL;
+	int vsync = jobs->flip_vsync;
+
+	limare_trace_thread("lima flip");
+
+	while ((frame = limare_render_queue_pop(&jobs->flip_queue))) {
+		while (vsync &&
+		       (newer = limare_render_queue_get(&jobs->flip_queue, 0))) {
+			limare_frame_flip_release(frame);
+			jobs->flips_skipped++;
+			frame = newer;
 		}
 
-		if (render_1_frame)
-			pthread_cond_broadcast(&render_1_cond);
+		limare_trace("flip", LIMARE_TRACE_BEGIN, frame->id);
+		limare_fb_flip(state, frame);
 
-		ret = pthread_mutex_unlock(&render_1_mutex);
-		if (ret)
-			printf("%s: error locking mutex: %s\n", __func__,
-			       strerror(ret));
+		if (vsync && limare_fb_vsync_wait(state)) {
+			printf("%s: no vsync to wait for, flipping "
+			       "unthrottled.\n", __func__);
+			vsync = 0;
+		}
+		limare_trace("flip", LIMARE_TRACE_END, frame->id);
+
+		limare_job_bench_stop(jobs,
+				      &limare_job_slot(jobs, frame->id)->flip_queued,
+				      LIMARE_JOB_STAT_FLIP);
+		jobs->flips_shown++;
+
+		if (shown)
+			limare_frame_flip_release(shown);
+		shown = frame;
+
+		/* a single buffer is always on screen, there's no waiting it
+		 * out. */
+		if (state->fb->buffer_count == 1) {
+			limare_frame_flip_release(shown);
+			shown = NULL;
+		}
 	}
+
+	if (shown)
+		limare_frame_flip_release(shown);
+
+	return NULL;
 }
 
 static void
-limare_render_1_stop(void)
+limare_jobs_thread_join(pthread_t thread)
 {
 	void *retval;
 	int ret;
 
-	ret = pthread_mutex_lock(&render_1_mutex);
+	ret = pthread_join(thread, &retval);
 	if (ret)
-		printf("%s: error locking mutex: %s\n", __func__,
+		printf("%s: error joining thread: %s\n", __func__,
 		       strerror(ret));
+}
 
-	render_1_stop = 1;
-	pthread_cond_broadcast(&render_1_cond);
+void
+limare_render_start(struct limare_frame *frame)
+{
+	struct limare_jobs *jobs = frame->state->jobs;
 
-	ret = pthread_mutex_unlock(&render_1_mutex);
-	if (ret)
-		printf("%s: error locking mutex: %s\n", __func__,
-		       strerror(ret));
+	limare_job_bench_start(&limare_job_slot(jobs, frame->id)->queued);
+
+	limare_render_queue_push(&jobs->gp_queue, frame);
+}
+
+static int
+limare_dumped_job_start(struct limare_state *state, int request,
+			void *job, unsigned int id, enum limare_job_stat stat)
+{
+	struct limare_jobs *jobs = state->jobs;
+	unsigned int *args = job;
+	struct timespec start;
+	int ret;
+
+	args[0] = state->fd;
+	args[1] = id;
+
+	limare_job_bench_start(&start);
+
+	limare_trace(stat == LIMARE_JOB_STAT_GP ? "gp job" : "pp job",
+		     LIMARE_TRACE_ASYNC_BEGIN, LIMARE_TRACE_JOB(state, id));
+	ret = ioctl(state->fd, request, job);
+	if (ret == -1) {
+		printf("%s: Error: failed to start job: %s\n",
+		       __func__, strerror(errno));
+		return errno;
+	}
+
+	limare_job_wait(jobs, id);
 
-	ret = pthread_join(limare_render_1_pthread, &retval);
+	limare_job_bench_stop(jobs, &start, stat);
+
+	return 0;
+}
+
+/*
+ * Runs a gp and a pp job straight from the ioctl arguments that the wrap
+ * library captured, see tests/template/replay.c. All of the job start
+ * structures begin with the fd and the user job pointer, these become ours,
+ * the rest goes to the kernel as captured. The start ioctls only encode the
+ * size of a pointer, so the request is the same for all kernel versions.
+ *
+ * This bypasses the render threads, the id only has to differ from the
+ * previous FRAME_COUNT calls, so that the job slots can tell them apart.
+ */
+int
+limare_dumped_job_run(struct limare_state *state, int id,
+		      void *gp_job, void *pp_job)
+{
+	int ret;
+
+	ret = limare_dumped_job_start(state, LIMA_GP_START_JOB_R3P0, gp_job,
+				      (id & 0x3FFFFFFF) | 0x80000000,
+				      LIMARE_JOB_STAT_GP);
 	if (ret)
-		printf("%s: error joining thread: %s\n", __func__,
-		       strerror(ret));
+		return ret;
+
+	return limare_dumped_job_start(state, LIMA_M200_PP_START_JOB, pp_job,
+				       (id & 0x3FFFFFFF) | 0xC0000000,
+				       LIMARE_JOB_STAT_PP);
+}
+
+int
+limare_job_stats_get(struct limare_state *state,
+		     struct limare_job_stats *stats, int reset)
+{
+	struct limare_jobs *jobs = state->jobs;
+	struct timespec new = { 0 };
+
+	if (!jobs)
+		return -1;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &new)) {
+		printf("Error: failed to get time: %s\n", strerror(errno));
+		return -1;
+	}
+
+	pthread_mutex_lock(&jobs->job_time_mutex);
+
+	*stats = jobs->stats;
+	stats->time = (new.tv_sec - jobs->stats_time.tv_sec) +
+		(new.tv_nsec - jobs->stats_time.tv_nsec) / 1000000000.0;
+
+	if (reset) {
+		memset(&jobs->stats, 0, sizeof(struct limare_job_stats));
+		jobs->stats_time = new;
+	}
+
+	pthread_mutex_unlock(&jobs->job_time_mutex);
+
+	return 0;
 }
 
 void
-limare_render_start(struct limare_frame *frame)
+limare_job_counters_enable(struct limare_state *state, int enable)
 {
-	if (frame->index)
-		limare_render_1_start(frame);
-	else
-		limare_render_0_start(frame);
+	state->jobs->counters = enable;
+}
+
+/*
+ * Returns the bytes that the gp and pp read and wrote on the bus so far,
+ * or -1 when no job came back with performance counters yet.
+ */
+int
+limare_job_bus_bytes(struct limare_state *state,
+		     unsigned long long *read, unsigned long long *write)
+{
+	struct limare_jobs *jobs = state->jobs;
+	int ret = -1;
+
+	if (!jobs)
+		return -1;
+
+	pthread_mutex_lock(&jobs->job_time_mutex);
+	if (jobs->counter_jobs) {
+		*read = jobs->bus_read;
+		*write = jobs->bus_write;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&jobs->job_time_mutex);
+
+	return ret;
 }
 
-static struct timespec jobs_time;
+/*
+ * Returns the tile heap bytes that the polygon lists took up so far, the
+ * number of gp jobs this was added up over and the most a single one took,
+ * or -1 when no gp job came back yet.
+ */
+int
+limare_job_heap_bytes(struct limare_state *state, unsigned long long *bytes,
+		      unsigned int *jobs_count, unsigned int *max)
+{
+	struct limare_jobs *jobs = state->jobs;
+	int ret = -1;
+
+	if (!jobs)
+		return -1;
+
+	pthread_mutex_lock(&jobs->job_time_mutex);
+	if (jobs->heap_jobs) {
+		*bytes = jobs->heap_bytes;
+		if (jobs_count)
+			*jobs_count = jobs->heap_jobs;
+		if (max)
+			*max = jobs->heap_max;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&jobs->job_time_mutex);
+
+	return ret;
+}
+
+/*
+ * Returns the upper bound of the bucket holding the given fraction of the
+ * entries, capped at the maximum, so this is accurate to a factor of two.
+ */
+long long
+limare_job_histogram_percentile(const struct limare_job_histogram *histogram,
+				double fraction)
+{
+	unsigned int target = fraction * histogram->count;
+	unsigned int seen = 0;
+	int i;
+
+	for (i = 0; i < LIMARE_JOB_HISTOGRAM_SIZE; i++) {
+		seen += histogram->buckets[i];
+		if (seen > target)
+			break;
+	}
+
+	if ((i >= (LIMARE_JOB_HISTOGRAM_SIZE - 1)) ||
+	    ((2LL << i) > histogram->max))
+		return histogram->max;
+
+	return 2LL << i;
+}
+
+static const char *limare_job_stat_names[LIMARE_JOB_STAT_COUNT] = {
+	[LIMARE_JOB_STAT_GP] = "gp job",
+	[LIMARE_JOB_STAT_PP] = "pp job",
+	[LIMARE_JOB_STAT_QUEUE] = "queued",
+	[LIMARE_JOB_STAT_FLIP] = "flip",
+	[LIMARE_JOB_STAT_PP_IDLE] = "pp idle",
+	[LIMARE_JOB_STAT_FRAME_WAIT] = "frame wait",
+	[LIMARE_JOB_STAT_FRAME_NEW] = "frame new",
+	[LIMARE_JOB_STAT_RECORD] = "draws",
+	[LIMARE_JOB_STAT_FLUSH] = "flush",
+};
 
 void
+limare_job_stats_print(const char *name, const struct limare_job_stats *stats)
+{
+	const struct limare_job_histogram *pp =
+		&stats->histograms[LIMARE_JOB_STAT_PP];
+	const struct limare_job_histogram *gp =
+		&stats->histograms[LIMARE_JOB_STAT_GP];
+	const struct limare_job_histogram *flush =
+		&stats->histograms[LIMARE_JOB_STAT_FLUSH];
+	int i;
+
+	printf("%s: gpu jobs over %.1fs, pp busy %.0f%%\n", name, stats->time,
+	       stats->time > 0 ? pp->total / (stats->time * 10000.0) : 0.0);
+
+	/* whichever of these is the largest holds the frame rate back */
+	if (flush->count) {
+		long long cpu =
+			stats->histograms[LIMARE_JOB_STAT_FRAME_NEW].total +
+			stats->histograms[LIMARE_JOB_STAT_RECORD].total +
+			flush->total;
+
+		printf("    per frame: cpu %.2f ms, gp %.2f ms, pp %.2f ms, "
+		       "%.2f ms waiting on the gpu\n",
+		       cpu / (flush->count * 1000.0),
+		       gp->count ? gp->total / (gp->count * 1000.0) : 0.0,
+		       pp->count ? pp->total / (pp->count * 1000.0) : 0.0,
+		       stats->histograms[LIMARE_JOB_STAT_FRAME_WAIT].total /
+		       (flush->count * 1000.0));
+	}
+
+	printf("    %-10s %8s %10s %10s %10s %10s\n", "", "count", "avg ms",
+	       "min ms", "p99 ms", "max ms");
+
+	for (i = 0; i < LIMARE_JOB_STAT_COUNT; i++) {
+		const struct limare_job_histogram *histogram =
+			&stats->histograms[i];
+
+		if (!histogram->count)
+			continue;
+
+		printf("    %-10s %8u %10.2f %10.2f %10.2f %10.2f\n",
+		       limare_job_stat_names[i], histogram->count,
+		       histogram->total / (histogram->count * 1000.0),
+		       histogram->min / 1000.0,
+		       limare_job_histogram_percentile(histogram, 0.99) /
+		       1000.0, histogram->max / 1000.0);
+	}
+}
+
+static void
+limare_render_queue_init(struct limare_render_queue *queue)
+{
+	pthread_mutex_init(&queue->mutex, NULL);
+	pthread_cond_init(&queue->cond, NULL);
+}
+
+int
 limare_jobs_init(struct limare_state *state)
 {
-	int ret;
+	struct limare_jobs *jobs;
+	const char *env;
+	int ret, i;
+
+	jobs = calloc(1, sizeof(struct limare_jobs));
+	if (!jobs) {
+		printf("%s: Error: failed to allocate jobs: %s\n",
+		       __func__, strerror(errno));
+		return -ENOMEM;
+	}
 
-	ret = pthread_create(&limare_notification_pthread, NULL,
+	for (i = 0; i < FRAME_COUNT; i++) {
+		pthread_mutex_init(&jobs->slots[i].mutex, NULL);
+		pthread_cond_init(&jobs->slots[i].cond, NULL);
+	}
+	pthread_mutex_init(&jobs->job_time_mutex, NULL);
+	limare_render_queue_init(&jobs->gp_queue);
+	limare_render_queue_init(&jobs->pp_queue);
+	limare_render_queue_init(&jobs->flip_queue);
+
+	env = getenv("LIMA_FLIP");
+	if (env && !strcmp(env, "vsync"))
+		jobs->flip_vsync = 1;
+	else if (env && env[0] && strcmp(env, "unthrottled"))
+		printf("%s: unknown LIMA_FLIP=%s, flipping unthrottled.\n",
+		       __func__, env);
+
+	state->jobs = jobs;
+
+	ret = pthread_create(&jobs->notification_pthread, NULL,
 			     limare_notification_thread, state);
 	if (ret)
 		printf("%s: error starting thread: %s\n", __func__,
 		       strerror(ret));
 
-	ret = pthread_create(&limare_render_0_pthread, NULL,
-			     limare_render_0_thread, state);
+	ret = pthread_create(&jobs->render_gp_pthread, NULL,
+			     limare_render_gp_thread, state);
+	if (ret)
+		printf("%s: error starting thread: %s\n", __func__,
+		       strerror(ret));
+
+	ret = pthread_create(&jobs->render_pp_pthread, NULL,
+			     limare_render_pp_thread, state);
 	if (ret)
 		printf("%s: error starting thread: %s\n", __func__,
 		       strerror(ret));
 
-	ret = pthread_create(&limare_render_1_pthread, NULL,
-			     limare_render_1_thread, state);
+	ret = pthread_create(&jobs->render_flip_pthread, NULL,
+			     limare_render_flip_thread, state);
 	if (ret)
 		printf("%s: error starting thread: %s\n", __func__,
 		       strerror(ret));
 
-	if (clock_gettime(CLOCK_MONOTONIC, &jobs_time))
+	if (clock_gettime(CLOCK_MONOTONIC, &jobs->time))
 		printf("Error: failed to get time: %s\n", strerror(errno));
+	jobs->stats_time = jobs->time;
+
+	return 0;
 }
 
 void
 limare_jobs_end(struct limare_state *state)
 {
+	struct limare_jobs *jobs = state->jobs;
 	struct timespec new = { 0 };
 	long long total;
 
-	limare_render_0_stop();
-	limare_render_1_stop();
+	if (!jobs)
+		return;
 
-	if (clock_gettime(CLOCK_MONOTONIC, &new)) {
+	/* let the queued frames drain through both stages first. */
+	limare_render_queue_stop(&jobs->gp_queue);
+	limare_jobs_thread_join(jobs->render_gp_pthread);
+
+	limare_render_queue_stop(&jobs->pp_queue);
+	limare_jobs_thread_join(jobs->render_pp_pthread);
+
+	limare_render_queue_stop(&jobs->flip_queue);
+	limare_jobs_thread_join(jobs->render_flip_pthread);
+
+	if (jobs->flips_skipped)
+		printf("Flipped %u frames at vsync, %u were overtaken.\n",
+		       jobs->flips_shown, jobs->flips_skipped);
+
+	/* this takes up to one notification timeout. */
+	jobs->notification_stop = 1;
+	limare_jobs_thread_join(jobs->notification_pthread);
+
+	if (clock_gettime(CLOCK_MONOTONIC, &new))
 		printf("Error: failed to get time: %s\n", strerror(errno));
-		return;
+	else {
+		total = (new.tv_sec - jobs->time.tv_sec) * 1000000;
+		total += (new.tv_nsec - jobs->time.tv_nsec) / 1000;
+
+		printf("Total jobs time: %f seconds\n",
+		       (float) total / 1000000);
+		printf("   GP job  time: %f seconds\n",
+		       (float) jobs->gp_job_time / 1000000);
+		printf("   PP job  time: %f seconds\n",
+		       (float) jobs->pp_job_time / 1000000);
 	}
 
-	total = (new.tv_sec - jobs_time.tv_sec) * 1000000;
-	total += (new.tv_nsec - jobs_time.tv_nsec) / 1000;
-
-	printf("Total jobs time: %f seconds\n", (float) total / 1000000);
-	printf("   GP job  time: %f seconds\n", (float) gp_job_time / 1000000);
-	printf("   PP job  time: %f seconds\n", (float) pp_job_time / 1000000);
+	state->jobs = NULL;
+	free(jobs);
 }
-
@@ -69,9 +69,16 @@ int limare_m400_pp_job_start_r3p2_01rel2(struct limare_state *state,
 					 unsigned int addr_stack[7],
 					 struct lima_pp_wb_registers *wb_regs);
 
-void limare_jobs_init(struct limare_state *state);
+int limare_jobs_init(struct limare_state *state);
 void limare_jobs_end(struct limare_state *state);
 
 void limare_render_start(struct limare_frame *frame);
 
+void limare_job_phase_begin(struct timespec *start);
+void limare_job_phase_end(struct limare_state *state, struct timespec *start,
+			  enum limare_job_stat stat);
+
+int limare_dumped_job_run(struct limare_state *state, int id,
+			  void *gp_job, void *pp_job);
+
 #endif /* LIMARE_JOBS_H */
@@ -0,0 +1,1189 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * DRM/KMS display, for kernels which no longer provide an fbdev.
+ *
+ * Mali cannot be told about the physical address of a dumb buffer, so the
+ * frames still get rendered into mali memory, like offscreen, and the
+ * finished frame is copied into the back dumb buffer before it gets
+ * flipped. When the previous flip is still waiting for its vblank, the
+ * frame is not shown at all, so that the gpu load never gets paced by the
+ * display.
+ *
+ * With atomic modesetting, the overlay planes of the crtc can be made to
+ * scan out the same buffer as the primary plane, each of them adding a full
+ * frame of memory reads per refresh.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <asm/ioctl.h>
+#include <sys/mman.h>
+
+#include "limare.h"
+#include "fb.h"
+#include "kms.h"
+
+/*
+ * The parts of the kernels drm.h and drm_mode.h uapi that we use, so that
+ * we build without libdrm and without the kernel drm headers.
+ */
+#define DRM_IOCTL_BASE 'd'
+#define DRM_IOW(nr, type) _IOW(DRM_IOCTL_BASE, nr, type)
+#define DRM_IOWR(nr, type) _IOWR(DRM_IOCTL_BASE, nr, type)
+
+struct drm_set_client_cap {
+	uint64_t capability;
+	uint64_t value;
+};
+
+#define DRM_CLIENT_CAP_UNIVERSAL_PLANES 2
+#define DRM_CLIENT_CAP_ATOMIC 3
+
+struct drm_mode_card_res {
+	uint64_t fb_id_ptr;
+	uint64_t crtc_id_ptr;
+	uint64_t connector_id_ptr;
+	uint64_t encoder_id_ptr;
+	uint32_t count_fbs;
+	uint32_t count_crtcs;
+	uint32_t count_connectors;
+	uint32_t count_encoders;
+	uint32_t min_width;
+	uint32_t max_width;
+	uint32_t min_height;
+	uint32_t max_height;
+};
+
+struct drm_mode_modeinfo {
+	uint32_t clock;
+	uint16_t hdisplay;
+	uint16_t hsync_start;
+	uint16_t hsync_end;
+	uint16_t htotal;
+	uint16_t hskew;
+	uint16_t vdisplay;
+	uint16_t vsync_start;
+	uint16_t vsync_end;
+	uint16_t vtotal;
+	uint16_t vscan;
+	uint32_t vrefresh;
+	uint32_t flags;
+	uint32_t type;
+	char name[32];
+};
+
+#define DRM_MODE_TYPE_PREFERRED (1 << 3)
+#define DRM_MODE_FLAG_INTERLACE (1 << 4)
+#define DRM_MODE_FLAG_DBLSCAN (1 << 5)
+
+struct drm_mode_crtc {
+	uint64_t set_connectors_ptr;
+	uint32_t count_connectors;
+	uint32_t crtc_id;
+	uint32_t fb_id;
+	uint32_t x;
+	uint32_t y;
+	uint32_t gamma_size;
+	uint32_t mode_valid;
+	struct drm_mode_modeinfo mode;
+};
+
+struct drm_mode_get_encoder {
+	uint32_t encoder_id;
+	uint32_t encoder_type;
+	uint32_t crtc_id;
+	uint32_t possible_crtcs;
+	uint32_t possible_clones;
+};
+
+struct drm_mode_get_connector {
+	uint64_t encoders_ptr;
+	uint64_t modes_ptr;
+	uint64_t props_ptr;
+	uint64_t prop_values_ptr;
+	uint32_t count_modes;
+	uint32_t count_props;
+	uint32_t count_encoders;
+	uint32_t encoder_id;
+	uint32_t connector_id;
+	uint32_t connector_type;
+	uint32_t connector_type_id;
+	uint32_t connection;
+	uint32_t mm_width;
+	uint32_t mm_height;
+	uint32_t subpixel;
+	uint32_t pad;
+};
+
+#define DRM_MODE_CONNECTED 1
+
+struct drm_mode_get_property {
+	uint64_t values_ptr;
+	uint64_t enum_blob_ptr;
+	uint32_t prop_id;
+	uint32_t flags;
+	char name[32];
+	uint32_t count_values;
+	uint32_t count_enum_blobs;
+};
+
+struct drm_mode_fb_cmd {
+	uint32_t fb_id;
+	uint32_t width;
+	uint32_t height;
+	uint32_t pitch;
+	uint32_t bpp;
+	uint32_t depth;
+	uint32_t handle;
+};
+
+struct drm_mode_crtc_page_flip {
+	uint32_t crtc_id;
+	uint32_t fb_id;
+	uint32_t flags;
+	uint32_t reserved;
+	uint64_t user_data;
+};
+
+#define DRM_MODE_PAGE_FLIP_EVENT 0x01
+
+struct drm_mode_create_dumb {
+	uint32_t height;
+	uint32_t width;
+	uint32_t bpp;
+	uint32_t flags;
+	uint32_t handle;
+	uint32_t pitch;
+	uint64_t size;
+};
+
+struct drm_mode_map_dumb {
+	uint32_t handle;
+	uint32_t pad;
+	uint64_t offset;
+};
+
+struct drm_mode_destroy_dumb {
+	uint32_t handle;
+};
+
+struct drm_mode_get_plane_res {
+	uint64_t plane_id_ptr;
+	uint32_t count_planes;
+};
+
+struct drm_mode_get_plane {
+	uint32_t plane_id;
+	uint32_t crtc_id;
+	uint32_t fb_id;
+	uint32_t possible_crtcs;
+	uint32_t gamma_size;
+	uint32_t count_format_types;
+	uint64_t format_type_ptr;
+};
+
+struct drm_mode_obj_get_properties {
+	uint64_t props_ptr;
+	uint64_t prop_values_ptr;
+	uint32_t count_props;
+	uint32_t obj_id;
+	uint32_t obj_type;
+};
+
+#define DRM_MODE_OBJECT_CRTC 0xcccccccc
+#define DRM_MODE_OBJECT_CONNECTOR 0xc0c0c0c0
+#define DRM_MODE_OBJECT_PLANE 0xeeeeeeee
+
+struct drm_mode_atomic {
+	uint32_t flags;
+	uint32_t count_objs;
+	uint64_t objs_ptr;
+	uint64_t count_props_ptr;
+	uint64_t props_ptr;
+	uint64_t prop_values_ptr;
+	uint64_t reserved;
+	uint64_t user_data;
+};
+
+#define DRM_MODE_ATOMIC_NONBLOCK 0x0200
+#define DRM_MODE_ATOMIC_ALLOW_MODESET 0x0400
+
+struct drm_mode_create_blob {
+	uint64_t data;
+	uint32_t length;
+	uint32_t blob_id;
+};
+
+struct drm_event {
+	uint32_t type;
+	uint32_t length;
+};
+
+#define DRM_EVENT_FLIP_COMPLETE 0x02
+
+#define DRM_IOCTL_SET_CLIENT_CAP DRM_IOW(0x0d, struct drm_set_client_cap)
+#define DRM_IOCTL_MODE_GETRESOURCES DRM_IOWR(0xA0, struct drm_mode_card_res)
+#define DRM_IOCTL_MODE_GETCRTC DRM_IOWR(0xA1, struct drm_mode_crtc)
+#define DRM_IOCTL_MODE_SETCRTC DRM_IOWR(0xA2, struct drm_mode_crtc)
+#define DRM_IOCTL_MODE_GETENCODER DRM_IOWR(0xA6, struct drm_mode_get_encoder)
+#define DRM_IOCTL_MODE_GETCONNECTOR \
+	DRM_IOWR(0xA7, struct drm_mode_get_connector)
+#define DRM_IOCTL_MODE_GETPROPERTY \
+	DRM_IOWR(0xAA, struct drm_mode_get_property)
+#define DRM_IOCTL_MODE_GETFB DRM_IOWR(0xAD, struct drm_mode_fb_cmd)
+#define DRM_IOCTL_MODE_ADDFB DRM_IOWR(0xAE, struct drm_mode_fb_cmd)
+#define DRM_IOCTL_MODE_RMFB DRM_IOWR(0xAF, unsigned int)
+#define DRM_IOCTL_MODE_PAGE_FLIP DRM_IOWR(0xB0, struct drm_mode_crtc_page_flip)
+#define DRM_IOCTL_MODE_CREATE_DUMB DRM_IOWR(0xB2, struct drm_mode_create_dumb)
+#define DRM_IOCTL_MODE_MAP_DUMB DRM_IOWR(0xB3, struct drm_mode_map_dumb)
+#define DRM_IOCTL_MODE_DESTROY_DUMB \
+	DRM_IOWR(0xB4, struct drm_mode_destroy_dumb)
+#define DRM_IOCTL_MODE_GETPLANERESOURCES \
+	DRM_IOWR(0xB5, struct drm_mode_get_plane_res)
+#define DRM_IOCTL_MODE_GETPLANE DRM_IOWR(0xB6, struct drm_mode_get_plane)
+#define DRM_IOCTL_MODE_OBJ_GETPROPERTIES \
+	DRM_IOWR(0xB9, struct drm_mode_obj_get_properties)
+#define DRM_IOCTL_MODE_ATOMIC DRM_IOWR(0xBC, struct drm_mode_atomic)
+#define DRM_IOCTL_MODE_CREATEPROPBLOB \
+	DRM_IOWR(0xBD, struct drm_mode_create_blob)
+
+#define DRM_FORMAT_XRGB8888 0x34325258 /* XR24 */
+#define DRM_FORMAT_RGB565 0x36314752 /* RG16 */
+
+/* values of the plane "type" property */
+#define DRM_PLANE_TYPE_OVERLAY 0
+#define DRM_PLANE_TYPE_PRIMARY 1
+
+#define U64_PTR(x) ((uint64_t) (uintptr_t) (x))
+
+static struct limare_kms *kms_shared;
+static pthread_mutex_t kms_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+kms_ioctl(int fd, unsigned long request, void *arg)
+{
+	int ret;
+
+	do {
+		ret = ioctl(fd, request, arg);
+	} while ((ret == -1) && ((errno == EINTR) || (errno == EAGAIN)));
+
+	return ret;
+}
+
+/*
+ * Looks up a property of a kms object by name, returns 0 when there is no
+ * such property.
+ */
+static unsigned int
+kms_property(int fd, unsigned int object_id, unsigned int object_type,
+	     const char *name, uint64_t *value)
+{
+	struct drm_mode_obj_get_properties props = { 0 };
+	unsigned int *ids, id = 0;
+	uint64_t *values;
+	int i;
+
+	props.obj_id = object_id;
+	props.obj_type = object_type;
+	if (kms_ioctl(fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &props) ||
+	    !props.count_props)
+		return 0;
+
+	ids = calloc(props.count_props, sizeof(unsigned int));
+	values = calloc(props.count_props, sizeof(uint64_t));
+	if (!ids || !values)
+		goto done;
+
+	props.props_ptr = U64_PTR(ids);
+	props.prop_values_ptr = U64_PTR(values);
+	if (kms_ioctl(fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &props))
+		goto done;
+
+	for (i = 0; i < (int) props.count_props; i++) {
+		struct drm_mode_get_property property = { 0 };
+
+		property.prop_id = ids[i];
+		if (kms_ioctl(fd, DRM_IOCTL_MODE_GETPROPERTY, &property))
+			continue;
+
+		if (!strncmp(property.name, name, sizeof(property.name))) {
+			id = ids[i];
+			if (value)
+				*value = values[i];
+			break;
+		}
+	}
+
+ done:
+	free(ids);
+	free(values);
+	return id;
+}
+
+static int
+kms_connector_mode(struct limare_kms *kms, unsigned int connector_id,
+		   struct drm_mode_modeinfo *mode, unsigned int *encoders,
+		   int *encoder_count, unsigned int *encoder_id)
+{
+	struct drm_mode_get_connector connector = { 0 };
+	struct drm_mode_modeinfo *modes;
+	const char *env = getenv("LIMA_KMS_MODE");
+	int width = 0, height = 0, i, best = 0;
+
+	connector.connector_id = connector_id;
+	if (kms_ioctl(kms->fd, DRM_IOCTL_MODE_GETCONNECTOR, &connector))
+		return -1;
+
+	if ((connector.connection != DRM_MODE_CONNECTED) ||
+	    !connector.count_modes || !connector.count_encoders)
+		return -1;
+
+	modes = calloc(connector.count_modes, sizeof(*modes));
+	if (!modes)
+		return -1;
+
+	if (connector.count_encoders > 32)
+		connector.count_encoders = 32;
+	connector.modes_ptr = U64_PTR(modes);
+	connector.encoders_ptr = U64_PTR(encoders);
+	connector.count_props = 0;
+	if (kms_ioctl(kms->fd, DRM_IOCTL_MODE_GETCONNECTOR, &connector) ||
+	    !connector.count_modes) {
+		free(modes);
+		return -1;
+	}
+
+	if (env && env[0])
+		sscanf(env, "%dx%d", &width, &height);
+
+	for (i = 0; i < (int) connector.count_modes; i++) {
+		if (width) {
+			if ((modes[i].hdisplay == width) &&
+			    (modes[i].vdisplay == height)) {
+				best = i;
+				break;
+			}
+		} else if (modes[i].type & DRM_MODE_TYPE_PREFERRED) {
+			best = i;
+			break;
+		}
+	}
+
+	if (width && (i == (int) connector.count_modes))
+		printf("%s: no %dx%d mode, using %s instead.\n", __func__,
+		       width, height, modes[best].name);
+
+	*mode = modes[best];
+	*encoder_count = connector.count_encoders;
+	*encoder_id = connector.encoder_id;
+
+	free(modes);
+	return 0;
+}
+
+/*
+ * Picks the first connected connector and a crtc which can drive it.
+ * Returns the index of the crtc in the resources, for possible_crtcs.
+ */
+static int
+kms_output_find(struct limare_kms *kms, struct drm_mode_modeinfo *mode)
+{
+	struct drm_mode_card_res res = { 0 };
+	unsigned int *crtcs = NULL, *connectors = NULL, encoders[32];
+	int i, j, k, encoder_count, crtc_index = -1;
+	unsigned int encoder_id;
+
+	if (kms_ioctl(kms->fd, DRM_IOCTL_MODE_GETRESOURCES, &res) ||
+	    !res.count_crtcs || !res.count_connectors) {
+		printf("%s: no crtcs or connectors.\n", __func__);
+		return -1;
+	}
+
+	crtcs = calloc(res.count_crtcs, sizeof(unsigned int));
+	connectors = calloc(res.count_connectors, sizeof(unsigned int));
+	if (!crtcs || !connectors)
+		goto done;
+
+	res.crtc_id_ptr = U64_PTR(crtcs);
+	res.connector_id_ptr = U64_PTR(connectors);
+	res.count_fbs = 0;
+	res.count_encoders = 0;
+	if (kms_ioctl(kms->fd, DRM_IOCTL_MODE_GETRESOURCES, &res))
+		goto done;
+
+	for (i = 0; (i < (int) res.count_connectors) && (crtc_index < 0); i++) {
+		if (kms_connector_mode(kms, connectors[i], mode, encoders,
+				       &encoder_count, &encoder_id))
+			continue;
+
+		for (j = -1; (j < encoder_count) && (crtc_index < 0); j++) {
+			struct drm_mode_get_encoder encoder = { 0 };
+
+			/* the encoder which is in use already goes first */
+			if (j < 0) {
+				if (!encoder_id)
+					continue;
+				encoder.encoder_id = encoder_id;
+			} else
+				encoder.encoder_id = encoders[j];
+
+			if (kms_ioctl(kms->fd, DRM_IOCTL_MODE_GETENCODER,
+				      &encoder))
+				continue;
+
+			for (k = 0; k < (int) res.count_crtcs; k++) {
+				if (encoder.crtc_id ?
+				    (encoder.crtc_id == crtcs[k]) :
+				    (encoder.possible_crtcs & (1 << k))) {
+					crtc_index = k;
+					break;
+				}
+			}
+		}
+
+		if (crtc_index >= 0) {
+			kms->connector_id = connectors[i];
+			kms->crtc_id = crtcs[crtc_index];
+		}
+	}
+
+	if (crtc_index < 0)
+		printf("%s: no connected output.\n", __func__);
+
+ done:
+	free(crtcs);
+	free(connectors);
+	return crtc_index;
+}
+
+static int
+kms_plane_format(struct limare_kms *kms, struct drm_mode_get_plane *plane)
+{
+	unsigned int *formats, format;
+	int i, ret = 0;
+
+	if (kms->bpp == 16)
+		format = DRM_FORMAT_RGB565;
+	else
+		format = DRM_FORMAT_XRGB8888;
+
+	if (!plane->count_format_types)
+		return 0;
+
+	formats = calloc(plane->count_format_types, sizeof(unsigned int));
+	if (!formats)
+		return 0;
+
+	plane->format_type_ptr = U64_PTR(formats);
+	if (!kms_ioctl(kms->fd, DRM_IOCTL_MODE_GETPLANE, plane))
+		for (i = 0; i < (int) plane->count_format_types; i++)
+			if (formats[i] == format)
+				ret = 1;
+
+	free(formats);
+	return ret;
+}
+
+/*
+ * The primary plane of our crtc, and as many of its overlays as were asked
+ * for and which take our format.
+ */
+static int
+kms_planes_find(struct limare_kms *kms, int crtc_index, int wanted)
+{
+	struct drm_mode_get_plane_res res = { 0 };
+	unsigned int *ids;
+	int i, pass;
+
+	if (kms_ioctl(kms->fd, DRM_IOCTL_MODE_GETPLANERESOURCES, &res) ||
+	    !res.count_planes)
+		return -1;
+
+	ids = calloc(res.count_planes, sizeof(unsigned int));
+	if (!ids)
+		return -1;
+
+	res.plane_id_ptr = U64_PTR(ids);
+	if (kms_ioctl(kms->fd, DRM_IOCTL_MODE_GETPLANERESOURCES, &res)) {
+		free(ids);
+		return -1;
+	}
+
+	kms->planes = 0;
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < (int) res.count_planes; i++) {
+			struct drm_mode_get_plane plane = { 0 };
+			uint64_t type = DRM_PLANE_TYPE_OVERLAY;
+
+			if ((kms->planes == wanted) ||
+			    ((pass == 1) && !kms->planes))
+				break;
+
+			plane.plane_id = ids[i];
+			if (kms_ioctl(kms->fd, DRM_IOCTL_MODE_GETPLANE, &plane) ||
+			    !(plane.possible_crtcs & (1 << crtc_index)))
+				continue;
+
+			if (!kms_property(kms->fd, ids[i],
+					  DRM_MODE_OBJECT_PLANE, "type", &type))
+				continue;
+
+			if (type != (pass ? DRM_PLANE_TYPE_OVERLAY :
+				     DRM_PLANE_TYPE_PRIMARY))
+				continue;
+
+			if (!kms_plane_format(kms, &plane))
+				continue;
+
+			kms->plane_id[kms->planes] = ids[i];
+			kms->prop_fb_id[kms->planes] =
+				kms_property(kms->fd, ids[i],
+					     DRM_MODE_OBJECT_PLANE, "FB_ID",
+					     NULL);
+			kms->planes++;
+
+			/* only one primary */
+			if (!pass)
+				break;
+		}
+	}
+
+	free(ids);
+
+	return kms->planes ? 0 : -1;
+}
+
+static int
+kms_buffer_create(struct limare_kms *kms, struct limare_kms_buffer *buffer)
+{
+	struct drm_mode_create_dumb create = { 0 };
+	struct drm_mode_map_dumb map = { 0 };
+	struct drm_mode_fb_cmd fb = { 0 };
+
+	create.width = kms->width;
+	create.height = kms->height;
+	create.bpp = kms->bpp;
+	if (kms_ioctl(kms->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create)) {
+		printf("%s: failed to create %dx%d dumb buffer: %s\n",
+		       __func__, kms->width, kms->height, strerror(errno));
+		return -1;
+	}
+
+	buffer->handle = create.handle;
+	kms->pitch = create.pitch;
+
+	fb.width = kms->width;
+	fb.height = kms->height;
+	fb.pitch = create.pitch;
+	fb.bpp = kms->bpp;
+	fb.depth = (kms->bpp == 16) ? 16 : 24;
+	fb.handle = create.handle;
+	if (kms_ioctl(kms->fd, DRM_IOCTL_MODE_ADDFB, &fb)) {
+		printf("%s: failed to add fb: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	buffer->fb_id = fb.fb_id;
+
+	map.handle = create.handle;
+	if (kms_ioctl(kms->fd, DRM_IOCTL_MODE_MAP_DUMB, &map)) {
+		printf("%s: failed to map dumb buffer: %s\n", __func__,
+		       strerror(errno));
+		return -1;
+	}
+
+	buffer->map = mmap(NULL, create.size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, kms->fd, map.offset);
+	if (buffer->map == MAP_FAILED) {
+		printf("%s: failed to mmap dumb buffer: %s\n", __func__,
+		       strerror(errno));
+		buffer->map = NULL;
+		return -1;
+	}
+	buffer->map_size = create.size;
+
+	memset(buffer->map, 0, buffer->map_size);
+
+	return 0;
+}
+
+static void
+kms_buffer_destroy(struct limare_kms *kms, struct limare_kms_buffer *buffer)
+{
+	struct drm_mode_destroy_dumb destroy = { 0 };
+
+	if (buffer->map)
+		munmap(buffer->map, buffer->map_size);
+	if (buffer->fb_id)
+		kms_ioctl(kms->fd, DRM_IOCTL_MODE_RMFB, &buffer->fb_id);
+	if (buffer->handle) {
+		destroy.handle = buffer->handle;
+		kms_ioctl(kms->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+	}
+}
+
+#define KMS_ATOMIC_PROPS_MAX (2 + 2 + 10 * LIMARE_KMS_PLANES_MAX)
+
+struct kms_atomic {
+	unsigned int objs[2 + LIMARE_KMS_PLANES_MAX];
+	unsigned int count_props[2 + LIMARE_KMS_PLANES_MAX];
+	unsigned int props[KMS_ATOMIC_PROPS_MAX];
+	uint64_t values[KMS_ATOMIC_PROPS_MAX];
+	int count_objs;
+	int count;
+	int fd;
+	int failed;
+};
+
+/* Properties have to be added grouped by the object they belong to. */
+static void
+kms_atomic_add(struct kms_atomic *atomic, unsigned int object_id,
+	       unsigned int object_type, const char *name, uint64_t value)
+{
+	unsigned int id;
+
+	id = kms_property(atomic->fd, object_id, object_type, name, NULL);
+	if (!id) {
+		printf("kms: object %d has no %s property.\n", object_id, name);
+		atomic->failed = 1;
+		return;
+	}
+
+	if (!atomic->count_objs ||
+	    (atomic->objs[atomic->count_objs - 1] != object_id)) {
+		atomic->objs[atomic->count_objs] = object_id;
+		atomic->count_props[atomic->count_objs] = 0;
+		atomic->count_objs++;
+	}
+
+	atomic->props[atomic->count] = id;
+	atomic->values[atomic->count] = value;
+	atomic->count++;
+	atomic->count_props[atomic->count_objs - 1]++;
+}
+
+static int
+kms_atomic_commit(struct kms_atomic *atomic, unsigned int flags)
+{
+	struct drm_mode_atomic commit = { 0 };
+
+	if (atomic->failed)
+		return -1;
+
+	commit.flags = flags;
+	commit.count_objs = atomic->count_objs;
+	commit.objs_ptr = U64_PTR(atomic->objs);
+	commit.count_props_ptr = U64_PTR(atomic->count_props);
+	commit.props_ptr = U64_PTR(atomic->props);
+	commit.prop_values_ptr = U64_PTR(atomic->values);
+
+	return kms_ioctl(atomic->fd, DRM_IOCTL_MODE_ATOMIC, &commit);
+}
+
+static int
+kms_modeset_atomic(struct limare_kms *kms, struct drm_mode_modeinfo *mode)
+{
+	struct drm_mode_create_blob blob = { 0 };
+	struct kms_atomic atomic = { { 0 } };
+	int i;
+
+	blob.data = U64_PTR(mode);
+	blob.length = sizeof(*mode);
+	if (kms_ioctl(kms->fd, DRM_IOCTL_MODE_CREATEPROPBLOB, &blob))
+		return -1;
+
+	atomic.fd = kms->fd;
+
+	kms_atomic_add(&atomic, kms->connector_id, DRM_MODE_OBJECT_CONNECTOR,
+		       "CRTC_ID", kms->crtc_id);
+	kms_atomic_add(&atomic, kms->crtc_id, DRM_MODE_OBJECT_CRTC,
+		       "MODE_ID", blob.blob_id);
+	kms_atomic_add(&atomic, kms->crtc_id, DRM_MODE_OBJECT_CRTC,
+		       "ACTIVE", 1);
+
+	/* every plane scans out the full front buffer */
+	for (i = 0; i < kms->planes; i++) {
+		unsigned int id = kms->plane_id[i];
+
+		kms_atomic_add(&atomic, id, DRM_MODE_OBJECT_PLANE, "FB_ID",
+			       kms->buffers[kms->front].fb_id);
+		kms_atomic_add(&atomic, id, DRM_MODE_OBJECT_PLANE, "CRTC_ID",
+			       kms->crtc_id);
+		kms_atomic_add(&atomic, id, DRM_MODE_OBJECT_PLANE, "SRC_X", 0);
+		kms_atomic_add(&atomic, id, DRM_MODE_OBJECT_PLANE, "SRC_Y", 0);
+		kms_atomic_add(&atomic, id, DRM_MODE_OBJECT_PLANE, "SRC_W",
+			       (uint64_t) kms->width << 16);
+		kms_atomic_add(&atomic, id, DRM_MODE_OBJECT_PLANE, "SRC_H",
+			       (uint64_t) kms->height << 16);
+		kms_atomic_add(&atomic, id, DRM_MODE_OBJECT_PLANE, "CRTC_X", 0);
+		kms_atomic_add(&atomic, id, DRM_MODE_OBJECT_PLANE, "CRTC_Y", 0);
+		kms_atomic_add(&atomic, id, DRM_MODE_OBJECT_PLANE, "CRTC_W",
+			       kms->width);
+		kms_atomic_add(&atomic, id, DRM_MODE_OBJECT_PLANE, "CRTC_H",
+			       kms->height);
+	}
+
+	return kms_atomic_commit(&atomic, DRM_MODE_ATOMIC_ALLOW_MODESET);
+}
+
+static int
+kms_modeset_legacy(struct limare_kms *kms, struct drm_mode_modeinfo *mode)
+{
+	struct drm_mode_crtc crtc = { 0 };
+
+	crtc.crtc_id = kms->crtc_id;
+	crtc.fb_id = kms->buffers[kms->front].fb_id;
+	crtc.set_connectors_ptr = U64_PTR(&kms->connector_id);
+	crtc.count_connectors = 1;
+	crtc.mode = *mode;
+	crtc.mode_valid = 1;
+
+	return kms_ioctl(kms->fd, DRM_IOCTL_MODE_SETCRTC, &crtc);
+}
+
+static double
+kms_mode_refresh(struct drm_mode_modeinfo *mode)
+{
+	double total = (double) mode->htotal * mode->vtotal;
+
+	if (mode->flags & DRM_MODE_FLAG_DBLSCAN)
+		total *= 2;
+
+	return total ? mode->clock * 1000.0 / total : mode->vrefresh;
+}
+
+static void
+kms_destroy(struct limare_kms *kms)
+{
+	int i;
+
+	for (i = 0; i < 2; i++)
+		kms_buffer_destroy(kms, &kms->buffers[i]);
+
+	close(kms->fd);
+	free(kms);
+}
+
+static struct limare_kms *
+kms_create(void)
+{
+	struct limare_kms *kms;
+	struct drm_set_client_cap cap = { 0 };
+	struct drm_mode_modeinfo mode;
+	const char *device = getenv("LIMA_KMS");
+	const char *env = getenv("LIMA_KMS_PLANES");
+	int crtc_index, planes = 1, i;
+
+	/* LIMA_KMS=1 just asks for kms on the default card */
+	if (!device || (device[0] != '/'))
+		device = LIMARE_KMS_DEVICE;
+
+	if (env && env[0])
+		planes = atoi(env);
+	if (planes < 1)
+		planes = 1;
+	if (planes > LIMARE_KMS_PLANES_MAX)
+		planes = LIMARE_KMS_PLANES_MAX;
+
+	kms = calloc(1, sizeof(struct limare_kms));
+	if (!kms)
+		return NULL;
+
+	kms->fd = open(device, O_RDWR | O_CLOEXEC);
+	if (kms->fd == -1) {
+		printf("%s: failed to open %s: %s\n", __func__, device,
+		       strerror(errno));
+		free(kms);
+		return NULL;
+	}
+
+	cap.capability = DRM_CLIENT_CAP_UNIVERSAL_PLANES;
+	cap.value = 1;
+	if (!kms_ioctl(kms->fd, DRM_IOCTL_SET_CLIENT_CAP, &cap)) {
+		cap.capability = DRM_CLIENT_CAP_ATOMIC;
+		if (!kms_ioctl(kms->fd, DRM_IOCTL_SET_CLIENT_CAP, &cap))
+			kms->atomic = 1;
+	}
+
+	crtc_index = kms_output_find(kms, &mode);
+	if (crtc_index < 0)
+		goto error;
+
+	if (mode.flags & DRM_MODE_FLAG_INTERLACE)
+		printf("%s: Warning: %s is interlaced.\n", __func__, mode.name);
+
+	kms->width = mode.hdisplay;
+	kms->height = mode.vdisplay;
+	kms->refresh = kms_mode_refresh(&mode);
+
+	/* RGB565 or XRGB8888, whatever limare renders in */
+	kms->bpp = fb_format_bpp();
+	if (!kms->bpp)
+		kms->bpp = 32;
+
+	if (kms->atomic && kms_planes_find(kms, crtc_index, planes)) {
+		printf("%s: no usable planes, not using atomic.\n", __func__);
+		kms->atomic = 0;
+	}
+	if (!kms->atomic)
+		kms->planes = 1;
+
+	for (i = 0; i < 2; i++)
+		if (kms_buffer_create(kms, &kms->buffers[i]))
+			goto error;
+
+	if (kms->atomic && kms_modeset_atomic(kms, &mode)) {
+		printf("%s: atomic modeset failed (%s), trying again without.\n",
+		       __func__, strerror(errno));
+		kms->atomic = 0;
+		kms->planes = 1;
+	}
+
+	if (!kms->atomic && kms_modeset_legacy(kms, &mode)) {
+		printf("%s: failed to set mode %s: %s\n", __func__, mode.name,
+		       strerror(errno));
+		goto error;
+	}
+
+	printf("Using KMS on %s: %dx%d@%.1fHz, %dbpp, %d plane%s, %s flips.\n",
+	       device, kms->width, kms->height, kms->refresh, kms->bpp,
+	       kms->planes,
+	       (kms->planes == 1) ? "" : "s",
+	       kms->atomic ? "atomic" : "legacy");
+
+	return kms;
+
+ error:
+	kms_destroy(kms);
+	return NULL;
+}
+
+/*
+ * Opens and sets up the display the first time around, after that it only
+ * hands out the same one again. Asking to become the owner fails when some
+ * other limare state is drawing to it already.
+ */
+struct limare_kms *
+kms_get(int owner)
+{
+	struct limare_kms *kms;
+
+	pthread_mutex_lock(&kms_mutex);
+
+	if (!kms_shared)
+		kms_shared = kms_create();
+
+	kms = kms_shared;
+	if (kms && owner) {
+		if (kms->owner)
+			kms = NULL;
+		else
+			kms->owner = 1;
+	}
+
+	if (kms)
+		kms->refcount++;
+
+	pthread_mutex_unlock(&kms_mutex);
+
+	return kms;
+}
+
+/*
+ * Reads the pending events, waits up to timeout ms for them to arrive.
+ */
+static void
+kms_events_read(struct limare_kms *kms, int timeout)
+{
+	struct pollfd fds = { 0 };
+	char buffer[1024];
+	int length, offset;
+
+	fds.fd = kms->fd;
+	fds.events = POLLIN;
+
+	while (kms->pending && (poll(&fds, 1, timeout) > 0)) {
+		length = read(kms->fd, buffer, sizeof(buffer));
+		if (length <= 0)
+			break;
+
+		for (offset = 0;
+		     (offset + (int) sizeof(struct drm_event)) <= length;) {
+			struct drm_event *event = (void *) (buffer + offset);
+
+			if (event->length < sizeof(struct drm_event))
+				break;
+
+			if (event->type == DRM_EVENT_FLIP_COMPLETE)
+				kms->pending = 0;
+			offset += event->length;
+		}
+	}
+}
+
+void
+kms_put(struct limare_kms *kms, int owner)
+{
+	pthread_mutex_lock(&kms_mutex);
+
+	if (owner)
+		kms->owner = 0;
+
+	if (--kms->refcount) {
+		pthread_mutex_unlock(&kms_mutex);
+		return;
+	}
+
+	kms_shared = NULL;
+	pthread_mutex_unlock(&kms_mutex);
+
+	/* let the last flip land before its buffer goes away */
+	kms_events_read(kms, 100);
+
+	if (kms->flips)
+		printf("KMS: %d flips, %d frames not shown.\n", kms->flips,
+		       kms->dropped);
+
+	kms_destroy(kms);
+}
+
+/*
+ * Where the next frame should be copied to, or NULL when the previous
+ * flip has not happened yet, and this frame should be skipped.
+ */
+void *
+kms_back_buffer(struct limare_kms *kms)
+{
+	kms_events_read(kms, 0);
+
+	if (kms->pending) {
+		kms->dropped++;
+		return NULL;
+	}
+
+	return kms->buffers[!kms->front].map;
+}
+
+/*
+ * Queues the back buffer for the next vblank, does not wait for it.
+ */
+int
+kms_flip(struct limare_kms *kms)
+{
+	struct limare_kms_buffer *buffer = &kms->buffers[!kms->front];
+	int ret, i;
+
+	if (kms->atomic) {
+		struct drm_mode_atomic commit = { 0 };
+		unsigned int count_props[LIMARE_KMS_PLANES_MAX];
+		uint64_t values[LIMARE_KMS_PLANES_MAX];
+
+		for (i = 0; i < kms->planes; i++) {
+			count_props[i] = 1;
+			values[i] = buffer->fb_id;
+		}
+
+		commit.flags = DRM_MODE_ATOMIC_NONBLOCK |
+			DRM_MODE_PAGE_FLIP_EVENT;
+		commit.count_objs = kms->planes;
+		commit.objs_ptr = U64_PTR(kms->plane_id);
+		commit.count_props_ptr = U64_PTR(count_props);
+		commit.props_ptr = U64_PTR(kms->prop_fb_id);
+		commit.prop_values_ptr = U64_PTR(values);
+
+		ret = kms_ioctl(kms->fd, DRM_IOCTL_MODE_ATOMIC, &commit);
+	} else {
+		struct drm_mode_crtc_page_flip flip = { 0 };
+
+		flip.crtc_id = kms->crtc_id;
+		flip.fb_id = buffer->fb_id;
+		flip.flags = DRM_MODE_PAGE_FLIP_EVENT;
+
+		ret = kms_ioctl(kms->fd, DRM_IOCTL_MODE_PAGE_FLIP, &flip);
+	}
+
+	if (ret) {
+		printf("%s: failed to flip: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+
+	kms->pending = 1;
+	kms->front = !kms->front;
+	kms->flips++;
+
+	return 0;
+}
+
+/*
+ * Block until the flip that was queued last has happened.
+ */
+int
+kms_flip_wait(struct limare_kms *kms)
+{
+	kms_events_read(kms, -1);
+
+	return kms->pending ? -1 : 0;
+}
+
+static int
+kms_fb_bpp(int fd, unsigned int fb_id)
+{
+	struct drm_mode_fb_cmd fb = { 0 };
+
+	fb.fb_id = fb_id;
+	if (kms_ioctl(fd, DRM_IOCTL_MODE_GETFB, &fb) || !fb.bpp)
+		return 32;
+
+	return fb.bpp;
+}
+
+/*
+ * Lists what every enabled plane of every active crtc of the device
+ * scans out, without changing anything, so this needs no drm master.
+ * Kernels without plane support get one entry per crtc, the size of its
+ * mode. Returns the number of entries, or -1 when the device is not
+ * there.
+ */
+int
+kms_scanout_list(const char *device, struct limare_kms_scanout *list,
+		 int max)
+{
+	struct drm_set_client_cap cap = { 0 };
+	struct drm_mode_card_res res = { 0 };
+	struct drm_mode_get_plane_res plane_res = { 0 };
+	struct drm_mode_crtc *crtcs = NULL;
+	unsigned int *crtc_ids = NULL, *plane_ids = NULL;
+	int fd, count = 0, i, j;
+
+	fd = open(device, O_RDWR | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	/* the primary planes only get listed with this, SRC_* with atomic */
+	cap.capability = DRM_CLIENT_CAP_UNIVERSAL_PLANES;
+	cap.value = 1;
+	kms_ioctl(fd, DRM_IOCTL_SET_CLIENT_CAP, &cap);
+	cap.capability = DRM_CLIENT_CAP_ATOMIC;
+	kms_ioctl(fd, DRM_IOCTL_SET_CLIENT_CAP, &cap);
+
+	if (kms_ioctl(fd, DRM_IOCTL_MODE_GETRESOURCES, &res) ||
+	    !res.count_crtcs)
+		goto done;
+
+	crtc_ids = calloc(res.count_crtcs, sizeof(unsigned int));
+	crtcs = calloc(res.count_crtcs, sizeof(struct drm_mode_crtc));
+	if (!crtc_ids || !crtcs)
+		goto done;
+
+	res.crtc_id_ptr = U64_PTR(crtc_ids);
+	res.count_fbs = 0;
+	res.count_connectors = 0;
+	res.count_encoders = 0;
+	if (kms_ioctl(fd, DRM_IOCTL_MODE_GETRESOURCES, &res))
+		goto done;
+
+	for (i = 0; i < (int) res.count_crtcs; i++) {
+		crtcs[i].crtc_id = crtc_ids[i];
+		if (kms_ioctl(fd, DRM_IOCTL_MODE_GETCRTC, &crtcs[i]))
+			crtcs[i].mode_valid = 0;
+	}
+
+	if (!kms_ioctl(fd, DRM_IOCTL_MODE_GETPLANERESOURCES, &plane_res) &&
+	    plane_res.count_planes) {
+		plane_ids = calloc(plane_res.count_planes,
+				   sizeof(unsigned int));
+		plane_res.plane_id_ptr = U64_PTR(plane_ids);
+		if (!plane_ids ||
+		    kms_ioctl(fd, DRM_IOCTL_MODE_GETPLANERESOURCES,
+			      &plane_res))
+			plane_res.count_planes = 0;
+	}
+
+	for (i = 0; i < (int) res.count_crtcs; i++) {
+		struct drm_mode_crtc *crtc = &crtcs[i];
+		int planes = 0;
+
+		if (!crtc->mode_valid)
+			continue;
+
+		for (j = 0; j < (int) plane_res.count_planes; j++) {
+			struct drm_mode_get_plane plane = { 0 };
+			struct limare_kms_scanout *entry;
+			uint64_t src_w = 0, src_h = 0;
+
+			plane.plane_id = plane_ids[j];
+			if (kms_ioctl(fd, DRM_IOCTL_MODE_GETPLANE, &plane) ||
+			    (plane.crtc_id != crtc->crtc_id) || !plane.fb_id)
+				continue;
+
+			planes++;
+			if (count == max)
+				continue;
+
+			kms_property(fd, plane.plane_id,
+				     DRM_MODE_OBJECT_PLANE, "SRC_W", &src_w);
+			kms_property(fd, plane.plane_id,
+				     DRM_MODE_OBJECT_PLANE, "SRC_H", &src_h);
+
+			entry = &list[count++];
+			entry->crtc_id = crtc->crtc_id;
+			entry->plane_id = plane.plane_id;
+			entry->width = src_w ? (src_w >> 16) :
+				crtc->mode.hdisplay;
+			entry->height = src_h ? (src_h >> 16) :
+				crtc->mode.vdisplay;
+			entry->bpp = kms_fb_bpp(fd, plane.fb_id);
+			entry->refresh = kms_mode_refresh(&crtc->mode);
+		}
+
+		/* no planes visible, the crtc scans out its fb directly */
+		if (!planes && crtc->fb_id && (count < max)) {
+			struct limare_kms_scanout *entry = &list[count++];
+
+			entry->crtc_id = crtc->crtc_id;
+			entry->plane_id = 0;
+			entry->width = crtc->mode.hdisplay;
+			entry->height = crtc->mode.vdisplay;
+			entry->bpp = kms_fb_bpp(fd, crtc->fb_id);
+			entry->refresh = kms_mode_refresh(&crtc->mode);
+		}
+	}
+
+ done:
+	free(plane_ids);
+	free(crtcs);
+	free(crtc_ids);
+	close(fd);
+	return count;
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef LIMARE_KMS_H
+#define LIMARE_KMS_H 1
+
+#define LIMARE_KMS_DEVICE "/dev/dri/card0"
+
+/* the primary plane plus this many overlays, at most */
+#define LIMARE_KMS_PLANES_MAX 4
+
+struct limare_kms_buffer {
+	unsigned int handle;
+	unsigned int fb_id;
+	void *map;
+	int map_size;
+};
+
+/*
+ * One display per process, shared between the limare state which draws to
+ * it and the memspeed scanout workload which only wants it to be lit up.
+ */
+struct limare_kms {
+	int fd;
+	int refcount;
+
+	/* a limare state is copying its frames to the buffers */
+	int owner;
+
+	int atomic;
+
+	unsigned int connector_id;
+	unsigned int crtc_id;
+	unsigned int plane_id[LIMARE_KMS_PLANES_MAX];
+	int planes;
+
+	int width;
+	int height;
+	int pitch;
+	int bpp;
+	double refresh;
+
+	struct limare_kms_buffer buffers[2];
+	int front;
+
+	/* atomic property ids */
+	unsigned int prop_fb_id[LIMARE_KMS_PLANES_MAX];
+
+	/* a flip was queued, its event has not arrived yet */
+	int pending;
+
+	int flips;
+	int dropped;
+};
+
+struct limare_kms *kms_get(int owner);
+void kms_put(struct limare_kms *kms, int owner);
+void *kms_back_buffer(struct limare_kms *kms);
+int kms_flip(struct limare_kms *kms);
+int kms_flip_wait(struct limare_kms *kms);
+
+/*
+ * What one enabled plane fetches from memory: its source area, which is
+ * larger than what it shows when the plane is scaled down.
+ */
+struct limare_kms_scanout {
+	unsigned int crtc_id;
+	unsigned int plane_id;
+	int width;
+	int height;
+	int bpp;
+	double refresh;
+};
+
+int kms_scanout_list(const char *device, struct limare_kms_scanout *list,
+		     int max);
+
+#endif /* LIMARE_KMS_H */
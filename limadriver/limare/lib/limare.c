@@ -28,12 +28,18 @@
 #include <asm/ioctl.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <pthread.h>
 
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include <GLES2/gl2.h>
 #define GL_ALPHA_TEST 0x0BC0
 #define GL_CLIP_PLANE0 0x3000
@@ -42,8 +48,10 @@
 #include "linux/mali_ioctl.h"
 
 #include "version.h"
+#include "formats.h"
 #include "limare.h"
 #include "fb.h"
+#include "kms.h"
 #include "plb.h"
 #include "gp.h"
 #include "pp.h"
@@ -52,14 +60,25 @@
 #include "compiler.h"
 #include "texture.h"
 #include "hfloat.h"
+#include "bmp.h"
 #include "program.h"
 #include "render_state.h"
+#include "aux.h"
+#include "handle.h"
+#include "trace.h"
 
-#define FRAME_MEMORY_SIZE 0x400000
+/* frames start out small, and get mapped in further as they fill up. */
+#define FRAME_MEMORY_SIZE 0x200000
+#define FRAME_MEMORY_MAX 0x1000000
 #define AUX_MEMORY_SIZE 0x01000000
 #define FB_MEMORY_OFFSET 0x08000000
+#define EXTERNAL_MEMORY_OFFSET 0x05000000
+#define EXTERNAL_MEMORY_SIZE 0x03000000
+#define SPARE_MEMORY_OFFSET 0x10000000
 #define COMMAND_BUFFER_SIZE 0x10000
 #define TILE_HEAP_SIZE 0x100000
+#define TILE_HEAP_SIZE_MIN 0x20000
+#define TILE_HEAP_SIZE_MAX 0x800000
 
 static int
 limare_fd_open(struct limare_state *state)
@@ -247,6 +266,7 @@ limare_mem_init(struct limare_state *state)
 	}
 
 	state->mem_base = mem_init.mali_address_base;
+	state->mem_size = mem_init.memory_size;
 
 	return 0;
 }
@@ -254,16 +274,13 @@ limare_mem_init(struct limare_state *state)
 /*
  * simplistic benchmarking.
  */
-static struct timespec framerate_start;
-static struct timespec framerate_time;
-
 static void
 limare_framerate_init(struct limare_state *state)
 {
-	if (clock_gettime(CLOCK_MONOTONIC, &framerate_start))
+	if (clock_gettime(CLOCK_MONOTONIC, &state->framerate_start))
 		printf("Error: failed to get time: %s\n", strerror(errno));
 
-	framerate_time = framerate_start;
+	state->framerate_time = state->framerate_start;
 }
 
 static void
@@ -278,25 +295,156 @@ limare_framerate_print(struct limare_state *state, int count, int total)
 		return;
 	}
 
-	usec = (new.tv_sec - framerate_time.tv_sec) * 1000000;
-	usec += (new.tv_nsec - framerate_time.tv_nsec) / 1000;
+	usec = (new.tv_sec - state->framerate_time.tv_sec) * 1000000;
+	usec += (new.tv_nsec - state->framerate_time.tv_nsec) / 1000;
 
-	average = (new.tv_sec - framerate_start.tv_sec) * 1000000;
-	average += (new.tv_nsec - framerate_start.tv_nsec) / 1000;
+	average = (new.tv_sec - state->framerate_start.tv_sec) * 1000000;
+	average += (new.tv_nsec - state->framerate_start.tv_nsec) / 1000;
 
-	framerate_time = new;
+	state->framerate_time = new;
 
 	printf("%df in %fs: %f fps (%4d at %f fps)\n", count,
 	       (float) usec / 1000000, (float) (count * 1000000) / usec,
 	       total, (double) (total * 1000000.0) / average);
 }
 
+/*
+ * Render offscreen at the size of the kms mode, and have the frames shown
+ * there. Only one limare state gets to drive the display.
+ */
+static int
+limare_kms_open(struct limare_state *state, int bpp)
+{
+	struct limare_kms *kms = kms_get(1);
+	int ret;
+
+	if (!kms) {
+		printf("No KMS display to drive, rendering offscreen.\n");
+		return fb_offscreen_open(state, 0, 0, bpp);
+	}
+
+	ret = fb_offscreen_open(state, kms->width, kms->height, kms->bpp);
+	if (ret) {
+		kms_put(kms, 1);
+		return fb_offscreen_open(state, 0, 0, bpp);
+	}
+
+	state->fb->kms = kms;
+
+	return 0;
+}
+
+/*
+ * LIMA_OFFSCREEN=WIDTHxHEIGHT[@BPP] renders to mali memory instead of to
+ * the fbdev, and so does a system without a usable fbdev. LIMA_FB_FORMAT
+ * picks the depth, for all of them.
+ */
+static int
+limare_fb_open(struct limare_state *state)
+{
+	const char *env = getenv("LIMA_OFFSCREEN");
+	int width = 0, height = 0, bpp = fb_format_bpp();
+
+	if (!bpp)
+		bpp = 32;
+
+	if (env && env[0]) {
+		if (sscanf(env, "%dx%d@%d", &width, &height, &bpp) < 2) {
+			printf("%s: Error: LIMA_OFFSCREEN=%s is not "
+			       "WIDTHxHEIGHT[@BPP]\n", __func__, env);
+			return -1;
+		}
+
+		return fb_offscreen_open(state, width, height, bpp);
+	}
+
+	env = getenv("LIMA_KMS");
+	if (env && env[0])
+		return limare_kms_open(state, bpp);
+
+	if (!fb_open(state))
+		return 0;
+
+	printf("No usable fbdev, rendering offscreen instead.\n");
+	return fb_offscreen_open(state, 0, 0, bpp);
+}
+
+/*
+ * Switch to offscreen rendering, in between limare_init and
+ * limare_state_setup. A width or height of 0 picks the default size.
+ */
+int
+limare_offscreen(struct limare_state *state, int width, int height, int bpp)
+{
+	if (state->plb) {
+		printf("%s: Error: already set up for rendering\n", __func__);
+		return -1;
+	}
+
+	return fb_offscreen_open(state, width, height, bpp);
+}
+
+/*
+ * Have size more bytes of AUX memory, which holds the textures, the
+ * buffers and the shaders, than the default, in between limare_init and
+ * limare_state_setup. It sits in between the frames and the external
+ * memory, which limits how far it can grow.
+ */
+int
+limare_aux_grow(struct limare_state *state, int size)
+{
+	int max = EXTERNAL_MEMORY_OFFSET - FRAME_COUNT * FRAME_MEMORY_MAX;
+
+	if (state->plb) {
+		printf("%s: Error: already set up for rendering\n", __func__);
+		return -1;
+	}
+
+	size = AUX_MEMORY_SIZE + ALIGN(size, 0x1000);
+	if ((size < AUX_MEMORY_SIZE) || (size > max)) {
+		printf("%s: Error: 0x%X bytes of AUX memory is more than the "
+		       "0x%X there is room for\n", __func__, size, max);
+		return -1;
+	}
+
+	state->aux_mem_size = size;
+
+	return 0;
+}
+
+/*
+ * LIMA_PLB=WxH[:SIZE] sets the default plb layout, see limare_plb_layout,
+ * with 0 for an automatically picked dimension.
+ */
+static int
+limare_plb_env(struct limare_state *state)
+{
+	const char *env = getenv("LIMA_PLB");
+	int block_w = 0, block_h = 0, block_size = 0;
+
+	state->plb_shift_w = -1;
+	state->plb_shift_h = -1;
+
+	if (!env || !env[0])
+		return 0;
+
+	if (sscanf(env, "%dx%d:%i", &block_w, &block_h, &block_size) < 2) {
+		printf("%s: Error: LIMA_PLB=%s is not WxH[:SIZE]\n",
+		       __func__, env);
+		return -1;
+	}
+
+	return limare_plb_layout(state, block_w, block_h, block_size);
+}
+
 struct limare_state *
 limare_init(void)
 {
 	struct limare_state *state;
 	int ret;
 
+	limare_trace_init();
+
 	state = calloc(1, sizeof(struct limare_state));
 	if (!state) {
 		printf("%s: Error: failed to allocate state: %s\n",
@@ -320,14 +468,123 @@ limare_init(void)
 	if (!state->render_state_template)
 		goto error;
 
-	fb_open(state);
+	ret = limare_fb_open(state);
+	if (ret)
+		goto error;
+
+	limare_framerate_init(state);
+
+	ret = limare_plb_env(state);
+	if (ret)
+		goto error;
+
+	limare_handle_table_init(&state->programs, LIMARE_HANDLE_TYPE_PROGRAM);
+	limare_handle_table_init(&state->textures, LIMARE_HANDLE_TYPE_TEXTURE);
+	limare_handle_table_init(&state->attribute_buffers,
+				 LIMARE_HANDLE_TYPE_ATTRIBUTE);
+	limare_handle_table_init(&state->indices_buffers,
+				 LIMARE_HANDLE_TYPE_INDICES);
+
+	ret = limare_jobs_init(state);
+	if (ret)
+		goto error;
+
+	return state;
+ error:
+	free(state);
+	return NULL;
+}
+
+/*
+ * Stands in for /dev/mali as far as mmap goes: a sparse file with room for
+ * all of the offsets that we map, in shared memory when there is any.
+ */
+#define NULL_MEMORY_SIZE 0x10000000
+
+static int
+limare_null_fd_open(void)
+{
+	char name[32];
+	FILE *file;
+	int fd;
+
+	snprintf(name, sizeof(name), "/limare-null-%d", getpid());
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd != -1) {
+		shm_unlink(name);
+	} else {
+		file = tmpfile();
+		if (!file)
+			return -1;
+		fd = dup(fileno(file));
+		fclose(file);
+		if (fd == -1)
+			return -1;
+	}
+
+	if (ftruncate(fd, NULL_MEMORY_SIZE)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * A state without a gpu behind it, for timing the cpu side of the library
+ * on any machine, see lima-bench-limare.c. What the kernel would map in
+ * comes from limare_null_fd_open instead, the frames render offscreen,
+ * and without the render threads a flushed frame is done straight away.
+ */
+struct limare_state *
+limare_init_null(int type, int pp_core_count)
+{
+	struct limare_state *state;
+	int ret;
+
+	state = calloc(1, sizeof(struct limare_state));
+	if (!state) {
+		printf("%s: Error: failed to allocate state: %s\n",
+		       __func__, strerror(errno));
+		return NULL;
+	}
+
+	state->fd = limare_null_fd_open();
+	if (state->fd == -1) {
+		printf("%s: Error: failed to create the null memory: %s\n",
+		       __func__, strerror(errno));
+		goto error;
+	}
+
+	state->kernel_version = MALI_DRIVER_VERSION_R3P2;
+	state->type = type;
+	state->pp_core_count = pp_core_count;
+
+	state->render_state_template = limare_render_state_template();
+	if (!state->render_state_template)
+		goto error;
+
+	ret = fb_offscreen_open(state, 0, 0, 32);
+	if (ret)
+		goto error;
 
 	limare_framerate_init(state);
 
-	limare_jobs_init(state);
+	ret = limare_plb_env(state);
+	if (ret)
+		goto error;
+
+	limare_handle_table_init(&state->programs, LIMARE_HANDLE_TYPE_PROGRAM);
+	limare_handle_table_init(&state->textures, LIMARE_HANDLE_TYPE_TEXTURE);
+	limare_handle_table_init(&state->attribute_buffers,
+				 LIMARE_HANDLE_TYPE_ATTRIBUTE);
+	limare_handle_table_init(&state->indices_buffers,
+				 LIMARE_HANDLE_TYPE_INDICES);
 
 	return state;
  error:
+	if (state->fd != -1)
+		close(state->fd);
 	free(state);
 	return NULL;
 }
@@ -342,15 +599,168 @@ limare_frame_destroy(struct limare_frame *frame)
 
 	for (i = 0; i < frame->draw_count; i++)
 		draw_info_destroy(frame->draws[i]);
+	free(frame->draws);
+
+	free(frame->vs_commands);
+	free(frame->plbu_commands);
 
 	if (frame->pp)
 		pp_info_destroy(frame->pp);
 
+	/* hand the address space back to the frame reservation. */
+	if (frame->mem_size)
+		mmap(frame->mem_address, frame->mem_size, PROT_NONE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+		     -1, 0);
+
+	pthread_cond_destroy(&frame->cond);
 	pthread_mutex_destroy(&frame->mutex);
 
 	free(frame);
 }
 
+/*
+ * Make sure there are size bytes free behind mem_used, mapping in more of
+ * the frame its address space when needed. Frames are only ever written
+ * behind mem_used, so none of the addresses handed out so far move.
+ */
+int
+limare_frame_mem_reserve(struct limare_frame *frame, int size)
+{
+	struct limare_state *state = frame->state;
+	int new_size = frame->mem_size;
+	void *address;
+
+	if ((frame->mem_size - frame->mem_used) >= size)
+		return 0;
+
+	if ((FRAME_MEMORY_MAX - frame->mem_used) < size)
+		return -1;
+
+	/* a new frame has nothing mapped yet, so start from something. */
+	if (new_size < FRAME_MEMORY_SIZE)
+		new_size = FRAME_MEMORY_SIZE;
+	if (new_size < ALIGN(size, 0x1000))
+		new_size = ALIGN(size, 0x1000);
+
+	while ((new_size - frame->mem_used) < size)
+		new_size *= 2;
+	if (new_size > FRAME_MEMORY_MAX)
+		new_size = FRAME_MEMORY_MAX;
+
+	address = mmap(frame->mem_address + frame->mem_size,
+		       new_size - frame->mem_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_FIXED, state->fd,
+		       frame->mem_physical + frame->mem_size);
+	if (address == MAP_FAILED) {
+		printf("%s: Error: failed to mmap offset 0x%x (0x%x): %s\n",
+		       __func__, frame->mem_physical + frame->mem_size,
+		       new_size - frame->mem_size, strerror(errno));
+		return -1;
+	}
+
+	frame->mem_size = new_size;
+
+	return 0;
+}
+
+/*
+ * Twice what the plbu used the last time this frame went out. Growing
+ * happens straight away, shrinking only by an eighth per frame, so that
+ * a single light frame does not undo it.
+ */
+static int
+limare_tile_heap_size(struct limare_state *state, struct limare_frame *frame)
+{
+	int size = state->tile_heap_size;
+	int target;
+
+	if (!frame->tile_heap_used)
+		return size;
+
+	target = ALIGN(2 * frame->tile_heap_used, TILE_HEAP_SIZE_MIN);
+	if (target > TILE_HEAP_SIZE_MAX)
+		target = TILE_HEAP_SIZE_MAX;
+
+	if (target > size)
+		size = target;
+	else if (target < (size - size / 8))
+		size = ALIGN(size - size / 8, TILE_HEAP_SIZE_MIN);
+
+	if (size < TILE_HEAP_SIZE_MIN)
+		size = TILE_HEAP_SIZE_MIN;
+
+	state->tile_heap_size = size;
+
+	return size;
+}
+
+/*
+ * Get a frame ready for the next round of draws: drop the old draws and
+ * set up the command queues and tile heap again. The plb streams and the
+ * pp info do not change between frames, so they are left alone.
+ */
+static int
+limare_frame_reset(struct limare_state *state, struct limare_frame *frame)
+{
+	int heap_size = limare_tile_heap_size(state, frame);
+	int i;
+
+	for (i = 0; i < frame->draw_count; i++)
+		draw_info_destroy(frame->draws[i]);
+	frame->draw_count = 0;
+
+	frame->id = state->frame_count;
+	frame->index = frame->id % state->fb->buffer_count;
+	frame->render_status = 0;
+
+	frame->recorded = 0;
+	frame->replay = 0;
+
+	frame->mem_used = frame->mem_static_size;
+	frame->tile_heap_grown = 0;
+	frame->tile_heap_used = 0;
+
+	frame->pp->clear_color = state->clear_color;
+
+	/* now the two command queues */
+	if (vs_command_queue_create(frame, COMMAND_BUFFER_SIZE) ||
+	    plbu_command_queue_create(state, frame, COMMAND_BUFFER_SIZE,
+				      heap_size))
+		return -1;
+
+	state->viewport_dirty = 1;
+	state->depth_dirty = 1;
+
+	return 0;
+}
+
+/*
+ * Keep the draws, commands and the memory of the recorded frame, only the
+ * uniform values get written again as the draws are replayed.
+ */
+static void
+limare_frame_replay_reset(struct limare_state *state,
+			  struct limare_frame *frame)
+{
+	frame->id = state->frame_count;
+	frame->index = frame->id % state->fb->buffer_count;
+	frame->render_status = 0;
+
+	frame->replay = 1;
+	frame->replay_draw = 0;
+
+	/*
+	 * the pp takes its stacks from behind the recording, where the tile
+	 * heap blocks of the last replay were too.
+	 */
+	frame->mem_used = frame->replay_mem_used;
+	frame->tile_heap_grown = 0;
+	frame->tile_heap_used = 0;
+
+	frame->pp->clear_color = state->clear_color;
+}
+
 struct limare_frame *
 limare_frame_create(struct limare_state *state, int offset, int size)
 {
@@ -362,8 +772,6 @@ limare_frame_create(struct limare_state *state, int offset, int size)
 	if (!frame)
 		return NULL;
 
-	frame->id = state->frame_count;
-	frame->index = frame->id & 0x01;
 	frame->state = state;
 
 	ret = pthread_mutexattr_init(&mattr);
@@ -377,12 +785,21 @@ limare_frame_create(struct limare_state *state, int offset, int size)
 		printf("%s: pthread_mutex_init failed: %s\n",
 		       __func__, strerror(ret));
 
+	ret = pthread_cond_init(&frame->cond, NULL);
+	if (ret)
+		printf("%s: pthread_cond_init failed: %s\n",
+		       __func__, strerror(ret));
+
 	/* space for our programs and textures. */
-	frame->mem_size = size;
 	frame->mem_used = 0;
 	frame->mem_physical = state->mem_base + offset;
 	frame->mem_address = state->frame_mem_address + offset;
 
+	if (limare_frame_mem_reserve(frame, size)) {
+		limare_frame_destroy(frame);
+		return NULL;
+	}
+
 	if (frame_plb_create(state, frame)) {
 		limare_frame_destroy(frame);
 		return NULL;
@@ -395,17 +812,13 @@ limare_frame_create(struct limare_state *state, int offset, int size)
 		return NULL;
 	}
 
-	/* now the two command queues */
-	if (vs_command_queue_create(frame, COMMAND_BUFFER_SIZE) ||
-	    plbu_command_queue_create(state, frame, COMMAND_BUFFER_SIZE,
-				      TILE_HEAP_SIZE)) {
+	frame->mem_static_size = frame->mem_used;
+
+	if (limare_frame_reset(state, frame)) {
 		limare_frame_destroy(frame);
 		return NULL;
 	}
 
-	state->viewport_dirty = 1;
-	state->depth_dirty = 1;
-
 	return frame;
 }
 
@@ -437,6 +850,77 @@ limare_state_init(struct limare_state *state, unsigned int clear_color)
 	state->cull_front_cw = 0;
 }
 
+/*
+ * Select how the tiles get distributed over the pp cores. Needs to be
+ * called before limare_state_setup(), as that is when the plb streams
+ * are generated.
+ */
+int
+limare_pp_split(struct limare_state *state, int split)
+{
+	if (state->plb) {
+		printf("%s: Error: plb streams already created\n", __func__);
+		return -1;
+	}
+
+	switch (split) {
+	case LIMARE_PP_SPLIT_INTERLEAVED:
+	case LIMARE_PP_SPLIT_HILBERT:
+		state->pp_split = split;
+		return 0;
+	default:
+		printf("%s: Error: unknown split 0x%04X\n", __func__, split);
+		return -1;
+	}
+}
+
+/*
+ * Lay out the plb in blocks of block_w by block_h tiles of 16x16 pixels,
+ * powers of two up to 16, or 0 to have the dimension grown until the
+ * blocks fit the plbu. Bigger blocks mean fewer plb entries for the plbu to
+ * fill in and less frame memory, smaller ones cull better as a dense draw
+ * only touches the blocks it covers. block_size is the polygon list space
+ * each block starts out with before it overflows into the tile heap, a
+ * multiple of 0x200, or 0 for 0x200. Like limare_pp_split, this needs
+ * to be called before limare_state_setup.
+ */
+int
+limare_plb_layout(struct limare_state *state, int block_w, int block_h,
+		  int block_size)
+{
+	int shift_w, shift_h;
+
+	if (state->plb) {
+		printf("%s: Error: plb streams already created\n", __func__);
+		return -1;
+	}
+
+	for (shift_w = 0; (1 << shift_w) < block_w; shift_w++)
+		;
+	for (shift_h = 0; (1 << shift_h) < block_h; shift_h++)
+		;
+
+	if ((block_w < 0) || (block_w > 16) || (block_w & (block_w - 1)) ||
+	    (block_h < 0) || (block_h > 16) || (block_h & (block_h - 1))) {
+		printf("%s: Error: %dx%d tiles is not a valid plb block\n",
+		       __func__, block_w, block_h);
+		return -1;
+	}
+
+	if ((block_size < 0) || (block_size > 0x2000) ||
+	    (block_size & 0x1FF)) {
+		printf("%s: Error: invalid plb block size 0x%X\n", __func__,
+		       block_size);
+		return -1;
+	}
+
+	state->plb_shift_w = block_w ? shift_w : -1;
+	state->plb_shift_h = block_h ? shift_h : -1;
+	state->plb_block_size = block_size;
+
+	return 0;
+}
+
 /* here we still hardcode our memory addresses. */
 int
 limare_state_setup(struct limare_state *state, int width, int height,
@@ -446,13 +930,14 @@ limare_state_setup(struct limare_state *state, int width, int height,
 		return -1;
 
 	/*
-	 * we have two frames, FRAME_MEMORY_SIZE large.
+	 * Each frame gets FRAME_MEMORY_MAX of address space, but only maps
+	 * in as much of it as it has used so far.
 	 */
 	state->frame_mem_physical = state->mem_base;
-	state->frame_mem_size = FRAME_COUNT * FRAME_MEMORY_SIZE;
+	state->frame_mem_size = FRAME_COUNT * FRAME_MEMORY_MAX;
 	state->frame_mem_address =
-		mmap(NULL, state->frame_mem_size, PROT_READ | PROT_WRITE,
-		     MAP_SHARED, state->fd, state->frame_mem_physical);
+		mmap(NULL, state->frame_mem_size, PROT_NONE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
 	if (state->frame_mem_address == MAP_FAILED) {
 		printf("Error: failed to mmap offset 0x%x (0x%x): %s\n",
 		       state->frame_mem_physical, state->frame_mem_size,
@@ -460,27 +945,16 @@ limare_state_setup(struct limare_state *state, int width, int height,
 		return -1;
 	}
 
+	state->tile_heap_size = TILE_HEAP_SIZE;
+
 	/*
-	 * Statically assign a given number of blocks for a fixed number of
-	 * programs. Later on diverge them one by one.
+	 * Space for our textures, buffers and shaders, unless
+	 * limare_aux_grow asked for more.
 	 */
-	state->program_mem_physical = state->frame_mem_physical +
-		state->frame_mem_size;
-	state->program_mem_size = LIMARE_PROGRAM_COUNT * LIMARE_PROGRAM_SIZE;
-	state->program_mem_address =
-		mmap(NULL, state->program_mem_size, PROT_READ | PROT_WRITE,
-		     MAP_SHARED, state->fd, state->program_mem_physical);
-	if (state->program_mem_address == MAP_FAILED) {
-		printf("Error: failed to mmap offset 0x%x (0x%x): %s\n",
-		       state->program_mem_physical, state->program_mem_size,
-		       strerror(errno));
-		return -1;
-	}
-
-	/* space for our textures. */
-	state->aux_mem_size = AUX_MEMORY_SIZE;
+	if (!state->aux_mem_size)
+		state->aux_mem_size = AUX_MEMORY_SIZE;
 	state->aux_mem_physical =
-		state->program_mem_physical + state->program_mem_size;
+		state->frame_mem_physical + state->frame_mem_size;
 	state->aux_mem_address = mmap(NULL, state->aux_mem_size,
 				       PROT_READ | PROT_WRITE,
 				       MAP_SHARED, state->fd,
@@ -492,6 +966,9 @@ limare_state_setup(struct limare_state *state, int width, int height,
 		return -1;
 	}
 
+	if (limare_aux_init(state))
+		return -1;
+
 	/* try to grab the necessary space for our image */
 	if (fb_init(state, width, height, FB_MEMORY_OFFSET))
 		return -1;
@@ -518,71 +995,102 @@ symbol_attach_data(struct symbol *symbol, int count, float *data)
 		symbol->data = data;
 		symbol->data_allocated = 0;
 	} else {
-		int i;
-
 		symbol->data = malloc(2 * count);
 		if (!symbol->data)
 			return -ENOMEM;
 
-		for (i = 0; i < count; i++)
-			((hfloat *) symbol->data)[i] = float_to_hfloat(data[i]);
+		floats_to_hfloats(symbol->data, data, count);
 
 		symbol->data_allocated = 1;
 	}
 	return 0;
 }
 
+/*
+ * Uniform locations hold the vertex uniform index + 1 in the low 16 bits
+ * and the fragment uniform index + 1 in the high 16 bits, as the same
+ * name can live in both shaders. Like with GL, a location is only valid
+ * for the program that was current when it was looked up.
+ */
 int
-limare_uniform_attach(struct limare_state *state, char *name, int count, float *data)
+limare_uniform_location(struct limare_state *state, const char *name)
 {
 	struct limare_program *program = state->program_current;
-	int found = 0, i, ret;
+	int vertex, fragment;
 
-	for (i = 0; i < program->vertex_uniform_count; i++) {
-		struct symbol *symbol = program->vertex_uniforms[i];
+	vertex = symbol_index_find(program->vertex_uniform_index,
+				   program->vertex_uniforms,
+				   program->vertex_uniform_count, name);
+	fragment = symbol_index_find(program->fragment_uniform_index,
+				     program->fragment_uniforms,
+				     program->fragment_uniform_count, name);
 
-		if (!strcmp(symbol->name, name)) {
-			if (symbol->component_count != count) {
-				printf("%s: Error: Uniform %s has wrong dimensions\n",
-				       __func__, name);
-				return -1;
-			}
+	if ((vertex == -1) && (fragment == -1))
+		return -1;
 
-			ret = symbol_attach_data(symbol, count, data);
-			if (ret)
-				return ret;
+	return (vertex + 1) | ((fragment + 1) << 16);
+}
 
-			found = 1;
-			break;
-		}
+static int
+uniform_location_attach(struct symbol *symbol, int count, float *data)
+{
+	if (symbol->component_count != count) {
+		printf("%s: Error: Uniform %s has wrong dimensions\n",
+		       __func__, symbol->name);
+		return -1;
 	}
 
-	for (i = 0; i < program->fragment_uniform_count; i++) {
-		struct symbol *symbol = program->fragment_uniforms[i];
+	return symbol_attach_data(symbol, count, data);
+}
 
-		if (!strcmp(symbol->name, name)) {
-			if (symbol->component_count != count) {
-				printf("%s: Error: Uniform %s has wrong dimensions\n",
-				       __func__, name);
-				return -1;
-			}
+int
+limare_uniform_attach_location(struct limare_state *state, int location,
+			       int count, float *data)
+{
+	struct limare_program *program = state->program_current;
+	int vertex = (location & 0xFFFF) - 1;
+	int fragment = ((location >> 16) & 0xFFFF) - 1;
+	int ret;
 
-			ret = symbol_attach_data(symbol, count, data);
-			if (ret)
-				return ret;
+	if ((location <= 0) ||
+	    (vertex >= program->vertex_uniform_count) ||
+	    (fragment >= program->fragment_uniform_count)) {
+		printf("%s: Error: Invalid uniform location 0x%08X\n",
+		       __func__, location);
+		return -1;
+	}
 
-			found = 1;
-			break;
-		}
+	if (vertex >= 0) {
+		ret = uniform_location_attach(program->vertex_uniforms[vertex],
+					      count, data);
+		if (ret)
+			return ret;
+	}
+
+	if (fragment >= 0) {
+		ret = uniform_location_attach(program->fragment_uniforms[fragment],
+					      count, data);
+		if (ret)
+			return ret;
 	}
 
-	if (!found) {
+	program->uniforms_dirty = 1;
+
+	return 0;
+}
+
+int
+limare_uniform_attach(struct limare_state *state, char *name, int count, float *data)
+{
+	int location = limare_uniform_location(state, name);
+
+	if (location == -1) {
 		printf("%s: Error: Unable to find uniform %s\n",
 		       __func__, name);
 		return -1;
 	}
 
-	return 0;
+	return limare_uniform_attach_location(state, location, count, data);
 }
 
 static struct {
@@ -615,35 +1123,210 @@ limare_attrib_type_size(enum limare_attrib_type type)
 	return 0;
 }
 
+/*
+ * Takes the name of the type without the LIMARE_ATTRIB_ prefix, in either
+ * case, like "i16n". Returns -1 for an unknown type.
+ */
 int
-limare_attribute_pointer(struct limare_state *state, char *name,
-			 enum limare_attrib_type type, int component_count,
-			 int entry_stride, int entry_count, void *data)
+limare_attrib_type_parse(const char *name)
 {
-	struct limare_program *program = state->program_current;
-	struct symbol *symbol = NULL;
-	int component_size;
 	int i;
 
-	for (i = 0; i < program->vertex_attribute_count; i++) {
-		symbol = program->vertex_attributes[i];
+	for (i = 0; limare_attrib_types[i].name; i++)
+		if (!strcasecmp(name, limare_attrib_types[i].name + 14))
+			return limare_attrib_types[i].type;
 
-		if (!strcmp(symbol->name, name))
-			break;
+	return -1;
+}
+
+/*
+ * The vertices are kept 4 byte aligned, so three 16bit components take up
+ * just as much as four.
+ */
+int
+limare_attrib_stride(enum limare_attrib_type type, int component_count)
+{
+	return ALIGN(limare_attrib_type_size(type) * component_count, 4);
+}
+
+static int
+attrib_round(float value, float scale, float min, float max)
+{
+	if (value < min)
+		value = min;
+	else if (value > max)
+		value = max;
+
+	value *= scale;
+
+	return (value < 0.0) ? (int) (value - 0.5) : (int) (value + 0.5);
+}
+
+/*
+ * Pack float vertices into the given type, at limare_attrib_stride. The
+ * normalised types map [-1, 1], or [0, 1] when unsigned, onto their full
+ * range, the others just get rounded, FIXED is 16.16. Values outside of
+ * the range get clamped. Returns the stride, or -1 for an unknown type.
+ */
+int
+limare_attrib_pack(enum limare_attrib_type type, int component_count,
+		   int entry_count, const float *src, void *dst)
+{
+	int stride = limare_attrib_stride(type, component_count);
+	int i, j;
+
+	if (!stride)
+		return -1;
+
+	for (i = 0; i < entry_count; i++) {
+		void *entry = dst + i * stride;
+
+		for (j = 0; j < component_count; j++) {
+			float value = *src++;
+
+			switch (type) {
+			case LIMARE_ATTRIB_FLOAT:
+				((float *) entry)[j] = value;
+				break;
+			case LIMARE_ATTRIB_FIXED:
+				((int *) entry)[j] =
+					attrib_round(value, 65536.0,
+						     -32768.0, 32767.0);
+				break;
+			case LIMARE_ATTRIB_I16:
+				((short *) entry)[j] =
+					attrib_round(value, 1.0,
+						     -32768.0, 32767.0);
+				break;
+			case LIMARE_ATTRIB_U16:
+				((unsigned short *) entry)[j] =
+					attrib_round(value, 1.0, 0.0, 65535.0);
+				break;
+			case LIMARE_ATTRIB_I8:
+				((signed char *) entry)[j] =
+					attrib_round(value, 1.0, -128.0, 127.0);
+				break;
+			case LIMARE_ATTRIB_U8:
+				((unsigned char *) entry)[j] =
+					attrib_round(value, 1.0, 0.0, 255.0);
+				break;
+			case LIMARE_ATTRIB_I16N:
+				((short *) entry)[j] =
+					attrib_round(value, 32767.0, -1.0, 1.0);
+				break;
+			case LIMARE_ATTRIB_U16N:
+				((unsigned short *) entry)[j] =
+					attrib_round(value, 65535.0, 0.0, 1.0);
+				break;
+			case LIMARE_ATTRIB_I8N:
+				((signed char *) entry)[j] =
+					attrib_round(value, 127.0, -1.0, 1.0);
+				break;
+			case LIMARE_ATTRIB_U8N:
+				((unsigned char *) entry)[j] =
+					attrib_round(value, 255.0, 0.0, 1.0);
+				break;
+			}
+		}
 	}
 
-	if (i == program->vertex_attribute_count) {
-		printf("%s: Error: Unable to find attribute %s\n",
-		       __func__, name);
+	return stride;
+}
+
+/*
+ * Like limare_attribute_buffer_upload(), but takes floats and packs them
+ * into the smaller type on the way, see limare_attrib_pack().
+ */
+int
+limare_attribute_buffer_upload_float(struct limare_state *state,
+				     enum limare_attrib_type type,
+				     int component_count, int entry_count,
+				     const float *data)
+{
+	int stride = limare_attrib_stride(type, component_count);
+	int handle;
+
+	if (!stride) {
+		printf("%s: Invalid attribute type %d\n", __func__, type);
 		return -1;
 	}
 
+	handle = limare_attribute_buffer_upload(state, type, component_count,
+						stride, entry_count, NULL);
+	if (handle == -1)
+		return -1;
+
+	limare_attrib_pack(type, component_count, entry_count, data,
+			   limare_attribute_buffer_map(state, handle));
+
+	return handle;
+}
+
+/* An attribute location is just its index, valid for the current program. */
+int
+limare_attribute_location(struct limare_state *state, const char *name)
+{
+	struct limare_program *program = state->program_current;
+
+	return symbol_index_find(program->vertex_attribute_index,
+				 program->vertex_attributes,
+				 program->vertex_attribute_count, name);
+}
+
+static struct symbol *
+attribute_location_symbol(struct limare_program *program, int location,
+			  const char *caller)
+{
+	struct symbol *symbol;
+
+	if ((location < 0) || (location >= program->vertex_attribute_count)) {
+		printf("%s: Error: Invalid attribute location %d\n",
+		       caller, location);
+		return NULL;
+	}
+
+	symbol = program->vertex_attributes[location];
 	if (symbol->precision != 3) {
 		printf("%s: Attribute %s has unsupported precision\n",
+		       caller, symbol->name);
+		return NULL;
+	}
+
+	return symbol;
+}
+
+int
+limare_attribute_pointer(struct limare_state *state, char *name,
+			 enum limare_attrib_type type, int component_count,
+			 int entry_stride, int entry_count, void *data)
+{
+	int location = limare_attribute_location(state, name);
+
+	if (location == -1) {
+		printf("%s: Error: Unable to find attribute %s\n",
 		       __func__, name);
 		return -1;
 	}
 
+	return limare_attribute_pointer_location(state, location, type,
+						 component_count, entry_stride,
+						 entry_count, data);
+}
+
+int
+limare_attribute_pointer_location(struct limare_state *state, int location,
+				  enum limare_attrib_type type,
+				  int component_count, int entry_stride,
+				  int entry_count, void *data)
+{
+	struct symbol *symbol;
+	int component_size;
+
+	symbol = attribute_location_symbol(state->program_current, location,
+					   __func__);
+	if (!symbol)
+		return -1;
+
 	component_size = limare_attrib_type_size(type);
 	if (!component_size)
 		printf("%s: Invalid attribute type %d\n", __func__, type);
@@ -653,7 +1336,7 @@ limare_attribute_pointer(struct limare_state *state, char *name,
 #if 0
 	if (symbol->component_size != component_size) {
 		printf("%s: Error: Attribute %s has different dimensions\n",
-		       __func__, name);
+		       __func__, symbol->name);
 		return -1;
 	}
 #endif
@@ -683,7 +1366,7 @@ attribute_upload(struct limare_frame *frame, struct symbol *symbol)
 
 	size = ALIGN(symbol->size, 0x40);
 
-	if ((frame->mem_size - frame->mem_used) < size) {
+	if (limare_frame_mem_reserve(frame, size)) {
 		printf("%s: Not enough space for %s\n", __func__, symbol->name);
 		return -1;
 	}
@@ -704,19 +1387,9 @@ limare_attribute_buffer_upload(struct limare_state *state,
 			       int entry_count, void *data)
 {
 	struct limare_attribute_buffer *buffer;
-	int i, size, component_size;
+	int size, component_size, offset;
 	void *address;
 
-	for (i = 0; i < LIMARE_ATTRIBUTE_BUFFER_COUNT; i++)
-		if (!state->attribute_buffers[i])
-			break;
-
-	if (i == LIMARE_ATTRIBUTE_BUFFER_COUNT) {
-		printf("%s: all attribute buffer slots have been taken!\n",
-		       __func__);
-		return -1;
-	}
-
 	buffer = calloc(1, sizeof(struct limare_attribute_buffer));
 	if (!buffer) {
 		printf("%s: Error: failed to allocate attribute buffer: %s\n",
@@ -734,28 +1407,33 @@ limare_attribute_buffer_upload(struct limare_state *state,
 	size = entry_stride * entry_count;
 	size = ALIGN(size, 0x40);
 
-	if ((state->aux_mem_size - state->aux_mem_used) < size) {
+	offset = limare_aux_alloc(state, size);
+	if (offset < 0) {
 		printf("%s: Not enough space for buffer\n", __func__);
 		free(buffer);
 		return -1;
 	}
 
-	address = state->aux_mem_address + state->aux_mem_used;
-	buffer->mem_offset = state->aux_mem_used;
-	buffer->mem_physical = state->aux_mem_physical + state->aux_mem_used;
-	state->aux_mem_used += size;
+	address = state->aux_mem_address + offset;
+	buffer->mem_offset = offset;
+	buffer->mem_size = size;
+	buffer->mem_physical = state->aux_mem_physical + offset;
 
 	buffer->component_type = type;
 	buffer->component_count = component_count;
 	buffer->entry_stride = entry_stride;
 	buffer->entry_count = entry_count;
 
-	buffer->handle = 0x80000000 + state->attribute_buffer_handles;
-	state->attribute_buffer_handles++;
-
-	memcpy(address, data, size);
+	buffer->handle = limare_handle_new(&state->attribute_buffers, buffer);
+	if (buffer->handle == -1) {
+		limare_aux_free(state, offset, size);
+		free(buffer);
+		return -1;
+	}
 
-	state->attribute_buffers[i] = buffer;
+	/* without data, the caller fills it in through the map call */
+	if (data)
+		memcpy(address, data, entry_stride * entry_count);
 
 	return buffer->handle;
 }
@@ -764,50 +1442,41 @@ int
 limare_attribute_buffer_attach(struct limare_state *state, char *name,
 			       int buffer_handle)
 {
-	struct limare_program *program = state->program_current;
-	struct symbol *symbol = NULL;
-	struct limare_attribute_buffer *buffer;
-	int i;
-
-	for (i = 0; i < LIMARE_ATTRIBUTE_BUFFER_COUNT; i++) {
-		buffer = state->attribute_buffers[i];
-
-		if (!buffer)
-			continue;
-
-		if (buffer->handle == buffer_handle)
-			break;
-	}
+	int location = limare_attribute_location(state, name);
 
-	if (i == LIMARE_ATTRIBUTE_BUFFER_COUNT) {
-		printf("%s: Error: Unable to find attribute buffer 0x%08X\n",
-		       __func__, buffer_handle);
+	if (location == -1) {
+		printf("%s: Error: Unable to find attribute %s\n",
+		       __func__, name);
 		return -1;
 	}
 
-	for (i = 0; i < program->vertex_attribute_count; i++) {
-		symbol = program->vertex_attributes[i];
+	return limare_attribute_buffer_attach_location(state, location,
+						       buffer_handle);
+}
 
-		if (!strcmp(symbol->name, name))
-			break;
-	}
+int
+limare_attribute_buffer_attach_location(struct limare_state *state,
+					int location, int buffer_handle)
+{
+	struct symbol *symbol;
+	struct limare_attribute_buffer *buffer =
+		limare_handle_lookup(&state->attribute_buffers, buffer_handle);
 
-	if (i == program->vertex_attribute_count) {
-		printf("%s: Error: Unable to find attribute %s\n",
-		       __func__, name);
+	if (!buffer) {
+		printf("%s: Error: Unable to find attribute buffer 0x%08X\n",
+		       __func__, buffer_handle);
 		return -1;
 	}
 
-	if (symbol->precision != 3) {
-		printf("%s: Attribute %s has unsupported precision\n",
-		       __func__, name);
+	symbol = attribute_location_symbol(state->program_current, location,
+					   __func__);
+	if (!symbol)
 		return -1;
-	}
 
 #if 0
 	if (symbol->component_size != buffer->component_size) {
 		printf("%s: Error: Attribute %s has different dimensions\n",
-		       __func__, name);
+		       __func__, symbol->name);
 		return -1;
 	}
 #endif
@@ -829,6 +1498,50 @@ limare_attribute_buffer_attach(struct limare_state *state, char *name,
 	return 0;
 }
 
+/*
+ * Give the AUX memory of an attribute buffer back. Only do this once the
+ * frames which use it are done.
+ */
+int
+limare_attribute_buffer_free(struct limare_state *state, int handle)
+{
+	struct limare_attribute_buffer *buffer =
+		limare_handle_free(&state->attribute_buffers, handle);
+
+	if (!buffer) {
+		printf("%s: Error: Unable to find attribute buffer 0x%08X\n",
+		       __func__, handle);
+		return -1;
+	}
+
+	limare_aux_free(state, buffer->mem_offset, buffer->mem_size);
+	free(buffer);
+
+	return 0;
+}
+
+/*
+ * Returns where the CPU can write the contents of an attribute buffer,
+ * so that vertices can be generated in place instead of being copied in
+ * with limare_attribute_buffer_upload(). AUX memory is shared with the GPU,
+ * so there is nothing to flush afterwards, but don't touch a buffer which
+ * a frame still in flight uses.
+ */
+void *
+limare_attribute_buffer_map(struct limare_state *state, int handle)
+{
+	struct limare_attribute_buffer *buffer =
+		limare_handle_lookup(&state->attribute_buffers, handle);
+
+	if (!buffer) {
+		printf("%s: Error: Unable to find attribute buffer 0x%08X\n",
+		       __func__, handle);
+		return NULL;
+	}
+
+	return state->aux_mem_address + buffer->mem_offset;
+}
+
 void
 limare_viewport_transform(struct limare_state *state)
 {
@@ -859,16 +1572,19 @@ limare_viewport_transform(struct limare_state *state)
 static struct limare_texture *
 limare_texture_find(struct limare_state *state, int handle)
 {
-	int i;
-
-	for (i = 0; i < LIMARE_TEXTURE_COUNT; i++) {
-		struct limare_texture *texture = state->textures[i];
+	return limare_handle_lookup(&state->textures, handle);
+}
 
-		if (texture && (texture->handle == handle))
-			return texture;
-	}
+/* Hands out the handle for a freshly created texture. */
+static int
+limare_texture_handle_new(struct limare_state *state,
+			  struct limare_texture *texture)
+{
+	texture->handle = limare_handle_new(&state->textures, texture);
+	if (texture->handle == -1)
+		limare_texture_destroy(state, texture);
 
-	return NULL;
+	return texture->handle;
 }
 
 int
@@ -876,28 +1592,416 @@ limare_texture_upload(struct limare_state *state, const void *pixels,
 		      int width, int height, int format, int mipmap)
 {
 	struct limare_texture *texture;
-	int i;
 
-	for (i = 0; i < LIMARE_TEXTURE_COUNT; i++)
-		if (!state->textures[i])
+	texture = limare_texture_create(state, pixels, width, height, format,
+					mipmap);
+	if (!texture)
+		return -1;
+
+	return limare_texture_handle_new(state, texture);
+}
+
+/*
+ * Next whitespace separated word of a pnm header, skipping comments.
+ */
+static int
+limare_pnm_token(const char *stream, int size, int *offset,
+		 char *token, int token_size)
+{
+	int i = *offset, count = 0;
+
+	while (i < size) {
+		if (stream[i] == '#') {
+			while ((i < size) && (stream[i] != '\n'))
+				i++;
+		} else if ((stream[i] == ' ') || (stream[i] == '\t') ||
+			   (stream[i] == '\r') || (stream[i] == '\n'))
+			i++;
+		else
 			break;
+	}
+
+	while ((i < size) && (count < (token_size - 1)) &&
+	       (stream[i] != ' ') && (stream[i] != '\t') &&
+	       (stream[i] != '\r') && (stream[i] != '\n'))
+		token[count++] = stream[i++];
+	token[count] = 0;
+
+	*offset = i;
+
+	return count ? 0 : -1;
+}
+
+/*
+ * Parses a binary ppm (P6) or a pam (P7) header, returns the offset of the
+ * texels, or -1.
+ */
+static int
+limare_pnm_header(const char *stream, int size, int *width, int *height,
+		  int *depth)
+{
+	char token[32];
+	int offset = 0, maxval = 0;
+
+	*width = *height = *depth = 0;
+
+	if (limare_pnm_token(stream, size, &offset, token, sizeof(token)))
+		return -1;
+
+	if (!strcmp(token, "P6")) {
+		*depth = 3;
+
+		if (limare_pnm_token(stream, size, &offset, token,
+				     sizeof(token)))
+			return -1;
+		*width = atoi(token);
+
+		if (limare_pnm_token(stream, size, &offset, token,
+				     sizeof(token)))
+			return -1;
+		*height = atoi(token);
+
+		if (limare_pnm_token(stream, size, &offset, token,
+				     sizeof(token)))
+			return -1;
+		maxval = atoi(token);
+	} else if (!strcmp(token, "P7")) {
+		char value[32];
+
+		while (1) {
+			if (limare_pnm_token(stream, size, &offset, token,
+					     sizeof(token)))
+				return -1;
+
+			if (!strcmp(token, "ENDHDR"))
+				break;
+
+			/* every other header line is a key and a value. */
+			if (limare_pnm_token(stream, size, &offset, value,
+					     sizeof(value)))
+				return -1;
+
+			if (!strcmp(token, "WIDTH"))
+				*width = atoi(value);
+			else if (!strcmp(token, "HEIGHT"))
+				*height = atoi(value);
+			else if (!strcmp(token, "DEPTH"))
+				*depth = atoi(value);
+			else if (!strcmp(token, "MAXVAL"))
+				maxval = atoi(value);
+		}
+	} else
+		return -1;
 
-	if (i == LIMARE_TEXTURE_COUNT) {
-		printf("%s: all texture slots have been taken!\n", __func__);
+	if ((maxval != 255) || (*width <= 0) || (*height <= 0) ||
+	    (*width > 4096) || (*height > 4096))
+		return -1;
+
+	/* a single whitespace character separates the header. */
+	offset++;
+	if ((offset + *width * *height * *depth) > size)
+		return -1;
+
+	return offset;
+}
+
+/*
+ * Upload a texture straight from a file: a binary ppm becomes RGB_888, and a
+ * pam with a depth of 4 becomes RGBA_8888, at 8 bits per channel. The file
+ * is mapped, and the texels go from the mapping straight into the swizzled
+ * layout in our memory, so even large stress textures get copied only once,
+ * and nothing needs to be compiled in. Width and height are optional.
+ */
+int
+limare_texture_upload_file(struct limare_state *state, const char *filename,
+			   int mipmap, int *width, int *height)
+{
+	struct stat buf;
+	const char *stream;
+	int fd, size, offset, w, h, depth, format, ret;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		printf("%s: Error: failed to open %s: %s\n", __func__,
+		       filename, strerror(errno));
 		return -1;
 	}
 
-	texture = limare_texture_create(state, pixels, width, height, format,
-					mipmap);
-	if (!texture)
+	if (fstat(fd, &buf) || !buf.st_size) {
+		printf("%s: Error: failed to stat %s, or empty\n", __func__,
+		       filename);
+		close(fd);
 		return -1;
+	}
+	size = buf.st_size;
 
-	texture->handle = state->texture_handles | 0xC0000000;
-	state->texture_handles++;
+	stream = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (stream == MAP_FAILED) {
+		printf("%s: Error: failed to mmap %s: %s\n", __func__,
+		       filename, strerror(errno));
+		return -1;
+	}
 
-	state->textures[i] = texture;
+	offset = limare_pnm_header(stream, size, &w, &h, &depth);
+	if (depth == 3)
+		format = LIMA_TEXEL_FORMAT_RGB_888;
+	else
+		format = LIMA_TEXEL_FORMAT_RGBA_8888;
 
-	return texture->handle;
+	if ((offset < 0) || ((depth != 3) && (depth != 4))) {
+		printf("%s: Error: %s is not an 8bit RGB ppm or RGBA pam\n",
+		       __func__, filename);
+		ret = -1;
+	} else
+		ret = limare_texture_upload(state, stream + offset, w, h,
+					    format, mipmap);
+
+	munmap((void *) stream, size);
+
+	if ((ret >= 0) && width)
+		*width = w;
+	if ((ret >= 0) && height)
+		*height = h;
+
+	return ret;
+}
+
+/* the texel formats which can be uploaded, by the names users give them */
+static const struct {
+	const char *name;
+	int format;
+	int bits;
+} limare_texel_formats[] = {
+	{ "rgba8888", LIMA_TEXEL_FORMAT_RGBA_8888, 32 },
+	{ "rgb888", LIMA_TEXEL_FORMAT_RGB_888, 24 },
+	{ "rgb565", LIMA_TEXEL_FORMAT_BGR_565, 16 },
+	{ "etc1", LIMA_TEXEL_FORMAT_ETC1_RGB8, 4 },
+};
+
+#define LIMARE_TEXEL_FORMAT_COUNT \
+	(sizeof(limare_texel_formats) / sizeof(limare_texel_formats[0]))
+
+/*
+ * Returns the texel format of that name, or -1.
+ */
+int
+limare_texel_format_parse(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < LIMARE_TEXEL_FORMAT_COUNT; i++)
+		if (!strcmp(name, limare_texel_formats[i].name))
+			return limare_texel_formats[i].format;
+
+	return -1;
+}
+
+/*
+ * Bits per texel, 0 for the formats which cannot be uploaded.
+ */
+int
+limare_texel_format_bits(int format)
+{
+	unsigned int i;
+
+	for (i = 0; i < LIMARE_TEXEL_FORMAT_COUNT; i++)
+		if (limare_texel_formats[i].format == format)
+			return limare_texel_formats[i].bits;
+
+	return 0;
+}
+
+/*
+ * Converts the width x height RGBA_8888 texels which the tests generate
+ * into one of the formats above, so that the same pattern can be sampled
+ * at a different number of bits per texel. ETC1 gets compressed, which
+ * takes a while for big textures. The result needs to be freed.
+ */
+void *
+limare_texels_convert(const void *rgba, int width, int height, int format)
+{
+	const unsigned char *src = rgba;
+	unsigned char *dst;
+	unsigned short *dst16;
+	int size = limare_texel_format_bits(format) / 8;
+	int count = width * height;
+	int i;
+
+	if (format == LIMA_TEXEL_FORMAT_ETC1_RGB8)
+		return limare_etc1_encode(rgba, width, height);
+
+	if (!size) {
+		printf("%s: Error: unsupported format 0x%02X\n",
+		       __func__, format);
+		return NULL;
+	}
+
+	dst = malloc(count * size);
+	if (!dst) {
+		printf("%s: Error: failed to allocate %d texels: %s\n",
+		       __func__, count, strerror(errno));
+		return NULL;
+	}
+
+	switch (format) {
+	case LIMA_TEXEL_FORMAT_RGBA_8888:
+		memcpy(dst, src, count * 4);
+		break;
+	case LIMA_TEXEL_FORMAT_RGB_888:
+		for (i = 0; i < count; i++) {
+			dst[3 * i + 0] = src[4 * i + 0];
+			dst[3 * i + 1] = src[4 * i + 1];
+			dst[3 * i + 2] = src[4 * i + 2];
+		}
+		break;
+	case LIMA_TEXEL_FORMAT_BGR_565:
+		dst16 = (unsigned short *) dst;
+		for (i = 0; i < count; i++)
+			dst16[i] = ((src[4 * i + 0] & 0xF8) << 8) |
+				((src[4 * i + 1] & 0xFC) << 3) |
+				(src[4 * i + 2] >> 3);
+		break;
+	}
+
+	return dst;
+}
+
+/*
+ * Hand physical memory which does not belong to mali, say a piece of a
+ * userspace buffer, to the gpu. It ends up behind our own memory, below
+ * the fb, and stays mapped until limare_finish. Returns the mali address
+ * or 0. A userspace buffer takes one mapping per physically contiguous
+ * run of pages, so the table of mappings doubles as it fills up.
+ */
+unsigned int
+limare_external_map(struct limare_state *state, unsigned int physical,
+		    int size)
+{
+	_mali_uk_map_external_mem_s map = { 0 };
+	unsigned int *cookies;
+	int count, ret;
+
+	if ((physical & 0xFFF) || (size & 0xFFF) || (size <= 0)) {
+		printf("%s: Error: 0x%08X (0x%x) is not page aligned\n",
+		       __func__, physical, size);
+		return 0;
+	}
+
+	if (state->external_count == state->external_size) {
+		count = state->external_size ?
+			2 * state->external_size : LIMARE_EXTERNAL_COUNT;
+
+		cookies = realloc(state->external_cookies,
+				  count * sizeof(unsigned int));
+		if (!cookies) {
+			printf("%s: Error: failed to grow the external "
+			       "mappings: %s\n", __func__, strerror(errno));
+			return 0;
+		}
+
+		state->external_cookies = cookies;
+		state->external_size = count;
+	}
+
+	if ((EXTERNAL_MEMORY_SIZE - state->external_mem_used) < size) {
+		printf("%s: Error: no space left for 0x%x bytes\n", __func__,
+		       size);
+		return 0;
+	}
+
+	map.phys_addr = physical;
+	map.size = size;
+	map.mali_address = state->mem_base + EXTERNAL_MEMORY_OFFSET +
+		state->external_mem_used;
+
+	if (state->kernel_version < MALI_DRIVER_VERSION_R3P1)
+		ret = ioctl(state->fd, MALI_IOC_MEM_MAP_EXT, &map);
+	else
+		ret = ioctl(state->fd, MALI_IOC_MEM_MAP_EXT_R3P1, &map);
+	if (ret) {
+		printf("%s: Error: failed to map 0x%08X (0x%x): %s\n",
+		       __func__, physical, size, strerror(errno));
+		return 0;
+	}
+
+	state->external_cookies[state->external_count] = map.cookie;
+	state->external_count++;
+	state->external_mem_used += size;
+
+	return map.mali_address;
+}
+
+static void
+limare_external_unmap(struct limare_state *state)
+{
+	int i, ret;
+
+	for (i = 0; i < state->external_count; i++) {
+		_mali_uk_unmap_external_mem_s unmap = { 0 };
+
+		unmap.cookie = state->external_cookies[i];
+
+		if (state->kernel_version < MALI_DRIVER_VERSION_R3P1)
+			ret = ioctl(state->fd, MALI_IOC_MEM_UNMAP_EXT, &unmap);
+		else
+			ret = ioctl(state->fd, MALI_IOC_MEM_UNMAP_EXT_R3P1,
+				    &unmap);
+		if (ret)
+			printf("%s: Error: failed to unmap: %s\n", __func__,
+			       strerror(errno));
+	}
+
+	free(state->external_cookies);
+	state->external_cookies = NULL;
+	state->external_count = 0;
+	state->external_size = 0;
+	state->external_mem_used = 0;
+}
+
+/*
+ * Map 'size' bytes of the mali address space which limare itself leaves
+ * alone, well above the framebuffer, for memtester to test. The kernel
+ * driver backs it with its reserved memory, and with pages it takes from
+ * the kernel after that, as it gets mapped: this fails once the driver
+ * runs out of either.
+ */
+void *
+limare_spare_map(struct limare_state *state, int size)
+{
+	void *address;
+
+	if ((size & 0xFFF) || (size <= 0) ||
+	    (state->mem_size && (state->mem_size < SPARE_MEMORY_OFFSET ||
+				 state->mem_size - SPARE_MEMORY_OFFSET <
+				 (unsigned int) size)))
+		return NULL;
+
+	address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       state->fd, state->mem_base + SPARE_MEMORY_OFFSET);
+	if (address == MAP_FAILED)
+		return NULL;
+
+	return address;
+}
+
+/*
+ * Turn external memory, as returned by limare_external_map, into a
+ * texture, which can then also be rendered to.
+ */
+int
+limare_texture_external(struct limare_state *state, void *address,
+			unsigned int mali_address, int width, int height,
+			int format)
+{
+	struct limare_texture *texture;
+
+	texture = limare_texture_create_external(state, address, mali_address,
+						 width, height, format);
+	if (!texture)
+		return -1;
+
+	return limare_texture_handle_new(state, texture);
 }
 
 int
@@ -914,6 +2018,44 @@ limare_texture_mipmap_upload(struct limare_state *state, int handle, int level,
 	return limare_texture_mipmap_upload_low(state, texture, level, pixels);
 }
 
+int
+limare_texture_sub_upload(struct limare_state *state, int handle,
+			  int x, int y, int width, int height,
+			  const void *pixels)
+{
+	struct limare_texture *texture = limare_texture_find(state, handle);
+
+	if (!texture) {
+		printf("%s: texture 0x%08X not found!\n", __func__, handle);
+		return -1;
+	}
+
+	return limare_texture_sub_upload_low(texture, x, y, width, height,
+					     pixels);
+}
+
+/*
+ * Give the AUX memory of a texture back. Only do this once the frames
+ * which use it are done.
+ */
+int
+limare_texture_free(struct limare_state *state, int handle)
+{
+	struct limare_texture *texture =
+		limare_handle_free(&state->textures, handle);
+
+	if (!texture) {
+		printf("%s: texture 0x%08X not found!\n", __func__, handle);
+		return -1;
+	}
+
+	if (state->render_target == texture)
+		state->render_target = NULL;
+	limare_texture_destroy(state, texture);
+
+	return 0;
+}
+
 int
 limare_texture_parameters(struct limare_state *state, int handle,
 			  int filter_mag, int filter_min,
@@ -983,11 +2125,27 @@ limare_texture_parameters(struct limare_state *state, int handle,
 int
 limare_texture_attach(struct limare_state *state, char *uniform_name,
 		      int handle)
+{
+	int location = limare_uniform_location(state, uniform_name);
+
+	if (location == -1) {
+		printf("%s: Error: Unable to find uniform %s\n",
+		       __func__, uniform_name);
+		return -1;
+	}
+
+	return limare_texture_attach_location(state, location, handle);
+}
+
+/* Takes a location from limare_uniform_location, samplers are fragment only. */
+int
+limare_texture_attach_location(struct limare_state *state, int location,
+			       int handle)
 {
 	struct limare_texture *texture = limare_texture_find(state, handle);
 	struct limare_program *program = state->program_current;
-	struct symbol *symbol = NULL;
-	int i;
+	struct symbol *symbol;
+	int fragment = ((location >> 16) & 0xFFFF) - 1;
 
 	if (!texture) {
 		printf("%s: texture 0x%08X not found!\n", __func__, handle);
@@ -1000,13 +2158,15 @@ limare_texture_attach(struct limare_state *state, char *uniform_name,
 		return -1;
 	}
 
-	for (i = 0; i < program->fragment_uniform_count; i++) {
-		symbol = program->fragment_uniforms[i];
-
-		if (!strcmp(symbol->name, uniform_name))
-			break;
+	if ((location <= 0) || (fragment < 0) ||
+	    (fragment >= program->fragment_uniform_count)) {
+		printf("%s: Error: Invalid sampler location 0x%08X\n",
+		       __func__, location);
+		return -1;
 	}
 
+	symbol = program->fragment_uniforms[fragment];
+
 	if (symbol->data) {
 		printf("%s: Error: vertex uniform %s is empty.\n",
 		       __func__, symbol->name);
@@ -1023,9 +2183,181 @@ limare_texture_attach(struct limare_state *state, char *uniform_name,
 	return 0;
 }
 
+/*
+ * Have the frames from the next limare_frame_new on rendered into this
+ * texture instead of into the fb, a handle of 0 goes back to the fb. The
+ * pp writes 16x16 blocks, which is the same layout our textures have, so
+ * the result can be sampled by the next frame right away. Only the first
+ * mipmap level gets written.
+ */
+int
+limare_render_target(struct limare_state *state, int handle)
+{
+	struct limare_texture *texture;
+
+	if (!handle) {
+		state->render_target = NULL;
+		return 0;
+	}
+
+	texture = limare_texture_find(state, handle);
+	if (!texture) {
+		printf("%s: texture 0x%08X not found!\n", __func__, handle);
+		return -1;
+	}
+
+	if ((texture->format != LIMA_TEXEL_FORMAT_RGBA_8888) &&
+	    (texture->format != LIMA_TEXEL_FORMAT_BGR_565)) {
+		printf("%s: Error: cannot render to texture format 0x%02X\n",
+		       __func__, texture->format);
+		return -1;
+	}
+
+	if ((texture->width != state->width) ||
+	    (texture->height != state->height)) {
+		printf("%s: Error: texture is %dx%d, not %dx%d\n", __func__,
+		       texture->width, texture->height,
+		       state->width, state->height);
+		return -1;
+	}
+
+	state->render_target = texture;
+
+	return 0;
+}
+
+static int
+limare_frame_draw_add(struct limare_frame *frame, struct draw_info *draw)
+{
+	if (frame->draw_count == frame->draw_size) {
+		int size = frame->draw_size ? 2 * frame->draw_size :
+			LIMARE_DRAW_COUNT;
+		struct draw_info **draws =
+			realloc(frame->draws, size * sizeof(struct draw_info *));
+
+		if (!draws) {
+			printf("%s: Error: failed to grow draws: %s\n",
+			       __func__, strerror(errno));
+			return -1;
+		}
+
+		frame->draws = draws;
+		frame->draw_size = size;
+	}
+
+	frame->draws[frame->draw_count] = draw;
+	frame->draw_count++;
+
+	return 0;
+}
+
+/*
+ * Uniforms only get copied into frame memory when something changed since
+ * the last draw with this program in this frame. Otherwise the new draw
+ * simply points at the same blocks.
+ *
+ * Note that uniform data is referenced, not copied, on attach, so data that
+ * is changed in place needs to be attached again to be picked up.
+ */
+static int
+limare_draw_uniforms_attach(struct limare_frame *frame,
+			    struct limare_program *program,
+			    struct draw_info *draw)
+{
+	struct vs_info *vs = draw->vs;
+	struct plbu_info *plbu = draw->plbu;
+
+	if (!program->uniforms_dirty && (program->uniforms_frame == frame) &&
+	    (program->uniforms_frame_id == frame->id)) {
+		draw->uniforms_shared = 1;
+
+		vs->uniform_offset = program->vertex_uniform_offset;
+		vs->uniform_size = program->vertex_uniform_size;
+
+		if (program->fragment_uniform_offset != -1) {
+			plbu->uniform_array_offset =
+				program->fragment_uniform_array_offset;
+			plbu->uniform_array_size = 4;
+			plbu->uniform_offset = program->fragment_uniform_offset;
+			plbu->uniform_size = program->fragment_uniform_size;
+		}
+
+		return 0;
+	}
+
+	if (vs_info_attach_uniforms(frame, draw,
+				    program->vertex_uniforms,
+				    program->vertex_uniform_count,
+				    program->vertex_uniform_size))
+		return -1;
+
+	if (plbu_info_attach_uniforms(frame, draw,
+				      program->fragment_uniforms,
+				      program->fragment_uniform_count,
+				      program->fragment_uniform_size))
+		return -1;
+
+	program->uniforms_dirty = 0;
+	program->uniforms_frame = frame;
+	program->uniforms_frame_id = frame->id;
+	program->vertex_uniform_offset = vs->uniform_offset;
+	if (plbu->uniform_size) {
+		program->fragment_uniform_array_offset =
+			plbu->uniform_array_offset;
+		program->fragment_uniform_offset = plbu->uniform_offset;
+	} else
+		program->fragment_uniform_offset = -1;
+
+	return 0;
+}
+
+/*
+ * Instead of building the draw again, check that it is the next one of
+ * the recording, and patch in the uniforms that it was given now. A draw
+ * which shared the uniform block of an earlier draw needs the uniforms to
+ * still be the same.
+ */
+static int
+limare_draw_replay(struct limare_state *state, struct limare_frame *frame,
+		   struct limare_program *program, int mode, int count,
+		   int uniforms)
+{
+	struct draw_info *draw = NULL;
+
+	if (frame->replay_draw < frame->draw_count)
+		draw = frame->draws[frame->replay_draw];
+
+	if (!draw || (draw->program != program) ||
+	    (draw->draw_mode != mode) || (draw->vertex_count != count) ||
+	    (draw->uniforms_shared && program->uniforms_dirty)) {
+		printf("%s: Error: draw %d does not match the recording\n",
+		       __func__, frame->replay_draw);
+		/* have the next frame in this slot recorded again. */
+		frame->recorded = 0;
+		return -1;
+	}
+
+	frame->replay_draw++;
+
+	if (!uniforms || draw->uniforms_shared)
+		return 0;
+
+	vs_info_uniforms_rewrite(frame, draw, program->vertex_uniforms,
+				 program->vertex_uniform_count);
+	plbu_info_uniforms_rewrite(frame, draw, program->fragment_uniforms,
+				   program->fragment_uniform_count);
+	program->uniforms_dirty = 0;
+
+	return 0;
+}
+
+/*
+ * When upload is not set, the attribute data is taken to be in frame
+ * memory already, from an earlier draw of the same batch.
+ */
 static int
 limare_draw(struct limare_state *state, int mode, int start, int count,
-	    struct limare_indices_buffer *indices_buffer)
+	    struct limare_indices_buffer *indices_buffer, int upload)
 {
 	struct limare_program *program = state->program_current;
 	struct limare_frame *frame =
@@ -1039,6 +2371,9 @@ limare_draw(struct limare_state *state, int mode, int start, int count,
 		return -1;
 	}
 
+	if (frame->replay)
+		return limare_draw_replay(state, frame, program, mode, count, 1);
+
 	for (i = 0; i < program->vertex_attribute_count; i++) {
 		struct symbol *symbol = program->vertex_attributes[i];
 
@@ -1062,6 +2397,14 @@ limare_draw(struct limare_state *state, int mode, int start, int count,
 	if (state->viewport_dirty || state->depth_dirty) {
 		limare_viewport_transform(state);
 		/* the dirty flags will be removed in the plbu */
+
+		/* every program refers to the one viewport transform. */
+		for (i = 0; i < state->programs.used; i++) {
+			struct limare_program *other = state->programs.objects[i];
+
+			if (other)
+				other->uniforms_dirty = 1;
+		}
 	}
 
 	for (i = 0; i < program->vertex_uniform_count; i++) {
@@ -1092,8 +2435,12 @@ limare_draw(struct limare_state *state, int mode, int start, int count,
 		}
 	}
 
-	if (frame->draw_count >= LIMARE_DRAW_COUNT) {
-		printf("%s: Error: too many draws already!\n", __func__);
+	/* the range is cached with the buffer, so this check is free. */
+	if (indices_buffer && program->vertex_attribute_count &&
+	    (indices_buffer->end >= attributes_vertex_count)) {
+		printf("%s: Error: index %d is beyond the %d vertices of the "
+		       "attributes.\n", __func__, indices_buffer->end,
+		       attributes_vertex_count);
 		return -1;
 	}
 
@@ -1103,13 +2450,17 @@ limare_draw(struct limare_state *state, int mode, int start, int count,
 	else
 		draw = draw_create_new(state, frame, mode, count, start, count);
 
-	frame->draws[frame->draw_count] = draw;
-	frame->draw_count++;
+	draw->program = program;
+
+	if (limare_frame_draw_add(frame, draw)) {
+		draw_info_destroy(draw);
+		return -1;
+	}
 
 	for (i = 0; i < program->vertex_attribute_count; i++) {
 		struct symbol *symbol = program->vertex_attributes[i];
 
-		if (symbol->data)
+		if (symbol->data && upload)
 			attribute_upload(frame, symbol);
 
 		vs_info_attach_attribute(frame, draw, symbol);
@@ -1118,51 +2469,94 @@ limare_draw(struct limare_state *state, int mode, int start, int count,
 	if (vs_info_attach_varyings(program, frame, draw))
 		return -1;
 
-	if (vs_info_attach_uniforms(frame, draw,
-				    program->vertex_uniforms,
-				    program->vertex_uniform_count,
-				    program->vertex_uniform_size))
+	if (limare_draw_uniforms_attach(frame, program, draw))
 		return -1;
 
 	if (plbu_info_attach_textures(state, frame, draw))
 		return -1;
 
-	if (plbu_info_attach_uniforms(frame, draw,
-				      program->fragment_uniforms,
-				      program->fragment_uniform_count,
-				      program->fragment_uniform_size))
-		return -1;
-
 	if (indices_buffer)
 		plbu_info_attach_indices(draw, indices_buffer->indices_type,
 					 indices_buffer->mem_physical);
 
-	vs_commands_draw_add(state, frame, program, draw);
+	if (vs_commands_draw_add(state, frame, program, draw))
+		return -1;
 	vs_info_finalize(state, frame, program, draw, draw->vs);
 
 	draw_render_state_create(frame, program, draw,
 				 state->render_state_template);
-	plbu_commands_draw_add(state, frame, draw);
 
-	return 0;
+	return plbu_commands_draw_add(state, frame, draw);
 }
 
 int
 limare_draw_arrays(struct limare_state *state, int mode, int start, int count)
 {
-	return limare_draw(state, mode, start, count, NULL);
+	return limare_draw(state, mode, start, count, NULL, 1);
+}
+
+/*
+ * Like glMultiDrawArrays: draw_count draws of the same program and
+ * attributes, each with their own range of vertices. The attributes are
+ * only uploaded once for the whole batch.
+ */
+int
+limare_draw_arrays_multi(struct limare_state *state, int mode,
+			 const int *start, const int *count, int draw_count)
+{
+	int i, ret;
+
+	for (i = 0; i < draw_count; i++) {
+		ret = limare_draw(state, mode, start[i], count[i], NULL, !i);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
 }
 
+/*
+ * Find the lowest and highest index. Buffers get this done once, when
+ * uploaded or committed, client side indices on every draw, so with NEON
+ * we reduce 16 bytes or 8 shorts at a time and only fold the lanes at the
+ * end.
+ */
 static void
 elements_count_byte(unsigned char *indices, int indices_count,
 		    int *start, int *end)
 {
-	int i;
+	int i = 0;
 
-	*start = indices_count;
+	*start = 0x7FFFFFFF;
 	*end = 0;
 
-	for (i = 0; i < indices_count; i++) {
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+	if (indices_count >= 16) {
+		uint8x16_t min = vdupq_n_u8(0xFF), max = vdupq_n_u8(0);
+		uint8x8_t low, high;
+
+		for (; (i + 16) <= indices_count; i += 16) {
+			uint8x16_t v = vld1q_u8(indices + i);
+
+			min = vminq_u8(min, v);
+			max = vmaxq_u8(max, v);
+		}
+
+		low = vpmin_u8(vget_low_u8(min), vget_high_u8(min));
+		low = vpmin_u8(low, low);
+		low = vpmin_u8(low, low);
+		low = vpmin_u8(low, low);
+		high = vpmax_u8(vget_low_u8(max), vget_high_u8(max));
+		high = vpmax_u8(high, high);
+		high = vpmax_u8(high, high);
+		high = vpmax_u8(high, high);
+
+		*start = vget_lane_u8(low, 0);
+		*end = vget_lane_u8(high, 0);
+	}
+#endif
+
+	for (; i < indices_count; i++) {
 		if (indices[i] < *start)
 			*start = indices[i];
 		if (indices[i] > *end)
@@ -1174,12 +2568,36 @@ static void
 elements_count_word(unsigned short *indices, int indices_count,
 		    int *start, int *end)
 {
-	int i;
+	int i = 0;
 
 	*start = 0x7FFFFFFF;
 	*end = 0;
 
-	for (i = 0; i < indices_count; i++) {
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+	if (indices_count >= 8) {
+		uint16x8_t min = vdupq_n_u16(0xFFFF), max = vdupq_n_u16(0);
+		uint16x4_t low, high;
+
+		for (; (i + 8) <= indices_count; i += 8) {
+			uint16x8_t v = vld1q_u16(indices + i);
+
+			min = vminq_u16(min, v);
+			max = vmaxq_u16(max, v);
+		}
+
+		low = vpmin_u16(vget_low_u16(min), vget_high_u16(min));
+		low = vpmin_u16(low, low);
+		low = vpmin_u16(low, low);
+		high = vpmax_u16(vget_low_u16(max), vget_high_u16(max));
+		high = vpmax_u16(high, high);
+		high = vpmax_u16(high, high);
+
+		*start = vget_lane_u16(low, 0);
+		*end = vget_lane_u16(high, 0);
+	}
+#endif
+
+	for (; i < indices_count; i++) {
 		if (indices[i] < *start)
 			*start = indices[i];
 		if (indices[i] > *end)
@@ -1188,10 +2606,9 @@ elements_count_word(unsigned short *indices, int indices_count,
 }
 
 /*
- * TODO: have a quick scan through the elements, and find the lowest and
- * highest indices. Then, only upload these, and limit the vertex count to
- * this. This might significantly reduce the amount of data the vs has to
- * churn through.
+ * TODO: only upload the range of vertices the indices refer to, and limit
+ * the vertex count to this. This might significantly reduce the amount of
+ * data the vs has to churn through.
  */
 int
 limare_draw_elements(struct limare_state *state, int mode, int count,
@@ -1202,6 +2619,11 @@ limare_draw_elements(struct limare_state *state, int mode, int count,
 	int size, start, end;
 	void *address;
 
+	/* the indices are in the recording already. */
+	if (frame && frame->replay)
+		return limare_draw_replay(state, frame, state->program_current,
+					  mode, count, 1);
+
 	if (indices_type == GL_UNSIGNED_BYTE) {
 		size = count;
 		elements_count_byte(indices, count, &start, &end);
@@ -1217,8 +2639,10 @@ limare_draw_elements(struct limare_state *state, int mode, int count,
 	buffer.drawing_mode = mode;
 	buffer.indices_type = indices_type;
 	buffer.count = count;
+	buffer.start = start;
+	buffer.end = end;
 
-	if ((frame->mem_size - frame->mem_used) < (0x40 + ALIGN(size, 0x40))) {
+	if (limare_frame_mem_reserve(frame, 0x40 + ALIGN(size, 0x40))) {
 		printf("%s: no space for indices\n", __func__);
 		return -1;
 	}
@@ -1229,7 +2653,7 @@ limare_draw_elements(struct limare_state *state, int mode, int count,
 
 	memcpy(address, indices, size);
 
-	return limare_draw(state, mode, start, count, &buffer);
+	return limare_draw(state, mode, start, count, &buffer, 1);
 }
 
 int
@@ -1237,19 +2661,9 @@ limare_elements_buffer_upload(struct limare_state *state, int mode, int type,
 			      int count, void *data)
 {
 	struct limare_indices_buffer *buffer;
-	int i, size, start, end;
+	int size, start, end, offset;
 	void *address;
 
-	for (i = 0; i < LIMARE_INDICES_BUFFER_COUNT; i++)
-		if (!state->indices_buffers[i])
-			break;
-
-	if (i == LIMARE_INDICES_BUFFER_COUNT) {
-		printf("%s: all indices buffer slots have been taken!\n",
-		       __func__);
-		return -1;
-	}
-
 	buffer = calloc(1, sizeof(struct limare_indices_buffer));
 	if (!buffer) {
 		printf("%s: Error: failed to allocate indices buffer: %s\n",
@@ -1263,103 +2677,282 @@ limare_elements_buffer_upload(struct limare_state *state, int mode, int type,
 
 	if (type == GL_UNSIGNED_BYTE) {
 		size = count;
-		elements_count_byte(data, count, &start, &end);
+		if (data)
+			elements_count_byte(data, count, &start, &end);
 	} else if (type == GL_UNSIGNED_SHORT) {
 		size = count * 2;
-		elements_count_word(data, count, &start, &end);
+		if (data)
+			elements_count_word(data, count, &start, &end);
 	} else {
 		printf("%s: only bytes and shorts supported.\n", __func__);
+		free(buffer);
 		return -1;
 	}
 
-	buffer->start = start;
+	/* without data, limare_elements_buffer_commit() sets these */
+	buffer->start = data ? start : 0;
+	buffer->end = data ? end : 0;
 
-	if ((state->aux_mem_size - state->aux_mem_used) <
-	    (0x40 + ALIGN(size, 0x40))) {
+	offset = limare_aux_alloc(state, size);
+	if (offset < 0) {
 		printf("%s: no space for indices\n", __func__);
 		free(buffer);
 		return -1;
 	}
 
-	address = state->aux_mem_address + state->aux_mem_used;
-	buffer->mem_physical = state->aux_mem_physical + state->aux_mem_used;
-	state->aux_mem_used += ALIGN(size, 0x40);
+	address = state->aux_mem_address + offset;
+	buffer->mem_offset = offset;
+	buffer->mem_size = ALIGN(size, AUX_MEMORY_ALIGN);
+	buffer->mem_physical = state->aux_mem_physical + offset;
 
-	memcpy(address, data, size);
+	if (data)
+		memcpy(address, data, size);
 
-	buffer->handle = 0x40000000 + state->indices_buffer_handles;
-	state->indices_buffer_handles++;
-
-	state->indices_buffers[i] = buffer;
+	buffer->handle = limare_handle_new(&state->indices_buffers, buffer);
+	if (buffer->handle == -1) {
+		limare_aux_free(state, buffer->mem_offset, buffer->mem_size);
+		free(buffer);
+		return -1;
+	}
 
 	return buffer->handle;
 }
 
+/*
+ * Give the AUX memory of an indices buffer back. Only do this once the
+ * frames which use it are done.
+ */
 int
-limare_draw_elements_buffer(struct limare_state *state, int buffer_handle)
+limare_elements_buffer_free(struct limare_state *state, int handle)
 {
-	struct limare_indices_buffer *buffer;
-	int i;
+	struct limare_indices_buffer *buffer =
+		limare_handle_free(&state->indices_buffers, handle);
 
-	for (i = 0; i < LIMARE_INDICES_BUFFER_COUNT; i++) {
-		if (!state->indices_buffers[i])
-			continue;
+	if (!buffer) {
+		printf("%s: Error: Unable to find indices buffer 0x%08X\n",
+		       __func__, handle);
+		return -1;
+	}
 
-		buffer = state->indices_buffers[i];
-		if (buffer->handle == buffer_handle)
-			break;
+	limare_aux_free(state, buffer->mem_offset, buffer->mem_size);
+	free(buffer);
+
+	return 0;
+}
+
+/*
+ * Like limare_attribute_buffer_map(), for the indices. Once they are
+ * written, limare_elements_buffer_commit() has to rescan them.
+ */
+void *
+limare_elements_buffer_map(struct limare_state *state, int handle)
+{
+	struct limare_indices_buffer *buffer =
+		limare_handle_lookup(&state->indices_buffers, handle);
+
+	if (!buffer) {
+		printf("%s: Error: Unable to find indices buffer 0x%08X\n",
+		       __func__, handle);
+		return NULL;
+	}
+
+	return state->aux_mem_address + buffer->mem_offset;
+}
+
+/* Pick up the index range again, after writing through the map call */
+int
+limare_elements_buffer_commit(struct limare_state *state, int handle)
+{
+	struct limare_indices_buffer *buffer =
+		limare_handle_lookup(&state->indices_buffers, handle);
+	int start, end;
+	void *address;
+
+	if (!buffer) {
+		printf("%s: Error: Unable to find indices buffer 0x%08X\n",
+		       __func__, handle);
+		return -1;
 	}
 
-	if (i == LIMARE_INDICES_BUFFER_COUNT) {
+	address = state->aux_mem_address + buffer->mem_offset;
+
+	if (buffer->indices_type == GL_UNSIGNED_BYTE)
+		elements_count_byte(address, buffer->count, &start, &end);
+	else
+		elements_count_word(address, buffer->count, &start, &end);
+
+	buffer->start = start;
+	buffer->end = end;
+
+	return 0;
+}
+
+int
+limare_draw_elements_buffer(struct limare_state *state, int buffer_handle)
+{
+	struct limare_indices_buffer *buffer =
+		limare_handle_lookup(&state->indices_buffers, buffer_handle);
+
+	if (!buffer) {
 		printf("%s: Error: unable to fine handle 0x%08X\n",
 		       __func__, buffer_handle);
 		return -1;
 	}
 
 	return limare_draw(state, buffer->drawing_mode, buffer->start,
-			   buffer->count, buffer);
+			   buffer->count, buffer, 1);
 }
 
 int
 limare_frame_flush(struct limare_state *state)
 {
 	struct limare_frame *frame = state->frames[state->frame_current];
+	struct limare_rect area;
 
 	if (!frame) {
 		printf("%s: Error: no frame was set up!\n", __func__);
 		return -1;
 	}
 
+	limare_job_phase_end(state, &frame->phase_start,
+			     LIMARE_JOB_STAT_RECORD);
+
 	pthread_mutex_lock(&frame->mutex);
 
-	plbu_commands_finish(frame);
+	if (frame->replay) {
+		if (frame->replay_draw != frame->draw_count) {
+			printf("%s: Error: only %d of the %d recorded draws "
+			       "were replayed\n", __func__, frame->replay_draw,
+			       frame->draw_count);
+			frame->recorded = 0;
+		}
+	} else {
+		if (plbu_commands_finish(frame) ||
+		    command_queues_upload(frame)) {
+			pthread_mutex_unlock(&frame->mutex);
+			return -1;
+		}
+
+		if (state->command_list) {
+			frame->recorded = state->command_list;
+			frame->replay_mem_used = frame->mem_used;
+		}
+	}
 
 	if (frame->mem_used > state->frame_memory_max)
 		state->frame_memory_max = frame->mem_used;
 
-	frame->render_status = 1;
+	/* frames which go to a texture always get all of their tiles. */
+	if (frame->target) {
+		area.x0 = 0;
+		area.y0 = 0;
+		area.x1 = state->width;
+		area.y1 = state->height;
+	} else
+		fb_damage_update(state, &state->fb->damage[frame->index],
+				 frame, &area);
+	frame_plb_damage(state, frame, &area);
+
+	/* nothing runs the frame on a null state, see limare_init_null */
+	frame->render_status = state->jobs ? 1 : 2;
 
 	pthread_mutex_unlock(&frame->mutex);
 
-	limare_render_start(frame);
+	limare_job_phase_end(state, &frame->phase_start, LIMARE_JOB_STAT_FLUSH);
+
+	if (state->jobs)
+		limare_render_start(frame);
+
+	return 0;
+}
+
+/*
+ * Block until the pp is done with the frame that was flushed last.
+ */
+int
+limare_frame_wait(struct limare_state *state)
+{
+	struct limare_frame *frame = state->frames[state->frame_current];
+
+	if (!frame) {
+		printf("%s: Error: no frame was set up!\n", __func__);
+		return -1;
+	}
+
+	pthread_mutex_lock(&frame->mutex);
+
+	if (!frame->render_status) {
+		pthread_mutex_unlock(&frame->mutex);
+		printf("%s: Error: frame %d was not flushed!\n", __func__,
+		       frame->id);
+		return -1;
+	}
+
+	while (frame->render_status != 2)
+		pthread_cond_wait(&frame->cond, &frame->mutex);
+
+	pthread_mutex_unlock(&frame->mutex);
 
 	return 0;
 }
 
+/*
+ * Hand every rendered frame to the callback, for instance to check what
+ * the gpu wrote. This runs on the render thread, so it holds up the
+ * pipeline for as long as it takes.
+ */
+void
+limare_frame_done_callback(struct limare_state *state,
+			   void (*callback)(struct limare_state *state,
+					    struct limare_frame *frame,
+					    const void *pixels, void *data),
+			   void *data)
+{
+	state->frame_done_data = data;
+	state->frame_done = callback;
+}
+
 /*
  * Just run fflush(stdout) to give the wrapper library a chance to finish.
  */
 void
 limare_finish(struct limare_state *state)
 {
-	printf("Max frame memory used: %d/%dkB\n",
-	       state->frame_memory_max / 1024, FRAME_MEMORY_SIZE / 1024);
+	unsigned long long heap = 0;
+	unsigned int heap_jobs = 0, heap_max = 0;
+
+	printf("Max frame memory used: %d/%dkB, tile heap %dkB\n",
+	       state->frame_memory_max / 1024, FRAME_MEMORY_MAX / 1024,
+	       state->tile_heap_size / 1024);
+
+	if (state->plb)
+		printf("PLB: %dx%d blocks of %dx%d tiles, 0x%X bytes each\n",
+		       state->plb->block_w, state->plb->block_h,
+		       1 << state->plb->shift_w, 1 << state->plb->shift_h,
+		       state->plb->block_size);
 
-	printf("Auxiliary memory used: %d/%dkB\n",
-		       state->aux_mem_used / 1024, state->aux_mem_size / 1024);
+	if (!limare_job_heap_bytes(state, &heap, &heap_jobs, &heap_max))
+		printf("Tile heap used: %.1fkB per frame on average, %ukB at "
+		       "most\n", heap / (heap_jobs * 1024.0), heap_max / 1024);
+
+	printf("Auxiliary memory used: %d/%dkB (at most %dkB)\n",
+	       state->aux_mem_used / 1024, state->aux_mem_size / 1024,
+	       state->aux_mem_peak / 1024);
 
 	limare_jobs_end(state);
 
+	/* the verify dumps of the last frames may still be on their way. */
+	bmp_dump_async_flush();
+
+	if (state->plb) {
+		plb_info_destroy(state->plb);
+		state->plb = NULL;
+	}
+
+	limare_aux_fini(state);
+
+	limare_external_unmap(state);
+
 	fflush(stdout);
 	sleep(1);
 }
@@ -1367,16 +2960,7 @@ limare_finish(struct limare_state *state)
 static struct limare_program *
 limare_program_find(struct limare_state *state, int handle)
 {
-	int i;
-
-	for (i = 0; i < LIMARE_PROGRAM_COUNT; i++) {
-		struct limare_program *program = state->programs[i];
-
-		if (program && (program->handle == handle))
-			return program;
-	}
-
-	return NULL;
+	return limare_handle_lookup(&state->programs, handle);
 }
 
 int
@@ -1400,30 +2984,19 @@ int
 limare_program_new(struct limare_state *state)
 {
 	struct limare_program *program;
-	int i;
-
-	for (i = 0; i < LIMARE_PROGRAM_COUNT; i++)
-		if (!state->programs[i])
-			break;
-
-	if (i == LIMARE_PROGRAM_COUNT) {
-		printf("%s: Error: no more program slots available!\n",
-		       __func__);
-		return -1;
-	}
 
-	program = limare_program_create(state->program_mem_address,
-					state->program_mem_physical,
-					i * LIMARE_PROGRAM_SIZE,
-					LIMARE_PROGRAM_SIZE);
+	/* its memory only gets allocated when linking. */
+	program = limare_program_create(NULL, 0, 0, 0);
 	if (!program)
 		return -ENOMEM;
 
-	program->handle = state->program_handles;
-	state->program_handles++;
+	program->handle = limare_handle_new(&state->programs, program);
+	if (program->handle == -1) {
+		free(program);
+		return -1;
+	}
 
 	state->program_current = program;
-	state->programs[i] = program;
 
 	return program->handle;
 }
@@ -1532,6 +3105,37 @@ int
 limare_link(struct limare_state *state)
 {
 	struct limare_program *program = state->program_current;
+	int size, offset;
+
+	program->uniforms_dirty = 1;
+
+	/* vertex shader first, then the fragment shader, 0x40 aligned. */
+	size = ALIGN(program->vertex_shader_size, 0x40) +
+		ALIGN(program->fragment_shader_size, 0x40);
+	if (size > (int) program->mem_size) {
+		offset = limare_aux_alloc(state, size);
+		if (offset < 0) {
+			printf("%s: Error: no space for 0x%X bytes of shaders\n",
+			       __func__, size);
+			return -ENOMEM;
+		}
+
+		/* frames still using the old shaders have to be done. */
+		if (program->mem_size)
+			limare_aux_free_deferred(state, program->mem_physical -
+						 state->aux_mem_physical,
+						 program->mem_size);
+
+		program->mem_address = state->aux_mem_address + offset;
+		program->mem_physical = state->aux_mem_physical + offset;
+		program->mem_size = size;
+	}
+
+	program->vertex_mem_offset = 0;
+	program->vertex_mem_size = ALIGN(program->vertex_shader_size, 0x40);
+	program->fragment_mem_offset = program->vertex_mem_size;
+	program->fragment_mem_size = program->mem_size -
+		program->vertex_mem_size;
 
 	return limare_program_link(program);
 }
@@ -1544,9 +3148,10 @@ limare_depth_buffer_clear_init(struct limare_state *state)
 	struct limare_program *program;
 	unsigned int *shader = mbs_fragment_clear;
 	int shader_size = sizeof(mbs_fragment_clear);
-	int ret;
+	int ret, offset;
 
-	if ((state->aux_mem_size - state->aux_mem_used) < 0x80) {
+	offset = limare_aux_alloc(state, 0x80);
+	if (offset < 0) {
 		printf("%s: no space left!\n", __func__);
 		return -ENOMEM;
 	}
@@ -1554,15 +3159,18 @@ limare_depth_buffer_clear_init(struct limare_state *state)
 	/* waste space for the vertex shader... */
 	program = limare_program_create(state->aux_mem_address,
 					state->aux_mem_physical,
-					state->aux_mem_used, 0x80);
-	if (!program)
+					offset, 0x80);
+	if (!program) {
+		limare_aux_free(state, offset, 0x80);
 		return -ENOMEM;
+	}
 
 	ret = limare_program_fragment_shader_attach_mbs_stream(state, program,
 							       shader,
 							       shader_size);
 	if (ret) {
 		free(program);
+		limare_aux_free(state, offset, 0x80);
 		return ret;
 	}
 
@@ -1574,8 +3182,6 @@ limare_depth_buffer_clear_init(struct limare_state *state)
 
 	state->depth_buffer_clear_program = program;
 
-	state->aux_mem_used += 0x80;
-
 	return 0;
 }
 
@@ -1600,18 +3206,30 @@ limare_depth_buffer_clear(struct limare_state *state)
 	unsigned int indices_physical;
 	int ret;
 
+	/*
+	 * Nothing drawn yet, so the pp can just start its tiles out at our
+	 * depth and we do not need to send any geometry. A replay has to
+	 * follow what happened when its frame got recorded.
+	 */
+	if ((frame->replay && !frame->replay_draw) ||
+	    (!frame->replay && !frame->draw_count)) {
+		frame->clear_depth = state->depth_clear_depth * 0xFFFFFF + 0.5;
+		return 0;
+	}
+
+	/* otherwise draw a full screen quad over what is there already. */
 	if (!state->depth_buffer_clear_program) {
 		ret = limare_depth_buffer_clear_init(state);
 		if (ret)
 			return ret;
 	}
 
-	if (frame->draw_count >= LIMARE_DRAW_COUNT) {
-		printf("%s: Error: too many draws already!\n", __func__);
-		return -1;
-	}
+	if (frame->replay)
+		return limare_draw_replay(state, frame,
+					  state->depth_buffer_clear_program,
+					  LIMA_DRAW_QUAD_DIRECT, 3, 0);
 
-	if ((frame->mem_size - frame->mem_used) < 0x80) {
+	if (limare_frame_mem_reserve(frame, 0x80)) {
 		printf("%s: no space left!\n", __func__);
 		return -ENOMEM;
 	}
@@ -1630,27 +3248,85 @@ limare_depth_buffer_clear(struct limare_state *state)
 	frame->mem_used += 0x80;
 
 	draw = draw_create_new(state, frame, LIMA_DRAW_QUAD_DIRECT, 3, 0, 3);
-	frame->draws[frame->draw_count] = draw;
-	frame->draw_count++;
+	draw->program = state->depth_buffer_clear_program;
+	if (limare_frame_draw_add(frame, draw)) {
+		draw_info_destroy(draw);
+		return -1;
+	}
 
 	plbu_info_attach_indices(draw, GL_UNSIGNED_BYTE, indices_physical);
 
 	draw_render_state_create(frame, state->depth_buffer_clear_program, draw,
 				 &template);
-	plbu_commands_depth_buffer_clear_draw_add(state, frame, draw,
-						  vertices_physical);
 
-	return 0;
+	return plbu_commands_depth_buffer_clear_draw_add(state, frame, draw,
+							 vertices_physical);
+}
+
+/*
+ * For static scenes, where only uniform values change from frame to frame.
+ * From here on, the first frame that gets built in each of the frame slots
+ * is recorded, and the later frames in the same slot replay it: the draw
+ * calls then only write their uniforms into the recorded frame memory,
+ * and the command streams, render states, attributes, indices and textures
+ * are all taken as they were recorded. The draws have to come in the same
+ * order, with the same programs and counts, or the frame fails and gets
+ * recorded again. Calling this again records the scene anew.
+ */
+void
+limare_command_list_begin(struct limare_state *state)
+{
+	state->command_list_count++;
+	if (!state->command_list_count)
+		state->command_list_count++;
+
+	state->command_list = state->command_list_count;
+}
+
+void
+limare_command_list_end(struct limare_state *state)
+{
+	state->command_list = 0;
+}
+
+/*
+ * The fb buffer of the next frame is the one of the frame buffer_count
+ * frames back, which with fewer buffers than frames is not the frame
+ * whose slot gets reused. Wait until that frame is done and off screen,
+ * or queued to be, so that we do not render into what is being shown.
+ */
+static void
+limare_frame_buffer_wait(struct limare_state *state,
+			 struct limare_frame *frame)
+{
+	struct limare_frame *user;
+	int index;
+
+	if (state->render_target)
+		return;
+
+	index = state->frame_count % state->fb->buffer_count;
+	user = state->fb_users[index];
+	if (user && (user != frame)) {
+		pthread_mutex_lock(&user->mutex);
+		while ((user->render_status == 1) || user->flip_pending)
+			pthread_cond_wait(&user->cond, &user->mutex);
+		pthread_mutex_unlock(&user->mutex);
+	}
 }
 
 int
 limare_frame_new(struct limare_state *state)
 {
 	struct limare_frame *frame;
+	struct timespec start;
+
+	limare_job_phase_begin(&start);
 
 	state->frame_current = state->frame_count % FRAME_COUNT;
 
 	frame = state->frames[state->frame_current];
+	limare_frame_buffer_wait(state, frame);
 	if (frame) {
 		/* make sure that we are no longer flushing. */
 		pthread_mutex_lock(&frame->mutex);
@@ -1659,25 +3335,54 @@ limare_frame_new(struct limare_state *state)
 			printf("%s: frame %d render not even started!\n",
 			       __func__, frame->id);
 		} else {
-			while (frame->render_status != 2) {
-				pthread_mutex_unlock(&frame->mutex);
-				sched_yield();
-				pthread_mutex_lock(&frame->mutex);
-			}
+			while ((frame->render_status != 2) ||
+			       frame->flip_pending)
+				pthread_cond_wait(&frame->cond,
+						  &frame->mutex);
 		}
 		pthread_mutex_unlock(&frame->mutex);
 
-		state->frames[state->frame_current] = NULL;
+		if (frame->render_status == 2)
+			limare_aux_retire(state, frame->id);
 
-		limare_frame_destroy(frame);
+		limare_job_phase_end(state, &start, LIMARE_JOB_STAT_FRAME_WAIT);
+
+		if (state->command_list &&
+		    (frame->recorded == state->command_list))
+			limare_frame_replay_reset(state, frame);
+		/* reuse the frame, only its draws and commands change. */
+		else if (limare_frame_reset(state, frame)) {
+			int i;
+
+			for (i = 0; i < FRAME_COUNT; i++)
+				if (state->fb_users[i] == frame)
+					state->fb_users[i] = NULL;
+			state->frames[state->frame_current] = NULL;
+			limare_frame_destroy(frame);
+			return -1;
+		}
+	} else {
+		state->frames[state->frame_current] =
+			limare_frame_create(state,
+					    FRAME_MEMORY_MAX *
+					    state->frame_current,
+					    FRAME_MEMORY_SIZE);
+		if (!state->frames[state->frame_current])
+			return -1;
 	}
 
-	state->frames[state->frame_current] =
-		limare_frame_create(state,
-				    FRAME_MEMORY_SIZE * state->frame_current,
-				    FRAME_MEMORY_SIZE);
-	if (!state->frames[state->frame_current])
-		return -1;
+	state->frames[state->frame_current]->target = state->render_target;
+	if (!state->render_target)
+		state->fb_users[state->frames[state->frame_current]->index] =
+			state->frames[state->frame_current];
+	state->frames[state->frame_current]->clear_depth = 0x00FFFFFF;
+	state->frames[state->frame_current]->damage.x0 = 0;
+	state->frames[state->frame_current]->damage.y0 = 0;
+	state->frames[state->frame_current]->damage.x1 = state->width;
+	state->frames[state->frame_current]->damage.y1 = state->height;
+
+	limare_job_phase_end(state, &start, LIMARE_JOB_STAT_FRAME_NEW);
+	state->frames[state->frame_current]->phase_start = start;
 
 	state->frame_count++;
 
@@ -1977,6 +3682,54 @@ limare_scissor(struct limare_state *state, int x, int y,
 	return 0;
 }
 
+/*
+ * Tells that the current frame only can differ from the clear color in the
+ * given area, in the same coordinates as limare_scissor, which is then
+ * what the draws need to be kept to. The pp renders only the tiles of the
+ * area, and of what the frame that was last rendered to the same buffer
+ * had there, the rest of the buffer already shows the clear color. Frames
+ * without it render the whole screen, or when the clear color changed.
+ */
+int
+limare_damage(struct limare_state *state, int x, int y,
+	      int width, int height)
+{
+	struct limare_frame *frame = state->frames[state->frame_current];
+
+	if (!frame) {
+		printf("%s: Error: no frame was set up!\n", __func__);
+		return -1;
+	}
+
+	if (x < 0) {
+		width += x;
+		x = 0;
+	}
+
+	if (y < 0) {
+		height += y;
+		y = 0;
+	}
+
+	if ((x + width) > state->width)
+		width = state->width - x;
+
+	if ((y + height) > state->height)
+		height = state->height - y;
+
+	if ((width <= 0) || (height <= 0)) {
+		x = y = 0;
+		width = height = 0;
+	}
+
+	frame->damage.x0 = x;
+	frame->damage.y0 = state->height - (y + height);
+	frame->damage.x1 = x + width;
+	frame->damage.y1 = state->height - y;
+
+	return 0;
+}
+
 int
 limare_cullface(struct limare_state *state, int face)
 {
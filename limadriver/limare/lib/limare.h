@@ -33,26 +33,51 @@ struct lima_cmd {
 	unsigned int cmd;
 };
 
+/* in pixels from the top left, x1 and y1 are just outside */
+struct limare_rect {
+	int x0;
+	int y0;
+	int x1;
+	int y1;
+};
+
 struct limare_frame {
 	int id;
 	int index;
 
 	int render_status;
+	/* shown, or queued to be: its fb buffer cannot be rendered to, see
+	 * limare_frame_buffer_wait() */
+	int flip_pending;
 
 	struct limare_state *state;
 	pthread_mutex_t mutex;
+	/* signalled when the render_status turns 2 (frame done), and when
+	 * the flip_pending is cleared. */
+	pthread_cond_t cond;
 
 	unsigned int mem_physical;
 	int mem_size;
 	int mem_used;
 	void *mem_address;
+	/* the plb and pp areas at the start, which are kept between frames */
+	int mem_static_size;
 
 	unsigned int tile_heap_offset;
 	int tile_heap_size;
+	/* handed to the plbu when it ran out of the above, see jobs.c */
+	int tile_heap_grown;
+	/* what the last gp job of this frame used, 0 when not known */
+	int tile_heap_used;
+
+	/* when the current cpu phase of the frame began, see jobs.c */
+	struct timespec phase_start;
 
+	/* grows as needed, starting out at LIMARE_DRAW_COUNT */
 #define LIMARE_DRAW_COUNT 512
-	struct draw_info *draws[LIMARE_DRAW_COUNT];
+	struct draw_info **draws;
 	int draw_count;
+	int draw_size;
 
 	/* locations of our plb buffers and pointers in our frame memory */
 	/* holds the actual polygons */
@@ -61,9 +86,39 @@ struct limare_frame {
 	int plb_plbu_offset;
 	/* holds the coordinates and addresses of the polygons for the PP */
 	int plb_pp_offset[LIMA_PP_CORE_MAX];
+	/* the pp streams only hold some of the tiles, see frame_plb_damage */
+	int plb_pp_damaged;
+
+	/*
+	 * Where this frame can differ from its clear color, all of the
+	 * screen unless limare_damage was told less.
+	 */
+	struct limare_rect damage;
 
 	struct pp_info *pp;
 
+	/* texture the pp writes to instead of the fb, see limare_render_target */
+	struct limare_texture *target;
+
+	/*
+	 * 24bit depth the pp fills its tiles with before the first draw, set
+	 * by limare_depth_buffer_clear when nothing was drawn yet.
+	 */
+	unsigned int clear_depth;
+
+	/*
+	 * The command list this frame holds the recording of, 0 for none,
+	 * whether it is being replayed, and the next draw to replay.
+	 */
+	int recorded;
+	int replay;
+	int replay_draw;
+	int replay_mem_used;
+
+	/*
+	 * The command queues live in normal memory while the frame is built,
+	 * the physical addresses become valid when the frame gets flushed.
+	 */
 	struct lima_cmd *vs_commands;
 	int vs_commands_physical;
 	int vs_commands_count;
@@ -100,6 +155,7 @@ struct limare_attribute_buffer {
 
 	/* in AUX space */
 	int mem_offset;
+	int mem_size;
 	unsigned int mem_physical;
 };
 
@@ -109,13 +165,46 @@ struct limare_indices_buffer {
 	int drawing_mode;
 	int indices_type;
 	int count;
+	/* lowest and highest index, scanned once */
 	int start;
+	int end;
 
+	/* in AUX space */
+	int mem_offset;
+	int mem_size;
 	unsigned int mem_physical;
 };
 
 #define FRAME_COUNT 3
 
+/*
+ * Handles are the slot in their table, the generation of that slot, and
+ * above that the kind of object. The sign bit stays clear, as callers
+ * take a negative handle for an error. See handle.c.
+ */
+#define LIMARE_HANDLE_TYPE_MASK		0x30000000
+#define LIMARE_HANDLE_TYPE_PROGRAM	0x00000000
+#define LIMARE_HANDLE_TYPE_INDICES	0x10000000
+#define LIMARE_HANDLE_TYPE_ATTRIBUTE	0x20000000
+#define LIMARE_HANDLE_TYPE_TEXTURE	0x30000000
+#define LIMARE_HANDLE_SLOT_BITS		16
+#define LIMARE_HANDLE_SLOT_MAX		(1 << LIMARE_HANDLE_SLOT_BITS)
+#define LIMARE_HANDLE_GENERATION_MASK	0x0FFF
+
+struct limare_handle_table {
+	unsigned int type;
+
+	void **objects;
+	unsigned short *generations;
+	int size;
+	/* slots handed out so far, in use or in the free list */
+	int used;
+	int count;
+
+	int *free_slots;
+	int free_count;
+};
+
 struct limare_state {
 	int fd;
 	int kernel_version;
@@ -125,7 +214,23 @@ struct limare_state {
 	int type;
 	int pp_core_count;
 
+	/* how the tiles are distributed over the pp cores */
+#define LIMARE_PP_SPLIT_INTERLEAVED	0
+#define LIMARE_PP_SPLIT_HILBERT		1
+	int pp_split;
+
+	/*
+	 * How the plb blocks are laid out, see limare_plb_layout: the log2 of
+	 * the tiles a block spans, -1 to have them picked from the size, and
+	 * the bytes of polygon list each block starts out with, 0 for 0x200.
+	 */
+	int plb_shift_w;
+	int plb_shift_h;
+	int plb_block_size;
+
 	unsigned int mem_base;
+	/* of the mali address space, as MALI_IOC_MEM_INIT reports it */
+	unsigned int mem_size;
 
 	int width;
 	int height;
@@ -174,45 +279,68 @@ struct limare_state {
 	int frame_count;
 	int frame_current;
 	int frame_memory_max;
+	/* that the next frame gets, follows the tile_heap_used of frames */
+	int tile_heap_size;
+
+	/* see limare_command_list_begin, 0 when not recording */
+	int command_list;
+	int command_list_count;
 	struct limare_frame *frames[FRAME_COUNT];
+	/* the frame which last rendered to each fb buffer, there are never
+	 * more buffers than frames */
+	struct limare_frame *fb_users[FRAME_COUNT];
 
+	/* address space for all frames, each only maps what it needs */
 	void *frame_mem_address;
 	unsigned int frame_mem_physical;
 	int frame_mem_size;
 
-#define LIMARE_PROGRAM_COUNT 16
-#define LIMARE_PROGRAM_SIZE 0x1000
-	void *program_mem_address;
-	unsigned int program_mem_physical;
-	int program_mem_size;
-
-	struct limare_program *programs[LIMARE_PROGRAM_COUNT];
+	/* the shaders get linked into AUX memory, each taking what it needs */
+	struct limare_handle_table programs;
 	struct limare_program *program_current;
-	int program_handles;
 
 	struct limare_program *depth_buffer_clear_program;
 
-	/* space used for vertex buffers and textures */
+	/* space used for vertex buffers and textures, see aux.c */
 	void *aux_mem_address;
 	unsigned int aux_mem_physical;
 	int aux_mem_size;
 	int aux_mem_used;
-
-#define LIMARE_TEXTURE_COUNT 512
-	struct limare_texture *textures[LIMARE_TEXTURE_COUNT];
-	int texture_handles;
-
-#define LIMARE_ATTRIBUTE_BUFFER_COUNT 16
-	struct limare_attribute_buffer *
-		attribute_buffers[LIMARE_ATTRIBUTE_BUFFER_COUNT];
-	int attribute_buffer_handles;
-
-#define LIMARE_INDICES_BUFFER_COUNT 4
-	struct limare_indices_buffer *
-	indices_buffers[LIMARE_INDICES_BUFFER_COUNT];
-	int indices_buffer_handles;
+	int aux_mem_peak;
+	struct limare_aux_range *aux_free;
+	/* freed, but possibly still read by frames in flight */
+	struct limare_aux_range *aux_deferred;
+
+	struct limare_handle_table textures;
+	struct limare_handle_table attribute_buffers;
+	struct limare_handle_table indices_buffers;
+
+	/* memory from outside of mali, see limare_external_map */
+#define LIMARE_EXTERNAL_COUNT 64
+	unsigned int *external_cookies;
+	int external_count;
+	int external_size;
+	int external_mem_used;
 
 	struct limare_fb *fb;
+	/* picked up by the next limare_frame_new, NULL renders to the fb */
+	struct limare_texture *render_target;
+
+	/* job submission and the render threads, see jobs.c */
+	struct limare_jobs *jobs;
+
+	/* simplistic benchmarking. */
+	struct timespec framerate_start;
+	struct timespec framerate_time;
+
+	/*
+	 * Called from the render thread once the pp is done with a frame,
+	 * before the next frame gets rendered into the same buffer.
+	 */
+	void (*frame_done)(struct limare_state *state,
+			   struct limare_frame *frame, const void *pixels,
+			   void *data);
+	void *frame_done_data;
 };
 
 /*
@@ -226,7 +354,14 @@ struct limare_state {
 
 /* from limare.c */
 struct limare_state *limare_init(void);
-
+struct limare_state *limare_init_null(int type, int pp_core_count);
+
+int limare_pp_split(struct limare_state *state, int split);
+int limare_plb_layout(struct limare_state *state, int block_w, int block_h,
+		      int block_size);
+int limare_offscreen(struct limare_state *state, int width, int height,
+		     int bpp);
+int limare_aux_grow(struct limare_state *state, int size);
 int limare_state_setup(struct limare_state *state, int width, int height,
 			unsigned int clear_color);
 
@@ -249,39 +384,101 @@ int limare_link(struct limare_state *state);
 
 int limare_texture_upload(struct limare_state *state, const void *pixels,
 			  int width, int height, int format, int mipmap);
+int limare_texture_upload_file(struct limare_state *state,
+			       const char *filename, int mipmap,
+			       int *width, int *height);
+int limare_texel_format_parse(const char *name);
+int limare_texel_format_bits(int format);
+void *limare_texels_convert(const void *rgba, int width, int height,
+			    int format);
 int limare_texture_mipmap_upload(struct limare_state *state, int handle,
 				 int level, const void *pixels);
+int limare_texture_sub_upload(struct limare_state *state, int handle,
+			      int x, int y, int width, int height,
+			      const void *pixels);
+int limare_texture_free(struct limare_state *state, int handle);
 int limare_texture_parameters(struct limare_state *state, int handle,
 			      int filter_mag, int filter_min,
 			      int wrap_s, int wrap_t);
 int limare_texture_attach(struct limare_state *state, char *uniform_name,
 			  int texture_handle);
+int limare_texture_attach_location(struct limare_state *state, int location,
+				   int texture_handle);
+int limare_render_target(struct limare_state *state, int texture_handle);
+
+unsigned int limare_external_map(struct limare_state *state,
+				 unsigned int physical, int size);
+int limare_texture_external(struct limare_state *state, void *address,
+			    unsigned int mali_address, int width, int height,
+			    int format);
+
+void *limare_spare_map(struct limare_state *state, int size);
+
+/*
+ * Locations are resolved once after limare_link, and then spare the draw
+ * loop the name lookups of the string based calls.
+ */
+int limare_uniform_location(struct limare_state *state, const char *name);
+int limare_attribute_location(struct limare_state *state, const char *name);
 
 int limare_uniform_attach(struct limare_state *state, char *name,
 			  int count, float *data);
+int limare_uniform_attach_location(struct limare_state *state, int location,
+				   int count, float *data);
 int limare_attribute_pointer(struct limare_state *state, char *name,
 			     enum limare_attrib_type type, int component_count,
 			     int entry_stride, int entry_count, void *data);
+int limare_attribute_pointer_location(struct limare_state *state, int location,
+				      enum limare_attrib_type type,
+				      int component_count, int entry_stride,
+				      int entry_count, void *data);
 int limare_attribute_buffer_upload(struct limare_state *state,
 				   enum limare_attrib_type type,
 				   int component_count, int entry_stride,
 				   int entry_count, void *data);
 int limare_attribute_buffer_attach(struct limare_state *state, char *name,
 				   int buffer_handle);
+int limare_attribute_buffer_attach_location(struct limare_state *state,
+					    int location, int buffer_handle);
+int limare_attribute_buffer_free(struct limare_state *state, int handle);
+void *limare_attribute_buffer_map(struct limare_state *state, int handle);
+
+int limare_attrib_type_parse(const char *name);
+int limare_attrib_stride(enum limare_attrib_type type, int component_count);
+int limare_attrib_pack(enum limare_attrib_type type, int component_count,
+		       int entry_count, const float *src, void *dst);
+int limare_attribute_buffer_upload_float(struct limare_state *state,
+					 enum limare_attrib_type type,
+					 int component_count, int entry_count,
+					 const float *data);
 
 int limare_elements_buffer_upload(struct limare_state *state, int mode,
 				  int type, int count, void *data);
+int limare_elements_buffer_free(struct limare_state *state, int handle);
+void *limare_elements_buffer_map(struct limare_state *state, int handle);
+int limare_elements_buffer_commit(struct limare_state *state, int handle);
 
 int limare_draw_arrays(struct limare_state *state, int mode,
 		       int vertex_start, int vertex_count);
+int limare_draw_arrays_multi(struct limare_state *state, int mode,
+			     const int *start, const int *count,
+			     int draw_count);
 int limare_draw_elements(struct limare_state *state, int mode, int count,
 			 void *indices, int indices_type);
 int limare_draw_elements_buffer(struct limare_state *state, int buffer_handle);
 
 int limare_depth_buffer_clear(struct limare_state *state);
 
+struct limare_frame *limare_frame_create(struct limare_state *state,
+					 int offset, int size);
+void limare_frame_destroy(struct limare_frame *frame);
 int limare_frame_new(struct limare_state *state);
 int limare_frame_flush(struct limare_state *state);
+int limare_frame_wait(struct limare_state *state);
+int limare_frame_mem_reserve(struct limare_frame *frame, int size);
+
+void limare_command_list_begin(struct limare_state *state);
+void limare_command_list_end(struct limare_state *state);
 
 void limare_buffer_clear(struct limare_state *state);
 void limare_buffer_swap(struct limare_state *state);
@@ -289,6 +486,61 @@ void limare_buffer_size(struct limare_state *state, int *width, int *height);
 
 void limare_finish(struct limare_state *state);
 
+/*
+ * Timing of the jobs going through the render threads, in microseconds.
+ * The histogram buckets are powers of two: bucket i counts the entries
+ * from 2^i up to 2^(i+1).
+ */
+#define LIMARE_JOB_HISTOGRAM_SIZE 24
+
+struct limare_job_histogram {
+	unsigned int count;
+	long long total;
+	long long min;
+	long long max;
+	unsigned int buckets[LIMARE_JOB_HISTOGRAM_SIZE];
+};
+
+enum limare_job_stat {
+	LIMARE_JOB_STAT_GP = 0,	/* gp job start until done */
+	LIMARE_JOB_STAT_PP,	/* pp job start until done */
+	LIMARE_JOB_STAT_QUEUE,	/* frame flushed until its gp job starts */
+	LIMARE_JOB_STAT_FLIP,	/* pp done until the frame got flipped */
+	LIMARE_JOB_STAT_PP_IDLE, /* pp thread waiting for the next frame */
+	/* the cpu side of a frame, from limare_frame_new until it is flushed */
+	LIMARE_JOB_STAT_FRAME_WAIT, /* for the gpu to hand back the frame */
+	LIMARE_JOB_STAT_FRAME_NEW, /* resetting or creating the frame */
+	LIMARE_JOB_STAT_RECORD,	/* the draws, until limare_frame_flush */
+	LIMARE_JOB_STAT_FLUSH,	/* finishing and uploading the commands */
+	LIMARE_JOB_STAT_COUNT,
+};
+
+struct limare_job_stats {
+	struct limare_job_histogram histograms[LIMARE_JOB_STAT_COUNT];
+	double time; /* in seconds, that these stats cover */
+};
+
+int limare_job_stats_get(struct limare_state *state,
+			 struct limare_job_stats *stats, int reset);
+long long
+limare_job_histogram_percentile(const struct limare_job_histogram *histogram,
+				double fraction);
+void limare_job_stats_print(const char *name,
+			    const struct limare_job_stats *stats);
+
+void limare_job_counters_enable(struct limare_state *state, int enable);
+int limare_job_bus_bytes(struct limare_state *state,
+			 unsigned long long *read, unsigned long long *write);
+int limare_job_heap_bytes(struct limare_state *state, unsigned long long *bytes,
+			  unsigned int *jobs_count, unsigned int *max);
+
+void limare_frame_done_callback(struct limare_state *state,
+				void (*callback)(struct limare_state *state,
+						 struct limare_frame *frame,
+						 const void *pixels,
+						 void *data),
+				void *data);
+
 int limare_enable(struct limare_state *state, int parameter);
 int limare_disable(struct limare_state *state, int parameter);
 int limare_depth_func(struct limare_state *state, int value);
@@ -299,6 +551,8 @@ int limare_viewport(struct limare_state *state, int x, int y,
 		    int width, int height);
 int limare_scissor(struct limare_state *state, int x, int y,
 		   int width, int height);
+int limare_damage(struct limare_state *state, int x, int y,
+		  int width, int height);
 int limare_cullface(struct limare_state *state, int face);
 int limare_frontface(struct limare_state *state, int face);
 int limare_polygon_offset(struct limare_state *state,
@@ -308,4 +562,16 @@ int limare_depth_clear_depth(struct limare_state *state, float depth);
 int limare_color_mask(struct limare_state *state,
 		      int red, int green, int blue, int alpha);
 
+/* from mesh.c */
+int limare_mesh_optimize(unsigned short *indices, int count, int vertex_count,
+			 int cache_size);
+int limare_mesh_vertices_order(unsigned short *indices, int count,
+			       int vertex_count, int *remap);
+int limare_mesh_vertices_remap(void *data, int stride, int vertex_count,
+			       const int *remap);
+void limare_mesh_shuffle(unsigned short *indices, int count,
+			 unsigned int seed);
+double limare_mesh_acmr(const unsigned short *indices, int count,
+			int vertex_count, int cache_size);
+
 #endif /* LIMARE_LIMARE_H */
@@ -0,0 +1,353 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Reordering of indexed triangle meshes, for the post transform vertex
+ * cache and for the vertex fetch.
+ *
+ * limare_mesh_optimize orders the triangles with Tipsify, from "Fast
+ * Triangle Reordering for Vertex Locality and Reduced Overdraw" by Sander,
+ * Nehab and Barczak: it fans out around one vertex at a time, and then
+ * moves on to whichever vertex of the last triangles is still in the cache
+ * and will not have dropped out of it by the time its own triangles are
+ * done, so it runs in linear time. limare_mesh_vertices_order then numbers
+ * the vertices in the order in which the triangles first use them, so the
+ * vertex fetch walks through the attribute buffers front to back.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "limare.h"
+
+/* Tipsify state, per vertex unless noted otherwise. */
+struct mesh_tipsify {
+	const unsigned short *indices;
+	int triangle_count;
+	int vertex_count;
+	int cache_size;
+
+	/* triangles left which use the vertex */
+	int *live;
+	/* when it went into the cache */
+	int *time;
+	/* the triangles using each vertex, from offsets[v] to offsets[v + 1] */
+	int *offsets;
+	int *triangles;
+	/* per triangle */
+	unsigned char *emitted;
+
+	/* vertices of the last emitted triangles, as a stack */
+	int *dead_end;
+	int dead_end_count;
+
+	int now;
+	int cursor;
+};
+
+static void
+mesh_tipsify_free(struct mesh_tipsify *tipsify)
+{
+	free(tipsify->live);
+	free(tipsify->time);
+	free(tipsify->offsets);
+	free(tipsify->triangles);
+	free(tipsify->emitted);
+	free(tipsify->dead_end);
+}
+
+static int
+mesh_tipsify_init(struct mesh_tipsify *tipsify,
+		  const unsigned short *indices, int count, int vertex_count,
+		  int cache_size)
+{
+	int i;
+
+	memset(tipsify, 0, sizeof(struct mesh_tipsify));
+
+	tipsify->indices = indices;
+	tipsify->triangle_count = count / 3;
+	tipsify->vertex_count = vertex_count;
+	tipsify->cache_size = cache_size;
+
+	tipsify->live = calloc(vertex_count, sizeof(int));
+	tipsify->time = calloc(vertex_count, sizeof(int));
+	tipsify->offsets = calloc(vertex_count + 1, sizeof(int));
+	tipsify->triangles = calloc(3 * tipsify->triangle_count, sizeof(int));
+	tipsify->emitted = calloc(tipsify->triangle_count, 1);
+	tipsify->dead_end = calloc(3 * tipsify->triangle_count, sizeof(int));
+	if (!tipsify->live || !tipsify->time || !tipsify->offsets ||
+	    !tipsify->triangles || !tipsify->emitted || !tipsify->dead_end) {
+		mesh_tipsify_free(tipsify);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < (3 * tipsify->triangle_count); i++)
+		tipsify->live[indices[i]]++;
+
+	for (i = 0; i < vertex_count; i++)
+		tipsify->offsets[i + 1] = tipsify->offsets[i] +
+			tipsify->live[i];
+
+	/*
+	 * Fill in back to front, which leaves the start of each vertex in the
+	 * offset after it, so shift them down again.
+	 */
+	for (i = (3 * tipsify->triangle_count) - 1; i >= 0; i--)
+		tipsify->triangles[--tipsify->offsets[indices[i] + 1]] = i / 3;
+	for (i = 0; i < vertex_count; i++)
+		tipsify->offsets[i] = tipsify->offsets[i + 1];
+	tipsify->offsets[vertex_count] = 3 * tipsify->triangle_count;
+
+	tipsify->now = cache_size + 1;
+
+	return 0;
+}
+
+static int
+mesh_tipsify_dead_end(struct mesh_tipsify *tipsify)
+{
+	while (tipsify->dead_end_count) {
+		int vertex = tipsify->dead_end[--tipsify->dead_end_count];
+
+		if (tipsify->live[vertex])
+			return vertex;
+	}
+
+	for (; tipsify->cursor < tipsify->vertex_count; tipsify->cursor++)
+		if (tipsify->live[tipsify->cursor])
+			return tipsify->cursor;
+
+	return -1;
+}
+
+/*
+ * The vertex of the candidates which went into the cache the longest ago,
+ * of the ones which stay in it while all their triangles get emitted.
+ */
+static int
+mesh_tipsify_next(struct mesh_tipsify *tipsify, const int *candidates,
+		  int count)
+{
+	int i, best = -1, best_priority = -1;
+
+	for (i = 0; i < count; i++) {
+		int vertex = candidates[i];
+		int priority = 0;
+
+		if (!tipsify->live[vertex])
+			continue;
+
+		if ((tipsify->now - tipsify->time[vertex] +
+		     2 * tipsify->live[vertex]) <= tipsify->cache_size)
+			priority = tipsify->now - tipsify->time[vertex];
+
+		if (priority > best_priority) {
+			best_priority = priority;
+			best = vertex;
+		}
+	}
+
+	if (best == -1)
+		best = mesh_tipsify_dead_end(tipsify);
+
+	return best;
+}
+
+/*
+ * Reorder the triangles of a GL_TRIANGLES mesh for a post transform vertex
+ * cache of cache_size entries, in place. The vertices stay as they are.
+ */
+int
+limare_mesh_optimize(unsigned short *indices, int count, int vertex_count,
+		     int cache_size)
+{
+	struct mesh_tipsify tipsify;
+	unsigned short *result;
+	int *candidates;
+	int fan, out = 0, ret;
+
+	count -= count % 3;
+	if (!count)
+		return 0;
+
+	ret = mesh_tipsify_init(&tipsify, indices, count, vertex_count,
+				cache_size);
+	if (ret)
+		return ret;
+
+	result = malloc(count * sizeof(unsigned short));
+	candidates = malloc(3 * tipsify.triangle_count * sizeof(int));
+	if (!result || !candidates) {
+		free(result);
+		free(candidates);
+		mesh_tipsify_free(&tipsify);
+		return -ENOMEM;
+	}
+
+	fan = mesh_tipsify_dead_end(&tipsify);
+	while (fan >= 0) {
+		int i, candidate_count = 0;
+
+		for (i = tipsify.offsets[fan]; i < tipsify.offsets[fan + 1];
+		     i++) {
+			int triangle = tipsify.triangles[i];
+			int j;
+
+			if (tipsify.emitted[triangle])
+				continue;
+			tipsify.emitted[triangle] = 1;
+
+			for (j = 0; j < 3; j++) {
+				int vertex = indices[3 * triangle + j];
+
+				result[out++] = vertex;
+
+				tipsify.dead_end[tipsify.dead_end_count++] =
+					vertex;
+				candidates[candidate_count++] = vertex;
+				tipsify.live[vertex]--;
+
+				if ((tipsify.now - tipsify.time[vertex]) >
+				    cache_size)
+					tipsify.time[vertex] = tipsify.now++;
+			}
+		}
+
+		fan = mesh_tipsify_next(&tipsify, candidates, candidate_count);
+	}
+
+	memcpy(indices, result, count * sizeof(unsigned short));
+
+	free(result);
+	free(candidates);
+	mesh_tipsify_free(&tipsify);
+
+	return 0;
+}
+
+/*
+ * Number the vertices in the order of their first use, and rewrite the
+ * indices to match. remap[old] gives the new index, the vertices which no
+ * triangle uses go at the end. Returns how many vertices are used.
+ */
+int
+limare_mesh_vertices_order(unsigned short *indices, int count,
+			   int vertex_count, int *remap)
+{
+	int i, next = 0;
+
+	for (i = 0; i < vertex_count; i++)
+		remap[i] = -1;
+
+	for (i = 0; i < count; i++) {
+		if (remap[indices[i]] == -1)
+			remap[indices[i]] = next++;
+		indices[i] = remap[indices[i]];
+	}
+
+	count = next;
+	for (i = 0; i < vertex_count; i++)
+		if (remap[i] == -1)
+			remap[i] = next++;
+
+	return count;
+}
+
+/*
+ * Move the vertices of an attribute array around as the remap of
+ * limare_mesh_vertices_order says, stride being the bytes per vertex.
+ */
+int
+limare_mesh_vertices_remap(void *data, int stride, int vertex_count,
+			   const int *remap)
+{
+	unsigned char *copy = malloc(stride * vertex_count);
+	int i;
+
+	if (!copy)
+		return -ENOMEM;
+
+	memcpy(copy, data, stride * vertex_count);
+	for (i = 0; i < vertex_count; i++)
+		memcpy((unsigned char *) data + remap[i] * stride,
+		       copy + i * stride, stride);
+
+	free(copy);
+
+	return 0;
+}
+
+/*
+ * Shuffle the triangles, as the worst case for the vertex cache. seed is
+ * for rand_r, so that runs can be repeated.
+ */
+void
+limare_mesh_shuffle(unsigned short *indices, int count, unsigned int seed)
+{
+	int i, triangle_count = count / 3;
+
+	for (i = triangle_count - 1; i > 0; i--) {
+		int j = rand_r(&seed) % (i + 1);
+		unsigned short tmp[3];
+
+		memcpy(tmp, indices + 3 * i, sizeof(tmp));
+		memcpy(indices + 3 * i, indices + 3 * j, sizeof(tmp));
+		memcpy(indices + 3 * j, tmp, sizeof(tmp));
+	}
+}
+
+/*
+ * Vertices the vs has to shade per triangle with a fifo cache of
+ * cache_size entries, 3.0 being the worst and about 0.5 the best that a
+ * regular grid can get.
+ */
+double
+limare_mesh_acmr(const unsigned short *indices, int count, int vertex_count,
+		 int cache_size)
+{
+	int *time = malloc(vertex_count * sizeof(int));
+	int i, misses = 0;
+
+	if (!time || (count < 3)) {
+		free(time);
+		return 0.0;
+	}
+
+	for (i = 0; i < vertex_count; i++)
+		time[i] = -cache_size - 1;
+
+	/* time counts the misses, which is when the fifo moves */
+	for (i = 0; i < count; i++) {
+		if ((misses - time[indices[i]]) > cache_size) {
+			time[indices[i]] = misses;
+			misses++;
+		}
+	}
+
+	free(time);
+
+	return (double) misses / (count / 3);
+}
@@ -27,6 +27,8 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "limare.h"
 #include "plb.h"
@@ -84,7 +86,7 @@ plb_pp_template_create(struct limare_state *state, struct plb_info *plb)
 	struct pp_pattern *pattern;
 	unsigned int *stream;
 	int size = plb->tiled_w * plb->tiled_h;
-	int max, dim, count, i, index, core;
+	int max, dim, count, i, index, core, start, step;
 
 	pattern = calloc(size, sizeof(struct pp_pattern));
 
@@ -113,11 +115,31 @@ plb_pp_template_create(struct limare_state *state, struct plb_info *plb)
 		}
 	}
 
-	plb->pp_size = size / state->pp_core_count;
-	for (core = 0; core < state->pp_core_count; core++) {
-		stream = calloc(plb->pp_size, 4 * sizeof(unsigned int));
+	/*
+	 * Hand every core the same number of tiles, give or take one, so
+	 * that all cores finish at about the same time. Interleaving deals
+	 * alternating tiles along the curve, so every core sees every part
+	 * of the screen; the hilbert split gives each core a contiguous
+	 * stretch of the curve, which keeps each core on a compact area of
+	 * the plb and the framebuffer.
+	 */
+	for (core = 0, start = 0; core < state->pp_core_count; core++) {
+		plb->pp_size[core] = size / state->pp_core_count;
+		if (core < (size % state->pp_core_count))
+			plb->pp_size[core]++;
+
+		stream = calloc(plb->pp_size[core] + 1,
+				4 * sizeof(unsigned int));
+
+		if (state->pp_split == LIMARE_PP_SPLIT_HILBERT) {
+			i = start;
+			step = 1;
+		} else {
+			i = core;
+			step = state->pp_core_count;
+		}
 
-		for (i = core, index = 0; i < size; i += state->pp_core_count) {
+		for (index = 0; index < 4 * plb->pp_size[core]; i += step) {
 			stream[index + 0] = 0;
 			stream[index + 1] = 0xB8000000 |
 				pattern[i].x | (pattern[i].y << 8);
@@ -128,17 +150,97 @@ plb_pp_template_create(struct limare_state *state, struct plb_info *plb)
 			index += 4;
 		}
 
+		stream[index + 0] = 0;
+		stream[index + 1] = 0xBC000000;
+
 		plb->pp_template[core] = stream;
+		start += plb->pp_size[core];
 	}
+
+	free(pattern);
 }
 
+static void
+plb_plbu_template_create(struct plb_info *plb)
+{
+	int i, size = plb->block_w * plb->block_h;
+
+	plb->plbu_template = calloc(size, sizeof(unsigned int));
+
+	for (i = 0; i < size; i++)
+		plb->plbu_template[i] = i * plb->block_size;
+}
+
+/*
+ * The plb info only depends on the resolution, the mali type and the
+ * number of pp cores, so states with the same setup share a single one,
+ * with its pre-generated streams.
+ */
+#define PLB_INFO_CACHE_SIZE 4
+
+static pthread_mutex_t plb_info_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct plb_info *plb_info_cache[PLB_INFO_CACHE_SIZE];
+
+static struct plb_info *plb_info_new(struct limare_state *state);
+
 struct plb_info *
 plb_info_create(struct limare_state *state)
+{
+	struct plb_info *plb = NULL;
+	int i;
+
+	pthread_mutex_lock(&plb_info_cache_mutex);
+
+	for (i = 0; i < PLB_INFO_CACHE_SIZE; i++) {
+		struct plb_info *cached = plb_info_cache[i];
+
+		if (cached && (cached->width == state->width) &&
+		    (cached->height == state->height) &&
+		    (cached->type == state->type) &&
+		    (cached->pp_core_count == state->pp_core_count) &&
+		    (cached->pp_split == state->pp_split) &&
+		    (cached->layout_shift_w == state->plb_shift_w) &&
+		    (cached->layout_shift_h == state->plb_shift_h) &&
+		    (cached->layout_block_size == state->plb_block_size)) {
+			plb = cached;
+			plb->refcount++;
+			break;
+		}
+	}
+
+	if (!plb) {
+		plb = plb_info_new(state);
+
+		for (i = 0; plb && (i < PLB_INFO_CACHE_SIZE); i++) {
+			if (!plb_info_cache[i]) {
+				plb_info_cache[i] = plb;
+				break;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&plb_info_cache_mutex);
+
+	return plb;
+}
+
+static struct plb_info *
+plb_info_new(struct limare_state *state)
 {
 	struct plb_info *plb = calloc(1, sizeof(struct plb_info));
 	int width, height, limit;
 	int max;
 
+	plb->width = state->width;
+	plb->height = state->height;
+	plb->type = state->type;
+	plb->pp_core_count = state->pp_core_count;
+	plb->pp_split = state->pp_split;
+	plb->layout_shift_w = state->plb_shift_w;
+	plb->layout_shift_h = state->plb_shift_h;
+	plb->layout_block_size = state->plb_block_size;
+	plb->refcount = 1;
+
 	width = ALIGN(state->width, 16) >> 4;
 	height = ALIGN(state->height, 16) >> 4;
 
@@ -155,17 +257,41 @@ plb_info_create(struct limare_state *state)
 	else
 		limit = 250;
 
+	/* a given block dimension is kept, only the others get grown. */
+	if (state->plb_shift_w >= 0) {
+		plb->shift_w = state->plb_shift_w;
+		width = (width + (1 << plb->shift_w) - 1) >> plb->shift_w;
+	}
+	if (state->plb_shift_h >= 0) {
+		plb->shift_h = state->plb_shift_h;
+		height = (height + (1 << plb->shift_h) - 1) >> plb->shift_h;
+	}
+
 	while ((width * height) > limit) {
-		if (width >= height) {
+		if ((state->plb_shift_w < 0) &&
+		    ((width >= height) || (state->plb_shift_h >= 0))) {
 			width = (width + 1) >> 1;
 			plb->shift_w++;
-		} else {
+		} else if (state->plb_shift_h < 0) {
 			height = (height + 1) >> 1;
 			plb->shift_h++;
-		}
+		} else
+			break;
+	}
+
+	if ((width * height) > ((state->type == LIMARE_TYPE_M400) ?
+				512 : 300)) {
+		printf("%s: Error: %dx%d plb blocks of %dx%d tiles are more "
+		       "than the plbu can handle\n", __func__, width, height,
+		       1 << plb->shift_w, 1 << plb->shift_h);
+		free(plb);
+		return NULL;
 	}
 
-	plb->block_size = 0x200;
+	if (state->plb_block_size)
+		plb->block_size = state->plb_block_size;
+	else
+		plb->block_size = 0x200;
 
 	plb->block_w = width;
 	plb->block_h = height;
@@ -194,6 +320,7 @@ plb_info_create(struct limare_state *state)
 		/* fixed size on mali200 */
 		plb->plbu_size = 4 * 300;
 
+	plb_plbu_template_create(plb);
 	plb_pp_template_create(state, plb);
 
 	return plb;
@@ -202,6 +329,25 @@ plb_info_create(struct limare_state *state)
 void
 plb_info_destroy(struct plb_info *plb)
 {
+	int i;
+
+	pthread_mutex_lock(&plb_info_cache_mutex);
+
+	plb->refcount--;
+	if (plb->refcount) {
+		pthread_mutex_unlock(&plb_info_cache_mutex);
+		return;
+	}
+
+	for (i = 0; i < PLB_INFO_CACHE_SIZE; i++)
+		if (plb_info_cache[i] == plb)
+			plb_info_cache[i] = NULL;
+
+	pthread_mutex_unlock(&plb_info_cache_mutex);
+
+	for (i = 0; i < LIMA_PP_CORE_MAX; i++)
+		free(plb->pp_template[i]);
+	free(plb->plbu_template);
 	free(plb);
 }
 
@@ -216,7 +362,7 @@ plb_plbu_stream_create(struct limare_frame *frame, struct plb_info *plb)
 	int i, size = plb->block_w * plb->block_h;
 
 	for (i = 0; i < size; i++)
-		stream[i] = address + (i * plb->block_size);
+		stream[i] = address + plb->plbu_template[i];
 }
 
 /*
@@ -228,23 +374,14 @@ plb_pp_stream_create(struct limare_frame *frame, struct plb_info *plb, int core)
 	unsigned int address = frame->mem_physical + frame->plb_offset;
 	unsigned int *stream = frame->mem_address + frame->plb_pp_offset[core];
 	int i;
-	unsigned int *p, *q;
 
-	address >>= 3;
-	p = stream;
-	q = plb->pp_template[core];
-
-	for (i = 0; i < plb->pp_size; i++) {
-		p[0] = 0;
-		p[1] = q[1];
-		p[2] = q[2] + address;
-		p[3] = 0xB0000000;
-		p += 4;
-		q += 4;
-	}
+	/* the template already is the full stream, just relocate it. */
+	memcpy(stream, plb->pp_template[core],
+	       0x10 * (plb->pp_size[core] + 1));
 
-	p[0] = 0;
-	p[1] = 0xBC000000;
+	address >>= 3;
+	for (i = 0; i < plb->pp_size[core]; i++)
+		stream[4 * i + 2] += address;
 }
 
 int
@@ -262,16 +399,16 @@ frame_plb_create(struct limare_state *state, struct limare_frame *frame)
 
 	for (i = 0; i < state->pp_core_count; i++) {
 		frame->plb_pp_offset[i] = frame->mem_used + mem_used;
-		mem_used += ALIGN(0x10 * (plb->pp_size + 1), 0x40);
+		mem_used += ALIGN(0x10 * (plb->pp_size[i] + 1), 0x40);
 
-		if ((frame->mem_used + mem_used) > frame->mem_size) {
+		if (limare_frame_mem_reserve(frame, mem_used)) {
 			printf("%s: no space for the plb areas\n", __func__);
 			return -1;
 		}
-
-		frame->mem_used += mem_used;
 	}
 
+	frame->mem_used += mem_used;
+
 	plb_plbu_stream_create(frame, plb);
 
 	for (i = 0; i < state->pp_core_count; i++)
@@ -279,3 +416,96 @@ frame_plb_create(struct limare_state *state, struct limare_frame *frame)
 
 	return 0;
 }
+
+/*
+ * Have the pp of this frame render only the tiles which touch the area, or
+ * all of them again when the area covers the whole screen. What the
+ * templates hold of the area gets dealt out again in contiguous parts of
+ * the same size, so that all cores still finish at about the same time.
+ * Every core gets at least one tile: with fewer tiles than cores, the
+ * first tile gets rendered more than once, which only writes the same
+ * pixels again.
+ */
+void
+frame_plb_damage(struct limare_state *state, struct limare_frame *frame,
+		 struct limare_rect *area)
+{
+	struct plb_info *plb = state->plb;
+	unsigned int address = (frame->mem_physical + frame->plb_offset) >> 3;
+	unsigned int *streams[LIMA_PP_CORE_MAX], *entry, *first = NULL;
+	int x0 = area->x0 >> 4, y0 = area->y0 >> 4;
+	int x1 = (area->x1 + 15) >> 4, y1 = (area->y1 + 15) >> 4;
+	int cores = state->pp_core_count;
+	int count, used, core, index, size, i, j;
+
+	if (x0 < 0)
+		x0 = 0;
+	if (y0 < 0)
+		y0 = 0;
+	if (x1 > plb->tiled_w)
+		x1 = plb->tiled_w;
+	if (y1 > plb->tiled_h)
+		y1 = plb->tiled_h;
+
+	if (!x0 && !y0 && (x1 == plb->tiled_w) && (y1 == plb->tiled_h)) {
+		if (frame->plb_pp_damaged) {
+			for (i = 0; i < cores; i++)
+				plb_pp_stream_create(frame, plb, i);
+			frame->plb_pp_damaged = 0;
+		}
+		return;
+	}
+
+	/* nothing changed, any one tile still makes for a valid job. */
+	if ((x1 <= x0) || (y1 <= y0)) {
+		x0 = y0 = 0;
+		x1 = y1 = 1;
+	}
+
+	for (i = 0; i < cores; i++)
+		streams[i] = frame->mem_address + frame->plb_pp_offset[i];
+
+	count = (x1 - x0) * (y1 - y0);
+	used = count < cores ? count : cores;
+
+	core = 0;
+	index = 0;
+	size = count / used + (count % used ? 1 : 0);
+	for (i = 0; i < cores; i++) {
+		for (j = 0; j < plb->pp_size[i]; j++) {
+			int x, y;
+
+			entry = plb->pp_template[i] + 4 * j;
+			x = entry[1] & 0xFF;
+			y = (entry[1] >> 8) & 0xFF;
+			if ((x < x0) || (x >= x1) || (y < y0) || (y >= y1))
+				continue;
+
+			if (index == size) {
+				streams[core][4 * index + 0] = 0;
+				streams[core][4 * index + 1] = 0xBC000000;
+				core++;
+				index = 0;
+				size = count / used +
+					(core < (count % used) ? 1 : 0);
+			}
+
+			memcpy(streams[core] + 4 * index, entry, 0x10);
+			streams[core][4 * index + 2] += address;
+			index++;
+
+			if (!first)
+				first = streams[core];
+		}
+	}
+	streams[core][4 * index + 0] = 0;
+	streams[core][4 * index + 1] = 0xBC000000;
+
+	for (core++; core < cores; core++) {
+		memcpy(streams[core], first, 0x10);
+		streams[core][4] = 0;
+		streams[core][5] = 0xBC000000;
+	}
+
+	frame->plb_pp_damaged = 1;
+}
@@ -33,7 +33,18 @@
  * The actual space is allocated on the frame memory.
  */
 struct plb_info {
-	int block_size; /* 0x200 */
+	/* what this info was created for, see plb_info_create() */
+	int width;
+	int height;
+	int type;
+	int pp_core_count;
+	int pp_split;
+	int layout_shift_w;
+	int layout_shift_h;
+	int layout_block_size;
+	int refcount;
+
+	int block_size; /* 0x200, unless limare_plb_layout asked otherwise */
 
 	int tiled_w;
 	int tiled_h;
@@ -51,13 +62,22 @@ struct plb_info {
 	/* holds the addresses so the plbu knows where to store the primitives */
 	int plbu_size; /* 4 * width * height */
 
-	/* holds the coordinates and addresses of the primitives for the PP */
-	int pp_size;
+	/* the plbu stream, with the plb offsets instead of the addresses */
+	unsigned int *plbu_template;
+
+	/*
+	 * holds the coordinates and addresses of the primitives for the PP.
+	 * The templates are the complete pp streams, only the plb address
+	 * needs to be added to the third word of each entry.
+	 */
+	int pp_size[LIMA_PP_CORE_MAX];
 	unsigned int *pp_template[LIMA_PP_CORE_MAX];
 };
 
 struct plb_info *plb_info_create(struct limare_state *state);
 int frame_plb_create(struct limare_state *state, struct limare_frame *frame);
-void plb_destroy(struct plb_info *plb);
+void frame_plb_damage(struct limare_state *state, struct limare_frame *frame,
+		      struct limare_rect *area);
+void plb_info_destroy(struct plb_info *plb);
 
 #endif /* LIMARE_PLB_H */
@@ -38,6 +38,7 @@
 #include "ioctl_registers.h"
 #include "limare.h"
 #include "fb.h"
+#include "texture.h"
 #include "plb.h"
 #include "pp.h"
 #include "jobs.h"
@@ -64,7 +65,7 @@ pp_info_create(struct limare_state *state, struct limare_frame *frame)
 	}
 	plb = state->plb;
 
-	if ((frame->mem_size - frame->mem_used) < 0x80) {
+	if (limare_frame_mem_reserve(frame, 0x80)) {
 		printf("%s: no space for the pp\n", __func__);
 		return NULL;
 	}
@@ -111,13 +112,59 @@ pp_info_destroy(struct pp_info *pp)
 	free(pp);
 }
 
+static int
+pp_target_bpp(struct limare_state *state, struct limare_frame *frame)
+{
+	if (!frame->target)
+		return state->fb->bpp;
+	else if (frame->target->format == LIMA_TEXEL_FORMAT_BGR_565)
+		return 16;
+	else
+		return 32;
+}
+
+/*
+ * Either the current fb, or the 16x16 blocked layout 3 textures use,
+ * which the pitch then counts the blocks of.
+ */
+static void
+pp_wb_registers_fill(struct limare_state *state, struct limare_frame *frame,
+		     struct lima_pp_wb_registers *wb_regs)
+{
+	struct limare_fb *fb = state->fb;
+	struct pp_info *info = frame->pp;
+
+	wb_regs->type = LIMA_PP_WB_TYPE_COLOR;
+
+	if (pp_target_bpp(state, frame) == 16)
+		wb_regs->pixel_format = LIMA_PIXEL_FORMAT_RGB_565;
+	else
+		wb_regs->pixel_format = LIMA_PIXEL_FORMAT_RGBA_8888;
+
+	if (frame->target) {
+		wb_regs->address = frame->target->level[0].mem_physical;
+		wb_regs->pixel_layout = 2;
+		wb_regs->pitch = (frame->target->width + 0x0F) / 16;
+		return;
+	}
+
+	if (fb->dual_buffer)
+		wb_regs->address = fb->mali_physical[frame->index];
+	else
+		wb_regs->address = fb->mali_physical[0];
+
+	if (fb->bpp == 16)
+		wb_regs->pitch = info->pitch / 16;
+	else
+		wb_regs->pitch = info->pitch / 8;
+}
+
 int
 limare_m200_pp_job_start(struct limare_state *state, struct limare_frame *frame)
 {
 	struct lima_m200_pp_frame_registers frame_regs = { 0 };
 	struct lima_pp_wb_registers wb_regs = { 0 };
 	struct pp_info *info = frame->pp;
-	struct limare_fb *fb = state->fb;
 	int supersampling = 1;
 
 	/* frame registers */
@@ -129,7 +176,7 @@ limare_m200_pp_job_start(struct limare_state *state, struct limare_frame *frame)
 	if (supersampling)
 		frame_regs.flags |= LIMA_PP_FRAME_FLAGS_ONSCREEN;
 
-	frame_regs.clear_value_depth = 0x00FFFFFF;
+	frame_regs.clear_value_depth = frame->clear_depth;
 	frame_regs.clear_value_stencil = 0;
 	frame_regs.clear_value_color = info->clear_color;
 	frame_regs.clear_value_color_1 = info->clear_color;
@@ -157,19 +204,7 @@ limare_m200_pp_job_start(struct limare_state *state, struct limare_frame *frame)
 	frame_regs.onscreen = supersampling;
 
 	/* write back registers */
-	wb_regs.type = LIMA_PP_WB_TYPE_COLOR;
-	if (state->fb->dual_buffer)
-		wb_regs.address = state->fb->mali_physical[frame->index];
-	else
-		wb_regs.address = state->fb->mali_physical[0];
-
-	if (fb->bpp == 16) {
-		wb_regs.pixel_format = LIMA_PIXEL_FORMAT_RGB_565;
-		wb_regs.pitch = info->pitch / 16;
-	} else {
-		wb_regs.pixel_format = LIMA_PIXEL_FORMAT_RGBA_8888;
-		wb_regs.pitch = info->pitch / 8;
-	}
+	pp_wb_registers_fill(state, frame, &wb_regs);
 
 	wb_regs.mrt_bits = 0;
 	wb_regs.mrt_pitch = 0;
@@ -187,7 +222,6 @@ limare_m400_pp_job_start(struct limare_state *state, struct limare_frame *frame)
 	struct lima_pp_wb_registers wb_regs = { 0 };
 	struct pp_info *info = frame->pp;
 	struct plb_info *plb = state->plb;
-	struct limare_fb *fb = state->fb;
 	int supersampling = 1;
 
 	/* frame registers */
@@ -199,7 +233,7 @@ limare_m400_pp_job_start(struct limare_state *state, struct limare_frame *frame)
 	if (supersampling)
 		frame_regs.flags |= LIMA_PP_FRAME_FLAGS_ONSCREEN;
 
-	frame_regs.clear_value_depth = 0x00FFFFFF;
+	frame_regs.clear_value_depth = frame->clear_depth;
 	frame_regs.clear_value_stencil = 0;
 	frame_regs.clear_value_color = info->clear_color;
 	frame_regs.clear_value_color_1 = info->clear_color;
@@ -210,7 +244,7 @@ limare_m400_pp_job_start(struct limare_state *state, struct limare_frame *frame)
 	frame_regs.height = info->height - 1;
 
 	if (frame) {
-		if ((frame->mem_size - frame->mem_used) > 0x400) {
+		if (!limare_frame_mem_reserve(frame, 0x400)) {
 			frame_regs.fragment_stack_address =
 				frame->mem_physical + frame->mem_used;
 			frame_regs.fragment_stack_size = 0x10001;
@@ -238,25 +272,13 @@ limare_m400_pp_job_start(struct limare_state *state, struct limare_frame *frame)
 		frame_regs.scale |= 0x100;
 
 	/* always set to this on newer drivers */
-	if (fb->bpp == 16)
+	if (pp_target_bpp(state, frame) == 16)
 		frame_regs.foureight = 0x8565;
 	else
 		frame_regs.foureight = 0x8888;
 
 	/* write back registers */
-	wb_regs.type = LIMA_PP_WB_TYPE_COLOR;
-	if (state->fb->dual_buffer)
-		wb_regs.address = state->fb->mali_physical[frame->index];
-	else
-		wb_regs.address = state->fb->mali_physical[0];
-
-	if (fb->bpp == 16) {
-		wb_regs.pixel_format = LIMA_PIXEL_FORMAT_RGB_565;
-		wb_regs.pitch = info->pitch / 16;
-	} else {
-		wb_regs.pixel_format = LIMA_PIXEL_FORMAT_RGBA_8888;
-		wb_regs.pitch = info->pitch / 8;
-	}
+	pp_wb_registers_fill(state, frame, &wb_regs);
 	/* todo: infrastructure to read fbdev and see whether, we need to swap R/B */
 	//wb.mrt_bits = 4; /* set to RGBA instead of BGRA */
 	wb_regs.mrt_bits = 2;
@@ -278,8 +300,7 @@ limare_m400_pp_job_start(struct limare_state *state, struct limare_frame *frame)
 					frame->plb_pp_offset[i];
 
 			for (i = 1; i < state->pp_core_count; i++) {
-				if ((frame->mem_size - frame->mem_used) >
-				    0x400) {
+				if (!limare_frame_mem_reserve(frame, 0x400)) {
 					stack_addr[i - 1] =
 						frame->mem_physical +
 						frame->mem_used;
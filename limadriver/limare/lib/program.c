@@ -29,6 +29,7 @@
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <limits.h>
 
 /* for mbs reading */
 #include <unistd.h>
@@ -1046,6 +1047,127 @@ vertex_shader_varyings_patch(unsigned int *shader, int size, int *indices)
 	return 0;
 }
 
+/*
+ * Shader cache.
+ *
+ * The MBS streams that the r3p0 and later compilers hand us are stored on
+ * disk, named after a hash of the source, the shader type and the kernel
+ * version. Later runs load these instead of compiling again, and builds
+ * without the blob can use shaders that someone compiled elsewhere.
+ *
+ * The cache lives in $LIMA_SHADER_CACHE, or in ~/.cache/lima when that is
+ * not set. An empty LIMA_SHADER_CACHE disables it.
+ */
+static int
+shader_cache_filename(struct limare_state *state, int type,
+		      const char *source, char *filename, int size)
+{
+	const char *dir = getenv("LIMA_SHADER_CACHE");
+	const char *home;
+	unsigned long long hash = 0xCBF29CE484222325ULL; /* FNV-1a */
+	const unsigned char *p;
+	int ret;
+
+	for (p = (const unsigned char *) source; *p; p++) {
+		hash ^= *p;
+		hash *= 0x100000001B3ULL;
+	}
+
+	if (dir) {
+		if (!dir[0])
+			return -1;
+		ret = snprintf(filename, size, "%s/%016llx-%c-%d.mbs", dir,
+			       hash, (type == LIMA_SHADER_VERTEX) ? 'v' : 'f',
+			       state->kernel_version);
+	} else {
+		home = getenv("HOME");
+		if (!home || !home[0])
+			return -1;
+		ret = snprintf(filename, size,
+			       "%s/.cache/lima/%016llx-%c-%d.mbs", home,
+			       hash, (type == LIMA_SHADER_VERTEX) ? 'v' : 'f',
+			       state->kernel_version);
+	}
+
+	if ((ret < 0) || (ret >= size))
+		return -1;
+
+	return 0;
+}
+
+static int
+shader_cache_load(struct limare_state *state, struct limare_program *program,
+		  int type, const char *source)
+{
+	char filename[PATH_MAX];
+	int ret;
+
+	if (shader_cache_filename(state, type, source,
+				  filename, sizeof(filename)))
+		return -1;
+
+	if (access(filename, R_OK))
+		return -1;
+
+	if (type == LIMA_SHADER_VERTEX) {
+		ret = limare_program_vertex_shader_attach_mbs_file(state,
+								   program,
+								   filename);
+		if (!ret && program->vertex_shader)
+			return 0;
+	} else {
+		ret = limare_program_fragment_shader_attach_mbs_file(state,
+								     program,
+								     filename);
+		if (!ret && program->fragment_shader)
+			return 0;
+	}
+
+	printf("%s: dropping broken cache entry %s\n", __func__, filename);
+	unlink(filename);
+
+	return -1;
+}
+
+#ifndef HAVE_NO_LIBMALI_BLOB
+static void
+shader_cache_store(struct limare_state *state, int type, const char *source,
+		   const void *stream, int size)
+{
+	char filename[PATH_MAX], temp[PATH_MAX + 16];
+	char *p;
+	FILE *file;
+	int ret;
+
+	if (!stream || (size <= 0))
+		return;
+
+	if (shader_cache_filename(state, type, source,
+				  filename, sizeof(filename)))
+		return;
+
+	/* create the directories leading up to our file. */
+	for (p = strchr(filename + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = 0;
+		ret = mkdir(filename, 0755);
+		*p = '/';
+		if (ret && (errno != EEXIST))
+			return;
+	}
+
+	/* write under a temporary name, so readers never see half a file. */
+	snprintf(temp, sizeof(temp), "%s.%d", filename, (int) getpid());
+
+	file = fopen(temp, "w");
+	if (!file)
+		return;
+
+	ret = fwrite(stream, size, 1, file);
+	if (fclose(file) || (ret != 1) || rename(temp, filename))
+		unlink(temp);
+}
+#endif
+
 static void
 limare_shader_binary_free(struct lima_shader_binary *binary)
 {
@@ -1096,7 +1218,9 @@ limare_shader_compile(struct limare_state *state, int type, const char *source)
 			return NULL;
 		}
 
-		/* we are not using the mbs */
+		/* we only keep the mbs around on disk */
+		shader_cache_store(state, type, source, mbs_binary->mbs_stream,
+				   mbs_binary->mbs_stream_size);
 		free((void *) mbs_binary->mbs_stream);
 
 		binary->compile_status = mbs_binary->compile_status;
@@ -1133,7 +1257,9 @@ limare_shader_compile(struct limare_state *state, int type, const char *source)
 			return NULL;
 		}
 
-		/* we are not using the mbs */
+		/* we only keep the mbs around on disk */
+		shader_cache_store(state, type, source, mbs_binary->mbs_stream,
+				   mbs_binary->mbs_stream_size);
 		free((void *) mbs_binary->mbs_stream);
 
 		binary->compile_status = mbs_binary->compile_status;
@@ -1218,17 +1344,13 @@ limare_program_vertex_shader_attach(struct limare_state *state,
 {
 	struct lima_shader_binary *binary;
 
+	if (!shader_cache_load(state, program, LIMA_SHADER_VERTEX, source))
+		return 0;
+
 	binary = limare_shader_compile(state, LIMA_SHADER_VERTEX, source);
 	if (!binary)
 		return -1;
 
-	if (binary->shader_size > program->vertex_mem_size) {
-		printf("%s: Vertex shader is too large: %d\n",
-		       __func__, binary->shader_size);
-		limare_shader_binary_free(binary);
-		return -1;
-	}
-
 	program->vertex_shader = binary->shader;
 	binary->shader = NULL;
 	program->vertex_shader_size = binary->shader_size;
@@ -1280,17 +1402,13 @@ limare_program_fragment_shader_attach(struct limare_state *state,
 {
 	struct lima_shader_binary *binary;
 
+	if (!shader_cache_load(state, program, LIMA_SHADER_FRAGMENT, source))
+		return 0;
+
 	binary = limare_shader_compile(state, LIMA_SHADER_FRAGMENT, source);
 	if (!binary)
 		return -1;
 
-	if (binary->shader_size > program->fragment_mem_size) {
-		printf("%s: Fragment shader is too large: %d\n",
-		       __func__, binary->shader_size);
-		limare_shader_binary_free(binary);
-		return -1;
-	}
-
 	program->fragment_shader = binary->shader;
 	binary->shader = NULL;
 	program->fragment_shader_size = binary->shader_size;
@@ -1568,12 +1686,6 @@ limare_program_vertex_shader_attach_mbs_stream(struct limare_state *state,
 		goto end;
 	}
 
-	if (binary->shader_size > program->vertex_mem_size) {
-		printf("%s: Vertex shader is too large: %d\n",
-		       __func__, binary->shader_size);
-		goto end;
-	}
-
 	program->vertex_shader = malloc(binary->shader_size);
 	if (!program->vertex_shader) {
 		printf("%s: Error: shader memory allocation failed: %s\n",
@@ -1747,12 +1859,6 @@ limare_program_fragment_shader_attach_mbs_stream(struct limare_state *state,
 		goto end;
 	}
 
-	if (binary->shader_size > program->fragment_mem_size) {
-		printf("%s: Fragment shader is too large: %d\n",
-		       __func__, binary->shader_size);
-		goto end;
-	}
-
 	program->fragment_shader = malloc(binary->shader_size);
 	if (!program->fragment_shader) {
 		printf("%s: Error: shader memory allocation failed: %s\n",
@@ -2067,6 +2173,31 @@ varying_map_create(struct limare_program *program)
 	return 0;
 }
 
+static int
+program_symbol_indices_create(struct limare_program *program)
+{
+	symbol_index_destroy(program->vertex_uniform_index);
+	symbol_index_destroy(program->vertex_attribute_index);
+	symbol_index_destroy(program->fragment_uniform_index);
+
+	program->vertex_uniform_index =
+		symbol_index_create(program->vertex_uniforms,
+				    program->vertex_uniform_count);
+	program->vertex_attribute_index =
+		symbol_index_create(program->vertex_attributes,
+				    program->vertex_attribute_count);
+	program->fragment_uniform_index =
+		symbol_index_create(program->fragment_uniforms,
+				    program->fragment_uniform_count);
+
+	if (!program->vertex_uniform_index ||
+	    !program->vertex_attribute_index ||
+	    !program->fragment_uniform_index)
+		return -ENOMEM;
+
+	return 0;
+}
+
 int
 limare_program_link(struct limare_program *program)
 {
@@ -2117,6 +2248,10 @@ limare_program_link(struct limare_program *program)
 
 	vertex_shader_varyings_rewrite(program);
 
+	ret = program_symbol_indices_create(program);
+	if (ret)
+		return ret;
+
 	/* now throw the shaders into mali mem. */
 	memcpy(program->mem_address + program->vertex_mem_offset,
 	       program->vertex_shader, program->vertex_shader_size);
@@ -2147,7 +2282,7 @@ limare_program_create(void *address, unsigned int physical,
 	program->mem_physical = physical + offset;
 	program->mem_size = size;
 
-	/* when we have proper memory management... */
+	/* limare_link lays a program out to fit its shaders instead. */
 	program->vertex_mem_offset = 0;
 	program->vertex_mem_size = ALIGN(program->mem_size / 2, 0x40);
 
@@ -2187,6 +2322,12 @@ limare_depth_clear_link(struct limare_state *state,
 	if (ret)
 		return ret;
 
+	if (program->fragment_shader_size > program->fragment_mem_size) {
+		printf("%s: Fragment shader is too large: %d\n",
+		       __func__, program->fragment_shader_size);
+		return -1;
+	}
+
 	/* now throw the shader into mali mem. */
 	memcpy(program->mem_address + program->fragment_mem_offset,
 	       program->fragment_shader, program->fragment_shader_size);
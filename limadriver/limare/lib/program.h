@@ -71,12 +71,29 @@ struct limare_program {
 	struct symbol **fragment_varyings;
 	int fragment_varying_count;
 
+	/* name lookups, built when linking. */
+	struct symbol_index *vertex_uniform_index;
+	struct symbol_index *vertex_attribute_index;
+	struct symbol_index *fragment_uniform_index;
+
 	struct symbol *gl_Position;
 	struct symbol *gl_PointSize;
 
 	struct varying_map varying_map[12];
 	int varying_map_count;
 	int varying_map_size;
+
+	/*
+	 * Where the uniforms of the last draw ended up in frame memory.
+	 * Further draws in that same frame point at these blocks again,
+	 * until a uniform gets (re-)attached or the viewport changes.
+	 */
+	int uniforms_dirty;
+	struct limare_frame *uniforms_frame;
+	int uniforms_frame_id;
+	int vertex_uniform_offset;
+	int fragment_uniform_array_offset;
+	int fragment_uniform_offset;
 };
 
 struct limare_program *
@@ -93,7 +93,7 @@ draw_render_state_create(struct limare_frame *frame,
 	}
 
 	size = ALIGN(sizeof(struct render_state), 0x40);
-	if (size > (frame->mem_size - frame->mem_used)) {
+	if (limare_frame_mem_reserve(frame, size)) {
 		printf("%s: no more space\n", __func__);
 		return -2;
 	}
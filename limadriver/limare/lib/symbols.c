@@ -173,3 +173,90 @@ symbol_print(struct symbol *symbol)
 
 	printf("};\n");
 }
+
+/* FNV-1a, our names are short and this is only run on lookups. */
+static unsigned int
+symbol_name_hash(const char *name)
+{
+	unsigned int hash = 2166136261U;
+
+	while (*name) {
+		hash ^= (unsigned char) *name++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+struct symbol_index *
+symbol_index_create(struct symbol **symbols, int count)
+{
+	struct symbol_index *index;
+	int size = 4, i;
+
+	/* keep the table at most half full. */
+	while (size < (2 * count))
+		size <<= 1;
+
+	index = calloc(1, sizeof(struct symbol_index) +
+		       size * sizeof(unsigned short));
+	if (!index) {
+		printf("%s: Error: failed to allocate index: %s\n",
+		       __func__, strerror(errno));
+		return NULL;
+	}
+
+	index->size = size;
+	index->count = count;
+
+	for (i = 0; i < count; i++) {
+		unsigned int slot =
+			symbol_name_hash(symbols[i]->name) & (size - 1);
+
+		while (index->slots[slot])
+			slot = (slot + 1) & (size - 1);
+
+		index->slots[slot] = i + 1;
+	}
+
+	return index;
+}
+
+/*
+ * Returns the index of the symbol with this name, or -1. Without an index,
+ * as is the case before linking, we fall back to walking the array.
+ */
+int
+symbol_index_find(struct symbol_index *index, struct symbol **symbols,
+		  int count, const char *name)
+{
+	unsigned int slot;
+
+	if (!index) {
+		int i;
+
+		for (i = 0; i < count; i++)
+			if (!strcmp(symbols[i]->name, name))
+				return i;
+		return -1;
+	}
+
+	slot = symbol_name_hash(name) & (index->size - 1);
+
+	while (index->slots[slot]) {
+		int i = index->slots[slot] - 1;
+
+		if (!strcmp(symbols[i]->name, name))
+			return i;
+
+		slot = (slot + 1) & (index->size - 1);
+	}
+
+	return -1;
+}
+
+void
+symbol_index_destroy(struct symbol_index *index)
+{
+	free(index);
+}
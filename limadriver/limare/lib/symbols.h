@@ -88,4 +88,20 @@ struct symbol *symbol_copy(struct symbol *original, int start, int count);
 void symbol_destroy(struct symbol *symbol);
 void symbol_print(struct symbol *symbol);
 
+/*
+ * Open addressed hash over the names of a symbol array, so that the
+ * string based lookups of the api do not have to strcmp their way
+ * through every symbol of a program. Slots hold the symbol index + 1.
+ */
+struct symbol_index {
+	int size; /* power of two */
+	int count;
+	unsigned short slots[];
+};
+
+struct symbol_index *symbol_index_create(struct symbol **symbols, int count);
+int symbol_index_find(struct symbol_index *index, struct symbol **symbols,
+		      int count, const char *name);
+void symbol_index_destroy(struct symbol_index *index);
+
 #endif /* LIMARE_SYMBOLS_H */
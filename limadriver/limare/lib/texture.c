@@ -33,12 +33,18 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include <GLES2/gl2.h>
 
 #include "limare.h"
 #include "texture.h"
 #include "formats.h"
+#include "aux.h"
 
 /*
  * Below is a space filler algorithm that is spatially optimized which makes
@@ -86,46 +92,258 @@ space_filler_index(int x, int y)
 }
 
 /*
- * Again, there seems to be some weirdness with the arm mipmapping code.
- * The top channel from time to time is rounded up by 1, but if rounding is
- * added to the code below, it produces vastly different results. Then there
- * seem to be some positioning issues with the binary code as well.
+ * Within a 16x16 block, every 2x2 quad of pixels at an even x and y ends
+ * up as 4 consecutive pixels: top left, top right, bottom right and then
+ * bottom left. The quads themselves follow the same space filler order,
+ * so this is space_filler_index(2 * qx, 2 * qy), for quad qy * 8 + qx.
+ */
+static const unsigned char
+space_filler_quads[64] = {
+	0x00, 0x04, 0x10, 0x14, 0x40, 0x44, 0x50, 0x54,
+	0x0c, 0x08, 0x1c, 0x18, 0x4c, 0x48, 0x5c, 0x58,
+	0x30, 0x34, 0x20, 0x24, 0x70, 0x74, 0x60, 0x64,
+	0x3c, 0x38, 0x2c, 0x28, 0x7c, 0x78, 0x6c, 0x68,
+	0xc0, 0xc4, 0xd0, 0xd4, 0x80, 0x84, 0x90, 0x94,
+	0xcc, 0xc8, 0xdc, 0xd8, 0x8c, 0x88, 0x9c, 0x98,
+	0xf0, 0xf4, 0xe0, 0xe4, 0xb0, 0xb4, 0xa0, 0xa4,
+	0xfc, 0xf8, 0xec, 0xe8, 0xbc, 0xb8, 0xac, 0xa8,
+};
+
+/*
+ * Swizzle one full 16x16 block, two source rows at a time. Each quad is a
+ * single contiguous store, with NEON four of them (16bpp) or two of them
+ * (32bpp) come from one pair of row loads.
  */
 static void
-texture_rgb565_swizzle(struct limare_texture_level *level,
-		       const unsigned char *pixels)
+texture_swizzle_block(unsigned char *dest, const unsigned char *source,
+		      int source_pitch, int bpp)
 {
-	int block_x, block_y, block_pitch;
-	int x, y, rem_x, rem_y, index, source_pitch;;
+	const unsigned char *top, *bottom;
+	const unsigned char *quads;
+	int qx, qy;
+
+	for (qy = 0; qy < 8; qy++) {
+		top = source + 2 * qy * source_pitch;
+		bottom = top + source_pitch;
+		quads = &space_filler_quads[qy * 8];
+		qx = 0;
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+		if (bpp == 2) {
+			for (; qx < 8; qx += 4) {
+				uint32x4_t a = vreinterpretq_u32_u8(
+					vld1q_u8(top + 4 * qx));
+				uint32x4_t b = vreinterpretq_u32_u16(vrev32q_u16(
+					vreinterpretq_u16_u8(
+						vld1q_u8(bottom + 4 * qx))));
+				uint32x4x2_t q = vzipq_u32(a, b);
+
+				vst1_u8(dest + 2 * quads[qx + 0],
+					vreinterpret_u8_u32(vget_low_u32(q.val[0])));
+				vst1_u8(dest + 2 * quads[qx + 1],
+					vreinterpret_u8_u32(vget_high_u32(q.val[0])));
+				vst1_u8(dest + 2 * quads[qx + 2],
+					vreinterpret_u8_u32(vget_low_u32(q.val[1])));
+				vst1_u8(dest + 2 * quads[qx + 3],
+					vreinterpret_u8_u32(vget_high_u32(q.val[1])));
+			}
+		} else if (bpp == 4) {
+			for (; qx < 8; qx += 2) {
+				uint32x4_t a = vreinterpretq_u32_u8(
+					vld1q_u8(top + 8 * qx));
+				uint32x4_t b = vrev64q_u32(vreinterpretq_u32_u8(
+					vld1q_u8(bottom + 8 * qx)));
+
+				vst1q_u8(dest + 4 * quads[qx + 0],
+					 vreinterpretq_u8_u32(vcombine_u32(
+						vget_low_u32(a), vget_low_u32(b))));
+				vst1q_u8(dest + 4 * quads[qx + 1],
+					 vreinterpretq_u8_u32(vcombine_u32(
+						vget_high_u32(a), vget_high_u32(b))));
+			}
+		}
+#endif
+
+		for (; qx < 8; qx++) {
+			unsigned char *quad = dest + bpp * quads[qx];
+			int offset = 2 * bpp * qx;
+
+			memcpy(quad, top + offset, 2 * bpp);
+			memcpy(quad + 2 * bpp, bottom + offset + bpp, bpp);
+			memcpy(quad + 3 * bpp, bottom + offset, bpp);
+		}
+	}
+}
+
+/*
+ * Swizzle the width x height rectangle at (x0, y0) of a level, from pixels
+ * which start with its top left pixel: the 16x16 blocks it fully covers a
+ * block at a time, and the partial blocks around them a pixel at a time.
+ */
+static void
+texture_swizzle_rect(struct limare_texture_level *level,
+		     const unsigned char *pixels, int bpp, int source_pitch,
+		     int x0, int y0, int width, int height)
+{
+	int block_x, block_y, block_pitch, block_size = 256 * bpp;
+	int full_x0 = ALIGN(x0, 16), full_x1 = (x0 + width) & ~0x0F;
+	int full_y0 = ALIGN(y0, 16), full_y1 = (y0 + height) & ~0x0F;
+	int x, y, index, in_blocks;
 	const unsigned char *source;
 	unsigned char *dest;
 
 	block_pitch = ALIGN(level->width, 16) >> 4;
-	source_pitch = ALIGN(level->width * 2, 4);
 
-	for (y = 0; y < level->height; y++) {
+	for (y = full_y0; y < full_y1; y += 16) {
+		block_y = y >> 4;
+		for (x = full_x0; x < full_x1; x += 16) {
+			block_x = x >> 4;
+			dest = level->dest;
+			dest += block_size * (block_y * block_pitch + block_x);
+			source = &pixels[(y - y0) * source_pitch +
+					 bpp * (x - x0)];
+			texture_swizzle_block(dest, source, source_pitch, bpp);
+		}
+	}
+
+	for (y = y0; y < (y0 + height); y++) {
 		block_y = y >> 4;
-		rem_y = y & 0x0F;
+		in_blocks = (y >= full_y0) && (y < full_y1) &&
+			(full_x0 < full_x1);
+
+		for (x = x0; x < (x0 + width); x++) {
+			if (in_blocks && (x == full_x0)) {
+				x = full_x1 - 1;
+				continue;
+			}
 
-		for (x = 0; x < level->width; x++) {
 			block_x = x >> 4;
-			rem_x = x & 0x0F;
 
-			index = space_filler_index(rem_x, rem_y);
+			index = space_filler_index(x & 0x0F, y & 0x0F);
 
-			source = &pixels[y * source_pitch + 2 * x];
 			dest = level->dest;
-			dest += (2 * 256) * (block_y * block_pitch + block_x);
-			dest += 2 * index;
+			dest += block_size * (block_y * block_pitch + block_x);
+			dest += bpp * index;
 
-			dest[0] = source[0];
-			dest[1] = source[1];
+			source = &pixels[(y - y0) * source_pitch +
+					 bpp * (x - x0)];
+			memcpy(dest, source, bpp);
 		}
 	}
+}
+
+static void
+texture_swizzle(struct limare_texture_level *level,
+		const unsigned char *pixels, int bpp, int source_pitch)
+{
+	texture_swizzle_rect(level, pixels, bpp, source_pitch,
+			     0, 0, level->width, level->height);
 
 	level->uploaded = 1;
 }
 
+/*
+ * Mipmap all the full 16x16 blocks of dst. In the swizzled layout, each
+ * quarter of a block (64 pixels) comes from the 64 quads of one block of
+ * the level above, in the same order, so every quarter is just a linear
+ * four to one reduction, done by the per-format 'quads' kernel. The
+ * pixels of the partial blocks at the edges are left to the caller.
+ */
+static void
+texture_mipmap_blocks(struct limare_texture_level *dst,
+		      struct limare_texture_level *src, int bpp,
+		      void (*quads)(unsigned char *dest,
+				    const unsigned char *source, int count))
+{
+	int block_x, block_y, block_pitch, source_pitch, quarter;
+	int full_width = dst->width >> 4;
+	int full_height = dst->height >> 4;
+	int source_x, source_y;
+	unsigned char *dest;
+	const unsigned char *source;
+
+	block_pitch = ALIGN(dst->width, 16) >> 4;
+	source_pitch = ALIGN(src->width, 16) >> 4;
+
+	for (block_y = 0; block_y < full_height; block_y++) {
+		for (block_x = 0; block_x < full_width; block_x++) {
+			for (quarter = 0; quarter < 4; quarter++) {
+				/* bit 0 is x ^ y, bit 1 is y, of the source block */
+				source_y = 2 * block_y + (quarter >> 1);
+				source_x = 2 * block_x +
+					((quarter ^ (quarter >> 1)) & 1);
+
+				dest = dst->dest;
+				dest += bpp * (256 * (block_pitch * block_y +
+						      block_x) + 64 * quarter);
+
+				source = src->dest;
+				source += bpp * 256 *
+					(source_pitch * source_y + source_x);
+
+				quads(dest, source, 64);
+			}
+		}
+	}
+}
+
+/*
+ * Again, there seems to be some weirdness with the arm mipmapping code.
+ * The top channel from time to time is rounded up by 1, but if rounding is
+ * added to the code below, it produces vastly different results. Then there
+ * seem to be some positioning issues with the binary code as well.
+ */
+static void
+texture_rgb565_swizzle(struct limare_texture_level *level,
+		       const unsigned char *pixels)
+{
+	texture_swizzle(level, pixels, 2, ALIGN(level->width * 2, 4));
+}
+
+/* Average each quad of 4 consecutive pixels, a channel at a time */
+static void
+texture_rgb565_mipmap_quads(unsigned char *dest, const unsigned char *source,
+			    int count)
+{
+	unsigned short *d = (unsigned short *) dest;
+	const unsigned short *s = (const unsigned short *) source;
+	int i = 0;
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+	uint16x8_t green_mask = vdupq_n_u16(0x3F), blue_mask = vdupq_n_u16(0x1F);
+
+	for (; (i + 8) <= count; i += 8) {
+		uint16x8x4_t p = vld4q_u16(s + 4 * i);
+		uint16x8_t r, g, b;
+		int k;
+
+		r = vshrq_n_u16(p.val[0], 11);
+		g = vandq_u16(vshrq_n_u16(p.val[0], 5), green_mask);
+		b = vandq_u16(p.val[0], blue_mask);
+		for (k = 1; k < 4; k++) {
+			r = vaddq_u16(r, vshrq_n_u16(p.val[k], 11));
+			g = vaddq_u16(g, vandq_u16(vshrq_n_u16(p.val[k], 5),
+						   green_mask));
+			b = vaddq_u16(b, vandq_u16(p.val[k], blue_mask));
+		}
+
+		r = vshlq_n_u16(vshrq_n_u16(r, 2), 11);
+		g = vshlq_n_u16(vshrq_n_u16(g, 2), 5);
+		b = vshrq_n_u16(b, 2);
+		vst1q_u16(d + i, vorrq_u16(r, vorrq_u16(g, b)));
+	}
+#endif
+
+	for (; i < count; i++, s += 4) {
+		d[i] = ((s[0] & 0x001F) + (s[1] & 0x001F) +
+			(s[2] & 0x001F) + (s[3] & 0x001F)) >> 2;
+		d[i] |= (((s[0] & 0x07E0) + (s[1] & 0x07E0) +
+			  (s[2] & 0x07E0) + (s[3] & 0x07E0)) >> 2) & 0x07E0;
+		d[i] |= (((s[0] & 0xF800) + (s[1] & 0xF800) +
+			  (s[2] & 0xF800) + (s[3] & 0xF800)) >> 2) & 0xF800;
+	}
+}
+
 static void
 texture_rgb565_mipmap_auto(struct limare_texture_level *dst,
 			   struct limare_texture_level *src)
@@ -190,12 +408,18 @@ texture_rgb565_mipmap_auto(struct limare_texture_level *dst,
 				     (source[1] & 0xF800)) >> 1) & 0xF800;
 		}
 	} else {
+		int full_width = dst->width & ~0x0F;
+		int full_height = dst->height & ~0x0F;
+
+		texture_mipmap_blocks(dst, src, 2, texture_rgb565_mipmap_quads);
+
 		for (y = 0; y < dst->height; y++) {
 			block_y = y >> 4;
 			dy = y & 0x0F;
 			source_y = y >> 3;
 
-			for (x = 0; x < dst->width; x++) {
+			for (x = y < full_height ? full_width : 0;
+			     x < dst->width; x++) {
 				block_x = x >> 4;
 				dx = x & 0x0F;
 				source_x = x >> 3;
@@ -234,6 +458,37 @@ texture_rgb565_mipmap_auto(struct limare_texture_level *dst,
 	dst->uploaded = 1;
 }
 
+/*
+ * Carve the levels from start on out of a single AUX allocation of size
+ * bytes, which their sizes add up to.
+ */
+static int
+texture_levels_allocate(struct limare_state *state,
+			struct limare_texture *texture, int start, int size)
+{
+	struct limare_texture_level *level;
+	int i, offset;
+
+	offset = limare_aux_alloc(state, size);
+	if (offset < 0) {
+		printf("%s: size (0x%X) exceeds available size (0x%X)\n",
+		       __func__, size,
+		       state->aux_mem_size - state->aux_mem_used);
+		return -1;
+	}
+
+	for (i = start; i < texture->levels; i++) {
+		level = &texture->level[i];
+
+		level->mem_offset = offset;
+		level->dest = state->aux_mem_address + offset;
+		level->mem_physical = state->aux_mem_physical + offset;
+		offset += level->size;
+	}
+
+	return 0;
+}
+
 static int
 texture_rgb565_allocate(struct limare_state *state,
 			struct limare_texture *texture)
@@ -266,23 +521,7 @@ texture_rgb565_allocate(struct limare_state *state,
 		size += level->size;
 	}
 
-	if ((state->aux_mem_size - state->aux_mem_used) < size) {
-		printf("%s: size (0x%X) exceeds available size (0x%X)\n",
-		       __func__, size,
-		       state->aux_mem_size - state->aux_mem_used);
-		return -1;
-	}
-
-	for (i = start; i < texture->levels; i++) {
-		level = &texture->level[i];
-
-		level->dest = state->aux_mem_address + state->aux_mem_used;
-		level->mem_physical =
-			state->aux_mem_physical + state->aux_mem_used;
-		state->aux_mem_used += level->size;
-	}
-
-	return 0;
+	return texture_levels_allocate(state, texture, start, size);
 }
 
 static int
@@ -313,36 +552,21 @@ static void
 texture_24_swizzle(struct limare_texture_level  *level,
 		   const unsigned char *pixels)
 {
-	int block_x, block_y, block_pitch;
-	int x, y, rem_x, rem_y, index, source_pitch;;
-	const unsigned char *source;
-	unsigned char *dest;
-
-	block_pitch = ALIGN(level->width, 16) >> 4;
-	source_pitch = ALIGN(level->width * 3, 4);
-
-	for (y = 0; y < level->height; y++) {
-		block_y = y >> 4;
-		rem_y = y & 0x0F;
-
-		for (x = 0; x < level->width; x++) {
-			block_x = x >> 4;
-			rem_x = x & 0x0F;
-
-			index = space_filler_index(rem_x, rem_y);
+	texture_swizzle(level, pixels, 3, ALIGN(level->width * 3, 4));
+}
 
-			source = &pixels[y * source_pitch + 3 * x];
-			dest = level->dest;
-			dest += (3 * 256) * (block_y * block_pitch + block_x);
-			dest += 3 * index;
+/* Average each quad of 4 consecutive pixels, a byte at a time */
+static void
+texture_24_mipmap_quads(unsigned char *dest, const unsigned char *source,
+			int count)
+{
+	int i;
 
-			dest[0] = source[0];
-			dest[1] = source[1];
-			dest[2] = source[2];
-		}
+	for (i = 0; i < count; i++, dest += 3, source += 12) {
+		dest[0] = (source[0] + source[3] + source[6] + source[9]) / 4;
+		dest[1] = (source[1] + source[4] + source[7] + source[10]) / 4;
+		dest[2] = (source[2] + source[5] + source[8] + source[11]) / 4;
 	}
-
-	level->uploaded = 1;
 }
 
 /*
@@ -414,12 +638,18 @@ texture_24_mipmap_auto(struct limare_texture_level *dst,
 			dest[2] = (source[2] + source[5]) / 2;
 		}
 	} else {
+		int full_width = dst->width & ~0x0F;
+		int full_height = dst->height & ~0x0F;
+
+		texture_mipmap_blocks(dst, src, 3, texture_24_mipmap_quads);
+
 		for (y = 0; y < dst->height; y++) {
 			block_y = y >> 4;
 			dy = y & 0x0F;
 			source_y = y >> 3;
 
-			for (x = 0; x < dst->width; x++) {
+			for (x = y < full_height ? full_width : 0;
+			     x < dst->width; x++) {
 				block_x = x >> 4;
 				dx = x & 0x0F;
 				source_x = x >> 3;
@@ -480,23 +710,7 @@ texture_24_allocate(struct limare_state *state, struct limare_texture *texture)
 		size += level->size;
 	}
 
-	if ((state->aux_mem_size - state->aux_mem_used) < size) {
-		printf("%s: size (0x%X) exceeds available size (0x%X)\n",
-		       __func__, size,
-		       state->aux_mem_size - state->aux_mem_used);
-		return -1;
-	}
-
-	for (i = start; i < texture->levels; i++) {
-		level = &texture->level[i];
-
-		level->dest = state->aux_mem_address + state->aux_mem_used;
-		level->mem_physical =
-			state->aux_mem_physical + state->aux_mem_used;
-		state->aux_mem_used += level->size;
-	}
-
-	return 0;
+	return texture_levels_allocate(state, texture, start, size);
 }
 
 static int
@@ -522,37 +736,43 @@ static void
 texture_32_swizzle(struct limare_texture_level *level,
 		   const unsigned char *pixels)
 {
-	int block_x, block_y, block_pitch;
-	int x, y, rem_x, rem_y, index, source_pitch;;
-	const unsigned char *source;
-	unsigned char *dest;
-
-	block_pitch = ALIGN(level->width, 16) >> 4;
-	source_pitch = level->width * 4;
-
-	for (y = 0; y < level->height; y++) {
-		block_y = y >> 4;
-		rem_y = y & 0x0F;
-
-		for (x = 0; x < level->width; x++) {
-			block_x = x >> 4;
-			rem_x = x & 0x0F;
+	texture_swizzle(level, pixels, 4, level->width * 4);
+}
 
-			index = space_filler_index(rem_x, rem_y);
+/* Average each quad of 4 consecutive pixels, a byte at a time */
+static void
+texture_32_mipmap_quads(unsigned char *dest, const unsigned char *source,
+			int count)
+{
+	int i = 0;
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+	for (; (i + 4) <= count; i += 4) {
+		uint32x4x4_t p = vld4q_u32((const uint32_t *) (source + 16 * i));
+		uint8x16_t p0 = vreinterpretq_u8_u32(p.val[0]);
+		uint8x16_t p1 = vreinterpretq_u8_u32(p.val[1]);
+		uint8x16_t p2 = vreinterpretq_u8_u32(p.val[2]);
+		uint8x16_t p3 = vreinterpretq_u8_u32(p.val[3]);
+		uint16x8_t low, high;
+
+		low = vaddq_u16(vaddl_u8(vget_low_u8(p0), vget_low_u8(p1)),
+				vaddl_u8(vget_low_u8(p2), vget_low_u8(p3)));
+		high = vaddq_u16(vaddl_u8(vget_high_u8(p0), vget_high_u8(p1)),
+				 vaddl_u8(vget_high_u8(p2), vget_high_u8(p3)));
+		vst1q_u8(dest + 4 * i, vcombine_u8(vshrn_n_u16(low, 2),
+						   vshrn_n_u16(high, 2)));
+	}
+#endif
 
-			source = &pixels[y * source_pitch + 4 * x];
-			dest = level->dest;
-			dest += (4 * 256) * (block_y * block_pitch + block_x);
-			dest += 4 * index;
+	for (; i < count; i++) {
+		const unsigned char *s = source + 16 * i;
+		unsigned char *d = dest + 4 * i;
 
-			dest[0] = source[0];
-			dest[1] = source[1];
-			dest[2] = source[2];
-			dest[3] = source[3];
-		}
+		d[0] = (s[0] + s[4] + s[8] + s[12]) / 4;
+		d[1] = (s[1] + s[5] + s[9] + s[13]) / 4;
+		d[2] = (s[2] + s[6] + s[10] + s[14]) / 4;
+		d[3] = (s[3] + s[7] + s[11] + s[15]) / 4;
 	}
-
-	level->uploaded = 1;
 }
 
 /*
@@ -617,12 +837,18 @@ texture_32_mipmap_auto(struct limare_texture_level *dst,
 			dest[3] = (source[3] + source[7]) / 2;
 		}
 	} else {
+		int full_width = dst->width & ~0x0F;
+		int full_height = dst->height & ~0x0F;
+
+		texture_mipmap_blocks(dst, src, 4, texture_32_mipmap_quads);
+
 		for (y = 0; y < dst->height; y++) {
 			block_y = y >> 4;
 			dy = y & 0x0F;
 			source_y = y >> 3;
 
-			for (x = 0; x < dst->width; x++) {
+			for (x = y < full_height ? full_width : 0;
+			     x < dst->width; x++) {
 				block_x = x >> 4;
 				dx = x & 0x0F;
 				source_x = x >> 3;
@@ -685,23 +911,7 @@ texture_32_allocate(struct limare_state *state, struct limare_texture *texture)
 		size += level->size;
 	}
 
-	if ((state->aux_mem_size - state->aux_mem_used) < size) {
-		printf("%s: size (0x%X) exceeds available size (0x%X)\n",
-		       __func__, size,
-		       state->aux_mem_size - state->aux_mem_used);
-		return -1;
-	}
-
-	for (i = start; i < texture->levels; i++) {
-		level = &texture->level[i];
-
-		level->dest = state->aux_mem_address + state->aux_mem_used;
-		level->mem_physical =
-			state->aux_mem_physical + state->aux_mem_used;
-		state->aux_mem_used += level->size;
-	}
-
-	return 0;
+	return texture_levels_allocate(state, texture, start, size);
 }
 
 static int
@@ -723,6 +933,302 @@ texture_32_create(struct limare_state *state, struct limare_texture *texture,
 	return 0;
 }
 
+/*
+ *
+ * ETC1: 4x4 texel blocks of 8 bytes, a quarter of the size of RGB 565.
+ *
+ * The blocks are not swizzled, they are stored row after row in the order
+ * of the specification, so these textures use the linear layout.
+ *
+ */
+static const int etc1_modifiers[8][2] = {
+	{2, 8}, {5, 17}, {9, 29}, {13, 42},
+	{18, 60}, {24, 80}, {33, 106}, {47, 183},
+};
+
+static inline int
+etc1_clamp(int value)
+{
+	if (value < 0)
+		return 0;
+	if (value > 255)
+		return 255;
+	return value;
+}
+
+/*
+ * Find the modifier table which fits the 8 texels of a sub block around
+ * base best. Index 0 and 1 are small and large positive, 2 and 3 are small
+ * and large negative. Returns the squared error.
+ */
+static int
+etc1_sub_block_encode(unsigned char texels[8][3], const int base[3],
+		      int *table, int indices[8])
+{
+	int best = 0x7FFFFFFF;
+	int t, i, m, c;
+
+	for (t = 0; t < 8; t++) {
+		int error = 0, choice[8];
+
+		for (i = 0; (i < 8) && (error < best); i++) {
+			int texel_error = 0x7FFFFFFF;
+
+			for (m = 0; m < 4; m++) {
+				int modifier = etc1_modifiers[t][m & 1];
+				int e = 0, d;
+
+				if (m & 2)
+					modifier = -modifier;
+
+				for (c = 0; c < 3; c++) {
+					d = etc1_clamp(base[c] + modifier) -
+						texels[i][c];
+					e += d * d;
+				}
+
+				if (e < texel_error) {
+					texel_error = e;
+					choice[i] = m;
+				}
+			}
+
+			error += texel_error;
+		}
+
+		if (error < best) {
+			best = error;
+			*table = t;
+			memcpy(indices, choice, sizeof(choice));
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Encode the 4x4 block at x, y of the width x height RGBA texels, texels
+ * past the edges repeat the last row or column.
+ *
+ * This is meant for the procedural textures of the tests, and it is fast
+ * rather than good: each sub block simply gets its average colour as base,
+ * in differential mode when the two averages are close enough, and only
+ * the two orientations and the eight tables get tried.
+ */
+static void
+etc1_block_encode(unsigned char *dest, const unsigned char *rgba,
+		  int width, int height, int x, int y)
+{
+	unsigned char block[16][3], texels[2][8][3];
+	int best_error = 0x7FFFFFFF, best_flip = 0, best_diff = 0;
+	int best_quant[2][3], best_table[2], best_indices[2][8];
+	unsigned int msb = 0, lsb = 0;
+	int next[2] = {0, 0};
+	int i, j, c, flip;
+
+	/* texel p of a block is at x = p / 4, y = p % 4 */
+	for (i = 0; i < 16; i++) {
+		int tx = x + i / 4, ty = y + i % 4;
+		const unsigned char *texel;
+
+		if (tx >= width)
+			tx = width - 1;
+		if (ty >= height)
+			ty = height - 1;
+
+		texel = rgba + 4 * (ty * width + tx);
+		for (c = 0; c < 3; c++)
+			block[i][c] = texel[c];
+	}
+
+	for (flip = 0; flip < 2; flip++) {
+		int quant[2][3], base[2][3], table[2], indices[2][8];
+		int counts[2] = {0, 0}, sums[2][3] = {{0}}, diff = 1;
+		int error;
+
+		/* unflipped, the sub blocks are the left and right half */
+		for (i = 0; i < 16; i++) {
+			if (flip)
+				j = (i % 4) >= 2;
+			else
+				j = i >= 8;
+
+			for (c = 0; c < 3; c++) {
+				texels[j][counts[j]][c] = block[i][c];
+				sums[j][c] += block[i][c];
+			}
+			counts[j]++;
+		}
+
+		for (j = 0; j < 2; j++)
+			for (c = 0; c < 3; c++)
+				quant[j][c] = (sums[j][c] * 31 + 1020) / 2040;
+
+		for (c = 0; c < 3; c++)
+			if (((quant[1][c] - quant[0][c]) < -4) ||
+			    ((quant[1][c] - quant[0][c]) > 3))
+				diff = 0;
+
+		for (j = 0; j < 2; j++) {
+			for (c = 0; c < 3; c++) {
+				if (diff) {
+					base[j][c] = (quant[j][c] << 3) |
+						(quant[j][c] >> 2);
+				} else {
+					quant[j][c] =
+						(sums[j][c] * 15 + 1020) / 2040;
+					base[j][c] = quant[j][c] * 17;
+				}
+			}
+		}
+
+		error = etc1_sub_block_encode(texels[0], base[0], &table[0],
+					      indices[0]);
+		error += etc1_sub_block_encode(texels[1], base[1], &table[1],
+					       indices[1]);
+
+		if (error < best_error) {
+			best_error = error;
+			best_flip = flip;
+			best_diff = diff;
+			memcpy(best_quant, quant, sizeof(quant));
+			memcpy(best_table, table, sizeof(table));
+			memcpy(best_indices, indices, sizeof(indices));
+		}
+	}
+
+	for (c = 0; c < 3; c++) {
+		if (best_diff)
+			dest[c] = (best_quant[0][c] << 3) |
+				((best_quant[1][c] - best_quant[0][c]) & 0x07);
+		else
+			dest[c] = (best_quant[0][c] << 4) | best_quant[1][c];
+	}
+	dest[3] = (best_table[0] << 5) | (best_table[1] << 2) |
+		(best_diff << 1) | best_flip;
+
+	/* walk the texels in the same order as they were gathered. */
+	for (i = 0; i < 16; i++) {
+		int index;
+
+		if (best_flip)
+			j = (i % 4) >= 2;
+		else
+			j = i >= 8;
+
+		index = best_indices[j][next[j]++];
+		msb |= (index >> 1) << i;
+		lsb |= (index & 1) << i;
+	}
+
+	dest[4] = msb >> 8;
+	dest[5] = msb;
+	dest[6] = lsb >> 8;
+	dest[7] = lsb;
+}
+
+/*
+ * Compress width x height RGBA texels into ETC1 blocks, for procedural
+ * textures which are generated at runtime. The result needs to be freed.
+ */
+void *
+limare_etc1_encode(const void *rgba, int width, int height)
+{
+	int blocks_x = ALIGN(width, 4) >> 2;
+	int blocks_y = ALIGN(height, 4) >> 2;
+	unsigned char *blocks;
+	int x, y;
+
+	blocks = malloc(blocks_x * blocks_y * 8);
+	if (!blocks) {
+		printf("%s: Error: failed to allocate %d blocks\n", __func__,
+		       blocks_x * blocks_y);
+		return NULL;
+	}
+
+	for (y = 0; y < blocks_y; y++)
+		for (x = 0; x < blocks_x; x++)
+			etc1_block_encode(blocks + 8 * (y * blocks_x + x),
+					  rgba, width, height, 4 * x, 4 * y);
+
+	return blocks;
+}
+
+static int
+texture_etc1_level_size(int width, int height)
+{
+	return (ALIGN(width, 4) >> 2) * (ALIGN(height, 4) >> 2) * 8;
+}
+
+static void
+texture_etc1_copy(struct limare_texture_level *level, const void *blocks)
+{
+	memcpy(level->dest, blocks,
+	       texture_etc1_level_size(level->width, level->height));
+
+	level->uploaded = 1;
+}
+
+static int
+texture_etc1_allocate(struct limare_state *state,
+		      struct limare_texture *texture)
+{
+	struct limare_texture_level *level;
+	int i, size = 0, start;
+
+	if (texture->level[0].uploaded)
+		start = 1;
+	else
+		start = 0;
+
+	for (i = start; i < texture->levels; i++) {
+		level = &texture->level[i];
+
+		level->level = i;
+
+		level->width = texture->width >> i;
+		level->height = texture->height >> i;
+		if (!level->width)
+			level->width = 1;
+		if (!level->height)
+			level->height = 1;
+
+		level->size = ALIGN(texture_etc1_level_size(level->width,
+							    level->height),
+				    0x400);
+		size += level->size;
+	}
+
+	return texture_levels_allocate(state, texture, start, size);
+}
+
+/*
+ * There is no decoder here, so the lower levels cannot be generated from
+ * the blocks, they have to come through limare_texture_mipmap_upload.
+ */
+static int
+texture_etc1_create(struct limare_state *state,
+		    struct limare_texture *texture, const void *src)
+{
+	int ret;
+
+	if ((texture->width & 3) || (texture->height & 3)) {
+		printf("%s: Error: %dx%d is not a whole number of blocks\n",
+		       __func__, texture->width, texture->height);
+		return -1;
+	}
+
+	texture->levels = 1;
+
+	ret = texture_etc1_allocate(state, texture);
+	if (ret)
+		return ret;
+
+	texture_etc1_copy(&texture->level[0], src);
+
+	return 0;
+}
+
 static void
 texture_descriptor_level_attach(struct limare_texture *texture, int i)
 {
@@ -848,16 +1354,17 @@ limare_texture_create(struct limare_state *state, const void *src,
 	 * grab space for descriptor first, so that we can catch space issues
 	 * in a nicer way.
 	 */
-	if ((state->aux_mem_size - state->aux_mem_used) < 0x40) {
+	texture->descriptor_offset = limare_aux_alloc(state, 0x40);
+	if (texture->descriptor_offset < 0) {
 		free(texture);
 		printf("%s: No more space for texture descriptor.\n", __func__);
 		return NULL;
 	}
 
-	texture->descriptor = state->aux_mem_address + state->aux_mem_used;
+	texture->descriptor = state->aux_mem_address +
+		texture->descriptor_offset;
 	texture->descriptor_physical = state->aux_mem_physical +
-		state->aux_mem_used;
-	state->aux_mem_used += 0x40;
+		texture->descriptor_offset;
 
 	/*
 	 * now do the actual work.
@@ -865,6 +1372,7 @@ limare_texture_create(struct limare_state *state, const void *src,
 	switch (texture->format) {
 	case LIMA_TEXEL_FORMAT_BGR_565:
 		if (texture_rgb565_create(state, texture, src)) {
+			limare_aux_free(state, texture->descriptor_offset, 0x40);
 			free(texture);
 			return NULL;
 		}
@@ -879,6 +1387,7 @@ limare_texture_create(struct limare_state *state, const void *src,
 	// case LIMA_TEXEL_FORMAT_LA_88:
 	case LIMA_TEXEL_FORMAT_RGB_888:
 		if (texture_24_create(state, texture, src)) {
+			limare_aux_free(state, texture->descriptor_offset, 0x40);
 			free(texture);
 			return NULL;
 		}
@@ -890,6 +1399,7 @@ limare_texture_create(struct limare_state *state, const void *src,
 	case LIMA_TEXEL_FORMAT_RGBA_8888:
 	// case LIMA_TEXEL_FORMAT_BGRA_8888:
 		if (texture_32_create(state, texture, src)) {
+			limare_aux_free(state, texture->descriptor_offset, 0x40);
 			free(texture);
 			return NULL;
 		}
@@ -898,11 +1408,22 @@ limare_texture_create(struct limare_state *state, const void *src,
 		flag1 = 0;
 		layout = 3;
 		break;
+	case LIMA_TEXEL_FORMAT_ETC1_RGB8:
+		if (texture_etc1_create(state, texture, src)) {
+			limare_aux_free(state, texture->descriptor_offset, 0x40);
+			free(texture);
+			return NULL;
+		}
+
+		flag0 = 1;
+		flag1 = 0;
+		layout = 0;
+		break;
 	// case LIMA_TEXEL_FORMAT_RGBA64:
 	// case LIMA_TEXEL_FORMAT_DEPTH_STENCIL_32:
 	default:
 		printf("%s: unsupported format %x\n", __func__, format);
-		state->aux_mem_used -= 0x40;
+		limare_aux_free(state, texture->descriptor_offset, 0x40);
 		free(texture);
 		return NULL;
 	}
@@ -934,6 +1455,75 @@ limare_texture_create(struct limare_state *state, const void *src,
 	return texture;
 }
 
+/*
+ * A single level RGBA8888 texture on top of memory which is already in
+ * the mali address space. Nothing gets copied or swizzled, so the caller
+ * has to know what layout the texels in there are in.
+ */
+struct limare_texture *
+limare_texture_create_external(struct limare_state *state, void *address,
+			       unsigned int physical, int width, int height,
+			       int format)
+{
+	struct limare_texture *texture;
+
+	if ((format != LIMA_TEXEL_FORMAT_RGBA_8888) ||
+	    (width > 4096) || (height > 4096) || (width & 0x0F) ||
+	    (height & 0x0F) || (physical & 0x3F)) {
+		printf("%s: Error: unsupported %dx%d texture (0x%x) at 0x%08X\n",
+		       __func__, width, height, format, physical);
+		return NULL;
+	}
+
+	texture = calloc(1, sizeof(struct limare_texture));
+	if (!texture)
+		return NULL;
+
+	texture->descriptor_offset = limare_aux_alloc(state, 0x40);
+	if (texture->descriptor_offset < 0) {
+		free(texture);
+		printf("%s: No more space for texture descriptor.\n", __func__);
+		return NULL;
+	}
+
+	texture->descriptor = state->aux_mem_address +
+		texture->descriptor_offset;
+	texture->descriptor_physical = state->aux_mem_physical +
+		texture->descriptor_offset;
+
+	texture->width = width;
+	texture->height = height;
+	texture->format = format;
+	texture->levels = 1;
+	texture->external = 1;
+
+	texture->level[0].width = width;
+	texture->level[0].height = height;
+	texture->level[0].size = width * height * 4;
+	texture->level[0].dest = address;
+	texture->level[0].mem_physical = physical;
+	texture->level[0].uploaded = 1;
+
+	/* we want every texel exactly as it is in memory. */
+	texture->filter_mag = GL_NEAREST;
+	texture->filter_min = GL_NEAREST;
+	texture->wrap_s = GL_CLAMP_TO_EDGE;
+	texture->wrap_t = GL_CLAMP_TO_EDGE;
+
+	texture->descriptor[0] = (1 << 7) | format;
+	texture->descriptor[1] = 0x00000400;
+	texture->descriptor[2] = (width << 22);
+	texture->descriptor[3] = 0x10000 | (height << 3) | (width >> 10);
+	texture->descriptor[6] = 3 << 13;
+
+	texture_descriptor_levels_attach(texture);
+	limare_texture_parameters_set(texture);
+
+	texture->complete = 1;
+
+	return texture;
+}
+
 int
 limare_texture_mipmap_upload_low(struct limare_state *state,
 				 struct limare_texture *texture,
@@ -974,6 +1564,9 @@ limare_texture_mipmap_upload_low(struct limare_state *state,
 		// case LIMA_TEXEL_FORMAT_BGRA_8888:
 			ret = texture_32_allocate(state, texture);
 			break;
+		case LIMA_TEXEL_FORMAT_ETC1_RGB8:
+			ret = texture_etc1_allocate(state, texture);
+			break;
 		// case LIMA_TEXEL_FORMAT_RGBA64:
 		// case LIMA_TEXEL_FORMAT_DEPTH_STENCIL_32:
 		default:
@@ -1005,6 +1598,9 @@ limare_texture_mipmap_upload_low(struct limare_state *state,
 	// case LIMA_TEXEL_FORMAT_BGRA_8888:
 		texture_32_swizzle(&texture->level[level], pixels);
 		break;
+	case LIMA_TEXEL_FORMAT_ETC1_RGB8:
+		texture_etc1_copy(&texture->level[level], pixels);
+		break;
 	// case LIMA_TEXEL_FORMAT_RGBA64:
 	// case LIMA_TEXEL_FORMAT_DEPTH_STENCIL_32:
 	default:
@@ -1026,6 +1622,67 @@ limare_texture_mipmap_upload_low(struct limare_state *state,
 	return 0;
 }
 
+/*
+ * Free the AUX memory of all the levels and of the descriptor, and the
+ * texture itself.
+ */
+void
+limare_texture_destroy(struct limare_state *state,
+		       struct limare_texture *texture)
+{
+	int i;
+
+	for (i = 0; i < texture->levels; i++)
+		if (texture->level[i].dest && !texture->external)
+			limare_aux_free(state, texture->level[i].mem_offset,
+					texture->level[i].size);
+
+	limare_aux_free(state, texture->descriptor_offset, 0x40);
+	free(texture);
+}
+
+/*
+ * Replace the width x height rectangle at (x, y) of the top level in place,
+ * without allocating any AUX memory. Only the 16x16 blocks which the
+ * rectangle touches get swizzled. Like glTexSubImage2D, this leaves the
+ * lower mipmap levels alone.
+ */
+int
+limare_texture_sub_upload_low(struct limare_texture *texture, int x, int y,
+			      int width, int height, const void *pixels)
+{
+	struct limare_texture_level *level = &texture->level[0];
+
+	if ((x < 0) || (y < 0) || (width <= 0) || (height <= 0) ||
+	    ((x + width) > level->width) || ((y + height) > level->height)) {
+		printf("%s: %dx%d at %d,%d is outside the %dx%d texture\n",
+		       __func__, width, height, x, y, level->width,
+		       level->height);
+		return -1;
+	}
+
+	switch (texture->format) {
+	case LIMA_TEXEL_FORMAT_BGR_565:
+		texture_swizzle_rect(level, pixels, 2, ALIGN(width * 2, 4),
+				     x, y, width, height);
+		break;
+	case LIMA_TEXEL_FORMAT_RGB_888:
+		texture_swizzle_rect(level, pixels, 3, ALIGN(width * 3, 4),
+				     x, y, width, height);
+		break;
+	case LIMA_TEXEL_FORMAT_RGBA_8888:
+		texture_swizzle_rect(level, pixels, 4, width * 4,
+				     x, y, width, height);
+		break;
+	default:
+		printf("%s: unsupported format %x\n", __func__,
+		       texture->format);
+		return -1;
+	}
+
+	return 0;
+}
+
 int
 limare_texture_parameters_set(struct limare_texture *texture)
 {
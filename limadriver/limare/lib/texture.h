@@ -35,6 +35,7 @@ struct limare_texture_level {
 
 	/* GPU-AUX space */
 	unsigned char *dest;
+	int mem_offset;
 	int mem_physical;
 };
 
@@ -54,9 +55,13 @@ struct limare_texture {
 	/* in AUX space */
 	unsigned int *descriptor;
 	unsigned int descriptor_physical;
+	int descriptor_offset;
 
 	int levels;
 	struct limare_texture_level level[13];
+
+	/* memory mapped in from elsewhere, see limare_texture_external */
+	int external;
 };
 
 struct limare_texture *
@@ -65,6 +70,16 @@ limare_texture_create(struct limare_state *state, const void *src,
 int limare_texture_mipmap_upload_low(struct limare_state *state,
 				     struct limare_texture *texture,
 				     int level, const void *pixels);
+int limare_texture_sub_upload_low(struct limare_texture *texture, int x, int y,
+				  int width, int height, const void *pixels);
 int limare_texture_parameters_set(struct limare_texture *texture);
+struct limare_texture *
+limare_texture_create_external(struct limare_state *state, void *address,
+			       unsigned int physical, int width, int height,
+			       int format);
+void limare_texture_destroy(struct limare_state *state,
+			    struct limare_texture *texture);
+
+void *limare_etc1_encode(const void *rgba, int width, int height);
 
 #endif /* LIMARE_TEXTURE_H */
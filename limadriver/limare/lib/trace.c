@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Event tracing: with LIMA_TRACE set to a file name, every traced thread
+ * appends its events to a ring buffer of its own, LIMARE_TRACE_EVENTS
+ * deep, with plain stores and no locking. The rings are written out in
+ * the Chrome trace event format (chrome://tracing, or ui.perfetto.dev)
+ * on exit and on every SIGUSR1, so the memtester passes, the gpu jobs,
+ * the notifications and the flips all show up on one timeline.
+ *
+ * A dump doesn't stop the threads, so the events that get overwritten
+ * while it runs can come out torn. That's the price of not having the
+ * threads take a lock for every event.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+#define LIMARE_TRACE_EVENTS 16384
+
+struct limare_trace_event {
+	uint64_t time; /* CLOCK_MONOTONIC, in ns */
+	const char *name;
+	uint64_t arg;
+	char phase;
+};
+
+struct limare_trace_ring {
+	struct limare_trace_ring *next;
+	int tid;
+	const char *name;
+
+	uint64_t count; /* events ever recorded */
+	struct limare_trace_event events[LIMARE_TRACE_EVENTS];
+};
+
+int limare_trace_enabled;
+
+static const char *limare_trace_path;
+static struct limare_trace_ring *limare_trace_rings;
+static __thread struct limare_trace_ring *limare_trace_ring;
+static pthread_once_t limare_trace_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t limare_trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sem_t limare_trace_request;
+
+static void
+limare_trace_signal(int sig)
+{
+	/* the only thing in here that is async signal safe. */
+	sem_post(&limare_trace_request);
+}
+
+static void *
+limare_trace_dump_thread(void *arg)
+{
+	while (1) {
+		if (sem_wait(&limare_trace_request))
+			continue;
+		limare_trace_dump();
+	}
+
+	return NULL;
+}
+
+static void
+limare_trace_exit(void)
+{
+	limare_trace_dump();
+}
+
+static void
+limare_trace_setup(void)
+{
+	pthread_t thread;
+
+	limare_trace_path = getenv("LIMA_TRACE");
+	if (!limare_trace_path || !limare_trace_path[0])
+		return;
+
+	sem_init(&limare_trace_request, 0, 0);
+	if (pthread_create(&thread, NULL, limare_trace_dump_thread, NULL)) {
+		printf("%s: failed to start the dump thread\n", __func__);
+		return;
+	}
+	signal(SIGUSR1, limare_trace_signal);
+	atexit(limare_trace_exit);
+
+	printf("tracing to %s, on exit and on SIGUSR1\n", limare_trace_path);
+	limare_trace_enabled = 1;
+}
+
+/*
+ * Called by everything that traces, before its threads start. Only the
+ * first call does anything.
+ */
+void
+limare_trace_init(void)
+{
+	pthread_once(&limare_trace_once, limare_trace_setup);
+}
+
+static struct limare_trace_ring *
+limare_trace_ring_get(void)
+{
+	struct limare_trace_ring *ring = limare_trace_ring;
+
+	if (ring)
+		return ring;
+
+	ring = calloc(1, sizeof(struct limare_trace_ring));
+	if (!ring)
+		return NULL;
+	ring->tid = syscall(SYS_gettid);
+
+	ring->next = __atomic_load_n(&limare_trace_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&limare_trace_rings, &ring->next,
+					    ring, 1, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED))
+		;
+
+	limare_trace_ring = ring;
+	return ring;
+}
+
+/* The name of the calling thread in the trace. */
+void
+limare_trace_thread(const char *name)
+{
+	struct limare_trace_ring *ring;
+
+	if (!limare_trace_enabled)
+		return;
+
+	ring = limare_trace_ring_get();
+	if (ring)
+		ring->name = name;
+}
+
+void
+limare_trace_record(const char *name, char phase, uint64_t arg)
+{
+	struct limare_trace_ring *ring = limare_trace_ring_get();
+	struct limare_trace_event *event;
+	struct timespec t;
+
+	if (!ring)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	event = &ring->events[ring->count % LIMARE_TRACE_EVENTS];
+	event->time = t.tv_sec * 1000000000ULL + t.tv_nsec;
+	event->name = name;
+	event->arg = arg;
+	event->phase = phase;
+
+	/* the dump only looks at the events before the count. */
+	__atomic_store_n(&ring->count, ring->count + 1, __ATOMIC_RELEASE);
+}
+
+static void
+limare_trace_event_write(FILE *file, const struct limare_trace_ring *ring,
+			 const struct limare_trace_event *event, int *first)
+{
+	fprintf(file, "%s\n{\"name\": \"%s\", \"ph\": \"%c\", "
+		"\"ts\": %.3f, \"pid\": %d, \"tid\": %d", *first ? "" : ",",
+		event->name, event->phase, event->time / 1000.0, getpid(),
+		ring->tid);
+
+	switch (event->phase) {
+	case LIMARE_TRACE_ASYNC_BEGIN:
+	case LIMARE_TRACE_ASYNC_END:
+		fprintf(file, ", \"cat\": \"%s\", \"id\": \"0x%llx\"}",
+			event->name, (unsigned long long) event->arg);
+		break;
+	case LIMARE_TRACE_INSTANT:
+		fprintf(file, ", \"s\": \"t\", \"args\": {\"arg\": %llu}}",
+			(unsigned long long) event->arg);
+		break;
+	default:
+		fprintf(file, ", \"args\": {\"arg\": %llu}}",
+			(unsigned long long) event->arg);
+		break;
+	}
+	*first = 0;
+}
+
+/*
+ * Write all the rings out to LIMA_TRACE, replacing what an earlier dump
+ * left there. Returns 0 on success.
+ */
+int
+limare_trace_dump(void)
+{
+	struct limare_trace_ring *ring;
+	char tmp[4096];
+	FILE *file;
+	int first = 1;
+
+	if (!limare_trace_enabled)
+		return -1;
+
+	pthread_mutex_lock(&limare_trace_mutex);
+
+	/* a dump that gets interrupted leaves the previous one in place. */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", limare_trace_path);
+	file = fopen(tmp, "w");
+	if (!file) {
+		printf("%s: failed to open %s\n", __func__, tmp);
+		pthread_mutex_unlock(&limare_trace_mutex);
+		return -1;
+	}
+
+	fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+
+	for (ring = __atomic_load_n(&limare_trace_rings, __ATOMIC_ACQUIRE);
+	     ring; ring = ring->next) {
+		uint64_t count = __atomic_load_n(&ring->count,
+						 __ATOMIC_ACQUIRE);
+		uint64_t i = 0;
+
+		if (ring->name) {
+			fprintf(file, "%s\n{\"name\": \"thread_name\", "
+				"\"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+				"\"args\": {\"name\": \"%s\"}}",
+				first ? "" : ",", getpid(), ring->tid,
+				ring->name);
+			first = 0;
+		}
+
+		if (count > LIMARE_TRACE_EVENTS)
+			i = count - LIMARE_TRACE_EVENTS;
+		for (; i < count; i++)
+			limare_trace_event_write(file, ring,
+				&ring->events[i % LIMARE_TRACE_EVENTS], &first);
+	}
+
+	fprintf(file, "\n]}\n");
+	fclose(file);
+
+	rename(tmp, limare_trace_path);
+
+	pthread_mutex_unlock(&limare_trace_mutex);
+	return 0;
+}
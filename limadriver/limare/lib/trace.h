@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Low overhead event tracing, into a ring buffer per thread, see trace.c.
+ */
+
+#ifndef LIMARE_TRACE_H
+#define LIMARE_TRACE_H 1
+
+#include <stdint.h>
+
+/* The Chrome trace event phases which we use. */
+#define LIMARE_TRACE_BEGIN 'B'
+#define LIMARE_TRACE_END 'E'
+#define LIMARE_TRACE_INSTANT 'i'
+#define LIMARE_TRACE_ASYNC_BEGIN 'b'
+#define LIMARE_TRACE_ASYNC_END 'e'
+
+extern int limare_trace_enabled;
+
+void limare_trace_init(void);
+void limare_trace_thread(const char *name);
+void limare_trace_record(const char *name, char phase, uint64_t arg);
+int limare_trace_dump(void);
+
+/*
+ * 'name' has to be a string constant, only the pointer gets stored. For
+ * the async phases, 'arg' is the id which pairs the begin and the end,
+ * otherwise it just shows up as the argument of the event.
+ */
+static inline void
+limare_trace(const char *name, char phase, uint64_t arg)
+{
+	if (limare_trace_enabled)
+		limare_trace_record(name, phase, arg);
+}
+
+#endif /* LIMARE_TRACE_H */
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Template file for benchmarking a dumped stream: the captured frame is
+ * loaded once, and then its gp and pp job get resubmitted over and over.
+ *
+ * Copy a frame of a LIMA_WRAP_LOG capture over dumped_stream.c, it needs to
+ * come from the same kernel version as it will be replayed on.
+ *
+ *   replay [-n frames] [-i seconds] [-r address]
+ *
+ * The memory goes back where it was captured, unless that lies below the
+ * memory that our kernel hands out, or unless -r moves it to the given
+ * address. Job statistics get printed every -i seconds, in the same form
+ * as the other limare users print them, so that the results compare.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "linux/ioctl.h"
+#include "dump.h"
+#include "limare.h"
+#include "jobs.h"
+
+#include "dumped_stream.c"
+
+static double
+replay_time(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec / 1000000000.0;
+}
+
+static void
+replay_relocate(unsigned int physical)
+{
+	int delta = physical - dumped_mem_base(&dumped_mem);
+
+	if (!delta)
+		return;
+
+	printf("Relocating dumped memory from 0x%08x to 0x%08x\n",
+	       dumped_mem_base(&dumped_mem), physical);
+
+	/* past the fd and the user job pointer. */
+	dumped_mem_relocate_words(&dumped_mem, ((unsigned int *) &gp_job) + 2,
+				  sizeof(gp_job) / 4 - 2, delta);
+	dumped_mem_relocate_words(&dumped_mem, ((unsigned int *) &pp_job) + 2,
+				  sizeof(pp_job) / 4 - 2, delta);
+
+	dumped_mem_relocate(&dumped_mem, delta);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct limare_state *state;
+	struct limare_job_stats stats;
+	unsigned int physical = 0;
+	int frames = 1000, i, ret, c;
+	double interval = 5.0, start, last, now;
+
+	while ((c = getopt(argc, argv, "n:i:r:")) != -1) {
+		switch (c) {
+		case 'n':
+			frames = atoi(optarg);
+			break;
+		case 'i':
+			interval = atof(optarg);
+			break;
+		case 'r':
+			physical = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n frames] [-i seconds] "
+				"[-r address]\n", argv[0]);
+			return -1;
+		}
+	}
+
+	state = limare_init();
+	if (!state)
+		return -1;
+
+	if (!physical && (dumped_mem_base(&dumped_mem) < state->mem_base))
+		physical = state->mem_base;
+	if (physical)
+		replay_relocate(physical);
+
+	ret = dumped_mem_load(state->fd, &dumped_mem);
+	if (ret)
+		return ret;
+
+	limare_job_stats_get(state, &stats, 1);
+
+	start = last = replay_time();
+
+	for (i = 0; !frames || (i < frames); i++) {
+		ret = limare_dumped_job_run(state, i, &gp_job, &pp_job);
+		if (ret)
+			return ret;
+
+		now = replay_time();
+		if ((now - last) >= interval) {
+			limare_job_stats_get(state, &stats, 1);
+			limare_job_stats_print("replay", &stats);
+			last = now;
+		}
+	}
+
+	now = replay_time();
+	printf("Replayed %d frames of %dx%d in %.2fs: %.2f fps\n", i,
+	       dump_render_width, dump_render_height, now - start,
+	       (now > start) ? i / (now - start) : 0.0);
+
+	limare_job_stats_get(state, &stats, 1);
+	if (stats.histograms[LIMARE_JOB_STAT_PP].count)
+		limare_job_stats_print("replay", &stats);
+
+	limare_finish(state);
+
+	return 0;
+}
@@ -35,6 +35,11 @@
 #include <ctype.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/syscall.h>
 
 #include <linux/fb.h>
 
@@ -46,9 +51,12 @@
 #include "formats.h"
 #include "linux/ioctl.h"
 #include "bmp.h"
+#include "wrap_trace.h"
 
+#ifndef WRAP_DECODE
 static int fb_ioctl(int request, void *data);
 static int mali_ioctl(int request, void *data);
+#endif
 static int mali_address_add(void *address, unsigned int size,
 			    unsigned int physical);
 static int mali_address_remove(void *address, int size);
@@ -59,8 +67,14 @@ static int mali_external_add(unsigned int address, unsigned int physical,
 static int mali_external_remove(unsigned int cookie);
 static void mali_memory_dump(void);
 static void mali_wrap_bmp_dump(void);
+static char *ioc_type_name(int type);
+#ifndef WRAP_DECODE
+static void wrap_trace_memory(void);
+#endif
 
+#ifndef WRAP_DECODE
 static pthread_mutex_t serializer[1] = { PTHREAD_MUTEX_INITIALIZER };
+#endif
 
 unsigned int render_address;
 int render_width;
@@ -104,6 +118,17 @@ serialized_stop(void)
 		pthread_mutex_unlock(serializer);
 	}
 }
+#elif defined(WRAP_DECODE)
+/* wrap_decode replays the trace from a single thread */
+static inline void
+serialized_start(const char *func)
+{
+}
+
+static inline void
+serialized_stop(void)
+{
+}
 #else
 static inline void
 serialized_start(const char *func)
@@ -198,6 +223,407 @@ lima_wrap_log_next(void)
 		wrap_log("#define LIMA_M400 1\n\n");
 }
 
+/*
+ *
+ * Binary trace.
+ *
+ */
+static int wrap_trace_fd = -1;
+
+#ifndef WRAP_DECODE
+/*
+ * With LIMA_WRAP_TRACE=file, nothing gets logged as text while the
+ * application runs, as the printing slows it down enough to change its
+ * timing. Every thread copies the ioctl arguments, the mappings and the
+ * pages of mali memory that changed since the previous gp job into a
+ * ring of its own instead, and a writer thread empties the rings into
+ * the file. wrap_decode turns the file into the usual text logs later.
+ */
+#define WRAP_RING_SIZE (1 << 20)
+
+struct wrap_ring {
+	struct wrap_ring *next;
+	uint32_t tid;
+	/* free running, head is moved by the thread, tail by the writer */
+	volatile unsigned int head;
+	volatile unsigned int tail;
+	unsigned char data[WRAP_RING_SIZE];
+};
+
+static uint64_t wrap_trace_seq;
+static struct wrap_ring *wrap_rings;
+static pthread_mutex_t wrap_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct wrap_ring *wrap_thread_ring;
+static sem_t wrap_writer_wake;
+
+static uint64_t
+wrap_time(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void
+wrap_trace_flush(void)
+{
+	struct wrap_ring *ring;
+	unsigned int head, tail, offset;
+	int count, ret;
+
+	pthread_mutex_lock(&wrap_rings_lock);
+	for (ring = wrap_rings; ring; ring = ring->next) {
+		head = ring->head;
+		__sync_synchronize();
+		for (tail = ring->tail; tail != head; tail += count) {
+			offset = tail & (WRAP_RING_SIZE - 1);
+			count = head - tail;
+			if (count > WRAP_RING_SIZE - offset)
+				count = WRAP_RING_SIZE - offset;
+			ret = write(wrap_trace_fd, ring->data + offset, count);
+			if (ret < 0 && errno == EINTR)
+				ret = 0;
+			else if (ret < 0) {
+				printf("Error: failed to write wrap trace: %s\n",
+				       strerror(errno));
+				ret = count;
+			}
+			count = ret;
+		}
+		__sync_synchronize();
+		ring->tail = tail;
+	}
+	pthread_mutex_unlock(&wrap_rings_lock);
+}
+
+static void *
+wrap_trace_writer(void *data)
+{
+	struct timespec timeout;
+
+	while (1) {
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_nsec += 100000000;
+		if (timeout.tv_nsec >= 1000000000) {
+			timeout.tv_sec++;
+			timeout.tv_nsec -= 1000000000;
+		}
+		sem_timedwait(&wrap_writer_wake, &timeout);
+		wrap_trace_flush();
+	}
+
+	return NULL;
+}
+
+/*
+ * Start the binary trace if LIMA_WRAP_TRACE is set, when /dev/mali gets
+ * opened. Without it, or if the file cannot be written, the text log is
+ * used as before.
+ */
+static void
+wrap_trace_open(void)
+{
+	struct wrap_trace_header header = {
+		WRAP_TRACE_MAGIC, WRAP_TRACE_VERSION, sizeof(void *)
+	};
+	char *filename = getenv("LIMA_WRAP_TRACE");
+	pthread_t thread;
+	int fd;
+
+	if (!filename || (wrap_trace_fd != -1))
+		return;
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		printf("Error: failed to open wrap trace %s: %s\n", filename,
+		       strerror(errno));
+		return;
+	}
+
+	if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+		printf("Error: failed to write wrap trace %s: %s\n", filename,
+		       strerror(errno));
+		close(fd);
+		return;
+	}
+
+	wrap_trace_fd = fd;
+	sem_init(&wrap_writer_wake, 0, 0);
+	pthread_create(&thread, NULL, wrap_trace_writer, NULL);
+	atexit(wrap_trace_flush);
+}
+
+static void
+wrap_ring_copy(struct wrap_ring *ring, unsigned int *head, const void *data,
+	       unsigned int size)
+{
+	unsigned int offset = *head & (WRAP_RING_SIZE - 1);
+	unsigned int count = size;
+
+	if (count > WRAP_RING_SIZE - offset)
+		count = WRAP_RING_SIZE - offset;
+
+	if (size) {
+		memcpy(ring->data + offset, data, count);
+		memcpy(ring->data, data + count, size - count);
+	}
+
+	*head += size;
+}
+
+/*
+ * Append the record, followed by the payload and the extra data, to the
+ * ring of this thread. The type, ret, request, address and length are
+ * filled in by the caller.
+ */
+static void
+wrap_trace_record(struct wrap_record *record, const void *payload,
+		  unsigned int size, const void *extra, unsigned int extra_size)
+{
+	static const uint64_t padding;
+	struct wrap_ring *ring = wrap_thread_ring;
+	unsigned int head, total = size + extra_size;
+
+	if (!ring) {
+		ring = calloc(1, sizeof(struct wrap_ring));
+		if (!ring) {
+			printf("Error: no memory for a wrap trace ring\n");
+			return;
+		}
+		ring->tid = syscall(SYS_gettid);
+
+		pthread_mutex_lock(&wrap_rings_lock);
+		ring->next = wrap_rings;
+		wrap_rings = ring;
+		pthread_mutex_unlock(&wrap_rings_lock);
+
+		wrap_thread_ring = ring;
+	}
+
+	record->size = sizeof(struct wrap_record) + ((total + 7) & ~7);
+	record->payload_size = total;
+	record->tid = ring->tid;
+	record->seq = __sync_fetch_and_add(&wrap_trace_seq, 1);
+	record->time = wrap_time();
+
+	/* rather wait for the writer than lose records */
+	while ((WRAP_RING_SIZE - (ring->head - ring->tail)) < record->size) {
+		sem_post(&wrap_writer_wake);
+		usleep(1000);
+	}
+
+	head = ring->head;
+	wrap_ring_copy(ring, &head, record, sizeof(struct wrap_record));
+	wrap_ring_copy(ring, &head, payload, size);
+	wrap_ring_copy(ring, &head, extra, extra_size);
+	wrap_ring_copy(ring, &head, &padding,
+		       record->size - sizeof(struct wrap_record) - total);
+	__sync_synchronize();
+	ring->head = head;
+
+	if ((head - ring->tail) > (WRAP_RING_SIZE / 2))
+		sem_post(&wrap_writer_wake);
+}
+
+static void
+wrap_trace_event(int type, int ret, uint64_t request, const void *address,
+		 uint64_t length)
+{
+	struct wrap_record record = {
+		.type = type,
+		.ret = ret,
+		.request = request,
+		.address = (uintptr_t) address,
+		.length = length,
+	};
+
+	wrap_trace_record(&record, NULL, 0, NULL, 0);
+}
+
+/*
+ *
+ * Ioctl latency histograms.
+ *
+ * With LIMA_WRAP_STATS=file, the time every mali ioctl spends in the
+ * kernel is added to a histogram per request, and the histograms are
+ * written to that file at exit and on every SIGUSR2. Only the call
+ * itself is timed, so the numbers are those of the kernel driver and
+ * not of the logging, which makes them comparable between the r3p0,
+ * r3p1 and r3p2 kernels.
+ *
+ */
+#define WRAP_STATS_MAX 64
+#define WRAP_STATS_BUCKETS 24 /* doubling from 1us */
+
+static struct wrap_stats {
+	int request;
+	const char *name;
+	unsigned long count;
+	uint64_t total, min, max; /* ns */
+	unsigned long buckets[WRAP_STATS_BUCKETS];
+} wrap_stats[WRAP_STATS_MAX];
+
+static int wrap_stats_count;
+static char *wrap_stats_filename;
+static pthread_mutex_t wrap_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static sem_t wrap_stats_wake;
+
+static void
+wrap_stats_add(int request, const char *name, uint64_t time)
+{
+	struct wrap_stats *stats = NULL;
+	uint64_t us = time / 1000;
+	int i, bucket;
+
+	/* bucket 0 is below 1us, bucket i from 2^(i - 1) to 2^i us */
+	for (bucket = 0; us && (bucket < (WRAP_STATS_BUCKETS - 1)); bucket++)
+		us >>= 1;
+
+	pthread_mutex_lock(&wrap_stats_lock);
+
+	for (i = 0; i < wrap_stats_count; i++)
+		if (wrap_stats[i].request == request) {
+			stats = &wrap_stats[i];
+			break;
+		}
+
+	if (!stats && (wrap_stats_count < WRAP_STATS_MAX)) {
+		stats = &wrap_stats[wrap_stats_count++];
+		stats->request = request;
+		stats->name = name;
+		stats->min = time;
+	}
+
+	if (stats) {
+		stats->count++;
+		stats->total += time;
+		if (time < stats->min)
+			stats->min = time;
+		if (time > stats->max)
+			stats->max = time;
+		stats->buckets[bucket]++;
+	}
+
+	pthread_mutex_unlock(&wrap_stats_lock);
+}
+
+static int
+wrap_stats_compare(const void *a, const void *b)
+{
+	const struct wrap_stats *sa = a, *sb = b;
+
+	if (sa->total > sb->total)
+		return -1;
+	return sa->total < sb->total;
+}
+
+/* Most time spent first, with a histogram of the call times */
+static void
+wrap_stats_dump(void)
+{
+	struct wrap_stats stats[WRAP_STATS_MAX];
+	unsigned long most;
+	char name[32];
+	int count, i, j;
+	FILE *file;
+
+	pthread_mutex_lock(&wrap_stats_lock);
+	count = wrap_stats_count;
+	memcpy(stats, wrap_stats, count * sizeof(struct wrap_stats));
+	pthread_mutex_unlock(&wrap_stats_lock);
+
+	qsort(stats, count, sizeof(struct wrap_stats), wrap_stats_compare);
+
+	file = fopen(wrap_stats_filename, "w");
+	if (!file) {
+		printf("Error: failed to open wrap stats %s: %s\n",
+		       wrap_stats_filename, strerror(errno));
+		return;
+	}
+
+	/* only known once the text log has parsed GET_API_VERSION */
+	if (mali_version)
+		fprintf(file, "Time spent in the mali kernel driver, api "
+			"version %d:\n", mali_version);
+	else
+		fprintf(file, "Time spent in the mali kernel driver:\n");
+
+	for (i = 0; i < count; i++) {
+		char *type = ioc_type_name(_IOC_TYPE(stats[i].request));
+
+		if (stats[i].name)
+			snprintf(name, sizeof(name), "%s", stats[i].name);
+		else if (type)
+			snprintf(name, sizeof(name), "%s:%02X", type,
+				 _IOC_NR(stats[i].request));
+		else
+			snprintf(name, sizeof(name), "%02X:%02X",
+				 _IOC_TYPE(stats[i].request),
+				 _IOC_NR(stats[i].request));
+
+		fprintf(file, "\n%-30s %8lu calls, %10.1fus average, "
+			"%10.1fus min, %10.1fus max, %8.3fs total\n", name,
+			stats[i].count, stats[i].total / 1000.0 / stats[i].count,
+			stats[i].min / 1000.0, stats[i].max / 1000.0,
+			stats[i].total / 1000000000.0);
+
+		most = 0;
+		for (j = 0; j < WRAP_STATS_BUCKETS; j++)
+			if (stats[i].buckets[j] > most)
+				most = stats[i].buckets[j];
+
+		for (j = 0; j < WRAP_STATS_BUCKETS; j++) {
+			int bar = (40 * stats[i].buckets[j] + most - 1) / most;
+
+			if (!stats[i].buckets[j])
+				continue;
+			fprintf(file, "\t%8lu - %8luus %8lu %.*s\n",
+				j ? 1UL << (j - 1) : 0UL, 1UL << j,
+				stats[i].buckets[j], bar,
+				"########################################");
+		}
+	}
+
+	fclose(file);
+}
+
+static void *
+wrap_stats_thread(void *data)
+{
+	while (1) {
+		if (sem_wait(&wrap_stats_wake))
+			continue;
+		wrap_stats_dump();
+	}
+
+	return NULL;
+}
+
+static void
+wrap_stats_signal(int signal)
+{
+	sem_post(&wrap_stats_wake);
+}
+
+static void
+wrap_stats_open(void)
+{
+	pthread_t thread;
+
+	if (wrap_stats_filename)
+		return;
+
+	wrap_stats_filename = getenv("LIMA_WRAP_STATS");
+	if (!wrap_stats_filename)
+		return;
+
+	sem_init(&wrap_stats_wake, 0, 0);
+	pthread_create(&thread, NULL, wrap_stats_thread, NULL);
+	signal(SIGUSR2, wrap_stats_signal);
+	atexit(wrap_stats_dump);
+}
+
 /*
  * Wrap around the libc calls that are crucial for capturing our
  * command stream, namely, open, ioctl, and mmap.
@@ -257,6 +683,8 @@ open(const char* path, int flags, ...)
 	if (!strcmp(path, "/dev/mali")) {
 		mali = 1;
 		serialized_start(__func__);
+		wrap_trace_open();
+		wrap_stats_open();
 	} else if (!strcmp(path, "/dev/ump")) {
 		ump = 1;
 	    	serialized_start(__func__);
@@ -312,7 +740,10 @@ close(int fd)
 		orig_close = libc_dlsym(__func__);
 
 	if (fd == dev_mali_fd) {
-		wrap_log("/* CLOSE */");
+		if (wrap_trace_fd != -1)
+			wrap_trace_event(WRAP_RECORD_CLOSE, 0, 0, NULL, 0);
+		else
+			wrap_log("/* CLOSE */");
 		dev_mali_fd = -1;
 	}
 
@@ -404,13 +835,23 @@ mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
 	ret = orig_mmap(addr, length, prot, flags, fd, offset);
 
 	if (fd == dev_mali_fd) {
-		wrap_log("/* MMAP 0x%08lx (0x%08x) = %p */\n\n", offset, length, ret);
+		if (wrap_trace_fd != -1)
+			wrap_trace_event(WRAP_RECORD_MMAP, 0, offset, ret, length);
+		else
+			wrap_log("/* MMAP 0x%08lx (0x%08x) = %p */\n\n", offset, length, ret);
 		mali_address_add(ret, length, offset);
 		memset(ret, 0, length);
-	} else if (fd == dev_ump_fd)
+	} else if (fd == dev_ump_fd) {
+		if (wrap_trace_fd != -1)
+			wrap_trace_event(WRAP_RECORD_MMAP_UMP, 0, offset, ret,
+					 length);
 		ump_id_add(offset >> 12, length, ret);
-	else if (fd == dev_fb_fd)
+	} else if (fd == dev_fb_fd) {
+		if (wrap_trace_fd != -1)
+			wrap_trace_event(WRAP_RECORD_MMAP_FB, 0, offset, ret,
+					 length);
 		fb_ump_address = ret;
+	}
 
 	serialized_stop();
 
@@ -434,8 +875,12 @@ munmap(void *addr, size_t length)
 
 	ret = orig_munmap(addr, length);
 
-	if (!mali_address_remove(addr, length))
-		wrap_log("/* MUNMAP %p (0x%08x) */\n\n", addr, length);
+	if (!mali_address_remove(addr, length)) {
+		if (wrap_trace_fd != -1)
+			wrap_trace_event(WRAP_RECORD_MUNMAP, 0, 0, addr, length);
+		else
+			wrap_log("/* MUNMAP %p (0x%08x) */\n\n", addr, length);
+	}
 
 	serialized_stop();
 
@@ -463,22 +908,16 @@ fflush(FILE *stream)
 
 	return ret;
 }
+#endif /* WRAP_DECODE */
 
 /*
  * Parse FB ioctls.
  */
-static int
-fb_ioctl(int request, void *data)
-{
-	int ret;
-
-	if (data)
-		ret = orig_ioctl(dev_fb_fd, request, data);
-	else
-		ret = orig_ioctl(dev_fb_fd, request);
-
 #define GET_UMP_SECURE_ID_BUF1   _IOWR('m', 311, unsigned int)
 
+static void
+fb_ioctl_post(int request, void *data)
+{
 	if (request == FBIOGET_FSCREENINFO) {
 		struct fb_fix_screeninfo *fix = data;
 
@@ -490,9 +929,40 @@ fb_ioctl(int request, void *data)
 
 		ump_id_add(fb_ump_id, fb_ump_size, fb_ump_address);
 	}
+}
+
+#ifndef WRAP_DECODE
+static int
+fb_ioctl(int request, void *data)
+{
+	struct wrap_record record = {
+		.type = WRAP_RECORD_FB_IOCTL,
+		.request = request,
+		.address = (uintptr_t) data,
+	};
+	int ret;
+
+	if (data)
+		ret = orig_ioctl(dev_fb_fd, request, data);
+	else
+		ret = orig_ioctl(dev_fb_fd, request);
+
+	if (wrap_trace_fd != -1) {
+		record.ret = ret;
+		if (request == FBIOGET_FSCREENINFO)
+			wrap_trace_record(&record, data,
+					  sizeof(struct fb_fix_screeninfo),
+					  NULL, 0);
+		else if (request == GET_UMP_SECURE_ID_BUF1)
+			wrap_trace_record(&record, data, sizeof(unsigned int),
+					  NULL, 0);
+	}
+
+	fb_ioctl_post(request, data);
 
 	return ret;
 }
+#endif /* WRAP_DECODE */
 
 
 /*
@@ -1446,84 +1916,120 @@ ioc_type_name(int type)
 	return ioc_types[i].name;
 }
 
+/*
+ * The largest of the job structures of the different kernel versions, as
+ * the version is not known yet when the size is needed.
+ */
+union gp_job_start_args {
+	struct lima_gp_job_start_r2p1 r2p1;
+	struct lima_gp_job_start_r3p0 r3p0;
+};
+
+union pp_job_start_args {
+	struct lima_m200_pp_job_start m200;
+	struct lima_m400_pp_job_start_r2p1 r2p1;
+	struct lima_m400_pp_job_start_r3p0 r3p0;
+	struct lima_m400_pp_job_start_r3p1 r3p1;
+	struct lima_m400_pp_job_start_r3p2 r3p2;
+};
+
 struct dev_mali_ioctl_table {
 	int type;
 	int nr;
 	char *name;
 	void (*pre)(void *data);
 	void (*post)(void *data, int ret);
+	/* of the argument the handlers look at, for the binary trace */
+	int size;
 };
 
 static struct dev_mali_ioctl_table
 dev_mali_ioctls[] = {
-	{MALI_IOC_CORE_BASE, _MALI_UK_OPEN, "CORE, OPEN", NULL, NULL},
-	{MALI_IOC_CORE_BASE, _MALI_UK_CLOSE, "CORE, CLOSE", NULL, NULL},
+	{MALI_IOC_CORE_BASE, _MALI_UK_OPEN, "CORE, OPEN", NULL, NULL, 0},
+	{MALI_IOC_CORE_BASE, _MALI_UK_CLOSE, "CORE, CLOSE", NULL, NULL, 0},
 	{MALI_IOC_CORE_BASE, _MALI_UK_GET_SYSTEM_INFO_SIZE, "CORE, GET_SYSTEM_INFO_SIZE",
-	 NULL, dev_mali_get_system_info_size_post},
+	 NULL, dev_mali_get_system_info_size_post,
+	 sizeof(_mali_uk_get_system_info_size_s)},
 	{MALI_IOC_CORE_BASE, _MALI_UK_GET_SYSTEM_INFO, "CORE, GET_SYSTEM_INFO",
-	 dev_mali_get_system_info_pre, dev_mali_get_system_info_post},
+	 dev_mali_get_system_info_pre, dev_mali_get_system_info_post,
+	 sizeof(_mali_uk_get_system_info_s)},
 	{MALI_IOC_CORE_BASE, _MALI_UK_WAIT_FOR_NOTIFICATION, "CORE, WAIT_FOR_NOTIFICATION",
-	 dev_mali_wait_for_notification_pre, dev_mali_wait_for_notification_post},
+	 dev_mali_wait_for_notification_pre, dev_mali_wait_for_notification_post,
+	 sizeof(_mali_uk_wait_for_notification_s)},
 	{MALI_IOC_CORE_BASE, _MALI_UK_GET_API_VERSION, "CORE, GET_API_VERSION",
-	 dev_mali_get_api_version_pre, dev_mali_get_api_version_post},
+	 dev_mali_get_api_version_pre, dev_mali_get_api_version_post,
+	 sizeof(_mali_uk_get_api_version_s)},
 	{MALI_IOC_MEMORY_BASE, _MALI_UK_INIT_MEM, "MEMORY, INIT_MEM",
-	 NULL, dev_mali_memory_init_mem_post},
+	 NULL, dev_mali_memory_init_mem_post,
+	 sizeof(_mali_uk_init_mem_s)},
 
 	{MALI_IOC_MEMORY_BASE, _MALI_UK_MAP_EXT_MEM, "MEMORY, MAP_EXT_MEM",
-	 NULL, dev_mali_memory_map_ext_mem_post},
+	 NULL, dev_mali_memory_map_ext_mem_post,
+	 sizeof(_mali_uk_map_external_mem_s)},
 	{MALI_IOC_MEMORY_BASE, _MALI_UK_UNMAP_EXT_MEM, "MEMORY, UNMAP_EXT_MEM",
-	 NULL, dev_mali_memory_unmap_ext_mem_post},
+	 NULL, dev_mali_memory_unmap_ext_mem_post,
+	 sizeof(_mali_uk_map_external_mem_s)},
 	{MALI_IOC_PP_BASE, _MALI_UK_PP_START_JOB, "PP, START_JOB",
-	 dev_mali_pp_job_start_pre, dev_mali_pp_job_start_post},
+	 dev_mali_pp_job_start_pre, dev_mali_pp_job_start_post,
+	 sizeof(union pp_job_start_args)},
 	{MALI_IOC_PP_BASE, _MALI_UK_GET_PP_CORE_VERSION_R2P1, "PP, GET_CORE_VERSION_R2P1",
-	 NULL, dev_mali_pp_core_version_post},
+	 NULL, dev_mali_pp_core_version_post,
+	 sizeof(_mali_uk_get_pp_core_version_s)},
 	{MALI_IOC_PP_BASE, _MALI_UK_GET_PP_CORE_VERSION_R3P0, "PP, GET_CORE_VERSION_R3P0",
-	 NULL, dev_mali_pp_core_version_post},
+	 NULL, dev_mali_pp_core_version_post,
+	 sizeof(_mali_uk_get_pp_core_version_s)},
 	{MALI_IOC_GP_BASE, _MALI_UK_GP_START_JOB, "GP, START_JOB",
-	 dev_mali_gp_job_start_pre, dev_mali_gp_job_start_post},
+	 dev_mali_gp_job_start_pre, dev_mali_gp_job_start_post,
+	 sizeof(union gp_job_start_args)},
 
-	{ 0, 0, NULL, NULL, NULL}
+	{ 0, 0, NULL, NULL, NULL, 0}
 };
 
 static struct dev_mali_ioctl_table
 dev_mali_ioctls_r3p1[] = {
-	{MALI_IOC_CORE_BASE, _MALI_UK_OPEN, "CORE, OPEN", NULL, NULL},
-	{MALI_IOC_CORE_BASE, _MALI_UK_CLOSE, "CORE, CLOSE", NULL, NULL},
+	{MALI_IOC_CORE_BASE, _MALI_UK_OPEN, "CORE, OPEN", NULL, NULL, 0},
+	{MALI_IOC_CORE_BASE, _MALI_UK_CLOSE, "CORE, CLOSE", NULL, NULL, 0},
 	{MALI_IOC_CORE_BASE, _MALI_UK_WAIT_FOR_NOTIFICATION_R3P1, "CORE, WAIT_FOR_NOTIFICATION",
-	 dev_mali_wait_for_notification_pre, dev_mali_wait_for_notification_post},
+	 dev_mali_wait_for_notification_pre, dev_mali_wait_for_notification_post,
+	 sizeof(_mali_uk_wait_for_notification_s)},
 	{MALI_IOC_CORE_BASE, _MALI_UK_GET_API_VERSION_R3P1, "CORE, GET_API_VERSION",
-	 dev_mali_get_api_version_pre, dev_mali_get_api_version_post},
+	 dev_mali_get_api_version_pre, dev_mali_get_api_version_post,
+	 sizeof(_mali_uk_get_api_version_s)},
 	{MALI_IOC_MEMORY_BASE, _MALI_UK_INIT_MEM, "MEMORY, INIT_MEM",
-	 NULL, dev_mali_memory_init_mem_post},
+	 NULL, dev_mali_memory_init_mem_post,
+	 sizeof(_mali_uk_init_mem_s)},
 
 	{MALI_IOC_MEMORY_BASE, _MALI_UK_ATTACH_UMP_MEM_R3P1, "MEMORY, ATTACH_UMP_MEM",
-	 NULL, dev_mali_memory_attach_ump_mem_post},
+	 NULL, dev_mali_memory_attach_ump_mem_post,
+	 sizeof(_mali_uk_attach_ump_mem_s)},
 
 	{MALI_IOC_MEMORY_BASE, _MALI_UK_MAP_EXT_MEM_R3P1, "MEMORY, MAP_EXT_MEM",
-	 NULL, dev_mali_memory_map_ext_mem_post},
+	 NULL, dev_mali_memory_map_ext_mem_post,
+	 sizeof(_mali_uk_map_external_mem_s)},
 	{MALI_IOC_MEMORY_BASE, _MALI_UK_UNMAP_EXT_MEM_R3P1, "MEMORY, UNMAP_EXT_MEM",
-	 NULL, dev_mali_memory_unmap_ext_mem_post},
+	 NULL, dev_mali_memory_unmap_ext_mem_post,
+	 sizeof(_mali_uk_map_external_mem_s)},
 	{MALI_IOC_PP_BASE, _MALI_UK_PP_START_JOB, "PP, START_JOB",
-	 dev_mali_pp_job_start_pre, dev_mali_pp_job_start_post},
+	 dev_mali_pp_job_start_pre, dev_mali_pp_job_start_post,
+	 sizeof(union pp_job_start_args)},
 	{MALI_IOC_PP_BASE, _MALI_UK_GET_PP_CORE_VERSION_R3P0, "PP, GET_CORE_VERSION_R3P0",
-	 NULL, dev_mali_pp_core_version_post},
+	 NULL, dev_mali_pp_core_version_post,
+	 sizeof(_mali_uk_get_pp_core_version_s)},
 	{MALI_IOC_GP_BASE, _MALI_UK_GP_START_JOB, "GP, START_JOB",
-	 dev_mali_gp_job_start_pre, dev_mali_gp_job_start_post},
+	 dev_mali_gp_job_start_pre, dev_mali_gp_job_start_post,
+	 sizeof(union gp_job_start_args)},
 
-	{ 0, 0, NULL, NULL, NULL}
+	{ 0, 0, NULL, NULL, NULL, 0}
 };
 
 struct dev_mali_ioctl_table *ioctl_table;
 
-static int
-mali_ioctl(int request, void *data)
+static struct dev_mali_ioctl_table *
+mali_ioctl_find(int request)
 {
-	struct dev_mali_ioctl_table *ioctl = NULL;
 	int ioc_type = _IOC_TYPE(request);
 	int ioc_nr = _IOC_NR(request);
-	char *ioc_string = ioctl_dir_string(request);
 	int i;
-	int ret;
 
 	if (!ioctl_table) {
 		if ((ioc_type == MALI_IOC_CORE_BASE) &&
@@ -1533,13 +2039,29 @@ mali_ioctl(int request, void *data)
 			ioctl_table = dev_mali_ioctls;
 	}
 
-	for (i = 0; ioctl_table[i].name; i++) {
+	for (i = 0; ioctl_table[i].name; i++)
 		if ((ioctl_table[i].type == ioc_type) &&
-		    (ioctl_table[i].nr == ioc_nr)) {
-			ioctl = &ioctl_table[i];
-			break;
-		}
+		    (ioctl_table[i].nr == ioc_nr))
+			return &ioctl_table[i];
+
+	return NULL;
+}
+
+static void
+mali_ioctl_table_update(int request, int ret)
+{
+	if (ret == -EPERM) {
+		if ((_IOC_TYPE(request) == MALI_IOC_CORE_BASE) &&
+		    (_IOC_NR(request) == _MALI_UK_GET_API_VERSION))
+			ioctl_table = dev_mali_ioctls_r3p1;
 	}
+}
+
+static void
+mali_ioctl_pre(struct dev_mali_ioctl_table *ioctl, int request, void *data)
+{
+	int ioc_type = _IOC_TYPE(request);
+	int ioc_nr = _IOC_NR(request);
 
 	if (!ioctl) {
 		char *name = ioc_type_name(ioc_type);
@@ -1555,17 +2077,13 @@ mali_ioctl(int request, void *data)
 
 	if (ioctl && ioctl->pre)
 		ioctl->pre(data);
+}
 
-	if (data)
-		ret = orig_ioctl(dev_mali_fd, request, data);
-	else
-		ret = orig_ioctl(dev_mali_fd, request);
-
-	if (ret == -EPERM) {
-		if ((ioc_type == MALI_IOC_CORE_BASE) &&
-		    (ioc_nr == _MALI_UK_GET_API_VERSION))
-			ioctl_table = dev_mali_ioctls_r3p1;
-	}
+static void
+mali_ioctl_post(struct dev_mali_ioctl_table *ioctl, int request, void *data,
+		int ret)
+{
+	char *ioc_string = ioctl_dir_string(request);
 
 	if (ioctl && !ioctl->pre && !ioctl->post) {
 		if (data)
@@ -1578,10 +2096,105 @@ mali_ioctl(int request, void *data)
 
 	if (ioctl && ioctl->post)
 		ioctl->post(data, ret);
+}
+
+#ifndef WRAP_DECODE
+static int
+mali_ioctl_call(struct dev_mali_ioctl_table *ioctl, int request, void *data)
+{
+	uint64_t start = 0;
+	int ret;
+
+	if (wrap_stats_filename)
+		start = wrap_time();
+
+	if (data)
+		ret = orig_ioctl(dev_mali_fd, request, data);
+	else
+		ret = orig_ioctl(dev_mali_fd, request);
+
+	if (wrap_stats_filename)
+		wrap_stats_add(request, ioctl ? ioctl->name : NULL,
+			       wrap_time() - start);
 
 	return ret;
 }
 
+/*
+ * Copy the argument before and after the call into the binary trace,
+ * instead of logging it, and the mali memory right before every gp job,
+ * which is where the text log dumps it.
+ */
+static int
+mali_ioctl_trace(struct dev_mali_ioctl_table *ioctl, int request, void *data)
+{
+	struct wrap_record record = {
+		.type = WRAP_RECORD_IOCTL_PRE,
+		.request = request,
+		.address = (uintptr_t) data,
+	};
+	void *system_info = NULL;
+	int system_info_size = 0;
+	int size = 0;
+	int ret;
+
+	/* the handlers only look at the arguments of the ioctls they know */
+	if (data && ioctl && (ioctl->pre || ioctl->post))
+		size = ioctl->size;
+
+	if (ioctl && (ioctl->pre == dev_mali_gp_job_start_pre))
+		wrap_trace_memory();
+
+	wrap_trace_record(&record, data, size, NULL, 0);
+
+	/* as dev_mali_wait_for_notification_pre() does */
+	if (ioctl && (ioctl->pre == dev_mali_wait_for_notification_pre))
+		serialized_stop();
+
+	ret = mali_ioctl_call(ioctl, request, data);
+
+	if (ioctl && (ioctl->pre == dev_mali_wait_for_notification_pre))
+		serialized_start(__func__);
+
+	/* the system info is a linked list in a buffer of its own */
+	if (ioctl && (ioctl->post == dev_mali_get_system_info_post) && !ret) {
+		_mali_uk_get_system_info_s *info = data;
+
+		system_info = info->system_info;
+		system_info_size = info->size;
+	}
+
+	record.type = WRAP_RECORD_IOCTL_POST;
+	record.ret = ret;
+	wrap_trace_record(&record, data, size, system_info, system_info_size);
+
+	return ret;
+}
+
+static int
+mali_ioctl(int request, void *data)
+{
+	struct dev_mali_ioctl_table *ioctl = mali_ioctl_find(request);
+	int ret;
+
+	if (wrap_trace_fd != -1) {
+		ret = mali_ioctl_trace(ioctl, request, data);
+		mali_ioctl_table_update(request, ret);
+		return ret;
+	}
+
+	mali_ioctl_pre(ioctl, request, data);
+
+	ret = mali_ioctl_call(ioctl, request, data);
+
+	mali_ioctl_table_update(request, ret);
+
+	mali_ioctl_post(ioctl, request, data, ret);
+
+	return ret;
+}
+#endif /* WRAP_DECODE */
+
 /*
  *
  * Memory dumper.
@@ -1593,6 +2206,7 @@ static struct mali_address {
 	void *address; /* mapped address */
 	unsigned int size;
 	unsigned int physical; /* actual address */
+	void *shadow; /* what the binary trace has of it */
 } mali_addresses[MALI_ADDRESSES];
 
 static int
@@ -1616,6 +2230,9 @@ mali_address_add(void *address, unsigned int size, unsigned int physical)
 			mali_addresses[i].address = address;
 			mali_addresses[i].size = size;
 			mali_addresses[i].physical = physical;
+			/* zeroed, as the mapping is */
+			if (wrap_trace_fd != -1)
+				mali_addresses[i].shadow = calloc(1, size);
 			return 0;
 		}
 
@@ -1635,6 +2252,8 @@ mali_address_remove(void *address, int size)
 			mali_addresses[i].address = NULL;
 			mali_addresses[i].size = 0;
 			mali_addresses[i].physical = 0;
+			free(mali_addresses[i].shadow);
+			mali_addresses[i].shadow = NULL;
 			return 0;
 		}
 
@@ -1649,10 +2268,12 @@ static struct mali_external {
 	unsigned int cookie;
 } mali_externals[MALI_EXTERNALS];
 
-static int fb_fd = -1;
-static char *fbdev_name = "/dev/fb0";
 static unsigned int fb_physical;
 static void *fb_map = ((void *) -1);
+
+#ifndef WRAP_DECODE
+static int fb_fd = -1;
+static char *fbdev_name = "/dev/fb0";
 static int fb_map_size;
 
 static int
@@ -1697,12 +2318,14 @@ mali_map_fb(void)
 
 	return 0;
 }
+#endif /* WRAP_DECODE */
 
 static int
 mali_external_add(unsigned int address, unsigned int physical, unsigned int size, unsigned int cookie)
 {
 	int i;
 
+#ifndef WRAP_DECODE
 	if (fb_map == ((void *) -1)) {
 		if (mali_map_fb())
 			exit(1);
@@ -1714,6 +2337,7 @@ mali_external_add(unsigned int address, unsigned int physical, unsigned int size
 		       physical, size);
 		exit(1);
 	}
+#endif
 
 	for (i = 0; i < MALI_EXTERNALS; i++) {
 		if ((mali_externals[i].address >= address) &&
@@ -1966,12 +2590,58 @@ mali_memory_dump(void)
 	wrap_log("};\n\n");
 }
 
+/*
+ * What the binary trace does instead of mali_memory_dump(): only the pages
+ * which differ from the copy made the last time get copied and recorded.
+ * wrap_decode keeps the same copy and dumps all of it at this point.
+ */
+#ifndef WRAP_DECODE
+#define WRAP_PAGE_SIZE 0x1000
+
+static void
+wrap_trace_memory(void)
+{
+	struct wrap_record record = { .type = WRAP_RECORD_MEMORY };
+	unsigned int offset, count;
+	int i;
+
+	for (i = 0; i < MALI_ADDRESSES; i++) {
+		struct mali_address *mem = &mali_addresses[i];
+
+		if (!mem->address || !mem->shadow)
+			continue;
+
+		for (offset = 0; offset < mem->size; offset += WRAP_PAGE_SIZE) {
+			count = mem->size - offset;
+			if (count > WRAP_PAGE_SIZE)
+				count = WRAP_PAGE_SIZE;
+
+			if (!memcmp(mem->address + offset, mem->shadow + offset,
+				    count))
+				continue;
+
+			memcpy(mem->shadow + offset, mem->address + offset,
+			       count);
+			record.request = mem->physical;
+			record.length = offset;
+			wrap_trace_record(&record, mem->shadow + offset, count,
+					  NULL, 0);
+		}
+	}
+}
+#endif /* WRAP_DECODE */
+
 static void
 mali_wrap_bmp_dump(void)
 {
 	void *address = mali_address_retrieve(render_address);
 	char buffer[1024];
 
+#ifdef WRAP_DECODE
+	/* the rendered frames are not in the binary trace */
+	return;
+#endif
+
 	printf("%s: dumping frame %04d from address 0x%08X (%dx%d)\n",
 	       __func__, frame_count, render_address, render_width, render_height);
 
@@ -2206,3 +2876,180 @@ __mali_compile_essl_shader(struct lima_shader_binary *binary, int type,
 	return ret;
 }
 #endif
+
+#ifdef WRAP_DECODE
+/*
+ *
+ * Replay of the binary trace, for wrap_decode.
+ *
+ * The records go through the same handlers as the live ioctls do, with
+ * copies of the arguments, and buffers of our own stand in for the mali
+ * mappings, so the text logs come out as if they had been written while
+ * the application ran.
+ *
+ */
+static struct replay_map {
+	uint64_t traced; /* the address in the traced application */
+	void *address;
+	unsigned int size;
+} replay_maps[MALI_ADDRESSES];
+
+static void *
+replay_map_add(uint64_t traced, unsigned int size)
+{
+	int i;
+
+	for (i = 0; i < MALI_ADDRESSES; i++)
+		if (!replay_maps[i].address) {
+			replay_maps[i].address = calloc(1, size);
+			if (!replay_maps[i].address)
+				return NULL;
+			replay_maps[i].traced = traced;
+			replay_maps[i].size = size;
+			return replay_maps[i].address;
+		}
+
+	printf("Error: No more free replay slots for 0x%08llx (0x%x)!\n",
+	       (unsigned long long) traced, size);
+	return NULL;
+}
+
+static struct replay_map *
+replay_map_find(uint64_t traced, unsigned int size)
+{
+	int i;
+
+	for (i = 0; i < MALI_ADDRESSES; i++)
+		if (replay_maps[i].address && (replay_maps[i].traced == traced) &&
+		    (replay_maps[i].size == size))
+			return &replay_maps[i];
+
+	return NULL;
+}
+
+static void
+replay_memory(uint64_t physical, uint64_t offset, void *data,
+	      unsigned int size)
+{
+	int i;
+
+	for (i = 0; i < MALI_ADDRESSES; i++)
+		if (mali_addresses[i].address &&
+		    (mali_addresses[i].physical == physical) &&
+		    ((offset + size) <= mali_addresses[i].size)) {
+			memcpy(mali_addresses[i].address + offset, data, size);
+			return;
+		}
+
+	printf("Error: no mapping for memory at 0x%08llx + 0x%llx\n",
+	       (unsigned long long) physical, (unsigned long long) offset);
+}
+
+/*
+ * The kernel fills in the system info as a linked list within the buffer
+ * it was given, point the links into our copy of that buffer instead.
+ */
+static void *
+replay_relocate(void *pointer, uintptr_t base, void *copy, unsigned int size)
+{
+	uintptr_t address = (uintptr_t) pointer;
+
+	if ((address < base) || (address >= (base + size)))
+		return NULL;
+
+	return copy + (address - base);
+}
+
+static void
+replay_system_info(_mali_uk_get_system_info_s *info, void *copy,
+		   unsigned int size)
+{
+	uintptr_t base = (uintptr_t) info->system_info;
+	struct _mali_system_info *system_info = copy;
+	struct _mali_core_info *core;
+	struct _mali_mem_info *mem;
+
+	info->system_info = system_info;
+
+	system_info->core_info = replay_relocate(system_info->core_info,
+						 base, copy, size);
+	for (core = system_info->core_info; core; core = core->next)
+		core->next = replay_relocate(core->next, base, copy, size);
+
+	system_info->mem_info = replay_relocate(system_info->mem_info,
+						base, copy, size);
+	for (mem = system_info->mem_info; mem; mem = mem->next)
+		mem->next = replay_relocate(mem->next, base, copy, size);
+}
+
+void
+wrap_replay(struct wrap_record *record, void *payload)
+{
+	struct dev_mali_ioctl_table *ioctl;
+	struct replay_map *map;
+	void *data;
+
+	/* the handlers never look at an argument that was not copied */
+	if (record->payload_size)
+		data = payload;
+	else
+		data = (void *) (uintptr_t) record->address;
+
+	switch (record->type) {
+	case WRAP_RECORD_IOCTL_PRE:
+		ioctl = mali_ioctl_find(record->request);
+		mali_ioctl_pre(ioctl, record->request, data);
+		break;
+	case WRAP_RECORD_IOCTL_POST:
+		ioctl = mali_ioctl_find(record->request);
+		mali_ioctl_table_update(record->request, record->ret);
+		if (ioctl && (ioctl->post == dev_mali_get_system_info_post)) {
+			if (record->payload_size <= ioctl->size)
+				break;
+			replay_system_info(data, payload + ioctl->size,
+					   record->payload_size - ioctl->size);
+		}
+		mali_ioctl_post(ioctl, record->request, data, record->ret);
+		break;
+	case WRAP_RECORD_FB_IOCTL:
+		fb_ioctl_post(record->request, data);
+		break;
+	case WRAP_RECORD_MMAP:
+		wrap_log("/* MMAP 0x%08lx (0x%08x) = %p */\n\n",
+			 (unsigned long) record->request,
+			 (unsigned int) record->length,
+			 (void *) (uintptr_t) record->address);
+		data = replay_map_add(record->address, record->length);
+		if (data)
+			mali_address_add(data, record->length, record->request);
+		break;
+	case WRAP_RECORD_MMAP_UMP:
+		/* the ump buffer contents are not traced */
+		ump_id_add(record->request >> 12, record->length, NULL);
+		break;
+	case WRAP_RECORD_MMAP_FB:
+		break;
+	case WRAP_RECORD_MUNMAP:
+		map = replay_map_find(record->address, record->length);
+		if (map && !mali_address_remove(map->address, map->size)) {
+			wrap_log("/* MUNMAP %p (0x%08x) */\n\n",
+				 (void *) (uintptr_t) record->address,
+				 (unsigned int) record->length);
+			free(map->address);
+			map->address = NULL;
+		}
+		break;
+	case WRAP_RECORD_CLOSE:
+		wrap_log("/* CLOSE */");
+		break;
+	case WRAP_RECORD_MEMORY:
+		replay_memory(record->request, record->length, payload,
+			      record->payload_size);
+		break;
+	default:
+		printf("Error: unknown wrap trace record type %d\n",
+		       record->type);
+		break;
+	}
+}
+#endif /* WRAP_DECODE */
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Turns a binary trace of libMali_wrap.so, written with LIMA_WRAP_TRACE,
+ * into the text logs which the wrapper writes without it, under the name
+ * given with LIMA_WRAP_LOG:
+ *
+ *	LIMA_WRAP_TRACE=/tmp/blob.trace LD_PRELOAD=libMali_wrap.so ./blob
+ *	LIMA_WRAP_LOG=/tmp/blob.wrap.log wrap_decode /tmp/blob.trace
+ *
+ * This has to be built for the same ABI as the traced application, as the
+ * ioctl arguments are copied as they are.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wrap_trace.h"
+
+static int
+record_compare(const void *a, const void *b)
+{
+	const struct wrap_record *ra = *(struct wrap_record * const *) a;
+	const struct wrap_record *rb = *(struct wrap_record * const *) b;
+
+	if (ra->seq < rb->seq)
+		return -1;
+	return ra->seq > rb->seq;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct wrap_trace_header *header;
+	struct wrap_record **records, *record;
+	size_t offset, count = 0, i;
+	struct stat st;
+	char *trace;
+	int fd;
+
+	if (argc != 2) {
+		printf("Usage: %s <trace>\n", argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[1], O_RDONLY);
+	if ((fd == -1) || fstat(fd, &st)) {
+		printf("Error: failed to open %s: %s\n", argv[1],
+		       strerror(errno));
+		return 1;
+	}
+
+	if (st.st_size < sizeof(struct wrap_trace_header)) {
+		printf("Error: %s is not a wrap trace\n", argv[1]);
+		return 1;
+	}
+
+	/* private, as the handlers get the arguments in place */
+	trace = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		     fd, 0);
+	if (trace == MAP_FAILED) {
+		printf("Error: failed to map %s: %s\n", argv[1],
+		       strerror(errno));
+		return 1;
+	}
+
+	header = (struct wrap_trace_header *) trace;
+	if (memcmp(header->magic, WRAP_TRACE_MAGIC, sizeof(header->magic)) ||
+	    (header->version != WRAP_TRACE_VERSION)) {
+		printf("Error: %s is not a version %d wrap trace\n", argv[1],
+		       WRAP_TRACE_VERSION);
+		return 1;
+	}
+
+	if (header->pointer_size != sizeof(void *)) {
+		printf("Error: %s was traced with %d bit pointers, this "
+		       "decoder has %d bit ones\n", argv[1],
+		       8 * header->pointer_size, (int) (8 * sizeof(void *)));
+		return 1;
+	}
+
+	records = malloc((st.st_size / sizeof(struct wrap_record) + 1) *
+			 sizeof(*records));
+	if (!records) {
+		printf("Error: no memory for the index of %s\n", argv[1]);
+		return 1;
+	}
+
+	/* a trace cut short by a crash ends within its last record */
+	for (offset = sizeof(struct wrap_trace_header);
+	     (offset + sizeof(struct wrap_record)) <= st.st_size;
+	     offset += record->size) {
+		record = (struct wrap_record *) (trace + offset);
+		if ((record->size < sizeof(struct wrap_record)) ||
+		    ((offset + record->size) > st.st_size))
+			break;
+		records[count++] = record;
+	}
+
+	if (offset != st.st_size)
+		printf("Warning: %s is truncated, %lld bytes left over\n",
+		       argv[1], (long long) (st.st_size - offset));
+
+	qsort(records, count, sizeof(*records), record_compare);
+
+	for (i = 0; i < count; i++)
+		wrap_replay(records[i], records[i] + 1);
+
+	printf("Decoded %lu records\n", (unsigned long) count);
+
+	return 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+#ifndef WRAP_TRACE_H
+#define WRAP_TRACE_H 1
+
+#include <stdint.h>
+
+/*
+ * The binary trace written with LIMA_WRAP_TRACE, and turned into the
+ * usual LIMA_WRAP_LOG text files by wrap_decode.
+ *
+ * After the header, the file is a series of records, each followed by
+ * its payload padded to 8 bytes. Every thread writes its own records in
+ * order, but the threads are interleaved in chunks: the global sequence
+ * number gives the order in which the wrapper saw them.
+ */
+#define WRAP_TRACE_MAGIC "LIMAWRAP"
+#define WRAP_TRACE_VERSION 1
+
+struct wrap_trace_header {
+	char magic[8];
+	uint32_t version;
+	/* the decoder has to use the same ioctl structures */
+	uint32_t pointer_size;
+};
+
+enum wrap_record_type {
+	WRAP_RECORD_IOCTL_PRE = 1,	/* the mali ioctl argument, before */
+	WRAP_RECORD_IOCTL_POST,		/* and after the call */
+	WRAP_RECORD_FB_IOCTL,		/* a framebuffer ioctl, after */
+	WRAP_RECORD_MMAP,		/* of /dev/mali */
+	WRAP_RECORD_MMAP_UMP,
+	WRAP_RECORD_MMAP_FB,
+	WRAP_RECORD_MUNMAP,
+	WRAP_RECORD_CLOSE,
+	WRAP_RECORD_MEMORY,		/* a page of mali memory that changed */
+};
+
+struct wrap_record {
+	uint32_t size;		/* with the payload and padding */
+	uint32_t type;
+	uint32_t payload_size;
+	uint32_t tid;
+	uint64_t seq;
+	uint64_t time;		/* CLOCK_MONOTONIC, in ns */
+	int32_t ret;
+	uint32_t pad;
+	uint64_t request;	/* ioctl request, mmap offset, or memory physical */
+	uint64_t address;	/* ioctl argument or mapping address */
+	uint64_t length;	/* mapping length, or offset of the memory page */
+};
+
+/* in wrap.c, built with WRAP_DECODE */
+void wrap_replay(struct wrap_record *record, void *payload);
+
+#endif /* WRAP_TRACE_H */
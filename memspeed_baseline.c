@@ -0,0 +1,511 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The results store of --baseline and --compare: a text file per board,
+ * with one line per workload and buffer size of every --baseline run,
+ *
+ *	TIME SOC DRAM_MHZ KERNEL WORKLOAD SIZE SAMPLES MEAN STDDEV
+ *
+ * appended to, so it is the history of the board too. The baseline of a
+ * --compare result is the latest stored one of the same SoC, dram clock,
+ * workload and size, whatever kernel it was measured on: a kernel or
+ * u-boot update which costs bandwidth shows up as a regression against
+ * the results from before. A different dram clock only compares with
+ * results at that clock.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#include "memspeed_baseline.h"
+#include "memspeed_telemetry.h"
+#include "memspeed_stats.h"
+
+#define BASELINE_DIR "/var/lib/lima-memspeed"
+
+/* Changes smaller than this fraction are noise, however significant */
+#define BASELINE_MIN_CHANGE 0.01
+
+/* Keep a value usable as one whitespace separated field of a line */
+static void baseline_field(char *dst, size_t size, const char *src)
+{
+	size_t i;
+
+	snprintf(dst, size, "%.*s", (int)size - 1,
+		 src && *src ? src : "unknown");
+	for (i = 0; dst[i]; i++) {
+		if (!isalnum((unsigned char)dst[i]) && !strchr(",.-_+", dst[i]))
+			dst[i] = '_';
+	}
+}
+
+/* The first line of a file, or the last of its NUL separated strings */
+static int baseline_read(const char *path, char *buf, size_t size,
+			 int last_string)
+{
+	size_t len, i, start = 0;
+	FILE *f = fopen(path, "r");
+
+	if (!f)
+		return -1;
+	len = fread(buf, 1, size - 1, f);
+	fclose(f);
+	buf[len] = 0;
+	if (last_string) {
+		for (i = 0; i < len; i += strlen(buf + i) + 1)
+			start = i;
+		memmove(buf, buf + start, strlen(buf + start) + 1);
+	}
+	buf[strcspn(buf, "\n")] = 0;
+	return *buf ? 0 : -1;
+}
+
+static void baseline_cpuinfo_hardware(char *buf, size_t size)
+{
+	char line[256];
+	FILE *f = fopen("/proc/cpuinfo", "r");
+
+	*buf = 0;
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		char *p = strchr(line, ':');
+
+		if (strncmp(line, "Hardware", 8) != 0 || !p)
+			continue;
+		p += strspn(p + 1, " \t") + 1;
+		p[strcspn(p, "\n")] = 0;
+		snprintf(buf, size, "%s", p);
+		break;
+	}
+	fclose(f);
+}
+
+/*
+ * The board from the device tree model, the SoC from the most generic
+ * device tree compatible string, either from "Hardware" in /proc/cpuinfo
+ * on the older kernels, the dram clock from the telemetry sources and the
+ * kernel release.
+ */
+void baseline_key_get(baseline_key_t *key)
+{
+	telemetry_value_t values[TELEMETRY_SOURCES_MAX];
+	struct utsname uts;
+	char buf[256];
+	int i, count;
+
+	if (baseline_read("/proc/device-tree/model", buf, sizeof(buf), 0))
+		baseline_cpuinfo_hardware(buf, sizeof(buf));
+	baseline_field(key->board, sizeof(key->board), buf);
+
+	if (baseline_read("/proc/device-tree/compatible", buf, sizeof(buf), 1))
+		baseline_cpuinfo_hardware(buf, sizeof(buf));
+	baseline_field(key->soc, sizeof(key->soc), buf);
+
+	/* the first sample is all we need, the next one is an hour away */
+	key->dram_mhz = 0;
+	count = telemetry_start(3600);
+	telemetry_take(values);
+	for (i = 0; i < count; i++) {
+		if (strcmp(values[i].name, "dram") == 0)
+			key->dram_mhz = (int)(values[i].last + 0.5);
+	}
+
+	baseline_field(key->kernel, sizeof(key->kernel),
+		       uname(&uts) == 0 ? uts.release : NULL);
+}
+
+/* The ARM cores by their "CPU part" in /proc/cpuinfo */
+static const struct {
+	int part;
+	const char *name;
+} baseline_arm_parts[] = {
+	{ 0xc05, "Cortex-A5" }, { 0xc07, "Cortex-A7" }, { 0xc08, "Cortex-A8" },
+	{ 0xc09, "Cortex-A9" }, { 0xc0e, "Cortex-A17" },
+	{ 0xc0f, "Cortex-A15" }, { 0xd03, "Cortex-A53" },
+	{ 0xd04, "Cortex-A35" }, { 0xd05, "Cortex-A55" },
+	{ 0xd07, "Cortex-A57" }, { 0xd08, "Cortex-A72" },
+	{ 0xd09, "Cortex-A73" },
+};
+
+static size_t baseline_cache_size(const char *dir, int *level)
+{
+	char path[128], buf[32];
+	unsigned long size;
+	char *end;
+
+	snprintf(path, sizeof(path), "%s/type", dir);
+	if (baseline_read(path, buf, sizeof(buf), 0) ||
+	    strcmp(buf, "Instruction") == 0)
+		return 0;
+	snprintf(path, sizeof(path), "%s/level", dir);
+	if (baseline_read(path, buf, sizeof(buf), 0))
+		return 0;
+	*level = atoi(buf);
+	snprintf(path, sizeof(path), "%s/size", dir);
+	if (baseline_read(path, buf, sizeof(buf), 0))
+		return 0;
+	size = strtoul(buf, &end, 10);
+	if (*end == 'K')
+		size <<= 10;
+	else if (*end == 'M')
+		size <<= 20;
+	return size;
+}
+
+/*
+ * The core from the "CPU part" of an ARM cpu or else the "model name" of
+ * /proc/cpuinfo, the cpus which are online and the caches of the first
+ * one from sysfs.
+ */
+void baseline_cpu_get(baseline_cpu_t *cpu)
+{
+	char line[256], dir[64];
+	int i, level, part = 0;
+	size_t size;
+	FILE *f;
+
+	memset(cpu, 0, sizeof(*cpu));
+	f = fopen("/proc/cpuinfo", "r");
+	while (f && fgets(line, sizeof(line), f)) {
+		char *p = strchr(line, ':');
+
+		if (!p)
+			continue;
+		p += strspn(p + 1, " \t") + 1;
+		p[strcspn(p, "\n")] = 0;
+		if (strncmp(line, "CPU part", 8) == 0 && !part)
+			part = strtol(p, NULL, 0);
+		else if ((strncmp(line, "model name", 10) == 0 ||
+			  strncmp(line, "Processor", 9) == 0) && !cpu->model[0])
+			snprintf(cpu->model, sizeof(cpu->model), "%s", p);
+	}
+	if (f)
+		fclose(f);
+	for (i = 0; i < (int)(sizeof(baseline_arm_parts) /
+			      sizeof(baseline_arm_parts[0])); i++)
+		if (baseline_arm_parts[i].part == part)
+			snprintf(cpu->model, sizeof(cpu->model), "%s",
+				 baseline_arm_parts[i].name);
+	if (!cpu->model[0])
+		snprintf(cpu->model, sizeof(cpu->model), "unknown");
+
+	cpu->cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for (i = 0; i < 8; i++) {
+		snprintf(dir, sizeof(dir),
+			 "/sys/devices/system/cpu/cpu0/cache/index%d", i);
+		level = 0;
+		size = baseline_cache_size(dir, &level);
+		if (level >= 1 && level <= 3 && size > cpu->cache[level - 1])
+			cpu->cache[level - 1] = size;
+	}
+}
+
+const char *baseline_default_path(const baseline_key_t *key)
+{
+	static char path[128];
+
+	snprintf(path, sizeof(path), BASELINE_DIR "/%s", key->board);
+	return path;
+}
+
+/* Append the results of a run, creating the default directory if needed */
+int baseline_save(const char *path, const baseline_key_t *key,
+		  const baseline_result_t *results, int count)
+{
+	long now = time(NULL);
+	FILE *f;
+	int i;
+
+	if (strncmp(path, BASELINE_DIR "/", sizeof(BASELINE_DIR)) == 0)
+		mkdir(BASELINE_DIR, 0755);
+	f = fopen(path, "a");
+	if (!f) {
+		printf("Can't open '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < count; i++)
+		fprintf(f, "%ld %s %d %s %s %zu %d %.1f %.2f\n", now, key->soc,
+			key->dram_mhz, key->kernel, results[i].workload,
+			results[i].size, results[i].samples, results[i].mean,
+			results[i].stddev);
+	if (fclose(f) != 0) {
+		printf("Can't write '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Append the best prefetch distance and unroll of a tunable kernel, to
+ * PATH.tuning next to the results store, one line each as
+ *
+ *	TIME SOC DRAM_MHZ KERNEL WORKLOAD PREFETCH UNROLL MEAN
+ *
+ * for whatever else wants to pick the setting of the board and clock.
+ */
+int baseline_save_tuning(const char *path, const baseline_key_t *key,
+			 const char *workload, int prefetch, int unroll,
+			 double mean)
+{
+	char tuning_path[512];
+	FILE *f;
+
+	if (strncmp(path, BASELINE_DIR "/", sizeof(BASELINE_DIR)) == 0)
+		mkdir(BASELINE_DIR, 0755);
+	snprintf(tuning_path, sizeof(tuning_path), "%s.tuning", path);
+	f = fopen(tuning_path, "a");
+	if (!f) {
+		printf("Can't open '%s': %s\n", tuning_path, strerror(errno));
+		return -1;
+	}
+	fprintf(f, "%ld %s %d %s %s %d %d %.1f\n", (long)time(NULL), key->soc,
+		key->dram_mhz, key->kernel, workload, prefetch, unroll, mean);
+	if (fclose(f) != 0) {
+		printf("Can't write '%s': %s\n", tuning_path, strerror(errno));
+		return -1;
+	}
+	printf("%s: prefetch %d, unroll %d saved to %s\n", workload, prefetch,
+	       unroll, tuning_path);
+	return 0;
+}
+
+/*
+ * Replace PATH.mix with the peak mix of --find-max, as the comma separated
+ * list which lima-memtester --load=@PATH.mix takes.
+ */
+int baseline_save_mix(const char *path, const char *list)
+{
+	char mix_path[512];
+	FILE *f;
+
+	if (strncmp(path, BASELINE_DIR "/", sizeof(BASELINE_DIR)) == 0)
+		mkdir(BASELINE_DIR, 0755);
+	snprintf(mix_path, sizeof(mix_path), "%s.mix", path);
+	f = fopen(mix_path, "w");
+	if (!f) {
+		printf("Can't open '%s': %s\n", mix_path, strerror(errno));
+		return -1;
+	}
+	fprintf(f, "%s\n", list);
+	if (fclose(f) != 0) {
+		printf("Can't write '%s': %s\n", mix_path, strerror(errno));
+		return -1;
+	}
+	printf("Saved to %s, for lima-memtester --load=@%s\n", mix_path,
+	       mix_path);
+	return 0;
+}
+
+/*
+ * Replace PATH.conf with the settings of --probe, as lines of
+ *
+ *	NAME VALUE
+ *
+ * after the SoC and the dram clock that they are for, and comments on
+ * the cpu that they were probed on.
+ */
+int baseline_save_profile(const char *path, const baseline_key_t *key,
+			  const baseline_cpu_t *cpu,
+			  const baseline_profile_t *profile)
+{
+	char conf_path[512];
+	time_t now = time(NULL);
+	int i;
+	FILE *f;
+
+	if (strncmp(path, BASELINE_DIR "/", sizeof(BASELINE_DIR)) == 0)
+		mkdir(BASELINE_DIR, 0755);
+	snprintf(conf_path, sizeof(conf_path), "%s.conf", path);
+	f = fopen(conf_path, "w");
+	if (!f) {
+		printf("Can't open '%s': %s\n", conf_path, strerror(errno));
+		return -1;
+	}
+	fprintf(f, "# lima-memspeed --probe of %s, %s", key->board,
+		ctime(&now));
+	fprintf(f, "# %s, %d cpus", cpu->model, cpu->cpus);
+	for (i = 0; i < 3; i++)
+		if (cpu->cache[i])
+			fprintf(f, ", L%d %zuK", i + 1, cpu->cache[i] >> 10);
+	fprintf(f, ", kernel %s\n", key->kernel);
+	fprintf(f, "soc %s\ndram_mhz %d\n", key->soc, key->dram_mhz);
+	if (profile->copy_kernel[0])
+		fprintf(f, "copy_kernel %s\n", profile->copy_kernel);
+	if (profile->prefetch)
+		fprintf(f, "prefetch %d\nunroll %d\n", profile->prefetch,
+			profile->unroll);
+	if (profile->threads)
+		fprintf(f, "threads %d\n", profile->threads);
+	if (profile->buffer_size)
+		fprintf(f, "buffer_size %zu\n", profile->buffer_size);
+	if (profile->stress_profile[0])
+		fprintf(f, "stress_profile %s\n", profile->stress_profile);
+	if (fclose(f) != 0) {
+		printf("Can't write '%s': %s\n", conf_path, strerror(errno));
+		return -1;
+	}
+	printf("Saved to %s\n", conf_path);
+	return 0;
+}
+
+/*
+ * The settings of a PATH.conf, if it is for the same SoC at the same dram
+ * clock. Returns 0 if they are.
+ */
+int baseline_load_profile(const char *path, const baseline_key_t *key,
+			  baseline_profile_t *profile)
+{
+	char line[256], name[32], value[128];
+	int matches = 0;
+	FILE *f;
+
+	memset(profile, 0, sizeof(*profile));
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' ||
+		    sscanf(line, "%31s %127s", name, value) != 2)
+			continue;
+		if (strcmp(name, "soc") == 0)
+			matches |= strcmp(value, key->soc) == 0 ? 1 : 4;
+		else if (strcmp(name, "dram_mhz") == 0)
+			matches |= atoi(value) == key->dram_mhz ? 2 : 4;
+		else if (strcmp(name, "copy_kernel") == 0)
+			snprintf(profile->copy_kernel,
+				 sizeof(profile->copy_kernel), "%.*s",
+				 (int)sizeof(profile->copy_kernel) - 1, value);
+		else if (strcmp(name, "prefetch") == 0)
+			profile->prefetch = atoi(value);
+		else if (strcmp(name, "unroll") == 0)
+			profile->unroll = atoi(value);
+		else if (strcmp(name, "threads") == 0)
+			profile->threads = atoi(value);
+		else if (strcmp(name, "buffer_size") == 0)
+			profile->buffer_size = strtoull(value, NULL, 0);
+		else if (strcmp(name, "stress_profile") == 0)
+			snprintf(profile->stress_profile,
+				 sizeof(profile->stress_profile), "%.*s",
+				 (int)sizeof(profile->stress_profile) - 1, value);
+	}
+	fclose(f);
+	return matches == 3 ? 0 : -1;
+}
+
+/*
+ * The profile of this board at its dram clock, from LIMA_PROFILE=FILE or
+ * else the --probe one in the results store. An empty LIMA_PROFILE goes
+ * without. Returns the file, or NULL if there is no profile which fits.
+ */
+const char *baseline_profile_find(baseline_profile_t *profile)
+{
+	static char path[512];
+	const char *env = getenv("LIMA_PROFILE");
+	baseline_key_t key;
+
+	if (env && !*env)
+		return NULL;
+	baseline_key_get(&key);
+	if (env)
+		snprintf(path, sizeof(path), "%s", env);
+	else
+		snprintf(path, sizeof(path), "%s.conf",
+			 baseline_default_path(&key));
+	if (baseline_load_profile(path, &key, profile) == 0)
+		return path;
+	if (env)
+		printf("LIMA_PROFILE: '%s' is not a profile of %s at %d MHz "
+		       "dram\n", env, key.soc, key.dram_mhz);
+	return NULL;
+}
+
+/*
+ * The latest stored result of the workload at the size, from the same SoC
+ * at the same dram clock. Returns 0 if there is one.
+ */
+int baseline_find(const char *path, const baseline_key_t *key,
+		  const char *workload, size_t size, baseline_result_t *found)
+{
+	char line[512], soc[64], kernel[64], name[64];
+	baseline_result_t r;
+	int dram_mhz, ret = -1;
+	long stamp;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%ld %63s %d %63s %63s %zu %d %lf %lf", &stamp,
+			   soc, &dram_mhz, kernel, name, &r.size, &r.samples,
+			   &r.mean, &r.stddev) != 9)
+			continue;
+		if (strcmp(soc, key->soc) || dram_mhz != key->dram_mhz ||
+		    strcmp(name, workload) || r.size != size || r.samples < 2)
+			continue;
+		/* the fields are as long as the words of the line */
+		snprintf(r.workload, sizeof(r.workload), "%.*s",
+			 (int)sizeof(r.workload) - 1, name);
+		snprintf(r.kernel, sizeof(r.kernel), "%.*s",
+			 (int)sizeof(r.kernel) - 1, kernel);
+		*found = r;
+		ret = 0;
+	}
+	fclose(f);
+	return ret;
+}
+
+/*
+ * Welch's t-test of the new samples against the baseline ones, at 99%.
+ * Returns -1 for a significant regression, 1 for an improvement and 0
+ * for no change, or one smaller than BASELINE_MIN_CHANGE.
+ */
+int baseline_compare(const baseline_result_t *now,
+		     const baseline_result_t *then)
+{
+	double va = now->stddev * now->stddev / now->samples;
+	double vb = then->stddev * then->stddev / then->samples;
+	double diff = now->mean - then->mean, df, t;
+
+	if (fabs(diff) < then->mean * BASELINE_MIN_CHANGE)
+		return 0;
+	if (va + vb > 0) {
+		df = (va + vb) * (va + vb) /
+		     (va * va / (now->samples - 1) +
+		      vb * vb / (then->samples - 1));
+		t = fabs(diff) / sqrt(va + vb);
+		if (t < stats_t_quantile(STATS_Z_99, df))
+			return 0;
+	}
+	return diff < 0 ? -1 : 1;
+}
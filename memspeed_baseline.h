@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef MEMSPEED_BASELINE_H
+#define MEMSPEED_BASELINE_H
+
+#include <stddef.h>
+
+/* What a stored result has to match to be the baseline of a new one */
+typedef struct baseline_key_t
+{
+	char board[64];
+	char soc[64];
+	int dram_mhz;
+	char kernel[64];
+} baseline_key_t;
+
+/* The samples of one workload at one buffer size */
+typedef struct baseline_result_t
+{
+	char workload[64];
+	size_t size;
+	int samples;
+	double mean;
+	double stddev;
+	/* of the baseline, filled in by baseline_find() */
+	char kernel[64];
+} baseline_result_t;
+
+/* The cpu, as far as the kernel tells */
+typedef struct baseline_cpu_t
+{
+	char model[64];
+	int cpus;
+	/* the data or unified cache of L1 to L3, 0 if there is none */
+	size_t cache[3];
+} baseline_cpu_t;
+
+/*
+ * The settings that --probe found the best for a board at its dram clock,
+ * which lima-memspeed and lima-memtester start with
+ */
+typedef struct baseline_profile_t
+{
+	char copy_kernel[64];
+	int prefetch;
+	int unroll;
+	int threads;
+	size_t buffer_size;
+	/* never probed, but kept if it is added by hand */
+	char stress_profile[32];
+} baseline_profile_t;
+
+void baseline_key_get(baseline_key_t *key);
+void baseline_cpu_get(baseline_cpu_t *cpu);
+const char *baseline_default_path(const baseline_key_t *key);
+int baseline_save(const char *path, const baseline_key_t *key,
+		  const baseline_result_t *results, int count);
+int baseline_find(const char *path, const baseline_key_t *key,
+		  const char *workload, size_t size,
+		  baseline_result_t *found);
+int baseline_compare(const baseline_result_t *now,
+		     const baseline_result_t *then);
+int baseline_save_tuning(const char *path, const baseline_key_t *key,
+			 const char *workload, int prefetch, int unroll,
+			 double mean);
+int baseline_save_mix(const char *path, const char *list);
+int baseline_save_profile(const char *path, const baseline_key_t *key,
+			  const baseline_cpu_t *cpu,
+			  const baseline_profile_t *profile);
+int baseline_load_profile(const char *path, const baseline_key_t *key,
+			  baseline_profile_t *profile);
+const char *baseline_profile_find(baseline_profile_t *profile);
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Sampling of the bandwidth counters of the dram controller, through
+ * /dev/mem. This shows the traffic that the workloads do not know about,
+ * such as display overlays or cache write-backs.
+ *
+ * Where these counters live differs from one Allwinner SoC to the next,
+ * and is hardly documented, so the layout is given on the command line:
+ *
+ *	BASE:NAME=OFFSET[*SCALE],NAME=OFFSET[*SCALE],...
+ *
+ * BASE is the physical address of the register block, and every counter
+ * is a free running 32 bit register at OFFSET from there, which counts
+ * SCALE bytes (1 by default) per step. The counters are only ever read,
+ * so they need to be enabled already.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "memspeed_dram.h"
+
+/*
+ * Read often enough that a 32 bit byte counter can not wrap in between,
+ * even at more than 10GB/s.
+ */
+#define DRAM_POLL_USEC		100000
+
+typedef struct dram_counter_t
+{
+	char name[32];
+	uint32_t offset;
+	uint32_t scale;
+	uint32_t last;
+	uint64_t bytes;
+} dram_counter_t;
+
+static dram_counter_t dram_counters[DRAM_COUNTERS_MAX];
+static int dram_counter_count;
+static volatile uint32_t *dram_regs;
+static pthread_mutex_t dram_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Poking around in /dev/mem with a layout meant for some other SoC is
+ * asking for trouble, so insist on an Allwinner one.
+ */
+static int dram_soc_detect(char *soc, size_t size)
+{
+	char buf[256];
+	FILE *f;
+	size_t len, i;
+
+	f = fopen("/proc/device-tree/compatible", "r");
+	if (f) {
+		len = fread(buf, 1, sizeof(buf) - 1, f);
+		fclose(f);
+		buf[len] = 0;
+		/* the list is NUL separated, the SoC comes last */
+		for (i = 0; i < len; i += strlen(buf + i) + 1) {
+			if (strncmp(buf + i, "allwinner,sun", 13) == 0) {
+				snprintf(soc, size, "%s", buf + i + 10);
+				return 0;
+			}
+		}
+	}
+
+	f = fopen("/proc/cpuinfo", "r");
+	if (!f)
+		return -1;
+	while (fgets(buf, sizeof(buf), f)) {
+		char *p;
+
+		if (strncmp(buf, "Hardware", 8) != 0)
+			continue;
+		p = strstr(buf, "sun");
+		if (p && p[3] >= '0' && p[3] <= '9') {
+			p[strcspn(p, " \t\n")] = 0;
+			snprintf(soc, size, "%s", p);
+			fclose(f);
+			return 0;
+		}
+	}
+	fclose(f);
+	return -1;
+}
+
+static void dram_counters_poll(void)
+{
+	int i;
+
+	for (i = 0; i < dram_counter_count; i++) {
+		dram_counter_t *c = &dram_counters[i];
+		uint32_t value = dram_regs[c->offset / 4];
+
+		c->bytes += (uint64_t)(uint32_t)(value - c->last) * c->scale;
+		c->last = value;
+	}
+}
+
+static void *dram_counters_thread(void *data)
+{
+	while (1) {
+		pthread_mutex_lock(&dram_mutex);
+		dram_counters_poll();
+		pthread_mutex_unlock(&dram_mutex);
+		usleep(DRAM_POLL_USEC);
+	}
+	return NULL;
+}
+
+static int dram_counters_parse(const char *spec, unsigned long *base,
+			       uint32_t *map_size)
+{
+	const char *p;
+	char *end;
+
+	*base = strtoul(spec, &end, 0);
+	if (end == spec || *end != ':')
+		return -1;
+	p = end + 1;
+	*map_size = 0;
+
+	while (*p) {
+		dram_counter_t *c = &dram_counters[dram_counter_count];
+		const char *eq = strchr(p, '=');
+		size_t len;
+
+		if (!eq || eq == p || dram_counter_count == DRAM_COUNTERS_MAX)
+			return -1;
+		len = eq - p;
+		if (len >= sizeof(c->name))
+			len = sizeof(c->name) - 1;
+		memcpy(c->name, p, len);
+		c->name[len] = 0;
+
+		c->offset = strtoul(eq + 1, &end, 0);
+		if (end == eq + 1 || (c->offset & 3))
+			return -1;
+		c->scale = 1;
+		if (*end == '*') {
+			p = end + 1;
+			c->scale = strtoul(p, &end, 0);
+			if (end == p || !c->scale)
+				return -1;
+		}
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return -1;
+		p = end;
+
+		if (c->offset + 4 > *map_size)
+			*map_size = c->offset + 4;
+		dram_counter_count++;
+	}
+
+	return dram_counter_count ? 0 : -1;
+}
+
+int dram_counters_init(const char *spec)
+{
+	unsigned long base, page = sysconf(_SC_PAGESIZE);
+	uint32_t map_size;
+	char soc[64];
+	pthread_t thread;
+	void *map;
+	int fd, i;
+
+	if (dram_soc_detect(soc, sizeof(soc))) {
+		printf("dram counters: not an Allwinner SoC, giving up\n");
+		return -1;
+	}
+
+	if (dram_counters_parse(spec, &base, &map_size)) {
+		printf("dram counters: can't parse '%s'\n", spec);
+		return -1;
+	}
+
+	fd = open("/dev/mem", O_RDONLY | O_SYNC);
+	if (fd == -1) {
+		printf("dram counters: can't open /dev/mem: %s\n",
+		       strerror(errno));
+		return -1;
+	}
+	map_size += base & (page - 1);
+	map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd,
+		   base & ~(page - 1));
+	close(fd);
+	if (map == MAP_FAILED) {
+		printf("dram counters: can't map 0x%08lx: %s\n", base,
+		       strerror(errno));
+		return -1;
+	}
+	dram_regs = (volatile uint32_t *)((char *)map + (base & (page - 1)));
+
+	printf("dram counters: %s, %d counters at 0x%08lx\n", soc,
+	       dram_counter_count, base);
+
+	for (i = 0; i < dram_counter_count; i++)
+		dram_counters[i].last = dram_regs[dram_counters[i].offset / 4];
+
+	pthread_create(&thread, NULL, dram_counters_thread, NULL);
+	return 0;
+}
+
+int dram_counters_count(void)
+{
+	return dram_counter_count;
+}
+
+const char *dram_counter_name(int i)
+{
+	return dram_counters[i].name;
+}
+
+/* The bytes counted so far, for each of the counters */
+void dram_counters_read(uint64_t *bytes)
+{
+	int i;
+
+	pthread_mutex_lock(&dram_mutex);
+	dram_counters_poll();
+	for (i = 0; i < dram_counter_count; i++)
+		bytes[i] = dram_counters[i].bytes;
+	pthread_mutex_unlock(&dram_mutex);
+}
@@ -0,0 +1,445 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Operating point control of the cpufreq policies and the devfreq devices
+ * (the mali and the dram, when the kernel has one for them), through their
+ * minimum and maximum frequencies, so it works with whatever governor
+ * there is:
+ *
+ *   /sys/devices/system/cpu/cpufreq/policy*  scaling_available_frequencies
+ *                                            in kHz
+ *   /sys/class/devfreq/NAME                  available_frequencies in Hz
+ *
+ * They get restored at exit, and on SIGINT and SIGTERM unless the program
+ * has handlers of its own. The stepping thread of dvfs_start() changes
+ * one domain at a time, in a sweep up and down or at random, and accounts
+ * the time, the bytes and the failures to the operating point they were
+ * at, and failures to the transition before them.
+ */
+
+#include <fcntl.h>
+#include <glob.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memspeed_dvfs.h"
+
+typedef struct {
+	dvfs_domain_t d;
+	char min_path[128];
+	char max_path[128];
+	/* in the units of the files */
+	unsigned long freq[DVFS_POINTS_MAX];
+	/* what min_path and max_path had, written back at exit */
+	char saved_min[32];
+	char saved_max[32];
+	/* the sweep goes up (1) or down (-1) next */
+	int direction;
+} domain_t;
+
+static domain_t domains[DVFS_DOMAINS_MAX];
+static int domains_count;
+static pthread_mutex_t domains_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* open(), write() and close() only, for the signal handler */
+static int
+write_file(const char *path, const char *value)
+{
+	int fd = open(path, O_WRONLY), ret;
+
+	if (fd < 0)
+		return -1;
+	ret = write(fd, value, strlen(value)) == (ssize_t)strlen(value);
+	close(fd);
+	return ret ? 0 : -1;
+}
+
+static int
+read_file(const char *path, char *buf, size_t size)
+{
+	int fd = open(path, O_RDONLY);
+	ssize_t n;
+
+	if (fd < 0)
+		return -1;
+	n = read(fd, buf, size - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	buf[n] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+static int
+compare_freq(const void *a, const void *b)
+{
+	unsigned long fa = *(const unsigned long *)a;
+	unsigned long fb = *(const unsigned long *)b;
+
+	return fa < fb ? -1 : fa > fb;
+}
+
+static void
+add_domain(const char *dir, const char *available, const char *min,
+	   const char *max, const char *name, int khz)
+{
+	domain_t *s = &domains[domains_count];
+	char path[192], list[512], *p, *end;
+	unsigned long f;
+	int i;
+
+	if (domains_count == DVFS_DOMAINS_MAX)
+		return;
+	memset(s, 0, sizeof(*s));
+	snprintf(path, sizeof(path), "%s/%s", dir, available);
+	if (read_file(path, list, sizeof(list)) < 0)
+		return;
+	for (p = list; s->d.points < DVFS_POINTS_MAX; p = end) {
+		f = strtoul(p, &end, 10);
+		if (end == p)
+			break;
+		s->freq[s->d.points++] = f;
+	}
+	if (s->d.points < 2)
+		return;
+	qsort(s->freq, s->d.points, sizeof(s->freq[0]), compare_freq);
+
+	snprintf(s->min_path, sizeof(s->min_path), "%s/%s", dir, min);
+	snprintf(s->max_path, sizeof(s->max_path), "%s/%s", dir, max);
+	if (read_file(s->min_path, s->saved_min, sizeof(s->saved_min)) < 0 ||
+	    read_file(s->max_path, s->saved_max, sizeof(s->saved_max)) < 0 ||
+	    access(s->min_path, W_OK) || access(s->max_path, W_OK))
+		return;
+
+	for (i = 0; i < s->d.points; i++) {
+		/* devfreq is in Hz, but in kHz for some vendor drivers */
+		if (khz || s->freq[s->d.points - 1] < 10000000)
+			s->d.mhz[i] = s->freq[i] / 1000.;
+		else
+			s->d.mhz[i] = s->freq[i] / 1000000.;
+	}
+	s->d.name = strdup(name);
+	s->d.current = -1;
+	s->direction = 1;
+	domains_count++;
+}
+
+static const char *
+basename_of(const char *path)
+{
+	const char *p = strrchr(path, '/');
+
+	return p ? p + 1 : path;
+}
+
+static void
+restore_on_signal(int sig)
+{
+	dvfs_restore();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+/*
+ * Find the domains which may be changed, named like the telemetry ones.
+ * Returns the number of them.
+ */
+int
+dvfs_init(void)
+{
+	struct sigaction old;
+	char name[64];
+	glob_t g;
+	size_t i;
+
+	if (domains_count)
+		return domains_count;
+	if (glob("/sys/devices/system/cpu/cpufreq/policy*", 0, NULL, &g) == 0) {
+		for (i = 0; i < g.gl_pathc; i++) {
+			snprintf(name, sizeof(name), "cpu%s",
+				 basename_of(g.gl_pathv[i]) + 6);
+			add_domain(g.gl_pathv[i],
+				   "scaling_available_frequencies",
+				   "scaling_min_freq", "scaling_max_freq",
+				   name, 1);
+		}
+		globfree(&g);
+	} else {
+		add_domain("/sys/devices/system/cpu/cpu0/cpufreq",
+			   "scaling_available_frequencies",
+			   "scaling_min_freq", "scaling_max_freq", "cpu0", 1);
+	}
+	if (glob("/sys/class/devfreq/*", 0, NULL, &g) == 0) {
+		for (i = 0; i < g.gl_pathc; i++) {
+			const char *p = basename_of(g.gl_pathv[i]);
+
+			add_domain(g.gl_pathv[i], "available_frequencies",
+				   "min_freq", "max_freq",
+				   strstr(p, "mali") || strstr(p, "gpu") ?
+				   "gpu" : strstr(p, "dram") ||
+				   strstr(p, "ddr") || strstr(p, "dmc") ?
+				   "dram" : p, 0);
+		}
+		globfree(&g);
+	}
+
+	if (domains_count) {
+		atexit(dvfs_restore);
+		if (sigaction(SIGINT, NULL, &old) == 0 &&
+		    old.sa_handler == SIG_DFL)
+			signal(SIGINT, restore_on_signal);
+		if (sigaction(SIGTERM, NULL, &old) == 0 &&
+		    old.sa_handler == SIG_DFL)
+			signal(SIGTERM, restore_on_signal);
+	}
+	return domains_count;
+}
+
+dvfs_domain_t *
+dvfs_domain(int domain)
+{
+	return &domains[domain].d;
+}
+
+/*
+ * The minimum goes down to the lowest point first, so that the maximum
+ * and then the minimum can go to the new one from either side.
+ */
+static int
+set_freq(domain_t *s, const char *min, const char *max)
+{
+	char lowest[32];
+
+	snprintf(lowest, sizeof(lowest), "%lu", s->freq[0]);
+	write_file(s->min_path, lowest);
+	if (write_file(s->max_path, max) < 0)
+		return -1;
+	return write_file(s->min_path, min);
+}
+
+/* Pin the domain to its point, returns 0 if the kernel took it */
+int
+dvfs_set(int domain, int point)
+{
+	domain_t *s = &domains[domain];
+	char freq[32];
+
+	snprintf(freq, sizeof(freq), "%lu", s->freq[point]);
+	if (set_freq(s, freq, freq) < 0)
+		return -1;
+	s->d.current = point;
+	return 0;
+}
+
+void
+dvfs_restore_domain(int domain)
+{
+	domain_t *s = &domains[domain];
+
+	if (s->d.current < 0)
+		return;
+	set_freq(s, s->saved_min, s->saved_max);
+	s->d.current = -1;
+}
+
+void
+dvfs_restore(void)
+{
+	int i;
+
+	for (i = 0; i < domains_count; i++)
+		dvfs_restore_domain(i);
+}
+
+static struct {
+	double interval;
+	int random;
+	dvfs_counter_t bytes, failures;
+} stepping;
+
+static double
+gettime(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + 0.000000001 * t.tv_nsec;
+}
+
+/* The next point of a domain in the sweep, turning at either end */
+static int
+next_point(domain_t *s)
+{
+	int point = s->d.current + s->direction;
+
+	if (point < 0 || point >= s->d.points) {
+		s->direction = -s->direction;
+		point = s->d.current + s->direction;
+	}
+	return point;
+}
+
+static void *
+stepping_thread(void *data)
+{
+	double t1 = gettime(), t2, bytes1 = 0, bytes2, failures1 = 0, failures2;
+	unsigned int seed = time(NULL);
+	int i, domain = 0, point, last = -1;
+	domain_t *s;
+
+	if (stepping.bytes)
+		bytes1 = stepping.bytes();
+	if (stepping.failures)
+		failures1 = stepping.failures();
+	while (1) {
+		usleep(stepping.interval * 1000000);
+		t2 = gettime();
+		bytes2 = stepping.bytes ? stepping.bytes() : 0;
+		failures2 = stepping.failures ? stepping.failures() : 0;
+
+		pthread_mutex_lock(&domains_lock);
+		for (i = 0; i < domains_count; i++) {
+			s = &domains[i];
+			if (s->d.current < 0)
+				continue;
+			s->d.seconds[s->d.current] += t2 - t1;
+			s->d.bytes[s->d.current] += bytes2 - bytes1;
+			s->d.failures[s->d.current] += failures2 - failures1;
+		}
+		if (last >= 0 && failures2 > failures1)
+			domains[last].d.failed_transitions++;
+
+		if (stepping.random) {
+			domain = rand_r(&seed) % domains_count;
+			s = &domains[domain];
+			point = rand_r(&seed) % s->d.points;
+			if (point == s->d.current)
+				point = (point + 1) % s->d.points;
+		} else {
+			domain = (domain + 1) % domains_count;
+			s = &domains[domain];
+			point = next_point(s);
+		}
+		if (dvfs_set(domain, point) == 0) {
+			s->d.transitions++;
+			last = domain;
+		} else {
+			last = -1;
+		}
+		pthread_mutex_unlock(&domains_lock);
+
+		t1 = gettime();
+		bytes1 = stepping.bytes ? stepping.bytes() : 0;
+		failures1 = stepping.failures ? stepping.failures() : 0;
+	}
+	return NULL;
+}
+
+/*
+ * Start at the lowest point of every domain and change one of them every
+ * interval seconds, in a sweep or at random. bytes and failures, if not
+ * NULL, get read at every change. Returns the number of domains, there is
+ * no thread if there are none.
+ */
+int
+dvfs_start(double interval, int random, dvfs_counter_t bytes,
+	   dvfs_counter_t failures)
+{
+	pthread_t thread;
+	int i;
+
+	if (!dvfs_init())
+		return 0;
+	stepping.interval = interval;
+	stepping.random = random;
+	stepping.bytes = bytes;
+	stepping.failures = failures;
+	for (i = 0; i < domains_count; i++)
+		dvfs_set(i, 0);
+	if (pthread_create(&thread, NULL, stepping_thread, NULL) != 0)
+		return 0;
+	return domains_count;
+}
+
+/*
+ * "name: N transitions, M followed by failures" and then every point,
+ * with its time, MB/s and failures if there were any
+ */
+void
+dvfs_print(FILE *f, const char *prefix)
+{
+	dvfs_domain_t *d;
+	int i, j;
+
+	pthread_mutex_lock(&domains_lock);
+	for (i = 0; i < domains_count; i++) {
+		d = &domains[i].d;
+		fprintf(f, "%s %s: %d transitions, %d followed by failures\n",
+			prefix, d->name, d->transitions,
+			d->failed_transitions);
+		for (j = 0; j < d->points; j++) {
+			if (d->seconds[j] <= 0)
+				continue;
+			fprintf(f, "%s   %6.0f MHz: %7.1f s", prefix,
+				d->mhz[j], d->seconds[j]);
+			if (d->bytes[j] > 0)
+				fprintf(f, ", %.1f MB/s",
+					d->bytes[j] / d->seconds[j] / 1000000.);
+			if (d->failures[j] > 0)
+				fprintf(f, ", %.0f failures", d->failures[j]);
+			fprintf(f, "\n");
+		}
+	}
+	pthread_mutex_unlock(&domains_lock);
+}
+
+/* The "dvfs" field of a json record, with a leading comma */
+void
+dvfs_print_json(FILE *f)
+{
+	dvfs_domain_t *d;
+	int i, j;
+
+	pthread_mutex_lock(&domains_lock);
+	fprintf(f, ", \"dvfs\": {");
+	for (i = 0; i < domains_count; i++) {
+		d = &domains[i].d;
+		fprintf(f, "%s\"%s\": {\"transitions\": %d, "
+			"\"failed_transitions\": %d, \"points\": [", i ? ", " : "",
+			d->name, d->transitions, d->failed_transitions);
+		for (j = 0; j < d->points; j++)
+			fprintf(f, "%s{\"mhz\": %.0f, \"seconds\": %.3f, "
+				"\"bytes\": %.0f, \"failures\": %.0f}",
+				j ? ", " : "", d->mhz[j], d->seconds[j],
+				d->bytes[j], d->failures[j]);
+		fprintf(f, "]}");
+	}
+	fprintf(f, "}");
+	pthread_mutex_unlock(&domains_lock);
+}
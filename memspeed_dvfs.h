@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef MEMSPEED_DVFS_H
+#define MEMSPEED_DVFS_H
+
+#include <stdio.h>
+
+#define DVFS_DOMAINS_MAX	8
+#define DVFS_POINTS_MAX		32
+
+/* Something that only grows, such as the bytes moved or the failures */
+typedef double (*dvfs_counter_t)(void);
+
+/*
+ * A cpufreq policy or a devfreq device with more than one operating
+ * point, such as the mali or the dram, and what the stepping thread saw
+ * at each of its points.
+ */
+typedef struct {
+	const char *name;
+	int points;
+	double mhz[DVFS_POINTS_MAX];
+	/* the point which was set last, -1 before the first */
+	int current;
+
+	double seconds[DVFS_POINTS_MAX];
+	double bytes[DVFS_POINTS_MAX];
+	double failures[DVFS_POINTS_MAX];
+	int transitions;
+	/* the ones with failures before the next one */
+	int failed_transitions;
+} dvfs_domain_t;
+
+int dvfs_init(void);
+dvfs_domain_t *dvfs_domain(int domain);
+int dvfs_set(int domain, int point);
+void dvfs_restore_domain(int domain);
+void dvfs_restore(void);
+int dvfs_start(double interval, int random, dvfs_counter_t bytes,
+	       dvfs_counter_t failures);
+void dvfs_print(FILE *f, const char *prefix);
+void dvfs_print_json(FILE *f);
+
+#endif
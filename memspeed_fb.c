@@ -22,15 +22,19 @@
  */
 
 #include <stdio.h>
+#include <stdint.h>
 #include <assert.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/ioctl.h>
 #include <linux/fb.h>
 #include "lima-memspeed.h"
 #include "memspeed_fb.h"
+#include "kms.h"
 
 void *fb_blank_thread(void *data)
 {
+	workload_t *w = (workload_t *)data;
 	int fd, ret;
 
 	fd = open("/dev/fb0", O_RDWR);
@@ -39,6 +43,8 @@ void *fb_blank_thread(void *data)
 	while (1) {
 		ret = ioctl(fd, FBIOBLANK, FB_BLANK_NORMAL);
 		assert(!ret);
+		/* It moves no bytes, the scanout has stopped once blanked */
+		workload_set_ready(w);
 		sleep(1);
 	}
 
@@ -46,40 +52,165 @@ void *fb_blank_thread(void *data)
 	return 0;
 }
 
-void *fb_scanout_thread(void *data)
+#define SCANOUT_DISPLAYS_MAX 8
+#define SCANOUT_FBDEV_MAX 8
+#define SCANOUT_KMS_CARDS 4
+
+/*
+ * One display, with everything it scans out: the fbdev, or all the
+ * enabled planes of a kms crtc.
+ */
+typedef struct
+{
+	char name[32];
+	int layers;
+	double bytes_per_frame;
+	double refresh_rate;
+} scanout_display_t;
+
+static double fbdev_refresh_rate(struct fb_var_screeninfo *var)
+{
+	double htotal, vtotal;
+
+	htotal = var->left_margin + var->xres + var->right_margin +
+		 var->hsync_len;
+	vtotal = var->upper_margin + var->yres + var->lower_margin +
+		 var->vsync_len;
+	/* every line goes out twice, the timings are of the lines sent */
+	if ((var->vmode & FB_VMODE_MASK) == FB_VMODE_DOUBLE)
+		vtotal *= 2;
+
+	if (!var->pixclock || !htotal || !vtotal)
+		return 0;
+	return 1e12 / var->pixclock / htotal / vtotal;
+}
+
+static int scanout_fbdev_model(scanout_display_t *d, int max)
 {
-	workload_t *w = (workload_t *)data;
-	int fd, ret, i = 0;
 	struct fb_var_screeninfo var;
-	double refresh_rate, htotal, vtotal;
-	double framebuffer_size;
-	double start_time;
+	char path[32];
+	int fd, i, n = 0;
+
+	for (i = 0; i < SCANOUT_FBDEV_MAX && n < max; i++) {
+		snprintf(path, sizeof(path), "/dev/fb%d", i);
+		fd = open(path, O_RDWR);
+		if (fd == -1)
+			continue;
+
+		/* without timings there is no display behind it */
+		if (!ioctl(fd, FBIOGET_VSCREENINFO, &var) &&
+		    fbdev_refresh_rate(&var) > 0) {
+			snprintf(d[n].name, sizeof(d[n].name), "fb%d", i);
+			d[n].layers = 1;
+			d[n].bytes_per_frame = (double)var.xres * var.yres *
+					       var.bits_per_pixel / 8;
+			d[n].refresh_rate = fbdev_refresh_rate(&var);
+			n++;
+		}
+		close(fd);
+	}
 
-	fd = open("/dev/fb0", O_RDWR);
-	assert(fd != -1);
+	return n;
+}
 
-	ret = ioctl(fd, FBIOGET_VSCREENINFO, &var);
-	assert(!ret);
+static int scanout_kms_model(scanout_display_t *d, int max)
+{
+	struct limare_kms_scanout planes[SCANOUT_DISPLAYS_MAX * 4];
+	char path[32];
+	int card, i, j, count, n = 0;
+
+	for (card = 0; card < SCANOUT_KMS_CARDS; card++) {
+		snprintf(path, sizeof(path), "/dev/dri/card%d", card);
+		count = kms_scanout_list(path, planes,
+					 sizeof(planes) / sizeof(planes[0]));
+
+		for (i = 0; i < count; i++) {
+			/* the planes of one crtc are listed together */
+			if (!i || planes[i].crtc_id != planes[i - 1].crtc_id) {
+				if (n == max)
+					break;
+				snprintf(d[n].name, sizeof(d[n].name),
+					 "card%d-crtc%u", card,
+					 planes[i].crtc_id);
+				d[n].layers = 0;
+				d[n].bytes_per_frame = 0;
+				d[n].refresh_rate = planes[i].refresh;
+				n++;
+			}
+			j = n - 1;
+			d[j].layers++;
+			d[j].bytes_per_frame += (double)planes[i].width *
+						planes[i].height *
+						planes[i].bpp / 8;
+		}
+	}
 
-	assert(var.vmode == FB_VMODE_NONINTERLACED);
+	return n;
+}
 
-	vtotal = var.left_margin + var.xres + var.right_margin + var.hsync_len;
-	htotal = var.upper_margin + var.yres + var.lower_margin + var.vsync_len;
-	refresh_rate = 1e12 / var.pixclock / htotal / vtotal;
-	framebuffer_size = var.xres * var.yres * (var.bits_per_pixel / 8);
+/*
+ * With kms active, the fbdevs are only its emulation of one of the
+ * planes, so they would be counted twice. Only without any kms crtc
+ * doing scanout, each fbdev with timings counts as a display (the
+ * layers of the older display drivers each have an fbdev of their own).
+ */
+static int scanout_model(scanout_display_t *d, int max)
+{
+	int n = scanout_kms_model(d, max);
+
+	if (n > 0)
+		return n;
+
+	return scanout_fbdev_model(d, max);
+}
 
-	printf("Framebuffer refresh rate: %.1f Hz\n", refresh_rate);
+/*
+ * fb_scanout counts the reads of all the displays, fb_scanoutN only the
+ * ones of display N, for a counter per display.
+ */
+void *fb_scanout_thread(void *data)
+{
+	workload_t *w = (workload_t *)data;
+	scanout_display_t d[SCANOUT_DISPLAYS_MAX];
+	struct limare_kms *kms = NULL;
+	int fd, ret, i = 0, n, display = (intptr_t)w->extra_data - 1;
+	double bytes_per_second = 0;
+	double start_time;
 
 	/* unblank the screen right from the start */
-	ret = ioctl(fd, FBIOBLANK, FB_BLANK_UNBLANK);
-	assert(!ret);
+	fd = open("/dev/fb0", O_RDWR);
+	if (fd != -1) {
+		ret = ioctl(fd, FBIOBLANK, FB_BLANK_UNBLANK);
+		assert(!ret);
+	}
+
+	n = scanout_model(d, SCANOUT_DISPLAYS_MAX);
+	if (n <= 0) {
+		/* nothing is lit up, so set a kms mode ourselves */
+		kms = kms_get(0);
+		assert(kms);
+		n = scanout_model(d, SCANOUT_DISPLAYS_MAX);
+	}
+	assert(n > 0);
+
+	for (i = 0; i < n; i++) {
+		if (display >= 0 && display != i)
+			continue;
+		printf("Scanout %d (%s): %d layer%s, %.1f Hz, %.1f MB/s\n", i,
+		       d[i].name, d[i].layers, d[i].layers == 1 ? "" : "s",
+		       d[i].refresh_rate,
+		       d[i].bytes_per_frame * d[i].refresh_rate / 1e6);
+		bytes_per_second += d[i].bytes_per_frame * d[i].refresh_rate;
+	}
+	if (display >= n)
+		printf("There is no scanout %d, counting nothing\n", display);
 
 	start_time = gettime();
 
 	/* Just wake up periodically and update the data counter */
-	while (1) {
+	for (i = 0; ; i++) {
 		/* Kick unblank at regular intervals */
-		if (i++ % 600 == 0) {
+		if (fd != -1 && i % 600 == 0) {
 			ret = ioctl(fd, FBIOBLANK, FB_BLANK_UNBLANK);
 			assert(!ret);
 		}
@@ -87,12 +218,13 @@ void *fb_scanout_thread(void *data)
 		/* Sleep a bit (does not really matter how much) */
 		usleep(1000000 / 50);
 
-		pthread_mutex_lock(&bandwidth_counters_mutex);
-		w->bytes_counter = framebuffer_size * refresh_rate *
-				   (gettime() - start_time);
-		pthread_mutex_unlock(&bandwidth_counters_mutex);
+		workload_set_bytes(w, bytes_per_second *
+				      (gettime() - start_time));
 	}
 
-	close(fd);
+	if (kms)
+		kms_put(kms, 0);
+	if (fd != -1)
+		close(fd);
 	return 0;
 }
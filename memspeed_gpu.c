@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <math.h>
 #include <unistd.h>
 #include <time.h>
 #include <errno.h>
@@ -40,10 +41,31 @@
 #include "memspeed_gpu.h"
 #include "load_mali_kernel_module.h"
 
+/*
+ * The bytes that the gpu really moved since the last call, as counted by
+ * its performance counters. Until the first job came back with counters,
+ * fall back to the estimate of the caller.
+ */
+static uint64_t gpu_bus_bytes(struct limare_state *state, uint64_t *total,
+			      uint64_t estimate)
+{
+	unsigned long long read, write;
+	uint64_t delta;
+
+	if (limare_job_bus_bytes(state, &read, &write))
+		return estimate;
+
+	delta = read + write - *total;
+	*total = read + write;
+
+	return delta;
+}
+
 void *gpu_write_thread(void *data)
 {
 	workload_t *w = (workload_t *)data;
 	struct limare_state *state;
+	uint64_t bus_total = 0;
 	double t1, t2;
 	int i = 0;
 	int ret;
@@ -59,6 +81,11 @@ void *gpu_write_thread(void *data)
 
 	limare_buffer_size(state, &width, &height);
 
+	/* for the job timing at the end of the run */
+	__atomic_store_n(&w->extra_data, state, __ATOMIC_RELEASE);
+
+	limare_job_counters_enable(state, 1);
+
 	while (1) {
 		state->clear_color = 0xFF000040 + abs((i++ * 1) %
 				((255 - 0x40) * 2) - (255 - 0x40));
@@ -67,9 +94,8 @@ void *gpu_write_thread(void *data)
 		assert(!ret);
 		limare_buffer_swap(state);
 
-		pthread_mutex_lock(&bandwidth_counters_mutex);
-		w->bytes_counter += width * height * (state->fb->bpp / 8);
-		pthread_mutex_unlock(&bandwidth_counters_mutex);
+		workload_add_bytes(w, gpu_bus_bytes(state, &bus_total,
+				width * height * (state->fb->bpp / 8)));
 	}
 
 	limare_finish(state);
@@ -102,25 +128,55 @@ static unsigned char copytest_indices[COPYTEST_TRIANGLE_COUNT][3] = {
 	{3,  2,  1},
 };
 
+static int gpu_texture_format = LIMA_TEXEL_FORMAT_RGBA_8888;
 
-void *gpu_copy_thread(void *data)
+int gpu_texture_format_set(const char *name)
 {
-	workload_t *w = (workload_t *)data;
-	struct limare_state *state;
-	int ret, width, height, x, y;
+	int format = limare_texel_format_parse(name);
 
-	#include "shader_v.h"
-	#include "shader_f.h"
+	if (format == -1)
+		return -1;
 
-	load_mali_kernel_module();
+	gpu_texture_format = format;
+	return 0;
+}
 
-	state = limare_init();
-	assert(state);
+static uint32_t *checkerboard_create(int width, int height)
+{
+	uint32_t *checkerboard = malloc(width * height * sizeof(uint32_t));
+	int x, y;
 
-	ret = limare_state_setup(state, 0, 0, 0xFF505050);
-	assert(state);
+	assert(checkerboard);
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			uint32_t color;
+			if (((x * 8 / width) % 2 == 0) ^ ((y * 8 / height) % 2 == 0))
+				color = (x % 2) ? 0xFFFFFFFF : 0;
+			else
+				color = (y % 2) ? 0xFFFFFFFF : 0;
+			checkerboard[y * width + x] = color;
+		}
+	}
 
-	limare_buffer_size(state, &width, &height);
+	return checkerboard;
+}
+
+/* The checkerboard, in the texel format that was asked for */
+static void *checkerboard_texture_create(int width, int height, int format)
+{
+	uint32_t *checkerboard = checkerboard_create(width, height);
+	void *texels = limare_texels_convert(checkerboard, width, height,
+					     format);
+
+	assert(texels);
+	free(checkerboard);
+	return texels;
+}
+
+static int copytest_program_setup(struct limare_state *state)
+{
+	#include "shader_v.h"
+	#include "shader_f.h"
 
 	int program = limare_program_new(state);
 	vertex_shader_attach_mbs_stream(state, program, vertex_shader_binary,
@@ -135,32 +191,58 @@ void *gpu_copy_thread(void *data)
 				 2, 0, COPYTEST_VERTEX_COUNT,
 				 copytest_texture_coordinates);
 
+	return program;
+}
+
+
+void *gpu_copy_thread(void *data)
+{
+	workload_t *w = (workload_t *)data;
+	struct limare_state *state;
+	uint64_t bus_total = 0;
+	int ret, width, height;
+	int format = gpu_texture_format;
+	int texel_bits = limare_texel_format_bits(format);
+
+	load_mali_kernel_module();
+
+	state = limare_init();
+	assert(state);
+
+	ret = limare_state_setup(state, 0, 0, 0xFF505050);
+	assert(state);
+
+	limare_buffer_size(state, &width, &height);
+
+	/* for the job timing at the end of the run */
+	__atomic_store_n(&w->extra_data, state, __ATOMIC_RELEASE);
+
+	limare_job_counters_enable(state, 1);
+
+	copytest_program_setup(state);
+
 	/* Generate a texture */
-	uint32_t *checkerboard_texture = malloc(width * height * sizeof(uint32_t));
-	assert(checkerboard_texture);
-	for (y = 0; y < height; y++) {
-		for (x = 0; x < width; x++) {
-			uint32_t color;
-			if (((x * 8 / width) % 2 == 0) ^ ((y * 8 / height) % 2 == 0))
-				color = (x % 2) ? 0xFFFFFFFF : 0;
-			else
-				color = (y % 2) ? 0xFFFFFFFF : 0;
-			checkerboard_texture[y * width + x] = color;
-		}
-	}
+	void *checkerboard_texture = checkerboard_texture_create(width, height,
+								 format);
 
 	int texture = limare_texture_upload(state, checkerboard_texture,
-					    width, height,
-					    LIMA_TEXEL_FORMAT_RGBA_8888, 0);
+					    width, height, format, 0);
 	limare_texture_attach(state, "in_texture", texture);
 
 	ESMatrix modelviewprojection;
 	esMatrixLoadIdentity(&modelviewprojection);
 	esTranslate(&modelviewprojection, 0.0, 0.0, -0.5);
 
+	/* resolve the names once, instead of on every frame */
+	int mvp = limare_uniform_location(state, "modelviewprojectionMatrix");
+	assert(mvp != -1);
+
+	/* the frames are all the same, so only build them once */
+	limare_command_list_begin(state);
+
 	while (1) {
-		limare_uniform_attach(state, "modelviewprojectionMatrix", 16,
-				      &modelviewprojection.m[0][0]);
+		limare_uniform_attach_location(state, mvp, 16,
+					       &modelviewprojection.m[0][0]);
 		limare_frame_new(state);
 		ret = limare_draw_elements(state, GL_TRIANGLES,
 					   COPYTEST_INDEX_COUNT,
@@ -171,10 +253,9 @@ void *gpu_copy_thread(void *data)
 		assert(!ret);
 		limare_buffer_swap(state);
 
-		pthread_mutex_lock(&bandwidth_counters_mutex);
-		w->bytes_counter += width * height * (state->fb->bpp / 8) +
-				    width * height * 4;
-		pthread_mutex_unlock(&bandwidth_counters_mutex);
+		workload_add_bytes(w, gpu_bus_bytes(state, &bus_total,
+				width * height * (state->fb->bpp / 8) +
+				width * height * texel_bits / 8));
 	}
 
 	limare_finish(state);
@@ -182,3 +263,837 @@ void *gpu_copy_thread(void *data)
 
 	return 0;
 }
+
+/******************************************************************************/
+
+/*
+ * Render into one texture while sampling the other, and swap them every
+ * frame. Unlike gpu_copy, whose single static texture mostly comes out of
+ * the texture cache, this reads and writes a full surface each frame.
+ */
+void *gpu_pingpong_thread(void *data)
+{
+	workload_t *w = (workload_t *)data;
+	struct limare_state *state;
+	uint64_t bus_total = 0;
+	int ret, width, height, i;
+	int textures[2];
+	int format = gpu_texture_format;
+
+	/* these also get rendered to, which rgb888 and etc1 can't be */
+	if ((format == LIMA_TEXEL_FORMAT_RGB_888) ||
+	    (format == LIMA_TEXEL_FORMAT_ETC1_RGB8)) {
+		printf("gpu_pingpong: format is no render target, using rgba8888\n");
+		format = LIMA_TEXEL_FORMAT_RGBA_8888;
+	}
+
+	load_mali_kernel_module();
+
+	state = limare_init();
+	assert(state);
+
+	ret = limare_state_setup(state, 0, 0, 0xFF505050);
+	assert(ret == 0);
+
+	limare_buffer_size(state, &width, &height);
+
+	/* for the job timing at the end of the run */
+	__atomic_store_n(&w->extra_data, state, __ATOMIC_RELEASE);
+
+	limare_job_counters_enable(state, 1);
+
+	copytest_program_setup(state);
+
+	/* both start out as the checkerboard, it only gets flipped around */
+	void *checkerboard_texture = checkerboard_texture_create(width, height,
+								 format);
+
+	for (i = 0; i < 2; i++) {
+		textures[i] = limare_texture_upload(state, checkerboard_texture,
+						    width, height, format, 0);
+		assert(textures[i] != -1);
+	}
+
+	ESMatrix modelviewprojection;
+	esMatrixLoadIdentity(&modelviewprojection);
+	esTranslate(&modelviewprojection, 0.0, 0.0, -0.5);
+
+	/* resolve the names once, instead of on every frame */
+	int mvp = limare_uniform_location(state, "modelviewprojectionMatrix");
+	assert(mvp != -1);
+	int sampler = limare_uniform_location(state, "in_texture");
+	assert(sampler != -1);
+
+	for (i = 0; ; i ^= 1) {
+		ret = limare_render_target(state, textures[i]);
+		assert(!ret);
+		limare_texture_attach_location(state, sampler, textures[i ^ 1]);
+		limare_uniform_attach_location(state, mvp, 16,
+					       &modelviewprojection.m[0][0]);
+		limare_frame_new(state);
+		ret = limare_draw_elements(state, GL_TRIANGLES,
+					   COPYTEST_INDEX_COUNT,
+					   &copytest_indices,
+					   GL_UNSIGNED_BYTE);
+		assert(!ret);
+		ret = limare_frame_flush(state);
+		assert(!ret);
+		limare_buffer_swap(state);
+
+		workload_add_bytes(w, gpu_bus_bytes(state, &bus_total,
+				2 * width * height *
+				limare_texel_format_bits(format) / 8));
+	}
+
+	limare_finish(state);
+	free(checkerboard_texture);
+
+	return 0;
+}
+
+/******************************************************************************/
+
+int gpu_blend_layers = GPU_BLEND_LAYERS_DEFAULT;
+
+/*
+ * Full screen alpha blended quads on top of each other. Every layer reads
+ * and writes back each pixel of the tile buffer, while memory only sees
+ * the final tile writes. The texture is a single block, so that it stays
+ * in the texture cache.
+ */
+void *gpu_blend_thread(void *data)
+{
+	workload_t *w = (workload_t *)data;
+	struct limare_state *state;
+	uint64_t bus_total = 0;
+	int ret, width, height, i;
+	int start[GPU_BLEND_LAYERS_MAX], count[GPU_BLEND_LAYERS_MAX];
+	int layers = gpu_blend_layers;
+	uint32_t pixels[16 * 16];
+	uint32_t color = 0x12345678;
+
+	load_mali_kernel_module();
+
+	state = limare_init();
+	assert(state);
+
+	ret = limare_state_setup(state, 0, 0, 0xFF505050);
+	assert(ret == 0);
+
+	limare_buffer_size(state, &width, &height);
+
+	/* for the job timing at the end of the run */
+	__atomic_store_n(&w->extra_data, state, __ATOMIC_RELEASE);
+
+	limare_job_counters_enable(state, 1);
+
+	copytest_program_setup(state);
+
+	/* half transparent, so that every layer has to read the tile back */
+	for (i = 0; i < 16 * 16; i++) {
+		color = color * 1103515245 + 12345;
+		pixels[i] = (color & 0x00FFFFFF) | 0x80000000;
+	}
+
+	int texture = limare_texture_upload(state, pixels, 16, 16,
+					    LIMA_TEXEL_FORMAT_RGBA_8888, 0);
+	assert(texture != -1);
+	limare_texture_attach(state, "in_texture", texture);
+
+	ret = limare_blend_func(state, GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	assert(!ret);
+	ret = limare_enable(state, GL_BLEND);
+	assert(!ret);
+
+	ESMatrix modelviewprojection;
+	esMatrixLoadIdentity(&modelviewprojection);
+	esTranslate(&modelviewprojection, 0.0, 0.0, -0.5);
+
+	/* resolve the names once, instead of on every frame */
+	int mvp = limare_uniform_location(state, "modelviewprojectionMatrix");
+	assert(mvp != -1);
+
+	for (i = 0; i < layers; i++) {
+		start[i] = 0;
+		count[i] = COPYTEST_VERTEX_COUNT;
+	}
+
+	while (1) {
+		limare_uniform_attach_location(state, mvp, 16,
+					       &modelviewprojection.m[0][0]);
+		limare_frame_new(state);
+		ret = limare_draw_arrays_multi(state, GL_TRIANGLE_STRIP,
+					       start, count, layers);
+		assert(!ret);
+		ret = limare_frame_flush(state);
+		assert(!ret);
+		limare_buffer_swap(state);
+
+		workload_add_bytes(w, gpu_bus_bytes(state, &bus_total,
+				width * height * (state->fb->bpp / 8)));
+	}
+
+	limare_finish(state);
+
+	return 0;
+}
+
+/******************************************************************************/
+
+int gpu_samplers = GPU_SAMPLERS_DEFAULT;
+
+/*
+ * A grid of screen cells, each of which samples every texture at its own
+ * random spot, GPU_SAMPLER_STRIDE texels apart from one pixel to the next.
+ * Every fragment then lands in a different texture block of each of the
+ * large textures, so the texture cache keeps missing, and each pixel reads
+ * gpu_samplers times as much as gpu_copy does.
+ *
+ * With the binary driver around, a program with that many samplers gets
+ * compiled. The precompiled shaders only have the one sampler, so then
+ * the textures get drawn in as many opaque passes instead, each with its
+ * own coordinates. The pp samples them all just the same, as nothing is
+ * hidden behind the others before it shades.
+ */
+#define GPU_SAMPLER_TEXTURE_WIDTH 1024
+#define GPU_SAMPLER_TEXTURE_HEIGHT 768
+#define GPU_SAMPLER_STRIDE 8
+#define GPU_SAMPLER_GRID 16
+#define GPU_SAMPLER_CELLS (GPU_SAMPLER_GRID * GPU_SAMPLER_GRID)
+
+static float sampler_vertices[GPU_SAMPLER_CELLS * 4][3];
+static float sampler_coords[GPU_SAMPLERS_MAX][GPU_SAMPLER_CELLS * 4][2];
+static unsigned short sampler_indices[GPU_SAMPLER_CELLS * 6];
+
+static void sampler_grid_create(int width, int height)
+{
+	uint32_t seed = 0x3C6EF372;
+	float span_s = (float) width * GPU_SAMPLER_STRIDE /
+		(GPU_SAMPLER_GRID * GPU_SAMPLER_TEXTURE_WIDTH);
+	float span_t = (float) height * GPU_SAMPLER_STRIDE /
+		(GPU_SAMPLER_GRID * GPU_SAMPLER_TEXTURE_HEIGHT);
+	int x, y, i, j, v;
+
+	for (y = 0, i = 0; y < GPU_SAMPLER_GRID; y++) {
+		for (x = 0; x < GPU_SAMPLER_GRID; x++, i++) {
+			for (v = 0; v < 4; v++) {
+				float *vertex = sampler_vertices[4 * i + v];
+
+				vertex[0] = 2.0 * (x + (v & 1)) /
+					GPU_SAMPLER_GRID - 1.0;
+				vertex[1] = 2.0 * (y + (v >> 1)) /
+					GPU_SAMPLER_GRID - 1.0;
+				vertex[2] = 1.0;
+			}
+
+			for (j = 0; j < GPU_SAMPLERS_MAX; j++) {
+				float s, t;
+
+				seed = seed * 1103515245 + 12345;
+				s = (seed >> 16) / 65536.0;
+				seed = seed * 1103515245 + 12345;
+				t = (seed >> 16) / 65536.0;
+
+				for (v = 0; v < 4; v++) {
+					float *coord =
+						sampler_coords[j][4 * i + v];
+
+					coord[0] = s + span_s * (v & 1);
+					coord[1] = t + span_t * (v >> 1);
+				}
+			}
+
+			sampler_indices[6 * i + 0] = 4 * i + 0;
+			sampler_indices[6 * i + 1] = 4 * i + 1;
+			sampler_indices[6 * i + 2] = 4 * i + 2;
+			sampler_indices[6 * i + 3] = 4 * i + 3;
+			sampler_indices[6 * i + 4] = 4 * i + 2;
+			sampler_indices[6 * i + 5] = 4 * i + 1;
+		}
+	}
+}
+
+#ifndef HAVE_NO_LIBMALI_BLOB
+/*
+ * A program which multiplies the samples of count textures, from
+ * in_texture0 with in_coord0 on.
+ */
+static int sampler_program_setup(struct limare_state *state, int count)
+{
+	char vertex_shader_source[1024], fragment_shader_source[1024];
+	char *source;
+	int program, i;
+
+	source = vertex_shader_source;
+	source += sprintf(source,
+			  "uniform mat4 modelviewprojectionMatrix;\n"
+			  "attribute vec4 in_position;\n");
+	for (i = 0; i < count; i++)
+		source += sprintf(source, "attribute vec2 in_coord%d;\n"
+				  "varying vec2 coord%d;\n", i, i);
+	source += sprintf(source, "void main()\n{\n"
+			  "    gl_Position = modelviewprojectionMatrix * "
+			  "in_position;\n");
+	for (i = 0; i < count; i++)
+		source += sprintf(source, "    coord%d = in_coord%d;\n", i, i);
+	sprintf(source, "}\n");
+
+	source = fragment_shader_source;
+	source += sprintf(source, "precision mediump float;\n");
+	for (i = 0; i < count; i++)
+		source += sprintf(source, "varying vec2 coord%d;\n"
+				  "uniform sampler2D in_texture%d;\n", i, i);
+	source += sprintf(source, "void main()\n{\n"
+			  "    gl_FragColor = texture2D(in_texture0, coord0)");
+	for (i = 1; i < count; i++)
+		source += sprintf(source,
+				  " *\n        texture2D(in_texture%d, coord%d)",
+				  i, i);
+	sprintf(source, ";\n}\n");
+
+	program = limare_program_new(state);
+	vertex_shader_attach(state, program, vertex_shader_source);
+	fragment_shader_attach(state, program, fragment_shader_source);
+	limare_link(state);
+
+	return program;
+}
+#endif
+
+void *gpu_sampler_thread(void *data)
+{
+	workload_t *w = (workload_t *)data;
+	struct limare_state *state;
+	uint64_t bus_total = 0;
+	int ret, width, height, i, j;
+	int samplers = gpu_samplers;
+	int textures[GPU_SAMPLERS_MAX];
+	uint32_t *pixels;
+	uint32_t seed = 0x9E3779B9;
+
+	load_mali_kernel_module();
+
+	state = limare_init();
+	assert(state);
+
+	ret = limare_state_setup(state, 0, 0, 0xFF505050);
+	assert(ret == 0);
+
+	limare_buffer_size(state, &width, &height);
+
+	/* for the job timing at the end of the run */
+	__atomic_store_n(&w->extra_data, state, __ATOMIC_RELEASE);
+
+	limare_job_counters_enable(state, 1);
+
+	sampler_grid_create(width, height);
+
+	/* noise, so that no two textures, or neighbouring texels, match */
+	pixels = malloc(GPU_SAMPLER_TEXTURE_WIDTH * GPU_SAMPLER_TEXTURE_HEIGHT *
+			sizeof(uint32_t));
+	assert(pixels);
+
+	for (j = 0; j < samplers; j++) {
+		for (i = 0; i < (GPU_SAMPLER_TEXTURE_WIDTH *
+				 GPU_SAMPLER_TEXTURE_HEIGHT); i++) {
+			seed = seed * 1103515245 + 12345;
+			pixels[i] = (seed >> 8) | 0xFF000000;
+		}
+
+		textures[j] = limare_texture_upload(state, pixels,
+						    GPU_SAMPLER_TEXTURE_WIDTH,
+						    GPU_SAMPLER_TEXTURE_HEIGHT,
+						    LIMA_TEXEL_FORMAT_RGBA_8888,
+						    0);
+		assert(textures[j] != -1);
+
+		ret = limare_texture_parameters(state, textures[j], GL_NEAREST,
+						GL_NEAREST, GL_REPEAT,
+						GL_REPEAT);
+		assert(!ret);
+	}
+	free(pixels);
+
+#ifndef HAVE_NO_LIBMALI_BLOB
+	sampler_program_setup(state, samplers);
+
+	limare_attribute_pointer(state, "in_position", LIMARE_ATTRIB_FLOAT,
+				 3, 0, GPU_SAMPLER_CELLS * 4, sampler_vertices);
+	for (j = 0; j < samplers; j++) {
+		char name[32];
+
+		snprintf(name, sizeof(name), "in_coord%d", j);
+		limare_attribute_pointer(state, name, LIMARE_ATTRIB_FLOAT, 2,
+					 0, GPU_SAMPLER_CELLS * 4,
+					 sampler_coords[j]);
+		snprintf(name, sizeof(name), "in_texture%d", j);
+		limare_texture_attach(state, name, textures[j]);
+	}
+	int passes = 1;
+#else
+	copytest_program_setup(state);
+
+	limare_attribute_pointer(state, "in_position", LIMARE_ATTRIB_FLOAT,
+				 3, 0, GPU_SAMPLER_CELLS * 4, sampler_vertices);
+	int passes = samplers;
+#endif
+
+	ESMatrix modelviewprojection;
+	esMatrixLoadIdentity(&modelviewprojection);
+	esTranslate(&modelviewprojection, 0.0, 0.0, -0.5);
+
+	/* resolve the names once, instead of on every frame */
+	int mvp = limare_uniform_location(state, "modelviewprojectionMatrix");
+	assert(mvp != -1);
+#ifdef HAVE_NO_LIBMALI_BLOB
+	int coord = limare_attribute_location(state, "in_coord");
+	assert(coord != -1);
+	int sampler = limare_uniform_location(state, "in_texture");
+	assert(sampler != -1);
+#endif
+
+	while (1) {
+		limare_uniform_attach_location(state, mvp, 16,
+					       &modelviewprojection.m[0][0]);
+		limare_frame_new(state);
+
+		for (j = 0; j < passes; j++) {
+#ifdef HAVE_NO_LIBMALI_BLOB
+			limare_attribute_pointer_location(state, coord,
+						LIMARE_ATTRIB_FLOAT, 2, 0,
+						GPU_SAMPLER_CELLS * 4,
+						sampler_coords[j]);
+			limare_texture_attach_location(state, sampler,
+						       textures[j]);
+#endif
+			ret = limare_draw_elements(state, GL_TRIANGLES,
+						   GPU_SAMPLER_CELLS * 6,
+						   sampler_indices,
+						   GL_UNSIGNED_SHORT);
+			assert(!ret);
+		}
+
+		ret = limare_frame_flush(state);
+		assert(!ret);
+		limare_buffer_swap(state);
+
+		workload_add_bytes(w, gpu_bus_bytes(state, &bus_total,
+				width * height * (state->fb->bpp / 8) +
+				(uint64_t) width * height * samplers * 4));
+	}
+
+	limare_finish(state);
+
+	return 0;
+}
+
+/******************************************************************************/
+
+uint64_t gpu_scatter_frame_bytes;
+
+/*
+ * The worst case of an image warp: the screen is cut into a grid of
+ * cells, and each cell samples a texel per pixel from its own random spot
+ * of a texture far larger than the texture cache, at a random angle. Within
+ * a cell the reads stay local, from one cell to the next they jump, so the
+ * cache only helps within a cell, and not at all in raster order.
+ *
+ * The dram reads get estimated from the same coordinates: every distinct
+ * 64 byte line, a 4x4 square of texels in the 16x16 blocked layout, that
+ * a cell touches gets read once per frame.
+ */
+#define GPU_SCATTER_TEXTURE_WIDTH 2048
+#define GPU_SCATTER_TEXTURE_HEIGHT 1024
+#define GPU_SCATTER_GRID_W 128
+#define GPU_SCATTER_GRID_H 72
+#define GPU_SCATTER_CELLS (GPU_SCATTER_GRID_W * GPU_SCATTER_GRID_H)
+#define GPU_SCATTER_LINE_SHIFT 2
+
+struct scatter_cell {
+	float s, t;		/* texel at the centre */
+	float cos, sin;
+};
+
+static float scatter_random(uint32_t *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return (*seed >> 16) / 65536.0;
+}
+
+/*
+ * Distinct lines which the pixels of a cell of width x height pixels sample
+ * from, seen is a bitmap of all lines, which gets left cleared.
+ */
+static int scatter_cell_lines(const struct scatter_cell *cell, float width,
+			      float height, uint8_t *seen)
+{
+	int lines_w = GPU_SCATTER_TEXTURE_WIDTH >> GPU_SCATTER_LINE_SHIFT;
+	int lines_h = GPU_SCATTER_TEXTURE_HEIGHT >> GPU_SCATTER_LINE_SHIFT;
+	int *touched = malloc((int) (width + 1) * (int) (height + 1) *
+			      sizeof(int));
+	int x, y, i, count = 0;
+
+	assert(touched);
+
+	for (y = 0; y < (int) height; y++) {
+		for (x = 0; x < (int) width; x++) {
+			float dx = x + 0.5 - width / 2;
+			float dy = y + 0.5 - height / 2;
+			int s = cell->s + dx * cell->cos - dy * cell->sin;
+			int t = cell->t + dx * cell->sin + dy * cell->cos;
+			int line;
+
+			s = (s >> GPU_SCATTER_LINE_SHIFT) & (lines_w - 1);
+			t = (t >> GPU_SCATTER_LINE_SHIFT) & (lines_h - 1);
+			line = t * lines_w + s;
+
+			if (!(seen[line >> 3] & (1 << (line & 7)))) {
+				seen[line >> 3] |= 1 << (line & 7);
+				touched[count++] = line;
+			}
+		}
+	}
+
+	for (i = 0; i < count; i++)
+		seen[touched[i] >> 3] = 0;
+
+	free(touched);
+
+	return count;
+}
+
+void *gpu_scatter_thread(void *data)
+{
+	workload_t *w = (workload_t *)data;
+	struct limare_state *state;
+	uint64_t bus_total = 0, lines = 0;
+	int ret, width, height, x, y, i, v;
+	int vertices_buffer, coords_buffer, indices_buffer;
+	struct scatter_cell cell;
+	uint32_t seed = 0x2545F491;
+	uint32_t *pixels;
+	uint8_t *seen;
+
+	float *vertices = calloc(1, ALIGN(GPU_SCATTER_CELLS * 4 * 3 *
+					  sizeof(float), 0x40));
+	float *coords = calloc(1, ALIGN(GPU_SCATTER_CELLS * 4 * 2 *
+					sizeof(float), 0x40));
+	unsigned short *indices =
+		calloc(1, ALIGN(GPU_SCATTER_CELLS * 6 * sizeof(unsigned short),
+				0x40));
+	seen = calloc(1, (GPU_SCATTER_TEXTURE_WIDTH *
+			  GPU_SCATTER_TEXTURE_HEIGHT) >>
+		      (2 * GPU_SCATTER_LINE_SHIFT + 3));
+	assert(vertices && coords && indices && seen);
+
+	load_mali_kernel_module();
+
+	state = limare_init();
+	assert(state);
+
+	ret = limare_state_setup(state, 0, 0, 0xFF505050);
+	assert(ret == 0);
+
+	limare_buffer_size(state, &width, &height);
+
+	/* for the job timing at the end of the run */
+	__atomic_store_n(&w->extra_data, state, __ATOMIC_RELEASE);
+
+	limare_job_counters_enable(state, 1);
+
+	copytest_program_setup(state);
+
+	float cell_w = (float) width / GPU_SCATTER_GRID_W;
+	float cell_h = (float) height / GPU_SCATTER_GRID_H;
+
+	for (y = 0, i = 0; y < GPU_SCATTER_GRID_H; y++) {
+		for (x = 0; x < GPU_SCATTER_GRID_W; x++, i++) {
+			float angle = 2 * M_PI * scatter_random(&seed);
+
+			cell.s = GPU_SCATTER_TEXTURE_WIDTH *
+				scatter_random(&seed);
+			cell.t = GPU_SCATTER_TEXTURE_HEIGHT *
+				scatter_random(&seed);
+			cell.cos = cos(angle);
+			cell.sin = sin(angle);
+
+			for (v = 0; v < 4; v++) {
+				float dx = ((v & 1) - 0.5) * cell_w;
+				float dy = ((v >> 1) - 0.5) * cell_h;
+				float *vertex = vertices + 3 * (4 * i + v);
+				float *coord = coords + 2 * (4 * i + v);
+
+				vertex[0] = 2.0 * (x + (v & 1)) /
+					GPU_SCATTER_GRID_W - 1.0;
+				vertex[1] = 2.0 * (y + (v >> 1)) /
+					GPU_SCATTER_GRID_H - 1.0;
+				vertex[2] = 1.0;
+
+				coord[0] = (cell.s + dx * cell.cos -
+					    dy * cell.sin) /
+					GPU_SCATTER_TEXTURE_WIDTH;
+				coord[1] = (cell.t + dx * cell.sin +
+					    dy * cell.cos) /
+					GPU_SCATTER_TEXTURE_HEIGHT;
+			}
+
+			indices[6 * i + 0] = 4 * i + 0;
+			indices[6 * i + 1] = 4 * i + 1;
+			indices[6 * i + 2] = 4 * i + 2;
+			indices[6 * i + 3] = 4 * i + 3;
+			indices[6 * i + 4] = 4 * i + 2;
+			indices[6 * i + 5] = 4 * i + 1;
+
+			lines += scatter_cell_lines(&cell, cell_w, cell_h,
+						    seen);
+		}
+	}
+	free(seen);
+
+	gpu_scatter_frame_bytes = lines << (2 * GPU_SCATTER_LINE_SHIFT + 2);
+
+	vertices_buffer =
+		limare_attribute_buffer_upload(state, LIMARE_ATTRIB_FLOAT, 3, 0,
+					       GPU_SCATTER_CELLS * 4, vertices);
+	coords_buffer =
+		limare_attribute_buffer_upload(state, LIMARE_ATTRIB_FLOAT, 2, 0,
+					       GPU_SCATTER_CELLS * 4, coords);
+	indices_buffer =
+		limare_elements_buffer_upload(state, GL_TRIANGLES,
+					      GL_UNSIGNED_SHORT,
+					      GPU_SCATTER_CELLS * 6, indices);
+	assert(vertices_buffer >= 0 && coords_buffer >= 0 &&
+	       indices_buffer >= 0);
+	free(vertices);
+	free(coords);
+	free(indices);
+
+	limare_attribute_buffer_attach(state, "in_position", vertices_buffer);
+	limare_attribute_buffer_attach(state, "in_coord", coords_buffer);
+
+	/* noise, so that no two texels are alike */
+	pixels = malloc(GPU_SCATTER_TEXTURE_WIDTH * GPU_SCATTER_TEXTURE_HEIGHT *
+			sizeof(uint32_t));
+	assert(pixels);
+	for (i = 0; i < (GPU_SCATTER_TEXTURE_WIDTH *
+			 GPU_SCATTER_TEXTURE_HEIGHT); i++) {
+		seed = seed * 1103515245 + 12345;
+		pixels[i] = (seed >> 8) | 0xFF000000;
+	}
+
+	int texture = limare_texture_upload(state, pixels,
+					    GPU_SCATTER_TEXTURE_WIDTH,
+					    GPU_SCATTER_TEXTURE_HEIGHT,
+					    LIMA_TEXEL_FORMAT_RGBA_8888, 0);
+	assert(texture != -1);
+	free(pixels);
+
+	ret = limare_texture_parameters(state, texture, GL_NEAREST, GL_NEAREST,
+					GL_REPEAT, GL_REPEAT);
+	assert(!ret);
+	limare_texture_attach(state, "in_texture", texture);
+
+	ESMatrix modelviewprojection;
+	esMatrixLoadIdentity(&modelviewprojection);
+	esTranslate(&modelviewprojection, 0.0, 0.0, -0.5);
+
+	/* resolve the names once, instead of on every frame */
+	int mvp = limare_uniform_location(state, "modelviewprojectionMatrix");
+	assert(mvp != -1);
+
+	/* the frames are all the same, so only build them once */
+	limare_command_list_begin(state);
+
+	while (1) {
+		limare_uniform_attach_location(state, mvp, 16,
+					       &modelviewprojection.m[0][0]);
+		limare_frame_new(state);
+		ret = limare_draw_elements_buffer(state, indices_buffer);
+		assert(!ret);
+		ret = limare_frame_flush(state);
+		assert(!ret);
+		limare_buffer_swap(state);
+
+		workload_add_bytes(w, gpu_bus_bytes(state, &bus_total,
+				width * height * (state->fb->bpp / 8) +
+				gpu_scatter_frame_bytes));
+	}
+
+	limare_finish(state);
+
+	return 0;
+}
+
+/******************************************************************************/
+
+/*
+ * A 256x256 vertex grid and a multi megabyte index buffer, which runs over
+ * the grid a number of times, back facing so that the plbu culls it. Only
+ * a coarse subset of the grid faces the front, so that the polygon lists
+ * see some work too without overflowing the tile heap. This keeps the gp
+ * vertex fetch and the plbu index reads busy, with little left for the pp.
+ */
+#define GPU_VERTEX_VISIBLE_INDEX_COUNT \
+	((GPU_VERTEX_GRID / GPU_VERTEX_VISIBLE_STEP) * \
+	 (GPU_VERTEX_GRID / GPU_VERTEX_VISIBLE_STEP) * 6)
+#define GPU_VERTEX_INDEX_COUNT (GPU_VERTEX_VISIBLE_INDEX_COUNT + \
+	GPU_VERTEX_PASSES * GPU_VERTEX_GRID * GPU_VERTEX_GRID * 6)
+
+static int gpu_vertex_format = LIMARE_ATTRIB_FLOAT;
+
+/* the grid spans [-1, 1], which only the signed types can hold */
+int gpu_vertex_format_set(const char *name)
+{
+	int type = limare_attrib_type_parse(name);
+
+	if ((type != LIMARE_ATTRIB_FLOAT) && (type != LIMARE_ATTRIB_FIXED) &&
+	    (type != LIMARE_ATTRIB_I16N) && (type != LIMARE_ATTRIB_I8N))
+		return -1;
+
+	gpu_vertex_format = type;
+	return 0;
+}
+
+void *gpu_vertex_thread(void *data)
+{
+	workload_t *w = (workload_t *)data;
+	struct limare_state *state;
+	uint64_t bus_total = 0;
+	int ret, x, y, i, pass;
+	int vertices_buffer, coords_buffer, indices_buffer;
+	int side = GPU_VERTEX_GRID + 1;
+	int step = GPU_VERTEX_VISIBLE_STEP;
+	int type = gpu_vertex_format;
+	int attribute_bytes = limare_attrib_stride(type, 3) +
+		limare_attrib_stride(type, 2);
+	uint32_t pixels[16 * 16];
+
+	/* the buffer uploads copy whole 0x40 byte blocks. */
+	float *vertices = calloc(1, ALIGN(GPU_VERTEX_COUNT * 3 * sizeof(float),
+					  0x40));
+	float *coords = calloc(1, ALIGN(GPU_VERTEX_COUNT * 2 * sizeof(float),
+					0x40));
+	unsigned short *indices =
+		calloc(1, ALIGN(GPU_VERTEX_INDEX_COUNT * sizeof(unsigned short),
+				0x40));
+	assert(vertices && coords && indices);
+
+	load_mali_kernel_module();
+
+	state = limare_init();
+	assert(state);
+
+	ret = limare_state_setup(state, 0, 0, 0xFF505050);
+	assert(ret == 0);
+
+	/* for the job timing at the end of the run */
+	__atomic_store_n(&w->extra_data, state, __ATOMIC_RELEASE);
+
+	limare_job_counters_enable(state, 1);
+
+	copytest_program_setup(state);
+
+	for (y = 0, i = 0; y < side; y++) {
+		for (x = 0; x < side; x++, i++) {
+			vertices[3 * i + 0] = 2.0 * x / GPU_VERTEX_GRID - 1.0;
+			vertices[3 * i + 1] = 2.0 * y / GPU_VERTEX_GRID - 1.0;
+			vertices[3 * i + 2] = 1.0;
+
+			coords[2 * i + 0] = (float) x / GPU_VERTEX_GRID;
+			coords[2 * i + 1] = (float) y / GPU_VERTEX_GRID;
+		}
+	}
+
+	/* the visible quads, every step vertices */
+	for (y = 0, i = 0; y < (GPU_VERTEX_GRID / step); y++) {
+		for (x = 0; x < (GPU_VERTEX_GRID / step); x++) {
+			int v = step * (y * side + x);
+
+			indices[i++] = v;
+			indices[i++] = v + step;
+			indices[i++] = v + step * side;
+			indices[i++] = v + step * side + step;
+			indices[i++] = v + step * side;
+			indices[i++] = v + step;
+		}
+	}
+
+	/* and the culled ones, with the opposite winding */
+	for (pass = 0; pass < GPU_VERTEX_PASSES; pass++) {
+		for (y = 0; y < GPU_VERTEX_GRID; y++) {
+			for (x = 0; x < GPU_VERTEX_GRID; x++) {
+				int v = y * side + x;
+
+				indices[i++] = v;
+				indices[i++] = v + side;
+				indices[i++] = v + 1;
+				indices[i++] = v + side + 1;
+				indices[i++] = v + 1;
+				indices[i++] = v + side;
+			}
+		}
+	}
+	assert(i == GPU_VERTEX_INDEX_COUNT);
+
+	vertices_buffer =
+		limare_attribute_buffer_upload_float(state, type, 3,
+						     GPU_VERTEX_COUNT, vertices);
+	coords_buffer =
+		limare_attribute_buffer_upload_float(state, type, 2,
+						     GPU_VERTEX_COUNT, coords);
+	indices_buffer =
+		limare_elements_buffer_upload(state, GL_TRIANGLES,
+					      GL_UNSIGNED_SHORT,
+					      GPU_VERTEX_INDEX_COUNT, indices);
+	assert(vertices_buffer >= 0 && coords_buffer >= 0 &&
+	       indices_buffer >= 0);
+	free(vertices);
+	free(coords);
+	free(indices);
+
+	limare_attribute_buffer_attach(state, "in_position", vertices_buffer);
+	limare_attribute_buffer_attach(state, "in_coord", coords_buffer);
+
+	for (i = 0; i < 16 * 16; i++)
+		pixels[i] = (i & 1) ? 0xFFFFFFFF : 0xFF000000;
+
+	int texture = limare_texture_upload(state, pixels, 16, 16,
+					    LIMA_TEXEL_FORMAT_RGBA_8888, 0);
+	assert(texture != -1);
+	limare_texture_attach(state, "in_texture", texture);
+
+	ret = limare_enable(state, GL_CULL_FACE);
+	assert(!ret);
+
+	ESMatrix modelviewprojection;
+	esMatrixLoadIdentity(&modelviewprojection);
+	esTranslate(&modelviewprojection, 0.0, 0.0, -0.5);
+
+	/* resolve the names once, instead of on every frame */
+	int mvp = limare_uniform_location(state, "modelviewprojectionMatrix");
+	assert(mvp != -1);
+
+	while (1) {
+		limare_uniform_attach_location(state, mvp, 16,
+					       &modelviewprojection.m[0][0]);
+		limare_frame_new(state);
+		ret = limare_draw_elements_buffer(state, indices_buffer);
+		assert(!ret);
+		ret = limare_frame_flush(state);
+		assert(!ret);
+		limare_buffer_swap(state);
+
+		/*
+		 * The attributes are read, gl_Position and the varying are
+		 * written by the vs, and the plbu reads them and the indices.
+		 */
+		workload_add_bytes(w, gpu_bus_bytes(state, &bus_total,
+				(uint64_t) GPU_VERTEX_COUNT *
+				(attribute_bytes + 2 * (4 * 4 + 2 * 4)) +
+				GPU_VERTEX_INDEX_COUNT * 2));
+	}
+
+	limare_finish(state);
+
+	return 0;
+}
@@ -25,5 +25,40 @@
 
 void *gpu_write_thread(void *data);
 void *gpu_copy_thread(void *data);
+void *gpu_pingpong_thread(void *data);
+
+/* what gpu_copy and gpu_pingpong texture from, see --texture-format */
+int gpu_texture_format_set(const char *name);
+
+/* full screen quads per gpu_blend frame, see --blend-layers */
+#define GPU_BLEND_LAYERS_DEFAULT 8
+#define GPU_BLEND_LAYERS_MAX 256
+extern int gpu_blend_layers;
+
+void *gpu_blend_thread(void *data);
+
+/* textures sampled per gpu_sampler pixel, see --samplers */
+#define GPU_SAMPLERS_DEFAULT 4
+#define GPU_SAMPLERS_MAX 4
+extern int gpu_samplers;
+
+void *gpu_sampler_thread(void *data);
+
+/* the estimated texture reads of every gpu_scatter frame */
+extern uint64_t gpu_scatter_frame_bytes;
+
+void *gpu_scatter_thread(void *data);
+
+/* gpu_vertex: quads per side of the grid, and how often it gets drawn */
+#define GPU_VERTEX_GRID 255
+#define GPU_VERTEX_COUNT ((GPU_VERTEX_GRID + 1) * (GPU_VERTEX_GRID + 1))
+#define GPU_VERTEX_PASSES 8
+/* every this many vertices, the grid faces the front */
+#define GPU_VERTEX_VISIBLE_STEP 5
+
+/* what gpu_vertex packs its attributes into, see --vertex-format */
+int gpu_vertex_format_set(const char *name);
+
+void *gpu_vertex_thread(void *data);
 
 #endif
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* for syscall() under -D_POSIX_C_SOURCE */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "memspeed_pmu.h"
+
+#define PMU_CACHE(cache, result) \
+	((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | ((result) << 16))
+
+static const struct {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+} pmu_events[PMU_EVENTS] = {
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "instr", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "L1D miss", PERF_TYPE_HW_CACHE,
+	  PMU_CACHE(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS) },
+	{ "L2 miss", PERF_TYPE_HW_CACHE,
+	  PMU_CACHE(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_MISS) },
+	{ "TLB miss", PERF_TYPE_HW_CACHE,
+	  PMU_CACHE(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_RESULT_MISS) },
+	{ "bus", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BUS_CYCLES },
+	{ "stalls", PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND },
+};
+
+/*
+ * Start counting in the calling thread. An event which the kernel or the
+ * cpu doesn't have gets a negative fd, and is left out of the report.
+ */
+void pmu_open(int *fd)
+{
+	struct perf_event_attr attr;
+	int i;
+
+	for (i = 0; i < PMU_EVENTS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = pmu_events[i].type;
+		attr.config = pmu_events[i].config;
+		/* allowed without root at the default perf_event_paranoid */
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+}
+
+const char *pmu_name(int event)
+{
+	return pmu_events[event].name;
+}
+
+/* Any thread can read the counters of another thread */
+void pmu_read(const int *fd, uint64_t *counts)
+{
+	int i;
+
+	for (i = 0; i < PMU_EVENTS; i++) {
+		if (fd[i] < 0 ||
+		    read(fd[i], &counts[i], sizeof(counts[i])) != sizeof(counts[i]))
+			counts[i] = 0;
+	}
+}
+
+void pmu_print_header(void)
+{
+	int i;
+
+	printf("%-30s %9s %5s", "PMU (millions)", pmu_events[0].name, "IPC");
+	for (i = 2; i < PMU_EVENTS - 1; i++)
+		printf(" %9s", pmu_events[i].name);
+	printf(" %6s\n", "stall%");
+}
+
+/*
+ * The counts in millions, but for the instructions per cycle and the
+ * share of the cycles stalled in the backend, '-' for the missing events.
+ */
+void pmu_print(const char *name, const int *fd, const uint64_t *counts)
+{
+	int i;
+
+	printf("%-30s", name);
+	if (fd[0] >= 0)
+		printf(" %9.1f", counts[0] / 1e6);
+	else
+		printf(" %9s", "-");
+	if (fd[0] >= 0 && fd[1] >= 0 && counts[0])
+		printf(" %5.2f", (double) counts[1] / counts[0]);
+	else
+		printf(" %5s", "-");
+	for (i = 2; i < PMU_EVENTS - 1; i++) {
+		if (fd[i] >= 0)
+			printf(" %9.1f", counts[i] / 1e6);
+		else
+			printf(" %9s", "-");
+	}
+	if (fd[0] >= 0 && fd[PMU_EVENTS - 1] >= 0 && counts[0])
+		printf(" %5.1f%%\n", 100.0 * counts[PMU_EVENTS - 1] / counts[0]);
+	else
+		printf(" %6s\n", "-");
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The statistics of the bandwidth samples, for the sampling loop of
+ * lima-memspeed and for the comparisons with the stored baselines.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "memspeed_stats.h"
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+	return (da > db) - (da < db);
+}
+
+double stats_median(const double *values, int n)
+{
+	double sorted[n];
+
+	memcpy(sorted, values, n * sizeof(double));
+	qsort(sorted, n, sizeof(double), compare_doubles);
+	return n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+}
+
+/* The median absolute deviation, 1.4826 times it estimates the stddev */
+double stats_mad(const double *values, int n, double median)
+{
+	double deviations[n];
+	int i;
+
+	for (i = 0; i < n; i++)
+		deviations[i] = fabs(values[i] - median);
+	return stats_median(deviations, n);
+}
+
+/* The sample standard deviation, 0 with fewer than two values */
+void stats_mean_stddev(const double *values, int n, double *mean,
+		       double *stddev)
+{
+	double sum = 0, sum2 = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		sum += values[i];
+	*mean = n ? sum / n : 0;
+	for (i = 0; i < n; i++)
+		sum2 += (values[i] - *mean) * (values[i] - *mean);
+	*stddev = n > 1 ? sqrt(sum2 / (n - 1)) : 0;
+}
+
+/*
+ * The two-sided quantile of Student's t distribution with df degrees of
+ * freedom, from the normal one 'z' (Cornish-Fisher), within 1% of the
+ * exact value from 3 degrees of freedom on.
+ */
+double stats_t_quantile(double z, double df)
+{
+	double z2 = z * z;
+
+	return z + z * (z2 + 1) / (4 * df) +
+	       z * ((5 * z2 + 16) * z2 + 3) / (96 * df * df) +
+	       z * (((3 * z2 + 19) * z2 + 17) * z2 - 15) / (384 * df * df * df);
+}
@@ -0,0 +1,597 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * A low rate sampler of the SoC temperatures, clocks and voltages from
+ * sysfs, so that bandwidth drops can be matched with throttling and
+ * failures with the temperature. Whatever the kernel has out of the
+ * following gets sampled:
+ *
+ *   /sys/class/thermal/thermal_zone*        temp, named after type
+ *   /sys/devices/system/cpu/cpufreq/policy* scaling_cur_freq
+ *   /sys/class/devfreq/NAME                 cur_freq, such as the mali
+ *                                           and the dramfreq devices
+ *   /sys/kernel/debug/clk/NAME              clk_rate of the mali and
+ *                                           dram clocks, if there is no
+ *                                           devfreq device for them
+ *   /sys/class/regulator/regulator.*        microvolts, such as the AXP
+ *                                           dcdc and ldo outputs
+ *   /sys/class/power_supply/NAME            voltage_now, and the power
+ *                                           from power_now or else
+ *                                           voltage_now and current_now,
+ *                                           such as the AXP ac, usb and
+ *                                           battery inputs
+ *   /sys/class/hwmon/hwmon*                 power1_input
+ *
+ * The files are kept open and read with pread(), which is cheap enough for
+ * sysfs to not disturb the measurements at one sample per second.
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "memspeed_telemetry.h"
+
+/* How the raw numbers are turned into the units of the source */
+enum {
+	SCALED,
+	THERMAL,	/* millidegrees, but degrees on some old sunxi kernels */
+	DEVFREQ,	/* Hz, but kHz for some vendor drivers */
+	POWER,		/* microvolts times the microamps of fd2 */
+};
+
+/* Which power readings add up to what the board draws */
+enum {
+	RAIL_NONE,
+	RAIL_INPUT,	/* an ac or usb supply */
+	RAIL_BATTERY,	/* only while the status of fd_status is discharging */
+	RAIL_SENSOR,	/* a hwmon sensor, most likely on one of the supplies */
+};
+
+typedef struct {
+	char *path;
+	int fd;
+	int fd2;
+	int fd_status;
+	int kind;
+	int rail;
+	double scale;
+	telemetry_value_t value;
+	int samples;
+	double sum;
+} source_t;
+
+static source_t sources[TELEMETRY_SOURCES_MAX];
+static int sources_count;
+static double sample_interval;
+static pthread_mutex_t sources_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+read_number(int fd, double *value)
+{
+	char buf[64];
+	ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+	char *end;
+
+	if (n <= 0)
+		return -1;
+	buf[n] = '\0';
+	*value = strtod(buf, &end);
+	return end == buf ? -1 : 0;
+}
+
+/* The first line of a small file next to the value, such as its name */
+static char *
+read_line(const char *dir, const char *file)
+{
+	char path[256], buf[64];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	f = fopen(path, "r");
+	if (!f)
+		return NULL;
+	if (!fgets(buf, sizeof(buf), f)) {
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+	buf[strcspn(buf, "\n")] = '\0';
+	return buf[0] ? strdup(buf) : NULL;
+}
+
+static const char *
+basename_of(const char *path)
+{
+	const char *p = strrchr(path, '/');
+
+	return p ? p + 1 : path;
+}
+
+/* The same file may be a voltage and, times a current, a power */
+static int
+has_source(const char *path, const char *unit)
+{
+	int i;
+
+	for (i = 0; i < sources_count; i++)
+		if (strcmp(sources[i].path, path) == 0 &&
+		    strcmp(sources[i].value.unit, unit) == 0)
+			return 1;
+	return 0;
+}
+
+static int
+has_name(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sources_count; i++)
+		if (strcmp(sources[i].value.name, name) == 0)
+			return 1;
+	return 0;
+}
+
+static source_t *
+add_source(const char *dir, const char *file, char *name, int kind,
+	   const char *unit, double scale)
+{
+	char path[256], unique[64];
+	source_t *s;
+	double value;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	if (!name || sources_count == TELEMETRY_SOURCES_MAX ||
+	    has_source(path, unit)) {
+		free(name);
+		return NULL;
+	}
+	/* two sensors of the same driver, told apart by their directory */
+	if (has_name(name)) {
+		snprintf(unique, sizeof(unique), "%s.%s", name,
+			 basename_of(dir));
+		free(name);
+		name = strdup(unique);
+	}
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || read_number(fd, &value) < 0) {
+		if (fd >= 0)
+			close(fd);
+		free(name);
+		return NULL;
+	}
+	s = &sources[sources_count++];
+	memset(s, 0, sizeof(*s));
+	s->path = strdup(path);
+	s->fd = fd;
+	s->fd2 = -1;
+	s->fd_status = -1;
+	s->kind = kind;
+	s->scale = scale;
+	s->value.name = name;
+	s->value.unit = unit;
+	return s;
+}
+
+static int
+is_gpu(const char *name)
+{
+	return strstr(name, "mali") || strstr(name, "gpu");
+}
+
+static int
+is_dram(const char *name)
+{
+	return strstr(name, "dram") || strstr(name, "ddr") ||
+	       strstr(name, "dmc");
+}
+
+/* "NAME_power", of a supply or of a hwmon sensor with that name */
+static char *
+power_name(const char *dir, char *name)
+{
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "%s_power", name ? name : basename_of(dir));
+	free(name);
+	return strdup(buf);
+}
+
+/* The battery goes by its status, everything which isn't one is an input */
+static void
+set_rail(source_t *s, const char *dir)
+{
+	char path[256], *type = read_line(dir, "type");
+
+	s->rail = RAIL_INPUT;
+	if (type && strcmp(type, "Battery") == 0) {
+		snprintf(path, sizeof(path), "%s/status", dir);
+		s->fd_status = open(path, O_RDONLY);
+		s->rail = RAIL_BATTERY;
+	}
+	free(type);
+}
+
+/*
+ * The voltage of a supply, and its power from power_now, or else from
+ * the voltage and current_now. Only the supply which is in use has a
+ * current, the others read 0.
+ */
+static void
+add_power_supply(const char *dir)
+{
+	char path[256];
+	source_t *s;
+	int fd;
+
+	add_source(dir, "voltage_now", strdup(basename_of(dir)), SCALED, "V",
+		   1e-6);
+	s = add_source(dir, "power_now", power_name(dir, NULL), SCALED, "W",
+		       1e-6);
+	if (s) {
+		set_rail(s, dir);
+		return;
+	}
+	snprintf(path, sizeof(path), "%s/current_now", dir);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	s = add_source(dir, "voltage_now", power_name(dir, NULL), POWER, "W",
+		       1e-12);
+	if (s) {
+		s->fd2 = fd;
+		set_rail(s, dir);
+	} else {
+		close(fd);
+	}
+}
+
+static void
+find_sources(void)
+{
+	int supplies = 0;
+	source_t *s;
+	glob_t g;
+	size_t i;
+
+	if (glob("/sys/class/thermal/thermal_zone*", 0, NULL, &g) == 0) {
+		for (i = 0; i < g.gl_pathc; i++)
+			add_source(g.gl_pathv[i], "temp",
+				   read_line(g.gl_pathv[i], "type"), THERMAL,
+				   "C", 1);
+		globfree(&g);
+	}
+
+	/* Older kernels have no policy directories, only the cpus */
+	if (glob("/sys/devices/system/cpu/cpufreq/policy*", 0, NULL, &g) == 0) {
+		for (i = 0; i < g.gl_pathc; i++) {
+			char name[32];
+
+			snprintf(name, sizeof(name), "cpu%s",
+				 basename_of(g.gl_pathv[i]) + 6);
+			add_source(g.gl_pathv[i], "scaling_cur_freq",
+				   strdup(name), SCALED, "MHz", 1e-3);
+		}
+		globfree(&g);
+	} else {
+		add_source("/sys/devices/system/cpu/cpu0/cpufreq",
+			   "scaling_cur_freq", strdup("cpu0"), SCALED, "MHz",
+			   1e-3);
+	}
+
+	if (glob("/sys/class/devfreq/*", 0, NULL, &g) == 0) {
+		for (i = 0; i < g.gl_pathc; i++) {
+			const char *p = basename_of(g.gl_pathv[i]);
+
+			add_source(g.gl_pathv[i], "cur_freq",
+				   strdup(is_gpu(p) ? "gpu" : is_dram(p) ?
+					  "dram" : p), DEVFREQ, "MHz", 1);
+		}
+		globfree(&g);
+	}
+
+	if (glob("/sys/kernel/debug/clk/*", 0, NULL, &g) == 0) {
+		for (i = 0; i < g.gl_pathc; i++) {
+			const char *p = basename_of(g.gl_pathv[i]);
+
+			if (is_gpu(p) && !has_name("gpu"))
+				add_source(g.gl_pathv[i], "clk_rate",
+					   strdup("gpu"), SCALED, "MHz", 1e-6);
+			else if (is_dram(p) && !has_name("dram"))
+				add_source(g.gl_pathv[i], "clk_rate",
+					   strdup("dram"), SCALED, "MHz", 1e-6);
+		}
+		globfree(&g);
+	}
+
+	if (glob("/sys/class/regulator/regulator.*", 0, NULL, &g) == 0) {
+		for (i = 0; i < g.gl_pathc; i++)
+			add_source(g.gl_pathv[i], "microvolts",
+				   read_line(g.gl_pathv[i], "name"), SCALED,
+				   "V", 1e-6);
+		globfree(&g);
+	}
+
+	if (glob("/sys/class/power_supply/*", 0, NULL, &g) == 0) {
+		for (i = 0; i < g.gl_pathc; i++)
+			add_power_supply(g.gl_pathv[i]);
+		globfree(&g);
+	}
+
+	/* the sensors would count an input which a supply has already */
+	for (i = 0; i < (size_t)sources_count; i++)
+		supplies += sources[i].rail != RAIL_NONE;
+	if (glob("/sys/class/hwmon/hwmon*", 0, NULL, &g) == 0) {
+		for (i = 0; i < g.gl_pathc; i++) {
+			s = add_source(g.gl_pathv[i], "power1_input",
+				       power_name(g.gl_pathv[i],
+						  read_line(g.gl_pathv[i],
+							    "name")),
+				       SCALED, "W", 1e-6);
+			if (s && !supplies)
+				s->rail = RAIL_SENSOR;
+		}
+		globfree(&g);
+	}
+}
+
+/* Whether the battery of fd_status is what the board runs off now */
+static int
+is_discharging(int fd)
+{
+	char buf[32];
+	ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+
+	if (n <= 0)
+		return 0;
+	buf[n] = '\0';
+	return strncmp(buf, "Discharging", 11) == 0;
+}
+
+static double
+scale_value(source_t *s, double raw)
+{
+	switch (s->kind) {
+	case THERMAL:
+		return raw >= 1000 ? raw / 1000 : raw;
+	case DEVFREQ:
+		if (raw >= 10000000)
+			return raw / 1000000;
+		if (raw >= 10000)
+			return raw / 1000;
+		return raw;
+	default:
+		return raw * s->scale;
+	}
+}
+
+static void
+sample(void)
+{
+	double raw, v;
+	int i;
+
+	pthread_mutex_lock(&sources_lock);
+	for (i = 0; i < sources_count; i++) {
+		source_t *s = &sources[i];
+
+		if (read_number(s->fd, &raw) < 0)
+			continue;
+		if (s->kind == POWER) {
+			double current;
+
+			/* the battery current is negative while it charges */
+			if (read_number(s->fd2, &current) < 0)
+				continue;
+			raw *= fabs(current);
+		}
+		v = scale_value(s, raw);
+		s->value.input = s->rail == RAIL_BATTERY ?
+				 s->fd_status >= 0 && is_discharging(s->fd_status) :
+				 s->rail != RAIL_NONE;
+		s->value.last = v;
+		s->sum += v;
+		if (!s->samples || v < s->value.min)
+			s->value.min = v;
+		if (!s->samples || v > s->value.max)
+			s->value.max = v;
+		s->samples++;
+	}
+	pthread_mutex_unlock(&sources_lock);
+}
+
+/* In steps of at most a second, so that a shorter interval takes over */
+static void *
+sampler_thread(void *data)
+{
+	double slept, step;
+
+	while (1) {
+		step = sample_interval < 1 ? sample_interval : 1;
+		for (slept = 0; slept < sample_interval; slept += step)
+			usleep(step * 1000000);
+		sample();
+	}
+	return NULL;
+}
+
+/*
+ * Find the sources and start sampling them every interval seconds.
+ * Returns the number of sources, there is no thread if there are none.
+ */
+int
+telemetry_start(double interval)
+{
+	pthread_t thread;
+
+	/* the metrics or the baseline key may have started it already */
+	if (sample_interval > 0) {
+		if (interval < sample_interval)
+			sample_interval = interval;
+		return sources_count;
+	}
+	find_sources();
+	if (!sources_count)
+		return 0;
+	sample_interval = interval;
+	sample();
+	if (pthread_create(&thread, NULL, sampler_thread, NULL) != 0)
+		return 0;
+	return sources_count;
+}
+
+/*
+ * Copy out the last value and the range of every source since the last
+ * call, and start a new range from the last value.
+ */
+int
+telemetry_take(telemetry_value_t *values)
+{
+	int i;
+
+	pthread_mutex_lock(&sources_lock);
+	for (i = 0; i < sources_count; i++) {
+		values[i] = sources[i].value;
+		values[i].mean = sources[i].samples ?
+				 sources[i].sum / sources[i].samples :
+				 sources[i].value.last;
+		sources[i].value.min = sources[i].value.max =
+			sources[i].value.last;
+		sources[i].samples = 1;
+		sources[i].sum = sources[i].value.last;
+	}
+	pthread_mutex_unlock(&sources_lock);
+	return sources_count;
+}
+
+static const char *
+value_format(const telemetry_value_t *v)
+{
+	if (strcmp(v->unit, "V") == 0 || strcmp(v->unit, "W") == 0)
+		return "%.3f";
+	if (strcmp(v->unit, "MHz") == 0)
+		return "%.0f";
+	return "%.1f";
+}
+
+/* "name last unit (min-max), ...", the range only if it changed */
+void
+telemetry_print(FILE *f, const char *prefix, const telemetry_value_t *values,
+		int count)
+{
+	int i;
+
+	fprintf(f, "%s", prefix);
+	for (i = 0; i < count; i++) {
+		const telemetry_value_t *v = &values[i];
+		const char *format = value_format(v);
+
+		fprintf(f, "%s %s ", i ? "," : "", v->name);
+		fprintf(f, format, v->last);
+		fprintf(f, " %s", v->unit);
+		if (v->min != v->max) {
+			fprintf(f, " (");
+			fprintf(f, format, v->min);
+			fprintf(f, "-");
+			fprintf(f, format, v->max);
+			fprintf(f, ")");
+		}
+	}
+	fprintf(f, "\n");
+}
+
+/*
+ * A Prometheus gauge per unit, of the last value of every source, for the
+ * metrics listener. The ranges are left to telemetry_take().
+ */
+void
+telemetry_metrics(FILE *f, void *data)
+{
+	static const struct {
+		const char *unit, *name, *help;
+	} gauges[] = {
+		{ "C", "soc_temperature_celsius", "SoC temperatures" },
+		{ "MHz", "soc_clock_mhz", "Cpu, gpu and dram clocks" },
+		{ "V", "soc_voltage_volts", "Regulator and supply voltages" },
+		{ "W", "soc_power_watts", "Supply and sensor power" },
+	};
+	telemetry_value_t values[TELEMETRY_SOURCES_MAX];
+	int g, i, header, count;
+
+	pthread_mutex_lock(&sources_lock);
+	for (count = 0; count < sources_count; count++)
+		values[count] = sources[count].value;
+	pthread_mutex_unlock(&sources_lock);
+
+	for (g = 0; g < (int)(sizeof(gauges) / sizeof(gauges[0])); g++) {
+		for (i = 0, header = 0; i < count; i++) {
+			if (strcmp(values[i].unit, gauges[g].unit) != 0)
+				continue;
+			if (!header++)
+				fprintf(f, "# HELP %s %s\n# TYPE %s gauge\n",
+					gauges[g].name, gauges[g].help,
+					gauges[g].name);
+			fprintf(f, "%s{source=\"%s\"} %.3f\n", gauges[g].name,
+				values[i].name, values[i].last);
+		}
+	}
+}
+
+/*
+ * The power drawn by the board, the sum of the mean power of the inputs
+ * of telemetry_take(). Each input is only counted once: an AXP board
+ * has just the ac or usb input in use, or the battery.
+ */
+double
+telemetry_input_watts(const telemetry_value_t *values, int count)
+{
+	double watts = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (values[i].input)
+			watts += values[i].mean;
+	return watts;
+}
+
+/* The "telemetry" field of a json record, with a leading comma */
+void
+telemetry_print_json(FILE *f, const telemetry_value_t *values, int count)
+{
+	int i;
+
+	fprintf(f, ", \"telemetry\": [");
+	for (i = 0; i < count; i++)
+		fprintf(f, "%s{\"name\": \"%s\", \"unit\": \"%s\", "
+			"\"last\": %.3f, \"min\": %.3f, \"max\": %.3f}",
+			i ? ", " : "", values[i].name, values[i].unit,
+			values[i].last, values[i].min, values[i].max);
+	fprintf(f, "]");
+}
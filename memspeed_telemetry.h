@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef MEMSPEED_TELEMETRY_H
+#define MEMSPEED_TELEMETRY_H
+
+#include <stdio.h>
+
+#define TELEMETRY_SOURCES_MAX	32
+
+/*
+ * One sysfs value followed by the sampler: a thermal zone, the clock of
+ * a cpufreq policy, of the gpu or of the dram, or the voltage of a
+ * regulator or power supply, or the power of a supply or hwmon sensor.
+ * The last sampled value, its range and its mean since the previous
+ * telemetry_take(), in the units of the source. Input is set for the
+ * power which the board draws from outside right now: that of the ac
+ * and usb supplies, of the battery while it discharges, and of the
+ * hwmon sensors if there are no supplies which measure it.
+ */
+typedef struct {
+	const char *name;
+	const char *unit;
+	double last, min, max, mean;
+	int input;
+} telemetry_value_t;
+
+int telemetry_start(double interval);
+int telemetry_take(telemetry_value_t *values);
+void telemetry_print(FILE *f, const char *prefix,
+		     const telemetry_value_t *values, int count);
+void telemetry_print_json(FILE *f, const telemetry_value_t *values,
+			  int count);
+void telemetry_metrics(FILE *f, void *data);
+double telemetry_input_watts(const telemetry_value_t *values, int count);
+
+#endif
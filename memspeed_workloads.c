@@ -0,0 +1,989 @@
+/*
+ * Copyright (c) 2014 Siarhei Siamashka
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <assert.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/auxv.h>
+#include <sys/mman.h>
+
+#include "lima-memspeed.h"
+#include "arm-neon.h"
+#include "memspeed_gpu.h"
+#include "memspeed_fb.h"
+#include "memspeed_workloads.h"
+
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(a)  (sizeof((a)) / sizeof((a)[0]))
+#endif
+
+double gettime(void)
+{
+	struct timespec t;
+	int clock_gettime_result = clock_gettime(CLOCK_MONOTONIC, &t);
+	assert(clock_gettime_result == 0);
+	return t.tv_sec + 0.000000001 * t.tv_nsec;
+}
+
+#define BUFFER_SIZE (32 * 1024 * 1024)
+
+/*
+ * A rate limited CPU workload runs its kernel over chunks of this size,
+ * and the token bucket holds at most this many seconds worth of bytes
+ */
+#define PACE_CHUNK     (64 * 1024)
+#define PACE_BURST     0.02
+
+size_t workload_buffer_size = BUFFER_SIZE;
+int workload_stride = STRIDE_DEFAULT;
+int workload_prefetch = PREFETCH_DEFAULT;
+int workload_unroll = UNROLL_DEFAULT;
+
+void *cpu_thread(void *data)
+{
+	workload_t *w = (workload_t *)data;
+	void (*f)(int64_t *, int64_t *, int) = w->extra_data;
+	int64_t *buffer;
+	size_t size = w->buffer_size ? w->buffer_size : workload_buffer_size;
+	int size_multiplier = w->size_multiplier;
+	if (!size_multiplier)
+		size_multiplier = 1;
+
+	if (posix_memalign((void **)&buffer, 4096, size) != 0) {
+		assert(0);
+	}
+	memset(buffer, 0xCC, size);
+
+	while (1) {
+		size_t offs, chunk = PACE_CHUNK;
+
+		if (!workload_get_rate(w) || size < chunk) {
+			f(buffer, buffer, size);
+			workload_add_bytes(w, (uint64_t)size * size_multiplier);
+			continue;
+		}
+		/* Pace in smaller steps than the whole buffer */
+		for (offs = 0; offs < size; offs += chunk) {
+			int64_t *p = buffer + offs / sizeof(int64_t);
+			f(p, p, chunk);
+			workload_add_bytes(w, (uint64_t)chunk * size_multiplier);
+		}
+	}
+
+	free(buffer);
+
+	return 0;
+}
+
+#define HUGE_PAGE_SIZE  (2 * 1024 * 1024)
+
+void *latency_sink;
+int64_t pattern_sink;
+
+/*
+ * The access pattern kernels read one 64-bit word at a time and go over
+ * every cache line of the 'size' bytes once per call, in their own order.
+ * For a stride of a cache line or more that takes a pass per cache line
+ * of the stride, each one a line further in, so that the cache line bytes
+ * which they move always add up to 'size'.
+ */
+static void stride_read(int64_t *dst, int64_t *src, int size)
+{
+	const char *p = (const char *)src;
+	size_t stride = workload_stride, step = stride, offs, first;
+	int64_t sum = 0;
+
+	if (stride < CACHE_LINE_SIZE)
+		step = CACHE_LINE_SIZE;
+	for (first = 0; first < step && first < (size_t)size;
+	     first += CACHE_LINE_SIZE) {
+		for (offs = first; offs < (size_t)size; offs += stride)
+			sum += *(const int64_t *)(p + offs);
+	}
+	pattern_sink = sum;
+}
+
+/* Cache lines picked at random, independent loads unlike the latency one */
+static void gather_read(int64_t *dst, int64_t *src, int size)
+{
+	const char *p = (const char *)src;
+	uint32_t seed = 0x9E3779B9 ^ (uint32_t)(uintptr_t)src;
+	size_t i, lines = size / CACHE_LINE_SIZE;
+	int64_t sum = 0;
+
+	for (i = 0; i < lines; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		sum += *(const int64_t *)(p + CACHE_LINE_SIZE *
+				(size_t)(((uint64_t)seed * lines) >> 32));
+	}
+	pattern_sink = sum;
+}
+
+/*
+ * Every read is in the next page, a line further in than in the previous
+ * one so that the cache sets don't alias, like going down the columns of
+ * an image with a 4K pitch
+ */
+static void page_read(int64_t *dst, int64_t *src, int size)
+{
+	const char *p = (const char *)src;
+	size_t pages = size / PAGE_STRIDE, line, page;
+	const size_t lines = PAGE_STRIDE / CACHE_LINE_SIZE;
+	int64_t sum = 0;
+
+	for (line = 0; line < lines; line++) {
+		for (page = 0; page < pages; page++)
+			sum += *(const int64_t *)(p + page * PAGE_STRIDE +
+				((line + page) % lines) * CACHE_LINE_SIZE);
+	}
+	pattern_sink = sum;
+}
+
+/*
+ * The libc workloads go through pointers, so that the compiler can't put
+ * its own inline copy in place of the libc which we are linked with. The
+ * copies go from the first half of the range to the second half, which
+ * moves 'size' bytes in and out together, like the 2x of the copy kernels
+ * on the whole range.
+ */
+static void *(*volatile libc_memcpy_func)(void *, const void *, size_t) =
+								memcpy;
+static void *(*volatile libc_memmove_func)(void *, const void *, size_t) =
+								memmove;
+static void *(*volatile libc_memset_func)(void *, int, size_t) = memset;
+
+/* The sizes which the small variants go through, one call each */
+static const size_t libc_small_sizes[] = {
+	8, 12, 16, 24, 32, 40, 48, 64, 80, 96, 128, 160, 200, 256,
+};
+
+static void libc_memcpy(int64_t *dst, int64_t *src, int size)
+{
+	char *p = (char *)src;
+
+	libc_memcpy_func(p + size / 2, p, size / 2);
+}
+
+/* Both sides equally off the 8 byte alignment */
+static void libc_memcpy_unaligned(int64_t *dst, int64_t *src, int size)
+{
+	char *p = (char *)src;
+
+	libc_memcpy_func(p + size / 2 + 1, p + 1, size / 2 - 1);
+}
+
+/* The source and the destination off by different amounts */
+static void libc_memcpy_misaligned(int64_t *dst, int64_t *src, int size)
+{
+	char *p = (char *)src;
+
+	libc_memcpy_func(p + size / 2 + 1, p + 3, size / 2 - 3);
+}
+
+static void libc_memcpy_small(int64_t *dst, int64_t *src, int size)
+{
+	char *p = (char *)src, *end = p + size / 2;
+	size_t i = 0, n;
+
+	while (p + (n = libc_small_sizes[i]) <= end) {
+		libc_memcpy_func(p + size / 2, p, n);
+		p += n;
+		if (++i == ARRAY_SIZE(libc_small_sizes))
+			i = 0;
+	}
+}
+
+/* A line up onto itself, the overlap makes it go backwards */
+static void libc_memmove(int64_t *dst, int64_t *src, int size)
+{
+	char *p = (char *)src;
+
+	libc_memmove_func(p + CACHE_LINE_SIZE, p, size - CACHE_LINE_SIZE);
+}
+
+static void libc_memset(int64_t *dst, int64_t *src, int size)
+{
+	libc_memset_func(dst, 0, size);
+}
+
+static void libc_memset_unaligned(int64_t *dst, int64_t *src, int size)
+{
+	libc_memset_func((char *)dst + 1, 0, size - 1);
+}
+
+static void libc_memset_small(int64_t *dst, int64_t *src, int size)
+{
+	char *p = (char *)dst, *end = p + size;
+	size_t i = 0, n;
+
+	while (p + (n = libc_small_sizes[i]) <= end) {
+		libc_memset_func(p, 0, n);
+		p += n;
+		if (++i == ARRAY_SIZE(libc_small_sizes))
+			i = 0;
+	}
+}
+
+#if defined(__arm__) || defined(__aarch64__)
+typedef void (*tuned_kernel_t)(int64_t *, int64_t *, int, int);
+
+static tuned_kernel_t tuned_kernel(const tuned_kernel_t kernels[3])
+{
+	return kernels[workload_unroll == 4 ? 2 : workload_unroll - 1];
+}
+
+static void neon_read_tuned(int64_t *dst, int64_t *src, int size)
+{
+	static const tuned_kernel_t kernels[3] = {
+		aligned_block_read_pfn1_neon, aligned_block_read_pfn2_neon,
+		aligned_block_read_pfn4_neon,
+	};
+
+	tuned_kernel(kernels)(dst, src, size, workload_prefetch);
+}
+
+static void neon_copy_tuned(int64_t *dst, int64_t *src, int size)
+{
+	static const tuned_kernel_t kernels[3] = {
+		aligned_block_copy_pfn1_neon, aligned_block_copy_pfn2_neon,
+		aligned_block_copy_pfn4_neon,
+	};
+
+	tuned_kernel(kernels)(dst, src, size, workload_prefetch);
+}
+#endif
+
+double workload_useful_fraction(const workload_t *w)
+{
+	if (w->thread_func != cpu_thread)
+		return 0;
+	if (w->extra_data == stride_read)
+		return (double)sizeof(int64_t) /
+			(workload_stride < CACHE_LINE_SIZE ? workload_stride :
+							      CACHE_LINE_SIZE);
+	if (w->extra_data == gather_read || w->extra_data == page_read)
+		return (double)sizeof(int64_t) / CACHE_LINE_SIZE;
+	return 0;
+}
+
+int workload_stride_valid(int stride)
+{
+	if (stride < STRIDE_MIN || stride > STRIDE_MAX)
+		return 0;
+	if (stride < CACHE_LINE_SIZE)
+		return CACHE_LINE_SIZE % stride == 0 &&
+		       stride % sizeof(int64_t) == 0;
+	return stride % CACHE_LINE_SIZE == 0;
+}
+
+static inline double timespec_ns(const struct timespec *t)
+{
+	return t->tv_sec * 1000000000. + t->tv_nsec;
+}
+
+/* A buffer backed by huge pages if the kernel has any, 'huge' says if so */
+static void *alloc_latency_buffer(size_t size, int *huge)
+{
+	void *buffer;
+
+	size = (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+	buffer = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (buffer != MAP_FAILED) {
+		*huge = 1;
+		return buffer;
+	}
+#endif
+	if (posix_memalign(&buffer, HUGE_PAGE_SIZE, size) != 0) {
+		assert(0);
+	}
+#ifdef MADV_HUGEPAGE
+	*huge = madvise(buffer, size, MADV_HUGEPAGE) == 0;
+#else
+	*huge = 0;
+#endif
+	return buffer;
+}
+
+void *latency_thread(void *data)
+{
+	workload_t *w = (workload_t *)data;
+	latency_stats_t *stats;
+	size_t size = w->buffer_size ? w->buffer_size : workload_buffer_size;
+	size_t i, j, lines = size / CACHE_LINE_SIZE, *next;
+	uint32_t seed = 0x9E3779B9;
+	struct timespec t1, t2;
+	double overhead = 1e9;
+	char *buffer;
+	void **p;
+
+	stats = calloc(1, sizeof(*stats));
+	assert(stats);
+	buffer = alloc_latency_buffer(size, &stats->huge_pages);
+
+	/* Sattolo's shuffle, which always gives a single cycle */
+	next = malloc(lines * sizeof(size_t));
+	assert(next);
+	for (i = 0; i < lines; i++)
+		next[i] = i;
+	for (i = lines - 1; i > 0; i--) {
+		size_t tmp;
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		j = seed % i;
+		tmp = next[i];
+		next[i] = next[j];
+		next[j] = tmp;
+	}
+	for (i = 0; i < lines; i++)
+		*(void **)(buffer + i * CACHE_LINE_SIZE) =
+					buffer + next[i] * CACHE_LINE_SIZE;
+	free(next);
+
+	/* The cost of reading the clock, taken off every batch */
+	for (i = 0; i < 1000; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		if (timespec_ns(&t2) - timespec_ns(&t1) < overhead)
+			overhead = timespec_ns(&t2) - timespec_ns(&t1);
+	}
+
+	w->extra_data = stats;
+	p = (void **)buffer;
+	while (1) {
+		double ns;
+		int bucket;
+
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		for (i = 0; i < LATENCY_BATCH; i += 4) {
+			p = *p;
+			p = *p;
+			p = *p;
+			p = *p;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		latency_sink = p;
+
+		ns = (timespec_ns(&t2) - timespec_ns(&t1) - overhead) /
+		     LATENCY_BATCH;
+		if (ns < 0)
+			ns = 0;
+		bucket = ns / LATENCY_BUCKET;
+		if (bucket >= LATENCY_BUCKETS)
+			bucket = LATENCY_BUCKETS - 1;
+		stats->buckets[bucket]++;
+		stats->sum_ns += ns;
+		stats->batches++;
+
+		workload_add_bytes(w, LATENCY_BATCH * CACHE_LINE_SIZE);
+	}
+
+	return 0;
+}
+
+/*
+ * The coherency workloads bounce cache lines between two threads, each
+ * one pinned to its own cpu. With true sharing the two take turns on one
+ * counter, so every step waits for the line to come over from the other
+ * cpu, and the time per step is the transfer latency. With false sharing
+ * each one writes its own counter in the same line as fast as it can.
+ */
+static const struct {
+	int false_sharing;
+	int atomic;
+} coherency_variants[COHERENCY_VARIANTS] = {
+	[COHERENCY_TRUE_ATOMIC]  = { 0, 1 },
+	[COHERENCY_TRUE_STORE]   = { 0, 0 },
+	[COHERENCY_FALSE_ATOMIC] = { 1, 1 },
+	[COHERENCY_FALSE_STORE]  = { 1, 0 },
+};
+
+/* Spins before giving the cpu away, for when both threads share one */
+#define COHERENCY_SPINS 100000
+
+struct coherency_t
+{
+	/* The counter of the first thread, the partner's is in the same line */
+	volatile uint32_t line[CACHE_LINE_SIZE / sizeof(uint32_t)]
+				__attribute__((aligned(CACHE_LINE_SIZE)));
+
+	/* Only read while they run, so that it stays in both caches */
+	int variant __attribute__((aligned(CACHE_LINE_SIZE)));
+	int cpu[2];
+	volatile int stop;
+	pthread_t partner;
+
+	/* The next turn of the first thread, which takes the even ones */
+	uint32_t value __attribute__((aligned(CACHE_LINE_SIZE)));
+
+	/* The false sharing writes of the partner, every COHERENCY_PUBLISH */
+	uint64_t partner_ops __attribute__((aligned(CACHE_LINE_SIZE)));
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+#define COHERENCY_PUBLISH 1024
+/* The counter of the partner, half a line away */
+#define COHERENCY_PARTNER (CACHE_LINE_SIZE / sizeof(uint32_t) / 2)
+
+static void coherency_pin(int cpu)
+{
+	cpu_set_t cpus;
+
+	if (cpu < 0)
+		return;
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+/* Wait for the counter to get to 'value', or for the stop */
+static int coherency_wait(coherency_t *c, uint32_t value)
+{
+	int spins = 0;
+
+	while (c->line[0] != value) {
+		if (c->stop)
+			return -1;
+		if (++spins == COHERENCY_SPINS) {
+			sched_yield();
+			spins = 0;
+		}
+	}
+	return 0;
+}
+
+static void coherency_step(coherency_t *c, volatile uint32_t *counter)
+{
+	if (coherency_variants[c->variant].atomic)
+		__atomic_fetch_add(counter, 1, __ATOMIC_SEQ_CST);
+	else
+		*counter = *counter + 1;
+}
+
+static void *coherency_partner(void *data)
+{
+	coherency_t *c = data;
+	uint32_t value = 1;
+	uint64_t ops = 0;
+	int i;
+
+	coherency_pin(c->cpu[1]);
+	if (coherency_variants[c->variant].false_sharing) {
+		while (!c->stop) {
+			for (i = 0; i < COHERENCY_PUBLISH; i++)
+				coherency_step(c, &c->line[COHERENCY_PARTNER]);
+			ops += COHERENCY_PUBLISH;
+			__atomic_store_n(&c->partner_ops, ops, __ATOMIC_RELAXED);
+		}
+		return NULL;
+	}
+	/* Takes the odd turns */
+	while (coherency_wait(c, value) == 0) {
+		coherency_step(c, &c->line[0]);
+		value += 2;
+	}
+	return NULL;
+}
+
+coherency_t *coherency_start(int variant, int cpu_a, int cpu_b)
+{
+	coherency_t *c;
+
+	if (posix_memalign((void **)&c, CACHE_LINE_SIZE, sizeof(*c)) != 0) {
+		assert(0);
+	}
+	memset(c, 0, sizeof(*c));
+	c->variant = variant;
+	c->cpu[0] = cpu_a;
+	c->cpu[1] = cpu_b;
+	coherency_pin(cpu_a);
+	pthread_create(&c->partner, NULL, coherency_partner, c);
+	return c;
+}
+
+/*
+ * Take 'steps' turns on the line, and return the line transfers of both
+ * threads meanwhile: two per turn with true sharing, the one of this
+ * thread and the one of the partner, and every write of either thread
+ * with false sharing, which is the most there can have been
+ */
+uint64_t coherency_run(coherency_t *c, uint64_t steps)
+{
+	uint64_t i, partner_ops;
+
+	if (coherency_variants[c->variant].false_sharing) {
+		partner_ops = __atomic_load_n(&c->partner_ops, __ATOMIC_RELAXED);
+		for (i = 0; i < steps; i++)
+			coherency_step(c, &c->line[0]);
+		return steps + __atomic_load_n(&c->partner_ops,
+					       __ATOMIC_RELAXED) - partner_ops;
+	}
+	for (i = 0; i < steps; i++) {
+		coherency_wait(c, c->value);
+		coherency_step(c, &c->line[0]);
+		c->value += 2;
+	}
+	return 2 * steps;
+}
+
+void coherency_stop(coherency_t *c)
+{
+	c->stop = 1;
+	pthread_join(c->partner, NULL);
+	free(c);
+}
+
+/* The next pair of cpus for a coherency workload thread */
+static int coherency_pairs;
+
+void *coherency_thread(void *data)
+{
+	workload_t *w = (workload_t *)data;
+	int pair = __atomic_fetch_add(&coherency_pairs, 1, __ATOMIC_RELAXED);
+	int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	coherency_stats_t *stats;
+	coherency_t *c;
+	double start;
+
+	stats = calloc(1, sizeof(*stats));
+	assert(stats);
+	stats->variant = (intptr_t)w->extra_data;
+	/* Left to the scheduler on a single cpu, where it is only a stress */
+	stats->cpu[0] = cpus > 1 ? 2 * pair % cpus : -1;
+	stats->cpu[1] = cpus > 1 ? (2 * pair + 1) % cpus : -1;
+	c = coherency_start(stats->variant, stats->cpu[0], stats->cpu[1]);
+
+	w->extra_data = stats;
+	start = gettime();
+	while (1) {
+		uint64_t transfers = coherency_run(c, COHERENCY_BATCH);
+
+		stats->transfers += transfers;
+		stats->seconds = gettime() - start;
+		workload_add_bytes(w, transfers * CACHE_LINE_SIZE);
+	}
+
+	coherency_stop(c);
+	return 0;
+}
+
+#ifndef HWCAP_ARM_VFP
+#define HWCAP_ARM_VFP  (1 << 6)
+#endif
+#ifndef HWCAP_ARM_NEON
+#define HWCAP_ARM_NEON (1 << 12)
+#endif
+#ifndef HWCAP_ASIMD
+#define HWCAP_ASIMD    (1 << 1)
+#endif
+
+/* Runs the workload with its perf events counted, for --pmu */
+void *workload_pmu_thread(void *data)
+{
+	workload_t *w = (workload_t *)data;
+
+	pmu_open(w->pmu_fd);
+	return w->thread_func(w);
+}
+
+int workload_is_supported(workload_t *w)
+{
+	return (getauxval(AT_HWCAP) & w->hwcap) == w->hwcap;
+}
+
+/*
+ * The token bucket of a rate limited workload. It is called after every
+ * 'bytes' of work, and sleeps for as long as the workload is ahead of its
+ * target rate. The bucket fills up at that rate, up to PACE_BURST seconds
+ * worth, so an idle period can't be made up for with a long burst.
+ */
+void workload_pace(workload_t *w, uint64_t bytes)
+{
+	uint64_t rate = workload_get_rate(w);
+	double now = gettime(), burst = rate * PACE_BURST;
+
+	if (rate != w->paced_rate) {
+		w->paced_rate = rate;
+		w->tokens = 0;
+		w->last_time = now;
+	}
+	w->tokens += (now - w->last_time) * rate;
+	if (w->tokens > burst)
+		w->tokens = burst;
+	w->last_time = now;
+	w->tokens -= bytes;
+
+	if (w->tokens < 0) {
+		double delay = -w->tokens / rate;
+		struct timespec t;
+
+		t.tv_sec = (time_t)delay;
+		t.tv_nsec = (long)((delay - t.tv_sec) * 1000000000.);
+		nanosleep(&t, NULL);
+	}
+}
+
+/* A paused workload sits here, in the middle of its work, until resumed */
+void workload_wait_resumed(workload_t *w)
+{
+	while (__atomic_load_n(&w->paused, __ATOMIC_RELAXED))
+		usleep(10000);
+}
+
+/* The read and fill kernels touch 'size' bytes, the copy kernels twice that */
+#define CPU_WORKLOAD(workload_name, workload_description, func, multiplier, \
+		     needed_hwcap)					\
+	{								\
+		.name = workload_name,					\
+		.description = workload_description,			\
+		.thread_func = cpu_thread,				\
+		.extra_data = func,					\
+		.size_multiplier = multiplier,				\
+		.hwcap = needed_hwcap,					\
+	}
+
+/* The scanout of a single display, numbered as fb_scanout prints them */
+#define FB_SCANOUT_WORKLOAD(n)						\
+	{								\
+		.name = "fb_scanout" #n,				\
+		.description = "only the scanout bandwidth of display " #n, \
+		.thread_func = fb_scanout_thread,			\
+		.extra_data = (void *)(intptr_t)((n) + 1),		\
+	}
+
+workload_t workloads_list[] = {
+	{
+		.name = "fb_blank",
+		.description = "blank the screen in order not to drain memory bandwidth",
+		.thread_func = fb_blank_thread,
+	},
+	{
+		.name = "fb_scanout",
+		.description = "take the framebuffer scanout bandwidth into account",
+		.thread_func = fb_scanout_thread,
+	},
+	FB_SCANOUT_WORKLOAD(0),
+	FB_SCANOUT_WORKLOAD(1),
+	FB_SCANOUT_WORKLOAD(2),
+	FB_SCANOUT_WORKLOAD(3),
+	{
+		.name = "gpu_write",
+		.description = "use the lima driver to solid fill the screen",
+		.thread_func = gpu_write_thread,
+	},
+	{
+		.name = "gpu_copy",
+		.description = "use the lima driver to copy a texture to the screen",
+		.thread_func = gpu_copy_thread,
+	},
+	{
+		.name = "gpu_pingpong",
+		.description = "use the lima driver to render one texture into another and back",
+		.thread_func = gpu_pingpong_thread,
+	},
+	{
+		.name = "gpu_blend",
+		.description = "use the lima driver to blend full screen quads on top of each other",
+		.thread_func = gpu_blend_thread,
+	},
+	{
+		.name = "gpu_sampler",
+		.description = "use the lima driver to sample several large textures at random spots",
+		.thread_func = gpu_sampler_thread,
+	},
+	{
+		.name = "gpu_scatter",
+		.description = "use the lima driver to sample a large texture in randomly placed blocks",
+		.thread_func = gpu_scatter_thread,
+	},
+	{
+		.name = "gpu_vertex",
+		.description = "use the lima driver to push a large, mostly culled, mesh through the gp",
+		.thread_func = gpu_vertex_thread,
+	},
+	{
+		.name = "latency",
+		.description = "chase pointers through the buffer to measure the load latency",
+		.thread_func = latency_thread,
+	},
+	{
+		.name = "coherency_atomic",
+		.description = "two cpus take turns at an atomic add on one cache line",
+		.thread_func = coherency_thread,
+		.extra_data = (void *)(intptr_t)COHERENCY_TRUE_ATOMIC,
+	},
+	{
+		.name = "coherency_store",
+		.description = "two cpus take turns at a plain store to one cache line",
+		.thread_func = coherency_thread,
+		.extra_data = (void *)(intptr_t)COHERENCY_TRUE_STORE,
+	},
+	{
+		.name = "coherency_false_atomic",
+		.description = "two cpus atomically add to their own words of one cache line",
+		.thread_func = coherency_thread,
+		.extra_data = (void *)(intptr_t)COHERENCY_FALSE_ATOMIC,
+	},
+	{
+		.name = "coherency_false_store",
+		.description = "two cpus store to their own words of one cache line",
+		.thread_func = coherency_thread,
+		.extra_data = (void *)(intptr_t)COHERENCY_FALSE_STORE,
+	},
+	CPU_WORKLOAD("stride_read",
+		     "read a 64-bit word every --stride bytes of a memory buffer",
+		     stride_read, 1, 0),
+	CPU_WORKLOAD("gather_read",
+		     "read a 64-bit word from random cache lines of a memory buffer",
+		     gather_read, 1, 0),
+	CPU_WORKLOAD("page_read",
+		     "read a 64-bit word from a different page every time",
+		     page_read, 1, 0),
+	CPU_WORKLOAD("libc_memcpy",
+		     "use libc memcpy to copy a memory buffer",
+		     libc_memcpy, 1, 0),
+	CPU_WORKLOAD("libc_memcpy_unaligned",
+		     "use libc memcpy to copy a memory buffer, both off by 1 byte",
+		     libc_memcpy_unaligned, 1, 0),
+	CPU_WORKLOAD("libc_memcpy_misaligned",
+		     "use libc memcpy to copy a memory buffer, off by 3 and 1 bytes",
+		     libc_memcpy_misaligned, 1, 0),
+	CPU_WORKLOAD("libc_memcpy_small",
+		     "use libc memcpy to copy a memory buffer 8 to 256 bytes at a time",
+		     libc_memcpy_small, 1, 0),
+	CPU_WORKLOAD("libc_memmove",
+		     "use libc memmove to move a memory buffer a cache line up",
+		     libc_memmove, 2, 0),
+	CPU_WORKLOAD("libc_memset",
+		     "use libc memset to fill a memory buffer",
+		     libc_memset, 1, 0),
+	CPU_WORKLOAD("libc_memset_unaligned",
+		     "use libc memset to fill a memory buffer, off by 1 byte",
+		     libc_memset_unaligned, 1, 0),
+	CPU_WORKLOAD("libc_memset_small",
+		     "use libc memset to fill a memory buffer 8 to 256 bytes at a time",
+		     libc_memset_small, 1, 0),
+#if defined(__arm__)
+	CPU_WORKLOAD("neon_read",
+		     "use ARM NEON to read from a memory buffer",
+		     aligned_block_read_neon, 1,
+		     HWCAP_ARM_NEON),
+	CPU_WORKLOAD("neon_read_pf32",
+		     "use ARM NEON to read from a memory buffer",
+		     aligned_block_read_pf32_neon, 1,
+		     HWCAP_ARM_NEON),
+	CPU_WORKLOAD("neon_read_pf64",
+		     "use ARM NEON to read from a memory buffer",
+		     aligned_block_read_pf64_neon, 1,
+		     HWCAP_ARM_NEON),
+	CPU_WORKLOAD("neon_read2",
+		     "use ARM NEON to read from two memory buffers",
+		     aligned_block_read2_neon, 1,
+		     HWCAP_ARM_NEON),
+	CPU_WORKLOAD("neon_read2_pf32",
+		     "use ARM NEON to read from two memory buffers",
+		     aligned_block_read2_pf32_neon, 1,
+		     HWCAP_ARM_NEON),
+	CPU_WORKLOAD("neon_read2_pf64",
+		     "use ARM NEON to read from two memory buffers",
+		     aligned_block_read2_pf64_neon, 1,
+		     HWCAP_ARM_NEON),
+	CPU_WORKLOAD("neon_copy",
+		     "use ARM NEON to copy a memory buffer",
+		     aligned_block_copy_neon, 2,
+		     HWCAP_ARM_NEON),
+	CPU_WORKLOAD("neon_copy_pf32",
+		     "use ARM NEON to copy a memory buffer",
+		     aligned_block_copy_pf32_neon, 2,
+		     HWCAP_ARM_NEON),
+	CPU_WORKLOAD("neon_copy_pf64",
+		     "use ARM NEON to copy a memory buffer",
+		     aligned_block_copy_pf64_neon, 2,
+		     HWCAP_ARM_NEON),
+	CPU_WORKLOAD("neon_copy_unrolled",
+		     "use ARM NEON to copy a memory buffer",
+		     aligned_block_copy_unrolled_neon, 2,
+		     HWCAP_ARM_NEON),
+	CPU_WORKLOAD("neon_copy_unrolled_pf32",
+		     "use ARM NEON to copy a memory buffer",
+		     aligned_block_copy_unrolled_pf32_neon, 2,
+		     HWCAP_ARM_NEON),
+	CPU_WORKLOAD("neon_copy_unrolled_pf64",
+		     "use ARM NEON to copy a memory buffer",
+		     aligned_block_copy_unrolled_pf64_neon, 2,
+		     HWCAP_ARM_NEON),
+	CPU_WORKLOAD("neon_copy_backwards",
+		     "use ARM NEON to copy a memory buffer backwards",
+		     aligned_block_copy_backwards_neon, 2,
+		     HWCAP_ARM_NEON),
+	CPU_WORKLOAD("neon_copy_backwards_pf32",
+		     "use ARM NEON to copy a memory buffer backwards",
+		     aligned_block_copy_backwards_pf32_neon, 2,
+		     HWCAP_ARM_NEON),
+	CPU_WORKLOAD("neon_copy_backwards_pf64",
+		     "use ARM NEON to copy a memory buffer backwards",
+		     aligned_block_copy_backwards_pf64_neon, 2,
+		     HWCAP_ARM_NEON),
+	CPU_WORKLOAD("neon_read_tuned",
+		     "use ARM NEON to read from a memory buffer, --prefetch and --unroll",
+		     neon_read_tuned, 1,
+		     HWCAP_ARM_NEON),
+	CPU_WORKLOAD("neon_copy_tuned",
+		     "use ARM NEON to copy a memory buffer, --prefetch and --unroll",
+		     neon_copy_tuned, 2,
+		     HWCAP_ARM_NEON),
+	CPU_WORKLOAD("neon_write",
+		     "use ARM NEON to fill a memory buffer",
+		     aligned_block_fill_neon, 1,
+		     HWCAP_ARM_NEON),
+	CPU_WORKLOAD("neon_write_backwards",
+		     "use ARM NEON to fill a memory buffer",
+		     aligned_block_fill_backwards_neon, 1,
+		     HWCAP_ARM_NEON),
+	CPU_WORKLOAD("vfp_copy",
+		     "use VFP VLDM/VSTM to copy a memory buffer",
+		     aligned_block_copy_vfp, 2,
+		     HWCAP_ARM_VFP),
+	CPU_WORKLOAD("armv5te_copy_incr",
+		     "use LDM/STM to copy a memory buffer",
+		     aligned_block_copy_incr_armv5te, 2,
+		     0),
+	CPU_WORKLOAD("armv5te_copy_wrap",
+		     "use LDM/STM to copy a memory buffer",
+		     aligned_block_copy_wrap_armv5te, 2,
+		     0),
+	CPU_WORKLOAD("armv5te_write_strd",
+		     "use STRD to fill a memory buffer",
+		     aligned_block_fill_strd_armv5te, 1,
+		     0),
+	CPU_WORKLOAD("armv4_write_stm4",
+		     "use STM with 4 registers to fill a memory buffer",
+		     aligned_block_fill_stm4_armv4, 1,
+		     0),
+	CPU_WORKLOAD("armv4_write_stm8",
+		     "use STM with 8 registers to fill a memory buffer",
+		     aligned_block_fill_stm8_armv4, 1,
+		     0),
+#elif defined(__aarch64__)
+	CPU_WORKLOAD("neon_read",
+		     "use ARM NEON to read from a memory buffer",
+		     aligned_block_read_neon, 1,
+		     HWCAP_ASIMD),
+	CPU_WORKLOAD("neon_read_pf32",
+		     "use ARM NEON to read from a memory buffer",
+		     aligned_block_read_pf32_neon, 1,
+		     HWCAP_ASIMD),
+	CPU_WORKLOAD("neon_read_pf64",
+		     "use ARM NEON to read from a memory buffer",
+		     aligned_block_read_pf64_neon, 1,
+		     HWCAP_ASIMD),
+	CPU_WORKLOAD("neon_copy",
+		     "use ARM NEON to copy a memory buffer",
+		     aligned_block_copy_neon, 2,
+		     HWCAP_ASIMD),
+	CPU_WORKLOAD("neon_copy_pf32",
+		     "use ARM NEON to copy a memory buffer",
+		     aligned_block_copy_pf32_neon, 2,
+		     HWCAP_ASIMD),
+	CPU_WORKLOAD("neon_copy_pf64",
+		     "use ARM NEON to copy a memory buffer",
+		     aligned_block_copy_pf64_neon, 2,
+		     HWCAP_ASIMD),
+	CPU_WORKLOAD("neon_copy_unrolled",
+		     "use ARM NEON to copy a memory buffer",
+		     aligned_block_copy_unrolled_neon, 2,
+		     HWCAP_ASIMD),
+	CPU_WORKLOAD("neon_copy_backwards",
+		     "use ARM NEON to copy a memory buffer backwards",
+		     aligned_block_copy_backwards_neon, 2,
+		     HWCAP_ASIMD),
+	CPU_WORKLOAD("neon_read_tuned",
+		     "use ARM NEON to read from a memory buffer, --prefetch and --unroll",
+		     neon_read_tuned, 1,
+		     HWCAP_ASIMD),
+	CPU_WORKLOAD("neon_copy_tuned",
+		     "use ARM NEON to copy a memory buffer, --prefetch and --unroll",
+		     neon_copy_tuned, 2,
+		     HWCAP_ASIMD),
+	CPU_WORKLOAD("neon_write",
+		     "use ARM NEON to fill a memory buffer",
+		     aligned_block_fill_neon, 1,
+		     HWCAP_ASIMD),
+	CPU_WORKLOAD("neon_write_backwards",
+		     "use ARM NEON to fill a memory buffer",
+		     aligned_block_fill_backwards_neon, 1,
+		     HWCAP_ASIMD),
+#endif
+};
+const int workloads_count = ARRAY_SIZE(workloads_list);
+
+/* The supported workload with exactly the first 'len' bytes of 'name' */
+workload_t *workload_find(const char *name, size_t len)
+{
+	int i;
+
+	for (i = 0; i < workloads_count; i++) {
+		if (strncmp(name, workloads_list[i].name, len) == 0 &&
+		    workloads_list[i].name[len] == 0 &&
+		    workload_is_supported(&workloads_list[i]))
+			return &workloads_list[i];
+	}
+	return NULL;
+}
+
+/*
+ * Wait until each of the workload threads got its first block of work done
+ * (or its first frame to the screen), instead of a fixed warm-up, or until
+ * the timeout runs out. Returns the number of the ones still not ready.
+ */
+int workloads_wait_ready(workload_t *w, int count, double timeout)
+{
+	double start = gettime();
+	int i, waiting;
+
+	while (1) {
+		waiting = 0;
+		for (i = 0; i < count; i++)
+			if (!__atomic_load_n(&w[i].ready, __ATOMIC_ACQUIRE))
+				waiting++;
+		if (!waiting || gettime() - start >= timeout)
+			break;
+		usleep(10000);
+	}
+
+	for (i = 0; i < count; i++)
+		if (!__atomic_load_n(&w[i].ready, __ATOMIC_ACQUIRE))
+			printf("'%s' is not up after %.0f seconds, going on\n",
+			       w[i].name, timeout);
+
+	return waiting;
+}
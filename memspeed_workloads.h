@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2014 Siarhei Siamashka
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The workloads which lima-memspeed measures, and which lima-memtester
+ * can run as background load with --load.
+ */
+
+#ifndef MEMSPEED_WORKLOADS_H
+#define MEMSPEED_WORKLOADS_H
+
+#include <stddef.h>
+#include "lima-memspeed.h"
+
+/*
+ * The latency workload follows a chain of pointers, one per cache line,
+ * through a random single cycle over the whole buffer, so that every load
+ * depends on the previous one and neither the prefetchers nor the caches
+ * (for a buffer much larger than them) can help. The loads are timed in
+ * batches of LATENCY_BATCH, and the per-load averages of the batches go
+ * into a histogram with LATENCY_BUCKET ns wide buckets, for the average
+ * and the percentiles printed at the end.
+ */
+#define LATENCY_BATCH   32
+#define LATENCY_BUCKET  0.5
+#define LATENCY_BUCKETS 4096
+
+typedef struct latency_stats_t
+{
+	uint64_t buckets[LATENCY_BUCKETS];
+	uint64_t batches;
+	double sum_ns;
+	int huge_pages;
+} latency_stats_t;
+
+/*
+ * The coherency workloads bounce a cache line between a pair of cpus, the
+ * first thread on cpu 0 and 1, the next one on 2 and 3 and so on. Each
+ * one counts the line transfers, COHERENCY_BATCH turns at a time, and the
+ * bandwidth is 64 bytes per transfer.
+ */
+enum {
+	COHERENCY_TRUE_ATOMIC,
+	COHERENCY_TRUE_STORE,
+	COHERENCY_FALSE_ATOMIC,
+	COHERENCY_FALSE_STORE,
+	COHERENCY_VARIANTS
+};
+#define COHERENCY_BATCH 16384
+
+typedef struct coherency_stats_t
+{
+	int variant;
+	int cpu[2];	/* -1 if not pinned */
+	uint64_t transfers;
+	double seconds;
+} coherency_stats_t;
+
+typedef struct coherency_t coherency_t;
+
+coherency_t *coherency_start(int variant, int cpu_a, int cpu_b);
+uint64_t coherency_run(coherency_t *c, uint64_t steps);
+void coherency_stop(coherency_t *c);
+
+/* The buffer size of the CPU and latency workloads */
+extern size_t workload_buffer_size;
+
+/*
+ * The stride_read, gather_read and page_read workloads count the cache
+ * line bytes which they move, of which only this fraction gets used: one
+ * 64-bit word per cache line, or per --stride bytes below a cache line.
+ * Returns 0 for the other workloads.
+ */
+#define STRIDE_MIN      8
+#define STRIDE_MAX      4096
+#define STRIDE_DEFAULT  256
+#define PAGE_STRIDE     4096
+
+extern int workload_stride;
+
+/*
+ * The prefetch distance in bytes and the cache lines per loop iteration
+ * of neon_read_tuned and neon_copy_tuned, which --autotune sweeps
+ */
+#define PREFETCH_MAX     4096
+#define PREFETCH_DEFAULT 256
+#define UNROLL_DEFAULT   2
+
+extern int workload_prefetch;
+extern int workload_unroll;
+
+double workload_useful_fraction(const workload_t *w);
+int workload_stride_valid(int stride);
+
+extern workload_t workloads_list[];
+extern const int workloads_count;
+
+void *cpu_thread(void *data);
+void *latency_thread(void *data);
+void *coherency_thread(void *data);
+void *workload_pmu_thread(void *data);
+
+int workload_is_supported(workload_t *w);
+workload_t *workload_find(const char *name, size_t len);
+int workloads_wait_ready(workload_t *w, int count, double timeout);
+
+#endif
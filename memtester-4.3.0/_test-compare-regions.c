@@ -8,91 +8,297 @@
  * Licensed under the terms of the GNU General Public License version 2 (only).
  * See the file COPYING for details.
  *
- * This file contains a simple test for the 'compare_regions_helper_*'
- * implementations.
+ * This file contains a test for the 'compare_regions_helper*'
+ * implementations: the C loop, the NEON kernel (the 32-bit ARM or the
+ * AArch64 one) and the capture of every mismatch into a compare_ring.
+ * Mismatches get put at random indexes and lanes of two equal buffers,
+ * and each implementation has to agree with a plain reference loop on
+ * the index and the values it reports. Afterwards every implementation
+ * is timed on its own.
  *
+ *   _test-compare-regions [-n repeats] [-s seed]
+ *
+ * It is linked with memtester.c and tests.c is included here, for the
+ * static parts of the helpers.
  */
-#include <stdint.h>
-#include <stdlib.h>
-#include <stdio.h>
-#include <assert.h>
-
-#include "types.h"
+#include "tests.c"
 
 #define BUFSIZE (256 * 1024)
+#define LANES 8
+/* more than a compare_ring holds */
+#define MAX_ERRORS (3 * COMPARE_RING_SIZE)
+#define BENCH_ROUNDS 200
 
-int use_phys = 0;
-int memtester_early_exit = 0;
-off_t physaddrbase = 0;
+struct reference {
+    size_t last;
+    ul va, vb;
+    size_t errors;
+    size_t lane_last[LANES];
+    ul lane_va[LANES], lane_vb[LANES];
+};
 
-size_t compare_regions_helper(ulv *bufa, ulv *bufb, size_t count, ul *va, ul *vb);
+static void reference_compare(ul *bufa, ul *bufb, size_t count,
+                              struct reference *ref) {
+    size_t i;
+    int j;
 
-#ifdef __arm__
+    ref->last = (size_t)(-1);
+    ref->va = ref->vb = 0;
+    ref->errors = 0;
+    for (j = 0; j < LANES; j++)
+        ref->lane_last[j] = (size_t)(-1);
+    for (i = 0; i < count; i++) {
+        if (bufa[i] == bufb[i])
+            continue;
+        ref->last = i;
+        ref->va = bufa[i];
+        ref->vb = bufb[i];
+        ref->errors++;
+        ref->lane_last[i % LANES] = i;
+        ref->lane_va[i % LANES] = bufa[i];
+        ref->lane_vb[i % LANES] = bufb[i];
+    }
+}
 
-typedef struct compare_regions_result {
-    ul iteration[8];
-    ul value1[8];
-    ul value2[8];
-} compare_regions_result;
+/* compare_regions_helper() with the NEON kernel, or forced to the C loop */
+static size_t helper(int neon, ul *bufa, ul *bufb, size_t count,
+                     ul *va, ul *vb, ul *crc, compare_ring *ring) {
+    size_t result;
+#ifdef USE_NEON_HELPERS
+    int saved = cpu_features()->neon;
 
-void write_regions_neon(ulv *buf1, ulv *buf2, ul val1, ul val2, ul bufsize);
-void compare_regions_neon(ulv *buf1, ulv *buf2, ul bufsize,
-                          compare_regions_result *res);
+    cpu.neon = neon && saved;
+    result = compare_regions_helper(bufa, bufb, count, va, vb, crc, ring);
+    cpu.neon = saved;
+#else
+    result = compare_regions_helper(bufa, bufb, count, va, vb, crc, ring);
+#endif
+    return result;
+}
 
+static int neon_available(void) {
+#ifdef USE_NEON_HELPERS
+    return have_neon();
+#else
+    return 0;
 #endif
+}
+
+/* Flip a random bit in one of the buffers, at a random block and lane */
+static void inject(ul *bufa, ul *bufb, size_t count, unsigned int *seed) {
+    size_t i = (rand_r(seed) % (count / LANES)) * LANES + rand_r(seed) % LANES;
+    ul *buf = rand_r(seed) & 1 ? bufa : bufb;
+
+    if (i >= count)
+        i = count - 1;
+    buf[i] ^= (ul) 1 << (rand_r(seed) % UL_LEN);
+}
+
+static int check_helper(const char *name, int neon, ul *bufa, ul *bufb,
+                        size_t count, struct reference *ref) {
+    size_t result, i;
+    ul va = 0, vb = 0, crc1, crc2;
+    compare_ring ring;
+    int k, n;
+
+    result = helper(neon, bufa, bufb, count, &va, &vb, &crc1, NULL);
+    if (result != ref->last ||
+        (result != (size_t)(-1) && (va != ref->va || vb != ref->vb))) {
+        printf("%s: (%08zX: %08lX != %08lX) vs. reference "
+               "(%08zX: %08lX != %08lX)\n", name, result, va, vb,
+               ref->last, ref->va, ref->vb);
+        return -1;
+    }
 
-size_t compare_regions_helper_ref(ulv *bufa, ulv *bufb, size_t count,
-                                  ul *va, ul *vb) {
-    size_t i, result = (size_t)(-1);
-    ulv *p1 = bufa;
-    ulv *p2 = bufb;
-
-    for (i = 0; i < count; i++, p1++, p2++) {
-        ul v1 = *p1, v2 = *p2;
-        if (v1 != v2) {
-            *va = v1;
-            *vb = v2;
-            result = i;
+    /* compare_regions() checks the crc of the same helper, run again */
+    helper(neon, bufa, bufb, count, &va, &vb, &crc2, NULL);
+    if (crc1 != crc2) {
+        printf("%s: crc 0x%08lX changed to 0x%08lX on the same buffers\n",
+               name, crc1, crc2);
+        return -1;
+    }
+
+    ring.seen = 0;
+    result = helper(neon, bufa, bufb, count, &va, &vb, &crc2, &ring);
+    if (result != ref->last || crc1 != crc2) {
+        printf("%s: the ring changed the result to %08zX, crc 0x%08lX\n",
+               name, result, crc2);
+        return -1;
+    }
+    if (ring.seen != ref->errors) {
+        printf("%s: the ring saw %zu mismatches, not %zu\n", name, ring.seen,
+               ref->errors);
+        return -1;
+    }
+    n = ring.seen < COMPARE_RING_SIZE ? ring.seen : COMPARE_RING_SIZE;
+    for (k = 0; k < n; k++) {
+        i = ring.index[k];
+        if (i >= count || bufa[i] == bufb[i] || ring.va[k] != bufa[i] ||
+            ring.vb[k] != bufb[i]) {
+            printf("%s: ring entry %d (%08zX: %08lX != %08lX) is not a "
+                   "mismatch\n", name, k, i, ring.va[k], ring.vb[k]);
+            return -1;
         }
     }
-    return result;
+    /* with all of them in the ring, each one has to be there once */
+    for (k = 0; ring.seen <= COMPARE_RING_SIZE && k < n; k++) {
+        int l;
+
+        for (l = k + 1; l < n; l++) {
+            if (ring.index[l] == ring.index[k]) {
+                printf("%s: ring has %08zX twice\n", name, ring.index[k]);
+                return -1;
+            }
+        }
+    }
+    return 0;
 }
 
-int main()
-{
-    int repeat;
-    int i;
-    ul *buf1 = malloc(BUFSIZE * sizeof(ulv));
-    ul *buf2 = malloc(BUFSIZE * sizeof(ulv));
-
-    for (repeat = 0; repeat < 10000; repeat++)
-    {
-        ul offs1, offs2, v1a, v1b, v2a, v2b;
-        for (i = 0; i < BUFSIZE; i++)
-        {
-            buf1[i] = buf2[i] = i ^ 0xCCCCCCCC;
+/* The NEON kernel alone, which reports the last mismatch of every lane */
+static int check_kernel(ul *bufa, ul *bufb, size_t count) {
+#ifdef USE_NEON_HELPERS
+    compare_regions_helper_result res;
+    struct reference ref;
+    size_t n = count & ~(size_t) 15;
+    int j;
+
+    reference_compare(bufa, bufb, n, &ref);
+    compare_regions_helper_neon(bufa, bufb, n, &res);
+    for (j = 0; j < LANES; j++) {
+        size_t i = res.failed_index[j] == NO_FAILED_INDEX ? (size_t)(-1)
+                                                          : res.failed_index[j];
+
+        if (i != ref.lane_last[j] ||
+            (i != (size_t)(-1) && (res.failed_value1[j] != ref.lane_va[j] ||
+                                   res.failed_value2[j] != ref.lane_vb[j]))) {
+            printf("NEON kernel: lane %d (%08zX: %08lX != %08lX) vs. "
+                   "reference (%08zX: %08lX != %08lX)\n", j, i,
+                   res.failed_value1[j], res.failed_value2[j],
+                   ref.lane_last[j], ref.lane_va[j], ref.lane_vb[j]);
+            return -1;
         }
-        uint32_t rand_index1 = rand() % BUFSIZE;
-        buf2[rand_index1] = rand();
+    }
+#endif
+    return 0;
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* GB/s of both buffers being read, with 'errors' mismatches for the ring */
+static double bench_helper(int neon, int use_ring, ul *bufa, ul *bufb,
+                           int errors, unsigned int *seed) {
+    compare_ring ring;
+    ul va, vb, crc;
+    double start;
+    int i;
+
+    memcpy(bufb, bufa, BUFSIZE * sizeof(ul));
+    for (i = 0; i < errors; i++)
+        inject(bufa, bufb, BUFSIZE, seed);
+    start = now();
+    for (i = 0; i < BENCH_ROUNDS; i++) {
+        ring.seen = 0;
+        helper(neon, bufa, bufb, BUFSIZE, &va, &vb, &crc,
+               use_ring ? &ring : NULL);
+    }
+    return 2.0 * BUFSIZE * sizeof(ul) * BENCH_ROUNDS / (now() - start) / 1e9;
+}
+
+static double bench_kernel(ul *bufa, ul *bufb) {
+#ifdef USE_NEON_HELPERS
+    compare_regions_helper_result res;
+    double start;
+    int i;
+
+    memcpy(bufb, bufa, BUFSIZE * sizeof(ul));
+    start = now();
+    for (i = 0; i < BENCH_ROUNDS; i++)
+        compare_regions_helper_neon(bufa, bufb, BUFSIZE, &res);
+    return 2.0 * BUFSIZE * sizeof(ul) * BENCH_ROUNDS / (now() - start) / 1e9;
+#else
+    return 0;
+#endif
+}
 
-        uint32_t rand_index2 = rand() % BUFSIZE;
-        buf2[rand_index2] = rand();
+int main(int argc, char *argv[])
+{
+    ul *buf1 = malloc(BUFSIZE * sizeof(ul));
+    ul *buf2 = malloc(BUFSIZE * sizeof(ul));
+    unsigned int seed = 1;
+    int repeats = 1000, repeat, errors, neon = neon_available();
+    struct reference ref;
+    size_t count, i;
+    ul pattern;
+    int c;
 
-        uint32_t rand_index3 = rand() % BUFSIZE;
-        buf2[rand_index3] = rand();
+    while ((c = getopt(argc, argv, "n:s:")) != -1) {
+        switch (c) {
+        case 'n':
+            repeats = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n repeats] [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!buf1 || !buf2) {
+        fprintf(stderr, "failed to allocate the buffers\n");
+        return 1;
+    }
 
-        offs1 = compare_regions_helper(buf1, buf2, BUFSIZE, &v1a, &v1b);
-        offs2 = compare_regions_helper_ref(buf1, buf2, BUFSIZE, &v2a, &v2b);
+    printf("checking compare_regions_helper C%s, %d repeats, seed %u\n",
+           neon ? ", NEON and the NEON kernel" : "", repeats, seed);
+    for (repeat = 0; repeat < repeats; repeat++) {
+        /* a tail which the NEON kernel leaves to the C loop, sometimes */
+        count = BUFSIZE - rand_r(&seed) % 64;
+        pattern = (ul) rand_r(&seed) * 0x01010101;
+        for (i = 0; i < count; i++)
+            buf1[i] = buf2[i] = i ^ pattern;
 
-        if (offs1 != offs2)
-        {
-            printf("rand_index1=%08X\n", rand_index1);
-            printf("rand_index2=%08X\n", rand_index2);
-            printf("rand_index3=%08X\n", rand_index3);
-            printf("(%08lX: %08lX != %08lX) vs. (%08lX: %08lX != %08lX)\n",
-                   offs1, v1a, v1b, offs2, v2a, v2b);
+        switch (rand_r(&seed) % 10) {
+        case 0:
+            errors = 0;
             break;
+        case 1:
+            errors = rand_r(&seed) % MAX_ERRORS;
+            break;
+        default:
+            errors = 1 + rand_r(&seed) % 3;
         }
+        for (c = 0; c < errors; c++)
+            inject(buf1, buf2, count, &seed);
+
+        reference_compare(buf1, buf2, count, &ref);
+        if (check_helper("C", 0, buf1, buf2, count, &ref) ||
+            (neon && check_helper("NEON", 1, buf1, buf2, count, &ref)) ||
+            (neon && check_kernel(buf1, buf2, count))) {
+            printf("repeat %d, count %zu, %d injected, %zu mismatches\n",
+                   repeat, count, errors, ref.errors);
+            return 1;
+        }
+    }
+    printf("all agree\n\n");
+
+    for (i = 0; i < BUFSIZE; i++)
+        buf1[i] = i ^ 0xCCCCCCCC;
+    printf("%-20s %8.2f GB/s\n", "C",
+           bench_helper(0, 0, buf1, buf2, 0, &seed));
+    printf("%-20s %8.2f GB/s\n", "C, ring",
+           bench_helper(0, 1, buf1, buf2, COMPARE_RING_SIZE, &seed));
+    if (neon) {
+        printf("%-20s %8.2f GB/s\n", "NEON",
+               bench_helper(1, 0, buf1, buf2, 0, &seed));
+        printf("%-20s %8.2f GB/s\n", "NEON, ring",
+               bench_helper(1, 1, buf1, buf2, COMPARE_RING_SIZE, &seed));
+        printf("%-20s %8.2f GB/s\n", "NEON kernel", bench_kernel(buf1, buf2));
     }
 
     free(buf1);
@@ -0,0 +1,65 @@
+/*
+ * Pattern kernels for the memtester tests, see kernels.h.
+ * Licensed under the terms of the GNU General Public License version 2 (only).
+ * See the file COPYING for details.
+ */
+
+#include "types.h"
+#include "sizes.h"
+#include "kernels.h"
+
+/* The value of element i, at address p, for each generator */
+#define KERNEL_VALUE_pair(p, i, a, b) (((i) & 1) ? (b) : (a))
+#define KERNEL_VALUE_seq(p, i, a, b)  ((a) + (i))
+#define KERNEL_VALUE_addr(p, i, a, b) ((size_t) (p) ^ (((i) & 1) ? (b) : (a)))
+
+/*
+ * One fill and check family for a generator, element type and unroll
+ * factor. The check ORs the differences of a block together, which
+ * vectorises, and only looks for the element once a block has one.
+ */
+#define KERNEL_DEFINE(name, gen, type, unroll)                              \
+void kernel_fill1_##name(type *buf, size_t count, type a, type b) {         \
+    size_t i = 0, k;                                                        \
+                                                                            \
+    for (; i + (unroll) <= count; i += (unroll))                            \
+        for (k = 0; k < (unroll); k++)                                      \
+            buf[i + k] = (type) KERNEL_VALUE_##gen(buf + i + k, i + k, a, b);\
+    for (; i < count; i++)                                                  \
+        buf[i] = (type) KERNEL_VALUE_##gen(buf + i, i, a, b);               \
+}                                                                           \
+                                                                            \
+void kernel_fill2_##name(type *bufa, type *bufb, size_t count,              \
+                         type a, type b) {                                  \
+    size_t i = 0, k;                                                        \
+                                                                            \
+    for (; i + (unroll) <= count; i += (unroll))                            \
+        for (k = 0; k < (unroll); k++)                                      \
+            bufa[i + k] = bufb[i + k] =                                     \
+                (type) KERNEL_VALUE_##gen(bufa + i + k, i + k, a, b);       \
+    for (; i < count; i++)                                                  \
+        bufa[i] = bufb[i] = (type) KERNEL_VALUE_##gen(bufa + i, i, a, b);   \
+}                                                                           \
+                                                                            \
+size_t kernel_check_##name(const type *buf, size_t count, type a, type b) {  \
+    size_t i = 0, k;                                                        \
+    type diff;                                                              \
+                                                                            \
+    for (; i + (unroll) <= count; i += (unroll)) {                          \
+        diff = 0;                                                           \
+        for (k = 0; k < (unroll); k++)                                      \
+            diff |= buf[i + k] ^                                            \
+                    (type) KERNEL_VALUE_##gen(buf + i + k, i + k, a, b);    \
+        if (diff)                                                           \
+            break;                                                          \
+    }                                                                       \
+    for (; i < count; i++) {                                                \
+        if (buf[i] != (type) KERNEL_VALUE_##gen(buf + i, i, a, b))          \
+            return i;                                                       \
+    }                                                                       \
+    return count;                                                           \
+}
+
+KERNEL_DEFINE(pair, pair, ul, 16)
+KERNEL_DEFINE(seq, seq, ul, 16)
+KERNEL_DEFINE(addr, addr, ul, 16)
@@ -0,0 +1,31 @@
+/*
+ * Pattern kernels for the memtester tests.
+ * Licensed under the terms of the GNU General Public License version 2 (only).
+ * See the file COPYING for details.
+ *
+ * The plain C fill and check loops of the tests, generated in kernels.c
+ * from one expression per pattern generator. They work on non-volatile
+ * pointers and live in their own compilation unit, which is built with
+ * high optimisation, so the compiler unrolls and vectorises them. Being
+ * out of line is what keeps the stores and loads from being optimised
+ * away across a fill and the check that follows it.
+ *
+ * Every generator takes two parameters, 'a' and 'b':
+ *   pair  'a' at even indexes, 'b' at odd ones
+ *   seq   'a' plus the index
+ *   addr  the address of the element, XORed with 'a' or 'b' like pair
+ * The indexes count from the start of the buffer passed in.
+ */
+
+#include <stddef.h>
+
+#define KERNEL_DECLARE(name, type)                                          \
+    void kernel_fill1_##name(type *buf, size_t count, type a, type b);      \
+    void kernel_fill2_##name(type *bufa, type *bufb, size_t count,          \
+                             type a, type b);                               \
+    /* the index of the first element which doesn't match, or count */     \
+    size_t kernel_check_##name(const type *buf, size_t count, type a, type b);
+
+KERNEL_DECLARE(pair, ul)
+KERNEL_DECLARE(seq, ul)
+KERNEL_DECLARE(addr, ul)
@@ -14,110 +14,2485 @@
 
 #define __version__ "4.3.0"
 
+#define _GNU_SOURCE
+
 #include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <dirent.h>
+#include <syslog.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <ctype.h>
+#include <getopt.h>
+
+#include "types.h"
+#include "sizes.h"
+#include "tests.h"
+#include "memtester.h"
+#include "../memspeed_pmu.h"
+
+#define EXIT_FAIL_NONSTARTER    0x01
+#define EXIT_FAIL_ADDRESSLINES  0x02
+#define EXIT_FAIL_OTHERTEST     0x04
+#define EXIT_FAIL_GPU           0x08
+
+/*
+ * The tests, in the order they are run. The bit of a test in
+ * MEMTESTER_TEST_MASK is its index here. Out of tree pattern engines can
+ * be compiled in by pointing MEMTESTER_EXTRA_TESTS at a header with more
+ * entries, e.g. -DMEMTESTER_EXTRA_TESTS='"board-tests.h"'.
+ */
+struct test tests[] = {
+    { "Random Value", test_random_value, 1 },
+    { "Compare XOR", test_xor_comparison },
+    { "Compare SUB", test_sub_comparison },
+    { "Compare MUL", test_mul_comparison },
+    { "Compare DIV",test_div_comparison },
+    { "Compare OR", test_or_comparison },
+    { "Compare AND", test_and_comparison },
+    { "Sequential Increment", test_seqinc_comparison, 1 },
+    { "Bit Flip", test_bitflip_comparison, 1 },
+    { "Block Sequential", test_blockseq_comparison, 1 },
+    { "Checkerboard", test_checkerboard_comparison, 1 },
+    { "Bit Spread", test_bitspread_comparison, 1 },
+    { "Solid Bits", test_solidbits_comparison, 1 },
+    { "Walking Ones", test_walkbits1_comparison, 1 },
+    { "Walking Zeroes", test_walkbits0_comparison, 1 },
+    { "Random Order", test_random_order, 1 },
+    { "Bank Conflict", test_bank_conflict, 1 },
+    { "Row Alternate", test_row_alternate, 1 },
+    { "Row Hammer", test_row_hammer, 1 },
+#ifdef TEST_NARROW_WRITES    
+    { "8-bit Writes", test_8bit_wide_random },
+    { "16-bit Writes", test_16bit_wide_random },
+#endif
+#ifdef MEMTESTER_EXTRA_TESTS
+#include MEMTESTER_EXTRA_TESTS
+#endif
+    { NULL, NULL }
+};
+
+/* Sanity checks and portability helper macros. */
+#ifdef _SC_VERSION
+void check_posix_system(void) {
+    if (sysconf(_SC_VERSION) < 198808L) {
+        fprintf(stderr, "A POSIX system is required.  Don't be surprised if "
+            "this craps out.\n");
+        fprintf(stderr, "_SC_VERSION is %lu\n", sysconf(_SC_VERSION));
+    }
+}
+#else
+#define check_posix_system()
+#endif
+
+#ifdef _SC_PAGE_SIZE
+int memtester_pagesize(void) {
+    int pagesize = sysconf(_SC_PAGE_SIZE);
+    if (pagesize == -1) {
+        perror("get page size failed");
+        exit(EXIT_FAIL_NONSTARTER);
+    }
+    printf("pagesize is %ld\n", (long) pagesize);
+    return pagesize;
+}
+#else
+int memtester_pagesize(void) {
+    printf("sysconf(_SC_PAGE_SIZE) not supported; using pagesize of 8192\n");
+    return 8192;
+}
+#endif
+
+/* Some systems don't define MAP_LOCKED.  Define it to 0 here
+   so it's just a no-op when ORed with other constants. */
+#ifndef MAP_LOCKED
+  #define MAP_LOCKED 0
+#endif
+
+/* What "max" leaves for the rest of the system, at least */
+#define MAX_MEMORY_RESERVE (16 << 20)
+
+/*
+ * The test buffer is backed by huge pages where possible, so that the
+ * sweeps over it don't measure TLB misses and page table walks along
+ * with the memory. The first choice is the hugetlbfs pool (MAP_HUGETLB),
+ * then an anonymous mapping aligned to the huge page size with
+ * MADV_HUGEPAGE for transparent huge pages, and plain malloc() if both
+ * fail. MEMTESTER_HUGEPAGES=0 goes straight to malloc().
+ */
+#define BUFFER_MALLOC   0
+#define BUFFER_HUGETLB  1
+#define BUFFER_THP      2
+
+static const char *buffer_kinds[] = { "malloc", "hugetlb pages",
+                                      "transparent huge pages" };
+
+static struct {
+    int kind;
+    void *map;
+    size_t maplen;
+} buffer;
+
+/* A value from /proc/meminfo in bytes, or 0 if it isn't there */
+static size_t meminfo_bytes(const char *key) {
+    char line[128];
+    unsigned long long kb;
+    size_t len = strlen(key), bytes = 0;
+    FILE *f = fopen("/proc/meminfo", "r");
+
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (!strncmp(line, key, len) &&
+            sscanf(line + len, "%llu kB", &kb) == 1) {
+            bytes = kb << 10 > (size_t) -1 ? (size_t) -1 : (size_t) (kb << 10);
+            break;
+        }
+    }
+    fclose(f);
+    return bytes;
+}
+
+/* The default huge page size, or 2MB */
+static size_t huge_page_size(void) {
+    size_t size = meminfo_bytes("Hugepagesize:");
+    return size ? size : 2 << 20;
+}
+
+static void volatile *buffer_alloc(size_t bytes, size_t pagesize) {
+    static int use_huge = -1;
+    static size_t huge;
+    size_t len, head;
+    char *p, *env;
+
+    if (use_huge < 0) {
+        env = getenv("MEMTESTER_HUGEPAGES");
+        use_huge = !env || strcmp(env, "0");
+        huge = huge_page_size();
+    }
+    if (!use_huge)
+        goto plain;
+
+#ifdef MAP_HUGETLB
+    len = (bytes + huge - 1) & ~(huge - 1);
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        buffer.kind = BUFFER_HUGETLB;
+        buffer.map = p;
+        buffer.maplen = len;
+        return p;
+    }
+#endif
+
+#ifdef MADV_HUGEPAGE
+    /* Over-allocate and trim, THP needs huge page aligned ranges */
+    len = ((bytes + pagesize - 1) & ~(pagesize - 1)) + huge;
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p != MAP_FAILED) {
+        head = (huge - (size_t) p % huge) % huge;
+        if (head)
+            munmap(p, head);
+        if (huge - head)
+            munmap(p + len - (huge - head), huge - head);
+        p += head;
+        len -= huge;
+        if (madvise(p, len, MADV_HUGEPAGE) == 0) {
+            buffer.kind = BUFFER_THP;
+            buffer.map = p;
+            buffer.maplen = len;
+            return p;
+        }
+        munmap(p, len);
+    }
+#endif
+
+plain:
+    buffer.kind = BUFFER_MALLOC;
+    buffer.map = malloc(bytes);
+    buffer.maplen = bytes;
+    return buffer.map;
+}
+
+/*
+ * The next size for the bisection in memtester_main(), or 0 once 'good'
+ * is within 1/256 of 'bad', which is close enough and keeps the number
+ * of tries (each of which faults in and locks the whole buffer) low.
+ */
+static size_t bisect_next(size_t good, size_t bad, size_t pagesize) {
+    size_t granule = bad >> 8 > pagesize ? bad >> 8 : pagesize;
+    size_t next;
+
+    if (bad - good <= granule)
+        return 0;
+    next = (good + (bad - good) / 2) & ~(pagesize - 1);
+    return next > good ? next : 0;
+}
+
+/*
+ * Fault in (and have the kernel zero) every page of an unlocked buffer
+ * from one thread per cpu, each on its own range, rather than from the
+ * first test. This is only done once the size has settled: a try of the
+ * mlock() bisection which is too large would just fail in mlock(), but
+ * touching all of its pages could wake the OOM killer.
+ */
+#define PREFAULT_MIN_BYTES (16 << 20)
+
+struct prefault_range {
+    pthread_t thread;
+    char volatile *start;
+    size_t bytes;
+    size_t pagesize;
+    int started;
+};
+
+static void *prefault_thread(void *arg) {
+    struct prefault_range *r = arg;
+    size_t i;
+
+    for (i = 0; i < r->bytes; i += r->pagesize)
+        r->start[i] = 0;
+    return NULL;
+}
+
+static void buffer_prefault(void volatile *buf, size_t bytes,
+                            size_t pagesize) {
+    static int enabled = -1;
+    struct prefault_range *ranges;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t slice, i, n;
+    char *env;
+
+    if (enabled < 0) {
+        env = getenv("MEMTESTER_PREFAULT");
+        enabled = !env || strcmp(env, "0");
+    }
+    n = bytes / PREFAULT_MIN_BYTES;
+    if (cpus > 0 && n > (size_t) cpus)
+        n = cpus;
+    if (!enabled || n < 2 || !(ranges = calloc(n, sizeof(*ranges))))
+        return;
+    slice = (bytes / n) & ~(pagesize - 1);
+    for (i = 0; i < n; i++) {
+        ranges[i].start = (char volatile *) buf + i * slice;
+        ranges[i].bytes = i == n - 1 ? bytes - i * slice : slice;
+        ranges[i].pagesize = pagesize;
+        ranges[i].started = !pthread_create(&ranges[i].thread, NULL,
+                                            prefault_thread, &ranges[i]);
+        if (!ranges[i].started)
+            prefault_thread(&ranges[i]);
+    }
+    for (i = 0; i < n; i++)
+        if (ranges[i].started)
+            pthread_join(ranges[i].thread, NULL);
+    free(ranges);
+}
+
+static void buffer_free(void volatile *buf) {
+    if (buffer.kind == BUFFER_MALLOC)
+        free((void *) buf);
+    else
+        munmap(buffer.map, buffer.maplen);
+    buffer.map = NULL;
+}
+
+/* Function declarations */
+void usage(char *me);
+
+/* Global vars - so tests have access to this information */
+int use_phys = 0;
+int memtester_early_exit = 0;
+int memtester_fused = 0;
+int memtester_single = 0;
+int memtester_uncached = 0;
+ul memtester_seed = 0;
+int memtester_bus_width = 32;
+int memtester_syslog = 0;
+FILE *memtester_json = NULL;
+off_t physaddrbase = 0;
+ulv *memtester_base = NULL;
+
+/*
+ * With MEMTESTER_GPU_SHARE=<MB>, that much of the end of the buffer is
+ * offered to this hook, which has the gpu test it instead. The cpu tests
+ * only skip it if the hook returns 0.
+ */
+int (*memtester_gpu_share)(ulv *base, size_t bytes) = NULL;
+
+/*
+ * If set, the buffer comes from this hook instead of malloc(): it gets
+ * the size wanted and cuts it down to what it could map, or returns NULL.
+ * lima-memtester --mali-memory has the memory of the mali driver tested.
+ */
+void volatile *(*memtester_gpu_memory)(size_t *bytes) = NULL;
+
+/*
+ * Called with the name of the test at the start (1) and the end (0) of
+ * every pass of every worker, if set, for lima-memtester's trace.
+ */
+void (*memtester_trace)(const char *name, int begin) = NULL;
+
+/*
+ * Called at the end of every loop, if set, for lima-memtester to print
+ * the SoC temperatures, clocks and voltages during the loop. With
+ * --json, it also gets the loop record to add them as more fields.
+ */
+void (*memtester_loop_telemetry)(FILE *json) = NULL;
+
+/*
+ * Without -p, failures are still reported at their physical address, from
+ * a copy of /proc/self/pagemap for the locked buffer, read in one go after
+ * mlock. The kernel only shows the page frame numbers to root, otherwise
+ * the offsets into the buffer are reported as before.
+ */
+#define PAGEMAP_PRESENT     (1ULL << 63)
+#define PAGEMAP_PFN_MASK    ((1ULL << 55) - 1)
+
+static uint64_t *pagemap;
+static size_t pagemap_pages;
+static size_t pagemap_pagesize;
+
+static void pagemap_load(void volatile *aligned, size_t bufsize,
+                         size_t pagesize) {
+    size_t i, n = bufsize / pagesize, found = 0;
+    off_t pos = (off_t) ((size_t) aligned / pagesize) * sizeof(uint64_t);
+    ssize_t got, done = 0;
+    int fd = open("/proc/self/pagemap", O_RDONLY);
+
+    if (fd < 0)
+        return;
+    pagemap = malloc(n * sizeof(uint64_t));
+    while (pagemap && done < (ssize_t) (n * sizeof(uint64_t))) {
+        got = pread(fd, (char *) pagemap + done,
+                    n * sizeof(uint64_t) - done, pos + done);
+        if (got <= 0)
+            break;
+        done += got;
+    }
+    close(fd);
+    if (!pagemap || done < (ssize_t) (n * sizeof(uint64_t))) {
+        free(pagemap);
+        pagemap = NULL;
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        if ((pagemap[i] & PAGEMAP_PRESENT) && (pagemap[i] & PAGEMAP_PFN_MASK))
+            found++;
+        pagemap[i] = (pagemap[i] & PAGEMAP_PRESENT) ?
+                     pagemap[i] & PAGEMAP_PFN_MASK : 0;
+    }
+    if (!found) {
+        free(pagemap);
+        pagemap = NULL;
+        return;
+    }
+    pagemap_pages = n;
+    pagemap_pagesize = pagesize;
+    printf("reporting physical addresses from /proc/self/pagemap\n");
+}
+
+/*
+ * -p takes a list of physical windows, "base[:size][,base:size...]" in
+ * hex, "reserved" for the no-map nodes of the device tree's
+ * reserved-memory, less anything /proc/iomem shows as System RAM, or
+ * "offline" for the memory blocks which were taken offline through memory
+ * hotplug, and which the kernel no longer hands out. They
+ * get mapped back to back into one virtual range, so the tests see a
+ * single buffer, and failures are reported at their physical address.
+ * Only a lone window can leave out its size, it then takes the memory
+ * argument.
+ */
+#define PHYS_WINDOWS_MAX 32
+#define RESERVED_MEMORY_DIR "/proc/device-tree/reserved-memory"
+#define MEMORY_BLOCKS_DIR "/sys/devices/system/memory"
+
+static struct phys_window {
+    off_t base;
+    size_t bytes;
+    size_t offset; /* into the tested buffer */
+} phys_windows[PHYS_WINDOWS_MAX];
+static int phys_nwindows;
+
+static int phys_window_add(off_t base, size_t bytes, size_t pagesize) {
+    if (phys_nwindows == PHYS_WINDOWS_MAX) {
+        fprintf(stderr, "too many physical windows, %d at most\n",
+                PHYS_WINDOWS_MAX);
+        return -1;
+    }
+    if ((base | bytes) & (pagesize - 1)) {
+        fprintf(stderr, "bad physical window 0x%llx:0x%llx; does not start "
+                "and end on page boundaries\n", (ull) base, (ull) bytes);
+        return -1;
+    }
+    phys_windows[phys_nwindows].base = base;
+    phys_windows[phys_nwindows].bytes = bytes;
+    phys_nwindows++;
+    return 0;
+}
+
+static int phys_windows_parse(const char *arg, size_t pagesize) {
+    const char *p = arg;
+    char *end;
+    ull base, bytes;
+
+    do {
+        errno = 0;
+        base = strtoull(p, &end, 16);
+        if (errno || end == p)
+            return -1;
+        bytes = 0;
+        if (*end == ':') {
+            p = end + 1;
+            bytes = strtoull(p, &end, 16);
+            if (errno || end == p || !bytes)
+                return -1;
+        }
+        if ((*end && *end != ',') ||
+            phys_window_add((off_t) base, (size_t) bytes, pagesize))
+            return -1;
+        p = end + 1;
+    } while (*end);
+    if (phys_nwindows > 1) {
+        int i;
+
+        for (i = 0; i < phys_nwindows; i++) {
+            if (!phys_windows[i].bytes) {
+                fprintf(stderr, "every one of several physical windows "
+                        "needs a size\n");
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* A big endian number of 'cells' 32-bit cells */
+static ull dt_cells(const unsigned char *p, int cells) {
+    ull v = 0;
+
+    while (cells-- > 0) {
+        v = v << 32 | (ull) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+        p += 4;
+    }
+    return v;
+}
+
+/* A device tree property, returns its length or -1 */
+static int dt_property(const char *node, const char *name,
+                       unsigned char *buf, int size) {
+    char path[512];
+    int fd, len;
+
+    snprintf(path, sizeof(path), "%s/%s", node, name);
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    len = read(fd, buf, size);
+    close(fd);
+    return len;
+}
+
+/* Whether any of [base, base + bytes) is System RAM in /proc/iomem */
+static int iomem_system_ram(ull base, ull bytes) {
+    char line[256];
+    ull start, end;
+    int found = 0, name;
+    FILE *f = fopen("/proc/iomem", "r");
+
+    if (!f)
+        return 0;
+    while (!found && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, " %llx-%llx : %n", &start, &end, &name) >= 2 &&
+            !strncmp(line + name, "System RAM", 10) &&
+            start < base + bytes && end >= base)
+            found = 1;
+    }
+    fclose(f);
+    return found;
+}
+
+static int phys_window_cmp(const void *a, const void *b) {
+    const struct phys_window *wa = a, *wb = b;
+
+    return wa->base < wb->base ? -1 : wa->base > wb->base;
+}
+
+/* Sort the windows by address and join the ones which touch */
+static void phys_windows_sort(void) {
+    int i, n = 0;
+
+    qsort(phys_windows, phys_nwindows, sizeof(*phys_windows),
+          phys_window_cmp);
+    for (i = 1; i < phys_nwindows; i++) {
+        if (phys_windows[n].base + (off_t) phys_windows[n].bytes ==
+            phys_windows[i].base)
+            phys_windows[n].bytes += phys_windows[i].bytes;
+        else
+            phys_windows[++n] = phys_windows[i];
+    }
+    phys_nwindows = n + 1;
+}
+
+static int phys_windows_offline(size_t pagesize) {
+    char path[512], state[16];
+    unsigned long block;
+    ull block_bytes = 0;
+    struct dirent *d;
+    FILE *f;
+    DIR *dir = opendir(MEMORY_BLOCKS_DIR);
+
+    f = fopen(MEMORY_BLOCKS_DIR "/block_size_bytes", "r");
+    if (f) {
+        if (fscanf(f, "%llx", &block_bytes) != 1)
+            block_bytes = 0;
+        fclose(f);
+    }
+    if (!dir || !block_bytes) {
+        fprintf(stderr, "no memory hotplug blocks in %s\n",
+                MEMORY_BLOCKS_DIR);
+        if (dir)
+            closedir(dir);
+        return -1;
+    }
+    while ((d = readdir(dir))) {
+        if (sscanf(d->d_name, "memory%lu", &block) != 1)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s/state", MEMORY_BLOCKS_DIR,
+                 d->d_name);
+        if (!(f = fopen(path, "r")))
+            continue;
+        if (fgets(state, sizeof(state), f) && !strncmp(state, "offline", 7) &&
+            phys_window_add((off_t) (block * block_bytes),
+                            (size_t) block_bytes, pagesize)) {
+            fclose(f);
+            closedir(dir);
+            return -1;
+        }
+        fclose(f);
+    }
+    closedir(dir);
+    if (!phys_nwindows) {
+        fprintf(stderr, "no offline memory blocks to test\n");
+        return -1;
+    }
+    phys_windows_sort();
+    return 0;
+}
+
+static int phys_windows_reserved(size_t pagesize) {
+    unsigned char cells[4], reg[256];
+    char node[512];
+    int acells = 1, scells = 1, len, i;
+    struct dirent *d;
+    DIR *dir = opendir(RESERVED_MEMORY_DIR);
+    ull base, bytes, head;
+
+    if (!dir) {
+        fprintf(stderr, "no %s to find reserved memory in\n",
+                RESERVED_MEMORY_DIR);
+        return -1;
+    }
+    if (dt_property(RESERVED_MEMORY_DIR, "#address-cells", cells, 4) == 4)
+        acells = (int) dt_cells(cells, 1);
+    if (dt_property(RESERVED_MEMORY_DIR, "#size-cells", cells, 4) == 4)
+        scells = (int) dt_cells(cells, 1);
+    while ((d = readdir(dir))) {
+        if (d->d_name[0] == '.')
+            continue;
+        snprintf(node, sizeof(node), "%s/%s", RESERVED_MEMORY_DIR,
+                 d->d_name);
+        /* reusable ones are CMA pools, which the kernel hands out */
+        if (dt_property(node, "no-map", reg, 0) < 0 ||
+            dt_property(node, "reusable", reg, 0) >= 0)
+            continue;
+        len = dt_property(node, "reg", reg, sizeof(reg));
+        for (i = 0; len > 0 && i + 4 * (acells + scells) <= len;
+             i += 4 * (acells + scells)) {
+            base = dt_cells(reg + i, acells);
+            bytes = dt_cells(reg + i + 4 * acells, scells);
+            head = (pagesize - base % pagesize) % pagesize;
+            if (bytes <= head)
+                continue;
+            base += head;
+            bytes = (bytes - head) & ~(ull) (pagesize - 1);
+            if (!bytes || iomem_system_ram(base, bytes)) {
+                printf("skipping the reserved memory %s\n", d->d_name);
+                continue;
+            }
+            if (phys_window_add((off_t) base, (size_t) bytes, pagesize)) {
+                closedir(dir);
+                return -1;
+            }
+        }
+    }
+    closedir(dir);
+    if (!phys_nwindows) {
+        fprintf(stderr, "no reserved memory to test\n");
+        return -1;
+    }
+    phys_windows_sort();
+    return 0;
+}
+
+/*
+ * Maps the windows from 'memfd' back to back, the last ones cut short or
+ * left out to stay within 'wantbytes'. Returns the start, or MAP_FAILED.
+ */
+static void *phys_windows_map(int memfd, size_t wantbytes,
+                              size_t *bufsize) {
+    size_t total = 0, len, bytes;
+    char *area, *p;
+    int i, n;
+
+    for (n = 0; n < phys_nwindows && total < wantbytes; n++)
+        total += phys_windows[n].bytes ? phys_windows[n].bytes : wantbytes;
+    len = total < wantbytes ? total : wantbytes;
+    /* a range of addresses to put the windows into */
+    area = mmap(NULL, len, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (area == MAP_FAILED)
+        return MAP_FAILED;
+    for (i = 0, total = 0; i < n; i++) {
+        bytes = phys_windows[i].bytes ? phys_windows[i].bytes : wantbytes;
+        if (bytes > wantbytes - total)
+            bytes = wantbytes - total;
+        phys_windows[i].bytes = bytes;
+        phys_windows[i].offset = total;
+        p = mmap(area + total, bytes, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_LOCKED | MAP_FIXED, memfd,
+                 phys_windows[i].base);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "failed to map the window at 0x%llx: %s\n",
+                    (ull) phys_windows[i].base, strerror(errno));
+            munmap(area, len);
+            return MAP_FAILED;
+        }
+        if (phys_nwindows > 1)
+            printf("window 0x%08llx-0x%08llx (%lluMB)\n",
+                   (ull) phys_windows[i].base,
+                   (ull) (phys_windows[i].base + bytes - 1), (ull) bytes >> 20);
+        total += bytes;
+    }
+    phys_nwindows = n;
+    *bufsize = total;
+    return area;
+}
+
+/* The sum of the window sizes, or 0 if one of them takes the memory size */
+static size_t phys_windows_bytes(void) {
+    size_t total = 0;
+    int i;
+
+    for (i = 0; i < phys_nwindows; i++) {
+        if (!phys_windows[i].bytes)
+            return 0;
+        total += phys_windows[i].bytes;
+    }
+    return total;
+}
+
+/* The physical address of a tested location, or -1 if it isn't known */
+off_t memtester_physaddr(ulv *p) {
+    size_t offset = (size_t) p - (size_t) memtester_base;
+    size_t page = offset / (pagemap_pagesize ? pagemap_pagesize : 1);
+    int i;
+
+    if (use_phys) {
+        for (i = phys_nwindows - 1; i > 0; i--)
+            if (offset >= phys_windows[i].offset)
+                break;
+        return phys_windows[i].base +
+               (off_t) (offset - phys_windows[i].offset);
+    }
+    if (!pagemap || page >= pagemap_pages || !pagemap[page])
+        return (off_t) -1;
+    return (off_t) (pagemap[page] * pagemap_pagesize +
+                    offset % pagemap_pagesize);
+}
+
+/*
+ * The other way around, for the tests which pick locations by their DRAM
+ * address: the tested location at a physical address, or NULL if that
+ * isn't in the buffer. The page frames are sorted into a table the first
+ * time this is needed.
+ */
+static struct pagemap_frame {
+    uint64_t pfn;
+    size_t page;
+} *pagemap_frames;
+static pthread_once_t pagemap_frames_once = PTHREAD_ONCE_INIT;
+
+static int pagemap_frame_cmp(const void *a, const void *b) {
+    const struct pagemap_frame *fa = a, *fb = b;
+
+    return fa->pfn < fb->pfn ? -1 : fa->pfn > fb->pfn;
+}
+
+static void pagemap_frames_build(void) {
+    size_t i;
+
+    pagemap_frames = malloc(pagemap_pages * sizeof(*pagemap_frames));
+    if (!pagemap_frames)
+        return;
+    for (i = 0; i < pagemap_pages; i++) {
+        pagemap_frames[i].pfn = pagemap[i];
+        pagemap_frames[i].page = i;
+    }
+    qsort(pagemap_frames, pagemap_pages, sizeof(*pagemap_frames),
+          pagemap_frame_cmp);
+}
+
+ulv *memtester_virt(off_t physaddr) {
+    struct pagemap_frame key, *found;
+
+    if (use_phys) {
+        int i;
+
+        for (i = 0; i < phys_nwindows; i++)
+            if (physaddr >= phys_windows[i].base &&
+                physaddr - phys_windows[i].base <
+                (off_t) phys_windows[i].bytes)
+                return (ulv *) ((size_t) memtester_base +
+                                phys_windows[i].offset +
+                                (size_t) (physaddr - phys_windows[i].base));
+        return NULL;
+    }
+    if (!pagemap || physaddr < 0)
+        return NULL;
+    pthread_once(&pagemap_frames_once, pagemap_frames_build);
+    if (!pagemap_frames)
+        return NULL;
+    key.pfn = (ull) physaddr / pagemap_pagesize;
+    found = bsearch(&key, pagemap_frames, pagemap_pages,
+                    sizeof(*pagemap_frames), pagemap_frame_cmp);
+    if (!found || !found->pfn)
+        return NULL;
+    return (ulv *) ((size_t) memtester_base + found->page * pagemap_pagesize +
+                    (ull) physaddr % pagemap_pagesize);
+}
+
+/*
+ * Every page with a failure is remembered. With MEMTESTER_BADPAGES set to
+ * a file name, the list gets written there after every failed test, as
+ * memmap= and badram= kernel arguments and as device tree reserved-memory
+ * nodes, for the next boot to keep them out of use. Then each new page is
+ * taken out of the tests: with MEMTESTER_SOFT_OFFLINE set, the kernel's
+ * hwpoison soft-offline moves our page to another frame and never hands
+ * out the bad one again; otherwise the bad page gets moved out of the
+ * buffer with mremap(2), and held on to, and a fresh one takes its place.
+ * Neither works on -p windows or hugetlb pages, those keep being tested.
+ */
+#define BADPAGES_MAX 1024
+#define SOFT_OFFLINE_PAGE "/sys/devices/system/memory/soft_offline_page"
+
+static struct bad_page {
+    size_t offset; /* of the page in the tested buffer */
+    off_t physaddr; /* -1 if not known */
+} bad_pages[BADPAGES_MAX];
+static int bad_pages_count, bad_pages_handled;
+/* the part of the buffer where pages can be taken out, 0 for none */
+static size_t bad_pages_limit;
+static pthread_mutex_t bad_pages_lock = PTHREAD_MUTEX_INITIALIZER;
+/* the first failure of the current test, for its --reproduce hint */
+static size_t failure_offset = (size_t) -1;
+
+void memtester_bad_page(ulv *p) {
+    size_t pagesize = pagemap_pagesize ? pagemap_pagesize
+                                       : (size_t) sysconf(_SC_PAGE_SIZE);
+    size_t offset = ((size_t) p - (size_t) memtester_base) & ~(pagesize - 1);
+    off_t physaddr = memtester_physaddr(p);
+    int i;
+
+    if (physaddr != (off_t) -1)
+        physaddr &= ~(off_t) (pagesize - 1);
+    pthread_mutex_lock(&bad_pages_lock);
+    if (failure_offset == (size_t) -1)
+        failure_offset = (size_t) p - (size_t) memtester_base;
+    for (i = 0; i < bad_pages_count; i++) {
+        if (physaddr != (off_t) -1 ? bad_pages[i].physaddr == physaddr
+                                   : bad_pages[i].offset == offset)
+            break;
+    }
+    if (i == bad_pages_count && bad_pages_count < BADPAGES_MAX) {
+        bad_pages[i].offset = offset;
+        bad_pages[i].physaddr = physaddr;
+        bad_pages_count++;
+    }
+    pthread_mutex_unlock(&bad_pages_lock);
+}
+
+static void bad_pages_write(const char *path, size_t pagesize) {
+    unsigned char cells[4];
+    int acells = 1, scells = 1, i, n = 0;
+    FILE *f;
+
+    if (dt_property("/proc/device-tree", "#address-cells", cells, 4) == 4)
+        acells = (int) dt_cells(cells, 1);
+    if (dt_property("/proc/device-tree", "#size-cells", cells, 4) == 4)
+        scells = (int) dt_cells(cells, 1);
+    if (!(f = fopen(path, "w"))) {
+        fprintf(stderr, "failed to write the bad pages to %s: %s\n", path,
+                strerror(errno));
+        return;
+    }
+    for (i = 0; i < bad_pages_count; i++) {
+        if (bad_pages[i].physaddr == (off_t) -1)
+            continue;
+        n++;
+        /* without a device tree to say, if the addresses need it */
+        if ((ull) bad_pages[i].physaddr >> 32 && acells < 2)
+            acells = scells = 2;
+    }
+    fprintf(f, "# %d bad pages, %d of them at a known physical address\n",
+            bad_pages_count, n);
+    for (i = 0; i < bad_pages_count; i++) {
+        if (bad_pages[i].physaddr == (off_t) -1)
+            fprintf(f, "# at offset 0x%08llx, physical address unknown\n",
+                    (ull) bad_pages[i].offset);
+    }
+    if (!n) {
+        fclose(f);
+        return;
+    }
+
+    fprintf(f, "\n# kernel arguments, the $ may need escaping for the "
+            "bootloader\n");
+    for (i = 0; i < bad_pages_count; i++) {
+        if (bad_pages[i].physaddr != (off_t) -1)
+            fprintf(f, "memmap=%lluK$0x%08llx%s", (ull) pagesize >> 10,
+                    (ull) bad_pages[i].physaddr,
+                    --n ? " " : "\n");
+    }
+    fprintf(f, "badram=");
+    for (i = 0; i < bad_pages_count; i++) {
+        if (bad_pages[i].physaddr != (off_t) -1)
+            fprintf(f, "%s0x%08llx,0x%08llx", n++ ? "," : "",
+                    (ull) bad_pages[i].physaddr,
+                    (ull) ~(pagesize - 1) &
+                    (acells > 1 ? ~0ULL : 0xffffffffULL));
+    }
+
+    fprintf(f, "\n\n# device tree\nreserved-memory {\n"
+            "\t#address-cells = <%d>;\n\t#size-cells = <%d>;\n"
+            "\tranges;\n", acells, scells);
+    for (i = 0; i < bad_pages_count; i++) {
+        ull a = (ull) bad_pages[i].physaddr;
+
+        if (bad_pages[i].physaddr == (off_t) -1)
+            continue;
+        fprintf(f, "\n\tbadpage@%llx {\n\t\treg = <", a);
+        if (acells > 1)
+            fprintf(f, "0x%llx ", a >> 32);
+        fprintf(f, "0x%llx ", a & 0xffffffffULL);
+        if (scells > 1)
+            fprintf(f, "0x0 ");
+        fprintf(f, "0x%llx>;\n\t\tno-map;\n\t};\n", (ull) pagesize);
+    }
+    fprintf(f, "};\n");
+    fclose(f);
+}
+
+/* Put the physical address of a page of the buffer into the pagemap */
+static void pagemap_update(size_t page) {
+    uint64_t entry = 0;
+    int fd = open("/proc/self/pagemap", O_RDONLY);
+    size_t i, va = (size_t) memtester_base + page * pagemap_pagesize;
+
+    if (fd >= 0) {
+        if (pread(fd, &entry, sizeof(entry), (off_t) (va / pagemap_pagesize) *
+                  sizeof(entry)) != sizeof(entry))
+            entry = 0;
+        close(fd);
+    }
+    pagemap[page] = entry & PAGEMAP_PRESENT ? entry & PAGEMAP_PFN_MASK : 0;
+    if (!pagemap_frames)
+        return;
+    for (i = 0; i < pagemap_pages; i++) {
+        if (pagemap_frames[i].page == page)
+            pagemap_frames[i].pfn = pagemap[page];
+    }
+    qsort(pagemap_frames, pagemap_pages, sizeof(*pagemap_frames),
+          pagemap_frame_cmp);
+}
+
+static int bad_page_soft_offline(off_t physaddr) {
+    int fd, ok;
+    char addr[32];
+
+    if (physaddr == (off_t) -1 ||
+        (fd = open(SOFT_OFFLINE_PAGE, O_WRONLY)) < 0)
+        return -1;
+    snprintf(addr, sizeof(addr), "0x%llx", (ull) physaddr);
+    ok = write(fd, addr, strlen(addr)) == (ssize_t) strlen(addr);
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+/* Move the page out of the buffer, where it stays mapped, and refill it */
+static int bad_page_replace(size_t offset, size_t pagesize) {
+    char *va = (char *) memtester_base + offset;
+    void *held;
+
+    /* mremap() leaves a page of the same size where it is, unless told */
+    held = mmap(NULL, pagesize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (held == MAP_FAILED)
+        return -1;
+    if (mremap(va, pagesize, pagesize, MREMAP_MAYMOVE | MREMAP_FIXED,
+               held) == MAP_FAILED) {
+        munmap(held, pagesize);
+        return -1;
+    }
+    if (mmap(va, pagesize, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        mremap(held, pagesize, pagesize, MREMAP_MAYMOVE | MREMAP_FIXED, va);
+        return -1;
+    }
+    mlock(va, pagesize);
+    /* the next test may go on from what this one left in the buffer */
+    memcpy(va, held, pagesize);
+    return 0;
+}
+
+/* After a failed test, with all workers waiting for the next one */
+static void bad_pages_update(void) {
+    const char *path = getenv("MEMTESTER_BADPAGES");
+    int soft_offline = getenv("MEMTESTER_SOFT_OFFLINE") != NULL;
+    size_t pagesize = pagemap_pagesize ? pagemap_pagesize
+                                       : (size_t) sysconf(_SC_PAGE_SIZE);
+    struct bad_page *b;
+    int i, moved;
+
+    pthread_mutex_lock(&bad_pages_lock);
+    if (path && bad_pages_handled < bad_pages_count)
+        bad_pages_write(path, pagesize);
+    for (i = bad_pages_handled; bad_pages_limit && i < bad_pages_count;
+         i++) {
+        b = &bad_pages[i];
+        if (b->offset >= bad_pages_limit)
+            continue;
+        moved = soft_offline ? !bad_page_soft_offline(b->physaddr)
+                             : !bad_page_replace(b->offset, pagesize);
+        if (moved && pagemap)
+            pagemap_update(b->offset / pagesize);
+        printf("  bad page at %s 0x%08llx %s\n",
+               b->physaddr != (off_t) -1 ? "physical address" : "offset",
+               b->physaddr != (off_t) -1 ? (ull) b->physaddr
+                                         : (ull) b->offset,
+               moved ? (soft_offline ? "soft offlined"
+                                     : "replaced, no longer tested")
+                     : "could not be taken out, still tested");
+    }
+    bad_pages_handled = bad_pages_count;
+    pthread_mutex_unlock(&bad_pages_lock);
+}
+
+/*
+ * With MEMTESTER_UNCACHED, the tests run on a second mapping of the same
+ * page frames, from /dev/mem opened with O_SYNC, which the kernel maps
+ * uncached. Every load and store then goes out to the DRAM, and failures
+ * that the L2 cache would hide show up. The frames come from the pagemap,
+ * each run of contiguous ones is mapped in one go, and the locked buffer
+ * stays mapped to keep them. Kernels built with STRICT_DEVMEM refuse to
+ * map RAM, the tests then run cached as before.
+ */
+#define UNCACHED_EVICT_BYTES (8 << 20) /* a few times the largest L2 */
+
+/*
+ * The pages from first up to end of the buffer, mapped from /dev/mem at
+ * their offsets into a range as large as the buffer, which stays
+ * inaccessible elsewhere. NULL with errno set, if any of them fails.
+ */
+static char *uncached_map(size_t bufsize, size_t first, size_t end,
+                          size_t pagesize, size_t *maps) {
+    size_t page, run;
+    char *alias, *p;
+    int fd, err;
+
+    fd = open("/dev/mem", O_RDWR | O_SYNC);
+    if (fd < 0)
+        return NULL;
+    /* reserve the address range, then map the frames over it */
+    alias = mmap(NULL, bufsize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+                 -1, 0);
+    if (alias == MAP_FAILED) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    for (page = first, *maps = 0; page < end; page += run, (*maps)++) {
+        if (!pagemap[page]) {
+            errno = EFAULT;
+            break;
+        }
+        for (run = 1; page + run < end &&
+             pagemap[page + run] == pagemap[page] + run; run++)
+            ;
+        p = mmap(alias + page * pagesize, run * pagesize,
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+                 (off_t) (pagemap[page] * pagesize));
+        if (p == MAP_FAILED)
+            break;
+    }
+    err = errno;
+    close(fd);
+    if (page < end) {
+        munmap(alias, bufsize);
+        errno = err;
+        return NULL;
+    }
+    return alias;
+}
+
+static void volatile *uncached_alias(void volatile *aligned, size_t bufsize,
+                                     size_t pagesize) {
+    size_t n = bufsize / pagesize, maps;
+    char *alias, *evict;
+
+    if (!pagemap || pagemap_pages < n) {
+        fprintf(stderr, "MEMTESTER_UNCACHED needs the physical addresses "
+                "from /proc/self/pagemap, testing cached\n");
+        return aligned;
+    }
+    alias = uncached_map(bufsize, 0, n, pagesize, &maps);
+    if (!alias) {
+        fprintf(stderr, "failed to map the buffer uncached from /dev/mem: "
+                "%s, testing cached\n", strerror(errno));
+        return aligned;
+    }
+    /* Push the dirty lines of the cached mappings out first, so that their
+       write backs can't land on top of what the tests write uncached. */
+    if ((evict = malloc(UNCACHED_EVICT_BYTES))) {
+        memset(evict, 0x5a, UNCACHED_EVICT_BYTES);
+        free(evict);
+    }
+    printf("testing through an uncached mapping, in %llu pieces\n",
+           (ull) maps);
+    memtester_uncached = 1;
+    return (void volatile *) alias;
+}
+
+/*
+ * MEMTESTER_DRAM_MAP describes how the physical addresses map to DRAM
+ * locations, as a comma separated list of fields: an optional base
+ * address of the DRAM, and the bit ranges of the other fields, e.g.
+ * "base=0x40000000,col=1-10,bank=11-13,row=14-28". Failures are then
+ * reported with the value of every field.
+ */
+#define DRAM_MAP_FIELDS 8
+
+static struct dram_field {
+    char name[16];
+    unsigned int lo, hi;
+} dram_fields[DRAM_MAP_FIELDS];
+static int dram_nfields;
+static ull dram_base;
+
+static int dram_map_parse(const char *map) {
+    const char *s = map;
+    char name[16];
+    unsigned int lo, hi;
+    int n;
+
+    while (*s) {
+        hi = UINT_MAX;
+        if (sscanf(s, "base=%lli%n", (long long *) &dram_base, &n) == 1) {
+            s += n;
+        } else if (sscanf(s, "%15[a-z_]=%u-%u%n", name, &lo, &hi, &n) == 3 ||
+                   sscanf(s, "%15[a-z_]=%u%n", name, &lo, &n) == 2) {
+            /* a single bit */
+            if (hi == UINT_MAX)
+                hi = lo;
+            if (dram_nfields == DRAM_MAP_FIELDS || lo > hi || hi > 63)
+                goto bad;
+            strcpy(dram_fields[dram_nfields].name, name);
+            dram_fields[dram_nfields].lo = lo;
+            dram_fields[dram_nfields].hi = hi;
+            dram_nfields++;
+            s += n;
+        } else {
+            goto bad;
+        }
+        if (*s == ',')
+            s++;
+        else if (*s)
+            goto bad;
+    }
+    return 0;
+
+bad:
+    fprintf(stderr, "error parsing MEMTESTER_DRAM_MAP at '%s'\n", s);
+    return -1;
+}
+
+/* The DRAM location of a physical address, as ", bank 1, row 2, ..." */
+void memtester_dram_location(off_t physaddr, char *buf, size_t len) {
+    ull addr = (ull) physaddr - dram_base;
+    ull v;
+    size_t used = 0;
+    int i;
+
+    buf[0] = '\0';
+    for (i = 0; i < dram_nfields && used < len; i++) {
+        v = addr >> dram_fields[i].lo;
+        if (dram_fields[i].hi - dram_fields[i].lo < 63)
+            v &= (1ULL << (dram_fields[i].hi - dram_fields[i].lo + 1)) - 1;
+        used += snprintf(buf + used, len - used, ", %s %llu",
+                         dram_fields[i].name, v);
+    }
+}
+
+/* The distance between neighbours in a field of the map, 0 without it */
+ull memtester_dram_step(const char *field) {
+    int i;
+
+    for (i = 0; i < dram_nfields; i++) {
+        if (!strcmp(dram_fields[i].name, field))
+            return 1ULL << dram_fields[i].lo;
+    }
+    return 0;
+}
+
+/*
+ * Multi-threaded mode. The tested region is split into one slice per
+ * worker thread, and each slice gets its own pair of bufa/bufb halves.
+ * The workers are pinned to CPU cores and run every test pass in
+ * lock-step: the main thread releases them through 'pass_start' and
+ * waits for all of them at 'pass_done' before reporting the result.
+ */
+#define PASS_STUCK_ADDRESS  (-1)
+#define PASS_STOP           (-2)
+
+/*
+ * With MEMTESTER_PMU set, every worker counts the events of lima-memspeed
+ * --pmu (memspeed_pmu.c) in its own thread, and the counts of every pass
+ * go into a second timing table of the same layout. An event that the
+ * kernel or the cpu doesn't have stays empty.
+ */
+static int memtester_pmu;
+
+struct worker {
+    pthread_t thread;
+    int id;
+    int stream; /* of the random values, the id but for --reproduce */
+    int cpu;
+    ulv *base;
+    size_t bytes;
+    /* for --reproduce, a window of the halves of a larger worker: how far
+       apart its halves are, and the words of them around the window */
+    size_t half;
+    size_t before, after;
+    /* Stuck Address or a single region test was the last to run */
+    int halves_differ;
+    int result;
+    ull traffic;
+    int pmu_fd[PMU_EVENTS];
+    uint64_t pmu[PMU_EVENTS];
+};
+
+static struct worker *workers;
+static int nworkers = 1;
+static int pass_current;
+static ul pass_seed;
+static pthread_barrier_t pass_start, pass_done;
+
+/*
+ * The placement of a class of threads, parsed from "cpus[:policy[:prio]]":
+ * a cpu list like "0-2,5" (empty for any cpu), then "other", "fifo" or
+ * "rr", and the real-time priority, which defaults to the lowest one.
+ * MEMTESTER_SCHED takes it for the workers, and lima-memtester for its
+ * own threads through memtester_thread_attr().
+ */
+struct thread_sched {
+    cpu_set_t cpus;
+    int ncpus;
+    int policy;
+    int priority;
+};
+
+static struct thread_sched *worker_sched;
+
+static int thread_sched_parse(const char *spec, struct thread_sched *s) {
+    const char *p = spec;
+    char *end;
+    unsigned long lo, hi;
+
+    memset(s, 0, sizeof(*s));
+    CPU_ZERO(&s->cpus);
+    s->policy = SCHED_OTHER;
+    while (*p && *p != ':') {
+        lo = hi = strtoul(p, &end, 10);
+        if (end == p)
+            return -1;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtoul(p, &end, 10);
+            if (end == p || hi < lo)
+                return -1;
+        }
+        if (hi >= CPU_SETSIZE)
+            return -1;
+        for (; lo <= hi; lo++)
+            CPU_SET(lo, &s->cpus);
+        p = end;
+        if (*p == ',')
+            p++;
+        else if (*p && *p != ':')
+            return -1;
+    }
+    s->ncpus = CPU_COUNT(&s->cpus);
+    if (!*p++)
+        return 0;
+
+    if (!strncmp(p, "fifo", 4)) {
+        s->policy = SCHED_FIFO;
+        p += 4;
+    } else if (!strncmp(p, "rr", 2)) {
+        s->policy = SCHED_RR;
+        p += 2;
+    } else if (!strncmp(p, "other", 5)) {
+        p += 5;
+    } else {
+        return -1;
+    }
+    s->priority = sched_get_priority_min(s->policy);
+    if (*p == ':') {
+        s->priority = (int) strtoul(p + 1, &end, 10);
+        if (end == p + 1 || s->priority < sched_get_priority_min(s->policy) ||
+            s->priority > sched_get_priority_max(s->policy))
+            return -1;
+        p = end;
+    }
+    return *p ? -1 : 0;
+}
+
+static void thread_sched_self(const struct thread_sched *s) {
+    struct sched_param param;
+
+    if (s->ncpus &&
+        pthread_setaffinity_np(pthread_self(), sizeof(s->cpus), &s->cpus))
+        fprintf(stderr, "failed to set the MEMTESTER_SCHED cpus\n");
+    param.sched_priority = s->priority;
+    if (pthread_setschedparam(pthread_self(), s->policy, &param))
+        fprintf(stderr, "failed to set the MEMTESTER_SCHED policy\n");
+}
+
+/* The n-th cpu of the list, cycling through it */
+static int thread_sched_cpu(const struct thread_sched *s, int n) {
+    int cpu;
+
+    n %= s->ncpus;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &s->cpus) && n-- == 0)
+            break;
+    return cpu;
+}
+
+static void thread_sched_attr(const struct thread_sched *s,
+                              pthread_attr_t *attr) {
+    struct sched_param param;
+
+    pthread_attr_init(attr);
+    if (s->ncpus)
+        pthread_attr_setaffinity_np(attr, sizeof(s->cpus), &s->cpus);
+    param.sched_priority = s->priority;
+    pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(attr, s->policy);
+    pthread_attr_setschedparam(attr, &param);
+}
+
+/*
+ * The attributes for a thread placed as 'spec' says, returns -1 if it
+ * doesn't parse. The threads which it creates inherit the placement.
+ */
+int memtester_thread_attr(const char *spec, pthread_attr_t *attr) {
+    struct thread_sched s;
+
+    if (thread_sched_parse(spec, &s))
+        return -1;
+    thread_sched_attr(&s, attr);
+    return 0;
+}
+
+/* Start counting the events in the calling thread, for worker 'w' */
+static void worker_pmu_open(struct worker *w) {
+    int i;
+
+    for (i = 0; i < PMU_EVENTS; i++)
+        w->pmu_fd[i] = -1;
+    if (!memtester_pmu)
+        return;
+    pmu_open(w->pmu_fd);
+    for (i = 0; w->id == 0 && i < PMU_EVENTS; i++)
+        if (w->pmu_fd[i] < 0)
+            fprintf(stderr, "no %s pmu counter\n", pmu_name(i));
+}
+
+static int worker_run_pass(struct worker *w, int pass) {
+    size_t halflen = w->bytes / 2;
+    ulv *bufa = w->base;
+    ulv *bufb = (ulv *) ((size_t) w->base + (w->half ? w->half : halflen));
+    ull start = memtester_traffic;
+    const char *name = pass == PASS_STUCK_ADDRESS ? "Stuck Address"
+                                                  : tests[pass].name;
+    uint64_t pmu_start[PMU_EVENTS];
+    int i, result;
+
+    if (memtester_trace)
+        memtester_trace(name, 1);
+    rand_seed(pass_seed, w->stream);
+    memtester_window_before = w->before;
+    memtester_window_after = w->after;
+    if (memtester_pmu)
+        pmu_read(w->pmu_fd, pmu_start);
+    if (pass == PASS_STUCK_ADDRESS) {
+        result = test_stuck_address(w->base, w->bytes / sizeof(ul));
+        w->halves_differ = 1;
+    } else if (memtester_single && tests[pass].single) {
+        result = tests[pass].fp(w->base, NULL, w->bytes / sizeof(ul));
+        w->halves_differ = 1;
+    } else {
+        /* the Compare tests expect the two halves to hold the same */
+        if (w->halves_differ) {
+            memcpy((void *) bufb, (void *) bufa, halflen);
+            memtester_traffic += 2 * halflen;
+            w->halves_differ = 0;
+        }
+        result = tests[pass].fp(bufa, bufb, halflen / sizeof(ul));
+    }
+    w->traffic = memtester_traffic - start;
+    if (memtester_pmu) {
+        pmu_read(w->pmu_fd, w->pmu);
+        for (i = 0; i < PMU_EVENTS; i++)
+            w->pmu[i] -= pmu_start[i];
+    }
+    if (memtester_trace)
+        memtester_trace(name, 0);
+    return result;
+}
+
+static void *worker_thread(void *arg) {
+    struct worker *w = arg;
+    cpu_set_t cpuset;
+
+    memtester_quiet = (w->id != 0);
+    rand_seed(memtester_seed, w->id);
+    worker_pmu_open(w);
+    CPU_ZERO(&cpuset);
+    CPU_SET(w->cpu, &cpuset);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset))
+        fprintf(stderr, "failed to pin worker %d to cpu %d\n", w->id, w->cpu);
+
+    while (1) {
+        pthread_barrier_wait(&pass_start);
+        if (pass_current == PASS_STOP)
+            break;
+        w->result = worker_run_pass(w, pass_current);
+        pthread_barrier_wait(&pass_done);
+    }
+    return NULL;
+}
+
+/* Start a worker placed as MEMTESTER_SCHED says, if the kernel lets us */
+static int worker_create(struct worker *w) {
+    pthread_attr_t attr;
+    int ret;
+
+    if (worker_sched) {
+        thread_sched_attr(worker_sched, &attr);
+        ret = pthread_create(&w->thread, &attr, worker_thread, w);
+        pthread_attr_destroy(&attr);
+        if (ret == 0)
+            return 0;
+        fprintf(stderr, "failed to apply MEMTESTER_SCHED to worker %d: %s\n",
+                w->id, strerror(ret));
+    }
+    return pthread_create(&w->thread, NULL, worker_thread, w);
+}
+
+static int run_pass(int pass) {
+    int i, result = 0;
+
+    if (nworkers == 1)
+        return worker_run_pass(&workers[0], pass);
+
+    pass_current = pass;
+    pthread_barrier_wait(&pass_start);
+    pthread_barrier_wait(&pass_done);
+    for (i = 0; i < nworkers; i++)
+        result |= workers[i].result;
+    return result;
+}
+
+/*
+ * Every pass is timed, and the bytes read and written by all workers are
+ * added up, for the summary table printed after each loop. The stuck
+ * address test has the first slot, followed by one slot per test.
+ */
+struct pass_timing {
+    ul runs;
+    ul failures;
+    double seconds;
+    ull traffic;
+    uint64_t pmu[PMU_EVENTS];
+};
+
+static struct pass_timing *timings;
+/* the same since the start, which memtester_metrics() reports */
+static struct pass_timing *totals;
+static int ntests;
+/* what runs now, for the metrics, -1 before the first test */
+static volatile ul current_loop;
+static volatile int current_slot = -1;
+
+#define SLOT_STUCK_ADDRESS 0
+
+static int slot_pass(int slot) {
+    return slot == SLOT_STUCK_ADDRESS ? PASS_STUCK_ADDRESS : slot - 1;
+}
+
+static const char *slot_name(int slot) {
+    return slot == SLOT_STUCK_ADDRESS ? "Stuck Address" : tests[slot - 1].name;
+}
+
+/*
+ * Every test draws its random values from a seed of its own, made from
+ * the seed of the run, the loop and the test, and each worker from its
+ * own stream of that. Any one test can then run again with the same
+ * values, without the tests before it.
+ */
+static ul test_seed(ul loop, int slot) {
+    return memtester_seed ^ (loop << 8) ^ (ul) slot;
+}
+
+static double time_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * With --json, memtester writes one JSON object per line to stdout for
+ * the start, every test, every failure, every loop and the end of a run,
+ * and all the text output goes to stderr instead. The records carry the
+ * wall clock time, so they can be lined up with other logs.
+ */
+double memtester_json_time(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void json_test(int slot, ul loop, int result, double seconds,
+                      ull traffic) {
+    if (!memtester_json)
+        return;
+    fprintf(memtester_json, "{\"type\": \"test\", \"time\": %.3f, "
+            "\"loop\": %lu, \"test\": \"%s\", \"result\": \"%s\", "
+            "\"seed\": \"0x%lx\", \"seconds\": %.3f, \"mb_per_s\": %.1f}\n",
+            memtester_json_time(), loop, slot_name(slot),
+            result ? "failed" : "ok", test_seed(loop, slot), seconds,
+            seconds > 0 ? traffic / seconds / (1 << 20) : 0);
+    fflush(memtester_json);
+}
+
+static void json_loop(ul loop) {
+    double seconds = 0;
+    ul failures = 0;
+    int slot;
+
+    if (!memtester_json) {
+        if (memtester_loop_telemetry)
+            memtester_loop_telemetry(NULL);
+        return;
+    }
+    for (slot = 0; slot <= ntests; slot++) {
+        seconds += timings[slot].seconds;
+        failures += timings[slot].failures;
+    }
+    fprintf(memtester_json, "{\"type\": \"loop\", \"time\": %.3f, "
+            "\"loop\": %lu, \"seconds\": %.3f, \"failures\": %lu",
+            memtester_json_time(), loop, seconds, failures);
+    if (memtester_loop_telemetry)
+        memtester_loop_telemetry(memtester_json);
+    fprintf(memtester_json, "}\n");
+    fflush(memtester_json);
+}
+
+/*
+ * With --checkpoint FILE, the progress of the run is written to FILE
+ * after every test: where the run is, the seed, the exit code so far and
+ * the runs and failures of every test since the start. --resume picks a
+ * run up from there, after a reboot say, and continues with the next
+ * test. The file is rewritten through a temporary file and rename(2), so
+ * a power cut leaves either the old or the new one, and it is removed
+ * once the run is done. The tests of a resumed run draw the same random
+ * values as they would have in an unbroken one, from test_seed().
+ */
+#define CHECKPOINT_MAGIC "memtester-checkpoint 1"
+
+static char *checkpoint_path;
+static struct checkpoint {
+    ul loop;        /* the loop to continue in */
+    int slot;       /* the next test of that loop */
+    int exit_code;
+    double seconds; /* spent testing so far */
+    ul *runs;
+    ul *failures;
+} checkpoint;
+static double checkpoint_started;
+
+static void checkpoint_save(ul loop, int slot, int exit_code) {
+    char tmp[PATH_MAX];
+    FILE *f;
+    int i;
+
+    if (!checkpoint_path)
+        return;
+    if (slot > ntests) {
+        loop++;
+        slot = 0;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", checkpoint_path);
+    f = fopen(tmp, "w");
+    if (!f) {
+        fprintf(stderr, "failed to write %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+    fprintf(f, CHECKPOINT_MAGIC "\nseed 0x%lx\ntests %d\nloop %lu\n"
+            "slot %d\nexit_code %d\nseconds %.1f\n", memtester_seed,
+            ntests, loop, slot, exit_code,
+            checkpoint.seconds + time_now() - checkpoint_started);
+    for (i = 0; i <= ntests; i++) {
+        fprintf(f, "test %lu %lu %s\n", checkpoint.runs[i],
+                checkpoint.failures[i], slot_name(i));
+    }
+    fflush(f);
+    fsync(fileno(f));
+    fclose(f);
+    if (rename(tmp, checkpoint_path))
+        fprintf(stderr, "failed to rename %s: %s\n", tmp, strerror(errno));
+}
+
+/* Returns 1 if there was a checkpoint to resume from, -1 on errors */
+static int checkpoint_load(const char *path) {
+    char line[256], name[128];
+    FILE *f = fopen(path, "r");
+    ul runs, failures;
+    int n, i = 0;
+
+    if (!f)
+        return errno == ENOENT ? 0 : -1;
+    if (!fgets(line, sizeof(line), f) ||
+        strncmp(line, CHECKPOINT_MAGIC, strlen(CHECKPOINT_MAGIC)) ||
+        fscanf(f, "seed 0x%lx\ntests %d\nloop %lu\nslot %d\n"
+               "exit_code %d\nseconds %lf\n", &memtester_seed, &n,
+               &checkpoint.loop, &checkpoint.slot, &checkpoint.exit_code,
+               &checkpoint.seconds) != 6 || n != ntests) {
+        fprintf(stderr, "%s is not a checkpoint of this memtester\n", path);
+        fclose(f);
+        return -1;
+    }
+    while (i <= ntests &&
+           fscanf(f, "test %lu %lu %127[^\n]\n", &runs, &failures,
+                  name) == 3) {
+        if (strcmp(name, slot_name(i)))
+            break;
+        checkpoint.runs[i] = runs;
+        checkpoint.failures[i] = failures;
+        i++;
+    }
+    fclose(f);
+    if (i != ntests + 1) {
+        fprintf(stderr, "the tests in %s do not match\n", path);
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * --reproduce=seed:loop:test:offset[:thread[:threads]] runs the one test
+ * of a failure again, with the random values it had in that loop and
+ * thread, on a small region around the offset of the failure. The hint
+ * printed after every failed test has them all.
+ */
+#define REPRODUCE_BYTES (1 << 20)
+
+/* The start of 'bytes' of the buffer, with 'offset' in one of its halves */
+static size_t region_around(size_t offset, size_t bufsize, size_t bytes) {
+    size_t start;
+
+    if (bufsize <= bytes)
+        return 0;
+    start = offset & ~(bytes / 2 - 1);
+    return start + bytes > bufsize ? bufsize - bytes : start;
+}
+
+static struct reproduce {
+    ul seed;
+    ul loop;
+    int slot;
+    size_t offset;
+    int stream;
+    int threads;
+} reproduce;
+static int reproducing;
+
+static void reproduce_hint(int slot, ul loop) {
+    size_t offset = failure_offset;
+    const char *s = slot_name(slot);
+    char name[64];
+    int i;
+
+    if (reproducing || offset == (size_t) -1)
+        return;
+    for (i = 0; s[i] && i < (int) sizeof(name) - 1; i++)
+        name[i] = s[i] == ' ' ? '-' : tolower((unsigned char) s[i]);
+    name[i] = '\0';
+    for (i = nworkers - 1; i > 0; i--)
+        if ((size_t) workers[i].base <= (size_t) memtester_base + offset)
+            break;
+    fprintf(stderr, "  to repeat it: --reproduce=0x%lx:%lu:%s:0x%llx:%d:%d"
+            "\n", memtester_seed, loop, name, (ull) offset,
+            workers[i].stream, nworkers);
+    fflush(stderr);
+}
+
+/*
+ * With MEMTESTER_ZOOM set to a number of seconds, a test which finds a
+ * new bad page is followed by all of the tests on the ZOOM_BYTES around
+ * its first failure, over and over for that long, and through an
+ * uncached mapping of the region in every other round, if /dev/mem maps
+ * it. The region is small enough for the checks to evict the caches
+ * first. What comes back tells a weak cell, which keeps failing in its
+ * page, from a bad line, which spreads to other pages, and from noise,
+ * which doesn't show up again. The scheduled tests go on afterwards.
+ */
+#define ZOOM_BYTES (1 << 20)
+
+static double zoom_seconds;
+static size_t zoom_bufsize, zoom_pagesize;
+
+static void zoom_in(size_t offset) {
+    size_t bytes = zoom_bufsize < ZOOM_BYTES ? zoom_bufsize : ZOOM_BYTES;
+    size_t start = region_around(offset, zoom_bufsize, bytes), maps;
+    ulv *cached = memtester_base;
+    char *alias = NULL, *saved;
+    double deadline = time_now() + zoom_seconds, seconds;
+    struct worker z = workers[0];
+    int pages = bad_pages_count, slot, uncached, i;
+    ul round, runs = 0, failed = 0;
+
+    if (pagemap && !use_phys && !memtester_uncached &&
+        pagemap_pages >= zoom_bufsize / zoom_pagesize)
+        alias = uncached_map(zoom_bufsize, start / zoom_pagesize,
+                             (start + bytes) / zoom_pagesize, zoom_pagesize,
+                             &maps);
+    /* the next test of the schedule may go on from what is there */
+    saved = malloc(bytes);
+    if (!saved) {
+        fprintf(stderr, "failed to allocate the zoom copy, not zooming in\n");
+        return;
+    }
+    memcpy(saved, (void *) ((size_t) cached + start), bytes);
+    printf("\n  zooming in on offsets 0x%llx-0x%llx for %.0f seconds%s\n",
+           (ull) start, (ull) (start + bytes - 1), zoom_seconds,
+           alias ? ", cached and uncached" : "");
+    fflush(stdout);
+
+    z.bytes = bytes;
+    z.stream = 0;
+    /* its halves are not the ones of the worker */
+    z.halves_differ = 1;
+    for (i = 0; i < PMU_EVENTS; i++)
+        z.pmu_fd[i] = -1;
+    memtester_quiet = 1;
+    for (round = 1; time_now() < deadline; round++) {
+        uncached = alias && !(round & 1);
+        if (uncached) {
+            /* the alias has the same offsets as the buffer */
+            memtester_base = (ulv *) alias;
+            memtester_uncached = 1;
+        }
+        z.base = (ulv *) ((size_t) memtester_base + start);
+        for (slot = 0; slot <= ntests && time_now() < deadline; slot++) {
+            pass_seed = test_seed(round, slot);
+            runs++;
+            if (worker_run_pass(&z, slot_pass(slot)))
+                failed++;
+        }
+        memtester_base = cached;
+        memtester_uncached = 0;
+    }
+    memtester_quiet = 0;
+    if (alias)
+        munmap(alias, zoom_bufsize);
+    memcpy((void *) ((size_t) cached + start), saved, bytes);
+    free(saved);
+
+    seconds = zoom_seconds + time_now() - deadline;
+    printf("  zoom: %lu of %lu test runs failed in %.0f seconds, ", failed,
+           runs, seconds);
+    if (!failed)
+        printf("not seen again, noise or a rare fault\n");
+    else if (bad_pages_count == pages)
+        printf("all in the pages found before, a weak cell\n");
+    else
+        printf("in %d more pages, a bad address or data line\n",
+               bad_pages_count - pages);
+    fflush(stdout);
+}
+
+/* Run one test and print its result, returns the exit code bits */
+static int run_test(int slot, ul loop) {
+    struct pass_timing *t = &timings[slot];
+    double start = time_now(), seconds;
+    ull traffic = 0;
+    int i, j, result;
+
+    printf("  %-20s: ", slot_name(slot));
+    fflush(stdout);
+    progress_test(loop, slot_name(slot));
+    current_loop = loop;
+    current_slot = slot;
+    pass_seed = test_seed(loop, slot);
+    failure_offset = (size_t) -1;
+    result = run_pass(slot_pass(slot));
+    seconds = time_now() - start;
+    for (i = 0; i < nworkers; i++) {
+        traffic += workers[i].traffic;
+        for (j = 0; memtester_pmu && j < PMU_EVENTS; j++)
+            t->pmu[j] += workers[i].pmu[j];
+    }
+    t->runs++;
+    t->seconds += seconds;
+    t->traffic += traffic;
+    totals[slot].runs++;
+    totals[slot].seconds += seconds;
+    totals[slot].traffic += traffic;
+    if (result)
+        totals[slot].failures++;
+    if (checkpoint.runs)
+        checkpoint.runs[slot]++;
+    json_test(slot, loop, result, seconds, traffic);
+    if (result) {
+        reproduce_hint(slot, loop);
+        if (zoom_seconds > 0 && !reproducing &&
+            failure_offset != (size_t) -1 &&
+            bad_pages_handled < bad_pages_count)
+            zoom_in(failure_offset);
+        bad_pages_update();
+        memtester_journal_sync(1);
+        t->failures++;
+        if (checkpoint.failures)
+            checkpoint.failures[slot]++;
+        return slot == SLOT_STUCK_ADDRESS ? EXIT_FAIL_ADDRESSLINES
+                                          : EXIT_FAIL_OTHERTEST;
+    }
+    printf("ok\n");
+    fflush(stdout);
+    return 0;
+}
+
+/*
+ * The state of the run in the Prometheus text format, for the metrics
+ * listener of lima-memtester. It only reads what the tests keep anyway,
+ * a scrape in the middle of a test may see its counts half updated.
+ */
+void memtester_metrics(FILE *f, void *data) {
+    static const struct {
+        const char *name, *type, *help;
+    } series[] = {
+        { "memtester_test_runs_total", "counter", "Runs of every test" },
+        { "memtester_test_failures_total", "counter",
+          "Runs of every test that failed" },
+        { "memtester_test_seconds_total", "counter",
+          "Seconds spent in every test" },
+        { "memtester_test_bytes_total", "counter",
+          "Bytes read and written by every test" },
+    };
+    struct pass_timing *t;
+    int slot = current_slot, i, s;
+
+    if (!totals)
+        return;
+    fprintf(f, "# HELP memtester_loop The loop which runs now\n"
+            "# TYPE memtester_loop gauge\nmemtester_loop %lu\n",
+            (ul) current_loop);
+    fprintf(f, "# HELP memtester_test The test which runs now\n"
+            "# TYPE memtester_test gauge\n");
+    for (i = 0; i <= ntests; i++)
+        fprintf(f, "memtester_test{test=\"%s\"} %d\n", slot_name(i),
+                i == slot);
+    for (s = 0; s < (int) (sizeof(series) / sizeof(series[0])); s++) {
+        fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", series[s].name,
+                series[s].help, series[s].name, series[s].type);
+        for (i = 0; i <= ntests; i++) {
+            t = &totals[i];
+            fprintf(f, "%s{test=\"%s\"} ", series[s].name, slot_name(i));
+            if (s == 0)
+                fprintf(f, "%lu\n", t->runs);
+            else if (s == 1)
+                fprintf(f, "%lu\n", t->failures);
+            else if (s == 2)
+                fprintf(f, "%.3f\n", t->seconds);
+            else
+                fprintf(f, "%llu\n", t->traffic);
+        }
+    }
+    fprintf(f, "# HELP memtester_bad_pages Pages with failures\n"
+            "# TYPE memtester_bad_pages gauge\nmemtester_bad_pages %d\n",
+            bad_pages_count);
+    error_histogram_metrics(f);
+}
+
+/*
+ * The loop and the test which run now, NULL before the first one, and the
+ * bytes and failures of all the tests which are done, for the status
+ * segment of lima-memtester. Read the same way as memtester_metrics().
+ */
+void memtester_progress(ul *loop, const char **test, ull *bytes,
+                        ul *failures) {
+    int slot = current_slot, i;
+
+    *loop = current_loop;
+    *test = slot >= 0 ? slot_name(slot) : NULL;
+    *bytes = 0;
+    *failures = 0;
+    for (i = 0; totals && i <= ntests; i++) {
+        *bytes += totals[i].traffic;
+        *failures += totals[i].failures;
+    }
+}
+
+/*
+ * The pmu counts of every test, in millions, but for the instructions
+ * per cycle and the share of the cycles stalled in the backend. A '-'
+ * is an event that isn't counted.
+ */
+static void report_pmu(void) {
+    struct pass_timing *t;
+    int slot;
+
+    printf("  ");
+    pmu_print_header();
+    for (slot = 0; slot <= ntests; slot++) {
+        t = &timings[slot];
+        if (!t->runs)
+            continue;
+        printf("  ");
+        pmu_print(slot_name(slot), workers[0].pmu_fd, t->pmu);
+    }
+}
+
+static void report_timings(void) {
+    struct pass_timing *t;
+    double seconds = 0, mbs;
+    int slot;
+
+    printf("  %-20s  %6s  %10s  %10s\n", "Timing", "runs", "seconds", "MB/s");
+    for (slot = 0; slot <= ntests; slot++) {
+        t = &timings[slot];
+        if (!t->runs)
+            continue;
+        seconds += t->seconds;
+        mbs = t->seconds > 0 ? t->traffic / t->seconds / (1 << 20) : 0;
+        printf("  %-20s  %6lu  %10.2f  %10.1f\n", slot_name(slot), t->runs,
+               t->seconds, mbs);
+    }
+    printf("  %-20s  %6s  %10.2f\n", "Total", "", seconds);
+    if (memtester_pmu)
+        report_pmu();
+}
+
+/*
+ * The detection history of a board family is kept in the file named by
+ * MEMTESTER_HISTORY, one line per test: its name, a tab, the number of
+ * failing runs and the seconds it has run. A missing file is an empty
+ * history, and the file is rewritten with the totals of this run added.
+ */
+static void history_load(const char *path, ul *failures, double *seconds) {
+    char line[256], *tab;
+    FILE *f = fopen(path, "r");
+    ul n;
+    double s;
+    int slot;
+
+    if (!f)
+        return;
+    while (fgets(line, sizeof(line), f)) {
+        tab = strchr(line, '\t');
+        if (!tab)
+            continue;
+        *tab = '\0';
+        if (sscanf(tab + 1, "%lu %lf", &n, &s) != 2)
+            continue;
+        for (slot = 0; slot <= ntests; slot++) {
+            if (!strcmp(line, slot_name(slot))) {
+                failures[slot] = n;
+                seconds[slot] = s;
+            }
+        }
+    }
+    fclose(f);
+}
+
+static void history_save(const char *path, ul *failures, double *seconds) {
+    FILE *f = fopen(path, "w");
+    int slot;
+
+    if (!f) {
+        fprintf(stderr, "failed to write %s: %s\n", path, strerror(errno));
+        return;
+    }
+    for (slot = 0; slot <= ntests; slot++) {
+        if (!timings[slot].runs && !seconds[slot])
+            continue;
+        fprintf(f, "%s\t%lu %.1f\n", slot_name(slot),
+                failures[slot] + timings[slot].failures,
+                seconds[slot] + timings[slot].seconds);
+    }
+    fclose(f);
+}
+
+/*
+ * With a duration, one calibration loop measures how long every test
+ * takes, then the tests are scheduled until the time is up. Each test
+ * gets a share of the time in proportion to its detection rate, the
+ * failures per second in the history. The rate starts out as one failure
+ * in HISTORY_PRIOR_SECONDS, so without a history all tests get the same
+ * share. The test which is furthest behind its share runs next, but only
+ * if its last running time still fits into the time left, so the run
+ * ends on time. The stuck address test only runs in the calibration loop,
+ * as it leaves different data in the two halves, so the Compare tests
+ * which might follow it have to copy one half into the other first.
+ */
+#define HISTORY_PRIOR_SECONDS 60.0
+
+static int run_for_duration(double duration, const char *selected) {
+    double deadline = time_now() + duration;
+    double *estimate, *weight, *hist_seconds, last, left, behind, best_behind;
+    ul *hist_failures;
+    char *history = getenv("MEMTESTER_HISTORY");
+    int slot, best, exit_code = 0;
+
+    estimate = calloc(ntests + 1, sizeof(double));
+    weight = calloc(ntests + 1, sizeof(double));
+    hist_seconds = calloc(ntests + 1, sizeof(double));
+    hist_failures = calloc(ntests + 1, sizeof(ul));
+    if (!estimate || !weight || !hist_seconds || !hist_failures) {
+        fprintf(stderr, "failed to allocate the schedule\n");
+        exit(EXIT_FAIL_NONSTARTER);
+    }
+    if (history)
+        history_load(history, hist_failures, hist_seconds);
+
+    printf("Calibration loop:\n");
+    fflush(stdout);
+    for (slot = 0; slot <= ntests; slot++) {
+        if (!selected[slot])
+            continue;
+        last = timings[slot].seconds;
+        exit_code |= run_test(slot, 1);
+        checkpoint_save(1, 0, exit_code);
+        estimate[slot] = timings[slot].seconds - last;
+        weight[slot] = (hist_failures[slot] + 1) /
+                       (hist_seconds[slot] + HISTORY_PRIOR_SECONDS);
+    }
+
+    left = deadline - time_now();
+    printf("\nScheduled tests, %.0f seconds left:\n", left > 0 ? left : 0);
+    fflush(stdout);
+    while (1) {
+        left = deadline - time_now();
+        best = -1;
+        best_behind = 0;
+        for (slot = 0; slot <= ntests; slot++) {
+            if (!selected[slot] || slot == SLOT_STUCK_ADDRESS ||
+                estimate[slot] > left)
+                continue;
+            behind = timings[slot].seconds / weight[slot];
+            if (best < 0 || behind < best_behind) {
+                best = slot;
+                best_behind = behind;
+            }
+        }
+        if (best < 0)
+            break;
+        last = timings[best].seconds;
+        exit_code |= run_test(best, timings[best].runs + 1);
+        checkpoint_save(1, 0, exit_code);
+        estimate[best] = timings[best].seconds - last;
+    }
+
+    printf("\n");
+    report_timings();
+    error_histogram_report();
+    json_loop(1);
+    if (history)
+        history_save(history, hist_failures, hist_seconds);
+    free(estimate);
+    free(weight);
+    free(hist_seconds);
+    free(hist_failures);
+    return exit_code;
+}
+
+/*
+ * --scrub[=MB/s]: a background scrubber, for machines which stay in
+ * service. It runs at SCHED_IDLE, unless MEMTESTER_SCHED places it, and
+ * only with the fast single pass tests. These go over one chunk of the
+ * buffer at a time, with sleeps in between which keep the traffic under
+ * the given rate on average. Failures go to syslog as well, and so does a
+ * summary of every cycle over the whole buffer.
+ */
+#define SCRUB_CHUNK (16 << 20)
+#define SCRUB_TESTS "Random Value,Compare XOR,Compare SUB,Sequential Increment"
 
-#include "types.h"
-#include "sizes.h"
-#include "tests.h"
+static int run_scrub(ulv *base, size_t bufsize, ul loops, double rate,
+                     const char *selected) {
+    double start = time_now(), cycle_start, t, wait;
+    ull traffic = 0, cycle_traffic;
+    size_t offset, bytes;
+    struct sched_param param = { 0 };
+    struct timespec ts;
+    ul loop, failures;
+    int slot, result, exit_code = 0;
 
-#define EXIT_FAIL_NONSTARTER    0x01
-#define EXIT_FAIL_ADDRESSLINES  0x02
-#define EXIT_FAIL_OTHERTEST     0x04
+    /* no progress indicator in between the cycles */
+    memtester_quiet = 1;
+    if (!worker_sched && sched_setscheduler(0, SCHED_IDLE, &param))
+        fprintf(stderr, "failed to switch to SCHED_IDLE: %s\n",
+                strerror(errno));
+    printf("scrubbing %lluMB in %lluMB chunks", (ull) bufsize >> 20,
+           (ull) SCRUB_CHUNK >> 20);
+    if (rate > 0)
+        printf(", at %.1f MB/s at most", rate);
+    printf("\n");
+    fflush(stdout);
+    syslog(LOG_INFO, "scrubbing %lluMB", (ull) bufsize >> 20);
 
-struct test tests[] = {
-    { "Random Value", test_random_value },
-    { "Compare XOR", test_xor_comparison },
-    { "Compare SUB", test_sub_comparison },
-    { "Compare MUL", test_mul_comparison },
-    { "Compare DIV",test_div_comparison },
-    { "Compare OR", test_or_comparison },
-    { "Compare AND", test_and_comparison },
-    { "Sequential Increment", test_seqinc_comparison },
-    { "Bit Flip", test_bitflip_comparison },
-    { "Block Sequential", test_blockseq_comparison },
-    { "Checkerboard", test_checkerboard_comparison },
-    { "Bit Spread", test_bitspread_comparison },
-    { "Solid Bits", test_solidbits_comparison },
-    { "Walking Ones", test_walkbits1_comparison },
-    { "Walking Zeroes", test_walkbits0_comparison },
-#ifdef TEST_NARROW_WRITES    
-    { "8-bit Writes", test_8bit_wide_random },
-    { "16-bit Writes", test_16bit_wide_random },
-#endif
-    { NULL, NULL }
-};
+    for (loop = 1; !loops || loop <= loops; loop++) {
+        cycle_start = time_now();
+        cycle_traffic = traffic;
+        failures = 0;
+        for (offset = 0; offset < bufsize; offset += bytes) {
+            /* the last chunk takes the rest, rather than being tiny */
+            bytes = bufsize - offset < 2 * SCRUB_CHUNK ? bufsize - offset
+                                                       : SCRUB_CHUNK;
+            workers[0].base = (ulv *) ((size_t) base + offset);
+            workers[0].bytes = bytes;
+            for (slot = 1; slot <= ntests; slot++) {
+                if (!selected[slot])
+                    continue;
+                t = time_now();
+                pass_seed = test_seed(loop, slot);
+                failure_offset = (size_t) -1;
+                result = run_pass(slot_pass(slot));
+                json_test(slot, loop, result, time_now() - t,
+                          workers[0].traffic);
+                traffic += workers[0].traffic;
+                if (result) {
+                    reproduce_hint(slot, loop);
+                    bad_pages_update();
+                    memtester_journal_sync(1);
+                    exit_code |= EXIT_FAIL_OTHERTEST;
+                    failures++;
+                }
+                wait = rate > 0 ? traffic / (rate * (1 << 20)) -
+                                  (time_now() - start) : 0;
+                if (wait > 0) {
+                    ts.tv_sec = (time_t) wait;
+                    ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+                    nanosleep(&ts, NULL);
+                }
+            }
+        }
+        t = time_now() - cycle_start;
+        printf("Scrub cycle %lu: %lluMB tested in %.0f seconds, %.1f MB/s, "
+               "%lu failed\n", loop, (ull) bufsize >> 20, t,
+               (traffic - cycle_traffic) / t / (1 << 20), failures);
+        fflush(stdout);
+        syslog(failures ? LOG_ERR : LOG_INFO, "scrub cycle %lu: %lluMB in "
+               "%.0f seconds, %lu failed tests", loop, (ull) bufsize >> 20,
+               t, failures);
+    }
+    return exit_code;
+}
 
-/* Sanity checks and portability helper macros. */
-#ifdef _SC_VERSION
-void check_posix_system(void) {
-    if (sysconf(_SC_VERSION) < 198808L) {
-        fprintf(stderr, "A POSIX system is required.  Don't be surprised if "
-            "this craps out.\n");
-        fprintf(stderr, "_SC_VERSION is %lu\n", sysconf(_SC_VERSION));
+/*
+ * The test of --reproduce on REPRODUCE_BYTES of the memory of the thread
+ * which had the failure in a run with that many threads. The tests which
+ * compare two halves get the same words of both halves of that memory,
+ * with the failure in one of them, and the random values are skipped
+ * ahead to the ones these words had. The others get the REPRODUCE_BYTES
+ * around the failure.
+ */
+static int run_reproduce(ulv *base, size_t bufsize, ptrdiff_t pagesizemask,
+                         ul loops) {
+    size_t slice = reproduce.threads == 1 ? bufsize :
+                   (bufsize / reproduce.threads) & pagesizemask;
+    size_t wbase = reproduce.stream * slice, half = slice / 2;
+    size_t bytes, start;
+    struct worker *w = &workers[0];
+    ul runs = 0, failed = 0;
+    int result, exit_code = 0;
+
+    if (reproduce.offset >= bufsize) {
+        fprintf(stderr, "offset 0x%llx of --reproduce is past the %llu "
+                "bytes tested\n", (ull) reproduce.offset, (ull) bufsize);
+        return EXIT_FAIL_NONSTARTER;
+    }
+    if (reproduce.offset < wbase || reproduce.offset >= wbase + slice) {
+        fprintf(stderr, "offset 0x%llx of --reproduce is not in the memory "
+                "of thread %d of %d\n", (ull) reproduce.offset,
+                reproduce.stream, reproduce.threads);
+        return EXIT_FAIL_NONSTARTER;
     }
+    w->stream = reproduce.stream;
+    if (reproduce.slot == SLOT_STUCK_ADDRESS ||
+        (memtester_single && tests[reproduce.slot - 1].single)) {
+        bytes = slice < REPRODUCE_BYTES ? slice : REPRODUCE_BYTES;
+        start = region_around(reproduce.offset - wbase, slice, bytes);
+        w->bytes = bytes;
+        w->half = 0;
+        w->after = (slice - start - bytes) / sizeof(ul);
+        printf("reproducing %s of loop %lu, thread %d, seed 0x%lx, on "
+               "offsets 0x%llx-0x%llx\n", slot_name(reproduce.slot),
+               reproduce.loop, reproduce.stream, memtester_seed,
+               (ull) (wbase + start), (ull) (wbase + start + bytes - 1));
+    } else {
+        bytes = half < REPRODUCE_BYTES / 2 ? half : REPRODUCE_BYTES / 2;
+        start = region_around((reproduce.offset - wbase) % half, half,
+                              bytes);
+        w->bytes = 2 * bytes;
+        w->half = half;
+        w->after = (half - start - bytes) / sizeof(ul);
+        printf("reproducing %s of loop %lu, thread %d, seed 0x%lx, on "
+               "offsets 0x%llx-0x%llx and 0x%llx-0x%llx\n",
+               slot_name(reproduce.slot), reproduce.loop, reproduce.stream,
+               memtester_seed, (ull) (wbase + start),
+               (ull) (wbase + start + bytes - 1),
+               (ull) (wbase + half + start),
+               (ull) (wbase + half + start + bytes - 1));
+    }
+    w->base = (ulv *) ((size_t) base + wbase + start);
+    w->before = start / sizeof(ul);
+    fflush(stdout);
+
+    while (!loops || runs < loops) {
+        result = run_test(reproduce.slot, reproduce.loop);
+        exit_code |= result;
+        runs++;
+        if (result) {
+            failed++;
+            if (!loops)
+                break;
+        }
+    }
+    printf("failed %lu of %lu runs\n", failed, runs);
+    report_timings();
+    error_histogram_report();
+    json_loop(reproduce.loop);
+    return exit_code;
 }
-#else
-#define check_posix_system()
-#endif
 
-#ifdef _SC_PAGE_SIZE
-int memtester_pagesize(void) {
-    int pagesize = sysconf(_SC_PAGE_SIZE);
-    if (pagesize == -1) {
-        perror("get page size failed");
+/* A number of seconds, or minutes or hours with an 'm' or 'h' suffix */
+static double parse_duration(const char *s) {
+    char *suffix;
+    double d;
+
+    errno = 0;
+    d = strtod(s, &suffix);
+    if (errno || suffix == s || d <= 0)
+        return -1;
+    switch (*suffix) {
+        case 'h':
+            d *= 60;
+            /* fall through */
+        case 'm':
+            d *= 60;
+            /* fall through */
+        case 's':
+            suffix++;
+            /* fall through */
+        case '\0':
+            break;
+        default:
+            return -1;
+    }
+    return *suffix ? -1 : d;
+}
+
+/*
+ * Tests can also be picked by name, from the comma separated list in
+ * MEMTESTER_TESTS. Case doesn't matter, and '_' or '-' match a space.
+ */
+static int test_name_matches(const char *name, const char *s, size_t len) {
+    size_t i;
+    char c;
+
+    for (i = 0; i < len; i++, name++) {
+        c = s[i] == '_' || s[i] == '-' ? ' ' : s[i];
+        if (!*name || tolower((unsigned char) c) !=
+                      tolower((unsigned char) *name))
+            return 0;
+    }
+    return !*name;
+}
+
+static int select_tests(const char *list, char *selected) {
+    const char *s = list, *end;
+    size_t len;
+    int i;
+
+    while (*s) {
+        end = strchr(s, ',');
+        len = end ? (size_t) (end - s) : strlen(s);
+        for (i = 0; tests[i].name; i++) {
+            if (test_name_matches(tests[i].name, s, len)) {
+                selected[i] = 1;
+                break;
+            }
+        }
+        if (len && !tests[i].name) {
+            fprintf(stderr, "unknown test '%.*s' in MEMTESTER_TESTS, "
+                    "available tests are:\n", (int) len, s);
+            for (i = 0; tests[i].name; i++)
+                fprintf(stderr, "  %s\n", tests[i].name);
+            return -1;
+        }
+        s += len;
+        if (*s == ',')
+            s++;
+    }
+    return 0;
+}
+
+static int reproduce_parse(const char *spec) {
+    const char *name;
+    char *end;
+    int i;
+
+    reproduce.seed = strtoul(spec, &end, 0);
+    if (*end != ':')
+        return -1;
+    reproduce.loop = strtoul(end + 1, &end, 0);
+    if (*end != ':' || !reproduce.loop)
+        return -1;
+    name = end + 1;
+    end = strchr(name, ':');
+    if (!end)
+        return -1;
+    for (i = 0; i <= ntests; i++)
+        if (test_name_matches(slot_name(i), name, end - name))
+            break;
+    if (i > ntests)
+        return -1;
+    reproduce.slot = i;
+    reproduce.offset = (size_t) strtoull(end + 1, &end, 0);
+    reproduce.threads = 1;
+    if (*end == ':')
+        reproduce.stream = (int) strtoul(end + 1, &end, 0);
+    if (*end == ':')
+        reproduce.threads = (int) strtoul(end + 1, &end, 0);
+    if (reproduce.threads < 1 || reproduce.stream >= reproduce.threads)
+        return -1;
+    return *end ? -1 : 0;
+}
+
+static void start_workers(void volatile *aligned, size_t bufsize,
+                          ptrdiff_t pagesizemask) {
+    size_t slice = (bufsize / nworkers) & pagesizemask;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    if (ncpus < 1)
+        ncpus = 1;
+    if (slice < 2 * (size_t) (~pagesizemask + 1)) {
+        fprintf(stderr, "not enough memory for %d threads\n", nworkers);
         exit(EXIT_FAIL_NONSTARTER);
     }
-    printf("pagesize is %ld\n", (long) pagesize);
-    return pagesize;
+
+    workers = calloc(nworkers, sizeof(struct worker));
+    if (!workers) {
+        fprintf(stderr, "failed to allocate worker threads\n");
+        exit(EXIT_FAIL_NONSTARTER);
+    }
+    for (i = 0; i < nworkers; i++) {
+        workers[i].id = i;
+        workers[i].stream = i;
+        workers[i].cpu = worker_sched && worker_sched->ncpus ?
+                         thread_sched_cpu(worker_sched, i) : i % ncpus;
+        workers[i].base = (ulv *) ((size_t) aligned + i * slice);
+        workers[i].bytes = nworkers == 1 ? bufsize : slice;
+        workers[i].halves_differ = 1;
+    }
+    if (nworkers == 1) {
+        /* The main thread is the only worker */
+        if (worker_sched)
+            thread_sched_self(worker_sched);
+        worker_pmu_open(&workers[0]);
+        return;
+    }
+
+    printf("using %d threads, %lluMB (%llu bytes) each\n", nworkers,
+           (ull) slice >> 20, (ull) slice);
+    pthread_barrier_init(&pass_start, NULL, nworkers + 1);
+    pthread_barrier_init(&pass_done, NULL, nworkers + 1);
+    for (i = 0; i < nworkers; i++) {
+        if (worker_create(&workers[i])) {
+            fprintf(stderr, "failed to start worker thread %d\n", i);
+            exit(EXIT_FAIL_NONSTARTER);
+        }
+    }
 }
-#else
-int memtester_pagesize(void) {
-    printf("sysconf(_SC_PAGE_SIZE) not supported; using pagesize of 8192\n");
-    return 8192;
+
+static void stop_workers(void) {
+    int i;
+
+    if (nworkers == 1)
+        return;
+
+    pass_current = PASS_STOP;
+    pthread_barrier_wait(&pass_start);
+    for (i = 0; i < nworkers; i++)
+        pthread_join(workers[i].thread, NULL);
 }
-#endif
 
-/* Some systems don't define MAP_LOCKED.  Define it to 0 here
-   so it's just a no-op when ORed with other constants. */
-#ifndef MAP_LOCKED
-  #define MAP_LOCKED 0
-#endif
+/*
+ * --bench: the selected tests and the helpers they share, each for the
+ * given seconds on every one of bench_sizes, in GB/s of the traffic they
+ * count. The buffers are split in halves like the workers' regions, the
+ * sizes are picked to fit the L1 cache, the L2 cache and neither. The
+ * comparisons are down to a sanity check, so the tests show the speed of
+ * their pattern writes and the compare helper is timed on its own.
+ */
+static const size_t bench_sizes[] = { 16 << 10, 256 << 10, 32 << 20 };
+#define BENCH_SIZES (sizeof(bench_sizes) / sizeof(bench_sizes[0]))
 
-/* Function declarations */
-void usage(char *me);
+static double bench_kernel(struct test *t, ulv *buf, size_t bytes,
+                           double seconds, int *result) {
+    size_t halflen = bytes / 2;
+    ulv *bufb = (ulv *) ((size_t) buf + halflen);
+    ull start_traffic;
+    double start, now;
 
-/* Global vars - so tests have access to this information */
-int use_phys = 0;
-int memtester_early_exit = 0;
-off_t physaddrbase = 0;
+    /* the Compare tests expect the two halves to hold the same */
+    memset((void *) buf, 0, bytes);
+    start_traffic = memtester_traffic;
+    start = time_now();
+    do {
+        *result = t->fp(buf, bufb, halflen / sizeof(ul));
+        now = time_now();
+    } while (!*result && now - start < seconds);
+    return (memtester_traffic - start_traffic) / (now - start) / 1e9;
+}
+
+static void bench_row(struct test *t, ulv *buf, double seconds,
+                      int *exit_code) {
+    double gbps;
+    int i, result;
+
+    printf("  %-20s", t->name);
+    fflush(stdout);
+    for (i = 0; i < (int) BENCH_SIZES; i++) {
+        gbps = bench_kernel(t, buf, bench_sizes[i], seconds, &result);
+        if (result < 0) {
+            printf("  %8s", "FAILED");
+            *exit_code |= EXIT_FAIL_OTHERTEST;
+        } else if (result > 0) {
+            printf("  %8s", "-");
+        } else {
+            printf("  %8.2f", gbps);
+        }
+        fflush(stdout);
+    }
+    printf("\n");
+}
+
+static int run_bench(double seconds, const char *selected) {
+    size_t bytes = bench_sizes[BENCH_SIZES - 1];
+    void *buf;
+    int i, exit_code = 0;
+
+    if (posix_memalign(&buf, sysconf(_SC_PAGE_SIZE), bytes)) {
+        fprintf(stderr, "failed to allocate the benchmark buffer\n");
+        return EXIT_FAIL_NONSTARTER;
+    }
+    memtester_bench = 1;
+    memtester_quiet = 1;
+    memtester_base = buf;
+    printf("  %-20s", "GB/s");
+    for (i = 0; i < (int) BENCH_SIZES; i++) {
+        if (bench_sizes[i] >= 1 << 20)
+            printf("  %7zuM", bench_sizes[i] >> 20);
+        else
+            printf("  %7zuK", bench_sizes[i] >> 10);
+    }
+    printf("\n");
+    for (i = 0; i < ntests; i++) {
+        if (selected[i + 1])
+            bench_row(&tests[i], buf, seconds, &exit_code);
+    }
+    for (i = 0; memtester_bench_helpers[i].name; i++)
+        bench_row(&memtester_bench_helpers[i], buf, seconds, &exit_code);
+    free(buf);
+    return exit_code;
+}
+
+static const struct option long_options[] = {
+    { "duration", required_argument, NULL, 'D' },
+    { "json", no_argument, NULL, 'j' },
+    { "journal", required_argument, NULL, 'J' },
+    { "decode-journal", required_argument, NULL, 'R' },
+    { "checkpoint", required_argument, NULL, 'C' },
+    { "resume", no_argument, NULL, 'r' },
+    { "bench", no_argument, NULL, 'B' },
+    { "scrub", optional_argument, NULL, 'S' },
+    { "reproduce", required_argument, NULL, 'X' },
+    { NULL, 0, NULL, 0 }
+};
 
 /* Function definitions */
 void usage(char *me) {
     fprintf(stderr, "\n"
-            "Usage: %s [-p physaddrbase [-d device]] <mem>[B|K|M|G] [loops]\n",
-            me);
+            "Usage: %s [-p physaddrbase[:size][,...]|reserved|offline "
+            "[-d device]] "
+            "[-t threads] "
+            "[-D|--duration time[s|m|h]] [--json] [--journal file] "
+            "[--checkpoint file [--resume]] [--scrub[=MB/s]] "
+            "[--reproduce=seed:loop:test:offset[:thread[:threads]]] "
+            "<mem>[B|K|M|G]|max [loops]\n"
+            "       %s --decode-journal file\n"
+            "       %s --bench [-D time[s|m|h]]\n",
+            me, me, me);
     exit(EXIT_FAIL_NONSTARTER);
 }
 
 int memtester_main(int argc, char **argv) {
     ul loops, loop, i;
-    size_t pagesize, wantraw, wantmb, wantbytes, wantbytes_orig, bufsize,
-         halflen, count;
+    size_t pagesize, wantraw, wantmb, wantbytes, wantbytes_orig, bufsize;
+    size_t good, bad, next, avail;
     char *memsuffix, *addrsuffix, *loopsuffix;
     ptrdiff_t pagesizemask;
-    void volatile *buf, *aligned;
-    ulv *bufa, *bufb;
+    void volatile *buf, *aligned, *tested;
     int do_mlock = 1, done_mem = 0;
-    int exit_code = 0;
+    int exit_code = 0, resume = 0, bench = 0, scrub = 0;
+    ul first_loop = 1, failed;
+    int first_slot = 0;
     int memfd, opt, memshift;
     size_t maxbytes = -1; /* addressable memory, in bytes */
     size_t maxmb = (maxbytes >> 20) + 1; /* addressable memory, in MB */
@@ -126,8 +2501,29 @@ int memtester_main(int argc, char **argv) {
     struct stat statbuf;
     int device_specified = 0;
     char *env_testmask = 0;
+    char *env_progress;
+    char *env_seed;
+    char *env_tests;
+    char *env_dram_map;
+    char *env_bus_width;
+    char *env_gpu_share;
+    char *env_sched;
+    char *env_zoom;
+    size_t gpu_share = 0, keep;
+    char *selected;
+    double duration = 0, scrub_rate = 0;
     ul testmask = 0;
 
+    /* --json has to move the text output to stderr before it starts */
+    for (i = 1; i < (ul) argc && strcmp(argv[i], "--"); i++) {
+        if (!strcmp(argv[i], "--json")) {
+            fflush(stdout);
+            memtester_json = fdopen(dup(STDOUT_FILENO), "w");
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+            break;
+        }
+    }
+
     printf("memtester version " __version__ " (%d-bit)\n", UL_LEN);
     printf("Copyright (C) 2001-2012 Charles Cazabon.\n");
     printf("Licensed under the GNU General Public License version 2 (only).\n");
@@ -136,10 +2532,31 @@ int memtester_main(int argc, char **argv) {
     pagesize = memtester_pagesize();
     pagesizemask = (ptrdiff_t) ~(pagesize - 1);
     printf("pagesizemask is 0x%tx\n", pagesizemask);
+    memtester_cpu_report();
 
     if (getenv("MEMTESTER_EARLY_EXIT"))
         memtester_early_exit = 1;
 
+    /* Verify the previous pattern while writing the next one */
+    if (getenv("MEMTESTER_FUSED"))
+        memtester_fused = 1;
+
+    /* Check the whole buffer against the patterns, not half against half */
+    if (getenv("MEMTESTER_SINGLE"))
+        memtester_single = 1;
+
+    /* The 16 sweeps of the stuck address test, not the address line walk */
+    if (getenv("MEMTESTER_FULL_STUCK_ADDRESS"))
+        memtester_full_stuck_address = 1;
+
+    /* Count the cpu events of every test, for the timing table */
+    if (getenv("MEMTESTER_PMU"))
+        memtester_pmu = 1;
+
+    /* Rescan the whole region on a mismatch, not just the page around it */
+    if (getenv("MEMTESTER_FULL_CONFIRM"))
+        memtester_full_confirm = 1;
+
     /* If MEMTESTER_TEST_MASK is set, we use its value as a mask of which
        tests we run.
      */
@@ -154,31 +2571,108 @@ int memtester_main(int argc, char **argv) {
         printf("using testmask 0x%lx\n", testmask);
     }
 
-    while ((opt = getopt(argc, argv, "p:d:")) != -1) {
+    for (ntests = 0; tests[ntests].name; ntests++)
+        ;
+    selected = calloc(ntests + 1, 1);
+    timings = calloc(ntests + 1, sizeof(*timings));
+    totals = calloc(ntests + 1, sizeof(*totals));
+    if (!selected || !timings || !totals) {
+        fprintf(stderr, "failed to allocate the test list\n");
+        exit(EXIT_FAIL_NONSTARTER);
+    }
+    selected[SLOT_STUCK_ADDRESS] = !getenv("MEMTESTER_SKIP_STUCK_ADDRESS");
+    for (i = 0; i < ntests; i++)
+        selected[i + 1] = !testmask ||
+                          (i < UL_LEN && ((ul) 1 << i) & testmask);
+    if (env_tests = getenv("MEMTESTER_TESTS")) {
+        /* Only the named tests, plus those in the mask, if there is one */
+        if (!testmask)
+            memset(selected + 1, 0, ntests);
+        if (select_tests(env_tests, selected + 1))
+            usage(argv[0]); /* doesn't return */
+    }
+
+    /* Log the seed of the random values, so that a run can be repeated */
+    if (env_seed = getenv("MEMTESTER_SEED")) {
+        errno = 0;
+        memtester_seed = strtoul(env_seed, 0, 0);
+        if (errno) {
+            fprintf(stderr, "error parsing MEMTESTER_SEED %s: %s\n",
+                    env_seed, strerror(errno));
+            usage(argv[0]); /* doesn't return */
+        }
+    } else {
+        memtester_seed = (ul) time(NULL) ^ ((ul) getpid() << 16);
+    }
+    printf("using seed 0x%lx\n", memtester_seed);
+    rand_seed(memtester_seed, 0);
+
+    if (env_dram_map = getenv("MEMTESTER_DRAM_MAP")) {
+        if (dram_map_parse(env_dram_map))
+            usage(argv[0]); /* doesn't return */
+    }
+
+    /* The width of the DRAM data bus, for the error histogram */
+    if (env_bus_width = getenv("MEMTESTER_BUS_WIDTH")) {
+        memtester_bus_width = (int) strtoul(env_bus_width, &addrsuffix, 0);
+        if (*addrsuffix || memtester_bus_width < 8 ||
+            memtester_bus_width > 64 || memtester_bus_width % 8) {
+            fprintf(stderr, "bad MEMTESTER_BUS_WIDTH %s, should be 8, 16, "
+                    "32 or 64\n", env_bus_width);
+            usage(argv[0]); /* doesn't return */
+        }
+    }
+
+    if (env_gpu_share = getenv("MEMTESTER_GPU_SHARE")) {
+        gpu_share = (size_t) strtoul(env_gpu_share, &addrsuffix, 0) << 20;
+        if (*addrsuffix || !gpu_share) {
+            fprintf(stderr, "bad MEMTESTER_GPU_SHARE %s, should be a size "
+                    "in MB\n", env_gpu_share);
+            usage(argv[0]); /* doesn't return */
+        }
+    }
+
+    /* How long to zoom in on the region of every new bad page */
+    if (env_zoom = getenv("MEMTESTER_ZOOM")) {
+        zoom_seconds = parse_duration(env_zoom);
+        if (zoom_seconds <= 0) {
+            fprintf(stderr, "bad MEMTESTER_ZOOM %s, should be a time in "
+                    "s, m or h\n", env_zoom);
+            usage(argv[0]); /* doesn't return */
+        }
+    }
+
+    /* Where the workers run and with which scheduling policy */
+    if (env_sched = getenv("MEMTESTER_SCHED")) {
+        worker_sched = malloc(sizeof(*worker_sched));
+        if (!worker_sched || thread_sched_parse(env_sched, worker_sched)) {
+            fprintf(stderr, "bad MEMTESTER_SCHED %s, should be "
+                    "cpus[:other|fifo|rr[:priority]]\n", env_sched);
+            usage(argv[0]); /* doesn't return */
+        }
+    }
+
+    while ((opt = getopt_long(argc, argv, "p:d:t:D:", long_options,
+                              NULL)) != -1) {
         switch (opt) {
             case 'p':
-                errno = 0;
-                physaddrbase = (off_t) strtoull(optarg, &addrsuffix, 16);
-                if (errno != 0) {
-                    fprintf(stderr,
-                            "failed to parse physaddrbase arg; should be hex "
-                            "address (0x123...)\n");
-                    usage(argv[0]); /* doesn't return */
-                }
-                if (*addrsuffix != '\0') {
-                    /* got an invalid character in the address */
+                phys_nwindows = 0;
+                if (!strcmp(optarg, "reserved")) {
+                    if (phys_windows_reserved(pagesize))
+                        usage(argv[0]); /* doesn't return */
+                } else if (!strcmp(optarg, "offline")) {
+                    if (phys_windows_offline(pagesize))
+                        usage(argv[0]); /* doesn't return */
+                } else if (phys_windows_parse(optarg, pagesize)) {
                     fprintf(stderr,
                             "failed to parse physaddrbase arg; should be hex "
-                            "address (0x123...)\n");
-                    usage(argv[0]); /* doesn't return */
-                }
-                if (physaddrbase & (pagesize - 1)) {
-                    fprintf(stderr,
-                            "bad physaddrbase arg; does not start on page "
-                            "boundary\n");
+                            "address (0x123...), with :size in hex and more "
+                            "windows after commas, \"reserved\" or "
+                            "\"offline\"\n");
                     usage(argv[0]); /* doesn't return */
                 }
                 /* okay, got address */
+                physaddrbase = phys_windows[0].base;
                 use_phys = 1;
                 break;
             case 'd':
@@ -197,11 +2691,127 @@ int memtester_main(int argc, char **argv) {
                     }
                 }
                 break;              
+            case 't':
+                errno = 0;
+                nworkers = (int) strtoul(optarg, &addrsuffix, 0);
+                if (errno != 0 || *addrsuffix != '\0') {
+                    fprintf(stderr, "failed to parse number of threads\n");
+                    usage(argv[0]); /* doesn't return */
+                }
+                /* zero means one thread per online CPU core */
+                if (nworkers <= 0)
+                    nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+                if (nworkers <= 0)
+                    nworkers = 1;
+                break;
+            case 'j':
+                /* already set up, before the first output */
+                break;
+            case 'J':
+                if (memtester_journal_open(optarg))
+                    exit(EXIT_FAIL_NONSTARTER);
+                break;
+            case 'R':
+                exit(memtester_journal_decode(optarg) ? EXIT_FAIL_NONSTARTER
+                                                      : 0);
+            case 'C':
+                checkpoint_path = optarg;
+                break;
+            case 'r':
+                resume = 1;
+                break;
+            case 'B':
+                bench = 1;
+                break;
+            case 'S':
+                scrub = 1;
+                if (optarg && (scrub_rate = atof(optarg)) <= 0) {
+                    fprintf(stderr, "bad scrub rate %s, should be MB/s\n",
+                            optarg);
+                    usage(argv[0]); /* doesn't return */
+                }
+                break;
+            case 'X':
+                if (reproduce_parse(optarg)) {
+                    fprintf(stderr, "failed to parse --reproduce %s, should "
+                            "be seed:loop:test:offset[:thread[:threads]]\n",
+                            optarg);
+                    usage(argv[0]); /* doesn't return */
+                }
+                reproducing = 1;
+                break;
+            case 'D':
+                duration = parse_duration(optarg);
+                if (duration <= 0) {
+                    fprintf(stderr, "failed to parse duration %s\n", optarg);
+                    usage(argv[0]); /* doesn't return */
+                }
+                break;
             default: /* '?' */
                 usage(argv[0]); /* doesn't return */
         }
     }
 
+    if (bench)
+        exit(run_bench(duration > 0 ? duration : 1, selected));
+
+    if (scrub) {
+        if (!getenv("MEMTESTER_TESTS") && !getenv("MEMTESTER_TEST_MASK")) {
+            memset(selected + 1, 0, ntests);
+            select_tests(SCRUB_TESTS, selected + 1);
+        }
+        if (nworkers != 1) {
+            fprintf(stderr, "--scrub runs a single thread\n");
+            nworkers = 1;
+        }
+        if (duration > 0) {
+            fprintf(stderr, "--scrub runs by loops, not by duration\n");
+            duration = 0;
+        }
+        openlog("memtester", LOG_PID, LOG_DAEMON);
+        memtester_syslog = 1;
+    }
+
+    if (reproducing) {
+        if (scrub || duration > 0 || checkpoint_path) {
+            fprintf(stderr, "--reproduce runs one test, not with --scrub, "
+                    "-D or --checkpoint\n");
+            usage(argv[0]); /* doesn't return */
+        }
+        memtester_seed = reproduce.seed;
+        printf("using seed 0x%lx of --reproduce\n", memtester_seed);
+        nworkers = 1;
+    }
+
+    if (resume && !checkpoint_path) {
+        fprintf(stderr, "--resume needs a --checkpoint file\n");
+        usage(argv[0]); /* doesn't return */
+    }
+    if (checkpoint_path) {
+        checkpoint.runs = calloc(ntests + 1, sizeof(ul));
+        checkpoint.failures = calloc(ntests + 1, sizeof(ul));
+        if (!checkpoint.runs || !checkpoint.failures) {
+            fprintf(stderr, "failed to allocate the checkpoint\n");
+            exit(EXIT_FAIL_NONSTARTER);
+        }
+        switch (resume ? checkpoint_load(checkpoint_path) : 0) {
+            case -1:
+                exit(EXIT_FAIL_NONSTARTER);
+            case 1:
+                for (i = 0, failed = 0; i <= (ul) ntests; i++)
+                    failed += checkpoint.failures[i];
+                printf("resuming from %s with seed 0x%lx at loop %lu, "
+                       "test %d, after %.0f seconds and %lu failures\n",
+                       checkpoint_path, memtester_seed, checkpoint.loop,
+                       checkpoint.slot, checkpoint.seconds, failed);
+                first_loop = checkpoint.loop;
+                first_slot = checkpoint.slot;
+                exit_code = checkpoint.exit_code;
+                rand_seed(memtester_seed, 0);
+                break;
+        }
+    }
+
     if (device_specified && !use_phys) {
         fprintf(stderr, 
                 "for mem device, physaddrbase (-p) must be specified\n");
@@ -214,7 +2824,23 @@ int memtester_main(int argc, char **argv) {
     }
 
     errno = 0;
-    wantraw = (size_t) strtoul(argv[optind], &memsuffix, 0);
+    if (!strcmp(argv[optind], "max") && use_phys && phys_windows_bytes()) {
+        /* All of the physical windows */
+        wantraw = phys_windows_bytes();
+        memsuffix = "B";
+    } else if (!strcmp(argv[optind], "max")) {
+        /* All available memory, less a reserve for the rest of the system */
+        avail = meminfo_bytes("MemAvailable:");
+        if (avail < 2 * MAX_MEMORY_RESERVE) {
+            fprintf(stderr, "failed to find the available memory\n");
+            usage(argv[0]); /* doesn't return */
+        }
+        wantraw = avail - (avail / 32 > MAX_MEMORY_RESERVE ?
+                           avail / 32 : MAX_MEMORY_RESERVE);
+        memsuffix = "B";
+    } else {
+        wantraw = (size_t) strtoul(argv[optind], &memsuffix, 0);
+    }
     if (errno != 0) {
         fprintf(stderr, "failed to parse memory argument");
         usage(argv[0]); /* doesn't return */
@@ -281,33 +2907,63 @@ int memtester_main(int argc, char **argv) {
                     device_name, strerror(errno));
             exit(EXIT_FAIL_NONSTARTER);
         }
-        buf = (void volatile *) mmap(0, wantbytes, PROT_READ | PROT_WRITE,
-                                     MAP_SHARED | MAP_LOCKED, memfd,
-                                     physaddrbase);
+        buf = (void volatile *) phys_windows_map(memfd, wantbytes, &bufsize);
         if (buf == MAP_FAILED) {
             fprintf(stderr, "failed to mmap %s for physical memory: %s\n",
                     device_name, strerror(errno));
             exit(EXIT_FAIL_NONSTARTER);
         }
 
-        if (mlock((void *) buf, wantbytes) < 0) {
+        if (mlock((void *) buf, bufsize) < 0) {
             fprintf(stderr, "failed to mlock mmap'ed space\n");
             do_mlock = 0;
         }
 
-        bufsize = wantbytes; /* accept no less */
+        aligned = buf;
+        done_mem = 1;
+    } else if (memtester_gpu_memory) {
+        bufsize = wantbytes;
+        buf = memtester_gpu_memory(&bufsize);
+        if (!buf)
+            exit(EXIT_FAIL_NONSTARTER);
+        printf("got  %lluMB (%llu bytes, mali memory)\n",
+               (ull) bufsize >> 20, (ull) bufsize);
+        /* the driver pins it anyway */
+        do_mlock = 0;
         aligned = buf;
         done_mem = 1;
     }
 
+    /*
+     * Look for the largest buffer that can be allocated and locked by
+     * bisection, between the largest size that worked ('good') and the
+     * smallest one that failed ('bad'). Sizes above MemAvailable count as
+     * failed from the start, they would only push the system into swap.
+     */
+    good = 0;
+    bad = wantbytes + 1;
+    if (!use_phys && (avail = meminfo_bytes("MemAvailable:")) &&
+        wantbytes > avail) {
+        wantbytes = avail & pagesizemask;
+        bad = wantbytes + 1;
+        printf("only %lluMB available, trying that\n",
+               (ull) wantbytes >> 20);
+    }
     while (!done_mem) {
-        while (!buf && wantbytes) {
-            buf = (void volatile *) malloc(wantbytes);
-            if (!buf) wantbytes -= pagesize;
+        if (wantbytes < pagesize) {
+            fprintf(stderr, "failed to allocate memory\n");
+            exit(EXIT_FAIL_NONSTARTER);
+        }
+        buf = buffer_alloc(wantbytes, pagesize);
+        if (!buf) {
+            bad = wantbytes;
+            next = bisect_next(good, bad, pagesize);
+            wantbytes = next ? next : good;
+            continue;
         }
         bufsize = wantbytes;
-        printf("got  %lluMB (%llu bytes)", (ull) wantbytes >> 20,
-            (ull) wantbytes);
+        printf("got  %lluMB (%llu bytes, %s)", (ull) wantbytes >> 20,
+            (ull) wantbytes, buffer_kinds[buffer.kind]);
         fflush(stdout);
         if (do_mlock) {
             printf(", trying mlock ...");
@@ -322,27 +2978,33 @@ int memtester_main(int argc, char **argv) {
             } else {
                 aligned = buf;
             }
-            /* Try mlock */
+            /* Try mlock, which faults in the pages itself */
             if (mlock((void *) aligned, bufsize) < 0) {
                 switch(errno) {
                     case EAGAIN: /* BSDs */
                         printf("over system/pre-process limit, reducing...\n");
-                        free((void *) buf);
+                        buffer_free(buf);
                         buf = NULL;
-                        wantbytes -= pagesize;
+                        bad = wantbytes;
+                        next = bisect_next(good, bad, pagesize);
+                        wantbytes = next ? next : good;
                         break;
                     case ENOMEM:
                         printf("too many pages, reducing...\n");
-                        free((void *) buf);
+                        buffer_free(buf);
                         buf = NULL;
-                        wantbytes -= pagesize;
+                        bad = wantbytes;
+                        next = bisect_next(good, bad, pagesize);
+                        wantbytes = next ? next : good;
                         break;
                     case EPERM:
                         printf("insufficient permission.\n");
                         printf("Trying again, unlocked:\n");
                         do_mlock = 0;
-                        free((void *) buf);
+                        buffer_free(buf);
                         buf = NULL;
+                        good = 0;
+                        bad = wantbytes_orig + 1;
                         wantbytes = wantbytes_orig;
                         break;
                     default:
@@ -352,59 +3014,141 @@ int memtester_main(int argc, char **argv) {
                 }
             } else {
                 printf("locked.\n");
-                done_mem = 1;
+                good = wantbytes;
+                next = bisect_next(good, bad, pagesize);
+                if (next) {
+                    /* there might be room for more */
+                    munlock((void *) aligned, bufsize);
+                    buffer_free(buf);
+                    buf = NULL;
+                    wantbytes = next;
+                } else {
+                    done_mem = 1;
+                }
             }
         } else {
             done_mem = 1;
             printf("\n");
+            buffer_prefault(buf, bufsize, pagesize);
+        }
+    }
+
+    if (!do_mlock && !memtester_gpu_memory)
+        fprintf(stderr, "Continuing with unlocked memory; testing "
+                "will be slower and less reliable.\n");
+
+    memtester_base = (ulv *) aligned;
+    if (!use_phys)
+        pagemap_load(aligned, bufsize, pagesize);
+    tested = aligned;
+    if (getenv("MEMTESTER_UNCACHED") && !use_phys)
+        tested = uncached_alias(aligned, bufsize, pagesize);
+    memtester_base = (ulv *) tested;
+
+    /* rather than an ok for a test which only hammered the caches */
+    for (i = 0; i < (ul) ntests; i++) {
+        if (tests[i].fp == test_row_hammer && selected[i + 1] &&
+            !test_row_hammer_usable()) {
+            printf("skipping %s, the caches can't be flushed on this cpu, "
+                   "set MEMTESTER_UNCACHED\n", tests[i].name);
+            selected[i + 1] = 0;
+        }
+    }
+
+    if (gpu_share) {
+        /* never more than half, the cpu tests keep the rest */
+        if (gpu_share > bufsize / 2)
+            gpu_share = bufsize / 2;
+        gpu_share &= pagesizemask;
+        keep = (bufsize - gpu_share) & pagesizemask;
+        if (!memtester_gpu_share) {
+            fprintf(stderr, "no gpu test built in, ignoring "
+                    "MEMTESTER_GPU_SHARE\n");
+        } else if (gpu_share && !memtester_gpu_share((ulv *) ((size_t)
+                   tested + keep), gpu_share)) {
+            bufsize = keep;
+            printf("leaving %lluMB (%llu bytes) to the gpu\n",
+                   (ull) gpu_share >> 20, (ull) gpu_share);
+        } else {
+            fprintf(stderr, "the gpu did not take its share, the cpu tests "
+                    "cover the whole buffer\n");
         }
     }
 
-    if (!do_mlock) fprintf(stderr, "Continuing with unlocked memory; testing "
-                           "will be slower and less reliable.\n");
+    /* The gpu share, the uncached alias and -p keep their bad pages, and
+       --reproduce keeps on at its one */
+    if (!use_phys && !memtester_gpu_memory && tested == aligned &&
+        buffer.kind != BUFFER_HUGETLB && !reproducing)
+        bad_pages_limit = bufsize;
+    zoom_bufsize = bufsize;
+    zoom_pagesize = pagesize;
+
+    start_workers(tested, bufsize, pagesizemask);
 
-    halflen = bufsize / 2;
-    count = halflen / sizeof(ul);
-    bufa = (ulv *) aligned;
-    bufb = (ulv *) ((size_t) aligned + halflen);
+    /* The progress indicator, or JSON progress lines on stderr */
+    env_progress = getenv("MEMTESTER_PROGRESS");
+    progress_start(env_progress && !strcmp(env_progress, "json"));
 
-    for(loop=1; ((!loops) || loop <= loops); loop++) {
+    if (memtester_json) {
+        fprintf(memtester_json, "{\"type\": \"start\", \"time\": %.3f, "
+                "\"version\": \"" __version__ "\", \"bytes\": %llu, "
+                "\"threads\": %d, \"seed\": \"0x%lx\", "
+                "\"locked\": %s}\n", memtester_json_time(), (ull) bufsize,
+                nworkers, memtester_seed, do_mlock ? "true" : "false");
+        fflush(memtester_json);
+    }
+
+    checkpoint_started = time_now();
+    if (duration > 0) {
+        /* A resumed run gets the time that was left, but at least the
+           calibration loop. */
+        duration -= checkpoint.seconds;
+        if (duration < 1)
+            duration = 1;
+        exit_code |= run_for_duration(duration, selected);
+    }
+    if (scrub)
+        exit_code |= run_scrub((ulv *) tested, bufsize, loops, scrub_rate,
+                               selected);
+    if (reproducing)
+        exit_code |= run_reproduce((ulv *) tested, bufsize, pagesizemask,
+                                   loops);
+    for(loop=first_loop; !scrub && !reproducing && duration <= 0 &&
+        ((!loops) || loop <= loops); loop++) {
         printf("Loop %lu", loop);
         if (loops) {
             printf("/%lu", loops);
         }
         printf(":\n");
         fflush(stdout);
-        if (!getenv("MEMTESTER_SKIP_STUCK_ADDRESS")) {
-            printf("  %-20s: ", "Stuck Address");
-            fflush(stdout);
-            if (!test_stuck_address(aligned, bufsize / sizeof(ul))) {
-                printf("ok\n");
-            } else {
-                exit_code |= EXIT_FAIL_ADDRESSLINES;
-            }
-        }
-        for (i=0;;i++) {
-            if (!tests[i].name) break;
-            /* If using a custom testmask, only run this test if the
-               bit corresponding to this test was set by the user.
-             */
-            if (testmask && (!((1 << i) & testmask))) {
-                continue;
+        /* Only run the tests picked by MEMTESTER_TEST_MASK or
+           MEMTESTER_TESTS, if either is set.
+         */
+        for (i = loop == first_loop ? first_slot : 0; i <= ntests; i++) {
+            if (selected[i]) {
+                exit_code |= run_test(i, loop);
+                checkpoint_save(loop, i + 1, exit_code);
             }
-            printf("  %-20s: ", tests[i].name);
-            if (!tests[i].fp(bufa, bufb, count)) {
-                printf("ok\n");
-            } else {
-                exit_code |= EXIT_FAIL_OTHERTEST;
-            }
-            fflush(stdout);
         }
+        report_timings();
+        error_histogram_report();
+        json_loop(loop);
+        memset(timings, 0, (ntests + 1) * sizeof(*timings));
         printf("\n");
         fflush(stdout);
     }
+    stop_workers();
+    if (memtester_gpu_failed)
+        exit_code |= EXIT_FAIL_GPU;
     if (do_mlock) munlock((void *) aligned, bufsize);
+    if (checkpoint_path)
+        unlink(checkpoint_path);
     printf("Done.\n");
     fflush(stdout);
+    if (memtester_json) {
+        fprintf(memtester_json, "{\"type\": \"done\", \"time\": %.3f, "
+                "\"exit_code\": %d}\n", memtester_json_time(), exit_code);
+        fflush(memtester_json);
+    }
     exit(exit_code);
 }
@@ -14,10 +14,46 @@
  */
 
 #include <sys/types.h>
+#include <stdio.h>
+#include <pthread.h>
 
 /* extern declarations. */
 
 extern int use_phys;
 extern off_t physaddrbase;
 extern int memtester_early_exit;
+extern int memtester_fused;
+extern int memtester_single;
+extern int memtester_full_confirm;
+extern int memtester_bench;
+extern struct test memtester_bench_helpers[];
+extern int memtester_full_stuck_address;
+extern int memtester_uncached;
+extern int memtester_gpu_failed;
+extern int memtester_has_found_errors;
+extern ul memtester_seed;
+extern int memtester_bus_width;
+extern int memtester_syslog;
+extern FILE *memtester_json;
+extern ulv *memtester_base;
+extern int (*memtester_gpu_share)(ulv *base, size_t bytes);
+extern void volatile *(*memtester_gpu_memory)(size_t *bytes);
+extern void (*memtester_trace)(const char *name, int begin);
+extern void (*memtester_loop_telemetry)(FILE *json);
+extern __thread int memtester_quiet;
+extern __thread ull memtester_traffic;
+extern __thread size_t memtester_window_before;
+extern __thread size_t memtester_window_after;
+
+double memtester_json_time(void);
+void memtester_gpu_stall(double seconds);
+off_t memtester_physaddr(ulv *p);
+ulv *memtester_virt(off_t physaddr);
+void memtester_bad_page(ulv *p);
+void memtester_dram_location(off_t physaddr, char *buf, size_t len);
+ull memtester_dram_step(const char *field);
+int memtester_thread_attr(const char *spec, pthread_attr_t *attr);
+void memtester_metrics(FILE *f, void *data);
+void memtester_progress(ul *loop, const char **test, ull *bytes,
+                        ul *failures);
 
@@ -14,7 +14,9 @@
 
 #include <limits.h>
 
-#define rand32() ((unsigned int) rand() | ( (unsigned int) rand() << 16))
+/* The per-thread generator in tests.c, see rand_seed() */
+unsigned int rand32(void);
+unsigned long rand64(void);
 
 #if (ULONG_MAX == 4294967295UL)
     #define rand_ul() rand32()
@@ -24,7 +26,6 @@
     #define CHECKERBOARD2 0xaaaaaaaa
     #define UL_BYTE(x) ((x | x << 8 | x << 16 | x << 24))
 #elif (ULONG_MAX == 18446744073709551615ULL)
-    #define rand64() (((ul) rand32()) << 32 | ((ul) rand32()))
     #define rand_ul() rand64()
     #define UL_ONEBITS 0xffffffffffffffffUL
     #define UL_LEN 64
@@ -16,22 +16,219 @@
 #include <sys/types.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#if defined(__arm__) || defined(__aarch64__)
+#define USE_NEON_HELPERS
+#include <sys/auxv.h>
+#endif
 
 #include "types.h"
 #include "sizes.h"
 #include "memtester.h"
+#include "kernels.h"
 
 char progress[] = "-\\|/";
 #define PROGRESSLEN 4
 #define PROGRESSOFTEN 2500
+/* How often the progress indicator gets updated (in ms) */
+#define PROGRESS_INTERVAL 250
 #define ONE 0x00000001L
 
 /* Function definitions. */
 
 int memtester_has_found_errors = 0;
 
-#ifdef __arm__
+/* Set by memtester_gpu_stall(), for the exit code */
+int memtester_gpu_failed = 0;
+
+/* Set in the worker threads, which must not print the progress indicator */
+__thread int memtester_quiet = 0;
+
+/* Bytes read plus bytes written by the tests, for the timing report */
+__thread ull memtester_traffic = 0;
+
+/*
+ * For --reproduce: the words of the original halves in front of and
+ * behind the ones tested, see rand_skip()
+ */
+__thread size_t memtester_window_before = 0;
+__thread size_t memtester_window_after = 0;
+#define count_traffic(count, sweeps) \
+    (memtester_traffic += (ull) (count) * sizeof(ul) * (sweeps))
+
+/*
+ * The progress indicator is drawn by a reporter thread, which samples the
+ * state below every PROGRESS_INTERVAL milliseconds. The test loops only
+ * store their position, so a slow (serial) console never holds them up.
+ */
+#define PROGRESS_NONE 0
+#define PROGRESS_PHASE 1
+#define PROGRESS_SPIN 2
+
+static struct progress_state {
+    pthread_mutex_t lock;
+    int json;
+    int kind;
+    unsigned long loop;
+    const char *test;
+    /* Written by the test loops */
+    const char * volatile phase;
+    volatile unsigned int step;
+    volatile unsigned int spin;
+    /* What the reporter has shown so far */
+    int drawn;
+    const char *drawn_phase;
+    unsigned int drawn_step;
+    unsigned int drawn_spin;
+} progress_state = { PTHREAD_MUTEX_INITIALIZER };
+
+/* Called with the lock held */
+static void progress_draw(void) {
+    struct progress_state *s = &progress_state;
+    const char *phase = s->phase;
+    unsigned int step = s->step;
+    unsigned int spin = s->spin;
+
+    if (s->kind == PROGRESS_PHASE) {
+        if (!phase || (s->drawn && phase == s->drawn_phase &&
+                       step == s->drawn_step))
+            return;
+        if (s->json) {
+            fprintf(stderr, "{\"loop\": %lu, \"test\": \"%s\", "
+                    "\"phase\": \"%s\", \"step\": %u}\n",
+                    s->loop, s->test ? s->test : "", phase, step);
+        } else {
+            printf("\b\b\b\b\b\b\b\b\b\b\b");
+            printf("%s %3u", phase, step);
+        }
+        s->drawn_phase = phase;
+        s->drawn_step = step;
+    } else if (s->kind == PROGRESS_SPIN) {
+        if (s->drawn && spin == s->drawn_spin)
+            return;
+        if (s->json) {
+            fprintf(stderr, "{\"loop\": %lu, \"test\": \"%s\", "
+                    "\"spin\": %u}\n",
+                    s->loop, s->test ? s->test : "", spin);
+        } else {
+            putchar('\b');
+            putchar(progress[spin % PROGRESSLEN]);
+        }
+        s->drawn_spin = spin;
+    } else {
+        return;
+    }
+    s->drawn = 1;
+    fflush(s->json ? stderr : stdout);
+}
+
+static void *progress_thread(void *arg) {
+    for (;;) {
+        usleep(PROGRESS_INTERVAL * 1000);
+        pthread_mutex_lock(&progress_state.lock);
+        progress_draw();
+        pthread_mutex_unlock(&progress_state.lock);
+    }
+    return NULL;
+}
+
+/* Start the reporter thread, with JSON lines on stderr if 'json' is set */
+void progress_start(int json) {
+    pthread_t thread;
+    int ret;
+
+    progress_state.json = json;
+    ret = pthread_create(&thread, NULL, progress_thread, NULL);
+    if (ret) {
+        fprintf(stderr, "failed to start the progress thread: %s\n",
+                strerror(ret));
+        return;
+    }
+    pthread_detach(thread);
+}
+
+/* Tell the reporter which test is running, for the JSON output */
+void progress_test(unsigned long loop, const char *name) {
+    pthread_mutex_lock(&progress_state.lock);
+    progress_state.loop = loop;
+    progress_state.test = name;
+    pthread_mutex_unlock(&progress_state.lock);
+}
+
+static void progress_start_kind(int kind, const char *blank) {
+    struct progress_state *s = &progress_state;
+
+    if (memtester_quiet) return;
+    pthread_mutex_lock(&s->lock);
+    s->kind = kind;
+    s->phase = NULL;
+    s->drawn = 0;
+    if (!s->json) {
+        printf("%s", blank);
+        fflush(stdout);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void progress_end_kind(const char *erase) {
+    struct progress_state *s = &progress_state;
+
+    if (memtester_quiet) return;
+    pthread_mutex_lock(&s->lock);
+    s->kind = PROGRESS_NONE;
+    if (!s->json) {
+        printf("%s", erase);
+        fflush(stdout);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void progress_begin(void) {
+    progress_start_kind(PROGRESS_PHASE, "           ");
+}
+
+static void progress_phase(const char *phase, unsigned int j) {
+    if (memtester_quiet) return;
+    progress_state.step = j;
+    progress_state.phase = phase;
+}
+
+static void progress_end(void) {
+    progress_end_kind("\b\b\b\b\b\b\b\b\b\b\b           "
+                      "\b\b\b\b\b\b\b\b\b\b\b");
+}
+
+static void progress_spin_begin(void) {
+    progress_start_kind(PROGRESS_SPIN, " ");
+}
+
+static void progress_spin(unsigned int j) {
+    if (memtester_quiet) return;
+    progress_state.spin = j;
+}
+
+static void progress_spin_end(void) {
+    progress_end_kind("\b \b");
+}
+
+/* Offset of a failing location from the start of the whole tested region */
+static ul region_offset(ulv *p) {
+    if (!memtester_base)
+        return 0;
+    return (ul)((size_t) p - (size_t) memtester_base);
+}
+
+#ifdef USE_NEON_HELPERS
 typedef struct compare_regions_helper_result {
     ul failed_index[8];
     ul failed_value1[8];
@@ -40,10 +237,413 @@ typedef struct compare_regions_helper_result {
 
 void compare_regions_helper_neon(ulv *buf1, ulv *buf2, ul count,
                                  compare_regions_helper_result *res);
+void fill_regions_helper_neon(ulv *buf1, ulv *buf2, ul count,
+                              ul even_value, ul odd_value);
+void xor_regions_helper_neon(ulv *buf1, ulv *buf2, ul count, ul value);
+struct div_magic;
+void narrow_copy8_helper_neon(u8v *dst, ulv *src, ul count);
+void narrow_copy16_helper_neon(u16v *dst, ulv *src, ul count);
+void div_regions_helper_neon(ulv *buf1, ulv *buf2, ul count,
+                             const struct div_magic *magic);
+void stuck_address_fill_helper_neon(ulv *buf, ul count,
+                                    ul even_mask, ul odd_mask);
+ul stuck_address_check_helper_neon(ulv *buf, ul count,
+                                   ul even_mask, ul odd_mask);
+struct rand_state;
+void rand_fill_helper_neon(ulv *buf1, ulv *buf2, ul count,
+                           struct rand_state *state);
+uint32_t crc32_helper_armv8(uint32_t crc, void *buf, ul size);
+
+/* The helpers use all ones to mark the lanes without failures */
+#define NO_FAILED_INDEX ((ul)(-1))
+
+#ifdef __aarch64__
+#ifndef HWCAP_ASIMD
+#define HWCAP_ASIMD (1 << 1)
+#endif
+#define HWCAP_NEON_HELPERS HWCAP_ASIMD
+#else
+#ifndef HWCAP_ARM_NEON
+#define HWCAP_ARM_NEON (1 << 12)
+#endif
+#define HWCAP_NEON_HELPERS HWCAP_ARM_NEON
 #endif
 
+#ifdef __aarch64__
+#define HWCAP_CRC32_HELPER (1 << 7)     /* HWCAP_CRC32 */
+#define HWCAP_CRC32_AUXV AT_HWCAP
+#else
+#define HWCAP_CRC32_HELPER (1 << 4)     /* HWCAP2_CRC32 */
+#define HWCAP_CRC32_AUXV 26             /* AT_HWCAP2 */
+#endif
+
+/*
+ * One binary runs on A10/A20 (Cortex-A8/A7), H3 (A7) and A64 (A53), so
+ * the helpers are picked at runtime. Not every ARMv7 core has NEON
+ * (Tegra 2 doesn't), ARMv8 cores have the CRC32 instructions even in
+ * 32-bit mode, and the core type comes from /proc/cpuinfo. On Cortex-A9
+ * the NEON unit sits behind the integer pipeline and its stores lose to
+ * the integer ones, so the plain fills use the C kernels there.
+ */
+static struct cpu_features {
+    int neon;
+    int neon_stores;
+    int crc32;
+    unsigned int part;
+    const char *name;
+} cpu;
+static pthread_once_t cpu_once = PTHREAD_ONCE_INIT;
+
+static const struct cpu_part {
+    unsigned int part;
+    const char *name;
+} cpu_parts[] = {
+    { 0xc05, "Cortex-A5" },
+    { 0xc07, "Cortex-A7" },
+    { 0xc08, "Cortex-A8" },
+    { 0xc09, "Cortex-A9" },
+    { 0xc0f, "Cortex-A15" },
+    { 0xd03, "Cortex-A53" },
+    { 0xd04, "Cortex-A35" },
+    { 0xd05, "Cortex-A55" },
+    { 0xd07, "Cortex-A57" },
+    { 0xd08, "Cortex-A72" },
+    { 0, NULL }
+};
+
+static void cpu_detect(void) {
+    unsigned int implementer = 0, part = 0;
+    char line[128];
+    FILE *f;
+    int i;
+
+    cpu.neon = (getauxval(AT_HWCAP) & HWCAP_NEON_HELPERS) != 0;
+    cpu.crc32 = (getauxval(HWCAP_CRC32_AUXV) & HWCAP_CRC32_HELPER) != 0;
+    f = fopen("/proc/cpuinfo", "r");
+    while (f && fgets(line, sizeof(line), f) && !(implementer && part)) {
+        sscanf(line, "CPU implementer : %x", &implementer);
+        sscanf(line, "CPU part : %x", &part);
+    }
+    if (f)
+        fclose(f);
+    if (implementer == 0x41) {
+        cpu.part = part;
+        for (i = 0; cpu_parts[i].name; i++) {
+            if (cpu_parts[i].part == part)
+                cpu.name = cpu_parts[i].name;
+        }
+    }
+    cpu.neon_stores = cpu.neon && cpu.part != 0xc09;
+}
+
+static const struct cpu_features *cpu_features(void) {
+    pthread_once(&cpu_once, cpu_detect);
+    return &cpu;
+}
+
+static int have_neon(void) {
+    return cpu_features()->neon;
+}
+
+/* For the loops which only store, and have a C kernel to fall back to */
+static int have_neon_stores(void) {
+    return cpu_features()->neon_stores;
+}
+#endif
+
+/* Print what the helpers were picked for, once at the start */
+void memtester_cpu_report(void) {
+#ifdef USE_NEON_HELPERS
+    const struct cpu_features *c = cpu_features();
+
+    printf("cpu: %s", c->name ? c->name : "unknown core");
+    if (c->part && !c->name)
+        printf(" (part 0x%03x)", c->part);
+    printf(", %s helpers%s%s\n", c->neon ? "NEON" : "C",
+           c->neon && !c->neon_stores ? " (C fills)" : "",
+           c->crc32 ? ", CRC32 instructions" : "");
+#endif
+}
+
+/*
+ * The random values come from four interleaved xorshift128 generators,
+ * one per NEON lane, so that the NEON helper can produce four words per
+ * step. The C code below steps them in the same way, which keeps the
+ * values for a given seed the same with and without NEON. Each thread
+ * has its own state, seeded from the seed and a stream number.
+ */
+typedef struct rand_state {
+    uint32_t x[4], y[4], z[4], w[4];
+    unsigned int avail;
+    int seeded;
+} rand_state;
+
+static __thread rand_state rng;
+
+/* splitmix64, to spread the seed over the generator state */
+static uint64_t rand_seed_next(uint64_t *s) {
+    uint64_t z = (*s += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+void rand_seed(unsigned long seed, int stream) {
+    uint64_t s = (uint64_t) seed ^ ((uint64_t) stream << 48);
+    uint64_t v;
+    int l;
+
+    for (l = 0; l < 4; l++) {
+        v = rand_seed_next(&s);
+        rng.x[l] = (uint32_t) v;
+        rng.y[l] = (uint32_t) (v >> 32);
+        v = rand_seed_next(&s);
+        rng.z[l] = (uint32_t) v;
+        rng.w[l] = (uint32_t) (v >> 32) | 1;  /* never all zeroes */
+    }
+    rng.avail = 0;
+    rng.seeded = 1;
+}
+
+/* Step all four generators, the new values are left in w[] */
+static void rand_step(rand_state *r) {
+    uint32_t t;
+    int l;
+
+    for (l = 0; l < 4; l++) {
+        t = r->x[l] ^ (r->x[l] << 11);
+        r->x[l] = r->y[l];
+        r->y[l] = r->z[l];
+        r->z[l] = r->w[l];
+        r->w[l] = r->w[l] ^ (r->w[l] >> 19) ^ t ^ (t >> 8);
+    }
+}
+
+unsigned int rand32(void) {
+    if (!rng.seeded)
+        rand_seed(0, 0);
+    if (rng.avail == 0) {
+        rand_step(&rng);
+        rng.avail = 4;
+    }
+    return rng.w[4 - rng.avail--];
+}
+
+unsigned long rand64(void) {
+    unsigned long lo = rand32();
+    return lo | (unsigned long) rand32() << 16 << 16;
+}
+
+/*
+ * Fill both regions with the same random values. Without bufb, only bufa
+ * is filled, and rand_check() later regenerates the values to check it.
+ */
+#define RAND_FILL_BLOCK (64 / sizeof(ul))
+
+static void rand_fill(ulv *bufa, ulv *bufb, size_t count) {
+    size_t i = 0;
+    int k, l;
+
+    if (!rng.seeded)
+        rand_seed(0, 0);
+    rng.avail = 0;
+    count_traffic(count, bufb ? 2 : 1);
+    if (!bufb)
+        bufb = bufa;
+#ifdef USE_NEON_HELPERS
+    if (have_neon()) {
+        i = count & ~(size_t) (RAND_FILL_BLOCK - 1);
+        rand_fill_helper_neon(bufa, bufb, i, &rng);
+    }
+#endif
+    for (; i + RAND_FILL_BLOCK <= count; i += RAND_FILL_BLOCK) {
+        /* the words of a block in the same order as the NEON stores */
+        for (k = 0; k < 4; k++) {
+            rand_step(&rng);
+#if UL_LEN == 32
+            for (l = 0; l < 4; l++)
+                bufa[i + k * 4 + l] = bufb[i + k * 4 + l] = rng.w[l];
+#else
+            for (l = 0; l < 2; l++)
+                bufa[i + k * 2 + l] = bufb[i + k * 2 + l] =
+                    rng.w[2 * l] | (ul) rng.w[2 * l + 1] << 32;
+#endif
+        }
+    }
+    for (; i < count; i++)
+        bufa[i] = bufb[i] = rand_ul();
+}
+
+/*
+ * Step the generator over the values rand_fill() would store in 'count'
+ * words, so that a fill of part of a region gets the values the whole of
+ * it would have had there. The count is a multiple of RAND_FILL_BLOCK,
+ * which the chunks of the tests are too.
+ */
+static void rand_skip(size_t count) {
+    int k;
+
+    if (!count)
+        return;
+    if (!rng.seeded)
+        rand_seed(0, 0);
+    rng.avail = 0;
+    for (; count >= RAND_FILL_BLOCK; count -= RAND_FILL_BLOCK)
+        for (k = 0; k < 4; k++)
+            rand_step(&rng);
+}
+
+/*
+ * Check a region against the values rand_fill() stored, which come from
+ * the generator state that rand_fill() started out with.
+ */
+static ulv *rand_check(ulv *buf, size_t count, ul *expected) {
+    size_t i = 0, n;
+    int k, l;
+
+    rng.avail = 0;
+    count_traffic(count, 1);
+    for (; i + RAND_FILL_BLOCK <= count; i += RAND_FILL_BLOCK) {
+        for (k = 0; k < 4; k++) {
+            rand_step(&rng);
+            for (l = 0; l < (int) RAND_FILL_BLOCK / 4; l++) {
+                n = i + k * (RAND_FILL_BLOCK / 4) + l;
+#if UL_LEN == 32
+                *expected = rng.w[l];
+#else
+                *expected = rng.w[2 * l] | (ul) rng.w[2 * l + 1] << 32;
+#endif
+                if (buf[n] != *expected)
+                    return buf + n;
+            }
+        }
+    }
+    for (; i < count; i++) {
+        *expected = rand_ul();
+        if (buf[i] != *expected)
+            return buf + i;
+    }
+    return NULL;
+}
+
+/*
+ * Fill both regions with a pattern, which alternates between 'even' and
+ * 'odd' values (pass the same value twice to get a solid fill).
+ */
+static void fill_regions(ulv *bufa, ulv *bufb, size_t count,
+                         ul even, ul odd) {
+    ulv *p1 = bufa;
+    ulv *p2 = bufb;
+    size_t i = 0;
+
+    count_traffic(count, 2);
+#ifdef USE_NEON_HELPERS
+    if (have_neon_stores()) {
+        i = count & ~(size_t) 15;
+        fill_regions_helper_neon(bufa, bufb, i, even, odd);
+        p1 += i;
+        p2 += i;
+    }
+#endif
+    /* i is even, so the parity carries over */
+    kernel_fill2_pair((ul *) p1, (ul *) p2, count - i, even, odd);
+}
+
+/* fill_regions() for a single region */
+static void fill_region(ulv *buf, size_t count, ul even, ul odd) {
+    ulv *p1 = buf;
+    size_t i = 0;
+
+    count_traffic(count, 1);
+#ifdef USE_NEON_HELPERS
+    if (have_neon_stores()) {
+        /* the second store goes to the same line, it never leaves cache */
+        i = count & ~(size_t) 15;
+        fill_regions_helper_neon(buf, buf, i, even, odd);
+        p1 += i;
+    }
+#endif
+    kernel_fill1_pair((ul *) p1, count - i, even, odd);
+}
+
+/* XOR every element of both regions with 'q' */
+static void xor_regions(ulv *bufa, ulv *bufb, size_t count, ul q) {
+    ulv *p1 = bufa;
+    ulv *p2 = bufb;
+    size_t i = 0;
+
+    count_traffic(count, 4);
+#ifdef USE_NEON_HELPERS
+    if (have_neon()) {
+        i = count & ~(size_t) 15;
+        xor_regions_helper_neon(bufa, bufb, i, q);
+        p1 += i;
+        p2 += i;
+    }
+#endif
+    for (; i < count; i++) {
+        *p1++ ^= q;
+        *p2++ ^= q;
+    }
+}
+
+/*
+ * The CRC32 is used to check whether the confirmation passes of
+ * compare_regions() see the same results. Use the CRC32 instructions
+ * when the cpu has them (ARMv8, in 32-bit mode too), otherwise the
+ * slice-by-8 tables when optimizing for speed and the small bit-by-bit
+ * code when optimizing for size.
+ */
+#if !defined(__OPTIMIZE_SIZE__) && defined(__BYTE_ORDER__) && \
+      __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+
+static uint32_t crc32_table[8][256];
+static pthread_once_t crc32_table_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init_table(void)
+{
+    uint32_t c;
+    int i, k;
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ 0xedb88320 : c >> 1;
+        crc32_table[0][i] = c;
+    }
+    for (i = 0; i < 256; i++) {
+        c = crc32_table[0][i];
+        for (k = 1; k < 8; k++) {
+            c = (c >> 8) ^ crc32_table[0][c & 0xff];
+            crc32_table[k][i] = c;
+        }
+    }
+}
+
+/* Slice-by-8 CRC32 code, processing 8 bytes per table lookup round */
+static ul crc32_soft(ul crc, void *buffer, int size)
+{
+    unsigned char *buf = (void *)buffer;
+    uint32_t c = ~(uint32_t)crc, lo, hi;
+    uint32_t (*t)[256] = crc32_table;
+    pthread_once(&crc32_table_once, crc32_init_table);
+    for (; size >= 8; size -= 8, buf += 8) {
+        memcpy(&lo, buf, 4);
+        memcpy(&hi, buf + 4, 4);
+        lo ^= c;
+        c = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+            t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+            t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+            t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+    }
+    while (size--)
+        c = t[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+    return ~c;
+}
+
+#else
+
 /* Space optimized CRC32 code (without using tables) */
-static ul crc32(ul crc, void *buffer, int size)
+static ul crc32_soft(ul crc, void *buffer, int size)
 {
     unsigned char *buf = (void *)buffer;
     int bitnum;
@@ -56,170 +656,1245 @@ static ul crc32(ul crc, void *buffer, int size)
     return ~crc;
 }
 
+#endif
+
+static ul crc32(ul crc, void *buffer, int size)
+{
+#ifdef USE_NEON_HELPERS
+    if (cpu_features()->crc32)
+        return ~crc32_helper_armv8(~(uint32_t)crc, buffer, size);
+#endif
+    return crc32_soft(crc, buffer, size);
+}
+
+/*
+ * The mismatches which compare_regions_helper() came across. Once more
+ * than COMPARE_RING_SIZE were seen, the newest ones overwrite the oldest.
+ */
+#define COMPARE_RING_SIZE 64
+
+typedef struct compare_ring {
+    size_t seen;
+    size_t index[COMPARE_RING_SIZE];
+    ul va[COMPARE_RING_SIZE];
+    ul vb[COMPARE_RING_SIZE];
+} compare_ring;
+
+static void compare_ring_add(compare_ring *ring, size_t i, ul v1, ul v2) {
+    size_t k = ring->seen % COMPARE_RING_SIZE;
+
+    ring->index[k] = i;
+    ring->va[k] = v1;
+    ring->vb[k] = v2;
+    ring->seen++;
+}
+
+#ifdef USE_NEON_HELPERS
+/*
+ * The NEON helper gets COMPARE_CHUNK elements at a time, and a chunk in
+ * which it spotted anything is walked again to capture all mismatches.
+ * The values the NEON helper saw go in first, as a read failure might
+ * not show up a second time.
+ */
+#define COMPARE_CHUNK (16384 / sizeof(ul))
+
+static void compare_chunk_capture(compare_ring *ring, ulv *bufa, ulv *bufb,
+                                  size_t base, size_t n,
+                                  compare_regions_helper_result *res) {
+    size_t i;
+    ul v1, v2;
+    int j;
+
+    for (j = 0; j < 8; j++) {
+        if (res->failed_index[j] != NO_FAILED_INDEX)
+            compare_ring_add(ring, base + res->failed_index[j],
+                             res->failed_value1[j], res->failed_value2[j]);
+    }
+    for (i = base; i < base + n; i++) {
+        v1 = bufa[i];
+        v2 = bufb[i];
+        if (v1 == v2)
+            continue;
+        for (j = 0; j < 8; j++) {
+            if (base + res->failed_index[j] == i)
+                break;
+        }
+        if (j == 8)
+            compare_ring_add(ring, i, v1, v2);
+    }
+}
+#endif
+
+/*
+ * Returns the index of the last mismatch, or -1. With a ring, all of the
+ * mismatches are put into it.
+ */
 size_t compare_regions_helper(ulv *bufa, ulv *bufb, size_t count,
-                              ul *va, ul *vb, ul *crc) {
-    size_t i, result = (size_t)(-1);
+                              ul *va, ul *vb, ul *crc, compare_ring *ring) {
+    size_t i = 0, result = (size_t)(-1);
     ulv *p1 = bufa;
     ulv *p2 = bufb;
 
-#ifdef __arm__
-    if (count >= 16) {
-        int j;
-        int best_j = 0;
+    count_traffic(count, 2);
+    *crc = 0;
+#ifdef USE_NEON_HELPERS
+    if (count >= 16 && have_neon()) {
         compare_regions_helper_result res;
-        compare_regions_helper_neon(bufa, bufb, count, &res);
-        *crc = crc32(0, &res, sizeof(res));
-        for (j = 0; j < 8; j++) {
-            if (res.failed_index[j] == 0xFFFFFFFF)
-                continue;
-            if (res.failed_index[best_j] == 0xFFFFFFFF)
-                best_j = j;
-            if (res.failed_index[j] > res.failed_index[best_j]) {
-                best_j = j;
+        size_t base, n, done = count & ~(size_t) 15;
+        int j, best_j;
+
+        for (base = 0; base < done; base += n) {
+            n = done - base < COMPARE_CHUNK ? done - base : COMPARE_CHUNK;
+            compare_regions_helper_neon(bufa + base, bufb + base, n, &res);
+            best_j = -1;
+            for (j = 0; j < 8; j++) {
+                if (res.failed_index[j] == NO_FAILED_INDEX)
+                    continue;
+                if (best_j < 0 ||
+                    res.failed_index[j] > res.failed_index[best_j])
+                    best_j = j;
             }
-        }
-        if (res.failed_index[best_j] != 0xFFFFFFFF) {
+            if (best_j < 0)
+                continue;
+            *crc = crc32(*crc, &base, sizeof(base));
+            *crc = crc32(*crc, &res, sizeof(res));
             *va = res.failed_value1[best_j];
             *vb = res.failed_value2[best_j];
-            return res.failed_index[best_j];
+            result = base + res.failed_index[best_j];
+            if (ring)
+                compare_chunk_capture(ring, bufa, bufb, base, n, &res);
         }
-        return (size_t)(-1);
+        /* the NEON helper leaves the tail to us */
+        i = done;
+        p1 += done;
+        p2 += done;
     }
 #endif
 
-    for (i = 0; i < count; i++, p1++, p2++) {
+    for (; i < count; i++, p1++, p2++) {
         ul v1 = *p1, v2 = *p2;
         if (v1 != v2) {
             *va = v1;
             *vb = v2;
             result = i;
+            if (ring)
+                compare_ring_add(ring, i, v1, v2);
         }
     }
-    *crc = crc32(0, &result, sizeof(result));
+    *crc = crc32(*crc, &result, sizeof(result));
     return result;
 }
 
+/*
+ * The helpers of the tests, as --bench times them next to the tests. They
+ * return 1 for a variant which this cpu doesn't have, and -1 when the
+ * sanity check fails. The C variants mask the cpu features while they
+ * run, --bench calls them before the workers are started.
+ */
+#define BENCH_CRC_SANITY_BYTES 4096
+
+static volatile ul bench_sink;
+
+static int bench_compare(ulv *bufa, ulv *bufb, size_t count) {
+    ul va, vb, crc;
+
+    if (compare_regions_helper(bufa, bufb, count, &va, &vb, &crc, NULL) !=
+        (size_t)(-1)) {
+        fprintf(stderr, "compare_regions_helper: 0x%08lx != 0x%08lx\n",
+                va, vb);
+        return -1;
+    }
+    return 0;
+}
+
+static int bench_crc32_soft(ulv *bufa, ulv *bufb, size_t count) {
+    count_traffic(count, 1);
+    bench_sink = crc32_soft(0, (void *) bufa, count * sizeof(ul));
+    return 0;
+}
+
+#ifdef USE_NEON_HELPERS
+static int bench_compare_c(ulv *bufa, ulv *bufb, size_t count) {
+    int neon = cpu_features()->neon, result;
+
+    cpu.neon = 0;
+    result = bench_compare(bufa, bufb, count);
+    cpu.neon = neon;
+    return result;
+}
+
+static int bench_compare_neon(ulv *bufa, ulv *bufb, size_t count) {
+    if (!have_neon())
+        return 1;
+    return bench_compare(bufa, bufb, count);
+}
+
+static int bench_crc32_armv8(ulv *bufa, ulv *bufb, size_t count) {
+    size_t n = count * sizeof(ul) < BENCH_CRC_SANITY_BYTES ?
+               count * sizeof(ul) : BENCH_CRC_SANITY_BYTES;
+
+    if (!cpu_features()->crc32)
+        return 1;
+    if (crc32(0, (void *) bufa, n) != crc32_soft(0, (void *) bufa, n)) {
+        fprintf(stderr, "crc32_helper_armv8 disagrees with crc32_soft\n");
+        return -1;
+    }
+    count_traffic(count, 1);
+    bench_sink = crc32(0, (void *) bufa, count * sizeof(ul));
+    return 0;
+}
+#endif
+
+struct test memtester_bench_helpers[] = {
+#ifdef USE_NEON_HELPERS
+    { "compare C", bench_compare_c },
+    { "compare NEON", bench_compare_neon },
+    { "crc32 soft", bench_crc32_soft },
+    { "crc32 ARMv8", bench_crc32_armv8 },
+#else
+    { "compare C", bench_compare },
+    { "crc32 soft", bench_crc32_soft },
+#endif
+    { NULL, NULL }
+};
+
+/*
+ * The error journal (--journal FILE) is a file of fixed size records,
+ * mapped in, which every failure is appended to with plain stores. The
+ * pages are synced at most once every JOURNAL_SYNC_SECONDS while errors
+ * come in, and after every failed test and gpu stall, so an error storm
+ * doesn't wait for the console, and a hard hang loses at most the last
+ * second. A journal that is there already is appended to, so several runs
+ * can share one. The records are decoded with --decode-journal FILE.
+ */
+#define JOURNAL_MAGIC 0x4c4a544d /* "MTJL" */
+#define JOURNAL_VERSION 1
+#define JOURNAL_RECORDS 16384
+#define JOURNAL_SYNC_SECONDS 1
+
+#define JOURNAL_READ 0
+#define JOURNAL_WRITE 1
+#define JOURNAL_ADDRESS 2
+#define JOURNAL_GPU_STALL 3
+
+typedef struct journal_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t records;
+    uint64_t used; /* records handed out, can be more than there are */
+    uint64_t reserved[5];
+} journal_header;
+
+typedef struct journal_record {
+    uint64_t seq; /* the record number + 1, stored last */
+    double time;
+    uint64_t physaddr; /* all ones if not known */
+    uint64_t offset;
+    uint64_t actual;
+    uint64_t expected;
+    uint32_t kind;
+    char test[28];
+} journal_record;
+
+static journal_header *journal;
+static size_t journal_size;
+static time_t journal_synced;
+
+int memtester_journal_open(const char *path) {
+    size_t size = sizeof(journal_header) +
+                  JOURNAL_RECORDS * sizeof(journal_record);
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || fstat(fd, &st) ||
+        ((size_t) st.st_size < size && ftruncate(fd, size))) {
+        fprintf(stderr, "failed to open the journal %s: %s\n", path,
+                strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if ((size_t) st.st_size > size)
+        size = st.st_size;
+
+    journal = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (journal == MAP_FAILED) {
+        fprintf(stderr, "failed to map the journal %s: %s\n", path,
+                strerror(errno));
+        journal = NULL;
+        return -1;
+    }
+    journal_size = size;
+
+    if (journal->magic != JOURNAL_MAGIC ||
+        journal->version != JOURNAL_VERSION ||
+        journal->record_size != sizeof(journal_record)) {
+        memset(journal, 0, size);
+        journal->version = JOURNAL_VERSION;
+        journal->record_size = sizeof(journal_record);
+        journal->records = (size - sizeof(journal_header)) /
+                           sizeof(journal_record);
+        journal->magic = JOURNAL_MAGIC;
+        msync(journal, size, MS_SYNC);
+    }
+    printf("journaling failures to %s, %llu records so far\n", path,
+           (ull) journal->used);
+    return 0;
+}
+
+/* Push the journal out to the file, at most every JOURNAL_SYNC_SECONDS */
+void memtester_journal_sync(int force) {
+    time_t now;
+
+    if (!journal)
+        return;
+    now = time(NULL);
+    if (!force && now - journal_synced < JOURNAL_SYNC_SECONDS)
+        return;
+    journal_synced = now;
+    msync(journal, journal_size, MS_SYNC);
+}
+
+static void journal_add(const char *tname, int kind, ul actual, ul expected,
+                        ulv *p, off_t physaddr) {
+    journal_record *r;
+    uint64_t n;
+
+    if (!journal)
+        return;
+    n = __atomic_fetch_add(&journal->used, 1, __ATOMIC_RELAXED);
+    if (n >= journal->records)
+        return;
+    r = (journal_record *) (journal + 1) + n;
+    r->time = memtester_json_time();
+    r->physaddr = (uint64_t) physaddr;
+    r->offset = region_offset(p);
+    r->actual = actual;
+    r->expected = expected;
+    r->kind = kind;
+    strncpy(r->test, tname, sizeof(r->test) - 1);
+    __atomic_store_n(&r->seq, n + 1, __ATOMIC_RELEASE);
+    memtester_journal_sync(0);
+}
+
+int memtester_journal_decode(const char *path) {
+    static const char *kinds[] = { "READ", "WRITE", "ADDRESS", "GPU" };
+    journal_header h;
+    journal_record r;
+    uint64_t n, torn = 0;
+    FILE *f = fopen(path, "rb");
+
+    if (!f || fread(&h, sizeof(h), 1, f) != 1 || h.magic != JOURNAL_MAGIC ||
+        h.version != JOURNAL_VERSION ||
+        h.record_size != sizeof(journal_record)) {
+        fprintf(stderr, "%s is not a memtester journal\n", path);
+        if (f)
+            fclose(f);
+        return -1;
+    }
+    for (n = 0; n < h.used && n < h.records; n++) {
+        if (fread(&r, sizeof(r), 1, f) != 1)
+            break;
+        if (r.seq != n + 1) {
+            torn++;
+            continue;
+        }
+        r.test[sizeof(r.test) - 1] = '\0';
+        if (r.kind == JOURNAL_GPU_STALL) {
+            printf("%.3f GPU STALL: no frame for %llu ms.\n", r.time,
+                   (ull) r.actual);
+            continue;
+        }
+        printf("%.3f %s FAILURE: 0x%08llx != 0x%08llx at ", r.time,
+               r.kind < 4 ? kinds[r.kind] : "?", (ull) r.actual,
+               (ull) r.expected);
+        if (r.physaddr != (uint64_t) -1)
+            printf("physical address 0x%08llx", (ull) r.physaddr);
+        else
+            printf("offset 0x%08llx", (ull) r.offset);
+        printf(" (%s).\n", r.test);
+    }
+    printf("%llu records", (ull) (h.used < h.records ? h.used : h.records));
+    if (torn)
+        printf(", %llu of them not written completely", (ull) torn);
+    if (h.used > h.records)
+        printf(", %llu more did not fit", (ull) (h.used - h.records));
+    printf("\n");
+    fclose(f);
+    return 0;
+}
+
+/* One --json record per failure; kind is "read", "write" or "address" */
+static void json_failure(const char *tname, const char *kind,
+                         ul v1, ul v2, ulv *p, off_t physaddr) {
+    if (!memtester_json)
+        return;
+    fprintf(memtester_json, "{\"type\": \"error\", \"time\": %.3f, "
+            "\"test\": \"%s\", \"kind\": \"%s\", \"actual\": "
+            "\"0x%08lx\", \"expected\": \"0x%08lx\", \"offset\": "
+            "\"0x%08lx\"", memtester_json_time(), tname, kind, v1, v2,
+            region_offset(p));
+    if (physaddr != (off_t) -1)
+        fprintf(memtester_json, ", \"physaddr\": \"0x%08lx\"",
+                (ul) physaddr);
+    fprintf(memtester_json, "}\n");
+    fflush(memtester_json);
+}
+
+static void report_failure(const char *tname, int write_error,
+                           ul v1, ul v2, ulv *p) {
+    off_t physaddr = memtester_physaddr(p);
+    char where[128];
+
+    memtester_has_found_errors = 1;
+    if (physaddr != (off_t) -1) {
+        memtester_dram_location(physaddr, where, sizeof(where));
+        fprintf(stderr, 
+                "%s FAILURE: 0x%08lx != 0x%08lx at physical address "
+                "0x%08lx%s (%s).\n",
+                write_error ? "WRITE" : "READ",
+                v1, v2, (ul) physaddr, where, tname);
+        if (memtester_syslog)
+            syslog(LOG_ERR, "%s FAILURE: 0x%08lx != 0x%08lx at physical "
+                   "address 0x%08lx%s (%s)", write_error ? "WRITE" : "READ",
+                   v1, v2, (ul) physaddr, where, tname);
+    } else {
+        fprintf(stderr, 
+                "%s FAILURE: 0x%08lx != 0x%08lx at offset 0x%08lx (%s).\n",
+                write_error ? "WRITE" : "READ",
+                v1, v2, region_offset(p), tname);
+        if (memtester_syslog)
+            syslog(LOG_ERR, "%s FAILURE: 0x%08lx != 0x%08lx at offset "
+                   "0x%08lx (%s)", write_error ? "WRITE" : "READ",
+                   v1, v2, region_offset(p), tname);
+    }
+    json_failure(tname, write_error ? "write" : "read", v1, v2, p, physaddr);
+    journal_add(tname, write_error ? JOURNAL_WRITE : JOURNAL_READ, v1, v2, p,
+                physaddr);
+    memtester_bad_page(p);
+    fflush(stderr);
+    /* the journal is what survives a hang, the console can take its time */
+    if (!journal)
+        fsync(fileno(stderr));
+    if (memtester_early_exit)
+        exit(4);
+}
+
+/*
+ * lima-memtester found no frame reaching the screen for 'seconds'. It
+ * counts as a failure of its own, with no memory location to it.
+ */
+void memtester_gpu_stall(double seconds) {
+    memtester_has_found_errors = 1;
+    memtester_gpu_failed = 1;
+    fprintf(stderr, "GPU STALL: no frame for %.1f s.\n", seconds);
+    if (memtester_json) {
+        fprintf(memtester_json, "{\"type\": \"error\", \"time\": %.3f, "
+                "\"kind\": \"gpu_stall\", \"seconds\": %.1f}\n",
+                memtester_json_time(), seconds);
+        fflush(memtester_json);
+    }
+    journal_add("GPU Stall", JOURNAL_GPU_STALL, (ul) (seconds * 1000), 0,
+                memtester_base, (off_t) -1);
+    memtester_journal_sync(1);
+    if (memtester_early_exit)
+        exit(8);
+}
+
+/*
+ * The error histogram adds up the failing bits of every mismatch per DQ
+ * line and byte lane of the DRAM bus (MEMTESTER_BUS_WIDTH bits wide) and
+ * per page, so that a bad data line or a weak chip stands out in the
+ * summary after each loop. It is only updated once a compare has found a
+ * failure, so it costs nothing while the memory is fine. A mismatch
+ * between the two halves is counted at the page of the first one.
+ */
+#define HISTOGRAM_PAGES 16
+
+static struct error_histogram {
+    ull words;
+    ull bits;
+    ull dq[64];
+    ull lanes[8];
+    struct {
+        off_t page;
+        ull count;
+    } pages[HISTOGRAM_PAGES];
+    int npages;
+    ull other_pages;
+} histogram;
+/* the same since the start, for the metrics */
+static struct {
+    ull words;
+    ull bits;
+    ull dq[64];
+} histogram_totals;
+static pthread_mutex_t histogram_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void histogram_add(ulv *p, ul diff) {
+    int lanes = memtester_bus_width / 8;
+    off_t page = memtester_physaddr(p);
+    unsigned int byte;
+    int k, b, i;
+
+    if (!diff)
+        return;
+    if (page == (off_t) -1)
+        page = (off_t) region_offset(p);
+    page &= ~(off_t) (sysconf(_SC_PAGE_SIZE) - 1);
+
+    pthread_mutex_lock(&histogram_lock);
+    histogram.words++;
+    histogram_totals.words++;
+    for (k = 0; k < UL_LEN / 8; k++) {
+        /* byte k of the word is at p + k on little endian */
+        byte = (diff >> (k * 8)) & 0xff;
+        if (!byte)
+            continue;
+        i = ((size_t) p + k) % lanes;
+        histogram.lanes[i]++;
+        for (b = 0; b < 8; b++) {
+            if ((byte >> b) & 1) {
+                histogram.bits++;
+                histogram.dq[i * 8 + b]++;
+                histogram_totals.bits++;
+                histogram_totals.dq[i * 8 + b]++;
+            }
+        }
+    }
+    for (i = 0; i < histogram.npages; i++) {
+        if (histogram.pages[i].page == page)
+            break;
+    }
+    if (i < histogram.npages) {
+        histogram.pages[i].count++;
+    } else if (histogram.npages < HISTOGRAM_PAGES) {
+        histogram.pages[i].page = page;
+        histogram.pages[i].count = 1;
+        histogram.npages++;
+    } else {
+        histogram.other_pages++;
+    }
+    pthread_mutex_unlock(&histogram_lock);
+}
+
+/* Print the histogram, if there were failures, and clear it */
+void error_histogram_report(void) {
+    int lanes = memtester_bus_width / 8;
+    int i;
+
+    pthread_mutex_lock(&histogram_lock);
+    if (!histogram.words) {
+        pthread_mutex_unlock(&histogram_lock);
+        return;
+    }
+    printf("  Error histogram: %llu words, %llu bits\n", histogram.words,
+           histogram.bits);
+    printf("    DQ lines:  ");
+    for (i = 0; i < lanes * 8; i++) {
+        if (histogram.dq[i])
+            printf(" DQ%d %llu", i, histogram.dq[i]);
+    }
+    printf("\n    byte lanes:");
+    for (i = 0; i < lanes; i++)
+        printf(" %d: %llu", i, histogram.lanes[i]);
+    printf("\n    pages:     ");
+    for (i = 0; i < histogram.npages; i++)
+        printf(" 0x%08llx %llu", (ull) histogram.pages[i].page,
+               histogram.pages[i].count);
+    if (histogram.other_pages)
+        printf(" other %llu", histogram.other_pages);
+    printf("\n");
+    memset(&histogram, 0, sizeof(histogram));
+    pthread_mutex_unlock(&histogram_lock);
+}
+
+/* The failing words since the start */
+ull error_histogram_words(void) {
+    ull words;
+
+    pthread_mutex_lock(&histogram_lock);
+    words = histogram_totals.words;
+    pthread_mutex_unlock(&histogram_lock);
+    return words;
+}
+
+/* The failing words and bits per DQ line since the start, for Prometheus */
+void error_histogram_metrics(FILE *f) {
+    int i;
+
+    pthread_mutex_lock(&histogram_lock);
+    fprintf(f, "# HELP memtester_failing_words_total Words found "
+            "corrupted\n# TYPE memtester_failing_words_total counter\n"
+            "memtester_failing_words_total %llu\n", histogram_totals.words);
+    fprintf(f, "# HELP memtester_failing_bits_total Bits found flipped, "
+            "per DQ line\n# TYPE memtester_failing_bits_total counter\n");
+    for (i = 0; i < memtester_bus_width; i++)
+        fprintf(f, "memtester_failing_bits_total{dq=\"%d\"} %llu\n", i,
+                histogram_totals.dq[i]);
+    pthread_mutex_unlock(&histogram_lock);
+}
+
+/* Add every mismatch between the regions to the histogram */
+static void histogram_add_regions(ulv *bufa, ulv *bufb, size_t count) {
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        histogram_add(bufa + i, bufa[i] ^ bufb[i]);
+}
+
+/*
+ * A region that fits into the caches a few times over may still be in
+ * them when it is checked, and the check would test the cache instead of
+ * the DRAM. Such regions get evicted before they are read back, by reading
+ * a buffer of our own, twice the size of the largest cache, which is taken
+ * from sysfs (1MB if it isn't there).
+ */
+#define EVICT_REGION_FACTOR 4
+#define EVICT_LINE_BYTES 64
+#define EVICT_DEFAULT_CACHE (1024 * 1024)
+
+static size_t evict_cache_bytes;
+static pthread_once_t evict_once = PTHREAD_ONCE_INIT;
+static __thread ulv *evict_buf;
+static volatile ul evict_sink;
+
+static void evict_detect(void) {
+    char path[64], line[32], *end;
+    size_t bytes;
+    FILE *f;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu0/cache/index%d/size", i);
+        f = fopen(path, "r");
+        if (!f)
+            break;
+        if (fgets(line, sizeof(line), f)) {
+            bytes = strtoul(line, &end, 10);
+            if (*end == 'K')
+                bytes <<= 10;
+            else if (*end == 'M')
+                bytes <<= 20;
+            if (bytes > evict_cache_bytes)
+                evict_cache_bytes = bytes;
+        }
+        fclose(f);
+    }
+    if (!evict_cache_bytes)
+        evict_cache_bytes = EVICT_DEFAULT_CACHE;
+}
+
+/* Read a line of every EVICT_LINE_BYTES of the eviction buffer */
+static void cache_evict(void) {
+    size_t i, n;
+    ul sum = 0;
+
+    pthread_once(&evict_once, evict_detect);
+    n = 2 * evict_cache_bytes / sizeof(ul);
+    if (!evict_buf) {
+        evict_buf = malloc(n * sizeof(ul));
+        if (!evict_buf)
+            return;
+        memset((void *) evict_buf, 0, n * sizeof(ul));
+    }
+    for (i = 0; i < n; i += EVICT_LINE_BYTES / sizeof(ul))
+        sum += evict_buf[i];
+    evict_sink = sum;
+}
+
+/* Evict before checking a region of this many bytes, if it is small */
+static void cache_evict_small(size_t bytes) {
+    pthread_once(&evict_once, evict_detect);
+    if (bytes < EVICT_REGION_FACTOR * evict_cache_bytes)
+        cache_evict();
+}
+
+/*
+ * A mismatch is confirmed by reading the page around it CONFIRM_PASSES
+ * more times, with the caches evicted in between. If every pass sees the
+ * same, the wrong value is in the DRAM (a WRITE failure), otherwise it only
+ * came up while reading. MEMTESTER_FULL_CONFIRM brings back the rescans
+ * of the whole region instead, which cost a lot of time on big buffers.
+ */
+#define CONFIRM_PASSES 64
+
+int memtester_full_confirm = 0;
+
+/* With --bench, compare_regions() is down to compare_regions_sanity() */
+int memtester_bench = 0;
+
+/* The page around buf[index], as [start, end) indexes of the region */
+static void confirm_page(ulv *buf, size_t count, size_t index,
+                         size_t *start, size_t *end) {
+    size_t pagesize = sysconf(_SC_PAGE_SIZE);
+    size_t first = (size_t) (buf + index) & ~(pagesize - 1);
+
+    *start = first > (size_t) buf ? (first - (size_t) buf) / sizeof(ul) : 0;
+    *end = (first + pagesize - (size_t) buf) / sizeof(ul);
+    if (*end > count)
+        *end = count;
+}
+
+/* Returns 1 if the page around the mismatch reads the same every time */
+static int confirm_regions(ulv *bufa, ulv *bufb, size_t count, size_t index,
+                           ul va, ul vb) {
+    size_t start, end, i;
+    ul crc, first = 0, v1, v2;
+    int j;
+
+    confirm_page(bufa, count, index, &start, &end);
+    for (j = 0; j < CONFIRM_PASSES; j++) {
+        cache_evict();
+        if (bufa[index] != va || bufb[index] != vb)
+            return 0;
+        crc = 0;
+        for (i = start; i < end; i++) {
+            v1 = bufa[i];
+            v2 = bufb[i];
+            if (v1 != v2) {
+                crc = crc32(crc, &i, sizeof(i));
+                crc = crc32(crc, &v1, sizeof(v1));
+                crc = crc32(crc, &v2, sizeof(v2));
+            }
+        }
+        if (j == 0)
+            first = crc;
+        else if (crc != first)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Report the other mismatches in the ring, oldest first. They are
+ * confirmed once per page, and share the result of the page.
+ */
+static void compare_ring_report(const char *tname, compare_ring *ring,
+                                ulv *bufa, ulv *bufb, size_t count,
+                                size_t index1, int write_error) {
+    size_t k, n, i, start, end;
+    size_t first = ring->seen > COMPARE_RING_SIZE ?
+                   ring->seen - COMPARE_RING_SIZE : 0;
+    int page_error = write_error;
+
+    confirm_page(bufa, count, index1, &start, &end);
+    for (n = first; n < ring->seen; n++) {
+        k = n % COMPARE_RING_SIZE;
+        i = ring->index[k];
+        if (i == index1)
+            continue;
+        if (!memtester_full_confirm && (i < start || i >= end)) {
+            confirm_page(bufa, count, i, &start, &end);
+            page_error = confirm_regions(bufa, bufb, count, i,
+                                         ring->va[k], ring->vb[k]);
+        }
+        report_failure(tname, page_error, ring->va[k], ring->vb[k],
+                       bufa + i);
+    }
+    if (first)
+        fprintf(stderr, "  ... and %lu earlier mismatches (%s).\n",
+                (ul) first, tname);
+
+    /* the whole story is in the ring, unless it overflowed */
+    if (first) {
+        histogram_add_regions(bufa, bufb, count);
+        return;
+    }
+    for (n = 0; n < ring->seen; n++)
+        histogram_add(bufa + ring->index[n], ring->va[n] ^ ring->vb[n]);
+}
+
+/*
+ * One word of every page and the last one, enough to tell that a test's
+ * kernel wrote the same to both halves, without costing any bandwidth.
+ */
+static int compare_regions_sanity(const char *tname, ulv *bufa, ulv *bufb,
+                                  size_t count) {
+    size_t i, step = sysconf(_SC_PAGE_SIZE) / sizeof(ul);
+
+    for (i = 0; i < count; i += step) {
+        if (bufa[i] != bufb[i])
+            break;
+    }
+    if (i >= count) {
+        i = count - 1;
+        if (bufa[i] == bufb[i])
+            return 0;
+    }
+    report_failure(tname, 1, bufa[i], bufb[i], bufa + i);
+    return -1;
+}
+
 int compare_regions(const char *tname, ulv *bufa, ulv *bufb, size_t count) {
     size_t i;
-    off_t physaddr;
     size_t index1, index2;
     ul v1a, v1b, v2a, v2b;
     ul crc1, crc2;
     ul write_error = 1;
+    compare_ring ring;
 
-    index1 = compare_regions_helper(bufa, bufb, count, &v1a, &v1b, &crc1);
+    if (memtester_bench)
+        return compare_regions_sanity(tname, bufa, bufb, count);
+
+    ring.seen = 0;
+    cache_evict_small(2 * count * sizeof(ul));
+    index1 = compare_regions_helper(bufa, bufb, count, &v1a, &v1b, &crc1,
+                                    &ring);
     if (index1 == (size_t)(-1))
         return 0;
 
+    if (!memtester_full_confirm) {
+        write_error = confirm_regions(bufa, bufb, count, index1, v1a, v1b);
+        report_failure(tname, write_error, v1a, v1b, bufa + index1);
+        compare_ring_report(tname, &ring, bufa, bufb, count, index1,
+                            write_error);
+        return -1;
+    }
+
     /* additional passes to confirm if the results are the same */
     for (i = 0; i < 32; i++) {
-        index2 = compare_regions_helper(bufa, bufb, count, &v2a, &v2b, &crc2);
+        index2 = compare_regions_helper(bufa, bufb, count, &v2a, &v2b, &crc2,
+                                        NULL);
         if (index1 != index2 || crc1 != crc2) {
             write_error = 0;
             break;
         }
     }
 
-    memtester_has_found_errors = 1;
-    if (use_phys) {
-        physaddr = physaddrbase + (ul)(index1 * sizeof(ul));
+    report_failure(tname, write_error, v1a, v1b, bufa + index1);
+    compare_ring_report(tname, &ring, bufa, bufb, count, index1,
+                        write_error);
+
+    /* printf("Skipping to next test..."); */
+    return -1;
+}
+
+/*
+ * Re-read a bad location to tell sporadic read failures from bad cells,
+ * with the caches flushed in between, see confirm_regions().
+ */
+static void report_mismatch(const char *tname, ulv *bad, ul expected) {
+    ul v = *bad;
+    int j;
+
+    for (j = 0; j < CONFIRM_PASSES; j++) {
+        cache_evict();
+        if (*bad != v)
+            break;
+    }
+    report_failure(tname, j == CONFIRM_PASSES, v, expected, bad);
+    histogram_add(bad, v ^ expected);
+}
+
+/* The values memtester_check_value() compares against, all the same */
+#define CHECK_VALUE_CHUNK 1024
+
+/*
+ * For memory that was written by someone else, like the gpu: check that
+ * all of it holds the expected value. Stops at the first mismatch. The
+ * NEON compare of compare_regions_helper() goes against a chunk of the
+ * expected value, which stays in the cache.
+ */
+int memtester_check_value(const char *tname, ulv *buf, size_t count,
+                          ul expected) {
+    size_t i = 0;
+
+    cache_evict_small(count * sizeof(ul));
+    count_traffic(count, 1);
+#ifdef USE_NEON_HELPERS
+    if (count >= 16 && have_neon()) {
+        compare_regions_helper_result res;
+        ul ref[CHECK_VALUE_CHUNK];
+        size_t base, n, done = count & ~(size_t) 15;
+        int j;
+
+        for (j = 0; j < CHECK_VALUE_CHUNK; j++)
+            ref[j] = expected;
+        for (base = 0; base < done; base += n) {
+            n = done - base < CHECK_VALUE_CHUNK ? done - base :
+                                                  CHECK_VALUE_CHUNK;
+            compare_regions_helper_neon(buf + base, ref, n, &res);
+            /* each lane reports its last mismatch, take the lowest */
+            for (i = n, j = 0; j < 8; j++)
+                if (res.failed_index[j] != NO_FAILED_INDEX &&
+                    res.failed_index[j] < i)
+                    i = res.failed_index[j];
+            if (i < n) {
+                report_mismatch(tname, buf + base + i, expected);
+                return -1;
+            }
+        }
+        i = done;
+    }
+#endif
+    /* one value in both the even and the odd elements */
+    i += kernel_check_pair((const ul *) buf + i, count - i, expected,
+                           expected);
+    if (i < count) {
+        report_mismatch(tname, buf + i, expected);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Write the next pattern into both regions, while checking that they
+ * still hold the previous one. Every location is read and written in
+ * the same sweep, which halves the memory traffic of a separate fill
+ * and compare. The sweep stops at the first mismatch.
+ */
+static int verify_fill_regions(const char *tname, ulv *bufa, ulv *bufb,
+                               size_t count, ul old_even, ul old_odd,
+                               ul even, ul odd) {
+    ulv *p1 = bufa;
+    ulv *p2 = bufb;
+    ulv *bad;
+    ul expected;
+    size_t i;
+
+    count_traffic(count, 4);
+    for (i = 0; i < count; i++, p1++, p2++) {
+        expected = (i % 2) == 0 ? old_even : old_odd;
+        if (*p1 != expected) {
+            bad = p1;
+            goto failed;
+        }
+        if (*p2 != expected) {
+            bad = p2;
+            goto failed;
+        }
+        *p1 = *p2 = (i % 2) == 0 ? even : odd;
+    }
+    return 0;
+
+failed:
+    report_mismatch(tname, bad, expected);
+    return -1;
+}
+
+/*
+ * The single region engine: instead of comparing two copies, the values
+ * are generated again from the pattern and the index. So the whole buffer
+ * gets tested, with half the reads, and a failure is always in the one
+ * location that is reported.
+ */
+static int check_region(const char *tname, ulv *buf, size_t count,
+                        ul even, ul odd) {
+    size_t i;
+
+    cache_evict_small(count * sizeof(ul));
+    count_traffic(count, 1);
+    i = kernel_check_pair((const ul *) buf, count, even, odd);
+    if (i < count) {
+        report_mismatch(tname, buf + i, (i % 2) == 0 ? even : odd);
+        return -1;
+    }
+    return 0;
+}
+
+/* verify_fill_regions() for a single region */
+static int verify_fill_region(const char *tname, ulv *buf, size_t count,
+                              ul old_even, ul old_odd, ul even, ul odd) {
+    ulv *p1 = buf;
+    ul expected;
+    size_t i;
+
+    count_traffic(count, 2);
+    for (i = 0; i < count; i++, p1++) {
+        expected = (i % 2) == 0 ? old_even : old_odd;
+        if (*p1 != expected) {
+            report_mismatch(tname, p1, expected);
+            return -1;
+        }
+        *p1 = (i % 2) == 0 ? even : odd;
+    }
+    return 0;
+}
+
+typedef struct pattern_state {
+    int valid;
+    ul even;
+    ul odd;
+} pattern_state;
+
+/*
+ * One step of a pattern test. Normally this fills both regions and
+ * compares them, in the fused mode the check of the previous step is
+ * folded into the fill of this one (see verify_fill_regions). Without
+ * bufb, bufa is checked against the pattern itself (see check_region).
+ */
+static int pattern_step(const char *tname, pattern_state *prev,
+                        unsigned int j, ulv *bufa, ulv *bufb, size_t count,
+                        ul even, ul odd) {
+    progress_phase("setting", j);
+    if (!memtester_fused) {
+        if (!bufb) {
+            fill_region(bufa, count, even, odd);
+            progress_phase("testing", j);
+            return check_region(tname, bufa, count, even, odd);
+        }
+        fill_regions(bufa, bufb, count, even, odd);
+        progress_phase("testing", j);
+        return compare_regions(tname, bufa, bufb, count);
+    }
+
+    if (prev->valid) {
+        if (!bufb ? verify_fill_region(tname, bufa, count, prev->even,
+                                       prev->odd, even, odd)
+                  : verify_fill_regions(tname, bufa, bufb, count,
+                                        prev->even, prev->odd, even, odd))
+            return -1;
+    } else if (!bufb) {
+        fill_region(bufa, count, even, odd);
+    } else {
+        fill_regions(bufa, bufb, count, even, odd);
+    }
+    prev->valid = 1;
+    prev->even = even;
+    prev->odd = odd;
+    return 0;
+}
+
+/* Check the last pattern written in the fused mode */
+static int pattern_finish(const char *tname, pattern_state *prev,
+                          ulv *bufa, ulv *bufb, size_t count) {
+    if (!memtester_fused || !prev->valid)
+        return 0;
+    if (!bufb)
+        return check_region(tname, bufa, count, prev->even, prev->odd);
+    return compare_regions(tname, bufa, bufb, count);
+}
+
+/*
+ * The stuck address test stores every element's own address into it,
+ * XORed with 'even' or 'odd' depending on the index. It walks the buffer
+ * in chunks, so that the progress indicator gets a chance in between.
+ * The chunk size keeps the index parity intact.
+ */
+#define STUCK_ADDRESS_CHUNK (256 * 1024)
+
+static void stuck_address_fill(ulv *buf, size_t count, ul even, ul odd) {
+    ulv *p1 = buf;
+    size_t i = 0;
+
+    count_traffic(count, 1);
+#ifdef USE_NEON_HELPERS
+    if (have_neon_stores()) {
+        i = count & ~(size_t) 15;
+        stuck_address_fill_helper_neon(buf, i, even, odd);
+        p1 += i;
+    }
+#endif
+    kernel_fill1_addr((ul *) p1, count - i, even, odd);
+}
+
+/* Returns the first element which doesn't match, or NULL */
+static ulv *stuck_address_check(ulv *buf, size_t count, ul even, ul odd) {
+    ulv *p1 = buf;
+    size_t i = 0;
+    int flagged = 0;
+
+    count_traffic(count, 1);
+#ifdef USE_NEON_HELPERS
+    if (have_neon()) {
+        i = count & ~(size_t) 15;
+        /* Only look for the failed element when there is one */
+        if (stuck_address_check_helper_neon(buf, i, even, odd)) {
+            flagged = 1;
+            i = 0;
+        } else {
+            p1 += i;
+        }
+    }
+#endif
+    i += kernel_check_addr((const ul *) p1, count - i, even, odd);
+    if (i < count)
+        return buf + i;
+    /* A failure which didn't show up again, report its chunk */
+    return flagged ? buf : NULL;
+}
+
+static void stuck_address_report(ulv *p, int line, ul actual, ul expected) {
+    off_t physaddr = memtester_physaddr(p);
+    char where[128], bit[32] = "";
+
+    if (line >= 0)
+        snprintf(bit, sizeof(bit), " %d", line);
+    if (physaddr != (off_t) -1) {
+        memtester_dram_location(physaddr, where, sizeof(where));
         fprintf(stderr, 
-                "%s FAILURE: 0x%08lx != 0x%08lx at physical address "
-                "0x%08lx (%s).\n",
-                write_error ? "WRITE" : "READ",
-                v1a, v1b, physaddr, tname);
+                "FAILURE: possible bad address line%s at physical "
+                "address 0x%08lx%s.\n", 
+                bit, (ul) physaddr, where);
     } else {
         fprintf(stderr, 
-                "%s FAILURE: 0x%08lx != 0x%08lx at offset 0x%08lx (%s).\n",
-                write_error ? "WRITE" : "READ",
-                v1a, v1b, (ul)(index1 * sizeof(ul)), tname);
+                "FAILURE: possible bad address line%s at offset "
+                "0x%08lx.\n", 
+                bit, region_offset(p));
     }
-    fflush(stderr);
-    fsync(fileno(stderr));
-    if (memtester_early_exit)
-        exit(4);
+    json_failure("Stuck Address", "address", actual, expected, p, physaddr);
+    journal_add("Stuck Address", JOURNAL_ADDRESS, actual, expected, p,
+                physaddr);
+    printf("Skipping to next test...\n");
+    fflush(stdout);
+}
+
+/* One fill and check of the whole buffer, returns the bad element or NULL */
+static ulv *stuck_address_pass(ulv *bufa, size_t count, unsigned int j,
+                               ul *even, ul *odd) {
+    ulv *p1;
+    size_t i, n;
+
+    /* Even passes store the plain address at even indexes */
+    *even = (j % 2) == 0 ? 0 : ~(ul) 0;
+    *odd = ~*even;
+    for (i = 0; i < count; i += n) {
+        progress_phase("setting", j);
+        n = count - i < STUCK_ADDRESS_CHUNK ? count - i : STUCK_ADDRESS_CHUNK;
+        stuck_address_fill(bufa + i, n, *even, *odd);
+    }
+    for (i = 0, p1 = NULL; i < count && !p1; i += n) {
+        progress_phase("testing", j);
+        n = count - i < STUCK_ADDRESS_CHUNK ? count - i : STUCK_ADDRESS_CHUNK;
+        p1 = stuck_address_check(bufa + i, n, *even, *odd);
+    }
+    return p1;
+}
+
+/*
+ * The address lines are checked by walking them: one location for every
+ * address bit, at the physical address of the start of the region with
+ * just that bit flipped (at the power of two offsets without a pagemap).
+ * All of them get a pattern, then each in turn the inverse, and the others
+ * must not change. A line that is stuck, or shorted to another, makes two
+ * of the locations the same. That is a few writes per line instead of
+ * whole buffer sweeps, with the caches evicted before every check, and
+ * one sweep of the full test follows for the faults in between.
+ * MEMTESTER_FULL_STUCK_ADDRESS brings back the 16 sweeps.
+ */
+#define ADDRESS_LINES (sizeof(off_t) * 8 - 1)
 
-    /* printf("Skipping to next test..."); */
-    return -1;
+int memtester_full_stuck_address = 0;
+
+/* Returns the number of locations, with the line of each in lines[] */
+static int address_lines_collect(ulv *bufa, size_t count, ulv **locs,
+                                 int *lines) {
+    off_t physaddr = memtester_physaddr(bufa);
+    unsigned int b;
+    int n = 0;
+    ulv *q;
+
+    for (b = 0; (1UL << b) < sizeof(ul); b++)
+        ;
+    for (; b < ADDRESS_LINES; b++) {
+        if (physaddr != (off_t) -1)
+            q = memtester_virt(physaddr ^ ((off_t) 1 << b));
+        else if (b < sizeof(size_t) * 8 &&
+                 ((size_t) 1 << b) / sizeof(ul) < count)
+            q = bufa + ((size_t) 1 << b) / sizeof(ul);
+        else
+            break;
+        if (!q || q < bufa || q >= bufa + count)
+            continue;
+        locs[n] = q;
+        lines[n++] = b;
+    }
+    return n;
 }
 
-int test_stuck_address(ulv *bufa, size_t count) {
-    ulv *p1 = bufa;
-    unsigned int j;
-    size_t i;
-    off_t physaddr;
+static int address_lines_walk(ulv *bufa, size_t count) {
+    ulv *locs[ADDRESS_LINES + 1];
+    int lines[ADDRESS_LINES + 1];
+    ul pattern = (ul) UL_ONEBITS / 3, anti = ~pattern;
+    int n, i, t;
 
-    printf("           ");
-    fflush(stdout);
-    for (j = 0; j < 16; j++) {
-        printf("\b\b\b\b\b\b\b\b\b\b\b");
-        p1 = (ulv *) bufa;
-        printf("setting %3u", j);
-        fflush(stdout);
-        for (i = 0; i < count; i++) {
-            *p1 = ((j + i) % 2) == 0 ? (ul) p1 : ~((ul) p1);
-            *p1++;
-        }
-        printf("\b\b\b\b\b\b\b\b\b\b\b");
-        printf("testing %3u", j);
-        fflush(stdout);
-        p1 = (ulv *) bufa;
-        for (i = 0; i < count; i++, p1++) {
-            if (*p1 != (((j + i) % 2) == 0 ? (ul) p1 : ~((ul) p1))) {
-                if (use_phys) {
-                    physaddr = physaddrbase + (i * sizeof(ul));
-                    fprintf(stderr, 
-                            "FAILURE: possible bad address line at physical "
-                            "address 0x%08lx.\n", 
-                            physaddr);
-                } else {
-                    fprintf(stderr, 
-                            "FAILURE: possible bad address line at offset "
-                            "0x%08lx.\n", 
-                            (ul) (i * sizeof(ul)));
-                }
-                printf("Skipping to next test...\n");
-                fflush(stdout);
+    /* the start of the region is locs[n], without a line of its own */
+    n = address_lines_collect(bufa, count, locs, lines);
+    locs[n] = bufa;
+    lines[n] = -1;
+    for (i = 0; i <= n; i++)
+        *locs[i] = pattern;
+    for (t = 0; t <= n; t++) {
+        *locs[t] = anti;
+        cache_evict();
+        for (i = 0; i <= n; i++) {
+            if (i != t && *locs[i] != pattern) {
+                stuck_address_report(locs[i], lines[t] >= 0 ? lines[t]
+                                     : lines[i], *locs[i], pattern);
                 return -1;
             }
         }
+        *locs[t] = pattern;
     }
-    printf("\b\b\b\b\b\b\b\b\b\b\b           \b\b\b\b\b\b\b\b\b\b\b");
-    fflush(stdout);
     return 0;
 }
 
+int test_stuck_address(ulv *bufa, size_t count) {
+    ulv *p1;
+    unsigned int j, passes = memtester_full_stuck_address ? 16 : 1;
+    ul even, odd;
+
+    progress_begin();
+    progress_phase("walking", 0);
+    if (!memtester_full_stuck_address && address_lines_walk(bufa, count))
+        return -1;
+    for (j = 0; j < passes; j++) {
+        p1 = stuck_address_pass(bufa, count, j, &even, &odd);
+        if (p1) {
+            stuck_address_report(p1, -1, *p1,
+                                 (ul) p1 ^ ((p1 - bufa) % 2 ? odd : even));
+            return -1;
+        }
+    }
+    progress_end();
+    return 0;
+}
+
+#define RANDOM_VALUE_CHUNK (64 * 1024)
+
 int test_random_value(ulv *bufa, ulv *bufb, size_t count) {
-    ulv *p1 = bufa;
-    ulv *p2 = bufb;
-    ul j = 0;
-    size_t i;
+    rand_state start;
+    ul j = 0, expected;
+    size_t i, n;
+    ulv *bad;
 
-    putchar(' ');
-    fflush(stdout);
-    for (i = 0; i < count; i++) {
-        *p1++ = *p2++ = rand_ul();
-        if (!(i % PROGRESSOFTEN)) {
-            putchar('\b');
-            putchar(progress[++j % PROGRESSLEN]);
-            fflush(stdout);
+    rand_skip(memtester_window_before);
+    start = rng;
+    progress_spin_begin();
+    for (i = 0; i < count; i += n) {
+        n = count - i < RANDOM_VALUE_CHUNK ? count - i : RANDOM_VALUE_CHUNK;
+        rand_fill(bufa + i, bufb ? bufb + i : NULL, n);
+        progress_spin(++j);
+    }
+    progress_spin_end();
+    if (bufb)
+        return compare_regions("random_value", bufa, bufb, count);
+
+    /* the same chunks, from the same generator state */
+    cache_evict_small(count * sizeof(ul));
+    rng = start;
+    if (!rng.seeded)
+        rand_seed(0, 0);
+    for (i = 0; i < count; i += n) {
+        n = count - i < RANDOM_VALUE_CHUNK ? count - i : RANDOM_VALUE_CHUNK;
+        bad = rand_check(bufa + i, n, &expected);
+        if (bad) {
+            report_mismatch("random_value", bad, expected);
+            return -1;
         }
     }
-    printf("\b \b");
-    fflush(stdout);
-    return compare_regions("random_value", bufa, bufb, count);
+    return 0;
 }
 
 int test_xor_comparison(ulv *bufa, ulv *bufb, size_t count) {
-    ulv *p1 = bufa;
-    ulv *p2 = bufb;
-    size_t i;
     ul q = rand_ul();
 
-    for (i = 0; i < count; i++) {
-        *p1++ ^= q;
-        *p2++ ^= q;
-    }
+    xor_regions(bufa, bufb, count, q);
     return compare_regions("xor", bufa, bufb, count);
 }
 
@@ -229,6 +1904,7 @@ int test_sub_comparison(ulv *bufa, ulv *bufb, size_t count) {
     size_t i;
     ul q = rand_ul();
 
+    count_traffic(count, 4);
     for (i = 0; i < count; i++) {
         *p1++ -= q;
         *p2++ -= q;
@@ -242,6 +1918,7 @@ int test_mul_comparison(ulv *bufa, ulv *bufb, size_t count) {
     size_t i;
     ul q = rand_ul();
 
+    count_traffic(count, 4);
     for (i = 0; i < count; i++) {
         *p1++ *= q;
         *p2++ *= q;
@@ -249,19 +1926,76 @@ int test_mul_comparison(ulv *bufa, ulv *bufb, size_t count) {
     return compare_regions("mul", bufa, bufb, count);
 }
 
-int test_div_comparison(ulv *bufa, ulv *bufb, size_t count) {
+/*
+ * Cortex-A7/A8 have no divide instruction, and a libgcc division per
+ * element kept the divide test from ever reaching memory speed. The
+ * division by the test's divisor is done as a multiply by its reciprocal
+ * instead (Granlund and Montgomery), which gives the exact quotient of
+ * every value: with l = ceil(log2(q)) and m = 2^N * (2^l - q) / q + 1,
+ * n / q is ((n - hi(m * n)) >> 1 + hi(m * n)) >> (l - 1). The shifts are
+ * 0 and 0 for q = 1, where m is 1. On AArch64 the C loop compiles to
+ * umulh, so only 32-bit ARM has a NEON helper for it.
+ */
+#if UL_LEN == 64
+typedef unsigned __int128 ul2;
+#else
+typedef uint64_t ul2;
+#endif
+
+typedef struct div_magic {
+    ul m;
+    ul shift1;
+    ul shift2;
+} div_magic;
+
+static void div_magic_init(div_magic *d, ul q) {
+    unsigned int l = 0;
+
+    while (l < UL_LEN && ((ul) 1 << l) < q)
+        l++;
+    d->m = (ul) ((((ul2) (l < UL_LEN ? ((ul) 1 << l) - q : 0 - q))
+                  << UL_LEN) / q + 1);
+    d->shift1 = l ? 1 : 0;
+    d->shift2 = l ? l - 1 : 0;
+}
+
+static inline ul div_magic_apply(const div_magic *d, ul n) {
+    ul t = (ul) (((ul2) d->m * n) >> UL_LEN);
+
+    return (((n - t) >> d->shift1) + t) >> d->shift2;
+}
+
+static void div_regions(ulv *bufa, ulv *bufb, size_t count, ul q) {
     ulv *p1 = bufa;
     ulv *p2 = bufb;
-    size_t i;
+    size_t i = 0;
+    div_magic d;
+
+    div_magic_init(&d, q);
+    count_traffic(count, 4);
+#if defined(USE_NEON_HELPERS) && !defined(__aarch64__)
+    if (have_neon()) {
+        i = count & ~(size_t) 15;
+        div_regions_helper_neon(bufa, bufb, i, &d);
+        p1 += i;
+        p2 += i;
+    }
+#endif
+    for (; i < count; i++) {
+        *p1 = div_magic_apply(&d, *p1);
+        *p2 = div_magic_apply(&d, *p2);
+        p1++;
+        p2++;
+    }
+}
+
+int test_div_comparison(ulv *bufa, ulv *bufb, size_t count) {
     ul q = rand_ul();
 
-    for (i = 0; i < count; i++) {
-        if (!q) {
-            q++;
-        }
-        *p1++ /= q;
-        *p2++ /= q;
+    if (!q) {
+        q++;
     }
+    div_regions(bufa, bufb, count, q);
     return compare_regions("div", bufa, bufb, count);
 }
 
@@ -271,6 +2005,7 @@ int test_or_comparison(ulv *bufa, ulv *bufb, size_t count) {
     size_t i;
     ul q = rand_ul();
 
+    count_traffic(count, 4);
     for (i = 0; i < count; i++) {
         *p1++ |= q;
         *p2++ |= q;
@@ -284,6 +2019,7 @@ int test_and_comparison(ulv *bufa, ulv *bufb, size_t count) {
     size_t i;
     ul q = rand_ul();
 
+    count_traffic(count, 4);
     for (i = 0; i < count; i++) {
         *p1++ &= q;
         *p2++ &= q;
@@ -292,321 +2028,595 @@ int test_and_comparison(ulv *bufa, ulv *bufb, size_t count) {
 }
 
 int test_seqinc_comparison(ulv *bufa, ulv *bufb, size_t count) {
-    ulv *p1 = bufa;
-    ulv *p2 = bufb;
     size_t i;
     ul q = rand_ul();
 
-    for (i = 0; i < count; i++) {
-        *p1++ = *p2++ = (i + q);
+    if (!bufb) {
+        count_traffic(count, 2);
+        kernel_fill1_seq((ul *) bufa, count, q, 0);
+        cache_evict_small(count * sizeof(ul));
+        i = kernel_check_seq((const ul *) bufa, count, q, 0);
+        if (i < count) {
+            report_mismatch("seqinc", bufa + i, i + q);
+            return -1;
+        }
+        return 0;
     }
+
+    count_traffic(count, 2);
+    kernel_fill2_seq((ul *) bufa, (ul *) bufb, count, q, 0);
     return compare_regions("seqinc", bufa, bufb, count);
 }
 
 int test_solidbits_comparison(ulv *bufa, ulv *bufb, size_t count) {
-    ulv *p1 = bufa;
-    ulv *p2 = bufb;
     unsigned int j;
     ul q;
-    size_t i;
+    pattern_state prev = { 0 };
 
-    printf("           ");
-    fflush(stdout);
+    progress_begin();
     for (j = 0; j < 64; j++) {
-        printf("\b\b\b\b\b\b\b\b\b\b\b");
         q = (j % 2) == 0 ? UL_ONEBITS : 0;
-        printf("setting %3u", j);
-        fflush(stdout);
-        p1 = (ulv *) bufa;
-        p2 = (ulv *) bufb;
-        for (i = 0; i < count; i++) {
-            *p1++ = *p2++ = (i % 2) == 0 ? q : ~q;
-        }
-        printf("\b\b\b\b\b\b\b\b\b\b\b");
-        printf("testing %3u", j);
-        fflush(stdout);
-        if (compare_regions("solidbits", bufa, bufb, count)) {
+        if (pattern_step("solidbits", &prev, j, bufa, bufb, count,
+                         q, ~q)) {
             return -1;
         }
     }
-    printf("\b\b\b\b\b\b\b\b\b\b\b           \b\b\b\b\b\b\b\b\b\b\b");
-    fflush(stdout);
+    if (pattern_finish("solidbits", &prev, bufa, bufb, count)) {
+        return -1;
+    }
+    progress_end();
     return 0;
 }
 
 int test_checkerboard_comparison(ulv *bufa, ulv *bufb, size_t count) {
-    ulv *p1 = bufa;
-    ulv *p2 = bufb;
     unsigned int j;
     ul q;
-    size_t i;
+    pattern_state prev = { 0 };
 
-    printf("           ");
-    fflush(stdout);
+    progress_begin();
     for (j = 0; j < 64; j++) {
-        printf("\b\b\b\b\b\b\b\b\b\b\b");
         q = (j % 2) == 0 ? CHECKERBOARD1 : CHECKERBOARD2;
-        printf("setting %3u", j);
-        fflush(stdout);
-        p1 = (ulv *) bufa;
-        p2 = (ulv *) bufb;
-        for (i = 0; i < count; i++) {
-            *p1++ = *p2++ = (i % 2) == 0 ? q : ~q;
-        }
-        printf("\b\b\b\b\b\b\b\b\b\b\b");
-        printf("testing %3u", j);
-        fflush(stdout);
-        if (compare_regions("checkerboard", bufa, bufb, count)) {
+        if (pattern_step("checkerboard", &prev, j, bufa, bufb, count,
+                         q, ~q)) {
             return -1;
         }
     }
-    printf("\b\b\b\b\b\b\b\b\b\b\b           \b\b\b\b\b\b\b\b\b\b\b");
-    fflush(stdout);
+    if (pattern_finish("checkerboard", &prev, bufa, bufb, count)) {
+        return -1;
+    }
+    progress_end();
     return 0;
 }
 
 int test_blockseq_comparison(ulv *bufa, ulv *bufb, size_t count) {
-    ulv *p1 = bufa;
-    ulv *p2 = bufb;
     unsigned int j;
-    size_t i;
+    pattern_state prev = { 0 };
 
-    printf("           ");
-    fflush(stdout);
+    progress_begin();
     for (j = 0; j < 256; j++) {
-        printf("\b\b\b\b\b\b\b\b\b\b\b");
-        p1 = (ulv *) bufa;
-        p2 = (ulv *) bufb;
-        printf("setting %3u", j);
-        fflush(stdout);
-        for (i = 0; i < count; i++) {
-            *p1++ = *p2++ = (ul) UL_BYTE(j);
-        }
-        printf("\b\b\b\b\b\b\b\b\b\b\b");
-        printf("testing %3u", j);
-        fflush(stdout);
-        if (compare_regions("blockseq", bufa, bufb, count)) {
+        if (pattern_step("blockseq", &prev, j, bufa, bufb, count,
+                         (ul) UL_BYTE(j), (ul) UL_BYTE(j))) {
             return -1;
         }
     }
-    printf("\b\b\b\b\b\b\b\b\b\b\b           \b\b\b\b\b\b\b\b\b\b\b");
-    fflush(stdout);
+    if (pattern_finish("blockseq", &prev, bufa, bufb, count)) {
+        return -1;
+    }
+    progress_end();
     return 0;
 }
 
 int test_walkbits0_comparison(ulv *bufa, ulv *bufb, size_t count) {
-    ulv *p1 = bufa;
-    ulv *p2 = bufb;
     unsigned int j;
-    size_t i;
+    ul q;
+    pattern_state prev = { 0 };
 
-    printf("           ");
-    fflush(stdout);
+    progress_begin();
     for (j = 0; j < UL_LEN * 2; j++) {
-        printf("\b\b\b\b\b\b\b\b\b\b\b");
-        p1 = (ulv *) bufa;
-        p2 = (ulv *) bufb;
-        printf("setting %3u", j);
-        fflush(stdout);
-        for (i = 0; i < count; i++) {
-            if (j < UL_LEN) { /* Walk it up. */
-                *p1++ = *p2++ = ONE << j;
-            } else { /* Walk it back down. */
-                *p1++ = *p2++ = ONE << (UL_LEN * 2 - j - 1);
-            }
+        if (j < UL_LEN) { /* Walk it up. */
+            q = ONE << j;
+        } else { /* Walk it back down. */
+            q = ONE << (UL_LEN * 2 - j - 1);
         }
-        printf("\b\b\b\b\b\b\b\b\b\b\b");
-        printf("testing %3u", j);
-        fflush(stdout);
-        if (compare_regions("walkbits0", bufa, bufb, count)) {
+        if (pattern_step("walkbits0", &prev, j, bufa, bufb, count,
+                         q, q)) {
             return -1;
         }
     }
-    printf("\b\b\b\b\b\b\b\b\b\b\b           \b\b\b\b\b\b\b\b\b\b\b");
-    fflush(stdout);
+    if (pattern_finish("walkbits0", &prev, bufa, bufb, count)) {
+        return -1;
+    }
+    progress_end();
     return 0;
 }
 
 int test_walkbits1_comparison(ulv *bufa, ulv *bufb, size_t count) {
-    ulv *p1 = bufa;
-    ulv *p2 = bufb;
     unsigned int j;
-    size_t i;
+    ul q;
+    pattern_state prev = { 0 };
 
-    printf("           ");
-    fflush(stdout);
+    progress_begin();
     for (j = 0; j < UL_LEN * 2; j++) {
-        printf("\b\b\b\b\b\b\b\b\b\b\b");
-        p1 = (ulv *) bufa;
-        p2 = (ulv *) bufb;
-        printf("setting %3u", j);
-        fflush(stdout);
-        for (i = 0; i < count; i++) {
-            if (j < UL_LEN) { /* Walk it up. */
-                *p1++ = *p2++ = UL_ONEBITS ^ (ONE << j);
-            } else { /* Walk it back down. */
-                *p1++ = *p2++ = UL_ONEBITS ^ (ONE << (UL_LEN * 2 - j - 1));
-            }
+        if (j < UL_LEN) { /* Walk it up. */
+            q = UL_ONEBITS ^ (ONE << j);
+        } else { /* Walk it back down. */
+            q = UL_ONEBITS ^ (ONE << (UL_LEN * 2 - j - 1));
         }
-        printf("\b\b\b\b\b\b\b\b\b\b\b");
-        printf("testing %3u", j);
-        fflush(stdout);
-        if (compare_regions("walkbits1", bufa, bufb, count)) {
+        if (pattern_step("walkbits1", &prev, j, bufa, bufb, count,
+                         q, q)) {
             return -1;
         }
     }
-    printf("\b\b\b\b\b\b\b\b\b\b\b           \b\b\b\b\b\b\b\b\b\b\b");
-    fflush(stdout);
+    if (pattern_finish("walkbits1", &prev, bufa, bufb, count)) {
+        return -1;
+    }
+    progress_end();
     return 0;
 }
 
 int test_bitspread_comparison(ulv *bufa, ulv *bufb, size_t count) {
-    ulv *p1 = bufa;
-    ulv *p2 = bufb;
     unsigned int j;
-    size_t i;
+    ul q;
+    pattern_state prev = { 0 };
 
-    printf("           ");
-    fflush(stdout);
+    progress_begin();
     for (j = 0; j < UL_LEN * 2; j++) {
-        printf("\b\b\b\b\b\b\b\b\b\b\b");
-        p1 = (ulv *) bufa;
-        p2 = (ulv *) bufb;
-        printf("setting %3u", j);
-        fflush(stdout);
-        for (i = 0; i < count; i++) {
-            if (j < UL_LEN) { /* Walk it up. */
-                *p1++ = *p2++ = (i % 2 == 0)
-                    ? (ONE << j) | (ONE << (j + 2))
-                    : UL_ONEBITS ^ ((ONE << j)
-                                    | (ONE << (j + 2)));
-            } else { /* Walk it back down. */
-                *p1++ = *p2++ = (i % 2 == 0)
-                    ? (ONE << (UL_LEN * 2 - 1 - j)) | (ONE << (UL_LEN * 2 + 1 - j))
-                    : UL_ONEBITS ^ (ONE << (UL_LEN * 2 - 1 - j)
-                                    | (ONE << (UL_LEN * 2 + 1 - j)));
-            }
+        if (j < UL_LEN) { /* Walk it up. */
+            q = (ONE << j) | (ONE << (j + 2));
+        } else { /* Walk it back down. */
+            q = (ONE << (UL_LEN * 2 - 1 - j)) | (ONE << (UL_LEN * 2 + 1 - j));
         }
-        printf("\b\b\b\b\b\b\b\b\b\b\b");
-        printf("testing %3u", j);
-        fflush(stdout);
-        if (compare_regions("bitspread", bufa, bufb, count)) {
+        if (pattern_step("bitspread", &prev, j, bufa, bufb, count,
+                         q, UL_ONEBITS ^ q)) {
             return -1;
         }
     }
-    printf("\b\b\b\b\b\b\b\b\b\b\b           \b\b\b\b\b\b\b\b\b\b\b");
-    fflush(stdout);
+    if (pattern_finish("bitspread", &prev, bufa, bufb, count)) {
+        return -1;
+    }
+    progress_end();
     return 0;
 }
 
 int test_bitflip_comparison(ulv *bufa, ulv *bufb, size_t count) {
-    ulv *p1 = bufa;
-    ulv *p2 = bufb;
     unsigned int j, k;
     ul q;
-    size_t i;
+    pattern_state prev = { 0 };
 
-    printf("           ");
-    fflush(stdout);
+    progress_begin();
     for (k = 0; k < UL_LEN; k++) {
         q = ONE << k;
         for (j = 0; j < 8; j++) {
-            printf("\b\b\b\b\b\b\b\b\b\b\b");
             q = ~q;
-            printf("setting %3u", k * 8 + j);
-            fflush(stdout);
-            p1 = (ulv *) bufa;
-            p2 = (ulv *) bufb;
-            for (i = 0; i < count; i++) {
-                *p1++ = *p2++ = (i % 2) == 0 ? q : ~q;
-            }
-            printf("\b\b\b\b\b\b\b\b\b\b\b");
-            printf("testing %3u", k * 8 + j);
-            fflush(stdout);
-            if (compare_regions("bitflip", bufa, bufb, count)) {
+            if (pattern_step("bitflip", &prev, k * 8 + j, bufa, bufb, count,
+                             q, ~q)) {
                 return -1;
             }
         }
     }
-    printf("\b\b\b\b\b\b\b\b\b\b\b           \b\b\b\b\b\b\b\b\b\b\b");
-    fflush(stdout);
+    if (pattern_finish("bitflip", &prev, bufa, bufb, count)) {
+        return -1;
+    }
+    progress_end();
     return 0;
 }
 
-#ifdef TEST_NARROW_WRITES    
-int test_8bit_wide_random(ulv* bufa, ulv* bufb, size_t count) {
-    u8v *p1, *t;
-    ulv *p2;
-    int attempt;
-    unsigned int b, j = 0;
-    size_t i;
+/*
+ * The access order tests visit the regions one cache line at a time in a
+ * non-sequential order, so the DRAM controller sees row misses and bank
+ * conflicts instead of prefetch friendly streams. This stresses the
+ * row activate and precharge timings (tRCD, tRP), which the linear sweeps
+ * above barely touch. The orders are computed on the fly, so no index
+ * table is needed.
+ */
+#define ORDER_LINE_BYTES 64
+#define ORDER_LINE_WORDS (ORDER_LINE_BYTES / sizeof(ul))
+/* Distance between rows in the same bank, for typical DDR2/DDR3 layouts */
+#define ORDER_BANK_STRIDE (64 * 1024)
+#define ORDER_PASSES 8
 
-    putchar(' ');
-    fflush(stdout);
-    for (attempt = 0; attempt < 2;  attempt++) {
-        if (attempt & 1) {
-            p1 = (u8v *) bufa;
-            p2 = bufb;
-        } else {
-            p1 = (u8v *) bufb;
-            p2 = bufa;
-        }
-        for (i = 0; i < count; i++) {
-            t = mword8.bytes;
-            *p2++ = mword8.val = rand_ul();
-            for (b=0; b < UL_LEN/8; b++) {
-                *p1++ = *t++;
+#define ORDER_RANDOM 0
+#define ORDER_ALTERNATE 1
+
+typedef struct order_state {
+    int order;
+    size_t lines;
+    /* random: bijection on [0, mask], walked until it lands below lines */
+    size_t mask;
+    unsigned int shift;
+    size_t mul1, mul2, add;
+    /* alternate: lines i and i + stride of every 2 * stride block */
+    size_t stride;
+} order_state;
+
+static void order_init(order_state *o, int order, size_t lines,
+                       size_t stride) {
+    o->order = order;
+    o->lines = lines;
+
+    o->mask = 0;
+    while (o->mask < lines - 1)
+        o->mask = (o->mask << 1) | 1;
+    o->shift = 1;
+    while ((o->mask >> (2 * o->shift)) != 0)
+        o->shift++;
+    o->mul1 = (size_t)rand_ul() | 1;
+    o->mul2 = (size_t)rand_ul() | 1;
+    o->add = (size_t)rand_ul();
+
+    o->stride = 1;
+    while (o->stride * 4 <= lines && o->stride < stride)
+        o->stride <<= 1;
+}
+
+/* The line visited in step k, every line is visited exactly once */
+static size_t order_line(const order_state *o, size_t k) {
+    size_t x = k, block, r;
+
+    if (o->order == ORDER_RANDOM) {
+        do {
+            /* odd multiply, add and xorshift are all bijective mod 2^n */
+            x = (x * o->mul1 + o->add) & o->mask;
+            x ^= x >> o->shift;
+            x = (x * o->mul2) & o->mask;
+            x ^= x >> o->shift;
+        } while (x >= o->lines);
+        return x;
+    }
+
+    block = k & ~(2 * o->stride - 1);
+    if (block + 2 * o->stride > o->lines)
+        return k;  /* the tail is walked linearly */
+    r = k - block;
+    return block + (r >> 1) + ((r & 1) ? o->stride : 0);
+}
+
+static ul order_value(size_t i, ul seed) {
+    return (ul)(i * (size_t)0x9e3779b97f4a7c15ULL) ^ seed;
+}
+
+static void order_fill(const order_state *o, ulv *bufa, ulv *bufb,
+                       size_t count, ul seed) {
+    size_t k, i, end;
+
+    count_traffic(count, bufb ? 2 : 1);
+    if (!bufb)
+        bufb = bufa;
+    for (k = 0; k < o->lines; k++) {
+        i = order_line(o, k) * ORDER_LINE_WORDS;
+        end = i + ORDER_LINE_WORDS < count ? i + ORDER_LINE_WORDS : count;
+        for (; i < end; i++)
+            bufa[i] = bufb[i] = order_value(i, seed);
+    }
+}
+
+static int order_check(const char *tname, const order_state *o,
+                       ulv *bufa, ulv *bufb, size_t count, ul seed) {
+    size_t k, i, end;
+    ul expected;
+
+    /* --bench times the order itself, not the eviction */
+    if (!memtester_bench)
+        cache_evict_small((bufb ? 2 : 1) * count * sizeof(ul));
+    count_traffic(count, bufb ? 2 : 1);
+    for (k = 0; k < o->lines; k++) {
+        i = order_line(o, k) * ORDER_LINE_WORDS;
+        end = i + ORDER_LINE_WORDS < count ? i + ORDER_LINE_WORDS : count;
+        for (; i < end; i++) {
+            expected = order_value(i, seed);
+            if (bufa[i] != expected) {
+                report_mismatch(tname, bufa + i, expected);
+                return -1;
             }
-            if (!(i % PROGRESSOFTEN)) {
-                putchar('\b');
-                putchar(progress[++j % PROGRESSLEN]);
-                fflush(stdout);
+            if (bufb && bufb[i] != expected) {
+                report_mismatch(tname, bufb + i, expected);
+                return -1;
             }
         }
-        if (compare_regions("8bit_wide_random", bufa, bufb, count)) {
+    }
+    return 0;
+}
+
+/*
+ * Fill the regions in one order and read them back in another. Both
+ * orders use their own random seed, so the random order test reads the
+ * lines back in a different permutation than they were written in.
+ */
+static int test_order(const char *tname, int order, size_t stride,
+                      ulv *bufa, ulv *bufb, size_t count) {
+    order_state fill, check;
+    size_t lines = (count + ORDER_LINE_WORDS - 1) / ORDER_LINE_WORDS;
+    unsigned int j;
+    ul seed;
+
+    if (lines == 0)
+        return 0;
+
+    progress_begin();
+    for (j = 0; j < ORDER_PASSES; j++) {
+        seed = rand_ul();
+        order_init(&fill, order, lines, stride);
+        order_init(&check, order, lines, stride);
+        progress_phase("setting", j);
+        order_fill(&fill, bufa, bufb, count, seed);
+        progress_phase("testing", j);
+        if (order_check(tname, &check, bufa, bufb, count, seed)) {
             return -1;
         }
     }
-    printf("\b \b");
-    fflush(stdout);
+    progress_end();
     return 0;
 }
 
-int test_16bit_wide_random(ulv* bufa, ulv* bufb, size_t count) {
-    u16v *p1, *t;
-    ulv *p2;
-    int attempt;
-    unsigned int b, j = 0;
+int test_random_order(ulv *bufa, ulv *bufb, size_t count) {
+    return test_order("random_order", ORDER_RANDOM, 0, bufa, bufb, count);
+}
+
+/* Every access goes to another row of the same bank */
+int test_bank_conflict(ulv *bufa, ulv *bufb, size_t count) {
+    return test_order("bank_conflict", ORDER_ALTERNATE,
+                      ORDER_BANK_STRIDE / ORDER_LINE_BYTES,
+                      bufa, bufb, count);
+}
+
+/*
+ * Row-hammer like ping-pong between the two halves of the regions. The
+ * caches absorb repeated hits on the same line, so every line is visited
+ * once per pass, the pressure comes from the constant row switching.
+ */
+int test_row_alternate(ulv *bufa, ulv *bufb, size_t count) {
+    return test_order("row_alternate", ORDER_ALTERNATE, (size_t)(-1),
+                      bufa, bufb, count);
+}
+
+/*
+ * Double sided row hammer. A random victim page gets the rows right above
+ * and below it in the same bank as aggressors, which are read
+ * HAMMER_READS times each, with the lines flushed after every read so
+ * each one activates the row again. That is about as many activations as
+ * fit into one 64ms refresh window. The aggressors are found through the
+ * physical addresses, with the row field of MEMTESTER_DRAM_MAP or rows
+ * ORDER_BANK_STRIDE apart without it. The victim page is checked after
+ * every pair and the flips are reported per row, the whole region is
+ * checked at the end.
+ *
+ * The cache lines are flushed with dc civac or clflush, 32-bit ARM can't
+ * do that from user space and needs MEMTESTER_UNCACHED.
+ */
+#define HAMMER_VICTIMS 32
+#define HAMMER_READS 500000
+
+#if defined(__aarch64__) || defined(__i386__) || defined(__x86_64__)
+#define HAMMER_FLUSH 1
+#endif
+
+static ul hammer_sink;
+
+/* Whether the reads of the aggressors can get past the caches */
+int test_row_hammer_usable(void) {
+#ifdef HAMMER_FLUSH
+    return 1;
+#else
+    return memtester_uncached;
+#endif
+}
+
+static void hammer(ulv *a, ulv *b, ul reads) {
+    ul i, sum = 0;
+
+    if (memtester_uncached) {
+        for (i = 0; i < reads; i++)
+            sum += *a + *b;
+        hammer_sink = sum;
+        return;
+    }
+#ifdef HAMMER_FLUSH
+    for (i = 0; i < reads; i++) {
+        sum += *a + *b;
+#if defined(__aarch64__)
+        asm volatile("dc civac, %0\n\tdc civac, %1"
+                     : : "r" (a), "r" (b) : "memory");
+#else
+        asm volatile("clflush (%0)\n\tclflush (%1)"
+                     : : "r" (a), "r" (b) : "memory");
+#endif
+    }
+#endif
+    hammer_sink = sum;
+}
+
+/* The location delta bytes away in the physical memory, if it is tested */
+static ulv *hammer_neighbour(ulv *buf, size_t count, ulv *p, long long delta) {
+    off_t physaddr = memtester_physaddr(p);
+    ulv *q;
+
+    if (physaddr == (off_t) -1)
+        q = (ulv *) ((size_t) p + delta);
+    else
+        q = memtester_virt(physaddr + delta);
+    if (!q || q < buf || q >= buf + count)
+        return NULL;
+    return q;
+}
+
+static void hammer_set_page(ulv *p, size_t words, ul value) {
     size_t i;
 
-    putchar( ' ' );
-    fflush( stdout );
-    for (attempt = 0; attempt < 2; attempt++) {
+    for (i = 0; i < words; i++)
+        p[i] = value;
+}
+
+int test_row_hammer(ulv *bufa, ulv *bufb, size_t count) {
+    size_t pagewords = sysconf(_SC_PAGE_SIZE) / sizeof(ul);
+    size_t pages, i, flips;
+    ull step = memtester_dram_step("row");
+    ulv *victim, *above, *below;
+    off_t physaddr;
+    char where[128];
+    unsigned int j, tries;
+    ul pattern = rand_ul();
+    int result = 0;
+
+    /* memtester leaves it out then, but a zoom in round runs it cached */
+    if (!test_row_hammer_usable())
+        return 0;
+    /* the two halves are next to each other, hammer them as one */
+    if (bufb && bufb == bufa + count)
+        count *= 2;
+    pages = count / pagewords;
+    if (!step)
+        step = ORDER_BANK_STRIDE;
+    if (pages < 3)
+        return 0;
+
+    progress_begin();
+    progress_phase("setting", 0);
+    count_traffic(count, 1);
+    hammer_set_page(bufa, count, pattern);
+    for (j = 0, tries = 0; j < HAMMER_VICTIMS && tries < 4 * HAMMER_VICTIMS;
+         tries++) {
+        victim = bufa + (rand_ul() % pages) * pagewords;
+        above = hammer_neighbour(bufa, count, victim, (long long) step);
+        below = hammer_neighbour(bufa, count, victim, -(long long) step);
+        if (!above || !below)
+            continue;
+        /* the aggressors hold the inverse, the victim sees both */
+        above -= ((size_t) above / sizeof(ul)) % pagewords;
+        below -= ((size_t) below / sizeof(ul)) % pagewords;
+        if (above == victim || below == victim)
+            continue;
+        progress_phase("hammering", j++);
+        hammer_set_page(above, pagewords, ~pattern);
+        hammer_set_page(below, pagewords, ~pattern);
+        hammer(above, below, HAMMER_READS);
+        hammer_set_page(above, pagewords, pattern);
+        hammer_set_page(below, pagewords, pattern);
+
+        cache_evict();
+        for (i = 0, flips = 0; i < pagewords; i++) {
+            if (victim[i] != pattern) {
+                flips += __builtin_popcountl(victim[i] ^ pattern);
+                report_mismatch("row_hammer", victim + i, pattern);
+                victim[i] = pattern;
+            }
+        }
+        if (flips) {
+            physaddr = memtester_physaddr(victim);
+            where[0] = '\0';
+            if (physaddr != (off_t) -1)
+                memtester_dram_location(physaddr, where, sizeof(where));
+            fprintf(stderr, "row_hammer: %lu bit flips in the row of "
+                    "0x%08lx%s\n", (ul) flips, physaddr != (off_t) -1 ?
+                    (ul) physaddr : region_offset(victim), where);
+            result = -1;
+        }
+    }
+    progress_phase("testing", 0);
+    if (check_region("row_hammer", bufa, count, pattern, pattern))
+        result = -1;
+    progress_end();
+    return result;
+}
+
+#ifdef TEST_NARROW_WRITES    
+/*
+ * The narrow write tests fill one region with random values at full
+ * width, and copy them into the other one with byte or halfword stores,
+ * so the DRAM sees the partial writes and their byte masks. A chunk is
+ * filled and then copied while it is still in the cache, the copy uses
+ * NEON lane stores or unrolled strb/strh, one store per byte or halfword.
+ */
+#define NARROW_CHUNK (4 * 1024)
+
+static void narrow_copy8(u8v *dst, ulv *src, size_t count) {
+    u8v *s = (u8v *) src;
+    size_t i = 0;
+
+    count *= sizeof(ul);
+#ifdef USE_NEON_HELPERS
+    if (have_neon()) {
+        i = (count / sizeof(ul)) & ~(size_t) 15;
+        narrow_copy8_helper_neon(dst, src, i);
+        i *= sizeof(ul);
+    }
+#endif
+    for (; i + 8 <= count; i += 8) {
+        dst[i] = s[i];
+        dst[i + 1] = s[i + 1];
+        dst[i + 2] = s[i + 2];
+        dst[i + 3] = s[i + 3];
+        dst[i + 4] = s[i + 4];
+        dst[i + 5] = s[i + 5];
+        dst[i + 6] = s[i + 6];
+        dst[i + 7] = s[i + 7];
+    }
+    for (; i < count; i++)
+        dst[i] = s[i];
+}
+
+static void narrow_copy16(u16v *dst, ulv *src, size_t count) {
+    u16v *s = (u16v *) src;
+    size_t i = 0;
+
+    count *= sizeof(ul) / 2;
+#ifdef USE_NEON_HELPERS
+    if (have_neon()) {
+        i = (count / (sizeof(ul) / 2)) & ~(size_t) 15;
+        narrow_copy16_helper_neon(dst, src, i);
+        i *= sizeof(ul) / 2;
+    }
+#endif
+    for (; i + 4 <= count; i += 4) {
+        dst[i] = s[i];
+        dst[i + 1] = s[i + 1];
+        dst[i + 2] = s[i + 2];
+        dst[i + 3] = s[i + 3];
+    }
+    for (; i < count; i++)
+        dst[i] = s[i];
+}
+
+static int test_narrow_random(const char *tname, int width, ulv *bufa,
+                              ulv *bufb, size_t count) {
+    ulv *p1, *p2;
+    int attempt;
+    unsigned int j = 0;
+    size_t i, n;
+
+    progress_spin_begin();
+    for (attempt = 0; attempt < 2;  attempt++) {
         if (attempt & 1) {
-            p1 = (u16v *) bufa;
+            p1 = bufa;
             p2 = bufb;
         } else {
-            p1 = (u16v *) bufb;
+            p1 = bufb;
             p2 = bufa;
         }
-        for (i = 0; i < count; i++) {
-            t = mword16.u16s;
-            *p2++ = mword16.val = rand_ul();
-            for (b = 0; b < UL_LEN/16; b++) {
-                *p1++ = *t++;
-            }
-            if (!(i % PROGRESSOFTEN)) {
-                putchar('\b');
-                putchar(progress[++j % PROGRESSLEN]);
-                fflush(stdout);
-            }
+        rand_skip(memtester_window_before);
+        for (i = 0; i < count; i += n) {
+            n = count - i < NARROW_CHUNK ? count - i : NARROW_CHUNK;
+            rand_fill(p2 + i, NULL, n);
+            count_traffic(n, 1);
+            if (width == 8)
+                narrow_copy8((u8v *) (p1 + i), p2 + i, n);
+            else
+                narrow_copy16((u16v *) (p1 + i), p2 + i, n);
+            progress_spin(++j);
         }
-        if (compare_regions("16bit_wide_random", bufa, bufb, count)) {
+        rand_skip(memtester_window_after);
+        if (compare_regions(tname, bufa, bufb, count)) {
             return -1;
         }
     }
-    printf("\b \b");
-    fflush(stdout);
+    progress_spin_end();
     return 0;
 }
+
+int test_8bit_wide_random(ulv* bufa, ulv* bufb, size_t count) {
+    return test_narrow_random("8bit_wide_random", 8, bufa, bufb, count);
+}
+
+int test_16bit_wide_random(ulv* bufa, ulv* bufb, size_t count) {
+    return test_narrow_random("16bit_wide_random", 16, bufa, bufb, count);
+}
 #endif
@@ -16,6 +16,19 @@
 
 /* Function declaration. */
 
+void progress_start(int json);
+void progress_test(unsigned long loop, const char *name);
+void rand_seed(unsigned long seed, int stream);
+void error_histogram_report(void);
+ull error_histogram_words(void);
+void error_histogram_metrics(FILE *f);
+void memtester_cpu_report(void);
+int memtester_journal_open(const char *path);
+int memtester_journal_decode(const char *path);
+void memtester_journal_sync(int force);
+int memtester_check_value(const char *tname, unsigned long volatile *buf,
+                          size_t count, unsigned long expected);
+
 int test_stuck_address(unsigned long volatile *bufa, size_t count);
 int test_random_value(unsigned long volatile *bufa, unsigned long volatile *bufb, size_t count);
 int test_xor_comparison(unsigned long volatile *bufa, unsigned long volatile *bufb, size_t count);
@@ -32,6 +45,11 @@ int test_walkbits0_comparison(unsigned long volatile *bufa, unsigned long volati
 int test_walkbits1_comparison(unsigned long volatile *bufa, unsigned long volatile *bufb, size_t count);
 int test_bitspread_comparison(unsigned long volatile *bufa, unsigned long volatile *bufb, size_t count);
 int test_bitflip_comparison(unsigned long volatile *bufa, unsigned long volatile *bufb, size_t count);
+int test_random_order(unsigned long volatile *bufa, unsigned long volatile *bufb, size_t count);
+int test_bank_conflict(unsigned long volatile *bufa, unsigned long volatile *bufb, size_t count);
+int test_row_alternate(unsigned long volatile *bufa, unsigned long volatile *bufb, size_t count);
+int test_row_hammer(unsigned long volatile *bufa, unsigned long volatile *bufb, size_t count);
+int test_row_hammer_usable(void);
 #ifdef TEST_NARROW_WRITES    
 int test_8bit_wide_random(unsigned long volatile *bufa, unsigned long volatile *bufb, size_t count);
 int test_16bit_wide_random(unsigned long volatile *bufa, unsigned long volatile *bufb, size_t count);
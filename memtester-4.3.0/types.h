@@ -23,14 +23,5 @@ typedef unsigned short volatile u16v;
 struct test {
     char *name;
     int (*fp)();
+    int single; /* can check a single region, see MEMTESTER_SINGLE */
 };
-
-union {
-    unsigned char bytes[UL_LEN/8];
-    ul val;
-} mword8;
-
-union {
-    unsigned short u16s[UL_LEN/16];
-    ul val;
-} mword16;
@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The gpu side of MEMTESTER_GPU_SHARE: a piece of the memtester buffer
+ * gets mapped into the mali address space, and then the gpu writes known
+ * patterns into it for the cpu to check, and reads back patterns that the
+ * cpu wrote. This tests the gpu path to the very same memory, including
+ * the physical addresses that the cpu tests report failures at.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "memtester-4.3.0/types.h"
+#include "memtester-4.3.0/sizes.h"
+#include "memtester-4.3.0/memtester.h"
+#include "memtester-4.3.0/tests.h"
+
+#include "limare.h"
+#include "formats.h"
+
+#include "esUtil.h"
+
+#include "memtester_gpu.h"
+#include "load_mali_kernel_module.h"
+
+/* --mali-memory steps down by an eighth until the driver has enough */
+#define GPU_MEMORY_MIN (1 << 20)
+
+/* the halves are square textures, no larger than this */
+#define GPU_SHARE_SIDE_MAX 2048
+
+#define QUAD_VERTEX_COUNT 4
+
+static float quad_vertices[QUAD_VERTEX_COUNT][3] = {
+	{-1.0, -1.0, +1.0},
+	{+1.0, -1.0, +1.0},
+	{-1.0, +1.0, +1.0},
+	{+1.0, +1.0, +1.0},
+};
+
+static float quad_texture_coordinates[QUAD_VERTEX_COUNT][2] = {
+	{0.0, 1.0},
+	{1.0, 1.0},
+	{0.0, 0.0},
+	{1.0, 0.0},
+};
+
+/* bytes which look the same in every channel order */
+static const unsigned char gpu_share_patterns[] = {
+	0x00, 0xFF, 0x55, 0xAA, 0x33, 0xCC, 0x0F, 0xF0,
+};
+
+#define GPU_SHARE_PATTERN_COUNT \
+	(sizeof(gpu_share_patterns) / sizeof(gpu_share_patterns[0]))
+
+static struct gpu_share {
+	struct limare_state *state;
+	int side;
+	size_t count; /* words per half */
+	ulv *half[2];
+	int textures[2];
+	int mvp;
+	int sampler;
+} share;
+
+/*
+ * Map the pages of the buffer, each run of physically contiguous pages in
+ * one go. They have to end up back to back in the mali address space.
+ */
+static unsigned int gpu_share_map(struct limare_state *state, ulv *base,
+				  size_t bytes)
+{
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+	size_t offset, run;
+	unsigned int mali = 0, address;
+	off_t physical;
+
+	for (offset = 0; offset < bytes; offset += run) {
+		physical = memtester_physaddr((ulv *) ((char *) base + offset));
+		if ((physical == (off_t) -1) || (physical > 0xFFFFFFFFLL)) {
+			fprintf(stderr, "gpu: no usable physical address for "
+				"the buffer, is /proc/self/pagemap readable?\n");
+			return 0;
+		}
+
+		for (run = pagesize; (offset + run) < bytes; run += pagesize)
+			if (memtester_physaddr((ulv *) ((char *) base + offset +
+							run)) !=
+			    (physical + (off_t) run))
+				break;
+
+		address = limare_external_map(state, physical, run);
+		if (!address)
+			return 0;
+
+		if (!offset)
+			mali = address;
+		else if (address != (mali + offset)) {
+			fprintf(stderr, "gpu: buffer is not contiguous in the "
+				"mali address space\n");
+			return 0;
+		}
+	}
+
+	return mali;
+}
+
+static void gpu_share_program_setup(struct limare_state *state)
+{
+	#include "shader_v.h"
+	#include "shader_f.h"
+
+	int program = limare_program_new(state);
+	vertex_shader_attach_mbs_stream(state, program, vertex_shader_binary,
+					sizeof(vertex_shader_binary));
+	fragment_shader_attach_mbs_stream(state, program,
+					  fragment_shader_binary,
+					  sizeof(fragment_shader_binary));
+	limare_link(state);
+
+	limare_attribute_pointer(state, "in_position", LIMARE_ATTRIB_FLOAT,
+				 3, 0, QUAD_VERTEX_COUNT, quad_vertices);
+	limare_attribute_pointer(state, "in_coord", LIMARE_ATTRIB_FLOAT,
+				 2, 0, QUAD_VERTEX_COUNT,
+				 quad_texture_coordinates);
+
+	share.mvp = limare_uniform_location(state,
+					    "modelviewprojectionMatrix");
+	share.sampler = limare_uniform_location(state, "in_texture");
+}
+
+/* Render one frame into the given half, and wait for it to land */
+static int gpu_share_render(int target, int source, ul clear)
+{
+	struct limare_state *state = share.state;
+	ESMatrix modelviewprojection;
+
+	esMatrixLoadIdentity(&modelviewprojection);
+	esTranslate(&modelviewprojection, 0.0, 0.0, -0.5);
+
+	if (limare_render_target(state, share.textures[target]))
+		return -1;
+
+	state->clear_color = (unsigned int) clear;
+	if (source >= 0) {
+		limare_texture_attach_location(state, share.sampler,
+					       share.textures[source]);
+		limare_uniform_attach_location(state, share.mvp, 16,
+					       &modelviewprojection.m[0][0]);
+	}
+
+	if (limare_frame_new(state))
+		return -1;
+	if ((source >= 0) &&
+	    limare_draw_arrays(state, GL_TRIANGLE_STRIP, 0, QUAD_VERTEX_COUNT))
+		return -1;
+	if (limare_frame_flush(state))
+		return -1;
+
+	return limare_frame_wait(state);
+}
+
+static void *gpu_share_thread(void *data)
+{
+	ul byte, pattern, other;
+	size_t i, j;
+	int a = 0;
+
+	memtester_quiet = 1;
+
+	for (j = 0; ; j++, a ^= 1) {
+		byte = gpu_share_patterns[j % GPU_SHARE_PATTERN_COUNT];
+		pattern = UL_BYTE(byte);
+		other = ~pattern;
+
+		/* gpu writes, cpu reads */
+		if (gpu_share_render(a, -1, pattern))
+			break;
+		memtester_check_value("GPU Write", share.half[a], share.count,
+				      pattern);
+
+		/* cpu writes, gpu reads, and hands it over to the other half */
+		for (i = 0; i < share.count; i++)
+			share.half[a][i] = other;
+		if (gpu_share_render(a ^ 1, a, pattern))
+			break;
+		memtester_check_value("GPU Read", share.half[a ^ 1],
+				      share.count, other);
+	}
+
+	fprintf(stderr, "gpu: rendering failed, the gpu share is no longer "
+		"tested\n");
+	return NULL;
+}
+
+/*
+ * Give up on the gpu share: limare_finish() stops the render threads and
+ * unmaps the pieces of the buffer mapped so far, and closing the device
+ * ends the mali session, along with everything it still holds.
+ */
+static int gpu_share_fail(struct limare_state *state)
+{
+	limare_finish(state);
+	close(state->fd);
+	free(state);
+	share.state = NULL;
+	return -1;
+}
+
+int memtester_gpu_share_start(ulv *base, size_t bytes)
+{
+	struct limare_state *state;
+	unsigned int mali;
+	pthread_t thread;
+	int i, side;
+
+	for (side = GPU_SHARE_SIDE_MAX;
+	     side && ((size_t) 2 * side * side * 4 > bytes); side -= 16)
+		;
+	if (!side) {
+		fprintf(stderr, "gpu: %llu bytes are too little to share\n",
+			(ull) bytes);
+		return -1;
+	}
+
+	load_mali_kernel_module();
+
+	state = limare_init();
+	if (!state)
+		return -1;
+
+	if (limare_offscreen(state, side, side, 32) ||
+	    limare_state_setup(state, side, side, 0))
+		return gpu_share_fail(state);
+
+	mali = gpu_share_map(state, base, bytes);
+	if (!mali)
+		return gpu_share_fail(state);
+
+	share.state = state;
+	share.side = side;
+	share.count = (size_t) side * side * 4 / sizeof(ul);
+	for (i = 0; i < 2; i++) {
+		share.half[i] = base + i * share.count;
+		share.textures[i] =
+			limare_texture_external(state, (void *) share.half[i],
+						mali + i * share.count *
+						sizeof(ul), side, side,
+						LIMA_TEXEL_FORMAT_RGBA_8888);
+		if (share.textures[i] == -1)
+			return gpu_share_fail(state);
+	}
+
+	gpu_share_program_setup(state);
+	if ((share.mvp == -1) || (share.sampler == -1))
+		return gpu_share_fail(state);
+
+	if (pthread_create(&thread, NULL, gpu_share_thread, NULL))
+		return gpu_share_fail(state);
+
+	printf("gpu: testing two %dx%d halves at mali address 0x%08X\n",
+	       side, side, mali);
+
+	return 0;
+}
+
+/*
+ * The memtester buffer of --mali-memory: the reserved memory of the mali
+ * driver and what it takes from the kernel, which the gpu's frames and
+ * textures come from and which no malloc() ever reaches. It gets its own
+ * mali session, so that it stays clear of whatever renders meanwhile.
+ */
+void volatile *memtester_gpu_memory_map(size_t *bytes)
+{
+	struct limare_state *state;
+	size_t size = *bytes;
+	void *address;
+
+	load_mali_kernel_module();
+
+	state = limare_init();
+	if (!state)
+		return NULL;
+
+	if (size > 0x7FFFF000)
+		size = 0x7FFFF000;
+	for (size &= ~(size_t) 0xFFF; size >= GPU_MEMORY_MIN;
+	     size = (size - size / 8) & ~(size_t) 0xFFF) {
+		address = limare_spare_map(state, size);
+		if (address) {
+			printf("gpu: got %lluMB of mali memory, in a %lluMB "
+			       "address space\n", (ull) size >> 20,
+			       (ull) state->mem_size >> 20);
+			*bytes = size;
+			return address;
+		}
+	}
+
+	fprintf(stderr, "gpu: the mali driver has no memory to spare\n");
+	return NULL;
+}
@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * A minimal HTTP listener for Prometheus to scrape: every GET of /metrics
+ * gets the output of the registered writers, in the text format. The
+ * writers read the counters that the test and workload threads keep
+ * anyway, without taking their locks, so a scrape never holds them up.
+ * Requests are served one at a time from a single thread, which is all a
+ * scraper needs, and a client that doesn't send its request in time gets
+ * dropped.
+ *
+ * The same writers also make the snapshots that SIGUSR1 and SIGUSR2 ask
+ * for, so that a long run can be looked at without a listener.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics_http.h"
+
+#define METRICS_REQUEST_MAX	2048
+#define METRICS_TIMEOUT		2 /* seconds for a client to send or take */
+
+static struct {
+	metrics_writer_t writer;
+	void *data;
+} writers[METRICS_WRITERS_MAX];
+static int writers_count;
+
+void
+metrics_add(metrics_writer_t writer, void *data)
+{
+	if (writers_count == METRICS_WRITERS_MAX)
+		return;
+	writers[writers_count].writer = writer;
+	writers[writers_count].data = data;
+	writers_count++;
+}
+
+void
+metrics_write(FILE *f)
+{
+	int i;
+
+	for (i = 0; i < writers_count; i++)
+		writers[i].writer(f, writers[i].data);
+}
+
+static void
+send_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n <= 0)
+			return;
+		buf += n;
+		len -= n;
+	}
+}
+
+/* Read up to the end of the headers, returns 0 if they never came */
+static int
+read_request(int fd, char *buf, size_t size)
+{
+	size_t len = 0;
+	ssize_t n;
+
+	while (len < size - 1) {
+		n = recv(fd, buf + len, size - 1 - len, 0);
+		if (n <= 0)
+			return 0;
+		len += n;
+		buf[len] = 0;
+		if (strstr(buf, "\r\n\r\n") || strstr(buf, "\n\n"))
+			return 1;
+	}
+	/* the request line is all that counts */
+	return 1;
+}
+
+static void
+serve(int fd)
+{
+	char request[METRICS_REQUEST_MAX], header[160];
+	char *body = NULL;
+	size_t len = 0;
+	FILE *f;
+
+	if (!read_request(fd, request, sizeof(request)))
+		return;
+	if (strncmp(request, "GET /metrics", 12) != 0 ||
+	    !strchr(" ?", request[12])) {
+		snprintf(header, sizeof(header), "HTTP/1.0 404 Not Found\r\n"
+			 "Content-Type: text/plain\r\nContent-Length: 10\r\n"
+			 "Connection: close\r\n\r\nnot found\n");
+		send_all(fd, header, strlen(header));
+		return;
+	}
+
+	f = open_memstream(&body, &len);
+	if (!f)
+		return;
+	metrics_write(f);
+	fclose(f);
+
+	snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+		 "Content-Type: text/plain; version=0.0.4\r\n"
+		 "Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+	send_all(fd, header, strlen(header));
+	send_all(fd, body, len);
+	free(body);
+}
+
+static void *
+listener_thread(void *data)
+{
+	int listener = (int)(long)data, fd;
+	struct timeval timeout = { METRICS_TIMEOUT, 0 };
+
+	while (1) {
+		fd = accept(listener, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			sleep(1);
+			continue;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+			   sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+			   sizeof(timeout));
+		serve(fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+/*
+ * Listen on "[address:]port", an IPv4 address or all of the interfaces,
+ * and serve the metrics from a thread of its own. Returns 0 if it is
+ * listening.
+ */
+int
+metrics_http_start(const char *spec)
+{
+	struct sockaddr_in addr;
+	const char *colon = strrchr(spec, ':');
+	char host[64];
+	pthread_t thread;
+	char *end;
+	long port;
+	int fd, one = 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (colon) {
+		if (colon - spec >= (int)sizeof(host))
+			return -1;
+		memcpy(host, spec, colon - spec);
+		host[colon - spec] = 0;
+		if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+			return -1;
+		spec = colon + 1;
+	}
+	port = strtol(spec, &end, 10);
+	if (*end || port <= 0 || port > 65535)
+		return -1;
+	addr.sin_port = htons(port);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, 4) < 0 ||
+	    pthread_create(&thread, NULL, listener_thread,
+			   (void *)(long)fd) != 0) {
+		close(fd);
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+static const char *snapshot_path;
+
+/* One write, so that snapshots appended by another run don't interleave */
+static void
+write_snapshot(int fd)
+{
+	char *body = NULL;
+	size_t len = 0, done = 0;
+	ssize_t n;
+	time_t now = time(NULL);
+	char date[32];
+	FILE *f;
+
+	f = open_memstream(&body, &len);
+	if (!f)
+		return;
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&now));
+	fprintf(f, "# snapshot of pid %d at %s\n", (int)getpid(), date);
+	metrics_write(f);
+	fclose(f);
+	while (done < len) {
+		n = write(fd, body + done, len - done);
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	free(body);
+}
+
+static void *
+snapshot_thread(void *data)
+{
+	sigset_t *set = data;
+	int sig, fd;
+
+	while (1) {
+		if (sigwait(set, &sig) != 0)
+			continue;
+		if (sig == SIGUSR1 && snapshot_path) {
+			fd = open(snapshot_path, O_WRONLY | O_CREAT | O_APPEND,
+				  0644);
+			if (fd < 0)
+				continue;
+			write_snapshot(fd);
+			close(fd);
+		} else {
+			write_snapshot(STDERR_FILENO);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Write a snapshot of the metrics for every SIGUSR1, appended to path if
+ * there is one, and for every SIGUSR2 to stderr. The signals are blocked
+ * and taken with sigwait() by a thread of their own, so nothing runs in a
+ * signal handler and no other thread gets interrupted. That only holds
+ * for the threads that are created afterwards, this has to be called
+ * before any other. Returns 0 if the thread is there.
+ */
+int
+metrics_snapshot_start(const char *path)
+{
+	static sigset_t set;
+	pthread_t thread;
+
+	snapshot_path = path;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGUSR2);
+	if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0 ||
+	    pthread_create(&thread, NULL, snapshot_thread, &set) != 0)
+		return -1;
+	pthread_detach(thread);
+	return 0;
+}
@@ -0,0 +1,258 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * A status segment in shared memory, /dev/shm/NAME, in which every process
+ * of a run publishes what it does: its progress, the bytes it moved and
+ * the errors it found, one slot for every part of it. A supervisor reads
+ * all of them for one combined timeline, without any of the writers ever
+ * waiting: a slot is claimed with a compare and swap of its pid, and only
+ * its owner writes to it, bumping the sequence counter before and after,
+ * so that a reader can tell when it caught an update halfway and has to
+ * read again.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "status_shm.h"
+
+#define STATUS_INTERVAL		0.5 /* seconds between two updates */
+#define STATUS_READ_TRIES	1000
+
+static struct {
+	const char *name;
+	status_writer_t writer;
+	void *data;
+	status_slot_t *slot;
+	unsigned long long bytes;
+	double time;
+} writers[STATUS_WRITERS_MAX];
+static int writers_count;
+
+static status_segment_t *segment;
+
+static double
+status_time(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + 0.000000001 * t.tv_nsec;
+}
+
+/*
+ * Map the segment of the given name, which gets created when it is not
+ * there yet and create is set. Returns NULL if that fails.
+ */
+status_segment_t *
+status_open(const char *spec, int create)
+{
+	status_segment_t *s;
+	char name[64];
+	struct stat st;
+	int fd;
+
+	snprintf(name, sizeof(name), "%s%s", spec[0] == '/' ? "" : "/", spec);
+	fd = shm_open(name, O_RDWR | (create ? O_CREAT : 0), 0644);
+	if (fd < 0)
+		return NULL;
+	/* both sizes being the same, it does not matter who comes first */
+	if (fstat(fd, &st) < 0 ||
+	    (st.st_size < (off_t)sizeof(*s) &&
+	     ftruncate(fd, sizeof(*s)) < 0)) {
+		close(fd);
+		return NULL;
+	}
+	s = mmap(NULL, sizeof(*s), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s == MAP_FAILED)
+		return NULL;
+
+	if (s->header.magic != STATUS_MAGIC) {
+		s->header.slots = STATUS_SLOTS;
+		s->header.slot_size = sizeof(status_slot_t);
+		__atomic_store_n(&s->header.magic, STATUS_MAGIC,
+				 __ATOMIC_RELEASE);
+	} else if (s->header.slots != STATUS_SLOTS ||
+		   s->header.slot_size != sizeof(status_slot_t)) {
+		munmap(s, sizeof(*s));
+		return NULL;
+	}
+	return s;
+}
+
+/*
+ * Copy slot i, as its owner last left it. Returns 0 if it is in use, -1
+ * if it is free, or if the owner never came out of an update.
+ */
+int
+status_read(status_segment_t *s, int i, status_slot_t *copy)
+{
+	status_slot_t *slot = &s->slot[i];
+	unsigned int seq;
+	int tries;
+
+	for (tries = 0; tries < STATUS_READ_TRIES; tries++) {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(copy, slot, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+			return copy->pid ? 0 : -1;
+	}
+	return -1;
+}
+
+/* Free the slots of a process that is gone */
+void
+status_release(status_segment_t *s, int pid)
+{
+	int i;
+
+	for (i = 0; i < STATUS_SLOTS; i++)
+		__sync_bool_compare_and_swap(&s->slot[i].pid, pid, 0);
+}
+
+/*
+ * Take a free slot, or one whose owner died without releasing it, and
+ * set it up for the named writer of this process.
+ */
+static status_slot_t *
+status_claim(const char *tool, const char *name)
+{
+	status_slot_t *slot;
+	int i, pid;
+
+	for (i = 0; i < STATUS_SLOTS; i++) {
+		slot = &segment->slot[i];
+		pid = __atomic_load_n(&slot->pid, __ATOMIC_RELAXED);
+		if (pid && (kill(pid, 0) == 0 || errno != ESRCH))
+			continue;
+		if (!__sync_bool_compare_and_swap(&slot->pid, pid, getpid()))
+			continue;
+
+		__atomic_add_fetch(&slot->seq, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		snprintf(slot->tool, sizeof(slot->tool), "%s", tool);
+		snprintf(slot->name, sizeof(slot->name), "%s", name);
+		memset(&slot->status, 0, sizeof(slot->status));
+		slot->mb_per_s = 0;
+		slot->updated = status_time();
+		__atomic_add_fetch(&slot->seq, 1, __ATOMIC_RELEASE);
+		return slot;
+	}
+	return NULL;
+}
+
+static void
+status_update(int i)
+{
+	status_slot_t *slot = writers[i].slot;
+	double now = status_time();
+	status_t status;
+
+	memset(&status, 0, sizeof(status));
+	writers[i].writer(&status, writers[i].data);
+
+	__atomic_add_fetch(&slot->seq, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->status = status;
+	if (now > writers[i].time && status.bytes >= writers[i].bytes)
+		slot->mb_per_s = (status.bytes - writers[i].bytes) /
+			(now - writers[i].time) / 1000000.0;
+	slot->updated = now;
+	__atomic_add_fetch(&slot->seq, 1, __ATOMIC_RELEASE);
+
+	writers[i].bytes = status.bytes;
+	writers[i].time = now;
+}
+
+static void *
+status_thread(void *data)
+{
+	int i;
+
+	while (1) {
+		for (i = 0; i < writers_count; i++)
+			status_update(i);
+		usleep(STATUS_INTERVAL * 1000000);
+	}
+	return NULL;
+}
+
+static void
+status_exit(void)
+{
+	status_release(segment, getpid());
+}
+
+void
+status_add(const char *name, status_writer_t writer, void *data)
+{
+	if (writers_count == STATUS_WRITERS_MAX)
+		return;
+	writers[writers_count].name = name;
+	writers[writers_count].writer = writer;
+	writers[writers_count].data = data;
+	writers_count++;
+}
+
+/*
+ * Publish the writers that were added in the segment named by spec, from
+ * a thread which updates them every STATUS_INTERVAL, as the given tool.
+ * Returns 0 if they are published.
+ */
+int
+status_start(const char *spec, const char *tool)
+{
+	pthread_t thread;
+	int i;
+
+	segment = status_open(spec, 1);
+	if (!segment)
+		return -1;
+	for (i = 0; i < writers_count; i++) {
+		writers[i].slot = status_claim(tool, writers[i].name);
+		if (!writers[i].slot) {
+			status_exit();
+			return -1;
+		}
+		writers[i].time = status_time();
+	}
+	atexit(status_exit);
+	if (pthread_create(&thread, NULL, status_thread, NULL) != 0)
+		return -1;
+	pthread_detach(thread);
+	return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef STATUS_SHM_H
+#define STATUS_SHM_H
+
+#define STATUS_MAGIC		0x4C535431 /* "LST1" */
+#define STATUS_SLOTS		32
+#define STATUS_CACHE_LINE	64
+#define STATUS_WRITERS_MAX	4
+
+/* What a writer publishes, filled in again for every update */
+typedef struct {
+	char state[32];			/* what runs now, for people */
+	unsigned long long progress;	/* loops, frames or samples done */
+	unsigned long long bytes;	/* moved since the start */
+	unsigned long long errors;	/* failures since the start */
+} status_t;
+
+typedef void (*status_writer_t)(status_t *status, void *data);
+
+/*
+ * Every slot has a single owner, which updates it through the sequence
+ * counter, and starts on a cache line of its own, so that the owners
+ * never write to the same line.
+ */
+typedef struct {
+	unsigned int seq;		/* odd while the owner updates */
+	int pid;			/* 0 for a free slot */
+	char tool[16];
+	char name[16];
+	double updated;			/* CLOCK_MONOTONIC seconds */
+	double mb_per_s;		/* of the bytes, since the update before */
+	status_t status;
+} __attribute__((aligned(STATUS_CACHE_LINE))) status_slot_t;
+
+typedef struct {
+	unsigned int magic;
+	unsigned int slots;
+	unsigned int slot_size;
+} __attribute__((aligned(STATUS_CACHE_LINE))) status_header_t;
+
+typedef struct {
+	status_header_t header;
+	status_slot_t slot[STATUS_SLOTS];
+} status_segment_t;
+
+void status_add(const char *name, status_writer_t writer, void *data);
+int status_start(const char *spec, const char *tool);
+
+status_segment_t *status_open(const char *spec, int create);
+int status_read(status_segment_t *segment, int i, status_slot_t *copy);
+void status_release(status_segment_t *segment, int pid);
+
+#endif
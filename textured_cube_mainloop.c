@@ -18,22 +18,1583 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include <GLES2/gl2.h>
 
-#include "limare.h"
-#include "formats.h"
+#include "limare.h"
+#include "fb.h"
+#include "bmp.h"
+#include "formats.h"
+
+#include "esUtil.h"
+#include "cube_mesh.h"
+#include "companion.h"
+#include "status_shm.h"
+#include "transform_batch.h"
+
+#ifdef MEMTESTER_MODE
+#include "memtester-4.3.0/types.h"
+#include "memtester-4.3.0/memtester.h"
+#endif
+
+/*
+ * Stress profiles: the spinning cube is a fairly light load, the other
+ * profiles try to keep the memory bus as busy as lima-memspeed's gpu_copy.
+ * Each profile reports the number of bytes it asks the gpu to move per
+ * frame, on top of the framebuffer write. This is what the draws need, the
+ * actual bus traffic is higher as caches fetch whole lines.
+ */
+struct stress_profile {
+	const char *name;
+	const char *description;
+	int (*setup)(struct limare_state *state, int width, int height);
+	int (*draw)(struct limare_state *state, int frame);
+	/* only renders what changes, see limare_damage */
+	int damage;
+};
+
+static double stress_frame_bytes;
+/* the damage of the profile is in use, which the frames cannot replay */
+static int stress_damage;
+/* of the framebuffer the last frame wrote */
+static double stress_fb_fraction = 1.0;
+/* the sum of what the reports estimate for every frame */
+static double stress_bytes;
+static const char *stress_profile_name;
+static float stress_aspect;
+
+/* modelviewprojectionMatrix of the program the profiles draw with */
+static int stress_mvp;
+
+/* moves the tile that gets rendered onto the target, see supersampling */
+static ESMatrix stress_tile;
+
+static void
+stress_matrix_attach(struct limare_state *state, ESMatrix *mvp)
+{
+	ESMatrix tiled;
+
+	esMatrixMultiply(&tiled, mvp, &stress_tile);
+	limare_uniform_attach_location(state, stress_mvp, 16, &tiled.m[0][0]);
+}
+
+static float quad_vertices[4][3] = {
+	{-1.0, -1.0, +1.0},
+	{+1.0, -1.0, +1.0},
+	{-1.0, +1.0, +1.0},
+	{+1.0, +1.0, +1.0},
+};
+
+static void
+quad_matrix_attach(struct limare_state *state)
+{
+	ESMatrix modelviewprojection;
+
+	esMatrixLoadIdentity(&modelviewprojection);
+	esTranslate(&modelviewprojection, 0.0, 0.0, -0.5);
+
+	stress_matrix_attach(state, &modelviewprojection);
+}
+
+static uint32_t
+random_next(uint32_t *seed)
+{
+	uint32_t x = *seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*seed = x;
+
+	return x;
+}
+
+/*
+ * Procedural textures, for the profiles that use the companion texture,
+ * picked with LIMA_STRESS_PATTERN as "name[:size[:format]]", say
+ * "hash:2048" or "hash:2048:rgb565":
+ *
+ *   companion  the compiled in companion image (default)
+ *   hash       every texel on its own, nothing for the texture cache
+ *   checker    4x4 checker cells of hashed colours
+ *   noise      smooth value noise over an 8 texel lattice
+ *
+ * The size is the width and the height, 512 when left out, the format is
+ * rgba8888 unless rgb888 or rgb565 is given. Builds without the companion
+ * image default to hash.
+ */
+#define PATTERN_SIZE 512
+#define PATTERN_CHECKER_SHIFT 2
+#define PATTERN_NOISE_SHIFT 3
+#define PATTERN_SEED 0x9E3779B9
+
+static uint32_t
+pattern_hash(uint32_t x)
+{
+	x += PATTERN_SEED;
+	x ^= x >> 16;
+	x *= 0x7FEB352D;
+	x ^= x >> 15;
+	x *= 0x846CA68B;
+	x ^= x >> 16;
+
+	return x;
+}
+
+/*
+ * Four texels at a time through neon, both versions give the same result.
+ */
+static void
+pattern_hash_row(uint32_t *pixels, uint32_t index, int count)
+{
+	int i = 0;
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+	static const uint32_t steps[4] = { 0, 1, 2, 3 };
+	uint32x4_t x, next = vaddq_u32(vdupq_n_u32(index + PATTERN_SEED),
+				       vld1q_u32(steps));
+
+	for (; (i + 4) <= count; i += 4) {
+		x = next;
+		next = vaddq_u32(next, vdupq_n_u32(4));
+
+		x = veorq_u32(x, vshrq_n_u32(x, 16));
+		x = vmulq_u32(x, vdupq_n_u32(0x7FEB352D));
+		x = veorq_u32(x, vshrq_n_u32(x, 15));
+		x = vmulq_u32(x, vdupq_n_u32(0x846CA68B));
+		x = veorq_u32(x, vshrq_n_u32(x, 16));
+
+		vst1q_u32(pixels + i, x);
+	}
+#endif
+
+	for (; i < count; i++)
+		pixels[i] = pattern_hash(index + i);
+}
+
+static uint32_t
+pattern_lerp(uint32_t a, uint32_t b, int weight, int shift)
+{
+	uint32_t result = 0;
+	int i;
+
+	for (i = 0; i < 32; i += 8) {
+		int ca = (a >> i) & 0xFF, cb = (b >> i) & 0xFF;
+
+		result |= (uint32_t) (ca + (((cb - ca) * weight) >> shift)) << i;
+	}
+
+	return result;
+}
+
+static uint32_t
+pattern_noise(int x, int y, int size)
+{
+	int cells = size >> PATTERN_NOISE_SHIFT;
+	int mask = (1 << PATTERN_NOISE_SHIFT) - 1;
+	int cx = x >> PATTERN_NOISE_SHIFT, cy = y >> PATTERN_NOISE_SHIFT;
+	int nx = (cx + 1) % cells, ny = (cy + 1) % cells;
+	uint32_t top, bottom;
+
+	/* wraps around, so it tiles cleanly with GL_REPEAT. */
+	top = pattern_lerp(pattern_hash(cy * cells + cx),
+			   pattern_hash(cy * cells + nx),
+			   x & mask, PATTERN_NOISE_SHIFT);
+	bottom = pattern_lerp(pattern_hash(ny * cells + cx),
+			      pattern_hash(ny * cells + nx),
+			      x & mask, PATTERN_NOISE_SHIFT);
+
+	return pattern_lerp(top, bottom, y & mask, PATTERN_NOISE_SHIFT);
+}
+
+static uint32_t *
+pattern_generate(const char *name, int size)
+{
+	uint32_t *pixels;
+	int x, y;
+
+	pixels = malloc(size * size * sizeof(uint32_t));
+	if (!pixels)
+		return NULL;
+
+	for (y = 0; y < size; y++) {
+		uint32_t *row = pixels + y * size;
+
+		if (!strcmp(name, "hash"))
+			pattern_hash_row(row, y * size, size);
+		else if (!strcmp(name, "checker"))
+			for (x = 0; x < size; x++) {
+				int cx = x >> PATTERN_CHECKER_SHIFT;
+				int cy = y >> PATTERN_CHECKER_SHIFT;
+				uint32_t color = pattern_hash(cy * size + cx);
+
+				row[x] = ((cx ^ cy) & 1) ? ~color : color;
+			}
+		else
+			for (x = 0; x < size; x++)
+				row[x] = pattern_noise(x, y, size);
+	}
+
+	return pixels;
+}
+
+static int
+pattern_texture_upload(struct limare_state *state)
+{
+	const char *env = getenv("LIMA_STRESS_PATTERN");
+	char name[16] = "hash", format_name[16] = "rgba8888";
+	int size = PATTERN_SIZE, format;
+	uint32_t *pixels;
+	void *texels;
+	int texture;
+
+	if (env && *env)
+		sscanf(env, "%15[^:]:%d:%15s", name, &size, format_name);
+#ifndef HAVE_NO_COMPANION_TEXTURE
+	else
+		strcpy(name, "companion");
+
+	if (!strcmp(name, "companion"))
+		return limare_texture_upload(state, companion_texture_flat,
+					     COMPANION_TEXTURE_WIDTH,
+					     COMPANION_TEXTURE_HEIGHT,
+					     COMPANION_TEXTURE_FORMAT, 0);
+#endif
+
+	if (strcmp(name, "hash") && strcmp(name, "checker") &&
+	    strcmp(name, "noise")) {
+		printf("Unknown texture pattern \"%s\", using hash\n", name);
+		strcpy(name, "hash");
+	}
+
+	/* the noise lattice needs to fit a whole number of times. */
+	if ((size < 16) || (size > 4096)) {
+		printf("Texture pattern size %d out of range, using %d\n",
+		       size, PATTERN_SIZE);
+		size = PATTERN_SIZE;
+	}
+	size &= ~((1 << PATTERN_NOISE_SHIFT) - 1);
+
+	format = limare_texel_format_parse(format_name);
+	if (format == -1) {
+		printf("Unknown texture format \"%s\", using rgba8888\n",
+		       format_name);
+		format = LIMA_TEXEL_FORMAT_RGBA_8888;
+	}
+
+	pixels = pattern_generate(name, size);
+	if (!pixels)
+		return -1;
+
+	texels = limare_texels_convert(pixels, size, size, format);
+	free(pixels);
+	if (!texels)
+		return -1;
+
+	texture = limare_texture_upload(state, texels, size, size, format, 0);
+	free(texels);
+
+	return texture;
+}
+
+/*
+ * cube: the original spinning companion cube.
+ */
+static int
+cube_setup(struct limare_state *state, int width, int height)
+{
+	int texture;
+
+	limare_enable(state, GL_DEPTH_TEST);
+	limare_enable(state, GL_CULL_FACE);
+	limare_depth_mask(state, 1);
+
+	limare_attribute_pointer(state, "in_position", LIMARE_ATTRIB_FLOAT,
+				 3, 0, CUBE_VERTEX_COUNT, cube_vertices);
+	limare_attribute_pointer(state, "in_coord", LIMARE_ATTRIB_FLOAT,
+				 2, 0, CUBE_VERTEX_COUNT,
+				 cube_texture_coordinates);
+
+	texture = pattern_texture_upload(state);
+	if (texture < 0)
+		return texture;
+
+	limare_texture_attach(state, "in_texture", texture);
+
+	stress_frame_bytes = 0;
+
+	return 0;
+}
+
+static void
+cube_matrix(ESMatrix *modelviewprojection, int frame)
+{
+	float angle = 0.5 * frame;
+
+	ESMatrix modelview;
+	esMatrixLoadIdentity(&modelview);
+	esTranslate(&modelview, 0.0, 0.0, -4.0);
+	esRotate(&modelview, angle * 0.97, 1.0, 0.0, 0.0);
+	esRotate(&modelview, angle * 1.13, 0.0, 1.0, 0.0);
+	esRotate(&modelview, angle * 0.73, 0.0, 0.0, 1.0);
+
+	ESMatrix projection;
+	esMatrixLoadIdentity(&projection);
+	esFrustum(&projection, -1.0, +1.0, -1.0 * stress_aspect,
+		  +1.0 * stress_aspect, 1.0, 10.0);
+
+	esMatrixLoadIdentity(modelviewprojection);
+	esMatrixMultiply(modelviewprojection, &modelview, &projection);
+}
+
+static int
+cube_draw(struct limare_state *state, int frame)
+{
+	ESMatrix modelviewprojection;
+
+	cube_matrix(&modelviewprojection, frame);
+	stress_matrix_attach(state, &modelviewprojection);
+
+	return limare_draw_elements(state, GL_TRIANGLES, CUBE_INDEX_COUNT,
+				    &cube_indices, GL_UNSIGNED_BYTE);
+}
+
+/*
+ * indicator: the same cube, for a display which only has to show that the
+ * board is alive. Only the tiles around the cube get rendered, and copied
+ * to a kms display, the rest of the screen keeps the clear color that the
+ * earlier frames left there. Supersampled, it is the plain cube again.
+ */
+#define INDICATOR_MARGIN 2
+
+static int
+indicator_setup(struct limare_state *state, int width, int height)
+{
+	if (stress_damage)
+		limare_enable(state, GL_SCISSOR_TEST);
+
+	return cube_setup(state, width, height);
+}
+
+static int
+indicator_draw(struct limare_state *state, int frame)
+{
+	ESMatrix modelviewprojection;
+	float x0 = state->width, y0 = state->height, x1 = 0.0, y1 = 0.0;
+	int i, j, x, y, width, height;
+
+	if (!stress_damage)
+		return cube_draw(state, frame);
+
+	cube_matrix(&modelviewprojection, frame);
+
+	/* window coordinates of the corners, w stays well above 0 at -4. */
+	for (i = 0; i < CUBE_VERTEX_COUNT; i++) {
+		float clip[4];
+
+		for (j = 0; j < 4; j++)
+			clip[j] = cube_vertices[i][0] *
+				modelviewprojection.m[0][j] +
+				cube_vertices[i][1] *
+				modelviewprojection.m[1][j] +
+				cube_vertices[i][2] *
+				modelviewprojection.m[2][j] +
+				modelviewprojection.m[3][j];
+
+		clip[0] = (clip[0] / clip[3] + 1.0) * 0.5 * state->width;
+		clip[1] = (clip[1] / clip[3] + 1.0) * 0.5 * state->height;
+
+		if (clip[0] < x0)
+			x0 = clip[0];
+		if (clip[0] > x1)
+			x1 = clip[0];
+		if (clip[1] < y0)
+			y0 = clip[1];
+		if (clip[1] > y1)
+			y1 = clip[1];
+	}
+
+	x = x0 - INDICATOR_MARGIN;
+	y = y0 - INDICATOR_MARGIN;
+	width = x1 + INDICATOR_MARGIN - x;
+	height = y1 + INDICATOR_MARGIN - y;
+
+	if (x < 0) {
+		width += x;
+		x = 0;
+	}
+	if (y < 0) {
+		height += y;
+		y = 0;
+	}
+	if ((x + width) > state->width)
+		width = state->width - x;
+	if ((y + height) > state->height)
+		height = state->height - y;
+	if ((width <= 0) || (height <= 0))
+		x = y = width = height = 0;
+
+	limare_scissor(state, x, y, width, height);
+	limare_damage(state, x, y, width, height);
+
+	stress_fb_fraction = (double) width * height /
+		((double) state->width * state->height);
+
+	stress_matrix_attach(state, &modelviewprojection);
+
+	return limare_draw_elements(state, GL_TRIANGLES, CUBE_INDEX_COUNT,
+				    &cube_indices, GL_UNSIGNED_BYTE);
+}
+
+/*
+ * fill: full screen quads on top of each other, each reading a screen
+ * sized texture. The overdraw itself stays in the tile buffer, only the
+ * texture reads and the final tile writes hit memory.
+ */
+#define FILL_LAYERS 8
+
+static float fill_texture_coordinates[4][2] = {
+	{0.0, 1.0},
+	{1.0, 1.0},
+	{0.0, 0.0},
+	{1.0, 0.0},
+};
+
+static int
+fill_setup(struct limare_state *state, int width, int height)
+{
+	uint32_t *pixels;
+	uint32_t seed = 0x12345678;
+	int texture, i;
+
+	pixels = malloc(width * height * sizeof(uint32_t));
+	if (!pixels)
+		return -1;
+
+	for (i = 0; i < (width * height); i++)
+		pixels[i] = random_next(&seed);
+
+	limare_attribute_pointer(state, "in_position", LIMARE_ATTRIB_FLOAT,
+				 3, 0, 4, quad_vertices);
+	limare_attribute_pointer(state, "in_coord", LIMARE_ATTRIB_FLOAT,
+				 2, 0, 4, fill_texture_coordinates);
+
+	texture = limare_texture_upload(state, pixels, width, height,
+					LIMA_TEXEL_FORMAT_RGBA_8888, 0);
+	free(pixels);
+	if (texture < 0)
+		return texture;
+
+	limare_texture_attach(state, "in_texture", texture);
+
+	stress_frame_bytes = (double) FILL_LAYERS * width * height * 4;
+
+	return 0;
+}
+
+static int
+fill_draw(struct limare_state *state, int frame)
+{
+	int start[FILL_LAYERS], count[FILL_LAYERS];
+	int i;
+
+	for (i = 0; i < FILL_LAYERS; i++) {
+		start[i] = 0;
+		count[i] = 4;
+	}
+
+	quad_matrix_attach(state);
+
+	return limare_draw_arrays_multi(state, GL_TRIANGLE_STRIP, start, count,
+					FILL_LAYERS);
+}
+
+/*
+ * texture: a large random texture, sampled so that neighbouring pixels
+ * are TEXTURE_STRIDE texels apart. Every fragment then lands in a
+ * different texture block, and the texture cache is of no help.
+ *
+ * LIMA_STRESS_TEXTURE can name a ppm or pam file to sample instead.
+ */
+#define TEXTURE_SIZE 1024
+#define TEXTURE_STRIDE 8
+#define TEXTURE_LAYERS 4
+
+static float texture_texture_coordinates[4][2];
+
+static int
+texture_setup(struct limare_state *state, int width, int height)
+{
+	const char *file = getenv("LIMA_STRESS_TEXTURE");
+	uint32_t *pixels;
+	uint32_t seed = 0x87654321;
+	int texture_width = TEXTURE_SIZE, texture_height = TEXTURE_SIZE;
+	float s, t;
+	int texture, i;
+
+	if (file && *file) {
+		texture = limare_texture_upload_file(state, file, 0,
+						     &texture_width,
+						     &texture_height);
+		if (texture < 0)
+			return texture;
+	} else {
+		pixels = malloc(TEXTURE_SIZE * TEXTURE_SIZE *
+				sizeof(uint32_t));
+		if (!pixels)
+			return -1;
+
+		for (i = 0; i < (TEXTURE_SIZE * TEXTURE_SIZE); i++)
+			pixels[i] = random_next(&seed);
+
+		texture = limare_texture_upload(state, pixels, TEXTURE_SIZE,
+						TEXTURE_SIZE,
+						LIMA_TEXEL_FORMAT_RGBA_8888, 0);
+		free(pixels);
+		if (texture < 0)
+			return texture;
+	}
+
+	s = (float) width * TEXTURE_STRIDE / texture_width;
+	t = (float) height * TEXTURE_STRIDE / texture_height;
+
+	texture_texture_coordinates[0][0] = 0.0;
+	texture_texture_coordinates[0][1] = t;
+	texture_texture_coordinates[1][0] = s;
+	texture_texture_coordinates[1][1] = t;
+	texture_texture_coordinates[2][0] = 0.0;
+	texture_texture_coordinates[2][1] = 0.0;
+	texture_texture_coordinates[3][0] = s;
+	texture_texture_coordinates[3][1] = 0.0;
+
+	limare_attribute_pointer(state, "in_position", LIMARE_ATTRIB_FLOAT,
+				 3, 0, 4, quad_vertices);
+	limare_attribute_pointer(state, "in_coord", LIMARE_ATTRIB_FLOAT,
+				 2, 0, 4, texture_texture_coordinates);
+
+	limare_texture_parameters(state, texture, GL_NEAREST, GL_NEAREST,
+				  GL_REPEAT, GL_REPEAT);
+	limare_texture_attach(state, "in_texture", texture);
+
+	stress_frame_bytes = (double) TEXTURE_LAYERS * width * height * 4;
+
+	return 0;
+}
+
+static int
+texture_draw(struct limare_state *state, int frame)
+{
+	int start[TEXTURE_LAYERS], count[TEXTURE_LAYERS];
+	int i;
+
+	for (i = 0; i < TEXTURE_LAYERS; i++) {
+		start[i] = 0;
+		count[i] = 4;
+	}
+
+	quad_matrix_attach(state);
+
+	return limare_draw_arrays_multi(state, GL_TRIANGLE_STRIP, start, count,
+					TEXTURE_LAYERS);
+}
+
+/*
+ * geometry: a finely tesselated grid, kept in vertex and index buffers,
+ * drawn a few times per frame at different angles.
+ */
+#define GEOMETRY_GRID_W 64
+#define GEOMETRY_GRID_H 48
+#define GEOMETRY_VERTEX_COUNT ((GEOMETRY_GRID_W + 1) * (GEOMETRY_GRID_H + 1))
+#define GEOMETRY_INDEX_COUNT (GEOMETRY_GRID_W * GEOMETRY_GRID_H * 6)
+#define GEOMETRY_LAYERS 4
+/* a common post transform cache size, for scoring the index orders */
+#define GEOMETRY_VERTEX_CACHE 16
+
+static int geometry_indices_buffer;
+
+/*
+ * LIMA_STRESS_INDEX_ORDER is "grid", row after row as the triangles get
+ * generated, "tipsify", which reorders the triangles for the vertex cache
+ * and then the vertices in the order of their first use, or "shuffled",
+ * which is as bad for both as it gets. The gp runs the vs over the vertex
+ * range in order either way, so this only moves the plbu fetches of the
+ * shaded positions around.
+ */
+enum geometry_order {
+	GEOMETRY_ORDER_GRID,
+	GEOMETRY_ORDER_TIPSIFY,
+	GEOMETRY_ORDER_SHUFFLED,
+};
+
+static const char *geometry_order_names[] = {
+	"grid", "tipsify", "shuffled",
+};
+
+static int
+geometry_index_order(void)
+{
+	const char *env = getenv("LIMA_STRESS_INDEX_ORDER");
+	int i;
+
+	if (!env || !*env)
+		return GEOMETRY_ORDER_GRID;
+
+	for (i = 0; i <= GEOMETRY_ORDER_SHUFFLED; i++)
+		if (!strcmp(env, geometry_order_names[i]))
+			return i;
+
+	printf("LIMA_STRESS_INDEX_ORDER=%s is not grid, tipsify or shuffled, "
+	       "using grid.\n", env);
+	return GEOMETRY_ORDER_GRID;
+}
+
+static int
+geometry_reorder(unsigned short *indices, float *vertices, float *coords)
+{
+	int order = geometry_index_order();
+	int remap[GEOMETRY_VERTEX_COUNT];
+	int ret;
+
+	switch (order) {
+	case GEOMETRY_ORDER_TIPSIFY:
+		ret = limare_mesh_optimize(indices, GEOMETRY_INDEX_COUNT,
+					   GEOMETRY_VERTEX_COUNT,
+					   GEOMETRY_VERTEX_CACHE);
+		if (ret)
+			return ret;
+
+		limare_mesh_vertices_order(indices, GEOMETRY_INDEX_COUNT,
+					   GEOMETRY_VERTEX_COUNT, remap);
+		ret = limare_mesh_vertices_remap(vertices, 3 * sizeof(float),
+						 GEOMETRY_VERTEX_COUNT, remap);
+		if (!ret)
+			ret = limare_mesh_vertices_remap(coords,
+							 2 * sizeof(float),
+							 GEOMETRY_VERTEX_COUNT,
+							 remap);
+		if (ret)
+			return ret;
+		break;
+	case GEOMETRY_ORDER_SHUFFLED:
+		limare_mesh_shuffle(indices, GEOMETRY_INDEX_COUNT, 1);
+		break;
+	default:
+		break;
+	}
+
+	printf("geometry: %s index order, %.2f vertices per triangle with a "
+	       "%d entry cache.\n", geometry_order_names[order],
+	       limare_mesh_acmr(indices, GEOMETRY_INDEX_COUNT,
+				GEOMETRY_VERTEX_COUNT, GEOMETRY_VERTEX_CACHE),
+	       GEOMETRY_VERTEX_CACHE);
+
+	return 0;
+}
+
+/*
+ * LIMA_STRESS_VERTEX_FORMAT picks the type the attributes get packed into,
+ * only the signed ones can hold the grid, which spans [-1, 1].
+ */
+static int
+geometry_vertex_format(void)
+{
+	const char *env = getenv("LIMA_STRESS_VERTEX_FORMAT");
+	int type;
+
+	if (!env || !*env)
+		return LIMARE_ATTRIB_FLOAT;
+
+	type = limare_attrib_type_parse(env);
+	if ((type != LIMARE_ATTRIB_FLOAT) && (type != LIMARE_ATTRIB_FIXED) &&
+	    (type != LIMARE_ATTRIB_I16N) && (type != LIMARE_ATTRIB_I8N)) {
+		printf("LIMA_STRESS_VERTEX_FORMAT=%s is not float, fixed, i16n "
+		       "or i8n, using float.\n", env);
+		return LIMARE_ATTRIB_FLOAT;
+	}
+
+	return type;
+}
+
+static int
+geometry_setup(struct limare_state *state, int width, int height)
+{
+	/* the buffer uploads copy whole 0x40 byte blocks. */
+	int vertices_size = ALIGN(GEOMETRY_VERTEX_COUNT * 3 * sizeof(float),
+				  0x40);
+	int coords_size = ALIGN(GEOMETRY_VERTEX_COUNT * 2 * sizeof(float),
+				0x40);
+	int indices_size = ALIGN(GEOMETRY_INDEX_COUNT * sizeof(unsigned short),
+				 0x40);
+	float *vertices = calloc(1, vertices_size);
+	float *coords = calloc(1, coords_size);
+	unsigned short *indices = calloc(1, indices_size);
+	int vertices_buffer, coords_buffer, texture;
+	int type = geometry_vertex_format();
+	int x, y, i, ret = -1;
+
+	if (!vertices || !coords || !indices)
+		goto out;
+
+	/* geometry_draw scales this up a bit, so that rotation covers all */
+	for (y = 0, i = 0; y <= GEOMETRY_GRID_H; y++) {
+		for (x = 0; x <= GEOMETRY_GRID_W; x++, i++) {
+			vertices[3 * i + 0] = 2.0 * x / GEOMETRY_GRID_W - 1.0;
+			vertices[3 * i + 1] = 2.0 * y / GEOMETRY_GRID_H - 1.0;
+			vertices[3 * i + 2] = 1.0;
+
+			coords[2 * i + 0] = (float) x / GEOMETRY_GRID_W;
+			coords[2 * i + 1] = (float) y / GEOMETRY_GRID_H;
+		}
+	}
+
+	for (y = 0, i = 0; y < GEOMETRY_GRID_H; y++) {
+		for (x = 0; x < GEOMETRY_GRID_W; x++) {
+			int v = y * (GEOMETRY_GRID_W + 1) + x;
+
+			indices[i++] = v;
+			indices[i++] = v + 1;
+			indices[i++] = v + GEOMETRY_GRID_W + 1;
+			indices[i++] = v + GEOMETRY_GRID_W + 2;
+			indices[i++] = v + GEOMETRY_GRID_W + 1;
+			indices[i++] = v + 1;
+		}
+	}
+
+	if (geometry_reorder(indices, vertices, coords))
+		goto out;
+
+	vertices_buffer =
+		limare_attribute_buffer_upload_float(state, type, 3,
+						     GEOMETRY_VERTEX_COUNT,
+						     vertices);
+	coords_buffer =
+		limare_attribute_buffer_upload_float(state, type, 2,
+						     GEOMETRY_VERTEX_COUNT,
+						     coords);
+	geometry_indices_buffer =
+		limare_elements_buffer_upload(state, GL_TRIANGLES,
+					      GL_UNSIGNED_SHORT,
+					      GEOMETRY_INDEX_COUNT, indices);
+	if ((vertices_buffer < 0) || (coords_buffer < 0) ||
+	    (geometry_indices_buffer < 0))
+		goto out;
+
+	limare_attribute_buffer_attach(state, "in_position", vertices_buffer);
+	limare_attribute_buffer_attach(state, "in_coord", coords_buffer);
+
+	texture = pattern_texture_upload(state);
+	if (texture < 0)
+		goto out;
+
+	limare_texture_attach(state, "in_texture", texture);
+
+	/*
+	 * Per vertex: the attributes are read, gl_Position and the varyings
+	 * are written by the vs and read back by the plbu and pp.
+	 */
+	stress_frame_bytes = (double) GEOMETRY_LAYERS *
+		(GEOMETRY_VERTEX_COUNT * (limare_attrib_stride(type, 3) +
+					  limare_attrib_stride(type, 2) +
+					  2 * 4 * 4 + 2 * 2 * 4) +
+		 GEOMETRY_INDEX_COUNT * 2);
+
+	ret = 0;
+ out:
+	free(vertices);
+	free(coords);
+	free(indices);
+	return ret;
+}
+
+static int
+geometry_draw(struct limare_state *state, int frame)
+{
+	ESMatrix modelviewprojection;
+	int i, ret;
+
+	for (i = 0; i < GEOMETRY_LAYERS; i++) {
+		esMatrixLoadIdentity(&modelviewprojection);
+		esTranslate(&modelviewprojection, 0.0, 0.0, -0.5);
+		esRotate(&modelviewprojection,
+			 0.25 * frame + (90.0 * i) / GEOMETRY_LAYERS,
+			 0.0, 0.0, 1.0);
+		esScale(&modelviewprojection, 1.5, 1.5, 1.0);
+
+		stress_matrix_attach(state, &modelviewprojection);
+
+		ret = limare_draw_elements_buffer(state,
+						  geometry_indices_buffer);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * objects: a grid of small spinning cubes, LIMA_STRESS_OBJECTS of them and
+ * 256 by default, each a draw of its own with its own matrix. The matrices
+ * are set up a whole frame at a time, with transform_batch, so that the
+ * cpu keeps up with the draws.
+ */
+#define OBJECTS_MAX 1024
+#define OBJECTS_DEFAULT 256
+
+static int objects_count;
+static int objects_indices_buffer;
+static float objects_offsets[OBJECTS_MAX][3];
+static float objects_phases[OBJECTS_MAX];
+static float objects_angles[OBJECTS_MAX];
+static ESMatrix objects_matrices[OBJECTS_MAX];
+static ESMatrix objects_projection;
+
+static int
+objects_setup(struct limare_state *state, int width, int height)
+{
+	const char *env = getenv("LIMA_STRESS_OBJECTS");
+	int vertices_buffer, coords_buffer, texture;
+	int columns, rows, distance, i;
+	uint32_t seed = 0x12345678;
+
+	objects_count = OBJECTS_DEFAULT;
+	if (env && *env) {
+		objects_count = atoi(env);
+		if ((objects_count < 1) || (objects_count > OBJECTS_MAX)) {
+			printf("LIMA_STRESS_OBJECTS=%s is not in between 1 and "
+			       "%d\n", env, OBJECTS_MAX);
+			return -1;
+		}
+	}
+
+	for (columns = 1; (columns * columns) < objects_count; columns++)
+		;
+	rows = (objects_count + columns - 1) / columns;
+
+	/* 3 units apart, and far enough away for the columns to fit */
+	distance = 2 + (3 * columns) / 2;
+	for (i = 0; i < objects_count; i++) {
+		objects_offsets[i][0] = 3.0 * (i % columns) - 1.5 * (columns - 1);
+		objects_offsets[i][1] = 3.0 * (i / columns) - 1.5 * (rows - 1);
+		objects_offsets[i][2] = -distance;
+		objects_phases[i] = random_next(&seed) % 360;
+	}
+
+	esMatrixLoadIdentity(&objects_projection);
+	esFrustum(&objects_projection, -1.0, +1.0, -1.0 * stress_aspect,
+		  +1.0 * stress_aspect, 1.0, distance + 4.0);
+
+	limare_enable(state, GL_DEPTH_TEST);
+	limare_enable(state, GL_CULL_FACE);
+	limare_depth_mask(state, 1);
+
+	vertices_buffer =
+		limare_attribute_buffer_upload(state, LIMARE_ATTRIB_FLOAT, 3,
+					       0, CUBE_VERTEX_COUNT,
+					       cube_vertices);
+	coords_buffer =
+		limare_attribute_buffer_upload(state, LIMARE_ATTRIB_FLOAT, 2,
+					       0, CUBE_VERTEX_COUNT,
+					       cube_texture_coordinates);
+	objects_indices_buffer =
+		limare_elements_buffer_upload(state, GL_TRIANGLES,
+					      GL_UNSIGNED_BYTE,
+					      CUBE_INDEX_COUNT, cube_indices);
+	if ((vertices_buffer < 0) || (coords_buffer < 0) ||
+	    (objects_indices_buffer < 0))
+		return -1;
+
+	limare_attribute_buffer_attach(state, "in_position", vertices_buffer);
+	limare_attribute_buffer_attach(state, "in_coord", coords_buffer);
+
+	texture = pattern_texture_upload(state);
+	if (texture < 0)
+		return texture;
+
+	limare_texture_attach(state, "in_texture", texture);
+
+	stress_frame_bytes = 0;
+
+	return 0;
+}
+
+static int
+objects_draw(struct limare_state *state, int frame)
+{
+	ESMatrix projection;
+	int i, ret;
+
+	/* the tile moves between the passes of a supersampled frame */
+	esMatrixMultiply(&projection, &objects_projection, &stress_tile);
+
+	transform_batch_identity(objects_matrices, objects_count);
+	transform_batch_translate(objects_matrices, objects_offsets,
+				  objects_count);
+
+	for (i = 0; i < objects_count; i++)
+		objects_angles[i] = 0.97 * (0.5 * frame + objects_phases[i]);
+	transform_batch_rotate(objects_matrices, objects_angles,
+			       1.0, 0.0, 0.0, objects_count);
+
+	for (i = 0; i < objects_count; i++)
+		objects_angles[i] = 1.13 * (0.5 * frame + objects_phases[i]);
+	transform_batch_rotate(objects_matrices, objects_angles,
+			       0.0, 1.0, 0.0, objects_count);
+
+	transform_batch_multiply(objects_matrices, objects_matrices,
+				 &projection, objects_count);
+
+	for (i = 0; i < objects_count; i++) {
+		limare_uniform_attach_location(state, stress_mvp, 16,
+					       objects_matrices[i].m[0]);
+
+		ret = limare_draw_elements_buffer(state,
+						  objects_indices_buffer);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static struct stress_profile stress_profiles[] = {
+	{ "cube", "the spinning textured cube", cube_setup, cube_draw },
+	{ "fill", "overdraw of full screen textured quads",
+	  fill_setup, fill_draw },
+	{ "texture", "cache defeating reads from a large random texture",
+	  texture_setup, texture_draw },
+	{ "geometry", "a large vertex and index buffer",
+	  geometry_setup, geometry_draw },
+	{ "objects", "hundreds of small cubes, one draw each",
+	  objects_setup, objects_draw },
+	{ "indicator", "the cube, rendering only the tiles it covers",
+	  indicator_setup, indicator_draw, 1 },
+	{ NULL },
+};
+
+static struct stress_profile *
+stress_profile_find(const char *name)
+{
+	struct stress_profile *profile;
+
+	if (!name || !name[0])
+		return &stress_profiles[0];
+
+	for (profile = stress_profiles; profile->name; profile++)
+		if (!strcmp(profile->name, name))
+			return profile;
+
+	printf("Unknown gpu stress profile \"%s\", available profiles:\n",
+	       name);
+	for (profile = stress_profiles; profile->name; profile++)
+		printf("    %-10s %s\n", profile->name, profile->description);
+
+	return &stress_profiles[0];
+}
+
+/*
+ * Supersampling: with LIMA_STRESS_SUPERSAMPLE=N, each frame of the profile
+ * gets rendered as N x N tiles, every one into a screen sized texture, and
+ * a resolve pass then draws the tiles scaled down into the fb. The scene
+ * stays the same, but the tile writeback and the resolve reads grow with
+ * the N * N samples per pixel, which makes for a dial on the dram load of
+ * the gpu. At N = 2, the linear filter of the resolve averages exactly the
+ * four samples of a pixel, above that it only takes the middle ones.
+ *
+ * The tiles need N * N times the size of the fb in AUX memory, which only
+ * grows so far: large screens need LIMA_FB_FORMAT=rgb565 for N = 2.
+ */
+#define SUPERSAMPLE_MAX 4
+
+struct stress_supersample {
+	int factor;
+	int program;
+	int sampler;
+	int tiles[SUPERSAMPLE_MAX * SUPERSAMPLE_MAX];
+
+	float vertices[SUPERSAMPLE_MAX * SUPERSAMPLE_MAX][4][3];
+	float coords[SUPERSAMPLE_MAX * SUPERSAMPLE_MAX][4][2];
+};
+
+static struct stress_supersample stress_supersample = { 1 };
+
+/*
+ * Before limare_state_setup, so that the AUX memory can grow to hold the
+ * tiles.
+ */
+static void
+supersample_init(struct limare_state *state)
+{
+	const char *env = getenv("LIMA_STRESS_SUPERSAMPLE");
+	struct limare_fb *fb = state->fb;
+	int factor, size;
+
+	if (!env || !*env)
+		return;
+
+	factor = atoi(env);
+	if ((factor < 1) || (factor > SUPERSAMPLE_MAX)) {
+		printf("LIMA_STRESS_SUPERSAMPLE=%s is not in between 1 and %d\n",
+		       env, SUPERSAMPLE_MAX);
+		return;
+	}
+
+	size = ALIGN(ALIGN(fb->width, 16) * ALIGN(fb->height, 16) *
+		     (fb->bpp / 8), 0x400);
+	if (limare_aux_grow(state, factor * factor * size)) {
+		printf("No room for %dx%d supersampling, rendering without.\n",
+		       factor, factor);
+		return;
+	}
+
+	stress_supersample.factor = factor;
+}
+
+/*
+ * Tile x, y, counting from the top left, then covers the whole target.
+ */
+static void
+supersample_tile_matrix(int factor, int x, int y)
+{
+	esMatrixLoadIdentity(&stress_tile);
+	stress_tile.m[0][0] = factor;
+	stress_tile.m[1][1] = factor;
+	stress_tile.m[3][0] = factor - 1 - 2 * x;
+	stress_tile.m[3][1] = 1 - factor + 2 * y;
+}
+
+static int
+supersample_setup(struct limare_state *state, int program, int width,
+		  int height)
+{
+	struct stress_supersample *supersample = &stress_supersample;
+	int factor = supersample->factor;
+	int format, x, y, i;
+	void *pixels;
 
-#include "esUtil.h"
-#include "cube_mesh.h"
-#include "companion.h"
+	if (state->fb->bpp == 16)
+		format = LIMA_TEXEL_FORMAT_BGR_565;
+	else
+		format = LIMA_TEXEL_FORMAT_RGBA_8888;
+
+	pixels = calloc(width * height, 4);
+	if (!pixels)
+		return -1;
+
+	for (i = 0; i < (factor * factor); i++) {
+		supersample->tiles[i] =
+			limare_texture_upload(state, pixels, width, height,
+					      format, 0);
+		if (supersample->tiles[i] < 0) {
+			free(pixels);
+			return -1;
+		}
+	}
+
+	free(pixels);
+
+	/* the resolve quads, laid out like the tiles. */
+	for (y = 0, i = 0; y < factor; y++) {
+		for (x = 0; x < factor; x++, i++) {
+			float left = -1.0 + 2.0 * x / factor;
+			float right = -1.0 + 2.0 * (x + 1) / factor;
+			float top = 1.0 - 2.0 * y / factor;
+			float bottom = 1.0 - 2.0 * (y + 1) / factor;
+
+			memcpy(supersample->vertices[i], quad_vertices,
+			       sizeof(quad_vertices));
+			supersample->vertices[i][0][0] = left;
+			supersample->vertices[i][0][1] = bottom;
+			supersample->vertices[i][1][0] = right;
+			supersample->vertices[i][1][1] = bottom;
+			supersample->vertices[i][2][0] = left;
+			supersample->vertices[i][2][1] = top;
+			supersample->vertices[i][3][0] = right;
+			supersample->vertices[i][3][1] = top;
+
+			memcpy(supersample->coords[i], fill_texture_coordinates,
+			       sizeof(fill_texture_coordinates));
+		}
+	}
+
+	supersample->program = program;
+
+	limare_attribute_pointer(state, "in_position", LIMARE_ATTRIB_FLOAT,
+				 3, 0, 4 * factor * factor,
+				 supersample->vertices);
+	limare_attribute_pointer(state, "in_coord", LIMARE_ATTRIB_FLOAT,
+				 2, 0, 4 * factor * factor,
+				 supersample->coords);
+
+	supersample->sampler = limare_uniform_location(state, "in_texture");
+	if (supersample->sampler < 0)
+		return -1;
 
-int textured_cube_main(void)
+	ESMatrix modelviewprojection;
+
+	esMatrixLoadIdentity(&modelviewprojection);
+	esTranslate(&modelviewprojection, 0.0, 0.0, -0.5);
+
+	return limare_uniform_attach(state, "modelviewprojectionMatrix", 16,
+				     &modelviewprojection.m[0][0]);
+}
+
+/*
+ * Draw all the tiles of the frame into the fb, with the resolve program.
+ */
+static int
+supersample_resolve(struct limare_state *state, int program)
 {
-	struct limare_state *state;
+	struct stress_supersample *supersample = &stress_supersample;
+	int i, ret;
+
+	limare_render_target(state, 0);
+	limare_program_current(state, supersample->program);
+
+	limare_frame_new(state);
+
+	for (i = 0; i < (supersample->factor * supersample->factor); i++) {
+		limare_texture_attach_location(state, supersample->sampler,
+					       supersample->tiles[i]);
+
+		ret = limare_draw_arrays(state, GL_TRIANGLE_STRIP, 4 * i, 4);
+		if (ret)
+			return ret;
+	}
+
+	ret = limare_frame_flush(state);
+	if (ret)
+		return ret;
+
+	limare_buffer_swap(state);
+
+	limare_program_current(state, program);
+
+	return 0;
+}
+
+static double
+stress_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/*
+ * Frame verification: with LIMA_STRESS_VERIFY=N, the scene is frozen so
+ * that every frame is identical, and every Nth frame is checksummed on
+ * the render thread, straight from the framebuffer. The first checksum
+ * seen on two checked frames in a row becomes the golden one, later
+ * frames have to match it.
+ *
+ * With LIMA_STRESS_VERIFY_DUMP=PREFIX, the golden frame and the first
+ * VERIFY_DUMP_MAX bad ones also get saved as PREFIX-<frame>.bmp, from a
+ * background thread, so that the frames keep coming at the same rate.
+ */
+#define VERIFY_DUMP_MAX 16
+
+struct stress_verify {
+	int interval;
+	int row_size;
+	int height;
+	int pitch;
+
+	const char *dump_prefix;
+	int dumps;
+
+	uint32_t golden;
+	uint32_t candidate;
+	int have_golden;
+	int have_candidate;
+
+	int mismatches;
+};
+
+static struct stress_verify stress_verify;
+
+#define VERIFY_PRIME 0x01000193
+
+/*
+ * Four independent multiply/xor lanes over the words, so that the whole
+ * thing maps onto neon directly. Both versions give the same result.
+ */
+static void
+verify_checksum_row(uint32_t *lanes, const uint32_t *words, int count)
+{
+	int i = 0;
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+	uint32x4_t hash = vld1q_u32(lanes);
+	uint32x4_t prime = vdupq_n_u32(VERIFY_PRIME);
+
+	for (; (i + 4) <= count; i += 4)
+		hash = vmulq_u32(veorq_u32(hash, vld1q_u32(words + i)), prime);
+
+	vst1q_u32(lanes, hash);
+#else
+	for (; (i + 4) <= count; i += 4) {
+		lanes[0] = (lanes[0] ^ words[i + 0]) * VERIFY_PRIME;
+		lanes[1] = (lanes[1] ^ words[i + 1]) * VERIFY_PRIME;
+		lanes[2] = (lanes[2] ^ words[i + 2]) * VERIFY_PRIME;
+		lanes[3] = (lanes[3] ^ words[i + 3]) * VERIFY_PRIME;
+	}
+#endif
+
+	for (; i < count; i++)
+		lanes[i & 3] = (lanes[i & 3] ^ words[i]) * VERIFY_PRIME;
+}
+
+static uint32_t
+verify_checksum(const void *pixels, int row_size, int height, int pitch)
+{
+	uint32_t lanes[4] = { 0x811C9DC5, 0x811C9DC5, 0x811C9DC5, 0x811C9DC5 };
+	int y;
+
+	for (y = 0; y < height; y++)
+		verify_checksum_row(lanes, pixels + y * pitch, row_size / 4);
+
+	return lanes[0] ^ (lanes[1] * 3) ^ (lanes[2] * 5) ^ (lanes[3] * 7);
+}
+
+static void
+verify_dump(struct stress_verify *verify, const void *pixels, int id)
+{
+	char filename[256];
+
+	if (!verify->dump_prefix || (verify->dumps >= VERIFY_DUMP_MAX))
+		return;
+
+	snprintf(filename, sizeof(filename), "%s-%d.bmp", verify->dump_prefix,
+		 id);
+	if (!bmp_dump_async(pixels, verify->row_size / 4, verify->height,
+			    verify->pitch, filename))
+		verify->dumps++;
+}
+
+static void
+verify_frame_done(struct limare_state *state, struct limare_frame *frame,
+		  const void *pixels, void *data)
+{
+	struct stress_verify *verify = data;
+	uint32_t checksum;
+
+#ifdef MEMTESTER_MODE
+	/* the background now pulses, so the frames no longer match. */
+	if (memtester_has_found_errors)
+		return;
+#endif
+
+	if (frame->id % verify->interval)
+		return;
+
+	checksum = verify_checksum(pixels, verify->row_size, verify->height,
+				   verify->pitch);
+
+	if (!verify->have_golden) {
+		if (verify->have_candidate && (checksum == verify->candidate)) {
+			verify->golden = checksum;
+			verify->have_golden = 1;
+			printf("lima: verifying frames against checksum "
+			       "0x%08X\n", checksum);
+			verify_dump(verify, pixels, frame->id);
+		} else {
+			verify->candidate = checksum;
+			verify->have_candidate = 1;
+		}
+		return;
+	}
+
+	if (checksum != verify->golden) {
+		verify->mismatches++;
+		printf("lima: frame %d checksum 0x%08X != 0x%08X (%d bad "
+		       "frames)\n", frame->id, checksum, verify->golden,
+		       verify->mismatches);
+		verify_dump(verify, pixels, frame->id);
+#ifdef MEMTESTER_MODE
+		memtester_has_found_errors = 1;
+#endif
+	}
+}
+
+static void
+verify_setup(struct limare_state *state, int width, int height)
+{
+	const char *env = getenv("LIMA_STRESS_VERIFY");
+	struct limare_fb *fb = state->fb;
+
+	if (!env || (atoi(env) <= 0))
+		return;
+
+	stress_verify.interval = atoi(env);
+	stress_verify.row_size = width * (fb->bpp / 8);
+	stress_verify.height = height;
+	stress_verify.pitch = fb->width * (fb->bpp / 8);
+
+	/* the bmp writer only does 32bpp. */
+	if (fb->bpp == 32)
+		stress_verify.dump_prefix = getenv("LIMA_STRESS_VERIFY_DUMP");
+}
+
+/*
+ * Frame heartbeat: the time between two frames reaching the screen goes
+ * into a histogram of HEARTBEAT_BUCKET ms wide buckets, for the frame
+ * time statistics of the periodic report. A watchdog thread flags a
+ * stall when no frame completes for LIMA_STALL_TIMEOUT seconds, which a
+ * hanging gpu would otherwise only show as a frozen cube.
+ */
+#define HEARTBEAT_BUCKET 0.5
+#define HEARTBEAT_BUCKETS 2000
+#define HEARTBEAT_TIMEOUT 10
+
+struct stress_heartbeat {
+	double timeout;
+	double last; /* only touched through __atomic */
+
+	unsigned int buckets[HEARTBEAT_BUCKETS];
+	unsigned int frames;
+	double sum_ms;
+	double max_ms;
+
+	int stalls;
+};
+
+static struct stress_heartbeat stress_heartbeat;
+
+/* of the last periodic report */
+static double stress_fps;
+
+/*
+ * Readiness: 1 once the first frame reached the screen, -1 when the setup
+ * failed, so that the memtester only gets going once the gpu is busy.
+ */
+static pthread_mutex_t stress_ready_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stress_ready_cond = PTHREAD_COND_INITIALIZER;
+static int stress_ready;
+
+static void
+stress_ready_set(int ready)
+{
+	pthread_mutex_lock(&stress_ready_mutex);
+	if (!stress_ready) {
+		stress_ready = ready;
+		pthread_cond_broadcast(&stress_ready_cond);
+	}
+	pthread_mutex_unlock(&stress_ready_mutex);
+}
+
+/*
+ * Waits up to timeout seconds for textured_cube_main() to get its first
+ * frame out. Returns 1 when it did, 0 on timeout and -1 when it failed.
+ */
+int textured_cube_wait_ready(double timeout)
+{
+	struct timespec ts;
 	int ret;
 
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += (time_t) timeout;
+	ts.tv_nsec += (timeout - (time_t) timeout) * 1000000000.0;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&stress_ready_mutex);
+	while (!stress_ready)
+		if (pthread_cond_timedwait(&stress_ready_cond,
+					   &stress_ready_mutex, &ts))
+			break;
+	ret = stress_ready;
+	pthread_mutex_unlock(&stress_ready_mutex);
+
+	return ret;
+}
+
+static void
+heartbeat_frame_done(struct limare_state *state, struct limare_frame *frame,
+		     const void *pixels, void *data)
+{
+	struct stress_heartbeat *heartbeat = data;
+	double now = stress_time(), last, ms;
+	int bucket;
+
+	__atomic_exchange(&heartbeat->last, &now, &last, __ATOMIC_RELAXED);
+	ms = (now - last) * 1000.0;
+	bucket = ms / HEARTBEAT_BUCKET;
+	if (bucket >= HEARTBEAT_BUCKETS)
+		bucket = HEARTBEAT_BUCKETS - 1;
+	heartbeat->buckets[bucket]++;
+	heartbeat->frames++;
+	heartbeat->sum_ms += ms;
+	if (ms > heartbeat->max_ms)
+		heartbeat->max_ms = ms;
+
+	if (heartbeat->frames == 1)
+		stress_ready_set(1);
+
+	if (stress_verify.interval)
+		verify_frame_done(state, frame, pixels, &stress_verify);
+}
+
+static void *
+heartbeat_thread(void *data)
+{
+	struct stress_heartbeat *heartbeat = data;
+	double now, last, stalled = 0;
+
+	while (1) {
+		sleep(1);
+		now = stress_time();
+		__atomic_load(&heartbeat->last, &last, __ATOMIC_RELAXED);
+
+		if ((now - last) < heartbeat->timeout) {
+			if (stalled) {
+				printf("lima: frames are coming again, after "
+				       "%.1f s\n", now - stalled);
+				stalled = 0;
+			}
+			continue;
+		}
+		if (stalled)
+			continue;
+
+		stalled = last;
+		heartbeat->stalls++;
+		printf("lima: no frame for %.1f s, the gpu has stalled\n",
+		       now - last);
+#ifdef MEMTESTER_MODE
+		memtester_gpu_stall(now - last);
+#endif
+		fflush(stdout);
+	}
+
+	return NULL;
+}
+
+/* The frame time of the given fraction of the frames, from the histogram */
+static double
+heartbeat_percentile(const struct stress_heartbeat *heartbeat,
+		     double fraction)
+{
+	unsigned int count = 0;
+	int i;
+
+	for (i = 0; i < HEARTBEAT_BUCKETS; i++) {
+		count += heartbeat->buckets[i];
+		if (count >= heartbeat->frames * fraction)
+			break;
+	}
+	return (i + 0.5) * HEARTBEAT_BUCKET;
+}
+
+static void
+heartbeat_report(const char *name, struct stress_heartbeat *heartbeat)
+{
+	if (!heartbeat->frames)
+		return;
+	printf("%s: %.1f ms average frame time, %.1f/%.1f ms at the 50/99th "
+	       "percentile, %.1f ms max\n", name,
+	       heartbeat->sum_ms / heartbeat->frames,
+	       heartbeat_percentile(heartbeat, 0.5),
+	       heartbeat_percentile(heartbeat, 0.99), heartbeat->max_ms);
+}
+
+/* The stalls so far, which count as gpu failures */
+int
+textured_cube_stalls(void)
+{
+	return stress_heartbeat.stalls;
+}
+
+/* The frames, for the status segment, with the stalls as the errors */
+void
+textured_cube_status(status_t *status, void *data)
+{
+	snprintf(status->state, sizeof(status->state), "%s",
+		 stress_profile_name ? stress_profile_name : "starting");
+	status->progress = stress_heartbeat.frames;
+	status->bytes = stress_bytes;
+	status->errors = stress_heartbeat.stalls + stress_verify.mismatches;
+}
+
+/*
+ * The frame statistics in the Prometheus text format, for the metrics
+ * listener. They are read while the frames keep coming, without a lock.
+ */
+void
+textured_cube_metrics(FILE *f, void *data)
+{
+	struct stress_heartbeat *heartbeat = &stress_heartbeat;
+	static const double quantiles[] = { 0.5, 0.9, 0.99 };
+	int i;
+
+	fprintf(f, "# HELP lima_frames_total Frames that reached the screen\n"
+		"# TYPE lima_frames_total counter\nlima_frames_total %u\n",
+		heartbeat->frames);
+	fprintf(f, "# HELP lima_fps Frame rate of the last report\n"
+		"# TYPE lima_fps gauge\nlima_fps %.1f\n", stress_fps);
+	fprintf(f, "# HELP lima_gpu_stalls_total Times no frame came for "
+		"LIMA_STALL_TIMEOUT\n# TYPE lima_gpu_stalls_total counter\n"
+		"lima_gpu_stalls_total %d\n", heartbeat->stalls);
+	if (!heartbeat->frames)
+		return;
+	fprintf(f, "# HELP lima_frame_time_ms Time between two frames\n"
+		"# TYPE lima_frame_time_ms summary\n");
+	for (i = 0; i < (int)(sizeof(quantiles) / sizeof(quantiles[0])); i++)
+		fprintf(f, "lima_frame_time_ms{quantile=\"%g\"} %.1f\n",
+			quantiles[i], heartbeat_percentile(heartbeat,
+							   quantiles[i]));
+	fprintf(f, "lima_frame_time_ms_sum %.1f\nlima_frame_time_ms_count %u\n",
+		heartbeat->sum_ms, heartbeat->frames);
+	fprintf(f, "# HELP lima_frame_time_max_ms Longest time between two "
+		"frames\n# TYPE lima_frame_time_max_ms gauge\n"
+		"lima_frame_time_max_ms %.1f\n", heartbeat->max_ms);
+}
+
+static void
+heartbeat_setup(struct limare_state *state)
+{
+	const char *env = getenv("LIMA_STALL_TIMEOUT");
+	double now = stress_time();
+	pthread_t thread;
+
+	stress_heartbeat.timeout = env ? atof(env) : HEARTBEAT_TIMEOUT;
+	__atomic_store(&stress_heartbeat.last, &now, __ATOMIC_RELAXED);
+	limare_frame_done_callback(state, heartbeat_frame_done,
+				   &stress_heartbeat);
+
+	/* 0 only keeps the statistics */
+	if (stress_heartbeat.timeout > 0)
+		pthread_create(&thread, NULL, heartbeat_thread,
+			       &stress_heartbeat);
+}
+
+#define STRESS_REPORT_INTERVAL 5.0
+#ifdef MEMTESTER_MODE
+/* only report once, so that we do not garble the memtester output. */
+#define STRESS_REPORT_ONCE 1
+#else
+#define STRESS_REPORT_ONCE 0
+#endif
+
+/*
+ * A linked program which draws with a single texture, and which becomes
+ * the current one.
+ */
+static int
+stress_program_new(struct limare_state *state)
+{
 #ifndef HAVE_NO_LIBMALI_BLOB
 	const char *vertex_shader_source =
 		"uniform mat4 modelviewprojectionMatrix;\n"
@@ -64,54 +1625,111 @@ int textured_cube_main(void)
 	#include "shader_f.h"
 #endif
 
+	int program = limare_program_new(state);
+#ifndef HAVE_NO_LIBMALI_BLOB
+	vertex_shader_attach(state, program, vertex_shader_source);
+	fragment_shader_attach(state, program, fragment_shader_source);
+#else
+	vertex_shader_attach_mbs_stream(state, program, vertex_shader_binary,
+						sizeof(vertex_shader_binary));
+	fragment_shader_attach_mbs_stream(state, program, fragment_shader_binary,
+						sizeof(fragment_shader_binary));
+#endif
+
+	if (limare_link(state))
+		return -1;
+
+	return program;
+}
+
+static int textured_cube_run(const char *profile_name)
+{
+	struct limare_state *state;
+	struct stress_profile *profile;
+	int ret;
+
+	if (!profile_name)
+		profile_name = getenv("LIMA_STRESS_PROFILE");
+	profile = stress_profile_find(profile_name);
+	stress_profile_name = profile->name;
+
 	state = limare_init();
 	if (!state)
 		return -1;
 
 	//limare_buffer_clear(state);
 
+	supersample_init(state);
+
 	ret = limare_state_setup(state, 0, 0, 0xFF505050);
 	if (ret)
 		return ret;
 
 	int width, height;
 	limare_buffer_size(state, &width, &height);
-	float aspect = (float) height / width;
+	stress_aspect = (float) height / width;
 
-	limare_enable(state, GL_DEPTH_TEST);
-	limare_enable(state, GL_CULL_FACE);
-	limare_depth_mask(state, 1);
+	int factor = stress_supersample.factor;
+	int program, tile;
 
-	int program = limare_program_new(state);
-#ifndef HAVE_NO_LIBMALI_BLOB
-	vertex_shader_attach(state, program, vertex_shader_source);
-	fragment_shader_attach(state, program, fragment_shader_source);
-#else
-	vertex_shader_attach_mbs_stream(state, program, vertex_shader_binary,
-						sizeof(vertex_shader_binary));
-	fragment_shader_attach_mbs_stream(state, program, fragment_shader_binary,
-						sizeof(fragment_shader_binary));
-#endif
+	if (factor > 1) {
+		program = stress_program_new(state);
+		if (program < 0)
+			return program;
+
+		ret = supersample_setup(state, program, width, height);
+		if (ret)
+			return ret;
+	}
 
-	limare_link(state);
+	program = stress_program_new(state);
+	if (program < 0)
+		return program;
 
-	limare_attribute_pointer(state, "in_position", LIMARE_ATTRIB_FLOAT,
-				 3, 0, CUBE_VERTEX_COUNT, cube_vertices);
-	limare_attribute_pointer(state, "in_coord", LIMARE_ATTRIB_FLOAT,
-				 2, 0, CUBE_VERTEX_COUNT,
-				 cube_texture_coordinates);
+	stress_mvp = limare_uniform_location(state,
+					     "modelviewprojectionMatrix");
+	if (stress_mvp < 0)
+		return -1;
 
-	int texture = limare_texture_upload(state, companion_texture_flat,
-					    COMPANION_TEXTURE_WIDTH,
-					    COMPANION_TEXTURE_HEIGHT,
-					    COMPANION_TEXTURE_FORMAT, 0);
-	limare_texture_attach(state, "in_texture", texture);
+	esMatrixLoadIdentity(&stress_tile);
 
+	/* the supersampling tiles cover the whole screen anyway. */
+	stress_damage = profile->damage && (factor == 1);
+
+	ret = profile->setup(state, width, height);
+	if (ret)
+		return ret;
+
+	verify_setup(state, width, height);
+	heartbeat_setup(state);
+
+	double fb_bytes = (double) width * height * (state->fb->bpp / 8);
+
+	/* every tile gets written once, and read back by the resolve. */
+	if (factor > 1) {
+		stress_frame_bytes *= factor * factor;
+		stress_frame_bytes += 2 * factor * factor * fb_bytes;
+	}
+
+	double report_time = stress_time();
+	unsigned long long bus_total = 0;
+	int report_frames = 0, reported = 0;
 	int i = 0;
 
+	limare_job_counters_enable(state, 1);
+
+	/*
+	 * The profiles only change their uniforms from frame to frame, so
+	 * every frame slot gets built once, and replayed after that. With
+	 * the tiles and the resolve, the slots no longer see the same frame
+	 * each time round. A replay would also keep the scissor of the frame
+	 * it recorded.
+	 */
+	if ((factor == 1) && !stress_damage)
+		limare_command_list_begin(state);
+
 	while (1) {
 #ifdef MEMTESTER_MODE
-		extern int memtester_has_found_errors;
 		if (memtester_has_found_errors) {
 			state->clear_color = 0xFF000040 + abs((i * 1) %
 					((255 - 0x40) * 2) - (255 - 0x40));
@@ -121,43 +1739,96 @@ int textured_cube_main(void)
 		if (i == 0xFFFFFFF)
 			i = 0;
 
-		float angle = 0.5 * i;
+		for (tile = 0; tile < (factor * factor); tile++) {
+			if (factor > 1) {
+				supersample_tile_matrix(factor, tile % factor,
+							tile / factor);
+				limare_render_target(state,
+					stress_supersample.tiles[tile]);
+			}
 
-		ESMatrix modelview;
-		esMatrixLoadIdentity(&modelview);
-		esTranslate(&modelview, 0.0, 0.0, -4.0);
-		esRotate(&modelview, angle * 0.97, 1.0, 0.0, 0.0);
-		esRotate(&modelview, angle * 1.13, 0.0, 1.0, 0.0);
-		esRotate(&modelview, angle * 0.73, 0.0, 0.0, 1.0);
+			limare_frame_new(state);
 
-		ESMatrix projection;
-		esMatrixLoadIdentity(&projection);
-		esFrustum(&projection, -1.0, +1.0, -1.0 * aspect, +1.0 * aspect,
-			  1.0, 10.0);
+			/* a frozen scene renders the same frame every time. */
+			ret = profile->draw(state,
+					    stress_verify.interval ? 0 : i);
+			if (ret)
+				return ret;
 
-		ESMatrix modelviewprojection;
-		esMatrixLoadIdentity(&modelviewprojection);
-		esMatrixMultiply(&modelviewprojection, &modelview, &projection);
+			ret = limare_frame_flush(state);
+			if (ret)
+				return ret;
 
-		limare_uniform_attach(state, "modelviewprojectionMatrix", 16,
-				      &modelviewprojection.m[0][0]);
+			limare_buffer_swap(state);
+		}
 
-		limare_frame_new(state);
+		if (factor > 1) {
+			ret = supersample_resolve(state, program);
+			if (ret)
+				return ret;
+		}
 
-		ret = limare_draw_elements(state, GL_TRIANGLES,
-					   CUBE_INDEX_COUNT, &cube_indices,
-					   GL_UNSIGNED_BYTE);
-		if (ret)
-			return ret;
+		report_frames++;
+		stress_bytes += fb_bytes * stress_fb_fraction +
+			stress_frame_bytes;
+		if (!STRESS_REPORT_ONCE || !reported) {
+			double now = stress_time();
 
-		ret = limare_frame_flush(state);
-		if (ret)
-			return ret;
+			if ((now - report_time) >= STRESS_REPORT_INTERVAL) {
+				struct limare_job_stats stats;
+				unsigned long long read, write;
+				double fps = report_frames / (now - report_time);
+
+				stress_fps = fps;
+
+				printf("lima %s: %.1f fps, %.1f MB/s\n",
+				       profile->name, fps, fps *
+				       (fb_bytes * stress_fb_fraction +
+					stress_frame_bytes) / 1e6);
+
+				/* what the gpu counters saw instead. */
+				if (!limare_job_bus_bytes(state, &read, &write)) {
+					printf("lima %s: %.1f MB/s measured\n",
+					       profile->name, (read + write -
+					       bus_total) / (now - report_time) /
+					       1e6);
+					bus_total = read + write;
+				}
+
+				char name[64];
+
+				snprintf(name, sizeof(name), "lima %s",
+					 profile->name);
+
+				/* is the gpu busy, or waiting for us? */
+				if (!limare_job_stats_get(state, &stats, 1))
+					limare_job_stats_print(name, &stats);
+
+				heartbeat_report(name, &stress_heartbeat);
 
-		limare_buffer_swap(state);
+				report_time = now;
+				report_frames = 0;
+				reported = 1;
+			}
+		}
 	}
 
 	limare_finish(state);
 
 	return 0;
 }
+
+/*
+ * Render the stress profile until something fails. The profile is given
+ * by name, or taken from the LIMA_STRESS_PROFILE environment variable
+ * when NULL.
+ */
+int textured_cube_main(const char *profile_name)
+{
+	int ret = textured_cube_run(profile_name);
+
+	/* it only comes back on failure, do not leave anyone waiting. */
+	stress_ready_set(-1);
+
+	return ret;
+}
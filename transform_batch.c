@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Batched versions of the esTransform.c matrix operations, for scenes which
+ * set up hundreds of objects per frame. The rows of an ESMatrix are four
+ * floats each, and all of the operations boil down to scaling rows and
+ * adding them up, which NEON does a row at a time. The shared matrix of a
+ * multiply stays in registers over the whole batch.
+ */
+
+#include <math.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "transform_batch.h"
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+
+typedef float32x4_t transform_row;
+
+#define row_load(p) vld1q_f32(p)
+#define row_store(p, row) vst1q_f32(p, row)
+#define row_scale(row, s) vmulq_n_f32(row, s)
+#define row_add_scaled(sum, row, s) vmlaq_n_f32(sum, row, s)
+
+#else
+
+typedef struct {
+	float v[4];
+} transform_row;
+
+static inline transform_row
+row_load(const float *p)
+{
+	transform_row row = {{ p[0], p[1], p[2], p[3] }};
+
+	return row;
+}
+
+static inline void
+row_store(float *p, transform_row row)
+{
+	p[0] = row.v[0];
+	p[1] = row.v[1];
+	p[2] = row.v[2];
+	p[3] = row.v[3];
+}
+
+static inline transform_row
+row_scale(transform_row row, float s)
+{
+	transform_row result = {{ row.v[0] * s, row.v[1] * s,
+				  row.v[2] * s, row.v[3] * s }};
+
+	return result;
+}
+
+static inline transform_row
+row_add_scaled(transform_row sum, transform_row row, float s)
+{
+	transform_row result = {{ sum.v[0] + row.v[0] * s,
+				  sum.v[1] + row.v[1] * s,
+				  sum.v[2] + row.v[2] * s,
+				  sum.v[3] + row.v[3] * s }};
+
+	return result;
+}
+
+#endif
+
+void
+transform_batch_identity(ESMatrix *matrices, int count)
+{
+	static const float identity[4][4] = {
+		{ 1.0, 0.0, 0.0, 0.0 },
+		{ 0.0, 1.0, 0.0, 0.0 },
+		{ 0.0, 0.0, 1.0, 0.0 },
+		{ 0.0, 0.0, 0.0, 1.0 },
+	};
+	transform_row row0 = row_load(identity[0]);
+	transform_row row1 = row_load(identity[1]);
+	transform_row row2 = row_load(identity[2]);
+	transform_row row3 = row_load(identity[3]);
+	int i;
+
+	for (i = 0; i < count; i++) {
+		row_store(matrices[i].m[0], row0);
+		row_store(matrices[i].m[1], row1);
+		row_store(matrices[i].m[2], row2);
+		row_store(matrices[i].m[3], row3);
+	}
+}
+
+/* esTranslate, by a different offset for each matrix. */
+void
+transform_batch_translate(ESMatrix *matrices, float (*offsets)[3], int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		float *m = matrices[i].m[0];
+		transform_row row3 = row_load(m + 12);
+
+		row3 = row_add_scaled(row3, row_load(m + 0), offsets[i][0]);
+		row3 = row_add_scaled(row3, row_load(m + 4), offsets[i][1]);
+		row3 = row_add_scaled(row3, row_load(m + 8), offsets[i][2]);
+
+		row_store(m + 12, row3);
+	}
+}
+
+/* esRotate, by a different angle in degrees for each matrix. */
+void
+transform_batch_rotate(ESMatrix *matrices, float *angles,
+		       float x, float y, float z, int count)
+{
+	float mag = sqrtf(x * x + y * y + z * z);
+	float xx, yy, zz, xy, yz, zx;
+	int i;
+
+	if (mag <= 0.0)
+		return;
+
+	x /= mag;
+	y /= mag;
+	z /= mag;
+
+	xx = x * x;
+	yy = y * y;
+	zz = z * z;
+	xy = x * y;
+	yz = y * z;
+	zx = z * x;
+
+	for (i = 0; i < count; i++) {
+		float *m = matrices[i].m[0];
+		float s = sinf(angles[i] * M_PI / 180.0);
+		float c = cosf(angles[i] * M_PI / 180.0);
+		float t = 1.0 - c;
+		transform_row row0 = row_load(m + 0);
+		transform_row row1 = row_load(m + 4);
+		transform_row row2 = row_load(m + 8);
+		transform_row result;
+
+		/* the rotation matrix goes on the left, as with esRotate */
+		result = row_scale(row0, t * xx + c);
+		result = row_add_scaled(result, row1, t * xy - z * s);
+		result = row_add_scaled(result, row2, t * zx + y * s);
+		row_store(m + 0, result);
+
+		result = row_scale(row0, t * xy + z * s);
+		result = row_add_scaled(result, row1, t * yy + c);
+		result = row_add_scaled(result, row2, t * yz - x * s);
+		row_store(m + 4, result);
+
+		result = row_scale(row0, t * zx - y * s);
+		result = row_add_scaled(result, row1, t * yz + x * s);
+		result = row_add_scaled(result, row2, t * zz + c);
+		row_store(m + 8, result);
+	}
+}
+
+/*
+ * result[i] = matrices[i] * shared, in the order of esMatrixMultiply, so
+ * a modelview times the projection. result can be matrices.
+ */
+void
+transform_batch_multiply(ESMatrix *result, ESMatrix *matrices,
+			 ESMatrix *shared, int count)
+{
+	transform_row b0 = row_load(shared->m[0]);
+	transform_row b1 = row_load(shared->m[1]);
+	transform_row b2 = row_load(shared->m[2]);
+	transform_row b3 = row_load(shared->m[3]);
+	int i, j;
+
+	for (i = 0; i < count; i++) {
+		float *a = matrices[i].m[0];
+		transform_row rows[4];
+
+		for (j = 0; j < 4; j++) {
+			rows[j] = row_scale(b0, a[4 * j + 0]);
+			rows[j] = row_add_scaled(rows[j], b1, a[4 * j + 1]);
+			rows[j] = row_add_scaled(rows[j], b2, a[4 * j + 2]);
+			rows[j] = row_add_scaled(rows[j], b3, a[4 * j + 3]);
+		}
+
+		for (j = 0; j < 4; j++)
+			row_store(result[i].m[j], rows[j]);
+	}
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2014 The lima-memtester contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef TRANSFORM_BATCH_H
+#define TRANSFORM_BATCH_H
+
+#include "esUtil.h"
+
+/*
+ * esTransform.c, over arrays of matrices. Each ESMatrix is the 16 floats
+ * which limare_uniform_attach takes for a mat4, so the results go straight
+ * to the gpu, one matrix per draw.
+ */
+void transform_batch_identity(ESMatrix *matrices, int count);
+void transform_batch_translate(ESMatrix *matrices, float (*offsets)[3],
+			       int count);
+void transform_batch_rotate(ESMatrix *matrices, float *angles,
+			    float x, float y, float z, int count);
+void transform_batch_multiply(ESMatrix *result, ESMatrix *matrices,
+			      ESMatrix *shared, int count);
+
+#endif